@@ -32,6 +32,12 @@ struct prom_dbh;
 int prom_db_init(pool *p);
 int prom_db_free(void);
 
+/* Note that every opened database provides the prom_slot_add() SQL function,
+ * for updating one counter within a blob of packed 64-bit counters, the
+ * prom_exemplar_set() function, for updating one slot's line within a text
+ * of exemplars, and the prom_now() function, for the current Unix time.
+ */
+
 /* Create/prepare the database (with the given schema name) at the given path */
 struct prom_dbh *prom_db_open(pool *p, const char *table_path,
   const char *schema_name);
@@ -74,6 +80,7 @@ int prom_db_bind_stmt(pool *p, struct prom_dbh *dbh, const char *stmt, int idx,
 #define PROM_DB_BIND_TYPE_DOUBLE	3
 #define PROM_DB_BIND_TYPE_TEXT		4
 #define PROM_DB_BIND_TYPE_NULL		5
+#define PROM_DB_BIND_TYPE_INT64		6
 
 /* Executes the given statement.  Assumes that the caller is not using a SELECT,
  * and/or is uninterested in the statement results.
@@ -85,6 +92,48 @@ int prom_db_exec_stmt(pool *p, struct prom_dbh *dbh, const char *stmt,
 array_header *prom_db_exec_prepared_stmt(pool *p, struct prom_dbh *dbh,
   const char *stmt, const char **errstr);
 
+/* Executes the given previously prepared INSERT/UPDATE/DELETE statement.
+ * Unlike prom_db_exec_prepared_stmt(), no (empty) result set is allocated;
+ * the pool is only used for the error string.
+ */
+int prom_db_exec_prepared_write(pool *p, struct prom_dbh *dbh,
+  const char *stmt, const char **errstr);
+
+/* Executes the given previously prepared statement, invoking `row_cb` for
+ * each result row; the row values are read using the typed accessors below.
+ * Returns the number of rows processed, or -1 on error, including when the
+ * callback returns -1.
+ */
+struct prom_db_row;
+int prom_db_exec_prepared_stmt_rows(pool *p, struct prom_dbh *dbh,
+  const char *stmt, int (*row_cb)(struct prom_db_row *row, void *user_data),
+  void *user_data, const char **errstr);
+
+/* Obtain the value of the given (zero-based) column of the current row.  The
+ * text and blob pointers are owned by SQLite, and are only valid until the
+ * row callback returns.
+ */
+int prom_db_row_get_int64(struct prom_db_row *row, int col, int64_t *val);
+int prom_db_row_get_double(struct prom_db_row *row, int col, double *val);
+const char *prom_db_row_get_text(struct prom_db_row *row, int col,
+  size_t *len);
+const void *prom_db_row_get_blob(struct prom_db_row *row, int col,
+  size_t *len);
+
+/* Cursors step through the results of the given SELECT statement, a row at
+ * a time, as the caller needs them; the statement is prepared for the cursor
+ * alone.  Each row is only valid until the next call to
+ * prom_db_cursor_next(), which returns NULL, with errno set to ENOENT, once
+ * there are no more rows (or EAGAIN if the database is busy).  Note that an
+ * open cursor holds a read lock on the database until it has returned all of
+ * its rows, or is closed; cursors must be closed before their handle.
+ */
+struct prom_db_cursor;
+struct prom_db_cursor *prom_db_cursor_open(pool *p, struct prom_dbh *dbh,
+  const char *stmt);
+struct prom_db_row *prom_db_cursor_next(struct prom_db_cursor *cursor);
+int prom_db_cursor_close(struct prom_db_cursor *cursor);
+
 /* Rebuild the named index. */
 int prom_db_reindex(pool *p, struct prom_dbh *dbh,
   const char *index_name, const char **errstr);
@@ -92,6 +141,33 @@ int prom_db_reindex(pool *p, struct prom_dbh *dbh,
 /* Obtain the ROWID for the last inserted row. */
 int prom_db_last_row_id(pool *p, struct prom_dbh *dbh, int64_t *row_id);
 
+/* Obtain the SQLite data version, which changes whenever any other
+ * connection commits changes to the database.
+ */
+int prom_db_get_data_version(pool *p, struct prom_dbh *dbh, int64_t *version);
+
+/* Obtain the database file's change counter, which changes whenever any
+ * connection, including this one, commits changes to the database.  Unlike
+ * the data version, it is the same for every connection to the database.
+ */
+int prom_db_get_change_counter(pool *p, struct prom_dbh *dbh,
+  uint32_t *counter);
+
+/* Limit the total time that any one statement waits on a busy database to
+ * the given budget, in microseconds, retrying with exponential backoff and
+ * jitter.  Statements which exceed the budget fail with EAGAIN.  With a
+ * budget, transactions are not used: each statement commits on its own.
+ * A budget of zero restores the default (blocking) retries.
+ */
+int prom_db_set_busy_budget(struct prom_dbh *dbh, unsigned long budget_usecs);
+
+/* Obtain the number of statements, executed using this handle, which found
+ * the database busy (SQLITE_BUSY), and the number of times that the busy
+ * handler slept, waiting for the database.
+ */
+int prom_db_get_busy_stats(struct prom_dbh *dbh, uint64_t *busy_errors,
+  uint64_t *busy_sleeps);
+
 /* Start a SQLite transaction. */
 int prom_db_begin_txn(pool *p, struct prom_dbh *dbh, const char **errstr);
 
@@ -27,11 +27,60 @@
 
 #include "mod_prometheus.h"
 #include "prometheus/registry.h"
+#include "prometheus/snapshot.h"
 
 struct prom_http;
 
+/* Default, and upper bound on, the maximum number of concurrent
+ * connections, per exporter process.
+ */
+#define PROM_HTTP_DEFAULT_MAX_CONNECTIONS	4
+#define PROM_HTTP_MAX_CONNECTIONS		1024
+
+/* Flags for prom_http_start. */
+#define PROM_HTTP_FL_SHARED_ADDR		0x001
+
+/* Starts the exporter, listening on the given address and handling up to
+ * `max_conns` concurrent connections (zero for the default).  Use the
+ * PROM_HTTP_FL_SHARED_ADDR flag when multiple exporter processes listen on
+ * the same address.
+ */
 struct prom_http *prom_http_start(pool *p, const pr_netaddr_t *addr,
-  struct prom_registry *registry, const char *username, const char *password);
+  struct prom_registry *registry, const char *username, const char *password,
+  unsigned int max_conns, int flags);
+
+/* Compression strategies for gzipped responses; these mirror zlib's. */
+#define PROM_HTTP_COMPRESS_STRATEGY_DEFAULT		0
+#define PROM_HTTP_COMPRESS_STRATEGY_FILTERED		1
+#define PROM_HTTP_COMPRESS_STRATEGY_HUFFMAN_ONLY	2
+#define PROM_HTTP_COMPRESS_STRATEGY_RLE			3
+#define PROM_HTTP_COMPRESS_STRATEGY_FIXED		4
+
+/* Sets the compression level (-1 for the zlib default, or 0-9) and strategy
+ * used for gzipped /metrics responses.
+ */
+int prom_http_set_compression(struct prom_http *http, int level,
+  int strategy);
+
+/* Serve /metrics requests from the snapshots published, by another process,
+ * to the given snapshot area, rather than rendering the registry when
+ * handling the request.  Until the first snapshot is published, the registry
+ * is rendered as usual.  A NULL snapshot disables this.
+ */
+int prom_http_set_snapshot(struct prom_http *http,
+  struct prom_snapshot *snapshot);
+
+/* Sets the ID, e.g. chosen by the parent process before forking, which
+ * prefixes our ETags.  Exporter workers sharing the same address must use
+ * the same ID, so that a conditional request sent to any of them matches
+ * the ETag given by another.  By default, the ID is derived from the PID.
+ */
+int prom_http_set_etag_id(struct prom_http *http, const char *etag_id);
+
+/* Arranges for the run loop to return once the process is no longer a
+ * child of the given parent process, i.e. once the parent has exited.
+ */
+int prom_http_set_parent(struct prom_http *http, pid_t parent_pid);
 
 /* This function will exit once the exporter finishes. */
 int prom_http_run_loop(pool *p, struct prom_http *http);
@@ -27,6 +27,8 @@
 
 #include "mod_prometheus.h"
 #include "prometheus/db.h"
+#include "prometheus/metric/buffer.h"
+#include "prometheus/metric/shm.h"
 
 struct prom_metric;
 
@@ -40,11 +42,92 @@ int prom_metric_add_gauge(struct prom_metric *metric, const char *suffix,
   const char *help_text);
 int prom_metric_add_histogram(struct prom_metric *metric, const char *suffix,
   const char *help_text, unsigned int bucket_count, ...);
+
+/* Adds a summary, reporting the given quantiles (as doubles, from 0.0 to
+ * 1.0) estimated from a bounded-memory quantile sketch of the observations.
+ */
+int prom_metric_add_summary(struct prom_metric *metric, const char *suffix,
+  const char *help_text, unsigned int quantile_count, ...);
+
+/* Adds native (sparse, exponential) buckets, of the given schema, to the
+ * metric's histogram.  A histogram added with no bucket bounds then has
+ * only native buckets.
+ */
+int prom_metric_set_native_histogram(struct prom_metric *metric, int schema);
+#define PROM_METRIC_NATIVE_SCHEMA_MIN	-4
+#define PROM_METRIC_NATIVE_SCHEMA_MAX	8
+
+/* Declares the names of the labels, in order, whose values are given to
+ * the prom_metric_*_values() functions.  A NULL value omits that label.
+ */
+int prom_metric_set_label_names(struct prom_metric *metric,
+  unsigned int label_count, ...);
+
 int prom_metric_set_dbh(struct prom_metric *metric, struct prom_dbh *dbh);
 
+/* Use the given shared memory datastore, rather than the database, for
+ * this metric's samples; summaries and native histogram buckets are always
+ * kept in the database.  A NULL `shm` reverts to using the database.
+ */
+int prom_metric_set_shm(struct prom_metric *metric,
+  struct prom_metric_shm *shm);
+
+/* Accumulate this metric's counter increments, gauge updates, and
+ * histogram/summary observations in the given buffer, rather than writing
+ * them immediately.  A NULL `buffer` reverts to immediate writes.
+ */
+int prom_metric_set_buffer(struct prom_metric *metric,
+  struct prom_metric_buffer *buffer);
+
+/* Defer this metric's counter increments and histogram/summary observations
+ * which find the database busy (see prom_db_set_busy_budget()) to the given
+ * buffer, rather than dropping them.  A NULL `buffer` reverts to dropping
+ * them.
+ */
+int prom_metric_set_deferred(struct prom_metric *metric,
+  struct prom_metric_buffer *buffer);
+
+/* Obtain the number of updates, made by this process, which found the
+ * database busy, and were deferred or dropped.
+ */
+int prom_metric_get_busy_counts(uint64_t *deferred, uint64_t *dropped);
+
+/* Records the given labels, e.g. the session ID or PID, as the exemplar of
+ * each histogram observation made by this process, allocated from the given
+ * pool.  Exemplars are kept per histogram bucket, for OpenMetrics scrapes,
+ * in the same update as the observation.  NULL `labels` stops recording
+ * exemplars.
+ */
+int prom_metric_set_exemplar_labels(pool *p, pr_table_t *labels);
+#define PROM_METRIC_EXEMPLAR_MAX_LABELS_LEN	128
+
+/* Sets the labels, e.g. "protocol", added to the samples updated by this
+ * process using the prom_metric_*_values() functions.  The labels are
+ * rendered here, once, rather than on every update; a label value given
+ * for the same name takes precedence.  NULL `labels` clears them.
+ */
+int prom_metric_set_base_labels(pool *p, pr_table_t *labels);
+
 /* Returns the metric name. */
 const char *prom_metric_get_name(struct prom_metric *metric);
 
+/* Returns the definition of the metric, i.e. its types, help texts, buckets,
+ * quantiles, and label names, as lines of tab-separated fields, e.g.:
+ *
+ *  metric\tlogin
+ *  counter\ttotal\tNumber of logins
+ *  histogram\tdelay_seconds\t0.1,1,5\tDelay before login
+ *  labels\tuser
+ *
+ * for recreating the metric elsewhere, e.g. when replaying recorded updates.
+ */
+const char *prom_metric_get_definition(pool *p,
+  const struct prom_metric *metric);
+
+/* Creates a metric, in the given database, from the given definition. */
+struct prom_metric *prom_metric_create_from_definition(pool *p,
+  const char *definition, struct prom_dbh *dbh);
+
 /* Decrement the specified metric by the given `decr`; applies to any
  * gauge records associated with this metric.
  */
@@ -61,8 +144,22 @@ int prom_metric_incr(pool *p, const struct prom_metric *metric, uint32_t incr,
 int prom_metric_incr_type(pool *p, const struct prom_metric *metric,
   uint32_t incr, pr_table_t *labels, int metric_type);
 
+/* Variants of the above, taking the values of the metric's declared labels
+ * (see prom_metric_set_label_names()), rather than a table.  The label text
+ * is rendered on the stack; nothing is allocated from the given pool, other
+ * than by the datastore for error messages and previously unseen label sets.
+ */
+int prom_metric_decr_values(pool *p, const struct prom_metric *metric,
+  uint32_t decr, const char **values);
+int prom_metric_incr_values(pool *p, const struct prom_metric *metric,
+  uint32_t incr, const char **values);
+int prom_metric_incr_type_values(pool *p, const struct prom_metric *metric,
+  uint32_t incr, const char **values, int metric_type);
+int prom_metric_observe_values(pool *p, const struct prom_metric *metric,
+  double val, const char **values);
+
 /* Observe the specified metric by the given `val`; apply to any
- * histogram records associated with this metric.
+ * histogram/summary records associated with this metric.
  */
 int prom_metric_observe(pool *p, const struct prom_metric *metric, double val,
   pr_table_t *labels);
@@ -74,19 +171,57 @@ int prom_metric_set(pool *p, const struct prom_metric *metric, uint32_t val,
   pr_table_t *labels);
 
 /* Returns the collected samples for this metric and type.  The `counts`
- * and `sums` arrays are used for histograms, to differentiate those samples
- * from the histogram bucket samples.
+ * and `sums` arrays are used for histograms and summaries, to differentiate
+ * those samples from the histogram bucket (or summary quantile) samples.
  */
 const array_header *prom_metric_get(pool *p, struct prom_metric *metric,
   int metric_type, const array_header **counts, const array_header **sums);
 #define PROM_METRIC_TYPE_COUNTER	1
 #define PROM_METRIC_TYPE_GAUGE		2
 #define PROM_METRIC_TYPE_HISTOGRAM	3
+#define PROM_METRIC_TYPE_SUMMARY	4
 
 /* Get the Prometheus exposition formatted text for the metric. */
 const char *prom_metric_get_text(pool *p, struct prom_metric *metric,
   const char *registry_name, size_t *textlen);
 
+/* Scans the samples of the given metrics (struct prom_metric pointers) in
+ * the given database, in a single query, a metric at a time, in order.  Each
+ * call to prom_metric_scan_next() returns the samples of the next metric,
+ * for use with prom_metric_get_text_with_samples().  The samples of metrics
+ * using shared memory are read from there, in a single pass, when opened.
+ */
+struct prom_metric_scan;
+struct prom_metric_scan *prom_metric_scan_open(pool *p, struct prom_dbh *dbh,
+  const array_header *metrics);
+pr_table_t *prom_metric_scan_next(pool *p, struct prom_metric_scan *scan);
+int prom_metric_scan_close(struct prom_metric_scan *scan);
+
+/* Get the Prometheus exposition formatted text for the metric, using the
+ * given samples rather than querying the database.
+ */
+const char *prom_metric_get_text_with_samples(pool *p,
+  struct prom_metric *metric, const char *registry_name, pr_table_t *samples,
+  size_t *textlen);
+
+/* Get the Prometheus protobuf exposition for the metric, as a
+ * length-delimited io.prometheus.client.MetricFamily message per type.
+ */
+const char *prom_metric_get_proto(pool *p, struct prom_metric *metric,
+  const char *registry_name, size_t *len);
+const char *prom_metric_get_proto_with_samples(pool *p,
+  struct prom_metric *metric, const char *registry_name, pr_table_t *samples,
+  size_t *len);
+
+/* Get the OpenMetrics text for the metric, including the "_created" time
+ * and unit of each family where known, and the histogram bucket exemplars.
+ */
+const char *prom_metric_get_openmetrics(pool *p, struct prom_metric *metric,
+  const char *registry_name, size_t *textlen);
+const char *prom_metric_get_openmetrics_with_samples(pool *p,
+  struct prom_metric *metric, const char *registry_name, pr_table_t *samples,
+  size_t *textlen);
+
 struct prom_dbh *prom_metric_init(pool *p, const char *tables_path);
 int prom_metric_free(pool *p, struct prom_dbh *dbh);
 
@@ -0,0 +1,77 @@
+/*
+ * ProFTPD - mod_prometheus metrics write-behind buffer API
+ * Copyright (c) 2021-2023 TJ Saunders
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+#ifndef MOD_PROMETHEUS_METRIC_BUFFER_H
+#define MOD_PROMETHEUS_METRIC_BUFFER_H
+
+#include "mod_prometheus.h"
+#include "prometheus/db.h"
+
+struct prom_metric_buffer;
+
+/* Creates a per-session buffer, which accumulates sample increments locally,
+ * keyed by metric ID and label text, until flushed to the given database.
+ */
+struct prom_metric_buffer *prom_metric_buffer_create(pool *p,
+  struct prom_dbh *dbh);
+int prom_metric_buffer_destroy(struct prom_metric_buffer *buffer);
+
+/* Accumulates a sample increment (or, if negative, decrement), e.g. of a
+ * counter or gauge.
+ */
+int prom_metric_buffer_add(pool *p, struct prom_metric_buffer *buffer,
+  int64_t metric_id, double sample_val, const char *sample_labels);
+
+/* Sets a sample's value, replacing any accumulated increments; any later
+ * increments are then applied to that value.
+ */
+int prom_metric_buffer_set(pool *p, struct prom_metric_buffer *buffer,
+  int64_t metric_id, double sample_val, const char *sample_labels);
+
+/* Accumulates one observation of a histogram, in the given bucket; see
+ * prom_metric_db_histogram_add().  Only the latest exemplar of each bucket
+ * is kept.
+ */
+int prom_metric_buffer_add_histogram(pool *p,
+  struct prom_metric_buffer *buffer, int64_t metric_id,
+  unsigned int bucket_idx, unsigned int bucket_count, double sum,
+  const char *sample_labels, const char *exemplar);
+
+/* Accumulates one observation of a summary, in the given sketch bin; see
+ * prom_metric_db_summary_add().
+ */
+int prom_metric_buffer_add_summary(pool *p, struct prom_metric_buffer *buffer,
+  int64_t metric_id, int bin_key, double sum, const char *sample_labels);
+
+/* Writes all of the accumulated samples to the database, and empties the
+ * buffer, except for any samples which found the database busy (EAGAIN).
+ * Note that the caller is responsible for wrapping this in a transaction, as
+ * appropriate.  Returns the number of samples written.
+ */
+int prom_metric_buffer_flush(pool *p, struct prom_metric_buffer *buffer);
+
+/* Returns the number of accumulated samples waiting to be flushed. */
+int prom_metric_buffer_count(struct prom_metric_buffer *buffer);
+
+#endif /* MOD_PROMETHEUS_METRIC_BUFFER_H */
@@ -27,12 +27,21 @@
 
 #include "mod_prometheus.h"
 #include "prometheus/db.h"
+#include "prometheus/metric/sketch.h"
 
 int prom_metric_db_close(pool *p, struct prom_dbh *dbh);
 struct prom_dbh *prom_metric_db_open(pool *p, const char *tables_path);
 struct prom_dbh *prom_metric_db_init(pool *p, const char *tables_path,
   int flags);
 
+/* Reopens the metrics database previously initialized via
+ * prom_metric_db_init(), without any checks; intended for use by sessions.
+ */
+struct prom_dbh *prom_metric_db_reopen(pool *p, const char *tables_path);
+
+/* Performs periodic maintenance (e.g. VACUUM) of the metrics database. */
+int prom_metric_db_maintain(pool *p, struct prom_dbh *dbh);
+
 int prom_metric_db_create(pool *p, struct prom_dbh *dbh,
   const char *metric_name, int metric_type, int64_t *metric_id);
 int prom_metric_db_exists(pool *p, struct prom_dbh *dbh,
@@ -49,4 +58,108 @@ int prom_metric_db_sample_set(pool *p, struct prom_dbh *dbh,
 const array_header *prom_metric_db_sample_get(pool *p, struct prom_dbh *dbh,
   int64_t metric_id);
 
+struct prom_metric_db_sample {
+  int64_t metric_id;
+  double sample_value;
+  const char *sample_labels;
+  size_t sample_labelslen;
+
+  /* The Unix time at which the sample was created, if known (else zero), and
+   * its exemplar text, if any, e.g. `{pid="123"} 0.5 1617813000.123`.
+   */
+  double created;
+  const char *exemplar;
+};
+
+/* Histograms are stored as one row per label set, holding the
+ * (non-cumulative) number of observations in each bucket, along with the
+ * total count and sum of those observations.  The latest exemplar of each
+ * bucket, if any, is kept in the same row; `bucket_exemplars` is NULL when
+ * there are none.
+ */
+struct prom_metric_db_histogram {
+  int64_t metric_id;
+  const char *sample_labels;
+  size_t sample_labelslen;
+  unsigned int bucket_count;
+  const double *bucket_counts;
+  double sample_count;
+  double sample_sum;
+  double created;
+  const char **bucket_exemplars;
+};
+
+/* Adds `count` observations, totalling `sum`, to the given (zero-based)
+ * bucket of the histogram, which has `bucket_count` buckets in all.  The
+ * `exemplar` text, if not NULL, replaces the bucket's exemplar, in the same
+ * update.
+ */
+int prom_metric_db_histogram_add(pool *p, struct prom_dbh *dbh,
+  int64_t metric_id, unsigned int bucket_idx, unsigned int bucket_count,
+  double count, double sum, const char *sample_labels, const char *exemplar);
+
+/* Returns the rows for the given histogram, as struct
+ * prom_metric_db_histogram elements ordered by labels.
+ */
+const array_header *prom_metric_db_histogram_get(pool *p,
+  struct prom_dbh *dbh, int64_t metric_id);
+
+/* Summaries are stored as one row per bin of their quantile sketch, per
+ * label set; the count and sum are the totals over those bins.
+ */
+struct prom_metric_db_summary {
+  int64_t metric_id;
+  const char *sample_labels;
+  size_t sample_labelslen;
+  unsigned int bin_count;
+  const struct prom_sketch_bin *bins;
+  double sample_count;
+  double sample_sum;
+  double created;
+};
+
+/* Merges `count` observations, totalling `sum`, into the given bin of the
+ * summary's sketch.
+ */
+int prom_metric_db_summary_add(pool *p, struct prom_dbh *dbh,
+  int64_t metric_id, int bin_key, double count, double sum,
+  const char *sample_labels);
+
+/* Returns the sketches for the given summary, as struct
+ * prom_metric_db_summary elements ordered by labels; the bins of each are
+ * ordered by key.
+ */
+const array_header *prom_metric_db_summary_get(pool *p, struct prom_dbh *dbh,
+  int64_t metric_id);
+
+/* Scans read the samples, histograms, and summaries of many metrics, using
+ * a single statement, a rank at a time, in rank order; the metrics sharing
+ * a rank (e.g. the counter and histogram of one registry metric) are read
+ * together.  Only the rows of one rank are thus held in memory at once.
+ */
+struct prom_metric_db_rank {
+  int64_t metric_id;
+  unsigned int rank;
+};
+
+struct prom_metric_db_scan;
+
+/* Opens a scan of the metrics with the given IDs, as struct
+ * prom_metric_db_rank elements.
+ */
+struct prom_metric_db_scan *prom_metric_db_scan_open(pool *p,
+  struct prom_dbh *dbh, const array_header *ranks);
+
+/* Returns the rows of the given rank, allocated from the given pool, as
+ * struct prom_metric_db_sample, prom_metric_db_histogram and
+ * prom_metric_db_summary elements, respectively, each ordered by metric ID
+ * and labels.  Ranks must be requested in ascending order; the rows of any
+ * ranks skipped are discarded.
+ */
+int prom_metric_db_scan_next(pool *p, struct prom_metric_db_scan *scan,
+  unsigned int rank, const array_header **samples,
+  const array_header **histograms, const array_header **summaries);
+
+int prom_metric_db_scan_close(struct prom_metric_db_scan *scan);
+
 #endif /* MOD_PROMETHEUS_METRIC_DB_H */
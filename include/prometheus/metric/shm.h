@@ -0,0 +1,70 @@
+/*
+ * ProFTPD - mod_prometheus shared memory metrics datastore API
+ * Copyright (c) 2021-2023 TJ Saunders
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+#ifndef MOD_PROMETHEUS_METRIC_SHM_H
+#define MOD_PROMETHEUS_METRIC_SHM_H
+
+#include "mod_prometheus.h"
+
+struct prom_metric_shm;
+
+/* Default number of samples (i.e. metric ID/label set combinations) which
+ * the shared memory datastore can hold.
+ */
+#define PROM_METRIC_SHM_DEFAULT_MAX_SAMPLES	4096
+
+/* Maximum length of the formatted label text for a single sample. */
+#define PROM_METRIC_SHM_MAX_LABELS_LEN		480
+
+/* Creates a new shared memory segment, backed by a file in the given
+ * directory.  This should be done by the daemon process, before forking
+ * any session processes, so that the mapping is inherited by all of them.
+ */
+struct prom_metric_shm *prom_metric_shm_init(pool *p, const char *tables_path,
+  unsigned int max_samples);
+int prom_metric_shm_close(pool *p, struct prom_metric_shm *shm);
+
+int prom_metric_shm_sample_decr(pool *p, struct prom_metric_shm *shm,
+  int64_t metric_id, double sample_val, const char *sample_labels);
+int prom_metric_shm_sample_incr(pool *p, struct prom_metric_shm *shm,
+  int64_t metric_id, double sample_val, const char *sample_labels);
+int prom_metric_shm_sample_set(pool *p, struct prom_metric_shm *shm,
+  int64_t metric_id, double sample_val, const char *sample_labels);
+
+/* Returns the samples for the given metric ID, as struct
+ * prom_metric_db_sample elements, sorted by the label text.
+ */
+const array_header *prom_metric_shm_sample_get(pool *p,
+  struct prom_metric_shm *shm, int64_t metric_id);
+
+/* Returns the samples of all metrics, read in a single pass, as struct
+ * prom_metric_db_sample elements, sorted by metric ID and label text.
+ */
+const array_header *prom_metric_shm_sample_get_all(pool *p,
+  struct prom_metric_shm *shm);
+
+/* Returns the number of samples currently in use. */
+int prom_metric_shm_sample_count(struct prom_metric_shm *shm);
+
+#endif /* MOD_PROMETHEUS_METRIC_SHM_H */
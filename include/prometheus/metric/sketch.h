@@ -0,0 +1,64 @@
+/*
+ * ProFTPD - mod_prometheus metrics quantile sketch API
+ * Copyright (c) 2021-2023 TJ Saunders
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+#ifndef MOD_PROMETHEUS_METRIC_SKETCH_H
+#define MOD_PROMETHEUS_METRIC_SKETCH_H
+
+#include "mod_prometheus.h"
+
+/* Summaries use a DDSketch-style quantile sketch: values are counted in
+ * logarithmically sized bins, identified by integer keys, such that any
+ * quantile estimated from the bin counts is within the relative accuracy of
+ * the true value.  Sketches merge by adding the counts for the same keys.
+ *
+ * Values at or below the minimum (including zero and negative values) are
+ * counted in a single, lowest bin; values above the maximum are counted in
+ * the highest bin.  The number of bins per sketch is thus bounded, no matter
+ * how many values are observed.
+ */
+#define PROM_SKETCH_RELATIVE_ACCURACY	0.01
+#define PROM_SKETCH_MIN_VALUE		1.0e-9
+#define PROM_SKETCH_MAX_VALUE		1.0e15
+
+struct prom_sketch_bin {
+  int key;
+  double count;
+};
+
+/* Returns the key of the bin for the given value. */
+int prom_sketch_key(double val);
+
+/* Returns the value represented by the given bin key. */
+double prom_sketch_value(int key);
+
+/* Returns the maximum number of distinct bin keys. */
+unsigned int prom_sketch_max_bins(void);
+
+/* Estimates the given quantile (0.0 to 1.0) from the bins, which must be
+ * sorted by key.  Returns -1 if there are no counts in the bins.
+ */
+int prom_sketch_quantile(const struct prom_sketch_bin *bins,
+  unsigned int bin_count, double quantile, double *val);
+
+#endif /* MOD_PROMETHEUS_METRIC_SKETCH_H */
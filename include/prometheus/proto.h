@@ -0,0 +1,111 @@
+/*
+ * ProFTPD - mod_prometheus protobuf encoding API
+ * Copyright (c) 2021 TJ Saunders
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+#ifndef MOD_PROMETHEUS_PROTO_H
+#define MOD_PROMETHEUS_PROTO_H
+
+#include "mod_prometheus.h"
+
+/* A minimal encoder for Protocol Buffers messages, sufficient for the
+ * io.prometheus.client.MetricFamily messages of the protobuf exposition
+ * format.  Nested messages are encoded in their own builder, then added
+ * to the enclosing message.
+ */
+struct prom_proto;
+
+struct prom_proto *prom_proto_create(pool *p);
+int prom_proto_destroy(struct prom_proto *proto);
+
+/* Discards the encoded data, for reusing the builder. */
+int prom_proto_reset(struct prom_proto *proto);
+
+int prom_proto_add_varint(struct prom_proto *proto, unsigned int field,
+  uint64_t val);
+
+/* Adds a zigzag-encoded (sint32/sint64) field. */
+int prom_proto_add_sint(struct prom_proto *proto, unsigned int field,
+  int64_t val);
+
+int prom_proto_add_double(struct prom_proto *proto, unsigned int field,
+  double val);
+
+/* Adds a string (or bytes) field. */
+int prom_proto_add_str(struct prom_proto *proto, unsigned int field,
+  const char *str, size_t len);
+
+/* Adds the given values as a packed repeated sint64 field. */
+int prom_proto_add_packed_sint(struct prom_proto *proto, unsigned int field,
+  const int64_t *vals, unsigned int count);
+
+/* Adds the message encoded in `msg` as a field. */
+int prom_proto_add_msg(struct prom_proto *proto, unsigned int field,
+  const struct prom_proto *msg);
+
+/* Adds the message encoded in `msg`, prefixed by its length, as used for
+ * streams of messages.
+ */
+int prom_proto_add_delimited(struct prom_proto *proto,
+  const struct prom_proto *msg);
+
+/* Returns the encoded data, which is owned by the builder. */
+const char *prom_proto_get_buf(struct prom_proto *proto, size_t *len);
+
+/* Field numbers and enum values of the io.prometheus.client messages. */
+#define PROM_PROTO_FAMILY_NAME			1
+#define PROM_PROTO_FAMILY_HELP			2
+#define PROM_PROTO_FAMILY_TYPE			3
+#define PROM_PROTO_FAMILY_METRIC		4
+#define PROM_PROTO_TYPE_COUNTER			0
+#define PROM_PROTO_TYPE_GAUGE			1
+#define PROM_PROTO_TYPE_SUMMARY			2
+#define PROM_PROTO_TYPE_HISTOGRAM		4
+#define PROM_PROTO_METRIC_LABEL			1
+#define PROM_PROTO_METRIC_GAUGE			2
+#define PROM_PROTO_METRIC_COUNTER		3
+#define PROM_PROTO_METRIC_SUMMARY		4
+#define PROM_PROTO_METRIC_HISTOGRAM		7
+#define PROM_PROTO_LABEL_NAME			1
+#define PROM_PROTO_LABEL_VALUE			2
+#define PROM_PROTO_VALUE			1
+#define PROM_PROTO_SUMMARY_COUNT		1
+#define PROM_PROTO_SUMMARY_SUM			2
+#define PROM_PROTO_SUMMARY_QUANTILE		3
+#define PROM_PROTO_QUANTILE_QUANTILE		1
+#define PROM_PROTO_QUANTILE_VALUE		2
+#define PROM_PROTO_HISTOGRAM_COUNT		1
+#define PROM_PROTO_HISTOGRAM_SUM		2
+#define PROM_PROTO_HISTOGRAM_BUCKET		3
+#define PROM_PROTO_HISTOGRAM_SCHEMA		5
+#define PROM_PROTO_HISTOGRAM_ZERO_THRESHOLD	6
+#define PROM_PROTO_HISTOGRAM_ZERO_COUNT		7
+#define PROM_PROTO_HISTOGRAM_NEGATIVE_SPAN	9
+#define PROM_PROTO_HISTOGRAM_NEGATIVE_DELTA	10
+#define PROM_PROTO_HISTOGRAM_POSITIVE_SPAN	12
+#define PROM_PROTO_HISTOGRAM_POSITIVE_DELTA	13
+#define PROM_PROTO_BUCKET_COUNT			1
+#define PROM_PROTO_BUCKET_UPPER_BOUND		2
+#define PROM_PROTO_SPAN_OFFSET			1
+#define PROM_PROTO_SPAN_LENGTH			2
+
+#endif /* MOD_PROMETHEUS_PROTO_H */
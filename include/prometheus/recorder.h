@@ -0,0 +1,111 @@
+/*
+ * ProFTPD - mod_prometheus recorder API
+ * Copyright (c) 2021-2023 TJ Saunders
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+#ifndef MOD_PROMETHEUS_RECORDER_H
+#define MOD_PROMETHEUS_RECORDER_H
+
+#include "mod_prometheus.h"
+#include "prometheus/metric.h"
+
+/* A recorder appends the metric updates made by a process, e.g. a session,
+ * to a compact binary trace, for replaying them later, e.g. against a
+ * different build, for comparing performance.  The trace begins with the
+ * definition (see prom_metric_get_definition()) of each metric, the first
+ * time that metric is updated.
+ */
+struct prom_recorder;
+
+/* Opens (creating if need be) the trace at the given path, for appending. */
+struct prom_recorder *prom_recorder_open(pool *p, const char *path);
+
+/* Writes any buffered records, and closes the trace. */
+int prom_recorder_close(struct prom_recorder *recorder);
+
+/* Writes any buffered records to the trace. */
+int prom_recorder_flush(struct prom_recorder *recorder);
+
+/* Records an update, of the given op, to the metric with the given handle,
+ * e.g. its index in the caller's table of metrics, with the given values
+ * of its declared labels (see prom_metric_set_label_names()); a value may
+ * be NULL.
+ */
+int prom_recorder_add_update(struct prom_recorder *recorder,
+  unsigned int handle, const struct prom_metric *metric, int op, double val,
+  const char **values, unsigned int nvalues);
+#define PROM_RECORDER_OP_DECR		1
+#define PROM_RECORDER_OP_INCR		2
+#define PROM_RECORDER_OP_INCR_COUNTER	3
+#define PROM_RECORDER_OP_INCR_GAUGE	4
+#define PROM_RECORDER_OP_OBSERVE	5
+
+#define PROM_RECORDER_MAX_HANDLES	256
+#define PROM_RECORDER_MAX_VALUES	16
+
+/* Records the base labels (see prom_metric_set_base_labels()) used for the
+ * following updates.
+ */
+int prom_recorder_add_base_labels(struct prom_recorder *recorder,
+  pr_table_t *labels);
+
+/* Reading a recorded trace. */
+struct prom_recorder_reader;
+
+struct prom_recorder_record {
+  int type;
+
+  /* Unix time, in microseconds, of updates and base labels. */
+  uint64_t timestamp_usecs;
+
+  /* For metric definitions and updates. */
+  unsigned int handle;
+
+  /* For updates. */
+  int op;
+  double value;
+
+  /* Label values of updates (which may be NULL), or the names and values of
+   * base labels, alternating.
+   */
+  unsigned int nvalues;
+  const char *values[PROM_RECORDER_MAX_VALUES];
+
+  /* For metric definitions. */
+  const char *definition;
+};
+#define PROM_RECORDER_RECORD_METRIC		1
+#define PROM_RECORDER_RECORD_UPDATE		2
+#define PROM_RECORDER_RECORD_BASE_LABELS	3
+
+struct prom_recorder_reader *prom_recorder_reader_open(pool *p,
+  const char *path);
+int prom_recorder_reader_close(struct prom_recorder_reader *reader);
+
+/* Reads the next record; its strings are valid until the next call.  Returns
+ * 1 for a record, 0 at the end of the trace, and -1 on error, e.g. EINVAL
+ * for a truncated or corrupted trace.
+ */
+int prom_recorder_reader_next(struct prom_recorder_reader *reader,
+  struct prom_recorder_record *record);
+
+#endif /* MOD_PROMETHEUS_RECORDER_H */
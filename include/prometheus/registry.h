@@ -37,6 +37,41 @@ const char *prom_registry_get_name(struct prom_registry *registry);
 /* Returns the text for all collector's metrics in the registry. */
 const char *prom_registry_get_text(pool *p, struct prom_registry *registry);
 
+/* Returns the OpenMetrics text, ending with the "# EOF" marker, for all
+ * metrics in the registry.
+ */
+const char *prom_registry_get_openmetrics(pool *p,
+  struct prom_registry *registry);
+
+/* Returns the protobuf exposition (delimited MetricFamily messages) for all
+ * metrics in the registry.
+ */
+const char *prom_registry_get_proto(pool *p, struct prom_registry *registry,
+  size_t *len);
+
+/* Iterates over the registry text, one metric at a time, e.g. for streaming
+ * responses.  The samples are read when the iterator is opened.  Each call
+ * to prom_registry_iter_next() returns the text for the next metric, from
+ * the given pool; at the end, NULL is returned, with ENOENT.
+ */
+struct prom_registry_iter;
+struct prom_registry_iter *prom_registry_iter_open(pool *p,
+  struct prom_registry *registry);
+const char *prom_registry_iter_next(pool *p, struct prom_registry_iter *iter,
+  size_t *textlen);
+int prom_registry_iter_close(struct prom_registry_iter *iter);
+
+/* Sets the exposition format returned by the iterator; the default is text.
+ * The protobuf format returns the delimited MetricFamily messages for each
+ * metric, with no terminating newline.  The OpenMetrics format ends with the
+ * "# EOF" marker, rather than a newline.
+ */
+int prom_registry_iter_set_format(struct prom_registry_iter *iter,
+  int format);
+#define PROM_REGISTRY_FORMAT_TEXT		1
+#define PROM_REGISTRY_FORMAT_PROTOBUF		2
+#define PROM_REGISTRY_FORMAT_OPENMETRICS	3
+
 int prom_registry_add_metric(struct prom_registry *registry,
   struct prom_metric *metric);
 int prom_registry_remove_metric(struct prom_registry *registry,
@@ -49,6 +84,32 @@ const struct prom_metric *prom_registry_get_metric(
 /* Sets the given database handle on all registered metrics. */
 int prom_registry_set_dbh(struct prom_registry *registry, struct prom_dbh *dbh);
 
+/* Obtain a version which changes whenever the registry's samples may have
+ * changed, for caching scrapes.  The version is the same for every process
+ * using the same database.  Fails with ENOSYS when the datastore does not
+ * support this, e.g. shared memory.
+ */
+int prom_registry_get_data_version(pool *p, struct prom_registry *registry,
+  int64_t *version);
+
+/* Sets the given shared memory datastore on all registered metrics, and on
+ * any metrics registered later.  A NULL `shm` reverts to using the database.
+ */
+int prom_registry_set_shm(struct prom_registry *registry,
+  struct prom_metric_shm *shm);
+
+/* Sets the given write-behind buffer on all registered metrics, and on any
+ * metrics registered later.  A NULL `buffer` reverts to immediate writes.
+ */
+int prom_registry_set_buffer(struct prom_registry *registry,
+  struct prom_metric_buffer *buffer);
+
+/* Sets the given buffer, for updates deferred due to a busy database, on all
+ * registered metrics, and on any metrics registered later.
+ */
+int prom_registry_set_deferred(struct prom_registry *registry,
+  struct prom_metric_buffer *buffer);
+
 /* Caches a sorted list of metric names, for use in generating the text. */
 int prom_registry_sort_metrics(struct prom_registry *registry);
 
@@ -0,0 +1,102 @@
+/*
+ * ProFTPD - mod_prometheus scrape snapshot API
+ * Copyright (c) 2021-2023 TJ Saunders
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+
+#ifndef MOD_PROMETHEUS_SNAPSHOT_H
+#define MOD_PROMETHEUS_SNAPSHOT_H
+
+#include "mod_prometheus.h"
+#include "prometheus/registry.h"
+
+struct prom_snapshot;
+
+/* Default maximum size of a snapshot's text and protobuf.  Note that the
+ * backing file is sparse, thus only the space actually used by snapshots is
+ * allocated.
+ */
+#define PROM_SNAPSHOT_DEFAULT_MAX_SIZE		(16 * 1024 * 1024)
+
+/* Creates the shared memory used for passing rendered snapshots of the
+ * registry text from a renderer process to the exporter processes.  This
+ * should be done before forking those processes, so that the mapping is
+ * inherited by all of them.
+ */
+struct prom_snapshot *prom_snapshot_init(pool *p, const char *tables_path,
+  size_t max_size);
+int prom_snapshot_close(pool *p, struct prom_snapshot *snapshot);
+
+/* Renders the registry text, protobuf encoding, and OpenMetrics text, plus a
+ * gauge of the time at which they were rendered, and publishes them as the
+ * latest snapshot.
+ * There must be only one process publishing snapshots.
+ */
+int prom_snapshot_render(pool *p, struct prom_snapshot *snapshot,
+  struct prom_registry *registry);
+
+/* Publishes the given text as the latest snapshot. */
+int prom_snapshot_set(pool *p, struct prom_snapshot *snapshot,
+  const char *text, size_t textlen);
+
+/* Publishes the given text, and its protobuf encoding, as the latest
+ * snapshot.  Their combined size must not exceed the maximum size.
+ */
+int prom_snapshot_set_with_proto(pool *p, struct prom_snapshot *snapshot,
+  const char *text, size_t textlen, const char *proto, size_t protolen);
+
+/* Publishes the given text, its protobuf encoding, and its OpenMetrics text,
+ * as the latest snapshot.  Their combined size must not exceed the maximum
+ * size.
+ */
+int prom_snapshot_set_with_openmetrics(pool *p,
+  struct prom_snapshot *snapshot, const char *text, size_t textlen,
+  const char *proto, size_t protolen, const char *om, size_t omlen);
+
+/* Returns a copy of the latest snapshot text, allocated from the given pool,
+ * and its generation.  Fails with ENOENT if no snapshot has been published
+ * yet.
+ */
+const char *prom_snapshot_get(pool *p, struct prom_snapshot *snapshot,
+  size_t *textlen, uint64_t *generation);
+
+/* Returns a copy of the protobuf encoding of the latest snapshot, and its
+ * generation.  Fails with ENOENT if no snapshot has been published, or if
+ * the latest snapshot has no protobuf encoding.
+ */
+const char *prom_snapshot_get_proto(pool *p, struct prom_snapshot *snapshot,
+  size_t *protolen, uint64_t *generation);
+
+/* Returns a copy of the OpenMetrics text of the latest snapshot, and its
+ * generation.  Fails with ENOENT if no snapshot has been published, or if
+ * the latest snapshot has no OpenMetrics text.
+ */
+const char *prom_snapshot_get_openmetrics(pool *p,
+  struct prom_snapshot *snapshot, size_t *omlen, uint64_t *generation);
+
+/* Returns the generation of the latest snapshot, which changes with every
+ * published snapshot; zero means that none has been published yet.
+ */
+int prom_snapshot_get_generation(struct prom_snapshot *snapshot,
+  uint64_t *generation);
+
+#endif /* MOD_PROMETHEUS_SNAPSHOT_H */
@@ -36,9 +36,34 @@ int prom_text_destroy(struct prom_text *text);
 int prom_text_add_byte(struct prom_text *text, char ch);
 int prom_text_add_str(struct prom_text *text, const char *str, size_t sz);
 
+/* Reserve space for at least `sz` bytes at the end of the text, e.g. for
+ * formatting a number in place, returning a pointer to that space.  Then
+ * commit the number of bytes actually written, up to `sz`, to the text.
+ */
+char *prom_text_reserve(struct prom_text *text, size_t sz);
+int prom_text_commit(struct prom_text *text, size_t sz);
+
+/* Appends the given sample value, formatted as by prom_text_format_double(). */
+int prom_text_add_double(struct prom_text *text, double val);
+
+/* Formats the given value as text which reads back, via strtod(3), as the
+ * same double, using the fewest digits in all but rare cases; integral values
+ * are formatted as integers, and NaN and the infinities as "NaN", "+Inf" and
+ * "-Inf".  The buffer must hold at least PROM_TEXT_DOUBLE_MAX_LEN bytes.
+ * Returns the length of the (NUL-terminated) text.
+ */
+int prom_text_format_double(char *buf, size_t bufsz, double val);
+#define PROM_TEXT_DOUBLE_MAX_LEN	32
+
 /* Obtain a copy of the accumulated text, duplicated from the given pool. */
 char *prom_text_get_str(pool *p, struct prom_text *text, size_t *sz);
 
+/* Obtain the accumulated (NUL-terminated) text itself, without copying it.
+ * The text is only valid until the next append, or until the text (or its
+ * parent pool) is destroyed.
+ */
+const char *prom_text_get_buf(struct prom_text *text, size_t *sz);
+
 /* Convert the given labels to text. */
 const char *prom_text_from_labels(pool *p, struct prom_text *text,
   pr_table_t *labels);
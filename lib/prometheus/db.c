@@ -31,6 +31,21 @@ struct prom_dbh {
   sqlite3 *db;
   const char *schema;
   pr_table_t *prepared_stmts;
+
+  /* Busy budget, in microseconds; see prom_db_set_busy_budget(). */
+  unsigned long busy_budget_usecs;
+  uint64_t busy_started_usecs;
+  uint32_t busy_rand;
+
+  /* See prom_db_get_busy_stats(). */
+  uint64_t busy_errors;
+  uint64_t busy_sleeps;
+};
+
+struct prom_db_row {
+  struct prom_dbh *dbh;
+  sqlite3_stmt *pstmt;
+  int ncols;
 };
 
 static const char *current_schema = NULL;
@@ -40,10 +55,74 @@ static const char *trace_channel = "prometheus.db";
 #define PROM_DB_SQLITE_MAX_RETRY_COUNT		20
 #define PROM_DB_SQLITE_MAX_RETRY_DELAY_MS	100
 
+/* With a busy budget, the first retry delay; it doubles with each retry. */
+#define PROM_DB_SQLITE_MIN_RETRY_DELAY_US	20
+
 #define PROM_DB_SQLITE_TRACE_LEVEL		17
 
+static uint64_t db_now_usecs(void) {
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return ((uint64_t) tv.tv_sec * 1000000) + tv.tv_usec;
+}
+
+/* Exponential backoff, with "equal jitter", bounded by the remaining busy
+ * budget.  Returns FALSE once the budget is spent, so that SQLite gives up
+ * with SQLITE_BUSY.
+ */
+static int db_busy_budget(struct prom_dbh *dbh, int busy_count) {
+  uint64_t now, elapsed;
+  unsigned long delay, remaining;
+
+  now = db_now_usecs();
+  if (busy_count == 0) {
+    dbh->busy_started_usecs = now;
+  }
+
+  elapsed = now - dbh->busy_started_usecs;
+  if (elapsed >= dbh->busy_budget_usecs) {
+    pr_trace_msg(trace_channel, 3,
+      "(sqlite3): schema '%s': busy budget (%lu usecs) exhausted after %d "
+      "retries", dbh->schema, dbh->busy_budget_usecs, busy_count);
+    return FALSE;
+  }
+
+  remaining = dbh->busy_budget_usecs - (unsigned long) elapsed;
+
+  delay = PROM_DB_SQLITE_MAX_RETRY_DELAY_MS * 1000;
+  if (busy_count < 16) {
+    delay = PROM_DB_SQLITE_MIN_RETRY_DELAY_US << busy_count;
+  }
+
+  /* A simple xorshift generator suffices for jitter. */
+  dbh->busy_rand ^= dbh->busy_rand << 13;
+  dbh->busy_rand ^= dbh->busy_rand >> 17;
+  dbh->busy_rand ^= dbh->busy_rand << 5;
+  delay = (delay / 2) + (dbh->busy_rand % ((delay / 2) + 1));
+
+  if (delay > remaining) {
+    delay = remaining;
+  }
+
+  pr_trace_msg(trace_channel, 9,
+    "(sqlite3): schema '%s': busy count = %d, retrying in %lu usecs",
+    dbh->schema, busy_count, delay);
+  dbh->busy_sleeps++;
+  (void) pr_timer_usleep(delay);
+
+  return TRUE;
+}
+
 static int db_busy(void *user_data, int busy_count) {
   int retry = FALSE;
+  struct prom_dbh *dbh;
+
+  dbh = user_data;
+  if (dbh != NULL &&
+      dbh->busy_budget_usecs > 0) {
+    return db_busy_budget(dbh, busy_count);
+  }
 
   /* How many retries do we want to allow? */
   if (busy_count <= PROM_DB_SQLITE_MAX_RETRY_COUNT) {
@@ -63,6 +142,9 @@ static int db_busy(void *user_data, int busy_count) {
   /* If we're busy, then sleep for a short while, on the assumption that the
    * other process will finish its business with our tables.
    */
+  if (dbh != NULL) {
+    dbh->busy_sleeps++;
+  }
   (void) pr_timer_usleep(PROM_DB_SQLITE_MAX_RETRY_DELAY_MS * 1000);
 
   return retry;
@@ -259,6 +341,26 @@ int prom_db_exec_stmt(pool *p, struct prom_dbh *dbh, const char *stmt,
   current_schema = dbh->schema;
   res = sqlite3_exec(dbh->db, stmt, stmt_cb, (void *) stmt, &ptr);
   while (res != SQLITE_OK) {
+    if (res == SQLITE_BUSY) {
+      dbh->busy_errors++;
+    }
+
+    if (res == SQLITE_BUSY &&
+        dbh->busy_budget_usecs > 0) {
+      /* The busy handler has already spent our budget; don't retry. */
+      pr_trace_msg(trace_channel, 3,
+        "database busy, giving up on '%s'", stmt);
+
+      if (errstr != NULL) {
+        *errstr = pstrdup(p, ptr);
+      }
+
+      current_schema = NULL;
+      sqlite3_free(ptr);
+      errno = EAGAIN;
+      return -1;
+    }
+
     if (res == SQLITE_BUSY) {
       struct timeval tv;
 
@@ -424,7 +526,7 @@ int prom_db_bind_stmt(pool *p, struct prom_dbh *dbh, const char *stmt,
       }
 
       l = *((long *) data);
-      res = sqlite3_bind_int(pstmt, idx, l);
+      res = sqlite3_bind_int64(pstmt, idx, (sqlite3_int64) l);
       if (res != SQLITE_OK) {
         pr_trace_msg(trace_channel, 4,
           "error binding parameter %d of '%s' to LONG %ld: %s", idx, stmt, l,
@@ -435,6 +537,26 @@ int prom_db_bind_stmt(pool *p, struct prom_dbh *dbh, const char *stmt,
       break;
     }
 
+    case PROM_DB_BIND_TYPE_INT64: {
+      int64_t i;
+
+      if (data == NULL) {
+        errno = EINVAL;
+        return -1;
+      }
+
+      i = *((int64_t *) data);
+      res = sqlite3_bind_int64(pstmt, idx, (sqlite3_int64) i);
+      if (res != SQLITE_OK) {
+        pr_trace_msg(trace_channel, 4,
+          "error binding parameter %d of '%s' to INT64 %lld: %s", idx, stmt,
+          (long long) i, sqlite3_errmsg(dbh->db));
+        errno = EPERM;
+        return -1;
+      }
+      break;
+    }
+
     case PROM_DB_BIND_TYPE_DOUBLE: {
       double d;
 
@@ -533,6 +655,45 @@ int prom_db_finish_stmt(pool *p, struct prom_dbh *dbh, const char *stmt) {
   return 0;
 }
 
+/* A busy database is reported as EAGAIN; the statement is reset, so that it
+ * releases any locks it holds (rolling back, if outside of a transaction).
+ */
+static int db_step_errno(struct prom_dbh *dbh, sqlite3_stmt *pstmt, int res) {
+  if (res == SQLITE_BUSY) {
+    dbh->busy_errors++;
+    (void) sqlite3_reset(pstmt);
+    return EAGAIN;
+  }
+
+  return EPERM;
+}
+
+/* Steps the given INSERT/UPDATE/DELETE statement to completion. */
+static int db_step_write(pool *p, struct prom_dbh *dbh, const char *stmt,
+    sqlite3_stmt *pstmt, const char **errstr) {
+  int res;
+
+  res = sqlite3_step(pstmt);
+  if (res != SQLITE_DONE) {
+    const char *errmsg;
+
+    errmsg = sqlite3_errmsg(dbh->db);
+    if (errstr) {
+      *errstr = pstrdup(p, errmsg);
+    }
+    pr_trace_msg(trace_channel, 2,
+      "error executing '%s': %s", stmt, errmsg);
+
+    current_schema = NULL;
+    errno = db_step_errno(dbh, pstmt, res);
+    return -1;
+  }
+
+  current_schema = NULL;
+  pr_trace_msg(trace_channel, 13, "successfully executed '%s'", stmt);
+  return 0;
+}
+
 array_header *prom_db_exec_prepared_stmt(pool *p, struct prom_dbh *dbh,
     const char *stmt, const char **errstr) {
   sqlite3_stmt *pstmt;
@@ -570,28 +731,13 @@ array_header *prom_db_exec_prepared_stmt(pool *p, struct prom_dbh *dbh,
 
   if (readonly == FALSE) {
     /* Assume this is an INSERT/UPDATE/DELETE. */
-    res = sqlite3_step(pstmt);
-    if (res != SQLITE_DONE) {
-      const char *errmsg;
-
-      errmsg = sqlite3_errmsg(dbh->db);
-      if (errstr) {
-        *errstr = pstrdup(p, errmsg);
-      }
-      pr_trace_msg(trace_channel, 2,
-        "error executing '%s': %s", stmt, errmsg);
-
-      current_schema = NULL;
-      errno = EPERM;
+    if (db_step_write(p, dbh, stmt, pstmt, errstr) < 0) {
       return NULL;
     }
 
-    current_schema = NULL;
-
     /* Indicate success for non-readonly statements by returning an empty
      * result set.
      */
-    pr_trace_msg(trace_channel, 13, "successfully executed '%s'", stmt);
     results = make_array(p, 0, sizeof(char *));
     return results;
   }
@@ -639,7 +785,7 @@ array_header *prom_db_exec_prepared_stmt(pool *p, struct prom_dbh *dbh,
     (void) pr_log_writefile(prometheus_logfd, MOD_PROMETHEUS_VERSION,
       "schema '%s': executing prepared statement '%s' did not complete "
       "successfully: %s", dbh->schema, stmt, errmsg);
-    errno = EPERM;
+    errno = db_step_errno(dbh, pstmt, res);
     return NULL;
   }
 
@@ -648,6 +794,489 @@ array_header *prom_db_exec_prepared_stmt(pool *p, struct prom_dbh *dbh,
   return results;
 }
 
+int prom_db_exec_prepared_stmt_rows(pool *p, struct prom_dbh *dbh,
+    const char *stmt, int (*row_cb)(struct prom_db_row *, void *),
+    void *user_data, const char **errstr) {
+  sqlite3_stmt *pstmt;
+  struct prom_db_row row;
+  int res, row_count = 0;
+
+  if (p == NULL ||
+      dbh == NULL ||
+      stmt == NULL ||
+      row_cb == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (dbh->prepared_stmts == NULL) {
+    errno = ENOENT;
+    return -1;
+  }
+
+  pstmt = (sqlite3_stmt *) pr_table_get(dbh->prepared_stmts, stmt, NULL);
+  if (pstmt == NULL) {
+    pr_trace_msg(trace_channel, 19,
+      "unable to find prepared statement for '%s'", stmt);
+    errno = ENOENT;
+    return -1;
+  }
+
+  current_schema = dbh->schema;
+
+  row.dbh = dbh;
+  row.pstmt = pstmt;
+  row.ncols = sqlite3_column_count(pstmt);
+
+  res = sqlite3_step(pstmt);
+  while (res == SQLITE_ROW) {
+    pr_signals_handle();
+
+    if (row_cb(&row, user_data) < 0) {
+      int xerrno = errno;
+
+      pr_trace_msg(trace_channel, 12,
+        "schema '%s': stopped processing rows of '%s' after %d rows: %s",
+        dbh->schema, stmt, row_count, strerror(xerrno));
+      current_schema = NULL;
+      errno = xerrno;
+      return -1;
+    }
+
+    row_count++;
+    res = sqlite3_step(pstmt);
+  }
+
+  if (res != SQLITE_DONE) {
+    const char *errmsg;
+
+    errmsg = sqlite3_errmsg(dbh->db);
+    if (errstr != NULL) {
+      *errstr = pstrdup(p, errmsg);
+    }
+
+    current_schema = NULL;
+    (void) pr_log_writefile(prometheus_logfd, MOD_PROMETHEUS_VERSION,
+      "schema '%s': executing prepared statement '%s' did not complete "
+      "successfully: %s", dbh->schema, stmt, errmsg);
+    errno = db_step_errno(dbh, pstmt, res);
+    return -1;
+  }
+
+  current_schema = NULL;
+  pr_trace_msg(trace_channel, 13, "successfully executed '%s' (%d rows)",
+    stmt, row_count);
+  return row_count;
+}
+
+int prom_db_exec_prepared_write(pool *p, struct prom_dbh *dbh,
+    const char *stmt, const char **errstr) {
+  sqlite3_stmt *pstmt;
+
+  if (p == NULL ||
+      dbh == NULL ||
+      stmt == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (dbh->prepared_stmts == NULL) {
+    errno = ENOENT;
+    return -1;
+  }
+
+  pstmt = (sqlite3_stmt *) pr_table_get(dbh->prepared_stmts, stmt, NULL);
+  if (pstmt == NULL) {
+    pr_trace_msg(trace_channel, 19,
+      "unable to find prepared statement for '%s'", stmt);
+    errno = ENOENT;
+    return -1;
+  }
+
+  current_schema = dbh->schema;
+  return db_step_write(p, dbh, stmt, pstmt, errstr);
+}
+
+/* Cursors.  Each cursor prepares its own statement, rather than using the
+ * cache of prepared statements, as several cursors, over the same statement
+ * text, may be open at once on a database handle.
+ */
+struct prom_db_cursor {
+  struct prom_dbh *dbh;
+  const char *stmt;
+  sqlite3_stmt *pstmt;
+  struct prom_db_row row;
+  int done;
+};
+
+struct prom_db_cursor *prom_db_cursor_open(pool *p, struct prom_dbh *dbh,
+    const char *stmt) {
+  struct prom_db_cursor *cursor;
+  sqlite3_stmt *pstmt = NULL;
+  int res;
+
+  if (p == NULL ||
+      dbh == NULL ||
+      stmt == NULL) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  res = sqlite3_prepare_v2(dbh->db, stmt, -1, &pstmt, NULL);
+  if (res != SQLITE_OK) {
+    pr_trace_msg(trace_channel, 4,
+      "schema '%s': error preparing cursor statement '%s': %s", dbh->schema,
+      stmt, sqlite3_errmsg(dbh->db));
+    errno = EINVAL;
+    return NULL;
+  }
+
+  cursor = pcalloc(p, sizeof(struct prom_db_cursor));
+  cursor->dbh = dbh;
+  cursor->stmt = stmt;
+  cursor->pstmt = pstmt;
+  cursor->row.dbh = dbh;
+  cursor->row.pstmt = pstmt;
+  cursor->row.ncols = sqlite3_column_count(pstmt);
+
+  return cursor;
+}
+
+struct prom_db_row *prom_db_cursor_next(struct prom_db_cursor *cursor) {
+  struct prom_dbh *dbh;
+  int res;
+
+  if (cursor == NULL) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  if (cursor->done == TRUE) {
+    errno = ENOENT;
+    return NULL;
+  }
+
+  dbh = cursor->dbh;
+  current_schema = dbh->schema;
+
+  res = sqlite3_step(cursor->pstmt);
+  current_schema = NULL;
+
+  if (res == SQLITE_ROW) {
+    return &(cursor->row);
+  }
+
+  cursor->done = TRUE;
+
+  if (res != SQLITE_DONE) {
+    (void) pr_log_writefile(prometheus_logfd, MOD_PROMETHEUS_VERSION,
+      "schema '%s': stepping cursor statement '%s' did not complete "
+      "successfully: %s", dbh->schema, cursor->stmt, sqlite3_errmsg(dbh->db));
+    errno = db_step_errno(dbh, cursor->pstmt, res);
+    return NULL;
+  }
+
+  /* Release any locks held by the statement now, rather than when the
+   * cursor is closed.
+   */
+  (void) sqlite3_reset(cursor->pstmt);
+
+  pr_trace_msg(trace_channel, 13, "successfully executed '%s'", cursor->stmt);
+  errno = ENOENT;
+  return NULL;
+}
+
+int prom_db_cursor_close(struct prom_db_cursor *cursor) {
+  int res;
+
+  if (cursor == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  res = sqlite3_finalize(cursor->pstmt);
+  cursor->pstmt = NULL;
+
+  if (res != SQLITE_OK &&
+      cursor->done == FALSE) {
+    pr_trace_msg(trace_channel, 3,
+      "schema '%s': error finishing cursor statement '%s': %s",
+      cursor->dbh->schema, cursor->stmt, sqlite3_errmsg(cursor->dbh->db));
+  }
+
+  return 0;
+}
+
+/* Typed column accessors.  Note that SQLite coerces the column value to the
+ * requested type, as necessary.
+ */
+static int check_row_col(struct prom_db_row *row, int col) {
+  if (row == NULL ||
+      col < 0 ||
+      col >= row->ncols) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  return 0;
+}
+
+int prom_db_row_get_int64(struct prom_db_row *row, int col, int64_t *val) {
+  if (check_row_col(row, col) < 0 ||
+      val == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  *val = (int64_t) sqlite3_column_int64(row->pstmt, col);
+  return 0;
+}
+
+int prom_db_row_get_double(struct prom_db_row *row, int col, double *val) {
+  if (check_row_col(row, col) < 0 ||
+      val == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  *val = sqlite3_column_double(row->pstmt, col);
+  return 0;
+}
+
+const char *prom_db_row_get_text(struct prom_db_row *row, int col,
+    size_t *len) {
+  const char *text;
+
+  if (check_row_col(row, col) < 0) {
+    return NULL;
+  }
+
+  text = (const char *) sqlite3_column_text(row->pstmt, col);
+  if (text == NULL) {
+    /* NULL column values, or out-of-memory. */
+    text = "";
+  }
+
+  if (len != NULL) {
+    *len = (size_t) sqlite3_column_bytes(row->pstmt, col);
+  }
+
+  return text;
+}
+
+const void *prom_db_row_get_blob(struct prom_db_row *row, int col,
+    size_t *len) {
+  const void *blob;
+
+  if (check_row_col(row, col) < 0 ||
+      len == NULL) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  blob = sqlite3_column_blob(row->pstmt, col);
+  *len = (size_t) sqlite3_column_bytes(row->pstmt, col);
+
+  if (blob == NULL) {
+    errno = ENOENT;
+  }
+
+  return blob;
+}
+
+/* SQL functions. */
+
+/* prom_slot_add(slots, slot, nslots, delta)
+ *
+ * Treats the `slots` blob as an array of 64-bit signed integers, stored
+ * little-endian, and returns a copy with `delta` added to the given
+ * (zero-based) slot.  A NULL or short blob is extended, with zeroed slots,
+ * to `nslots` slots.  This lets a single UPDATE adjust one counter within a
+ * packed row, e.g. one bucket of a histogram.
+ */
+static void db_slot_add(sqlite3_context *ctx, int nargs, sqlite3_value **args) {
+  register unsigned int i;
+  const unsigned char *blob;
+  unsigned char *slots, *ptr;
+  size_t blobsz, slotssz;
+  sqlite3_int64 slot, nslots, delta;
+  uint64_t val = 0;
+
+  (void) nargs;
+
+  slot = sqlite3_value_int64(args[1]);
+  nslots = sqlite3_value_int64(args[2]);
+  delta = sqlite3_value_int64(args[3]);
+
+  if (slot < 0 ||
+      nslots <= slot ||
+      nslots > 65536) {
+    sqlite3_result_error(ctx, "prom_slot_add: slot out of range", -1);
+    return;
+  }
+
+  blob = sqlite3_value_blob(args[0]);
+  blobsz = (size_t) sqlite3_value_bytes(args[0]);
+  if (blob == NULL) {
+    blobsz = 0;
+  }
+
+  slotssz = (size_t) nslots * sizeof(uint64_t);
+  if (blobsz > slotssz) {
+    slotssz = blobsz - (blobsz % sizeof(uint64_t));
+  }
+
+  slots = sqlite3_malloc((int) slotssz);
+  if (slots == NULL) {
+    sqlite3_result_error_nomem(ctx);
+    return;
+  }
+
+  memset(slots, 0, slotssz);
+  if (blobsz > 0) {
+    memcpy(slots, blob, blobsz < slotssz ? blobsz : slotssz);
+  }
+
+  ptr = slots + (slot * sizeof(uint64_t));
+  for (i = 0; i < sizeof(uint64_t); i++) {
+    val |= ((uint64_t) ptr[i]) << (i * 8);
+  }
+
+  val += (uint64_t) delta;
+
+  for (i = 0; i < sizeof(uint64_t); i++) {
+    ptr[i] = (unsigned char) ((val >> (i * 8)) & 0xff);
+  }
+
+  sqlite3_result_blob(ctx, slots, (int) slotssz, sqlite3_free);
+}
+
+/* prom_exemplar_set(exemplars, slot, exemplar)
+ *
+ * Treats the `exemplars` text as lines of "<slot> <exemplar>", and returns a
+ * copy with the line for the given slot replaced by the given exemplar.  A
+ * NULL exemplar leaves the text as is.  This lets the same UPDATE which
+ * counts an observation in its slot also record that observation as the
+ * slot's exemplar.
+ */
+static void db_exemplar_set(sqlite3_context *ctx, int nargs,
+    sqlite3_value **args) {
+  const char *text, *exemplar, *ptr, *end;
+  char slot_text[32], *res, *dst;
+  size_t textlen, exemplarlen, slot_textlen;
+
+  (void) nargs;
+
+  if (sqlite3_value_type(args[2]) == SQLITE_NULL) {
+    sqlite3_result_value(ctx, args[0]);
+    return;
+  }
+
+  text = (const char *) sqlite3_value_text(args[0]);
+  textlen = (size_t) sqlite3_value_bytes(args[0]);
+  if (text == NULL) {
+    text = "";
+    textlen = 0;
+  }
+
+  exemplar = (const char *) sqlite3_value_text(args[2]);
+  exemplarlen = (size_t) sqlite3_value_bytes(args[2]);
+  if (exemplar == NULL) {
+    sqlite3_result_error_nomem(ctx);
+    return;
+  }
+
+  memset(slot_text, '\0', sizeof(slot_text));
+  slot_textlen = snprintf(slot_text, sizeof(slot_text)-1, "%lld ",
+    (long long) sqlite3_value_int64(args[1]));
+
+  res = sqlite3_malloc((int) (textlen + slot_textlen + exemplarlen + 2));
+  if (res == NULL) {
+    sqlite3_result_error_nomem(ctx);
+    return;
+  }
+
+  /* Keep the lines of the other slots. */
+  dst = res;
+  ptr = text;
+  end = text + textlen;
+  while (ptr < end) {
+    const char *eol;
+    size_t linelen;
+
+    eol = memchr(ptr, '\n', end - ptr);
+    linelen = (eol != NULL ? (size_t) (eol - ptr) + 1 : (size_t) (end - ptr));
+
+    if (linelen < slot_textlen ||
+        strncmp(ptr, slot_text, slot_textlen) != 0) {
+      memcpy(dst, ptr, linelen);
+      dst += linelen;
+
+      if (eol == NULL) {
+        *dst++ = '\n';
+      }
+    }
+
+    ptr += linelen;
+  }
+
+  memcpy(dst, slot_text, slot_textlen);
+  dst += slot_textlen;
+  memcpy(dst, exemplar, exemplarlen);
+  dst += exemplarlen;
+  *dst++ = '\n';
+
+  sqlite3_result_text(ctx, res, (int) (dst - res), sqlite3_free);
+}
+
+/* prom_now()
+ *
+ * Returns the current time, as fractional seconds since the Unix epoch,
+ * e.g. for recording when a row was created.
+ */
+static void db_now(sqlite3_context *ctx, int nargs, sqlite3_value **args) {
+  struct timeval tv;
+
+  (void) nargs;
+  (void) args;
+
+  gettimeofday(&tv, NULL);
+  sqlite3_result_double(ctx, (double) tv.tv_sec +
+    ((double) (tv.tv_usec / 1000) / 1000.0));
+}
+
+static void db_add_functions(struct prom_dbh *dbh) {
+  int res, flags = SQLITE_UTF8;
+
+#if defined(SQLITE_DETERMINISTIC)
+  flags |= SQLITE_DETERMINISTIC;
+#endif /* SQLITE_DETERMINISTIC */
+
+  res = sqlite3_create_function(dbh->db, "prom_slot_add", 4, flags, NULL,
+    db_slot_add, NULL, NULL);
+  if (res != SQLITE_OK) {
+    pr_trace_msg(trace_channel, 2,
+      "error registering prom_slot_add() function: %s",
+      sqlite3_errmsg(dbh->db));
+  }
+
+  res = sqlite3_create_function(dbh->db, "prom_exemplar_set", 3, flags, NULL,
+    db_exemplar_set, NULL, NULL);
+  if (res != SQLITE_OK) {
+    pr_trace_msg(trace_channel, 2,
+      "error registering prom_exemplar_set() function: %s",
+      sqlite3_errmsg(dbh->db));
+  }
+
+  /* Note that prom_now() is, by definition, not deterministic. */
+  res = sqlite3_create_function(dbh->db, "prom_now", 0, SQLITE_UTF8, NULL,
+    db_now, NULL, NULL);
+  if (res != SQLITE_OK) {
+    pr_trace_msg(trace_channel, 2,
+      "error registering prom_now() function: %s", sqlite3_errmsg(dbh->db));
+  }
+}
+
 /* Database opening/closing. */
 
 static struct prom_dbh *db_open(pool *p, const char *table_path,
@@ -685,9 +1314,6 @@ static struct prom_dbh *db_open(pool *p, const char *table_path,
     return NULL;
   }
 
-  /* Make sure we set our busy handler. */
-  sqlite3_busy_handler(db, db_busy, (void *) schema_name);
-
   if (pr_trace_get_level(trace_channel) >= PROM_DB_SQLITE_TRACE_LEVEL) {
 #if defined(HAVE_SQLITE3_TRACE_V2)
     sqlite3_trace_v2(db, SQLITE_TRACE_STMT|SQLITE_TRACE_PROFILE|SQLITE_TRACE_ROW|SQLITE_TRACE_CLOSE,
@@ -703,6 +1329,11 @@ static struct prom_dbh *db_open(pool *p, const char *table_path,
   dbh->pool = sub_pool;
   dbh->db = db;
   dbh->schema = pstrdup(dbh->pool, schema_name);
+  dbh->busy_rand = (uint32_t) (getpid() ^ time(NULL)) | 1;
+
+  /* Make sure we set our busy handler. */
+  sqlite3_busy_handler(db, db_busy, dbh);
+  db_add_functions(dbh);
 
   stmt = "PRAGMA temp_store = MEMORY;";
   res = prom_db_exec_stmt(p, dbh, stmt, NULL);
@@ -1142,6 +1773,122 @@ int prom_db_last_row_id(pool *p, struct prom_dbh *dbh, int64_t *id) {
   return 0;
 }
 
+static int data_version_cb(struct prom_db_row *row, void *user_data) {
+  return prom_db_row_get_int64(row, 0, user_data);
+}
+
+int prom_db_get_data_version(pool *p, struct prom_dbh *dbh,
+    int64_t *version) {
+  int res;
+  const char *stmt, *errstr = NULL;
+
+  if (p == NULL ||
+      dbh == NULL ||
+      version == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  stmt = "PRAGMA data_version;";
+  res = prom_db_prepare_stmt(p, dbh, stmt);
+  if (res < 0) {
+    return -1;
+  }
+
+  res = prom_db_exec_prepared_stmt_rows(p, dbh, stmt, data_version_cb,
+    version, &errstr);
+  if (res < 0) {
+    pr_trace_msg(trace_channel, 3, "error getting data version: %s",
+      errstr ? errstr : strerror(errno));
+    errno = EPERM;
+    return -1;
+  }
+
+  if (res == 0) {
+    errno = ENOENT;
+    return -1;
+  }
+
+  return 0;
+}
+
+int prom_db_get_change_counter(pool *p, struct prom_dbh *dbh,
+    uint32_t *counter) {
+  int res;
+  sqlite3_file *fh = NULL;
+  unsigned char buf[4];
+
+  if (p == NULL ||
+      dbh == NULL ||
+      counter == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  /* The change counter is the big-endian 32-bit integer at offset 24 of the
+   * database file header.  We read it through SQLite's own file handle,
+   * which remains usable after chrooting.  Writers update the header page
+   * with a single write, so an unlocked read sees either the old or the new
+   * counter.
+   */
+  res = sqlite3_file_control(dbh->db, "main", SQLITE_FCNTL_FILE_POINTER, &fh);
+  if (res != SQLITE_OK ||
+      fh == NULL ||
+      fh->pMethods == NULL) {
+    pr_trace_msg(trace_channel, 3,
+      "error getting database file handle (SQLite error %d)", res);
+    errno = ENOSYS;
+    return -1;
+  }
+
+  res = fh->pMethods->xRead(fh, buf, sizeof(buf), 24);
+  if (res != SQLITE_OK) {
+    /* A short read means a database with no pages yet. */
+    if (res == SQLITE_IOERR_SHORT_READ) {
+      *counter = 0;
+      return 0;
+    }
+
+    pr_trace_msg(trace_channel, 3,
+      "error reading database change counter (SQLite error %d)", res);
+    errno = EIO;
+    return -1;
+  }
+
+  *counter = ((uint32_t) buf[0] << 24) | ((uint32_t) buf[1] << 16) |
+    ((uint32_t) buf[2] << 8) | (uint32_t) buf[3];
+  return 0;
+}
+
+int prom_db_set_busy_budget(struct prom_dbh *dbh,
+    unsigned long budget_usecs) {
+  if (dbh == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  dbh->busy_budget_usecs = budget_usecs;
+  return 0;
+}
+
+int prom_db_get_busy_stats(struct prom_dbh *dbh, uint64_t *busy_errors,
+    uint64_t *busy_sleeps) {
+  if (dbh == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (busy_errors != NULL) {
+    *busy_errors = dbh->busy_errors;
+  }
+
+  if (busy_sleeps != NULL) {
+    *busy_sleeps = dbh->busy_sleeps;
+  }
+
+  return 0;
+}
+
 int prom_db_begin_txn(pool *p, struct prom_dbh *dbh, const char **errstr) {
   if (p == NULL ||
       dbh == NULL) {
@@ -1149,6 +1896,14 @@ int prom_db_begin_txn(pool *p, struct prom_dbh *dbh, const char **errstr) {
     return -1;
   }
 
+  /* With a busy budget, every statement commits (or fails) on its own;
+   * an explicit transaction would hold the database lock across statements
+   * which give up.
+   */
+  if (dbh->busy_budget_usecs > 0) {
+    return 0;
+  }
+
   pr_trace_msg(trace_channel, 10, "schema '%s': beginning transaction",
     dbh->schema);
   return prom_db_exec_stmt(p, dbh, "BEGIN", errstr);
@@ -1161,6 +1916,10 @@ int prom_db_commit_txn(pool *p, struct prom_dbh *dbh, const char **errstr) {
     return -1;
   }
 
+  if (dbh->busy_budget_usecs > 0) {
+    return 0;
+  }
+
   pr_trace_msg(trace_channel, 10, "schema '%s': committing transaction",
     dbh->schema);
   return prom_db_exec_stmt(p, dbh, "COMMIT", errstr);
@@ -73,10 +73,78 @@ enum MHD_Result {
 };
 #endif /* # MHD_VERSION older than 0x00097002 */
 
+/* Size of the buffers which libmicrohttpd provides for the streamed
+ * /metrics response.
+ */
+#define PROM_HTTP_RESPONSE_BLOCK_SIZE		(16 * 1024)
+
+/* Exposition text is highly repetitive; the lower compression levels get
+ * most of the size reduction, for much less CPU than the zlib default.
+ */
+#define PROM_HTTP_DEFAULT_COMPRESS_LEVEL	3
+
+/* Content encodings of /metrics responses, for caching. */
+#define PROM_HTTP_ENCODING_IDENTITY		0
+#define PROM_HTTP_ENCODING_GZIP			1
+#define PROM_HTTP_ENCODING_COUNT		2
+
+/* Exposition formats of /metrics responses, for caching. */
+#define PROM_HTTP_FORMAT_TEXT			0
+#define PROM_HTTP_FORMAT_PROTOBUF		1
+#define PROM_HTTP_FORMAT_OPENMETRICS		2
+#define PROM_HTTP_FORMAT_COUNT			3
+
+#define PROM_HTTP_PROTOBUF_CONTENT_TYPE \
+  "application/vnd.google.protobuf; " \
+  "proto=io.prometheus.client.MetricFamily; encoding=delimited"
+
+#define PROM_HTTP_OPENMETRICS_CONTENT_TYPE \
+  "application/openmetrics-text; version=1.0.0; charset=utf-8"
+
+/* A rendered /metrics response body, cached until the data from which it
+ * was rendered changes.  Responses in progress may still be sending a body
+ * which has since been replaced; such bodies are freed once no longer used.
+ */
+struct metrics_cache {
+  pool *pool;
+  int64_t data_version;
+  const char *etag;
+  char *body;
+  size_t bodylen;
+
+  unsigned int refcount;
+  int stale;
+};
+
 struct prom_http {
   pool *pool;
   struct prom_registry *registry;
   struct MHD_Daemon *mhd;
+
+  /* For worker processes, the exporter process which forked us. */
+  pid_t parent_pid;
+
+  /* Compression settings, and the long-lived deflate state which is reset
+   * and reused for each gzipped response.
+   */
+  int compress_level;
+  int compress_strategy;
+#if defined(HAVE_ZLIB_H)
+  z_stream *zstrm;
+  int zstrm_busy;
+#endif /* HAVE_ZLIB_H */
+
+  /* Cached response bodies, per exposition format and content encoding. */
+  struct metrics_cache
+    *caches[PROM_HTTP_FORMAT_COUNT][PROM_HTTP_ENCODING_COUNT];
+
+  /* Snapshots of the metrics, rendered by another process, if any. */
+  struct prom_snapshot *snapshot;
+
+  /* Identifies the exporter, for our ETags; exporter workers sharing the
+   * same address must use the same ID (see prom_http_set_etag_id()).
+   */
+  char etag_id[40];
 };
 
 /* HTTP Basic Auth settings. */
@@ -132,6 +200,110 @@ static int can_gzip(struct MHD_Connection *conn) {
   return FALSE;
 }
 
+static char *trim_space(char *str) {
+  size_t len;
+
+  while (*str == ' ' ||
+         *str == '\t') {
+    str++;
+  }
+
+  len = strlen(str);
+  while (len > 0 &&
+         (str[len-1] == ' ' || str[len-1] == '\t')) {
+    str[--len] = '\0';
+  }
+
+  return str;
+}
+
+/* Returns the exposition format which the client prefers, per the media
+ * ranges, and their q-values, in its Accept header.  The protobuf and
+ * OpenMetrics formats are only used when asked for at least as strongly as
+ * the text format; on a tie between them, protobuf wins.
+ */
+static int get_accept_format(pool *p, struct MHD_Connection *conn) {
+  const char *accept;
+  char *ranges, *range;
+  double proto_q = 0.0, om_q = 0.0, text_q = 0.0;
+
+  accept = MHD_lookup_connection_value(conn, MHD_HEADER_KIND,
+    MHD_HTTP_HEADER_ACCEPT);
+  if (accept == NULL) {
+    return PROM_HTTP_FORMAT_TEXT;
+  }
+
+  pr_trace_msg(trace_channel, 19, "found Accept request header: '%s'",
+    accept);
+
+  ranges = pstrdup(p, accept);
+  while ((range = strsep(&ranges, ",")) != NULL) {
+    char *media_type, *param;
+    double q = 1.0;
+    int is_family = FALSE, is_delimited = FALSE;
+
+    media_type = trim_space(strsep(&range, ";"));
+
+    while ((param = strsep(&range, ";")) != NULL) {
+      char *name, *value;
+
+      value = trim_space(param);
+      name = strsep(&value, "=");
+      if (value == NULL) {
+        continue;
+      }
+
+      name = trim_space(name);
+      value = trim_space(value);
+
+      if (strcasecmp(name, "q") == 0) {
+        q = strtod(value, NULL);
+
+      } else if (strcasecmp(name, "proto") == 0 &&
+                 strcmp(value, "io.prometheus.client.MetricFamily") == 0) {
+        is_family = TRUE;
+
+      } else if (strcasecmp(name, "encoding") == 0 &&
+                 strcmp(value, "delimited") == 0) {
+        is_delimited = TRUE;
+      }
+    }
+
+    if (strcasecmp(media_type, "application/vnd.google.protobuf") == 0) {
+      if (is_family == TRUE &&
+          is_delimited == TRUE &&
+          q > proto_q) {
+        proto_q = q;
+      }
+
+    } else if (strcasecmp(media_type, "application/openmetrics-text") == 0) {
+      if (q > om_q) {
+        om_q = q;
+      }
+
+    } else if (strcasecmp(media_type, "text/plain") == 0 ||
+               strcasecmp(media_type, "text/*") == 0 ||
+               strcmp(media_type, "*/*") == 0) {
+      if (q > text_q) {
+        text_q = q;
+      }
+    }
+  }
+
+  if (proto_q > 0.0 &&
+      proto_q >= text_q &&
+      proto_q >= om_q) {
+    return PROM_HTTP_FORMAT_PROTOBUF;
+  }
+
+  if (om_q > 0.0 &&
+      om_q >= text_q) {
+    return PROM_HTTP_FORMAT_OPENMETRICS;
+  }
+
+  return PROM_HTTP_FORMAT_TEXT;
+}
+
 #if defined(HAVE_ZLIB_H)
 static const char *zlib_strerror(int zerrno) {
   const char *zstr = "unknown";
@@ -178,69 +350,505 @@ static const char *zlib_strerror(int zerrno) {
 }
 #endif /* HAVE_ZLIB_H */
 
-static const char *gzip_text(pool *p, const char *text, size_t text_len,
-    size_t *gzipped_textlen) {
+/* Streamed /metrics responses.  The text for each metric is obtained from
+ * the registry, and copied (or compressed) into the buffers provided by
+ * libmicrohttpd, as needed.  When the registry can tell us whether its data
+ * has changed, the response body is also collected, for caching.
+ */
+struct metrics_stream {
+  pool *pool;
+  struct prom_http *http;
+  struct prom_registry_iter *iter;
+  int format;
+  int encoding;
+  int done;
+
+  /* When sending a cached body, the body and how much of it has been sent. */
+  struct metrics_cache *cache;
+  size_t cachepos;
+
+  /* When rendering a cacheable body, the data version from which it is
+   * rendered, and the body so far.
+   */
+  int cacheable;
+  int64_t data_version;
+  pool *body_pool;
+  char *body;
+  size_t bodylen, bodysz;
+
+  /* The current metric text, and how much of it has been consumed. */
+  pool *text_pool;
+  const char *text;
+  size_t textlen;
+  size_t textpos;
+  int eof;
+
+#if defined(HAVE_ZLIB_H)
+  z_stream *zstrm;
+  int zfinished;
+#endif /* HAVE_ZLIB_H */
+
+  /* For CLF logging, once the response is done. */
+  const char *remote_ip;
+  const char *username;
+  const char *http_method;
+  const char *http_uri;
+  const char *http_version;
+  size_t resplen;
+};
+
+static void log_clf_msg(pool *p, const char *remote_ip, const char *username,
+    const char *http_method, const char *http_uri, const char *http_version,
+    unsigned int status_code, size_t resplen);
+
+/* The ETag of a response, derived from the data version of its body, the
+ * exposition format and content encoding, e.g. `"1f2e.5f3a9c1b-v42-om-gzip"`.
+ * It is thus known before the body is rendered.
+ */
+static const char *get_etag(pool *p, struct prom_http *http,
+    int64_t data_version, int format, int encoding) {
+  char etag[96];
+
+  memset(etag, '\0', sizeof(etag));
+  snprintf(etag, sizeof(etag)-1, "\"%s-v%lld%s%s\"", http->etag_id,
+    (long long) data_version,
+    format == PROM_HTTP_FORMAT_PROTOBUF ? "-pb" :
+      format == PROM_HTTP_FORMAT_OPENMETRICS ? "-om" : "",
+    encoding == PROM_HTTP_ENCODING_GZIP ? "-gzip" : "");
+  return pstrdup(p, etag);
+}
+
+/* Makes sure that the stream has pending text, fetching the text for the
+ * next metric as needed.  Returns -1 once all of the text has been consumed.
+ */
+static int stream_next_text(struct metrics_stream *stream) {
+  while (stream->textpos >= stream->textlen) {
+    const char *text;
+    size_t textlen = 0;
+
+    if (stream->eof == TRUE) {
+      return -1;
+    }
+
+    if (stream->text_pool != NULL) {
+      destroy_pool(stream->text_pool);
+    }
+
+    stream->text_pool = make_sub_pool(stream->pool);
+    pr_pool_tag(stream->text_pool, "Prometheus metric text pool");
+
+    text = prom_registry_iter_next(stream->text_pool, stream->iter, &textlen);
+    if (text == NULL) {
+      stream->eof = TRUE;
+      return -1;
+    }
+
+    stream->text = text;
+    stream->textlen = textlen;
+    stream->textpos = 0;
+  }
+
+  return 0;
+}
+
+#if defined(HAVE_ZLIB_H)
+static ssize_t stream_read_gzip(struct metrics_stream *stream, char *buf,
+    size_t bufsz) {
+  int res;
+  z_stream *zstrm;
+  size_t len;
+
+  if (stream->zfinished == TRUE) {
+    return MHD_CONTENT_READER_END_OF_STREAM;
+  }
+
+  zstrm = stream->zstrm;
+  zstrm->next_out = (Bytef *) buf;
+  zstrm->avail_out = bufsz;
+
+  while (zstrm->avail_out > 0) {
+    if (stream_next_text(stream) == 0) {
+      zstrm->next_in = (Bytef *) (stream->text + stream->textpos);
+      zstrm->avail_in = stream->textlen - stream->textpos;
+
+      res = deflate(zstrm, Z_NO_FLUSH);
+      stream->textpos = stream->textlen - zstrm->avail_in;
+
+    } else {
+      zstrm->next_in = Z_NULL;
+      zstrm->avail_in = 0;
+
+      res = deflate(zstrm, Z_FINISH);
+      if (res == Z_STREAM_END) {
+        stream->zfinished = TRUE;
+        break;
+      }
+    }
+
+    if (res != Z_OK &&
+        res != Z_BUF_ERROR) {
+      pr_trace_msg(trace_channel, 1, "error compressing data: %s",
+        zstrm->msg ? zstrm->msg : zlib_strerror(res));
+      return MHD_CONTENT_READER_END_WITH_ERROR;
+    }
+  }
+
+  len = bufsz - zstrm->avail_out;
+  if (len == 0) {
+    return MHD_CONTENT_READER_END_OF_STREAM;
+  }
+
+  return (ssize_t) len;
+}
+#endif /* HAVE_ZLIB_H */
+
+static ssize_t stream_read_cache(struct metrics_stream *stream, char *buf,
+    size_t bufsz) {
+  struct metrics_cache *cache;
+  size_t len;
+
+  cache = stream->cache;
+  len = cache->bodylen - stream->cachepos;
+  if (len == 0) {
+    return MHD_CONTENT_READER_END_OF_STREAM;
+  }
+
+  if (len > bufsz) {
+    len = bufsz;
+  }
+
+  memcpy(buf, cache->body + stream->cachepos, len);
+  stream->cachepos += len;
+
+  return (ssize_t) len;
+}
+
+static ssize_t stream_read_text(struct metrics_stream *stream, char *buf,
+    size_t bufsz) {
+  size_t len = 0;
+
+  while (len < bufsz) {
+    size_t n;
+
+    if (stream_next_text(stream) < 0) {
+      break;
+    }
+
+    n = stream->textlen - stream->textpos;
+    if (n > (bufsz - len)) {
+      n = bufsz - len;
+    }
+
+    memcpy(buf + len, stream->text + stream->textpos, n);
+    stream->textpos += n;
+    len += n;
+  }
+
+  if (len == 0) {
+    return MHD_CONTENT_READER_END_OF_STREAM;
+  }
+
+  return (ssize_t) len;
+}
+
+/* Appends the given response data to the body being collected for caching.
+ */
+static void stream_add_body(struct metrics_stream *stream, const char *data,
+    size_t datalen) {
+  if (stream->bodylen + datalen > stream->bodysz) {
+    char *body;
+    size_t bodysz;
+
+    bodysz = stream->bodysz > 0 ? stream->bodysz * 2 :
+      PROM_HTTP_RESPONSE_BLOCK_SIZE;
+    while (bodysz < stream->bodylen + datalen) {
+      bodysz *= 2;
+    }
+
+    body = palloc(stream->body_pool, bodysz);
+    if (stream->bodylen > 0) {
+      memcpy(body, stream->body, stream->bodylen);
+    }
+
+    stream->body = body;
+    stream->bodysz = bodysz;
+  }
+
+  memcpy(stream->body + stream->bodylen, data, datalen);
+  stream->bodylen += datalen;
+}
+
+static ssize_t stream_read_cb(void *user_data, uint64_t pos, char *buf,
+    size_t bufsz) {
+  struct metrics_stream *stream;
+  ssize_t len;
+
+  stream = user_data;
+
+  if (stream->cache != NULL) {
+    len = stream_read_cache(stream, buf, bufsz);
+
 #if defined(HAVE_ZLIB_H)
+  } else if (stream->zstrm != NULL) {
+    len = stream_read_gzip(stream, buf, bufsz);
+#endif /* HAVE_ZLIB_H */
+
+  } else {
+    len = stream_read_text(stream, buf, bufsz);
+  }
+
+  if (len == MHD_CONTENT_READER_END_OF_STREAM) {
+    stream->done = TRUE;
+    return len;
+  }
+
+  if (len < 0) {
+    return len;
+  }
+
+  if (stream->cacheable == TRUE) {
+    stream_add_body(stream, buf, len);
+  }
+
+  stream->resplen += len;
+  return len;
+}
+
+static void cache_free(struct metrics_cache *cache) {
+  if (cache->refcount == 0) {
+    destroy_pool(cache->pool);
+
+  } else {
+    /* Still being sent; it will be freed once the last response using it
+     * is done.
+     */
+    cache->stale = TRUE;
+  }
+}
+
+static void cache_drop(struct prom_http *http, int format, int encoding) {
+  struct metrics_cache *cache;
+
+  cache = http->caches[format][encoding];
+  if (cache != NULL) {
+    http->caches[format][encoding] = NULL;
+    cache_free(cache);
+  }
+}
+
+static void cache_release(struct metrics_cache *cache) {
+  cache->refcount--;
+
+  if (cache->refcount == 0 &&
+      cache->stale == TRUE) {
+    destroy_pool(cache->pool);
+  }
+}
+
+/* Caches the completely rendered body of the given stream. */
+static void cache_add(struct metrics_stream *stream) {
+  struct prom_http *http;
+  struct metrics_cache *cache;
+
+  http = stream->http;
+
+  cache = pcalloc(stream->body_pool, sizeof(struct metrics_cache));
+  cache->pool = stream->body_pool;
+  cache->data_version = stream->data_version;
+  cache->body = stream->body;
+  cache->bodylen = stream->bodylen;
+
+  cache->etag = get_etag(cache->pool, http, stream->data_version,
+    stream->format, stream->encoding);
+
+  cache_drop(http, stream->format, stream->encoding);
+  http->caches[stream->format][stream->encoding] = cache;
+
+  stream->body_pool = NULL;
+  pr_trace_msg(trace_channel, 15,
+    "cached %lu byte response body (data version %lld, ETag %s)",
+    (unsigned long) cache->bodylen, (long long) cache->data_version,
+    cache->etag);
+}
+
+#if defined(HAVE_ZLIB_H)
+static z_stream *deflate_init(pool *p, int level, int strategy) {
   int res;
   z_stream *zstrm;
-  unsigned char *output_buf = NULL;
-  const char *gzipped_text = NULL;
 
   zstrm = pcalloc(p, sizeof(z_stream));
   zstrm->zalloc = Z_NULL;
   zstrm->zfree = Z_NULL;
   zstrm->opaque = Z_NULL;
 
-  zstrm->next_in = (Bytef *) text;
-  zstrm->avail_in = zstrm->total_in = text_len;
-
-  /* It's possible that it may require more room to compress the given
-   * text, especially if it's small.  Be prepared.
-   */
-  zstrm->avail_out = zstrm->total_out = (text_len * 3);
-  zstrm->next_out = output_buf = pcalloc(p, zstrm->avail_out);
-
   /* Note that it is IMPORTANT that the `windowBits` value be 31 or more here,
    * to indicate to zlib that it should add a gzip header.  Subtle magic.
    */
-  res = deflateInit2(zstrm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 31, 8,
-    Z_DEFAULT_STRATEGY);
+  res = deflateInit2(zstrm, level, Z_DEFLATED, 31, 8, strategy);
   if (res != Z_OK) {
-    deflateEnd(zstrm);
     pr_trace_msg(trace_channel, 1,
       "error initializing zlib for deflation: %s (%d)",
       zstrm->msg ? zstrm->msg : zlib_strerror(res), res);
+    errno = EPERM;
     return NULL;
   }
 
+  return zstrm;
+}
+
+static void deflate_release(struct metrics_stream *stream) {
+  struct prom_http *http;
+
+  http = stream->http;
+  if (stream->zstrm == http->zstrm) {
+    http->zstrm_busy = FALSE;
+
+  } else {
+    deflateEnd(stream->zstrm);
+  }
+
+  stream->zstrm = NULL;
+}
+#endif /* HAVE_ZLIB_H */
+
+static void stream_free_cb(void *user_data) {
+  struct metrics_stream *stream;
+
+  stream = user_data;
+
+#if defined(HAVE_ZLIB_H)
+  if (stream->zstrm != NULL) {
+    deflate_release(stream);
+  }
+#endif /* HAVE_ZLIB_H */
+
+  if (stream->cache != NULL) {
+    cache_release(stream->cache);
+
+  } else if (stream->cacheable == TRUE &&
+             stream->done == TRUE) {
+    cache_add(stream);
+  }
+
+  if (stream->body_pool != NULL) {
+    destroy_pool(stream->body_pool);
+  }
+
+  log_clf_msg(stream->pool, stream->remote_ip, stream->username,
+    stream->http_method, stream->http_uri, stream->http_version, MHD_HTTP_OK,
+    stream->resplen);
+
+  if (stream->iter != NULL) {
+    (void) prom_registry_iter_close(stream->iter);
+  }
+
+  destroy_pool(stream->pool);
+}
+
+static int stream_init_gzip(struct metrics_stream *stream) {
+#if defined(HAVE_ZLIB_H)
+  int res;
+  struct prom_http *http;
+  z_stream *zstrm;
+
+  http = stream->http;
+
+  /* Reuse the exporter's deflate state, if it is not already in use by
+   * another response; only allocate a fresh one when it is.
+   */
+  if (http->zstrm != NULL &&
+      http->zstrm_busy == FALSE) {
+    zstrm = http->zstrm;
+
+    res = deflateReset(zstrm);
+    if (res != Z_OK) {
+      pr_trace_msg(trace_channel, 1, "error resetting zlib deflation: %s (%d)",
+        zstrm->msg ? zstrm->msg : zlib_strerror(res), res);
+      deflateEnd(zstrm);
+      http->zstrm = NULL;
+    }
+  }
+
+  if (http->zstrm == NULL) {
+    http->zstrm = deflate_init(http->pool, http->compress_level,
+      http->compress_strategy);
+    if (http->zstrm == NULL) {
+      return -1;
+    }
+
+    http->zstrm_busy = FALSE;
+  }
+
+  if (http->zstrm_busy == FALSE) {
+    zstrm = http->zstrm;
+    http->zstrm_busy = TRUE;
+
+  } else {
+    zstrm = deflate_init(stream->pool, http->compress_level,
+      http->compress_strategy);
+    if (zstrm == NULL) {
+      return -1;
+    }
+  }
+
+  stream->zstrm = zstrm;
+
+  /* Note that deflateReset() discards any previously set header, thus we
+   * set it for every response.
+   */
   res = deflateSetHeader(zstrm, &gzip_header);
   if (res != Z_OK) {
-    deflateEnd(zstrm);
     pr_trace_msg(trace_channel, 1, "error setting gzip header: %s (%d)",
       zstrm->msg ? zstrm->msg : zlib_strerror(res), res);
-    return NULL;
+    deflate_release(stream);
+    errno = EPERM;
+    return -1;
   }
 
-  res = deflate(zstrm, Z_FINISH);
-  if (res != Z_STREAM_END) {
-    deflateEnd(zstrm);
-    pr_trace_msg(trace_channel, 1, "error compressing data: %s",
-      zstrm->msg ? zstrm->msg : zlib_strerror(res));
-    return NULL;
-  }
+  return 0;
+#else
+  errno = ENOSYS;
+  return -1;
+#endif /* HAVE_ZLIB_H */
+}
 
-  pr_trace_msg(trace_channel, 19, "available compressed text: %lu bytes",
-    (unsigned long) zstrm->total_out);
-  *gzipped_textlen = zstrm->total_out;
-  gzipped_text = pcalloc(p, *gzipped_textlen);
-  memcpy((char *) gzipped_text, output_buf, *gzipped_textlen);
+/* Checks whether the given If-None-Match header value, a list of ETags,
+ * matches the given ETag.  Per RFC 9110, weak comparison is used.
+ */
+static int etag_matches(const char *header, const char *etag) {
+  const char *ptr;
+  size_t etaglen;
 
-  deflateEnd(zstrm);
-  return gzipped_text;
-#endif /* HAVE_ZLIB_H */
+  etaglen = strlen(etag);
+  ptr = header;
 
-  errno = ENOSYS;
-  return NULL;
+  while (*ptr != '\0') {
+    size_t toklen;
+
+    while (*ptr == ' ' ||
+           *ptr == '\t' ||
+           *ptr == ',') {
+      ptr++;
+    }
+
+    if (strncmp(ptr, "W/", 2) == 0) {
+      ptr += 2;
+    }
+
+    toklen = strcspn(ptr, " \t,");
+    if (toklen == 0) {
+      break;
+    }
+
+    if ((toklen == 1 && *ptr == '*') ||
+        (toklen == etaglen && strncmp(ptr, etag, etaglen) == 0)) {
+      return TRUE;
+    }
+
+    ptr += toklen;
+  }
+
+  return FALSE;
 }
 
 static const char *get_ip_text(pool *p, const struct sockaddr *sa) {
@@ -280,12 +888,22 @@ static const char *get_ip_text(pool *p, const struct sockaddr *sa) {
   return remote_ip;
 }
 
-static void log_clf(pool *p, struct MHD_Connection *conn, const char *username,
+static const char *get_conn_ip_text(pool *p, struct MHD_Connection *conn) {
+  const union MHD_ConnectionInfo *conn_info = NULL;
+
+  conn_info = MHD_get_connection_info(conn, MHD_CONNECTION_INFO_CLIENT_ADDRESS,
+    NULL);
+  if (conn_info == NULL) {
+    return "unknown";
+  }
+
+  return get_ip_text(p, conn_info->client_addr);
+}
+
+static void log_clf_msg(pool *p, const char *remote_ip, const char *username,
     const char *http_method, const char *http_uri, const char *http_version,
     unsigned int status_code, size_t resplen) {
   int clf_level = 1, res;
-  const union MHD_ConnectionInfo *conn_info = NULL;
-  const char *remote_ip = NULL;
   char timestamp[128];
   struct tm *tm;
   time_t now;
@@ -301,14 +919,10 @@ static void log_clf(pool *p, struct MHD_Connection *conn, const char *username,
     return;
   }
 
-  conn_info = MHD_get_connection_info(conn, MHD_CONNECTION_INFO_CLIENT_ADDRESS,
-    NULL);
   if (username == NULL) {
     username = "-";
   }
 
-  remote_ip = get_ip_text(p, conn_info->client_addr);
-
   memset(timestamp, '\0', sizeof(timestamp));
   strftime(timestamp, sizeof(timestamp)-1, "%d/%b/%Y:%H:%M:%S %z", tm);
 
@@ -317,6 +931,18 @@ static void log_clf(pool *p, struct MHD_Connection *conn, const char *username,
     status_code, (unsigned long) resplen);
 }
 
+static void log_clf(pool *p, struct MHD_Connection *conn, const char *username,
+    const char *http_method, const char *http_uri, const char *http_version,
+    unsigned int status_code, size_t resplen) {
+
+  if (pr_trace_get_level(clf_channel) < 1) {
+    return;
+  }
+
+  log_clf_msg(p, get_conn_ip_text(p, conn), username, http_method, http_uri,
+    http_version, status_code, resplen);
+}
+
 #if MHD_VERSION < 0x00097002
 static int handle_request_cb(void *user_data,
     struct MHD_Connection *conn, const char *http_uri, const char *http_method,
@@ -337,6 +963,7 @@ static enum MHD_Result handle_request_cb(void *user_data,
   int res;
 
   http = user_data;
+
   resp_pool = make_sub_pool(http->pool);
   pr_pool_tag(resp_pool, "Prometheus response pool");
 
@@ -379,8 +1006,18 @@ static enum MHD_Result handle_request_cb(void *user_data,
   }
 
   if (strcmp(http_uri, "/metrics") == 0) {
-    int xerrno, use_gzip = FALSE;
+    int xerrno, use_gzip = FALSE, have_version = FALSE;
+    const char *snapshot_text = NULL;
+    size_t snapshot_textlen = 0;
+    int format = PROM_HTTP_FORMAT_TEXT;
+    int encoding = PROM_HTTP_ENCODING_IDENTITY;
     char *request_username = NULL;
+    pool *stream_pool;
+    int64_t data_version = 0;
+    uint64_t resp_size = MHD_SIZE_UNKNOWN;
+    struct prom_registry_iter *iter = NULL;
+    struct metrics_cache *cache = NULL;
+    struct metrics_stream *stream;
 
     if (http_username != NULL) {
       char *request_password = NULL;
@@ -459,10 +1096,148 @@ static enum MHD_Result handle_request_cb(void *user_data,
       pr_trace_msg(trace_channel, 19, "exporter received /metrics request");
     }
 
-    text = prom_registry_get_text(resp_pool, http->registry);
+    use_gzip = can_gzip(conn);
+    if (use_gzip == TRUE) {
+      encoding = PROM_HTTP_ENCODING_GZIP;
+    }
+
+    format = get_accept_format(resp_pool, conn);
+    if (format == PROM_HTTP_FORMAT_PROTOBUF) {
+      pr_trace_msg(trace_channel, 12,
+        "client prefers protobuf exposition format");
+
+    } else if (format == PROM_HTTP_FORMAT_OPENMETRICS) {
+      pr_trace_msg(trace_channel, 12,
+        "client prefers OpenMetrics exposition format");
+    }
+
+    /* If the data has not changed since we last rendered it, we can use the
+     * cached body, and avoid querying the database again.  When snapshots
+     * are rendered for us, we use the snapshot generation instead.
+     */
+    if (http->snapshot != NULL) {
+      uint64_t generation = 0;
+
+      if (prom_snapshot_get_generation(http->snapshot, &generation) == 0 &&
+          generation > 0) {
+        have_version = TRUE;
+        data_version = (int64_t) generation;
+      }
+
+    } else if (prom_registry_get_data_version(resp_pool, http->registry,
+        &data_version) == 0) {
+      have_version = TRUE;
+    }
+
+    if (have_version == TRUE) {
+      register unsigned int i, j;
+
+      for (i = 0; i < PROM_HTTP_FORMAT_COUNT; i++) {
+        for (j = 0; j < PROM_HTTP_ENCODING_COUNT; j++) {
+          if (http->caches[i][j] != NULL &&
+              http->caches[i][j]->data_version != data_version) {
+            cache_drop(http, i, j);
+          }
+        }
+      }
+
+      cache = http->caches[format][encoding];
+    }
+
+    /* The client may have the current response, whether or not we have it
+     * cached.
+     */
+    if (have_version == TRUE) {
+      const char *etag, *if_none_match;
+
+      etag = get_etag(resp_pool, http, data_version, format, encoding);
+      if_none_match = MHD_lookup_connection_value(conn, MHD_HEADER_KIND,
+        MHD_HTTP_HEADER_IF_NONE_MATCH);
+      if (if_none_match != NULL &&
+          etag_matches(if_none_match, etag) == TRUE) {
+        pr_trace_msg(trace_channel, 12,
+          "client has current /metrics response (ETag %s), not modified",
+          etag);
+
+        status_code = MHD_HTTP_NOT_MODIFIED;
+        resp = MHD_create_response_from_buffer(0, (void *) "",
+          MHD_RESPMEM_PERSISTENT);
+        (void) MHD_add_response_header(resp, MHD_HTTP_HEADER_ETAG, etag);
+        res = MHD_queue_response(conn, status_code, resp);
+        MHD_destroy_response(resp);
+
+        log_clf(resp_pool, conn, request_username, http_method, http_uri,
+          http_version, status_code, 0);
+        destroy_pool(resp_pool);
+
+        return res;
+      }
+
+    }
+
+    /* The stream, and its pool, live until libmicrohttpd is done with the
+     * response; see stream_free_cb().
+     */
+    stream_pool = make_sub_pool(http->pool);
+    pr_pool_tag(stream_pool, "Prometheus response stream pool");
+
+    /* Snapshots hold all of the exposition formats; a snapshot published
+     * without the requested format is rendered directly instead.
+     */
+    if (cache == NULL &&
+        http->snapshot != NULL &&
+        have_version == TRUE) {
+      uint64_t generation = 0;
+
+      if (format == PROM_HTTP_FORMAT_PROTOBUF) {
+        snapshot_text = prom_snapshot_get_proto(stream_pool, http->snapshot,
+          &snapshot_textlen, &generation);
+
+      } else if (format == PROM_HTTP_FORMAT_OPENMETRICS) {
+        snapshot_text = prom_snapshot_get_openmetrics(stream_pool,
+          http->snapshot, &snapshot_textlen, &generation);
+
+      } else {
+        snapshot_text = prom_snapshot_get(stream_pool, http->snapshot,
+          &snapshot_textlen, &generation);
+      }
+
+      if (snapshot_text != NULL) {
+        data_version = (int64_t) generation;
+
+      } else {
+        pr_trace_msg(trace_channel, 3,
+          "error getting snapshot, rendering metrics directly: %s",
+          strerror(errno));
+        have_version = FALSE;
+      }
+    }
+
+    /* Without a cached body or a snapshot, we render the metrics as we
+     * go.
+     */
+    if (cache == NULL &&
+        snapshot_text == NULL) {
+      iter = prom_registry_iter_open(http->pool, http->registry);
+      if (iter != NULL) {
+        if (format == PROM_HTTP_FORMAT_PROTOBUF) {
+          (void) prom_registry_iter_set_format(iter,
+            PROM_REGISTRY_FORMAT_PROTOBUF);
+
+        } else if (format == PROM_HTTP_FORMAT_OPENMETRICS) {
+          (void) prom_registry_iter_set_format(iter,
+            PROM_REGISTRY_FORMAT_OPENMETRICS);
+        }
+      }
+    }
+
     xerrno = errno;
 
-    if (text == NULL) {
+    if (cache == NULL &&
+        snapshot_text == NULL &&
+        iter == NULL) {
+      destroy_pool(stream_pool);
+
       pr_trace_msg(trace_channel, 3, "error getting registry text: %s",
         strerror(xerrno));
 
@@ -499,50 +1274,98 @@ static enum MHD_Result handle_request_cb(void *user_data,
       return res;
     }
 
-    textlen = strlen(text);
-    status_code = MHD_HTTP_OK;
+    stream = pcalloc(stream_pool, sizeof(struct metrics_stream));
+    stream->pool = stream_pool;
+    stream->http = http;
+    stream->iter = iter;
+    stream->format = format;
+    stream->encoding = encoding;
+    stream->http_method = pstrdup(stream_pool, http_method);
+    stream->http_uri = pstrdup(stream_pool, http_uri);
+    stream->http_version = pstrdup(stream_pool, http_version);
+    if (request_username != NULL) {
+      stream->username = pstrdup(stream_pool, request_username);
+    }
 
-    use_gzip = can_gzip(conn);
-    if (use_gzip == TRUE) {
-      const char *gzipped_text = NULL;
-      size_t gzipped_textlen = 0;
+    if (pr_trace_get_level(clf_channel) >= 1) {
+      stream->remote_ip = get_conn_ip_text(stream_pool, conn);
+    }
+
+    status_code = MHD_HTTP_OK;
 
+    if (cache != NULL) {
       pr_trace_msg(trace_channel, 12,
-        "client indicates support for gzip-compressed content, "
-        "attempting to compress text (%lu bytes):\n%.*s",
-        (unsigned long) textlen, (int) textlen, text);
-      gzipped_text = gzip_text(resp_pool, text, textlen, &gzipped_textlen);
-      if (gzipped_text != NULL) {
-        text = gzipped_text;
-        textlen = gzipped_textlen;
-        pr_trace_msg(trace_channel, 19,
-          "registry text:\n(gzip compressed, %lu bytes)", (size_t) textlen);
+        "using cached /metrics response (data version %lld)",
+        (long long) data_version);
+      stream->cache = cache;
+      cache->refcount++;
+      resp_size = cache->bodylen;
 
-      } else {
-        use_gzip = FALSE;
+    } else {
+      if (use_gzip == TRUE) {
+        pr_trace_msg(trace_channel, 12,
+          "client indicates support for gzip-compressed content, "
+          "compressing text");
+        if (stream_init_gzip(stream) < 0) {
+          use_gzip = FALSE;
+          stream->encoding = PROM_HTTP_ENCODING_IDENTITY;
+        }
       }
 
-    } else {
-      pr_trace_msg(trace_channel, 19, "registry text:\n%.*s", (int) textlen,
-        text);
+      if (have_version == TRUE) {
+        stream->cacheable = TRUE;
+        stream->data_version = data_version;
+        stream->body_pool = make_sub_pool(http->pool);
+        pr_pool_tag(stream->body_pool, "Prometheus response cache pool");
+      }
+
+      if (snapshot_text != NULL) {
+        pr_trace_msg(trace_channel, 12,
+          "using snapshot generation %lld for /metrics response",
+          (long long) data_version);
+        stream->text = snapshot_text;
+        stream->textlen = snapshot_textlen;
+        stream->eof = TRUE;
+      }
+    }
+
+    resp = MHD_create_response_from_callback(resp_size,
+      PROM_HTTP_RESPONSE_BLOCK_SIZE, stream_read_cb, stream, stream_free_cb);
+    if (resp == NULL) {
+      pr_trace_msg(trace_channel, 3, "error creating streamed response");
+      stream_free_cb(stream);
+      destroy_pool(resp_pool);
+      return MHD_NO;
     }
 
-    resp = MHD_create_response_from_buffer(textlen, (void *) text,
-      MHD_RESPMEM_MUST_COPY);
     (void) MHD_add_response_header(resp, MHD_HTTP_HEADER_CONTENT_TYPE,
-      "text/plain");
+      format == PROM_HTTP_FORMAT_PROTOBUF ? PROM_HTTP_PROTOBUF_CONTENT_TYPE :
+        format == PROM_HTTP_FORMAT_OPENMETRICS ?
+          PROM_HTTP_OPENMETRICS_CONTENT_TYPE : "text/plain");
+    (void) MHD_add_response_header(resp, MHD_HTTP_HEADER_VARY,
+      MHD_HTTP_HEADER_ACCEPT_ENCODING ", " MHD_HTTP_HEADER_ACCEPT);
     if (use_gzip == TRUE) {
       (void) MHD_add_response_header(resp, MHD_HTTP_HEADER_CONTENT_ENCODING,
         "gzip");
     }
 
+    /* Cacheable responses get their ETag now, while being rendered, so that
+     * clients can revalidate them whether or not they were cached.
+     */
+    if (cache != NULL) {
+      (void) MHD_add_response_header(resp, MHD_HTTP_HEADER_ETAG, cache->etag);
+
+    } else if (stream->cacheable == TRUE) {
+      (void) MHD_add_response_header(resp, MHD_HTTP_HEADER_ETAG,
+        get_etag(stream->pool, http, stream->data_version, stream->format,
+          stream->encoding));
+    }
+
     res = MHD_queue_response(conn, status_code, resp);
     MHD_destroy_response(resp);
 
-    log_clf(resp_pool, conn, request_username, http_method, http_uri,
-      http_version, status_code, textlen);
+    /* Note that the CLF logging happens once the response has been sent. */
     destroy_pool(resp_pool);
-
     return res;
   }
 
@@ -569,16 +1392,17 @@ static enum MHD_Result handle_request_cb(void *user_data,
 
 struct prom_http *prom_http_start(pool *p, const pr_netaddr_t *addr,
     struct prom_registry *registry, const char *username,
-    const char *password) {
+    const char *password, unsigned int max_conns, int flags) {
   struct prom_http *http;
   pool *http_pool;
   struct MHD_Daemon *mhd;
-  unsigned int http_port;
-  int flags;
+  unsigned int http_port, reuse_addr = 0;
+  int mhd_flags;
 
   if (p == NULL ||
       addr == NULL ||
-      registry == NULL) {
+      registry == NULL ||
+      max_conns > PROM_HTTP_MAX_CONNECTIONS) {
     errno = EINVAL;
     return NULL;
   }
@@ -589,18 +1413,41 @@ struct prom_http *prom_http_start(pool *p, const pr_netaddr_t *addr,
   http = pcalloc(http_pool, sizeof(struct prom_http));
   http->pool = http_pool;
   http->registry = registry;
+  http->compress_level = PROM_HTTP_DEFAULT_COMPRESS_LEVEL;
+  http->compress_strategy = PROM_HTTP_COMPRESS_STRATEGY_DEFAULT;
+  snprintf(http->etag_id, sizeof(http->etag_id)-1, "%lx.%lx",
+    (unsigned long) getpid(), (unsigned long) time(NULL));
+
+  if (max_conns == 0) {
+    max_conns = PROM_HTTP_DEFAULT_MAX_CONNECTIONS;
+  }
+
+  /* Multiple exporter processes can listen on the same address; the kernel
+   * then distributes the incoming connections among them.
+   */
+  if (flags & PROM_HTTP_FL_SHARED_ADDR) {
+    reuse_addr = 1;
+  }
 
   http_port = ntohs(pr_netaddr_get_port(addr));
-  pr_trace_msg(trace_channel, 9, "starting exporter %son %s:%u",
+  pr_trace_msg(trace_channel, 9,
+    "starting exporter %son %s:%u (max %u connections)",
     username != NULL ? "requiring basic auth " : "",
-    pr_netaddr_get_ipstr(addr), http_port);
+    pr_netaddr_get_ipstr(addr), http_port, max_conns);
 
-  flags = MHD_USE_INTERNAL_POLLING_THREAD|MHD_USE_ERROR_LOG|MHD_USE_DEBUG;
-  mhd = MHD_start_daemon(flags, http_port, NULL, NULL,
+  /* Note that we use a single polling thread, rather than a thread pool: the
+   * request handling uses memory pools and a database handle, neither of
+   * which can be shared between threads.  Concurrent connections are
+   * multiplexed by that thread; for more concurrency, use more processes.
+   */
+  mhd_flags = MHD_USE_INTERNAL_POLLING_THREAD|MHD_USE_AUTO|MHD_USE_ERROR_LOG|
+    MHD_USE_DEBUG;
+  mhd = MHD_start_daemon(mhd_flags, http_port, NULL, NULL,
     handle_request_cb, http,
     MHD_OPTION_EXTERNAL_LOGGER, log_cb, NULL,
-    MHD_OPTION_CONNECTION_LIMIT, 1,
+    MHD_OPTION_CONNECTION_LIMIT, max_conns,
     MHD_OPTION_CONNECTION_TIMEOUT, 10,
+    MHD_OPTION_LISTENING_ADDRESS_REUSE, reuse_addr,
     MHD_OPTION_SOCK_ADDR, pr_netaddr_get_sockaddr(addr),
     MHD_OPTION_END);
   if (mhd == NULL) {
@@ -620,6 +1467,86 @@ struct prom_http *prom_http_start(pool *p, const pr_netaddr_t *addr,
   return http;
 }
 
+int prom_http_set_compression(struct prom_http *http, int level,
+    int strategy) {
+  if (http == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (level < -1 ||
+      level > 9) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  switch (strategy) {
+    case PROM_HTTP_COMPRESS_STRATEGY_DEFAULT:
+    case PROM_HTTP_COMPRESS_STRATEGY_FILTERED:
+    case PROM_HTTP_COMPRESS_STRATEGY_HUFFMAN_ONLY:
+    case PROM_HTTP_COMPRESS_STRATEGY_RLE:
+    case PROM_HTTP_COMPRESS_STRATEGY_FIXED:
+      break;
+
+    default:
+      errno = EINVAL;
+      return -1;
+  }
+
+  http->compress_level = level;
+  http->compress_strategy = strategy;
+
+#if defined(HAVE_ZLIB_H)
+  /* Discard any idle deflate state; the next gzipped response will create
+   * one using the new settings.
+   */
+  if (http->zstrm != NULL &&
+      http->zstrm_busy == FALSE) {
+    deflateEnd(http->zstrm);
+    http->zstrm = NULL;
+  }
+#endif /* HAVE_ZLIB_H */
+
+  return 0;
+}
+
+int prom_http_set_snapshot(struct prom_http *http,
+    struct prom_snapshot *snapshot) {
+  if (http == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  http->snapshot = snapshot;
+  return 0;
+}
+
+int prom_http_set_etag_id(struct prom_http *http, const char *etag_id) {
+  if (http == NULL ||
+      etag_id == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (strlen(etag_id) >= sizeof(http->etag_id)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+
+  sstrncpy(http->etag_id, etag_id, sizeof(http->etag_id));
+  return 0;
+}
+
+int prom_http_set_parent(struct prom_http *http, pid_t parent_pid) {
+  if (http == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  http->parent_pid = parent_pid;
+  return 0;
+}
+
 int prom_http_run_loop(pool *p, struct prom_http *http) {
   unsigned long sleep_ms = 500;
 
@@ -636,6 +1563,14 @@ int prom_http_run_loop(pool *p, struct prom_http *http) {
   while (TRUE) {
     pr_timer_usleep(sleep_ms * 1000);
     pr_signals_handle();
+
+    if (http->parent_pid != 0 &&
+        getppid() != http->parent_pid) {
+      pr_trace_msg(trace_channel, 3,
+        "parent exporter process %lu has exited, stopping",
+        (unsigned long) http->parent_pid);
+      break;
+    }
   }
 
   return 0;
@@ -651,6 +1586,13 @@ int prom_http_stop(pool *p, struct prom_http *http) {
   (void) p;
   MHD_stop_daemon(http->mhd);
 
+#if defined(HAVE_ZLIB_H)
+  if (http->zstrm != NULL) {
+    deflateEnd(http->zstrm);
+    http->zstrm = NULL;
+  }
+#endif /* HAVE_ZLIB_H */
+
   return 0;
 }
 
@@ -24,11 +24,18 @@
 
 #include "mod_prometheus.h"
 #include "prometheus/metric.h"
+#include "prometheus/metric/buffer.h"
 #include "prometheus/metric/db.h"
+#include "prometheus/metric/shm.h"
+#include "prometheus/metric/sketch.h"
+#include "prometheus/proto.h"
 #include "prometheus/text.h"
 
+#include <float.h>
+#include <limits.h>
+#include <math.h>
+
 struct prom_histogram_bucket {
-  int64_t bucket_id;
   int is_inf_bucket;
   double upper_bound;
   const char *upper_bound_text;
@@ -37,6 +44,9 @@ struct prom_histogram_bucket {
 struct prom_metric {
   pool *pool;
   struct prom_dbh *dbh;
+  struct prom_metric_shm *shm;
+  struct prom_metric_buffer *buffer;
+  struct prom_metric_buffer *deferred;
   const char *name;
 
   /* Counter */
@@ -58,14 +68,72 @@ struct prom_metric {
   size_t histogram_namelen;
   const char *histogram_help;
   size_t histogram_helplen;
+  int64_t histogram_id;
   unsigned int histogram_bucket_count;
   struct prom_histogram_bucket **histogram_buckets;
-  const char *histogram_count_name;
-  int64_t histogram_count_id;
-  const char *histogram_sum_name;
-  int64_t histogram_sum_id;
+
+  /* Native histogram buckets, if enabled, are kept as sparse bins, under
+   * their own ID.
+   */
+  int histogram_native;
+  int histogram_schema;
+  int64_t histogram_native_id;
+
+  /* Summary */
+  const char *summary_name;
+  size_t summary_namelen;
+  const char *summary_help;
+  size_t summary_helplen;
+  int64_t summary_id;
+  unsigned int summary_quantile_count;
+  double *summary_quantiles;
+  const char **summary_quantile_texts;
+
+  /* Label names, for updates using label values; sorted, with the index of
+   * each name's value, as the values are given in declaration order.
+   */
+  unsigned int label_count;
+  const char **label_names;
+  size_t *label_namelens;
+  unsigned int *label_value_idxs;
 };
 
+/* Counts of the updates which could not be written to a busy database
+ * within its budget (EAGAIN), and which were deferred or dropped.
+ */
+static uint64_t busy_deferred_count = 0;
+static uint64_t busy_dropped_count = 0;
+
+/* The label text of the exemplars recorded by this process, with histogram
+ * observations; NULL if exemplars are not recorded.
+ */
+static const char *exemplar_labels = NULL;
+
+/* The base labels (e.g. "protocol") of the samples updated using label
+ * values, sorted by name, and pre-rendered as `name="value"`.
+ */
+static pool *base_labels_pool = NULL;
+static unsigned int base_label_count = 0;
+static const char **base_label_names = NULL;
+static const char **base_label_texts = NULL;
+static size_t *base_label_textlens = NULL;
+
+/* The longest label text rendered for updates using label values. */
+#define PROM_METRIC_LABELS_MAX_LEN		1024
+
+/* The space reserved, in the exposition text, for formatting a creation
+ * time, using "%.3f".
+ */
+#define PROM_METRIC_VALUE_TEXT_MAX_LEN		32
+
+/* Native histogram buckets are stored as bins keyed by their bucket index.
+ * The zero bucket, and the buckets of negative values, use keys outside of
+ * the range of the bucket indexes (at most 1024 << 8, for any double).
+ */
+#define PROM_METRIC_NATIVE_ZERO_THRESHOLD	2.938735877055719e-39
+#define PROM_METRIC_NATIVE_ZERO_KEY		INT_MIN
+#define PROM_METRIC_NATIVE_NEGATIVE_OFFSET	(1 << 22)
+
 static const char *trace_channel = "prometheus.metric";
 
 /* Returns the name of the given metric. */
@@ -78,876 +146,3989 @@ const char *prom_metric_get_name(struct prom_metric *metric) {
   return metric->name;
 }
 
-static struct prom_text *add_help_text(struct prom_text *text,
-    const char *registry_name, size_t registry_namelen,
-    const char *name, size_t namelen, const char *help, size_t helplen) {
-
-  prom_text_add_str(text, "# HELP ", 7);
-  prom_text_add_str(text, registry_name, registry_namelen);
-  prom_text_add_byte(text, '_');
-  prom_text_add_str(text, name, namelen);
-  prom_text_add_byte(text, ' ');
-  prom_text_add_str(text, help, helplen);
-  prom_text_add_str(text, ".\n", 2);
+/* Counts an update which was dropped because the datastore was busy, i.e.
+ * the database (beyond the update budget), or a shared memory slot being
+ * claimed by another process, or because the shared memory datastore was
+ * full, preserving the errno for the caller.
+ */
+static int metric_sample_busy(int res) {
+  if (res < 0 &&
+      (errno == EAGAIN || errno == ENOSPC)) {
+    busy_dropped_count++;
+  }
 
-  return text;
+  return res;
 }
 
-static struct prom_text *add_type_text(struct prom_text *text,
-    const char *registry_name, size_t registry_namelen,
-    const char *name, size_t namelen, int metric_type) {
-
-  prom_text_add_str(text, "# TYPE ", 7);
-  prom_text_add_str(text, registry_name, registry_namelen);
-  prom_text_add_byte(text, '_');
-  prom_text_add_str(text, name, namelen);
+/* Sample storage: use the shared memory datastore, if configured, otherwise
+ * the buffer, if any, otherwise the database.  Gauge increments and
+ * decrements are buffered as deltas, netted per label set.
+ */
+static int metric_sample_decr(pool *p, const struct prom_metric *metric,
+    int64_t metric_id, double val, const char *labels) {
+  if (metric->shm != NULL) {
+    return metric_sample_busy(prom_metric_shm_sample_decr(p, metric->shm,
+      metric_id, val, labels));
+  }
 
-  switch (metric_type) {
-    case PROM_METRIC_TYPE_COUNTER:
-      prom_text_add_str(text, " counter\n", 9);
-      break;
+  if (metric->buffer != NULL) {
+    return prom_metric_buffer_add(p, metric->buffer, metric_id, -val, labels);
+  }
 
-    case PROM_METRIC_TYPE_GAUGE:
-      prom_text_add_str(text, " gauge\n", 7);
-      break;
+  return metric_sample_busy(prom_metric_db_sample_decr(p, metric->dbh,
+    metric_id, val, labels));
+}
 
-    case PROM_METRIC_TYPE_HISTOGRAM:
-      prom_text_add_str(text, " histogram\n", 11);
-      break;
+static int metric_sample_incr(pool *p, const struct prom_metric *metric,
+    int64_t metric_id, double val, const char *labels) {
+  if (metric->shm != NULL) {
+    return metric_sample_busy(prom_metric_shm_sample_incr(p, metric->shm,
+      metric_id, val, labels));
+  }
 
-    default:
-      break;
+  if (metric->buffer != NULL) {
+    return prom_metric_buffer_add(p, metric->buffer, metric_id, val, labels);
   }
 
-  return text;
+  return metric_sample_busy(prom_metric_db_sample_incr(p, metric->dbh,
+    metric_id, val, labels));
 }
 
-static struct prom_text *add_histogram_text(struct prom_text *text,
-    const char *registry_name, size_t registry_namelen,
-    const char *name, size_t namelen, const char *suffix, size_t suffixlen,
-    const array_header *results) {
-  register unsigned int i;
-  char **elts;
+/* Only accumulating increments (counters, histograms) which find the database
+ * busy can be deferred, for writing later.
+ */
+static int metric_sample_add(pool *p, const struct prom_metric *metric,
+    int64_t metric_id, double val, const char *labels) {
+  int res;
 
-  if (results->nelts == 0) {
-    return text;
+  if (metric->shm != NULL) {
+    return metric_sample_incr(p, metric, metric_id, val, labels);
   }
 
-  elts = results->elts;
-  for (i = 0; i < results->nelts; i += 2) {
-    double sample_val;
-    char sample_text[50], *sample_labels, *ptr = NULL;
-    size_t sample_labelslen;
-    int sample_textlen;
+  if (metric->buffer != NULL) {
+    return prom_metric_buffer_add(p, metric->buffer, metric_id, val, labels);
+  }
 
-    sample_val = strtod(elts[i], &ptr);
-    memset(sample_text, '\0', sizeof(sample_text));
-    sample_textlen = snprintf(sample_text, sizeof(sample_text)-1, "%0.17g",
-      sample_val);
+  if (metric->deferred == NULL) {
+    return metric_sample_incr(p, metric, metric_id, val, labels);
+  }
 
-    sample_labels = elts[i+1];
-    sample_labelslen = strlen(sample_labels);
+  res = prom_metric_db_sample_incr(p, metric->dbh, metric_id, val, labels);
+  if (res < 0 &&
+      errno == EAGAIN) {
+    res = prom_metric_buffer_add(p, metric->deferred, metric_id, val, labels);
+    if (res < 0) {
+      return metric_sample_busy(res);
+    }
 
-    prom_text_add_str(text, registry_name, registry_namelen);
-    prom_text_add_byte(text, '_');
-    prom_text_add_str(text, name, namelen);
-    prom_text_add_str(text, suffix, suffixlen);
+    pr_trace_msg(trace_channel, 15,
+      "database busy, deferred update of metric ID %lld",
+      (long long) metric_id);
+    busy_deferred_count++;
+  }
 
-    if (sample_labelslen > 0) {
-      prom_text_add_str(text, sample_labels, sample_labelslen);
-    }
+  return res;
+}
 
-    prom_text_add_byte(text, ' ');
-    prom_text_add_str(text, sample_text, sample_textlen);
-    prom_text_add_byte(text, '\n');
+static int metric_sample_set(pool *p, const struct prom_metric *metric,
+    int64_t metric_id, double val, const char *labels) {
+  if (metric->shm != NULL) {
+    return metric_sample_busy(prom_metric_shm_sample_set(p, metric->shm,
+      metric_id, val, labels));
   }
 
-  return text;
+  if (metric->buffer != NULL) {
+    return prom_metric_buffer_set(p, metric->buffer, metric_id, val, labels);
+  }
+
+  return metric_sample_busy(prom_metric_db_sample_set(p, metric->dbh,
+    metric_id, val, labels));
 }
 
-static struct prom_text *add_metric_type_text(pool *p,
-    struct prom_metric *metric, struct prom_text *text,
-    const char *registry_name, size_t registry_namelen, int metric_type) {
-  register unsigned int i;
-  const array_header *results, *histogram_counts = NULL, *histogram_sums = NULL;
-  const char *type_name, *type_help;
-  size_t type_namelen, type_helplen;
-  char **elts;
+/* Histogram observations are stored as one row per label set, holding the
+ * per-bucket counts, count, and sum; an observation is a single write, to
+ * its bucket.  In shared memory, each bucket count and the sum is a sample,
+ * whose labels carry a "#<slot>" suffix; the count is the sum of the bucket
+ * counts.
+ */
+static const char *shm_slot_labels(char *buf, size_t bufsz,
+    const char *labels, const char *slot_text) {
+  size_t labels_len, slot_len;
 
-  results = prom_metric_get(p, metric, metric_type, &histogram_counts,
-    &histogram_sums);
-  if (results == NULL) {
+  labels_len = strlen(labels);
+  slot_len = strlen(slot_text);
+
+  /* Such labels would not fit in a shared memory slot anyway. */
+  if (labels_len + slot_len >= bufsz) {
+    errno = ENAMETOOLONG;
     return NULL;
   }
 
-  switch (metric_type) {
-    case PROM_METRIC_TYPE_COUNTER:
-      type_name = metric->counter_name;
-      type_namelen = metric->counter_namelen;
-      type_help = metric->counter_help;
-      type_helplen = metric->counter_helplen;
-      break;
+  memcpy(buf, labels, labels_len);
+  memcpy(buf + labels_len, slot_text, slot_len + 1);
+  return buf;
+}
 
-    case PROM_METRIC_TYPE_GAUGE:
-      type_name = metric->gauge_name;
-      type_namelen = metric->gauge_namelen;
-      type_help = metric->gauge_help;
-      type_helplen = metric->gauge_helplen;
-      break;
+static int metric_histogram_shm_add(pool *p, const struct prom_metric *metric,
+    unsigned int bucket_idx, double val, const char *labels) {
+  char slot_text[32], slot_labels[PROM_METRIC_SHM_MAX_LABELS_LEN+1];
+  const char *text;
+  int res;
 
-    case PROM_METRIC_TYPE_HISTOGRAM:
-      type_name = metric->histogram_name;
-      type_namelen = metric->histogram_namelen;
-      type_help = metric->histogram_help;
-      type_helplen = metric->histogram_helplen;
-      break;
+  memset(slot_text, '\0', sizeof(slot_text));
+  snprintf(slot_text, sizeof(slot_text)-1, "#b%u", bucket_idx);
 
-    default:
-      errno = EINVAL;
-      return NULL;
+  text = shm_slot_labels(slot_labels, sizeof(slot_labels), labels, slot_text);
+  if (text == NULL) {
+    return -1;
   }
 
-  add_help_text(text, registry_name, registry_namelen, type_name, type_namelen,
-    type_help, type_helplen);
-  add_type_text(text, registry_name, registry_namelen, type_name, type_namelen,
-    metric_type);
-
-  if (results->nelts == 0) {
-    /* Provide the default value of 0. */
-    prom_text_add_str(text, registry_name, registry_namelen);
-    prom_text_add_byte(text, '_');
-    prom_text_add_str(text, type_name, type_namelen);
-    prom_text_add_str(text, " 0\n", 3);
+  res = prom_metric_shm_sample_incr(p, metric->shm, metric->histogram_id, 1.0,
+    text);
+  if (res < 0) {
+    return -1;
+  }
 
-    return text;
+  text = shm_slot_labels(slot_labels, sizeof(slot_labels), labels, "#sum");
+  if (text == NULL) {
+    return -1;
   }
 
-  elts = results->elts;
-  for (i = 0; i < results->nelts; i += 2) {
-    double sample_val;
-    char sample_text[50], *sample_labels, *ptr = NULL;
-    size_t sample_labelslen;
-    int sample_textlen;
+  return prom_metric_shm_sample_incr(p, metric->shm, metric->histogram_id, val,
+    text);
+}
 
-    sample_val = strtod(elts[i], &ptr);
-    memset(sample_text, '\0', sizeof(sample_text));
-    sample_textlen = snprintf(sample_text, sizeof(sample_text)-1, "%0.17g",
-      sample_val);
+/* Note that exemplars are only kept by the database (and buffers); shared
+ * memory has no room for them.
+ */
+static int metric_histogram_add(pool *p, const struct prom_metric *metric,
+    unsigned int bucket_idx, double val, const char *labels,
+    const char *exemplar) {
+  int res;
 
-    sample_labels = elts[i+1];
-    sample_labelslen = strlen(sample_labels);
+  if (metric->shm != NULL) {
+    return metric_sample_busy(metric_histogram_shm_add(p, metric, bucket_idx,
+      val, labels));
+  }
 
-    prom_text_add_str(text, registry_name, registry_namelen);
-    prom_text_add_byte(text, '_');
-    prom_text_add_str(text, type_name, type_namelen);
+  if (metric->buffer != NULL) {
+    return prom_metric_buffer_add_histogram(p, metric->buffer,
+      metric->histogram_id, bucket_idx, metric->histogram_bucket_count, val,
+      labels, exemplar);
+  }
 
-    /* XXX For histogram buckets, ensure "+Inf" bucket is last. */
-    if (metric_type == PROM_METRIC_TYPE_HISTOGRAM) {
-      /* For histograms, `results` contains the bucket samples; name them
-       * accordingly.
-       */
-      prom_text_add_str(text, "_bucket", 7);
+  res = prom_metric_db_histogram_add(p, metric->dbh, metric->histogram_id,
+    bucket_idx, metric->histogram_bucket_count, 1.0, val, labels, exemplar);
+  if (res < 0 &&
+      errno == EAGAIN &&
+      metric->deferred != NULL) {
+    res = prom_metric_buffer_add_histogram(p, metric->deferred,
+      metric->histogram_id, bucket_idx, metric->histogram_bucket_count, val,
+      labels, exemplar);
+    if (res < 0) {
+      return metric_sample_busy(res);
     }
 
-    if (sample_labelslen > 0) {
-      prom_text_add_str(text, sample_labels, sample_labelslen);
+    pr_trace_msg(trace_channel, 15,
+      "database busy, deferred update of metric ID %lld",
+      (long long) metric->histogram_id);
+    busy_deferred_count++;
+    return 0;
+  }
+
+  return metric_sample_busy(res);
+}
+
+/* Reassembles the histogram rows from the shared memory samples, taken from
+ * the `samples` index if provided.  Those are sorted by their label text,
+ * thus the rows are, too.
+ */
+static const array_header *metric_histogram_shm_get(pool *p,
+    const struct prom_metric *metric, pr_table_t *samples) {
+  register unsigned int i;
+  const array_header *results = NULL;
+  array_header *histograms;
+  pr_table_t *rows;
+  const struct prom_metric_db_sample *elts;
+
+  if (samples != NULL) {
+    char id_text[32];
+
+    memset(id_text, '\0', sizeof(id_text));
+    snprintf(id_text, sizeof(id_text)-1, "%lld",
+      (long long) metric->histogram_id);
+
+    results = pr_table_get(samples, id_text, NULL);
+    if (results == NULL) {
+      results = make_array(p, 0, sizeof(struct prom_metric_db_sample));
     }
 
-    prom_text_add_byte(text, ' ');
-    prom_text_add_str(text, sample_text, sample_textlen);
-    prom_text_add_byte(text, '\n');
+  } else {
+    results = prom_metric_shm_sample_get(p, metric->shm, metric->histogram_id);
+    if (results == NULL) {
+      return NULL;
+    }
   }
 
-  if (metric_type == PROM_METRIC_TYPE_HISTOGRAM) {
-    add_histogram_text(text, registry_name, registry_namelen, type_name,
-      type_namelen, "_count", 6, histogram_counts);
-    add_histogram_text(text, registry_name, registry_namelen, type_name,
-      type_namelen, "_sum", 4, histogram_sums);
+  /* There are at most as many rows as samples; allocating for those up front
+   * means that the rows never move, and can be indexed by their labels.
+   */
+  histograms = make_array(p, results->nelts + 1,
+    sizeof(struct prom_metric_db_histogram));
+  rows = pr_table_alloc(p, 0);
+
+  elts = results->elts;
+  for (i = 0; i < results->nelts; i++) {
+    struct prom_metric_db_histogram *histogram;
+    const char *labels, *slot;
+    double val;
+
+    labels = elts[i].sample_labels;
+    slot = strrchr(labels, '#');
+    if (slot == NULL) {
+      continue;
+    }
+
+    labels = pstrndup(p, labels, slot - labels);
+    slot++;
+    val = elts[i].sample_value;
+
+    histogram = (struct prom_metric_db_histogram *) pr_table_get(rows, labels,
+      NULL);
+    if (histogram == NULL) {
+      histogram = push_array(histograms);
+      memset(histogram, 0, sizeof(struct prom_metric_db_histogram));
+      histogram->metric_id = metric->histogram_id;
+      histogram->sample_labels = labels;
+      histogram->sample_labelslen = strlen(labels);
+      histogram->bucket_count = metric->histogram_bucket_count;
+      histogram->bucket_counts = pcalloc(p,
+        sizeof(double) * histogram->bucket_count);
+
+      (void) pr_table_add(rows, labels, histogram,
+        sizeof(struct prom_metric_db_histogram *));
+    }
+
+    if (strcmp(slot, "sum") == 0) {
+      histogram->sample_sum = val;
+
+    } else if (*slot == 'b') {
+      unsigned int bucket_idx;
+
+      bucket_idx = (unsigned int) strtoul(slot + 1, NULL, 10);
+      if (bucket_idx < histogram->bucket_count) {
+        ((double *) histogram->bucket_counts)[bucket_idx] = val;
+        histogram->sample_count += val;
+      }
+    }
   }
 
-  return text;
+  return histograms;
 }
 
-/* Get the Prometheus text for the given metric: for each metric
- * type, add:
- *
- *  "# HELP name ...\n"
- *  "# TYPE name ...\n"
- *  "name<sample_labels> sample_val\n"
+/* Returns the histogram rows, as struct prom_metric_db_histogram elements.
+ * The `samples` index, if provided, is used rather than the datastore.
  */
-const char *prom_metric_get_text(pool *p, struct prom_metric *metric,
-    const char *registry_name, size_t *len) {
-  int xerrno;
-  pool *tmp_pool;
-  size_t registry_namelen;
-  struct prom_text *text;
-  char *res;
+static const array_header *metric_histogram_get(pool *p,
+    const struct prom_metric *metric, pr_table_t *samples) {
+  const array_header *results;
 
-  if (p == NULL ||
-      metric == NULL ||
-      registry_name == NULL ||
-      len == NULL) {
-    errno = EINVAL;
-    return NULL;
+  if (metric->shm != NULL) {
+    return metric_histogram_shm_get(p, metric, samples);
   }
 
-  registry_namelen = strlen(registry_name);
-  tmp_pool = make_sub_pool(p);
-  text = prom_text_create(tmp_pool);
+  if (samples != NULL) {
+    char id_text[32];
 
-  add_metric_type_text(tmp_pool, metric, text, registry_name, registry_namelen,
-    PROM_METRIC_TYPE_COUNTER);
-  add_metric_type_text(tmp_pool, metric, text, registry_name, registry_namelen,
-    PROM_METRIC_TYPE_GAUGE);
-  add_metric_type_text(tmp_pool, metric, text, registry_name, registry_namelen,
-    PROM_METRIC_TYPE_HISTOGRAM);
+    memset(id_text, '\0', sizeof(id_text));
+    snprintf(id_text, sizeof(id_text)-1, "%lld",
+      (long long) metric->histogram_id);
 
-  res = prom_text_get_str(p, text, len);
-  xerrno = errno;
+    results = pr_table_get(samples, id_text, NULL);
+    if (results == NULL) {
+      results = make_array(p, 0, sizeof(struct prom_metric_db_histogram));
+    }
 
-  if (res != NULL) {
-    pr_trace_msg(trace_channel, 19, "converted '%s' metric to text:\n%.*s",
-      metric->name, (int) *len, res);
+    return results;
   }
 
-  prom_text_destroy(text);
-  destroy_pool(tmp_pool);
-
-  errno = xerrno;
-  return res;
+  return prom_metric_db_histogram_get(p, metric->dbh, metric->histogram_id);
 }
 
-/* Returns the samples collected for this metric and type. */
-const array_header *prom_metric_get(pool *p, struct prom_metric *metric,
-    int metric_type, const array_header **histogram_counts,
-    const array_header **histogram_sums) {
-  const array_header *results = NULL;
+/* Summary (and native histogram) observations are merged into the bin for
+ * their value, of the summary's quantile sketch (or of the histogram's
+ * exponential buckets).  A sketch may have thousands of bins, per label set,
+ * which would soon fill the fixed shared memory slots; these are thus always
+ * kept in the database (which stores a sketch as one row), even when the
+ * metric's other samples are kept in shared memory.
+ */
+static int metric_bin_add(pool *p, const struct prom_metric *metric,
+    int64_t metric_id, int bin_key, double val, const char *labels) {
+  int res;
 
-  if (p == NULL ||
-      metric == NULL) {
-    errno = EINVAL;
-    return NULL;
+  if (metric->buffer != NULL) {
+    return prom_metric_buffer_add_summary(p, metric->buffer, metric_id,
+      bin_key, val, labels);
   }
 
-  switch (metric_type) {
-    case PROM_METRIC_TYPE_COUNTER:
-      if (metric->counter_name == NULL) {
-        /* No counter associated with this metric. */
-        errno = EPERM;
-        return NULL;
-      }
+  res = prom_metric_db_summary_add(p, metric->dbh, metric_id, bin_key, 1.0,
+    val, labels);
+  if (res < 0 &&
+      errno == EAGAIN &&
+      metric->deferred != NULL) {
+    res = prom_metric_buffer_add_summary(p, metric->deferred, metric_id,
+      bin_key, val, labels);
+    if (res < 0) {
+      return metric_sample_busy(res);
+    }
 
-      results = prom_metric_db_sample_get(p, metric->dbh, metric->counter_id);
-      if (results != NULL) {
-        pr_trace_msg(trace_channel, 17,
-          "found samples (%d) for counter metric '%s'", results->nelts/2,
-          metric->counter_name);
-      }
-      break;
+    pr_trace_msg(trace_channel, 15,
+      "database busy, deferred update of metric ID %lld",
+      (long long) metric_id);
+    busy_deferred_count++;
+    return 0;
+  }
 
-    case PROM_METRIC_TYPE_GAUGE:
-      if (metric->gauge_name == NULL) {
-        /* No gauge associated with this metric. */
-        errno = EPERM;
-        return NULL;
-      }
+  return metric_sample_busy(res);
+}
 
-      results = prom_metric_db_sample_get(p, metric->dbh, metric->gauge_id);
-      if (results != NULL) {
-        pr_trace_msg(trace_channel, 17,
-          "found samples (%d) for gauge metric '%s'", results->nelts/2,
-          metric->gauge_name);
-      }
-      break;
+/* Returns the summary sketches (or native histogram buckets), as struct
+ * prom_metric_db_summary elements.  The `samples` index, if provided, is used
+ * rather than the datastore.
+ */
+static const array_header *metric_bins_get(pool *p,
+    const struct prom_metric *metric, int64_t metric_id, pr_table_t *samples) {
+  const array_header *results;
 
-    case PROM_METRIC_TYPE_HISTOGRAM: {
-      register unsigned int i;
-      const array_header *sample_results;
+  if (samples != NULL) {
+    char id_text[32];
 
-      if (metric->histogram_name == NULL) {
-        /* No histogram associated with this metric. */
-        errno = EPERM;
-        return NULL;
+    memset(id_text, '\0', sizeof(id_text));
+    snprintf(id_text, sizeof(id_text)-1, "%lld", (long long) metric_id);
+
+    results = pr_table_get(samples, id_text, NULL);
+    if (results == NULL) {
+      results = make_array(p, 0, sizeof(struct prom_metric_db_summary));
+    }
+
+    return results;
+  }
+
+  return prom_metric_db_summary_get(p, metric->dbh, metric_id);
+}
+
+/* Returns the upper bound of the given native histogram bucket, which is
+ * 2^(idx * 2^-schema).
+ */
+static double native_bucket_bound(int idx, int schema) {
+  if (schema > 0) {
+    return exp2((double) idx / (double) (1 << schema));
+  }
+
+  return ldexp(1.0, idx * (1 << -schema));
+}
+
+/* Finds the native histogram bucket for the given (positive) value. */
+static int native_bucket_idx(double val, int schema) {
+  int exp, idx, n;
+  double frac;
+
+  if (isinf(val)) {
+    val = DBL_MAX;
+  }
+
+  /* Note that val = frac * 2^exp, with frac in [0.5, 1). */
+  frac = frexp(val, &exp);
+
+  if (schema > 0) {
+    idx = (int) ceil(log2(frac) * (1 << schema)) + (exp * (1 << schema));
+
+    /* Correct for any rounding, at the bucket boundaries. */
+    if (val > native_bucket_bound(idx, schema)) {
+      idx++;
+
+    } else if (val <= native_bucket_bound(idx - 1, schema)) {
+      idx--;
+    }
+
+    return idx;
+  }
+
+  /* For schemas of zero and below, the bucket is that of the exponent,
+   * divided (rounding up) by the number of powers of two per bucket.
+   */
+  idx = (frac == 0.5) ? exp - 1 : exp;
+  n = 1 << -schema;
+
+  return idx >= 0 ? (idx + n - 1) / n : -((-idx) / n);
+}
+
+static int native_bucket_key(double val, int schema) {
+  if (val > PROM_METRIC_NATIVE_ZERO_THRESHOLD) {
+    return native_bucket_idx(val, schema);
+  }
+
+  if (val < -PROM_METRIC_NATIVE_ZERO_THRESHOLD) {
+    return native_bucket_idx(-val, schema) -
+      PROM_METRIC_NATIVE_NEGATIVE_OFFSET;
+  }
+
+  /* Note that NaN lands here, too. */
+  return PROM_METRIC_NATIVE_ZERO_KEY;
+}
+
+static int native_key_is_negative(int key) {
+  return key != PROM_METRIC_NATIVE_ZERO_KEY &&
+    key < -(PROM_METRIC_NATIVE_NEGATIVE_OFFSET / 2);
+}
+
+/* Converts the (value, labels) text pairs, as returned by the database, to
+ * struct prom_metric_db_sample elements.
+ */
+static array_header *samples_from_text(pool *p, int64_t metric_id,
+    const array_header *results) {
+  register unsigned int i;
+  array_header *samples;
+  char **elts;
+
+  samples = make_array(p, results->nelts/2,
+    sizeof(struct prom_metric_db_sample));
+
+  elts = results->elts;
+  for (i = 0; i < results->nelts; i += 2) {
+    struct prom_metric_db_sample *sample;
+
+    sample = push_array(samples);
+    sample->metric_id = metric_id;
+    sample->sample_value = strtod(elts[i], NULL);
+    sample->sample_labels = elts[i+1];
+    sample->sample_labelslen = strlen(elts[i+1]);
+  }
+
+  return samples;
+}
+
+/* Converts the struct prom_metric_db_sample elements, as returned by shared
+ * memory, to (value, labels) text pairs.
+ */
+static array_header *samples_to_text(pool *p, const array_header *samples) {
+  register unsigned int i;
+  array_header *results;
+  const struct prom_metric_db_sample *elts;
+
+  results = make_array(p, samples->nelts * 2, sizeof(char *));
+
+  elts = samples->elts;
+  for (i = 0; i < samples->nelts; i++) {
+    char value_text[PROM_TEXT_DOUBLE_MAX_LEN];
+
+    (void) prom_text_format_double(value_text, sizeof(value_text),
+      elts[i].sample_value);
+
+    *((char **) push_array(results)) = pstrdup(p, value_text);
+    *((char **) push_array(results)) = (char *) elts[i].sample_labels;
+  }
+
+  return results;
+}
+
+/* Returns the samples for the given metric ID as (value, labels) text pairs
+ * or, if `typed` is true, as struct prom_metric_db_sample elements.  The
+ * `samples` index, if provided, is used rather than the datastore; its
+ * samples are always typed.
+ */
+static const array_header *metric_sample_get(pool *p,
+    const struct prom_metric *metric, int64_t metric_id, pr_table_t *samples,
+    int typed) {
+  const array_header *results;
+
+  if (samples != NULL) {
+    char id_text[32];
+
+    memset(id_text, '\0', sizeof(id_text));
+    snprintf(id_text, sizeof(id_text)-1, "%lld", (long long) metric_id);
+
+    results = pr_table_get(samples, id_text, NULL);
+    if (results == NULL) {
+      results = make_array(p, 0, sizeof(struct prom_metric_db_sample));
+    }
+
+    return results;
+  }
+
+  if (metric->shm != NULL) {
+    results = prom_metric_shm_sample_get(p, metric->shm, metric_id);
+    if (results == NULL ||
+        typed == TRUE) {
+      return results;
+    }
+
+    return samples_to_text(p, results);
+  }
+
+  results = prom_metric_db_sample_get(p, metric->dbh, metric_id);
+  if (results == NULL ||
+      typed == FALSE) {
+    return results;
+  }
+
+  return samples_from_text(p, metric_id, results);
+}
+
+static int count_samples(const array_header *results, int typed) {
+  return typed ? results->nelts : results->nelts/2;
+}
+
+static struct prom_text *add_help_text(struct prom_text *text,
+    const char *registry_name, size_t registry_namelen,
+    const char *name, size_t namelen, const char *help, size_t helplen) {
+
+  prom_text_add_str(text, "# HELP ", 7);
+  prom_text_add_str(text, registry_name, registry_namelen);
+  prom_text_add_byte(text, '_');
+  prom_text_add_str(text, name, namelen);
+  prom_text_add_byte(text, ' ');
+  prom_text_add_str(text, help, helplen);
+  prom_text_add_str(text, ".\n", 2);
+
+  return text;
+}
+
+static struct prom_text *add_type_text(struct prom_text *text,
+    const char *registry_name, size_t registry_namelen,
+    const char *name, size_t namelen, int metric_type) {
+
+  prom_text_add_str(text, "# TYPE ", 7);
+  prom_text_add_str(text, registry_name, registry_namelen);
+  prom_text_add_byte(text, '_');
+  prom_text_add_str(text, name, namelen);
+
+  switch (metric_type) {
+    case PROM_METRIC_TYPE_COUNTER:
+      prom_text_add_str(text, " counter\n", 9);
+      break;
+
+    case PROM_METRIC_TYPE_GAUGE:
+      prom_text_add_str(text, " gauge\n", 7);
+      break;
+
+    case PROM_METRIC_TYPE_HISTOGRAM:
+      prom_text_add_str(text, " histogram\n", 11);
+      break;
+
+    case PROM_METRIC_TYPE_SUMMARY:
+      prom_text_add_str(text, " summary\n", 9);
+      break;
+
+    default:
+      break;
+  }
+
+  return text;
+}
+
+/* Formats the given value directly into the text. */
+static void add_double_text(struct prom_text *text, const char *fmt,
+    double val) {
+  char *ptr;
+  int len;
+
+  ptr = prom_text_reserve(text, PROM_METRIC_VALUE_TEXT_MAX_LEN);
+  if (ptr == NULL) {
+    return;
+  }
+
+  len = snprintf(ptr, PROM_METRIC_VALUE_TEXT_MAX_LEN, fmt, val);
+  if (len < 0 ||
+      len >= PROM_METRIC_VALUE_TEXT_MAX_LEN) {
+    /* Truncated, e.g. a huge value formatted using "%f". */
+    len = PROM_METRIC_VALUE_TEXT_MAX_LEN - 1;
+  }
+
+  (void) prom_text_commit(text, (size_t) len);
+}
+
+static struct prom_text *add_sample_text(struct prom_text *text,
+    const char *registry_name, size_t registry_namelen,
+    const char *name, size_t namelen, const char *suffix, size_t suffixlen,
+    const struct prom_metric_db_sample *sample) {
+
+  prom_text_add_str(text, registry_name, registry_namelen);
+  prom_text_add_byte(text, '_');
+  prom_text_add_str(text, name, namelen);
+
+  if (suffixlen > 0) {
+    prom_text_add_str(text, suffix, suffixlen);
+  }
+
+  if (sample->sample_labelslen > 0) {
+    prom_text_add_str(text, sample->sample_labels, sample->sample_labelslen);
+  }
+
+  prom_text_add_byte(text, ' ');
+  prom_text_add_double(text, sample->sample_value);
+  prom_text_add_byte(text, '\n');
+
+  return text;
+}
+
+static struct prom_text *add_samples_text(struct prom_text *text,
+    const char *registry_name, size_t registry_namelen,
+    const char *name, size_t namelen, const char *suffix, size_t suffixlen,
+    const array_header *results) {
+  register unsigned int i;
+  const struct prom_metric_db_sample *samples;
+
+  if (results == NULL ||
+      results->nelts == 0) {
+    return text;
+  }
+
+  samples = results->elts;
+  for (i = 0; i < results->nelts; i++) {
+    add_sample_text(text, registry_name, registry_namelen, name, namelen,
+      suffix, suffixlen, &(samples[i]));
+  }
+
+  return text;
+}
+
+static const array_header *metric_get(pool *p, struct prom_metric *metric,
+    int metric_type, const array_header **histogram_counts,
+    const array_header **histogram_sums, pr_table_t *samples, int typed);
+
+static struct prom_text *add_metric_type_text(pool *p,
+    struct prom_metric *metric, struct prom_text *text,
+    const char *registry_name, size_t registry_namelen, int metric_type,
+    pr_table_t *samples) {
+  const array_header *results, *histogram_counts = NULL, *histogram_sums = NULL;
+  const char *type_name, *type_help;
+  size_t type_namelen, type_helplen;
+
+  results = metric_get(p, metric, metric_type, &histogram_counts,
+    &histogram_sums, samples, TRUE);
+  if (results == NULL) {
+    return NULL;
+  }
+
+  switch (metric_type) {
+    case PROM_METRIC_TYPE_COUNTER:
+      type_name = metric->counter_name;
+      type_namelen = metric->counter_namelen;
+      type_help = metric->counter_help;
+      type_helplen = metric->counter_helplen;
+      break;
+
+    case PROM_METRIC_TYPE_GAUGE:
+      type_name = metric->gauge_name;
+      type_namelen = metric->gauge_namelen;
+      type_help = metric->gauge_help;
+      type_helplen = metric->gauge_helplen;
+      break;
+
+    case PROM_METRIC_TYPE_HISTOGRAM:
+      type_name = metric->histogram_name;
+      type_namelen = metric->histogram_namelen;
+      type_help = metric->histogram_help;
+      type_helplen = metric->histogram_helplen;
+      break;
+
+    case PROM_METRIC_TYPE_SUMMARY:
+      type_name = metric->summary_name;
+      type_namelen = metric->summary_namelen;
+      type_help = metric->summary_help;
+      type_helplen = metric->summary_helplen;
+      break;
+
+    default:
+      errno = EINVAL;
+      return NULL;
+  }
+
+  add_help_text(text, registry_name, registry_namelen, type_name, type_namelen,
+    type_help, type_helplen);
+  add_type_text(text, registry_name, registry_namelen, type_name, type_namelen,
+    metric_type);
+
+  if (results->nelts == 0) {
+    /* Provide the default value of 0. */
+    prom_text_add_str(text, registry_name, registry_namelen);
+    prom_text_add_byte(text, '_');
+    prom_text_add_str(text, type_name, type_namelen);
+    prom_text_add_str(text, " 0\n", 3);
+
+    return text;
+  }
+
+  if (metric_type == PROM_METRIC_TYPE_HISTOGRAM) {
+    /* For histograms, `results` contains the bucket samples, in bucket
+     * order (thus the "+Inf" bucket is last); name them accordingly.
+     */
+    add_samples_text(text, registry_name, registry_namelen, type_name,
+      type_namelen, "_bucket", 7, results);
+    add_samples_text(text, registry_name, registry_namelen, type_name,
+      type_namelen, "_count", 6, histogram_counts);
+    add_samples_text(text, registry_name, registry_namelen, type_name,
+      type_namelen, "_sum", 4, histogram_sums);
+
+  } else if (metric_type == PROM_METRIC_TYPE_SUMMARY) {
+    /* For summaries, `results` contains the quantile samples, which are
+     * named as the summary itself.
+     */
+    add_samples_text(text, registry_name, registry_namelen, type_name,
+      type_namelen, NULL, 0, results);
+    add_samples_text(text, registry_name, registry_namelen, type_name,
+      type_namelen, "_count", 6, histogram_counts);
+    add_samples_text(text, registry_name, registry_namelen, type_name,
+      type_namelen, "_sum", 4, histogram_sums);
+
+  } else {
+    add_samples_text(text, registry_name, registry_namelen, type_name,
+      type_namelen, NULL, 0, results);
+  }
+
+  return text;
+}
+
+static const char *metric_get_text(pool *p, struct prom_metric *metric,
+    const char *registry_name, pr_table_t *samples, size_t *len) {
+  int xerrno;
+  pool *tmp_pool;
+  size_t registry_namelen;
+  struct prom_text *text;
+  const char *res;
+
+  registry_namelen = strlen(registry_name);
+  tmp_pool = make_sub_pool(p);
+  /* The text is allocated from the caller's pool, so that its buffer can be
+   * returned as is, rather than copied.
+   */
+  text = prom_text_create(p);
+
+  add_metric_type_text(tmp_pool, metric, text, registry_name, registry_namelen,
+    PROM_METRIC_TYPE_COUNTER, samples);
+  add_metric_type_text(tmp_pool, metric, text, registry_name, registry_namelen,
+    PROM_METRIC_TYPE_GAUGE, samples);
+  add_metric_type_text(tmp_pool, metric, text, registry_name, registry_namelen,
+    PROM_METRIC_TYPE_HISTOGRAM, samples);
+  add_metric_type_text(tmp_pool, metric, text, registry_name, registry_namelen,
+    PROM_METRIC_TYPE_SUMMARY, samples);
+
+  res = prom_text_get_buf(text, len);
+  xerrno = errno;
+
+  if (res != NULL) {
+    pr_trace_msg(trace_channel, 19, "converted '%s' metric to text:\n%.*s",
+      metric->name, (int) *len, res);
+  }
+
+  if (res == NULL) {
+    prom_text_destroy(text);
+  }
+
+  destroy_pool(tmp_pool);
+
+  errno = xerrno;
+  return res;
+}
+
+/* Get the Prometheus text for the given metric: for each metric
+ * type, add:
+ *
+ *  "# HELP name ...\n"
+ *  "# TYPE name ...\n"
+ *  "name<sample_labels> sample_val\n"
+ */
+const char *prom_metric_get_text(pool *p, struct prom_metric *metric,
+    const char *registry_name, size_t *len) {
+
+  if (p == NULL ||
+      metric == NULL ||
+      registry_name == NULL ||
+      len == NULL) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  return metric_get_text(p, metric, registry_name, NULL, len);
+}
+
+const char *prom_metric_get_text_with_samples(pool *p,
+    struct prom_metric *metric, const char *registry_name,
+    pr_table_t *samples, size_t *len) {
+
+  if (p == NULL ||
+      metric == NULL ||
+      registry_name == NULL ||
+      samples == NULL ||
+      len == NULL) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  return metric_get_text(p, metric, registry_name, samples, len);
+}
+
+/* Indexes the given samples (or histogram/summary rows) by their metric ID;
+ * the results must be ordered by metric ID, so that each metric's elements
+ * are contiguous.
+ */
+static void index_samples(pool *p, pr_table_t *samples,
+    const array_header *results, size_t eltsz) {
+  register unsigned int i;
+  array_header *metric_samples = NULL;
+  int64_t metric_id = 0;
+
+  for (i = 0; i < results->nelts; i++) {
+    const void *elt;
+
+    /* The sample, histogram, and summary structs all start with the metric
+     * ID.
+     */
+    elt = ((const char *) results->elts) + (i * eltsz);
+
+    if (metric_samples == NULL ||
+        *((const int64_t *) elt) != metric_id) {
+      char *id_text;
+
+      metric_id = *((const int64_t *) elt);
+      id_text = pcalloc(p, 32);
+      snprintf(id_text, 31, "%lld", (long long) metric_id);
+
+      metric_samples = make_array(p, 0, eltsz);
+      if (pr_table_add(samples, id_text, metric_samples,
+          sizeof(array_header *)) < 0) {
+        pr_trace_msg(trace_channel, 9,
+          "error indexing samples for metric ID %s: %s", id_text,
+          strerror(errno));
+      }
+    }
+
+    memcpy(push_array(metric_samples), elt, eltsz);
+  }
+}
+
+struct prom_metric_scan {
+  struct prom_metric_db_scan *db_scan;
+  const array_header *metrics;
+
+  /* The samples kept in shared memory, indexed by metric ID. */
+  pr_table_t *shm_samples;
+
+  /* The rank of the next metric, i.e. its index in the scanned metrics. */
+  unsigned int next_rank;
+};
+
+static void scan_add_rank(array_header *ranks, int64_t metric_id,
+    unsigned int rank) {
+  struct prom_metric_db_rank *elt;
+
+  elt = push_array(ranks);
+  elt->metric_id = metric_id;
+  elt->rank = rank;
+}
+
+/* Adds the shared memory samples of the given metric ID, if any, to the
+ * index of the scanned metric.
+ */
+static void scan_add_shm(pool *p, struct prom_metric_scan *scan,
+    pr_table_t *samples, int64_t metric_id) {
+  char *id_text;
+  const array_header *results;
+
+  id_text = pcalloc(p, 32);
+  snprintf(id_text, 31, "%lld", (long long) metric_id);
+
+  results = pr_table_get(scan->shm_samples, id_text, NULL);
+  if (results != NULL) {
+    (void) pr_table_add(samples, id_text, (void *) results,
+      sizeof(array_header *));
+  }
+}
+
+/* Scans the samples of the given metrics (as struct prom_metric pointers),
+ * in that order, using a single query.  All of the database IDs of a metric
+ * (e.g. of its counter and histogram) share its rank, so that its samples
+ * are read together.  For metrics using shared memory, only the summaries
+ * and native histograms are kept in the database; their other samples are
+ * read from shared memory, for all metrics at once, in a single pass.
+ */
+struct prom_metric_scan *prom_metric_scan_open(pool *p, struct prom_dbh *dbh,
+    const array_header *metrics) {
+  register unsigned int i;
+  struct prom_metric_scan *scan;
+  struct prom_metric **elts;
+  struct prom_metric_shm *shm = NULL;
+  array_header *ranks;
+
+  if (p == NULL ||
+      dbh == NULL ||
+      metrics == NULL) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  ranks = make_array(p, metrics->nelts * 2,
+    sizeof(struct prom_metric_db_rank));
+
+  elts = metrics->elts;
+  for (i = 0; i < metrics->nelts; i++) {
+    struct prom_metric *metric;
+
+    metric = elts[i];
+    if (metric == NULL) {
+      continue;
+    }
+
+    if (metric->shm != NULL) {
+      shm = metric->shm;
+    }
+
+    if (metric->counter_name != NULL &&
+        metric->shm == NULL) {
+      scan_add_rank(ranks, metric->counter_id, i);
+    }
+
+    if (metric->gauge_name != NULL &&
+        metric->shm == NULL) {
+      scan_add_rank(ranks, metric->gauge_id, i);
+    }
+
+    if (metric->histogram_name != NULL) {
+      if (metric->shm == NULL) {
+        scan_add_rank(ranks, metric->histogram_id, i);
+      }
+
+      if (metric->histogram_native == TRUE) {
+        scan_add_rank(ranks, metric->histogram_native_id, i);
+      }
+    }
+
+    if (metric->summary_name != NULL) {
+      scan_add_rank(ranks, metric->summary_id, i);
+    }
+  }
+
+  scan = pcalloc(p, sizeof(struct prom_metric_scan));
+  scan->metrics = metrics;
+
+  if (shm != NULL) {
+    const array_header *results;
+
+    results = prom_metric_shm_sample_get_all(p, shm);
+    if (results == NULL) {
+      return NULL;
+    }
+
+    scan->shm_samples = pr_table_alloc(p, 0);
+    index_samples(p, scan->shm_samples, results,
+      sizeof(struct prom_metric_db_sample));
+  }
+
+  scan->db_scan = prom_metric_db_scan_open(p, dbh, ranks);
+  if (scan->db_scan == NULL) {
+    return NULL;
+  }
+
+  return scan;
+}
+
+/* Returns the samples of the next scanned metric, indexed by metric ID, for
+ * rendering via prom_metric_get_text_with_samples().  Histograms and
+ * summaries are indexed by their ID, as struct prom_metric_db_histogram and
+ * struct prom_metric_db_summary elements, respectively.
+ */
+pr_table_t *prom_metric_scan_next(pool *p, struct prom_metric_scan *scan) {
+  const array_header *results = NULL, *histograms = NULL, *summaries = NULL;
+  struct prom_metric *metric = NULL;
+  pr_table_t *samples;
+
+  if (p == NULL ||
+      scan == NULL) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  if (scan->next_rank < scan->metrics->nelts) {
+    metric = ((struct prom_metric **) scan->metrics->elts)[scan->next_rank];
+  }
+
+  if (prom_metric_db_scan_next(p, scan->db_scan, scan->next_rank++, &results,
+      &histograms, &summaries) < 0) {
+    return NULL;
+  }
+
+  samples = pr_table_alloc(p, 0);
+  index_samples(p, samples, results, sizeof(struct prom_metric_db_sample));
+  index_samples(p, samples, histograms,
+    sizeof(struct prom_metric_db_histogram));
+  index_samples(p, samples, summaries, sizeof(struct prom_metric_db_summary));
+
+  if (metric != NULL &&
+      metric->shm != NULL &&
+      scan->shm_samples != NULL) {
+    if (metric->counter_name != NULL) {
+      scan_add_shm(p, scan, samples, metric->counter_id);
+    }
+
+    if (metric->gauge_name != NULL) {
+      scan_add_shm(p, scan, samples, metric->gauge_id);
+    }
+
+    if (metric->histogram_name != NULL) {
+      scan_add_shm(p, scan, samples, metric->histogram_id);
+    }
+  }
+
+  pr_trace_msg(trace_channel, 19,
+    "scanned samples (%d), histograms (%d), and summaries (%d) for "
+    "metric #%u", results->nelts, histograms->nelts, summaries->nelts,
+    scan->next_rank - 1);
+  return samples;
+}
+
+int prom_metric_scan_close(struct prom_metric_scan *scan) {
+  if (scan == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  return prom_metric_db_scan_close(scan->db_scan);
+}
+
+/* Finds where the named label (e.g. "le" for histogram buckets) belongs in
+ * the given label text, keeping the keys sorted as prom_text_from_labels()
+ * does.  Returns the offset of the key before which the label is inserted,
+ * or zero if it goes last.
+ */
+static size_t label_text_offset(pool *p, const char *labels,
+    size_t labelslen, const char *name) {
+  const char *ptr, *end;
+
+  /* Skip the opening '{'. */
+  ptr = labels + 1;
+  end = labels + labelslen;
+
+  while (ptr < end) {
+    const char *eq, *next;
+
+    eq = memchr(ptr, '=', end - ptr);
+    if (eq == NULL) {
+      break;
+    }
+
+    if (strcmp(pstrndup(p, ptr, eq - ptr), name) > 0) {
+      return ptr - labels;
+    }
+
+    next = strstr(eq, "\",");
+    if (next == NULL ||
+        next >= end) {
+      break;
+    }
+
+    ptr = next + 2;
+  }
+
+  return 0;
+}
+
+static const char *label_text_add(pool *p, const char *labels,
+    size_t labelslen, size_t offset, const char *name, const char *value) {
+  if (labelslen == 0) {
+    return pstrcat(p, "{", name, "=\"", value, "\"}", NULL);
+  }
+
+  if (offset == 0) {
+    return pstrcat(p, pstrndup(p, labels, labelslen - 1), ",", name, "=\"",
+      value, "\"}", NULL);
+  }
+
+  return pstrcat(p, pstrndup(p, labels, offset), name, "=\"", value, "\",",
+    labels + offset, NULL);
+}
+
+/* Returns the added sample, if typed, else NULL. */
+static struct prom_metric_db_sample *add_typed_sample(pool *p,
+    array_header *results, int typed, int64_t metric_id, double val,
+    const char *labels) {
+  char *val_text;
+
+  if (typed == TRUE) {
+    struct prom_metric_db_sample *sample;
+
+    sample = push_array(results);
+    sample->metric_id = metric_id;
+    sample->sample_value = val;
+    sample->sample_labels = labels;
+    sample->sample_labelslen = strlen(labels);
+    sample->created = 0.0;
+    sample->exemplar = NULL;
+    return sample;
+  }
+
+  val_text = pcalloc(p, PROM_TEXT_DOUBLE_MAX_LEN);
+  (void) prom_text_format_double(val_text, PROM_TEXT_DOUBLE_MAX_LEN, val);
+
+  *((char **) push_array(results)) = val_text;
+  *((char **) push_array(results)) = (char *) labels;
+  return NULL;
+}
+
+/* Expands the histogram rows into the bucket, count, and sum samples.  The
+ * per-bucket counts are summed here, at scrape time, into the cumulative
+ * counts for each bucket; the bucket samples are returned in bucket order
+ * (thus the "+Inf" bucket is last).
+ */
+static const array_header *histogram_get_samples(pool *p,
+    const struct prom_metric *metric, const array_header *histograms,
+    const array_header **histogram_counts,
+    const array_header **histogram_sums, int typed) {
+  register unsigned int i, j;
+  const struct prom_metric_db_histogram *rows;
+  unsigned int bucket_count, row_count;
+  array_header *buckets, *counts, *sums;
+  double *cumulative_counts;
+  size_t *le_offsets;
+  size_t eltsz;
+
+  eltsz = typed ? sizeof(struct prom_metric_db_sample) : sizeof(char *);
+  bucket_count = metric->histogram_bucket_count;
+  row_count = histograms->nelts;
+  rows = histograms->elts;
+
+  buckets = make_array(p, (bucket_count * row_count) + 1, eltsz);
+  counts = make_array(p, row_count + 1, eltsz);
+  sums = make_array(p, row_count + 1, eltsz);
+
+  cumulative_counts = pcalloc(p,
+    sizeof(double) * ((bucket_count * row_count) + 1));
+  le_offsets = pcalloc(p, sizeof(size_t) * (row_count + 1));
+
+  for (i = 0; i < row_count; i++) {
+    double *row_counts;
+
+    row_counts = cumulative_counts + (i * bucket_count);
+    for (j = 0; j < rows[i].bucket_count; j++) {
+      /* Any slots beyond our buckets are counted in the "+Inf" bucket. */
+      row_counts[j < bucket_count ? j : bucket_count - 1] +=
+        rows[i].bucket_counts[j];
+    }
+
+    for (j = 1; j < bucket_count; j++) {
+      row_counts[j] += row_counts[j-1];
+    }
+
+    if (rows[i].sample_labelslen > 0) {
+      le_offsets[i] = label_text_offset(p, rows[i].sample_labels,
+        rows[i].sample_labelslen, "le");
+    }
+
+    add_typed_sample(p, counts, typed, metric->histogram_id,
+      rows[i].sample_count, rows[i].sample_labels);
+    add_typed_sample(p, sums, typed, metric->histogram_id,
+      rows[i].sample_sum, rows[i].sample_labels);
+  }
+
+  for (j = 0; j < bucket_count; j++) {
+    const struct prom_histogram_bucket *bucket;
+
+    bucket = metric->histogram_buckets[j];
+    for (i = 0; i < row_count; i++) {
+      struct prom_metric_db_sample *sample;
+
+      sample = add_typed_sample(p, buckets, typed, metric->histogram_id,
+        cumulative_counts[(i * bucket_count) + j],
+        label_text_add(p, rows[i].sample_labels, rows[i].sample_labelslen,
+          le_offsets[i], "le", bucket->upper_bound_text));
+
+      if (sample != NULL &&
+          rows[i].bucket_exemplars != NULL &&
+          j < rows[i].bucket_count) {
+        sample->exemplar = rows[i].bucket_exemplars[j];
+      }
+    }
+  }
+
+  *histogram_counts = counts;
+  *histogram_sums = sums;
+  return buckets;
+}
+
+/* Expands the summary sketches into the quantile, count, and sum samples.
+ * The quantiles for each label set are estimated here, at scrape time.
+ */
+static const array_header *summary_get_samples(pool *p,
+    const struct prom_metric *metric, const array_header *summaries,
+    const array_header **summary_counts, const array_header **summary_sums,
+    int typed) {
+  register unsigned int i, j;
+  const struct prom_metric_db_summary *rows;
+  unsigned int quantile_count, row_count;
+  array_header *quantiles, *counts, *sums;
+  size_t eltsz;
+
+  eltsz = typed ? sizeof(struct prom_metric_db_sample) : sizeof(char *);
+  quantile_count = metric->summary_quantile_count;
+  row_count = summaries->nelts;
+  rows = summaries->elts;
+
+  quantiles = make_array(p, (quantile_count * row_count) + 1, eltsz);
+  counts = make_array(p, row_count + 1, eltsz);
+  sums = make_array(p, row_count + 1, eltsz);
+
+  for (i = 0; i < row_count; i++) {
+    size_t offset = 0;
+
+    if (rows[i].sample_labelslen > 0) {
+      offset = label_text_offset(p, rows[i].sample_labels,
+        rows[i].sample_labelslen, "quantile");
+    }
+
+    for (j = 0; j < quantile_count; j++) {
+      double val = 0.0;
+
+      if (prom_sketch_quantile(rows[i].bins, rows[i].bin_count,
+          metric->summary_quantiles[j], &val) < 0) {
+        continue;
+      }
+
+      add_typed_sample(p, quantiles, typed, metric->summary_id, val,
+        label_text_add(p, rows[i].sample_labels, rows[i].sample_labelslen,
+          offset, "quantile", metric->summary_quantile_texts[j]));
+    }
+
+    add_typed_sample(p, counts, typed, metric->summary_id,
+      rows[i].sample_count, rows[i].sample_labels);
+    add_typed_sample(p, sums, typed, metric->summary_id, rows[i].sample_sum,
+      rows[i].sample_labels);
+  }
+
+  *summary_counts = counts;
+  *summary_sums = sums;
+  return quantiles;
+}
+
+/* Formats the given bucket bound, using no more digits than needed for the
+ * text to read back as the same value.
+ */
+static const char *get_bound_text(pool *p, double val) {
+  char *text;
+
+  text = palloc(p, PROM_TEXT_DOUBLE_MAX_LEN);
+  (void) prom_text_format_double(text, PROM_TEXT_DOUBLE_MAX_LEN, val);
+
+  return text;
+}
+
+/* Expands the native histogram buckets into the bucket, count, and sum
+ * samples, for histograms without any classic buckets.  Each label set gets
+ * the cumulative counts of its populated buckets, in order of their upper
+ * bounds, followed by its "+Inf" bucket.
+ */
+static const array_header *native_get_samples(pool *p,
+    const struct prom_metric *metric, const array_header *natives,
+    const array_header **histogram_counts,
+    const array_header **histogram_sums, int typed) {
+  register unsigned int i;
+  const struct prom_metric_db_summary *rows;
+  array_header *buckets, *counts, *sums;
+  size_t eltsz;
+
+  eltsz = typed ? sizeof(struct prom_metric_db_sample) : sizeof(char *);
+  rows = natives->elts;
+
+  buckets = make_array(p, natives->nelts + 1, eltsz);
+  counts = make_array(p, natives->nelts + 1, eltsz);
+  sums = make_array(p, natives->nelts + 1, eltsz);
+
+  for (i = 0; i < natives->nelts; i++) {
+    register unsigned int j;
+    const struct prom_sketch_bin *bins;
+    unsigned int bin_count, neg_start, neg_end;
+    double cumulative = 0.0, zero_count = 0.0;
+    size_t offset = 0;
+
+    bins = rows[i].bins;
+    bin_count = rows[i].bin_count;
+
+    if (rows[i].sample_labelslen > 0) {
+      offset = label_text_offset(p, rows[i].sample_labels,
+        rows[i].sample_labelslen, "le");
+    }
+
+    /* Ordered by key, the bins are the zero bucket (if any), the negative
+     * buckets, and then the positive buckets.
+     */
+    j = 0;
+    if (j < bin_count &&
+        bins[j].key == PROM_METRIC_NATIVE_ZERO_KEY) {
+      zero_count = bins[j].count;
+      j++;
+    }
+
+    neg_start = j;
+    while (j < bin_count &&
+           native_key_is_negative(bins[j].key)) {
+      j++;
+    }
+    neg_end = j;
+
+    /* The negative buckets have descending bounds. */
+    while (neg_end > neg_start) {
+      int idx;
+
+      neg_end--;
+      idx = bins[neg_end].key + PROM_METRIC_NATIVE_NEGATIVE_OFFSET;
+      cumulative += bins[neg_end].count;
+      add_typed_sample(p, buckets, typed, metric->histogram_id, cumulative,
+        label_text_add(p, rows[i].sample_labels, rows[i].sample_labelslen,
+          offset, "le", get_bound_text(p,
+            -native_bucket_bound(idx - 1, metric->histogram_schema))));
+    }
+
+    if (zero_count > 0.0) {
+      cumulative += zero_count;
+      add_typed_sample(p, buckets, typed, metric->histogram_id, cumulative,
+        label_text_add(p, rows[i].sample_labels, rows[i].sample_labelslen,
+          offset, "le", get_bound_text(p, PROM_METRIC_NATIVE_ZERO_THRESHOLD)));
+    }
+
+    for (; j < bin_count; j++) {
+      cumulative += bins[j].count;
+      add_typed_sample(p, buckets, typed, metric->histogram_id, cumulative,
+        label_text_add(p, rows[i].sample_labels, rows[i].sample_labelslen,
+          offset, "le", get_bound_text(p,
+            native_bucket_bound(bins[j].key, metric->histogram_schema))));
+    }
+
+    add_typed_sample(p, buckets, typed, metric->histogram_id,
+      rows[i].sample_count, label_text_add(p, rows[i].sample_labels,
+        rows[i].sample_labelslen, offset, "le", "+Inf"));
+    add_typed_sample(p, counts, typed, metric->histogram_id,
+      rows[i].sample_count, rows[i].sample_labels);
+    add_typed_sample(p, sums, typed, metric->histogram_id, rows[i].sample_sum,
+      rows[i].sample_labels);
+  }
+
+  *histogram_counts = counts;
+  *histogram_sums = sums;
+  return buckets;
+}
+
+static const array_header *metric_get(pool *p, struct prom_metric *metric,
+    int metric_type, const array_header **histogram_counts,
+    const array_header **histogram_sums, pr_table_t *samples, int typed) {
+  const array_header *results = NULL;
+
+  switch (metric_type) {
+    case PROM_METRIC_TYPE_COUNTER:
+      if (metric->counter_name == NULL) {
+        /* No counter associated with this metric. */
+        errno = EPERM;
+        return NULL;
+      }
+
+      results = metric_sample_get(p, metric, metric->counter_id, samples,
+        typed);
+      if (results != NULL) {
+        pr_trace_msg(trace_channel, 17,
+          "found samples (%d) for counter metric '%s'",
+          count_samples(results, typed), metric->counter_name);
+      }
+      break;
+
+    case PROM_METRIC_TYPE_GAUGE:
+      if (metric->gauge_name == NULL) {
+        /* No gauge associated with this metric. */
+        errno = EPERM;
+        return NULL;
+      }
+
+      results = metric_sample_get(p, metric, metric->gauge_id, samples,
+        typed);
+      if (results != NULL) {
+        pr_trace_msg(trace_channel, 17,
+          "found samples (%d) for gauge metric '%s'",
+          count_samples(results, typed), metric->gauge_name);
+      }
+      break;
+
+    case PROM_METRIC_TYPE_HISTOGRAM: {
+      const array_header *histograms;
+
+      if (metric->histogram_name == NULL) {
+        /* No histogram associated with this metric. */
+        errno = EPERM;
+        return NULL;
+      }
+
+      /* For histograms, the caller needs to provide ways to return the
+       * count/sum as well.
+       */
+      if (histogram_counts == NULL ||
+          histogram_sums == NULL) {
+        errno = EINVAL;
+        return NULL;
+      }
+
+      /* Histograms with only native buckets are rendered from those. */
+      if (metric->histogram_native == TRUE &&
+          metric->histogram_bucket_count == 1) {
+        histograms = metric_bins_get(p, metric, metric->histogram_native_id,
+          samples);
+        if (histograms == NULL) {
+          return NULL;
+        }
+
+        pr_trace_msg(trace_channel, 17,
+          "found samples (%d) for native histogram metric '%s'",
+          histograms->nelts, metric->histogram_name);
+
+        return native_get_samples(p, metric, histograms, histogram_counts,
+          histogram_sums, typed);
+      }
+
+      histograms = metric_histogram_get(p, metric, samples);
+      if (histograms == NULL) {
+        return NULL;
+      }
+
+      pr_trace_msg(trace_channel, 17,
+        "found samples (%d) for histogram metric '%s'", histograms->nelts,
+        metric->histogram_name);
+
+      return histogram_get_samples(p, metric, histograms, histogram_counts,
+        histogram_sums, typed);
+    }
+
+    case PROM_METRIC_TYPE_SUMMARY: {
+      const array_header *summaries;
+
+      if (metric->summary_name == NULL) {
+        /* No summary associated with this metric. */
+        errno = EPERM;
+        return NULL;
+      }
+
+      /* As for histograms, summaries have a count/sum to return. */
+      if (histogram_counts == NULL ||
+          histogram_sums == NULL) {
+        errno = EINVAL;
+        return NULL;
+      }
+
+      summaries = metric_bins_get(p, metric, metric->summary_id, samples);
+      if (summaries == NULL) {
+        return NULL;
+      }
+
+      pr_trace_msg(trace_channel, 17,
+        "found samples (%d) for summary metric '%s'", summaries->nelts,
+        metric->summary_name);
+
+      return summary_get_samples(p, metric, summaries, histogram_counts,
+        histogram_sums, typed);
+    }
+
+    default:
+      pr_trace_msg(trace_channel, 9,
+        "unknown metric type %d requested for '%s'", metric_type, metric->name);
+      errno = EINVAL;
+      return NULL;
+  }
+
+  return results;
+}
+
+/* Returns the samples collected for this metric and type. */
+const array_header *prom_metric_get(pool *p, struct prom_metric *metric,
+    int metric_type, const array_header **histogram_counts,
+    const array_header **histogram_sums) {
+
+  if (p == NULL ||
+      metric == NULL) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  return metric_get(p, metric, metric_type, histogram_counts, histogram_sums,
+    NULL, FALSE);
+}
+
+/* Scratch messages, reused while encoding a metric family. */
+struct proto_msgs {
+  struct prom_proto *family;
+  struct prom_proto *metric;
+  struct prom_proto *value;
+  struct prom_proto *label;
+  struct prom_proto *item;
+};
+
+/* Adds the labels, parsed from the given label text (as built by
+ * prom_text_from_labels()), to the current metric message.
+ */
+static void proto_add_labels(struct proto_msgs *msgs, const char *labels,
+    size_t labelslen) {
+  const char *ptr, *end;
+
+  if (labelslen < 2) {
+    return;
+  }
+
+  /* Skip the enclosing braces. */
+  ptr = labels + 1;
+  end = labels + labelslen - 1;
+
+  while (ptr < end) {
+    const char *eq, *val, *val_end;
+
+    eq = memchr(ptr, '=', end - ptr);
+    if (eq == NULL ||
+        eq + 1 >= end ||
+        eq[1] != '"') {
+      break;
+    }
+
+    val = eq + 2;
+    val_end = memchr(val, '"', end - val);
+    if (val_end == NULL) {
+      break;
+    }
+
+    prom_proto_reset(msgs->label);
+    prom_proto_add_str(msgs->label, PROM_PROTO_LABEL_NAME, ptr, eq - ptr);
+    prom_proto_add_str(msgs->label, PROM_PROTO_LABEL_VALUE, val,
+      val_end - val);
+    prom_proto_add_msg(msgs->metric, PROM_PROTO_METRIC_LABEL, msgs->label);
+
+    /* Skip the closing quote, and the comma. */
+    ptr = val_end + 2;
+  }
+}
+
+/* Adds a metric, with the given labels and the message in `msgs->value`, to
+ * the family.
+ */
+static void proto_add_metric(struct proto_msgs *msgs, unsigned int field,
+    const char *labels, size_t labelslen) {
+  prom_proto_reset(msgs->metric);
+  proto_add_labels(msgs, labels, labelslen);
+  prom_proto_add_msg(msgs->metric, field, msgs->value);
+  prom_proto_add_msg(msgs->family, PROM_PROTO_FAMILY_METRIC, msgs->metric);
+}
+
+static void proto_add_samples(struct proto_msgs *msgs, int metric_type,
+    const array_header *results) {
+  register unsigned int i;
+  const struct prom_metric_db_sample *samples;
+  unsigned int field;
+
+  field = metric_type == PROM_METRIC_TYPE_COUNTER ?
+    PROM_PROTO_METRIC_COUNTER : PROM_PROTO_METRIC_GAUGE;
+
+  if (results->nelts == 0) {
+    /* Provide the default value of 0, as for the text format. */
+    prom_proto_reset(msgs->value);
+    prom_proto_add_double(msgs->value, PROM_PROTO_VALUE, 0.0);
+    proto_add_metric(msgs, field, "", 0);
+    return;
+  }
+
+  samples = results->elts;
+  for (i = 0; i < results->nelts; i++) {
+    prom_proto_reset(msgs->value);
+    prom_proto_add_double(msgs->value, PROM_PROTO_VALUE,
+      samples[i].sample_value);
+    proto_add_metric(msgs, field, samples[i].sample_labels,
+      samples[i].sample_labelslen);
+  }
+}
+
+/* Adds the spans and deltas for the given (negative or positive) native
+ * buckets, whose bucket indexes are their keys plus `key_offset`.
+ */
+static void proto_add_native_spans(pool *p, struct proto_msgs *msgs,
+    unsigned int span_field, unsigned int delta_field,
+    const struct prom_sketch_bin *bins, unsigned int bin_count,
+    int key_offset) {
+  register unsigned int i;
+  int64_t *deltas, prev_count = 0;
+  int prev_idx = 0, span_offset = 0;
+  unsigned int span_len = 0;
+
+  if (bin_count == 0) {
+    return;
+  }
+
+  deltas = palloc(p, sizeof(int64_t) * bin_count);
+
+  for (i = 0; i < bin_count; i++) {
+    int idx;
+    int64_t count;
+
+    idx = bins[i].key + key_offset;
+    count = (int64_t) bins[i].count;
+
+    if (i == 0) {
+      span_offset = idx;
+      span_len = 1;
+
+    } else if (idx == prev_idx + 1) {
+      span_len++;
+
+    } else {
+      /* A gap; the offset of the next span is relative to this one. */
+      prom_proto_reset(msgs->label);
+      prom_proto_add_sint(msgs->label, PROM_PROTO_SPAN_OFFSET, span_offset);
+      prom_proto_add_varint(msgs->label, PROM_PROTO_SPAN_LENGTH, span_len);
+      prom_proto_add_msg(msgs->value, span_field, msgs->label);
+
+      span_offset = idx - prev_idx - 1;
+      span_len = 1;
+    }
+
+    deltas[i] = count - prev_count;
+    prev_count = count;
+    prev_idx = idx;
+  }
+
+  prom_proto_reset(msgs->label);
+  prom_proto_add_sint(msgs->label, PROM_PROTO_SPAN_OFFSET, span_offset);
+  prom_proto_add_varint(msgs->label, PROM_PROTO_SPAN_LENGTH, span_len);
+  prom_proto_add_msg(msgs->value, span_field, msgs->label);
+
+  prom_proto_add_packed_sint(msgs->value, delta_field, deltas, bin_count);
+}
+
+static void proto_add_native(pool *p, struct proto_msgs *msgs,
+    const struct prom_metric *metric,
+    const struct prom_metric_db_summary *native) {
+  unsigned int i = 0, neg_start;
+  double zero_count = 0.0;
+
+  prom_proto_add_sint(msgs->value, PROM_PROTO_HISTOGRAM_SCHEMA,
+    metric->histogram_schema);
+  prom_proto_add_double(msgs->value, PROM_PROTO_HISTOGRAM_ZERO_THRESHOLD,
+    PROM_METRIC_NATIVE_ZERO_THRESHOLD);
+
+  if (native == NULL) {
+    prom_proto_add_varint(msgs->value, PROM_PROTO_HISTOGRAM_ZERO_COUNT, 0);
+    return;
+  }
+
+  if (i < native->bin_count &&
+      native->bins[i].key == PROM_METRIC_NATIVE_ZERO_KEY) {
+    zero_count = native->bins[i].count;
+    i++;
+  }
+
+  prom_proto_add_varint(msgs->value, PROM_PROTO_HISTOGRAM_ZERO_COUNT,
+    (uint64_t) zero_count);
+
+  neg_start = i;
+  while (i < native->bin_count &&
+         native_key_is_negative(native->bins[i].key)) {
+    i++;
+  }
+
+  proto_add_native_spans(p, msgs, PROM_PROTO_HISTOGRAM_NEGATIVE_SPAN,
+    PROM_PROTO_HISTOGRAM_NEGATIVE_DELTA, native->bins + neg_start,
+    i - neg_start, PROM_METRIC_NATIVE_NEGATIVE_OFFSET);
+  proto_add_native_spans(p, msgs, PROM_PROTO_HISTOGRAM_POSITIVE_SPAN,
+    PROM_PROTO_HISTOGRAM_POSITIVE_DELTA, native->bins + i,
+    native->bin_count - i, 0);
+}
+
+/* Adds the classic buckets of the given histogram row; the "+Inf" bucket is
+ * implied by the count, and omitted.
+ */
+static void proto_add_buckets(struct proto_msgs *msgs,
+    const struct prom_metric *metric,
+    const struct prom_metric_db_histogram *histogram) {
+  register unsigned int i;
+  double cumulative = 0.0;
+
+  for (i = 0; i + 1 < metric->histogram_bucket_count; i++) {
+    if (histogram != NULL &&
+        i < histogram->bucket_count) {
+      cumulative += histogram->bucket_counts[i];
+    }
+
+    prom_proto_reset(msgs->item);
+    prom_proto_add_varint(msgs->item, PROM_PROTO_BUCKET_COUNT,
+      (uint64_t) cumulative);
+    prom_proto_add_double(msgs->item, PROM_PROTO_BUCKET_UPPER_BOUND,
+      metric->histogram_buckets[i]->upper_bound);
+    prom_proto_add_msg(msgs->value, PROM_PROTO_HISTOGRAM_BUCKET, msgs->item);
+  }
+}
+
+static int proto_add_histograms(pool *p, struct proto_msgs *msgs,
+    const struct prom_metric *metric, pr_table_t *samples) {
+  register unsigned int i;
+  const array_header *histograms = NULL, *natives = NULL;
+  const struct prom_metric_db_summary *native_rows = NULL;
+  pr_table_t *native_idx = NULL;
+  int has_classic;
+
+  has_classic = (metric->histogram_native == FALSE ||
+    metric->histogram_bucket_count > 1);
+
+  if (has_classic == TRUE) {
+    histograms = metric_histogram_get(p, metric, samples);
+    if (histograms == NULL) {
+      return -1;
+    }
+  }
+
+  if (metric->histogram_native == TRUE) {
+    natives = metric_bins_get(p, metric, metric->histogram_native_id,
+      samples);
+    if (natives == NULL) {
+      return -1;
+    }
+
+    native_rows = natives->elts;
+  }
+
+  if (has_classic == TRUE &&
+      natives != NULL) {
+    /* Match the native buckets to the classic rows, by labels. */
+    native_idx = pr_table_alloc(p, 0);
+    for (i = 0; i < natives->nelts; i++) {
+      (void) pr_table_add(native_idx, native_rows[i].sample_labels,
+        &(native_rows[i]), sizeof(struct prom_metric_db_summary));
+    }
+  }
+
+  if ((histograms != NULL && histograms->nelts == 0) ||
+      (histograms == NULL && natives->nelts == 0)) {
+    /* Provide an empty histogram, as the text format provides 0. */
+    prom_proto_reset(msgs->value);
+    prom_proto_add_varint(msgs->value, PROM_PROTO_HISTOGRAM_COUNT, 0);
+    prom_proto_add_double(msgs->value, PROM_PROTO_HISTOGRAM_SUM, 0.0);
+    if (has_classic == TRUE) {
+      proto_add_buckets(msgs, metric, NULL);
+    }
+
+    if (metric->histogram_native == TRUE) {
+      proto_add_native(p, msgs, metric, NULL);
+    }
+
+    proto_add_metric(msgs, PROM_PROTO_METRIC_HISTOGRAM, "", 0);
+    return 0;
+  }
+
+  if (histograms != NULL) {
+    const struct prom_metric_db_histogram *rows;
+
+    rows = histograms->elts;
+    for (i = 0; i < histograms->nelts; i++) {
+      prom_proto_reset(msgs->value);
+      prom_proto_add_varint(msgs->value, PROM_PROTO_HISTOGRAM_COUNT,
+        (uint64_t) rows[i].sample_count);
+      prom_proto_add_double(msgs->value, PROM_PROTO_HISTOGRAM_SUM,
+        rows[i].sample_sum);
+      proto_add_buckets(msgs, metric, &(rows[i]));
+
+      if (native_idx != NULL) {
+        proto_add_native(p, msgs, metric,
+          pr_table_get(native_idx, rows[i].sample_labels, NULL));
+      }
+
+      proto_add_metric(msgs, PROM_PROTO_METRIC_HISTOGRAM,
+        rows[i].sample_labels, rows[i].sample_labelslen);
+    }
+
+    return 0;
+  }
+
+  for (i = 0; i < natives->nelts; i++) {
+    prom_proto_reset(msgs->value);
+    prom_proto_add_varint(msgs->value, PROM_PROTO_HISTOGRAM_COUNT,
+      (uint64_t) native_rows[i].sample_count);
+    prom_proto_add_double(msgs->value, PROM_PROTO_HISTOGRAM_SUM,
+      native_rows[i].sample_sum);
+    proto_add_native(p, msgs, metric, &(native_rows[i]));
+    proto_add_metric(msgs, PROM_PROTO_METRIC_HISTOGRAM,
+      native_rows[i].sample_labels, native_rows[i].sample_labelslen);
+  }
+
+  return 0;
+}
+
+static int proto_add_summaries(pool *p, struct proto_msgs *msgs,
+    const struct prom_metric *metric, pr_table_t *samples) {
+  register unsigned int i, j;
+  const array_header *summaries;
+  const struct prom_metric_db_summary *rows;
+
+  summaries = metric_bins_get(p, metric, metric->summary_id, samples);
+  if (summaries == NULL) {
+    return -1;
+  }
+
+  if (summaries->nelts == 0) {
+    prom_proto_reset(msgs->value);
+    prom_proto_add_varint(msgs->value, PROM_PROTO_SUMMARY_COUNT, 0);
+    prom_proto_add_double(msgs->value, PROM_PROTO_SUMMARY_SUM, 0.0);
+    proto_add_metric(msgs, PROM_PROTO_METRIC_SUMMARY, "", 0);
+    return 0;
+  }
+
+  rows = summaries->elts;
+  for (i = 0; i < summaries->nelts; i++) {
+    prom_proto_reset(msgs->value);
+    prom_proto_add_varint(msgs->value, PROM_PROTO_SUMMARY_COUNT,
+      (uint64_t) rows[i].sample_count);
+    prom_proto_add_double(msgs->value, PROM_PROTO_SUMMARY_SUM,
+      rows[i].sample_sum);
+
+    for (j = 0; j < metric->summary_quantile_count; j++) {
+      double val = 0.0;
+
+      if (prom_sketch_quantile(rows[i].bins, rows[i].bin_count,
+          metric->summary_quantiles[j], &val) < 0) {
+        continue;
+      }
+
+      prom_proto_reset(msgs->item);
+      prom_proto_add_double(msgs->item, PROM_PROTO_QUANTILE_QUANTILE,
+        metric->summary_quantiles[j]);
+      prom_proto_add_double(msgs->item, PROM_PROTO_QUANTILE_VALUE, val);
+      prom_proto_add_msg(msgs->value, PROM_PROTO_SUMMARY_QUANTILE,
+        msgs->item);
+    }
+
+    proto_add_metric(msgs, PROM_PROTO_METRIC_SUMMARY, rows[i].sample_labels,
+      rows[i].sample_labelslen);
+  }
+
+  return 0;
+}
+
+/* Adds the MetricFamily message for the given type of the metric, if the
+ * metric has that type.
+ */
+static void proto_add_family(pool *p, struct prom_metric *metric,
+    struct proto_msgs *msgs, struct prom_proto *proto,
+    const char *registry_name, int metric_type, pr_table_t *samples) {
+  const char *type_name = NULL, *type_help = NULL;
+  int res = 0;
+  unsigned int family_type = 0;
+
+  switch (metric_type) {
+    case PROM_METRIC_TYPE_COUNTER:
+      type_name = metric->counter_name;
+      type_help = metric->counter_help;
+      family_type = PROM_PROTO_TYPE_COUNTER;
+      break;
+
+    case PROM_METRIC_TYPE_GAUGE:
+      type_name = metric->gauge_name;
+      type_help = metric->gauge_help;
+      family_type = PROM_PROTO_TYPE_GAUGE;
+      break;
+
+    case PROM_METRIC_TYPE_HISTOGRAM:
+      type_name = metric->histogram_name;
+      type_help = metric->histogram_help;
+      family_type = PROM_PROTO_TYPE_HISTOGRAM;
+      break;
+
+    case PROM_METRIC_TYPE_SUMMARY:
+      type_name = metric->summary_name;
+      type_help = metric->summary_help;
+      family_type = PROM_PROTO_TYPE_SUMMARY;
+      break;
+  }
+
+  if (type_name == NULL) {
+    return;
+  }
+
+  prom_proto_reset(msgs->family);
+  prom_proto_add_str(msgs->family, PROM_PROTO_FAMILY_NAME,
+    pstrcat(p, registry_name, "_", type_name, NULL),
+    strlen(registry_name) + strlen(type_name) + 1);
+  prom_proto_add_str(msgs->family, PROM_PROTO_FAMILY_HELP,
+    pstrcat(p, type_help, ".", NULL), strlen(type_help) + 1);
+  prom_proto_add_varint(msgs->family, PROM_PROTO_FAMILY_TYPE, family_type);
+
+  switch (metric_type) {
+    case PROM_METRIC_TYPE_COUNTER:
+    case PROM_METRIC_TYPE_GAUGE: {
+      const array_header *results;
+
+      results = metric_get(p, metric, metric_type, NULL, NULL, samples, TRUE);
+      if (results == NULL) {
+        res = -1;
+        break;
+      }
+
+      proto_add_samples(msgs, metric_type, results);
+      break;
+    }
+
+    case PROM_METRIC_TYPE_HISTOGRAM:
+      res = proto_add_histograms(p, msgs, metric, samples);
+      break;
+
+    case PROM_METRIC_TYPE_SUMMARY:
+      res = proto_add_summaries(p, msgs, metric, samples);
+      break;
+  }
+
+  if (res < 0) {
+    pr_trace_msg(trace_channel, 7, "error getting samples for '%s': %s",
+      type_name, strerror(errno));
+    return;
+  }
+
+  prom_proto_add_delimited(proto, msgs->family);
+}
+
+static const char *metric_get_proto(pool *p, struct prom_metric *metric,
+    const char *registry_name, pr_table_t *samples, size_t *len) {
+  pool *tmp_pool;
+  struct prom_proto *proto;
+  struct proto_msgs msgs;
+  const char *buf;
+  size_t buflen = 0;
+  char *res;
+
+  tmp_pool = make_sub_pool(p);
+  proto = prom_proto_create(tmp_pool);
+  msgs.family = prom_proto_create(tmp_pool);
+  msgs.metric = prom_proto_create(tmp_pool);
+  msgs.value = prom_proto_create(tmp_pool);
+  msgs.label = prom_proto_create(tmp_pool);
+  msgs.item = prom_proto_create(tmp_pool);
+
+  proto_add_family(tmp_pool, metric, &msgs, proto, registry_name,
+    PROM_METRIC_TYPE_COUNTER, samples);
+  proto_add_family(tmp_pool, metric, &msgs, proto, registry_name,
+    PROM_METRIC_TYPE_GAUGE, samples);
+  proto_add_family(tmp_pool, metric, &msgs, proto, registry_name,
+    PROM_METRIC_TYPE_HISTOGRAM, samples);
+  proto_add_family(tmp_pool, metric, &msgs, proto, registry_name,
+    PROM_METRIC_TYPE_SUMMARY, samples);
+
+  buf = prom_proto_get_buf(proto, &buflen);
+  if (buflen == 0) {
+    destroy_pool(tmp_pool);
+    errno = ENOENT;
+    return NULL;
+  }
+
+  res = palloc(p, buflen);
+  memcpy(res, buf, buflen);
+  *len = buflen;
+
+  pr_trace_msg(trace_channel, 19, "encoded '%s' metric as protobuf (%lu bytes)",
+    metric->name, (unsigned long) buflen);
+
+  destroy_pool(tmp_pool);
+  return res;
+}
+
+/* Get the protobuf exposition for the given metric: a length-delimited
+ * io.prometheus.client.MetricFamily message for each metric type.
+ */
+const char *prom_metric_get_proto(pool *p, struct prom_metric *metric,
+    const char *registry_name, size_t *len) {
+
+  if (p == NULL ||
+      metric == NULL ||
+      registry_name == NULL ||
+      len == NULL) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  return metric_get_proto(p, metric, registry_name, NULL, len);
+}
+
+const char *prom_metric_get_proto_with_samples(pool *p,
+    struct prom_metric *metric, const char *registry_name,
+    pr_table_t *samples, size_t *len) {
+
+  if (p == NULL ||
+      metric == NULL ||
+      registry_name == NULL ||
+      samples == NULL ||
+      len == NULL) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  return metric_get_proto(p, metric, registry_name, samples, len);
+}
+
+/* OpenMetrics rendering.  Unlike the Prometheus text, counter families are
+ * named without their "_total" suffix, families declare their units, and
+ * the samples of each label set are grouped together, followed by the time
+ * at which that label set was created, if known.  Histogram buckets carry
+ * the latest exemplar observed in them, if any.
+ */
+
+static const char *om_units[] = { "seconds", "bytes", NULL };
+
+/* Returns the unit of the given family name, per its suffix, if any. */
+static const char *om_get_unit(const char *name, size_t namelen) {
+  register unsigned int i;
+
+  for (i = 0; om_units[i] != NULL; i++) {
+    size_t unitlen;
+
+    unitlen = strlen(om_units[i]);
+    if (namelen > unitlen + 1 &&
+        name[namelen - unitlen - 1] == '_' &&
+        strcmp(name + namelen - unitlen, om_units[i]) == 0) {
+      return om_units[i];
+    }
+  }
+
+  return NULL;
+}
+
+static void om_add_metadata(struct prom_text *text, const char *registry_name,
+    size_t registry_namelen, const char *name, size_t namelen,
+    const char *help, size_t helplen, int metric_type) {
+  const char *unit;
+
+  add_help_text(text, registry_name, registry_namelen, name, namelen, help,
+    helplen);
+  add_type_text(text, registry_name, registry_namelen, name, namelen,
+    metric_type);
+
+  unit = om_get_unit(name, namelen);
+  if (unit != NULL) {
+    prom_text_add_str(text, "# UNIT ", 7);
+    prom_text_add_str(text, registry_name, registry_namelen);
+    prom_text_add_byte(text, '_');
+    prom_text_add_str(text, name, namelen);
+    prom_text_add_byte(text, ' ');
+    prom_text_add_str(text, unit, strlen(unit));
+    prom_text_add_byte(text, '\n');
+  }
+}
+
+static void om_add_sample(struct prom_text *text, const char *registry_name,
+    size_t registry_namelen, const char *name, size_t namelen,
+    const char *suffix, size_t suffixlen,
+    const struct prom_metric_db_sample *sample) {
+
+  prom_text_add_str(text, registry_name, registry_namelen);
+  prom_text_add_byte(text, '_');
+  prom_text_add_str(text, name, namelen);
+
+  if (suffixlen > 0) {
+    prom_text_add_str(text, suffix, suffixlen);
+  }
+
+  if (sample->sample_labelslen > 0) {
+    prom_text_add_str(text, sample->sample_labels, sample->sample_labelslen);
+  }
+
+  prom_text_add_byte(text, ' ');
+  prom_text_add_double(text, sample->sample_value);
+
+  if (sample->exemplar != NULL) {
+    prom_text_add_str(text, " # ", 3);
+    prom_text_add_str(text, sample->exemplar, strlen(sample->exemplar));
+  }
+
+  prom_text_add_byte(text, '\n');
+}
+
+static void om_add_samples(struct prom_text *text, const char *registry_name,
+    size_t registry_namelen, const char *name, size_t namelen,
+    const char *suffix, size_t suffixlen, const array_header *results) {
+  register unsigned int i;
+  const struct prom_metric_db_sample *samples;
+
+  samples = results->elts;
+  for (i = 0; i < results->nelts; i++) {
+    om_add_sample(text, registry_name, registry_namelen, name, namelen,
+      suffix, suffixlen, &(samples[i]));
+  }
+}
+
+static void om_add_created(struct prom_text *text, const char *registry_name,
+    size_t registry_namelen, const char *name, size_t namelen,
+    const char *labels, size_t labelslen, double created) {
+
+  /* The creation time is not known, e.g. for shared memory samples. */
+  if (created <= 0.0) {
+    return;
+  }
+
+  prom_text_add_str(text, registry_name, registry_namelen);
+  prom_text_add_byte(text, '_');
+  prom_text_add_str(text, name, namelen);
+  prom_text_add_str(text, "_created", 8);
+
+  if (labelslen > 0) {
+    prom_text_add_str(text, labels, labelslen);
+  }
+
+  prom_text_add_byte(text, ' ');
+  add_double_text(text, "%.3f", created);
+  prom_text_add_byte(text, '\n');
+}
+
+/* Returns an array of just the given histogram or summary row, so that its
+ * samples can be expanded on their own.
+ */
+static const array_header *om_get_row(pool *p, const void *row,
+    size_t rowsz) {
+  array_header *rows;
+
+  rows = make_array(p, 1, rowsz);
+  memcpy(push_array(rows), row, rowsz);
+  return rows;
+}
+
+static int om_add_counter(pool *p, struct prom_metric *metric,
+    struct prom_text *text, const char *registry_name,
+    size_t registry_namelen, pr_table_t *samples) {
+  register unsigned int i;
+  const array_header *results;
+  const struct prom_metric_db_sample *elts;
+  size_t namelen;
+
+  results = metric_get(p, metric, PROM_METRIC_TYPE_COUNTER, NULL, NULL,
+    samples, TRUE);
+  if (results == NULL) {
+    return -1;
+  }
+
+  /* The family is named without the "_total" suffix of its samples. */
+  namelen = metric->counter_namelen;
+  if (namelen > 6 &&
+      strcmp(metric->counter_name + namelen - 6, "_total") == 0) {
+    namelen -= 6;
+  }
+
+  om_add_metadata(text, registry_name, registry_namelen, metric->counter_name,
+    namelen, metric->counter_help, metric->counter_helplen,
+    PROM_METRIC_TYPE_COUNTER);
+
+  if (results->nelts == 0) {
+    /* Provide the default value of 0. */
+    prom_text_add_str(text, registry_name, registry_namelen);
+    prom_text_add_byte(text, '_');
+    prom_text_add_str(text, metric->counter_name, namelen);
+    prom_text_add_str(text, "_total 0\n", 9);
+    return 0;
+  }
+
+  elts = results->elts;
+  for (i = 0; i < results->nelts; i++) {
+    om_add_sample(text, registry_name, registry_namelen, metric->counter_name,
+      namelen, "_total", 6, &(elts[i]));
+    om_add_created(text, registry_name, registry_namelen,
+      metric->counter_name, namelen, elts[i].sample_labels,
+      elts[i].sample_labelslen, elts[i].created);
+  }
+
+  return 0;
+}
+
+static int om_add_gauge(pool *p, struct prom_metric *metric,
+    struct prom_text *text, const char *registry_name,
+    size_t registry_namelen, pr_table_t *samples) {
+  const array_header *results;
+
+  results = metric_get(p, metric, PROM_METRIC_TYPE_GAUGE, NULL, NULL,
+    samples, TRUE);
+  if (results == NULL) {
+    return -1;
+  }
+
+  om_add_metadata(text, registry_name, registry_namelen, metric->gauge_name,
+    metric->gauge_namelen, metric->gauge_help, metric->gauge_helplen,
+    PROM_METRIC_TYPE_GAUGE);
+
+  if (results->nelts == 0) {
+    /* Provide the default value of 0. */
+    prom_text_add_str(text, registry_name, registry_namelen);
+    prom_text_add_byte(text, '_');
+    prom_text_add_str(text, metric->gauge_name, metric->gauge_namelen);
+    prom_text_add_str(text, " 0\n", 3);
+    return 0;
+  }
+
+  om_add_samples(text, registry_name, registry_namelen, metric->gauge_name,
+    metric->gauge_namelen, NULL, 0, results);
+  return 0;
+}
+
+/* Adds the bucket, count, and sum samples of one histogram (or summary)
+ * label set, followed by its creation time.
+ */
+static void om_add_row_samples(struct prom_text *text,
+    const char *registry_name, size_t registry_namelen, const char *name,
+    size_t namelen, int metric_type, const array_header *buckets,
+    const array_header *counts, const array_header *sums, const char *labels,
+    size_t labelslen, double created) {
+
+  if (metric_type == PROM_METRIC_TYPE_HISTOGRAM) {
+    om_add_samples(text, registry_name, registry_namelen, name, namelen,
+      "_bucket", 7, buckets);
+
+  } else {
+    om_add_samples(text, registry_name, registry_namelen, name, namelen,
+      NULL, 0, buckets);
+  }
+
+  om_add_samples(text, registry_name, registry_namelen, name, namelen,
+    "_count", 6, counts);
+  om_add_samples(text, registry_name, registry_namelen, name, namelen,
+    "_sum", 4, sums);
+  om_add_created(text, registry_name, registry_namelen, name, namelen,
+    labels, labelslen, created);
+}
+
+static int om_add_histogram(pool *p, struct prom_metric *metric,
+    struct prom_text *text, const char *registry_name,
+    size_t registry_namelen, pr_table_t *samples) {
+  register unsigned int i;
+  const array_header *rows, *buckets, *counts = NULL, *sums = NULL;
+  int native_only;
+
+  if (metric->histogram_name == NULL) {
+    errno = EPERM;
+    return -1;
+  }
+
+  /* Histograms with only native buckets are rendered from those. */
+  native_only = (metric->histogram_native == TRUE &&
+    metric->histogram_bucket_count == 1);
+
+  if (native_only == TRUE) {
+    rows = metric_bins_get(p, metric, metric->histogram_native_id, samples);
+
+  } else {
+    rows = metric_histogram_get(p, metric, samples);
+  }
+
+  if (rows == NULL) {
+    return -1;
+  }
+
+  om_add_metadata(text, registry_name, registry_namelen,
+    metric->histogram_name, metric->histogram_namelen,
+    metric->histogram_help, metric->histogram_helplen,
+    PROM_METRIC_TYPE_HISTOGRAM);
+
+  for (i = 0; i < rows->nelts; i++) {
+    const char *labels;
+    size_t labelslen;
+    double created;
+
+    if (native_only == TRUE) {
+      const struct prom_metric_db_summary *row;
+
+      row = ((const struct prom_metric_db_summary *) rows->elts) + i;
+      buckets = native_get_samples(p, metric,
+        om_get_row(p, row, sizeof(struct prom_metric_db_summary)), &counts,
+        &sums, TRUE);
+      labels = row->sample_labels;
+      labelslen = row->sample_labelslen;
+      created = row->created;
+
+    } else {
+      const struct prom_metric_db_histogram *row;
+
+      row = ((const struct prom_metric_db_histogram *) rows->elts) + i;
+      buckets = histogram_get_samples(p, metric,
+        om_get_row(p, row, sizeof(struct prom_metric_db_histogram)), &counts,
+        &sums, TRUE);
+      labels = row->sample_labels;
+      labelslen = row->sample_labelslen;
+      created = row->created;
+    }
+
+    om_add_row_samples(text, registry_name, registry_namelen,
+      metric->histogram_name, metric->histogram_namelen,
+      PROM_METRIC_TYPE_HISTOGRAM, buckets, counts, sums, labels, labelslen,
+      created);
+  }
+
+  return 0;
+}
+
+static int om_add_summary(pool *p, struct prom_metric *metric,
+    struct prom_text *text, const char *registry_name,
+    size_t registry_namelen, pr_table_t *samples) {
+  register unsigned int i;
+  const array_header *rows;
+  const struct prom_metric_db_summary *elts;
+
+  if (metric->summary_name == NULL) {
+    errno = EPERM;
+    return -1;
+  }
+
+  rows = metric_bins_get(p, metric, metric->summary_id, samples);
+  if (rows == NULL) {
+    return -1;
+  }
+
+  om_add_metadata(text, registry_name, registry_namelen, metric->summary_name,
+    metric->summary_namelen, metric->summary_help, metric->summary_helplen,
+    PROM_METRIC_TYPE_SUMMARY);
+
+  elts = rows->elts;
+  for (i = 0; i < rows->nelts; i++) {
+    const array_header *quantiles, *counts = NULL, *sums = NULL;
+
+    quantiles = summary_get_samples(p, metric,
+      om_get_row(p, &(elts[i]), sizeof(struct prom_metric_db_summary)),
+      &counts, &sums, TRUE);
+
+    om_add_row_samples(text, registry_name, registry_namelen,
+      metric->summary_name, metric->summary_namelen, PROM_METRIC_TYPE_SUMMARY,
+      quantiles, counts, sums, elts[i].sample_labels,
+      elts[i].sample_labelslen, elts[i].created);
+  }
+
+  return 0;
+}
+
+static const char *metric_get_openmetrics(pool *p, struct prom_metric *metric,
+    const char *registry_name, pr_table_t *samples, size_t *len) {
+  int xerrno;
+  pool *tmp_pool;
+  size_t registry_namelen;
+  struct prom_text *text;
+  const char *res;
+
+  registry_namelen = strlen(registry_name);
+  tmp_pool = make_sub_pool(p);
+  /* The text is allocated from the caller's pool, so that its buffer can be
+   * returned as is, rather than copied.
+   */
+  text = prom_text_create(p);
+
+  /* Note that a metric need not have all of these types. */
+  (void) om_add_counter(tmp_pool, metric, text, registry_name,
+    registry_namelen, samples);
+  (void) om_add_gauge(tmp_pool, metric, text, registry_name,
+    registry_namelen, samples);
+  (void) om_add_histogram(tmp_pool, metric, text, registry_name,
+    registry_namelen, samples);
+  (void) om_add_summary(tmp_pool, metric, text, registry_name,
+    registry_namelen, samples);
+
+  res = prom_text_get_buf(text, len);
+  xerrno = errno;
+
+  if (res != NULL) {
+    pr_trace_msg(trace_channel, 19,
+      "converted '%s' metric to OpenMetrics text:\n%.*s", metric->name,
+      (int) *len, res);
+  }
+
+  if (res == NULL) {
+    prom_text_destroy(text);
+  }
+
+  destroy_pool(tmp_pool);
+
+  errno = xerrno;
+  return res;
+}
+
+/* Get the OpenMetrics text for the given metric: for each metric type, add:
+ *
+ *  "# HELP name ...\n"
+ *  "# TYPE name ...\n"
+ *  "# UNIT name ...\n" (if the name ends in a unit)
+ *  "name<suffix><sample_labels> sample_val[ # exemplar]\n"
+ *  "name_created<sample_labels> created\n"
+ */
+const char *prom_metric_get_openmetrics(pool *p, struct prom_metric *metric,
+    const char *registry_name, size_t *len) {
+
+  if (p == NULL ||
+      metric == NULL ||
+      registry_name == NULL ||
+      len == NULL) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  return metric_get_openmetrics(p, metric, registry_name, NULL, len);
+}
+
+const char *prom_metric_get_openmetrics_with_samples(pool *p,
+    struct prom_metric *metric, const char *registry_name,
+    pr_table_t *samples, size_t *len) {
+
+  if (p == NULL ||
+      metric == NULL ||
+      registry_name == NULL ||
+      samples == NULL ||
+      len == NULL) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  return metric_get_openmetrics(p, metric, registry_name, samples, len);
+}
+
+/* Label values: the label text is rendered from the metric's declared label
+ * names, the given values, and the base labels, into a caller-provided
+ * buffer, without allocating.
+ */
+static int label_value_add(char *buf, size_t bufsz, size_t *buflen,
+    const char *name, size_t namelen, const char *val, size_t valsz) {
+  size_t len;
+
+  /* Separator, name, `="`, value, `"`, and room for the closing brace. */
+  len = 1 + namelen + 2 + valsz + 1;
+  if (*buflen + len + 2 > bufsz) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+
+  buf[*buflen] = (*buflen == 0 ? '{' : ',');
+  (*buflen)++;
+  memcpy(buf + *buflen, name, namelen);
+  *buflen += namelen;
+  buf[(*buflen)++] = '=';
+  buf[(*buflen)++] = '"';
+  memcpy(buf + *buflen, val, valsz);
+  *buflen += valsz;
+  buf[(*buflen)++] = '"';
+
+  return 0;
+}
+
+static int base_label_add(char *buf, size_t bufsz, size_t *buflen,
+    unsigned int idx) {
+  size_t len;
+
+  len = base_label_textlens[idx];
+  if (*buflen + 1 + len + 2 > bufsz) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+
+  buf[*buflen] = (*buflen == 0 ? '{' : ',');
+  (*buflen)++;
+  memcpy(buf + *buflen, base_label_texts[idx], len);
+  *buflen += len;
+
+  return 0;
+}
+
+/* Merges the (sorted) base labels and the metric's (sorted) label names,
+ * thus the text matches that of prom_text_from_labels() for the same labels.
+ * A value given for a base label name takes precedence; NULL values are
+ * omitted.
+ */
+static const char *metric_values_text(const struct prom_metric *metric,
+    const char **values, char *buf, size_t bufsz) {
+  unsigned int i = 0, j = 0, label_count = 0;
+  size_t buflen = 0;
+  int res = 0;
+
+  if (values != NULL) {
+    label_count = metric->label_count;
+  }
+
+  while (res == 0 &&
+         (i < base_label_count || j < label_count)) {
+    int cmp;
+    const char *val = NULL;
+
+    if (i == base_label_count) {
+      cmp = 1;
+
+    } else if (j == label_count) {
+      cmp = -1;
+
+    } else {
+      cmp = strcmp(base_label_names[i], metric->label_names[j]);
+    }
+
+    if (cmp >= 0) {
+      val = values[metric->label_value_idxs[j]];
+    }
+
+    if (val != NULL) {
+      res = label_value_add(buf, bufsz, &buflen, metric->label_names[j],
+        metric->label_namelens[j], val, strlen(val));
+
+    } else if (cmp <= 0) {
+      res = base_label_add(buf, bufsz, &buflen, i);
+    }
+
+    if (cmp <= 0) {
+      i++;
+    }
+
+    if (cmp >= 0) {
+      j++;
+    }
+  }
+
+  if (res < 0) {
+    pr_trace_msg(trace_channel, 12, "labels for '%s' too long (max %lu)",
+      metric->name, (unsigned long) bufsz);
+    return NULL;
+  }
+
+  if (buflen > 0) {
+    buf[buflen++] = '}';
+  }
+
+  buf[buflen] = '\0';
+  return buf;
+}
+
+static int metric_decr(pool *p, const struct prom_metric *metric,
+    uint32_t val, const char *label_str) {
+  return metric_sample_decr(p, metric, metric->gauge_id, (double) val,
+    label_str);
+}
+
+int prom_metric_decr(pool *p, const struct prom_metric *metric, uint32_t val,
+    pr_table_t *labels) {
+  int res, xerrno;
+  pool *tmp_pool;
+  struct prom_text *text;
+  const char *label_str;
+
+  if (p == NULL ||
+      metric == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  /* Decrement operation only supported for gauges. */
+  if (metric->gauge_name == NULL) {
+    errno = EPERM;
+    return -1;
+  }
+
+  tmp_pool = make_sub_pool(p);
+  text = prom_text_create(tmp_pool);
+  label_str = prom_text_from_labels(tmp_pool, text, labels);
+  res = metric_decr(p, metric, val, label_str);
+  xerrno = errno;
+
+  prom_text_destroy(text);
+  destroy_pool(tmp_pool);
+  errno = xerrno;
+  return res;
+}
+
+int prom_metric_decr_values(pool *p, const struct prom_metric *metric,
+    uint32_t val, const char **values) {
+  char buf[PROM_METRIC_LABELS_MAX_LEN];
+  const char *label_str;
+
+  if (p == NULL ||
+      metric == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (metric->gauge_name == NULL) {
+    errno = EPERM;
+    return -1;
+  }
+
+  label_str = metric_values_text(metric, values, buf, sizeof(buf));
+  if (label_str == NULL) {
+    return -1;
+  }
+
+  return metric_decr(p, metric, val, label_str);
+}
+
+static int metric_incr_type(pool *p, const struct prom_metric *metric,
+    uint32_t val, const char *label_str, int metric_type) {
+  int res;
+  const char *metric_name;
+
+  if (metric_type == PROM_METRIC_TYPE_COUNTER) {
+    metric_name = metric->counter_name;
+    res = metric_sample_add(p, metric, metric->counter_id, (double) val,
+      label_str);
+
+  } else {
+    metric_name = metric->gauge_name;
+    res = metric_sample_incr(p, metric, metric->gauge_id, (double) val,
+      label_str);
+  }
+
+  if (res < 0) {
+    int xerrno = errno;
+
+    pr_trace_msg(trace_channel, 12, "error incrementing '%s' by %lu: %s",
+      metric_name, (unsigned long) val, strerror(xerrno));
+    errno = xerrno;
+  }
+
+  return res;
+}
+
+/* Increment operation only supported for counters/gauges. */
+static int metric_check_incr_type(const struct prom_metric *metric,
+    int metric_type) {
+  switch (metric_type) {
+    case PROM_METRIC_TYPE_COUNTER:
+      if (metric->counter_name == NULL) {
+        errno = EPERM;
+        return -1;
+      }
+      break;
+
+    case PROM_METRIC_TYPE_GAUGE:
+      if (metric->gauge_name == NULL) {
+        errno = EPERM;
+        return -1;
       }
+      break;
+
+    case PROM_METRIC_TYPE_HISTOGRAM:
+      errno = EPERM;
+      return -1;
+
+    default:
+      errno = EINVAL;
+      return -1;
+  }
+
+  return 0;
+}
+
+int prom_metric_incr_type(pool *p, const struct prom_metric *metric,
+    uint32_t val, pr_table_t *labels, int metric_type) {
+  int res = 0, xerrno;
+  pool *tmp_pool;
+  struct prom_text *text;
+  const char *label_str;
+
+  if (p == NULL ||
+      metric == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (metric_check_incr_type(metric, metric_type) < 0) {
+    return -1;
+  }
+
+  tmp_pool = make_sub_pool(p);
+  text = prom_text_create(tmp_pool);
+  label_str = prom_text_from_labels(tmp_pool, text, labels);
+  res = metric_incr_type(p, metric, val, label_str, metric_type);
+  xerrno = errno;
+
+  prom_text_destroy(text);
+  destroy_pool(tmp_pool);
+  errno = xerrno;
+  return res;
+}
+
+int prom_metric_incr_type_values(pool *p, const struct prom_metric *metric,
+    uint32_t val, const char **values, int metric_type) {
+  char buf[PROM_METRIC_LABELS_MAX_LEN];
+  const char *label_str;
+
+  if (p == NULL ||
+      metric == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (metric_check_incr_type(metric, metric_type) < 0) {
+    return -1;
+  }
+
+  label_str = metric_values_text(metric, values, buf, sizeof(buf));
+  if (label_str == NULL) {
+    return -1;
+  }
+
+  return metric_incr_type(p, metric, val, label_str, metric_type);
+}
+
+int prom_metric_incr(pool *p, const struct prom_metric *metric, uint32_t val,
+    pr_table_t *labels) {
+
+  if (metric == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  /* Increment operation only supported for counters/gauges. */
+  if (metric->counter_name == NULL &&
+      metric->gauge_name == NULL) {
+    errno = EPERM;
+    return -1;
+  }
+
+  if (metric->counter_name != NULL) {
+    int res;
+
+    res = prom_metric_incr_type(p, metric, val, labels,
+      PROM_METRIC_TYPE_COUNTER);
+    if (res < 0) {
+      return -1;
+    }
+  }
+
+  if (metric->gauge_name != NULL) {
+    int res;
+
+    res = prom_metric_incr_type(p, metric, val, labels, PROM_METRIC_TYPE_GAUGE);
+    if (res < 0) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+int prom_metric_incr_values(pool *p, const struct prom_metric *metric,
+    uint32_t val, const char **values) {
+  char buf[PROM_METRIC_LABELS_MAX_LEN];
+  const char *label_str;
+
+  if (p == NULL ||
+      metric == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (metric->counter_name == NULL &&
+      metric->gauge_name == NULL) {
+    errno = EPERM;
+    return -1;
+  }
+
+  label_str = metric_values_text(metric, values, buf, sizeof(buf));
+  if (label_str == NULL) {
+    return -1;
+  }
+
+  if (metric->counter_name != NULL) {
+    if (metric_incr_type(p, metric, val, label_str,
+        PROM_METRIC_TYPE_COUNTER) < 0) {
+      return -1;
+    }
+  }
+
+  if (metric->gauge_name != NULL) {
+    if (metric_incr_type(p, metric, val, label_str,
+        PROM_METRIC_TYPE_GAUGE) < 0) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/* Finds the first bucket whose upper bound is at least the given value;
+ * values beyond all of the finite bounds (or NaN) land in the "+Inf" bucket.
+ */
+static unsigned int histogram_bucket_idx(const struct prom_metric *metric,
+    double val) {
+  unsigned int lo = 0, hi;
+
+  hi = metric->histogram_bucket_count - 1;
+  while (lo < hi) {
+    unsigned int mid;
+
+    mid = lo + ((hi - lo) / 2);
+    if (val <= metric->histogram_buckets[mid]->upper_bound) {
+      hi = mid;
+
+    } else {
+      lo = mid + 1;
+    }
+  }
+
+  return lo;
+}
+
+/* Formats the exemplar of an observation, as its labels, value, and
+ * timestamp, e.g. `{pid="123"} 0.5 1617813000.123`, into the given buffer.
+ */
+static const char *get_exemplar_text(char *buf, size_t bufsz, double val) {
+  struct timeval tv;
+  char val_text[PROM_TEXT_DOUBLE_MAX_LEN];
+  int len;
+
+  gettimeofday(&tv, NULL);
+
+  if (prom_text_format_double(val_text, sizeof(val_text), val) < 0) {
+    return NULL;
+  }
+
+  len = snprintf(buf, bufsz, "%s %s %lu.%03lu", exemplar_labels, val_text,
+    (unsigned long) tv.tv_sec, (unsigned long) (tv.tv_usec / 1000));
+  if (len < 0 ||
+      (size_t) len >= bufsz) {
+    return NULL;
+  }
+
+  return buf;
+}
+
+static void metric_observe(pool *p, const struct prom_metric *metric,
+    double val, const char *label_str) {
+  int res;
+  unsigned int bucket_idx;
+
+  /* Histograms with only native buckets skip the classic buckets. */
+  if (metric->histogram_name != NULL &&
+      (metric->histogram_native == FALSE ||
+       metric->histogram_bucket_count > 1)) {
+    char exemplar_buf[PROM_METRIC_EXEMPLAR_MAX_LABELS_LEN * 4 + 64];
+    const char *exemplar = NULL;
+
+    /* Only the bucket into which the value falls is updated; the cumulative
+     * bucket counts are computed when scraped.
+     */
+    bucket_idx = histogram_bucket_idx(metric, val);
+
+    if (exemplar_labels != NULL) {
+      exemplar = get_exemplar_text(exemplar_buf, sizeof(exemplar_buf), val);
+    }
+
+    res = metric_histogram_add(p, metric, bucket_idx, val, label_str,
+      exemplar);
+    if (res < 0) {
+      pr_trace_msg(trace_channel, 12, "error observing '%s' with %g: %s",
+        metric->histogram_name, val, strerror(errno));
+    }
+  }
+
+  if (metric->histogram_native == TRUE) {
+    res = metric_bin_add(p, metric, metric->histogram_native_id,
+      native_bucket_key(val, metric->histogram_schema), val, label_str);
+    if (res < 0) {
+      pr_trace_msg(trace_channel, 12,
+        "error observing native '%s' with %g: %s", metric->histogram_name,
+        val, strerror(errno));
+    }
+  }
+
+  if (metric->summary_name != NULL) {
+    res = metric_bin_add(p, metric, metric->summary_id, prom_sketch_key(val),
+      val, label_str);
+    if (res < 0) {
+      pr_trace_msg(trace_channel, 12, "error observing '%s' with %g: %s",
+        metric->summary_name, val, strerror(errno));
+    }
+  }
+}
+
+int prom_metric_observe(pool *p, const struct prom_metric *metric, double val,
+    pr_table_t *labels) {
+  pool *tmp_pool;
+  struct prom_text *text;
+  const char *label_str;
+
+  if (p == NULL ||
+      metric == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  /* Observe operation only supported for histograms and summaries. */
+  if (metric->histogram_name == NULL &&
+      metric->summary_name == NULL) {
+    errno = EPERM;
+    return -1;
+  }
+
+  tmp_pool = make_sub_pool(p);
+  text = prom_text_create(tmp_pool);
+  label_str = prom_text_from_labels(tmp_pool, text, labels);
+
+  metric_observe(p, metric, val, label_str);
+
+  prom_text_destroy(text);
+  destroy_pool(tmp_pool);
+
+  return 0;
+}
+
+int prom_metric_observe_values(pool *p, const struct prom_metric *metric,
+    double val, const char **values) {
+  char buf[PROM_METRIC_LABELS_MAX_LEN];
+  const char *label_str;
+
+  if (p == NULL ||
+      metric == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (metric->histogram_name == NULL &&
+      metric->summary_name == NULL) {
+    errno = EPERM;
+    return -1;
+  }
+
+  label_str = metric_values_text(metric, values, buf, sizeof(buf));
+  if (label_str == NULL) {
+    return -1;
+  }
+
+  metric_observe(p, metric, val, label_str);
+  return 0;
+}
+
+int prom_metric_set(pool *p, const struct prom_metric *metric, uint32_t val,
+    pr_table_t *labels) {
+  int res, xerrno;
+  pool *tmp_pool;
+  struct prom_text *text;
+  const char *label_str;
+
+  if (p == NULL ||
+      metric == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  /* Set operation only supported for gauges. */
+  if (metric->gauge_name == NULL) {
+    errno = EPERM;
+    return -1;
+  }
+
+  tmp_pool = make_sub_pool(p);
+  text = prom_text_create(tmp_pool);
+  label_str = prom_text_from_labels(tmp_pool, text, labels);
+  res = metric_sample_set(p, metric, metric->gauge_id,
+    (double) val, label_str);
+  xerrno = errno;
+
+  prom_text_destroy(text);
+  destroy_pool(tmp_pool);
+  errno = xerrno;
+  return res;
+}
+
+int prom_metric_add_counter(struct prom_metric *metric, const char *suffix,
+    const char *help_text) {
+  int res;
+  int64_t counter_id;
+
+  if (metric == NULL ||
+      help_text == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (suffix != NULL) {
+    metric->counter_name = pstrcat(metric->pool, metric->name, "_", suffix,
+      NULL);
+
+  } else {
+    metric->counter_name = metric->name;
+  }
+
+  metric->counter_namelen = strlen(metric->counter_name);
+  metric->counter_help = pstrdup(metric->pool, help_text);
+  metric->counter_helplen = strlen(metric->counter_help);
+
+  res = prom_metric_db_exists(metric->pool, metric->dbh, metric->counter_name);
+  if (res == 0) {
+    pr_trace_msg(trace_channel, 3, "'%s' metric already exists in database",
+      metric->counter_name);
+    errno = EEXIST;
+    return -1;
+  }
+
+  res = prom_metric_db_create(metric->pool, metric->dbh, metric->counter_name,
+    PROM_METRIC_TYPE_COUNTER, &counter_id);
+  if (res < 0) {
+    pr_trace_msg(trace_channel, 3, "error adding '%s' metric to database: %s",
+      metric->counter_name, strerror(errno));
+    errno = EEXIST;
+    return -1;
+  }
+
+  metric->counter_id = counter_id;
+  pr_trace_msg(trace_channel, 27,
+    "added '%s' counter metric (ID %lld) to database", metric->counter_name,
+    (long long int) metric->counter_id);
+  return 0;
+}
+
+int prom_metric_add_gauge(struct prom_metric *metric, const char *suffix,
+    const char *help_text) {
+  int res;
+  int64_t gauge_id;
+
+  if (metric == NULL ||
+      help_text == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (suffix != NULL) {
+    metric->gauge_name = pstrcat(metric->pool, metric->name, "_", suffix,
+      NULL);
+
+  } else {
+    metric->gauge_name = metric->name;
+  }
+
+  metric->gauge_namelen = strlen(metric->gauge_name);
+  metric->gauge_help = pstrdup(metric->pool, help_text);
+  metric->gauge_helplen = strlen(metric->gauge_help);
+
+  res = prom_metric_db_exists(metric->pool, metric->dbh, metric->gauge_name);
+  if (res == 0) {
+    pr_trace_msg(trace_channel, 3, "'%s' metric already exists in database",
+      metric->gauge_name);
+    errno = EEXIST;
+    return -1;
+  }
+
+  res = prom_metric_db_create(metric->pool, metric->dbh, metric->gauge_name,
+    PROM_METRIC_TYPE_GAUGE, &gauge_id);
+  if (res < 0) {
+    pr_trace_msg(trace_channel, 3, "error adding '%s' metric to database: %s",
+      metric->gauge_name, strerror(errno));
+    errno = EEXIST;
+    return -1;
+  }
+
+  metric->gauge_id = gauge_id;
+  pr_trace_msg(trace_channel, 27,
+    "added '%s' gauge metric (ID %lld) to database", metric->gauge_name,
+    (long long int) metric->gauge_id);
+  return 0;
+}
+
+static const char *get_double_text(pool *p, double val) {
+  char *text;
+  size_t text_len;
+
+  text_len = 50;
+  text = pcalloc(p, text_len);
+  snprintf(text, text_len-1, "%f", val);
+
+  if (strstr(text, ".") == NULL) {
+    strcat(text, ".0");
+  }
+
+  return text;
+}
+
+static int metric_add_histogram(struct prom_metric *metric,
+    const char *suffix, const char *help_text, unsigned int bucket_count,
+    const double *bounds) {
+  register unsigned int i;
+  int res;
+
+  if (suffix != NULL) {
+    metric->histogram_name = pstrcat(metric->pool, metric->name, "_", suffix,
+      NULL);
+
+  } else {
+    metric->histogram_name = metric->name;
+  }
+
+  metric->histogram_namelen = strlen(metric->histogram_name);
+  metric->histogram_help = pstrdup(metric->pool, help_text);
+  metric->histogram_helplen = strlen(metric->histogram_help);
+
+  /* Add one more for the "+Inf" bucket.  Note that the bucket bounds are
+   * expected in ascending order.
+   */
+  metric->histogram_bucket_count = bucket_count + 1;
+  metric->histogram_buckets = pcalloc(metric->pool,
+    sizeof(struct prom_histogram_bucket *) * metric->histogram_bucket_count);
+  for (i = 0; i < metric->histogram_bucket_count; i++) {
+    metric->histogram_buckets[i] = pcalloc(metric->pool,
+      sizeof(struct prom_histogram_bucket));
+  }
+
+  for (i = 0; i < metric->histogram_bucket_count; i++) {
+    struct prom_histogram_bucket *bucket;
+
+    bucket = ((struct prom_histogram_bucket **) metric->histogram_buckets)[i];
+
+    if (i != metric->histogram_bucket_count-1) {
+      bucket->upper_bound = bounds[i];
+      bucket->upper_bound_text = get_double_text(metric->pool,
+        bucket->upper_bound);
+
+    } else {
+      /* The "+Inf" bucket. */
+      bucket->is_inf_bucket = TRUE;
+      bucket->upper_bound_text = pstrdup(metric->pool, "+Inf");
+    }
+  }
+
+  /* All of the buckets, the count, and the sum are stored in the rows of
+   * this single histogram metric.
+   */
+  res = prom_metric_db_exists(metric->pool, metric->dbh,
+    metric->histogram_name);
+  if (res == 0) {
+    pr_trace_msg(trace_channel, 3, "'%s' metric already exists in database",
+      metric->histogram_name);
+    errno = EEXIST;
+    return -1;
+  }
+
+  res = prom_metric_db_create(metric->pool, metric->dbh,
+    metric->histogram_name, PROM_METRIC_TYPE_HISTOGRAM,
+    &(metric->histogram_id));
+  if (res < 0) {
+    pr_trace_msg(trace_channel, 3, "error adding '%s' metric to database: %s",
+      metric->histogram_name, strerror(errno));
+    errno = EEXIST;
+    return -1;
+  }
+
+  pr_trace_msg(trace_channel, 27,
+    "added '%s' histogram metric (ID %lld, %u buckets) to database",
+    metric->histogram_name, (long long) metric->histogram_id,
+    metric->histogram_bucket_count);
+  return 0;
+}
+
+int prom_metric_add_histogram(struct prom_metric *metric, const char *suffix,
+    const char *help_text, unsigned int bucket_count, ...) {
+  register unsigned int i;
+  double *bounds = NULL;
+  va_list ap;
+
+  if (metric == NULL ||
+      help_text == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (bucket_count > 0) {
+    bounds = palloc(metric->pool, sizeof(double) * bucket_count);
+  }
+
+  va_start(ap, bucket_count);
+  for (i = 0; i < bucket_count; i++) {
+    bounds[i] = va_arg(ap, double);
+  }
+  va_end(ap);
+
+  return metric_add_histogram(metric, suffix, help_text, bucket_count,
+    bounds);
+}
+
+int prom_metric_set_native_histogram(struct prom_metric *metric,
+    int schema) {
+  const char *native_name;
+  int res;
+
+  if (metric == NULL ||
+      schema < PROM_METRIC_NATIVE_SCHEMA_MIN ||
+      schema > PROM_METRIC_NATIVE_SCHEMA_MAX) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (metric->histogram_name == NULL) {
+    /* No histogram associated with this metric. */
+    errno = EPERM;
+    return -1;
+  }
+
+  if (metric->histogram_native == TRUE) {
+    errno = EEXIST;
+    return -1;
+  }
+
+  /* The native buckets need their own ID, distinct from that of the classic
+   * buckets; note that '#' cannot appear in any real metric name.
+   */
+  native_name = pstrcat(metric->pool, metric->histogram_name, "#native",
+    NULL);
+
+  res = prom_metric_db_exists(metric->pool, metric->dbh, native_name);
+  if (res == 0) {
+    pr_trace_msg(trace_channel, 3, "'%s' metric already exists in database",
+      native_name);
+    errno = EEXIST;
+    return -1;
+  }
+
+  res = prom_metric_db_create(metric->pool, metric->dbh, native_name,
+    PROM_METRIC_TYPE_HISTOGRAM, &(metric->histogram_native_id));
+  if (res < 0) {
+    pr_trace_msg(trace_channel, 3, "error adding '%s' metric to database: %s",
+      native_name, strerror(errno));
+    errno = EEXIST;
+    return -1;
+  }
+
+  metric->histogram_native = TRUE;
+  metric->histogram_schema = schema;
+
+  pr_trace_msg(trace_channel, 27,
+    "added native buckets (schema %d, ID %lld) to '%s' histogram metric",
+    schema, (long long) metric->histogram_native_id, metric->histogram_name);
+  return 0;
+}
+
+static int metric_add_summary(struct prom_metric *metric, const char *suffix,
+    const char *help_text, unsigned int quantile_count,
+    const double *quantiles) {
+  register unsigned int i;
+  int res;
+
+  if (suffix != NULL) {
+    metric->summary_name = pstrcat(metric->pool, metric->name, "_", suffix,
+      NULL);
+
+  } else {
+    metric->summary_name = metric->name;
+  }
+
+  metric->summary_namelen = strlen(metric->summary_name);
+  metric->summary_help = pstrdup(metric->pool, help_text);
+  metric->summary_helplen = strlen(metric->summary_help);
+
+  metric->summary_quantile_count = quantile_count;
+  metric->summary_quantiles = pcalloc(metric->pool,
+    sizeof(double) * quantile_count);
+  metric->summary_quantile_texts = pcalloc(metric->pool,
+    sizeof(char *) * quantile_count);
+
+  for (i = 0; i < quantile_count; i++) {
+    double quantile;
+    char *quantile_text;
+
+    quantile = quantiles[i];
+    if (quantile < 0.0 ||
+        quantile > 1.0) {
+      metric->summary_name = NULL;
+      errno = EINVAL;
+      return -1;
+    }
+
+    quantile_text = pcalloc(metric->pool, 32);
+    snprintf(quantile_text, 31, "%g", quantile);
+
+    metric->summary_quantiles[i] = quantile;
+    metric->summary_quantile_texts[i] = quantile_text;
+  }
+
+  /* The sketch bins, for all label sets, are stored in the rows of this
+   * single summary metric.
+   */
+  res = prom_metric_db_exists(metric->pool, metric->dbh, metric->summary_name);
+  if (res == 0) {
+    pr_trace_msg(trace_channel, 3, "'%s' metric already exists in database",
+      metric->summary_name);
+    errno = EEXIST;
+    return -1;
+  }
+
+  res = prom_metric_db_create(metric->pool, metric->dbh, metric->summary_name,
+    PROM_METRIC_TYPE_SUMMARY, &(metric->summary_id));
+  if (res < 0) {
+    pr_trace_msg(trace_channel, 3, "error adding '%s' metric to database: %s",
+      metric->summary_name, strerror(errno));
+    errno = EEXIST;
+    return -1;
+  }
+
+  pr_trace_msg(trace_channel, 27,
+    "added '%s' summary metric (ID %lld, %u quantiles) to database",
+    metric->summary_name, (long long) metric->summary_id,
+    metric->summary_quantile_count);
+  return 0;
+}
+
+int prom_metric_add_summary(struct prom_metric *metric, const char *suffix,
+    const char *help_text, unsigned int quantile_count, ...) {
+  register unsigned int i;
+  double *quantiles;
+  va_list ap;
+
+  if (metric == NULL ||
+      help_text == NULL ||
+      quantile_count == 0) {
+    errno = EINVAL;
+    return -1;
+  }
 
-      /* For histograms, the caller needs to provide ways to return the
-       * count/sum as well.
-       */
-      if (histogram_counts == NULL ||
-          histogram_sums == NULL) {
-        errno = EINVAL;
-        return NULL;
-      }
+  quantiles = palloc(metric->pool, sizeof(double) * quantile_count);
 
-      for (i = 0; i < metric->histogram_bucket_count; i++) {
-        struct prom_histogram_bucket *bucket;
-        const array_header *bucket_results;
-
-        bucket = ((struct prom_histogram_bucket **) metric->histogram_buckets)[i];
-        bucket_results = prom_metric_db_sample_get(p, metric->dbh,
-          bucket->bucket_id);
-        if (bucket_results != NULL) {
-          pr_trace_msg(trace_channel, 17,
-            "found samples (%d) for histogram bucket '%s' metric '%s'",
-            bucket_results->nelts/2, bucket->upper_bound_text,
-            metric->histogram_name);
-        }
+  va_start(ap, quantile_count);
+  for (i = 0; i < quantile_count; i++) {
+    quantiles[i] = va_arg(ap, double);
+  }
+  va_end(ap);
 
-        if (results != NULL) {
-          array_cat((array_header *) results, bucket_results);
+  return metric_add_summary(metric, suffix, help_text, quantile_count,
+    quantiles);
+}
 
-        } else {
-          results = bucket_results;
-        }
-      }
+/* Sorts the given label names (there are few), and their value indexes, if
+ * any.
+ */
+static void sort_label_names(const char **names, unsigned int *idxs,
+    unsigned int count) {
+  register unsigned int i;
 
-      sample_results = prom_metric_db_sample_get(p, metric->dbh,
-        metric->histogram_count_id);
-      if (sample_results != NULL) {
-        pr_trace_msg(trace_channel, 17,
-          "found samples (%d) for histogram bucket 'count' metric '%s'",
-          sample_results->nelts/2, metric->histogram_name);
-      }
-      *histogram_counts = sample_results;
+  for (i = 1; i < count; i++) {
+    unsigned int j;
 
-      sample_results = prom_metric_db_sample_get(p, metric->dbh,
-        metric->histogram_sum_id);
-      if (sample_results != NULL) {
-        pr_trace_msg(trace_channel, 17,
-          "found samples (%d) for histogram bucket 'sum' metric '%s'",
-          sample_results->nelts/2, metric->histogram_name);
+    for (j = i; j > 0 && strcmp(names[j-1], names[j]) > 0; j--) {
+      const char *name;
+
+      name = names[j];
+      names[j] = names[j-1];
+      names[j-1] = name;
+
+      if (idxs != NULL) {
+        unsigned int idx;
+
+        idx = idxs[j];
+        idxs[j] = idxs[j-1];
+        idxs[j-1] = idx;
       }
-      *histogram_sums = sample_results;
+    }
+  }
+}
 
-      return results;
+static int metric_set_label_names(struct prom_metric *metric,
+    unsigned int label_count, const char **label_names) {
+  register unsigned int i;
+  const char **names;
+  unsigned int *idxs;
+
+  if (label_count == 0) {
+    metric->label_count = 0;
+    return 0;
+  }
+
+  names = pcalloc(metric->pool, sizeof(char *) * label_count);
+  idxs = pcalloc(metric->pool, sizeof(unsigned int) * label_count);
+
+  for (i = 0; i < label_count; i++) {
+    if (label_names[i] == NULL) {
+      errno = EINVAL;
+      return -1;
     }
 
-    default:
-      pr_trace_msg(trace_channel, 9,
-        "unknown metric type %d requested for '%s'", metric_type, metric->name);
+    names[i] = pstrdup(metric->pool, label_names[i]);
+    idxs[i] = i;
+  }
+
+  sort_label_names(names, idxs, label_count);
+
+  for (i = 1; i < label_count; i++) {
+    if (strcmp(names[i-1], names[i]) == 0) {
       errno = EINVAL;
-      return NULL;
+      return -1;
+    }
   }
 
-  return results;
+  metric->label_namelens = pcalloc(metric->pool, sizeof(size_t) * label_count);
+  for (i = 0; i < label_count; i++) {
+    metric->label_namelens[i] = strlen(names[i]);
+  }
+
+  metric->label_names = names;
+  metric->label_value_idxs = idxs;
+  metric->label_count = label_count;
+
+  return 0;
 }
 
-int prom_metric_decr(pool *p, const struct prom_metric *metric, uint32_t val,
-    pr_table_t *labels) {
-  int res, xerrno;
-  pool *tmp_pool;
-  struct prom_text *text;
-  const char *label_str;
+int prom_metric_set_label_names(struct prom_metric *metric,
+    unsigned int label_count, ...) {
+  register unsigned int i;
+  const char **names = NULL;
+  va_list ap;
 
-  if (p == NULL ||
-      metric == NULL) {
+  if (metric == NULL) {
     errno = EINVAL;
     return -1;
   }
 
-  /* Decrement operation only supported for gauges. */
-  if (metric->gauge_name == NULL) {
-    errno = EPERM;
+  if (label_count > 0) {
+    names = palloc(metric->pool, sizeof(char *) * label_count);
+  }
+
+  va_start(ap, label_count);
+  for (i = 0; i < label_count; i++) {
+    names[i] = va_arg(ap, const char *);
+  }
+  va_end(ap);
+
+  return metric_set_label_names(metric, label_count, names);
+}
+
+int prom_metric_set_dbh(struct prom_metric *metric, struct prom_dbh *dbh) {
+  if (metric == NULL ||
+      dbh == NULL) {
+    errno = EINVAL;
     return -1;
   }
 
-  tmp_pool = make_sub_pool(p);
-  text = prom_text_create(tmp_pool);
-  label_str = prom_text_from_labels(tmp_pool, text, labels);
-  res = prom_metric_db_sample_decr(p, metric->dbh, metric->gauge_id,
-    (double) val, label_str);
-  xerrno = errno;
+  metric->dbh = dbh;
+  return 0;
+}
 
-  prom_text_destroy(text);
-  destroy_pool(tmp_pool);
-  errno = xerrno;
-  return res;
+int prom_metric_set_shm(struct prom_metric *metric,
+    struct prom_metric_shm *shm) {
+  if (metric == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  metric->shm = shm;
+  return 0;
 }
 
-int prom_metric_incr_type(pool *p, const struct prom_metric *metric,
-    uint32_t val, pr_table_t *labels, int metric_type) {
-  int res = 0, xerrno;
+int prom_metric_set_buffer(struct prom_metric *metric,
+    struct prom_metric_buffer *buffer) {
+  if (metric == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  metric->buffer = buffer;
+  return 0;
+}
+
+int prom_metric_set_deferred(struct prom_metric *metric,
+    struct prom_metric_buffer *buffer) {
+  if (metric == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  metric->deferred = buffer;
+  return 0;
+}
+
+int prom_metric_get_busy_counts(uint64_t *deferred, uint64_t *dropped) {
+  if (deferred == NULL ||
+      dropped == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  *deferred = busy_deferred_count;
+  *dropped = busy_dropped_count;
+  return 0;
+}
+
+int prom_metric_set_exemplar_labels(pool *p, pr_table_t *labels) {
   pool *tmp_pool;
   struct prom_text *text;
-  const char *metric_name, *label_str;
-  int64_t metric_id;
+  const char *label_str;
+  const void *key;
+  size_t total_len = 0;
 
-  if (p == NULL ||
-      metric == NULL) {
+  if (p == NULL) {
     errno = EINVAL;
     return -1;
   }
 
-  /* Increment operation only supported for counters/gauges. */
-  switch (metric_type) {
-    case PROM_METRIC_TYPE_COUNTER:
-      if (metric->counter_name == NULL) {
-        errno = EPERM;
-        return -1;
-      }
-      metric_name = metric->counter_name;
-      metric_id = metric->counter_id;
-      break;
+  if (labels == NULL) {
+    exemplar_labels = NULL;
+    return 0;
+  }
 
-    case PROM_METRIC_TYPE_GAUGE:
-      if (metric->gauge_name == NULL) {
-        errno = EPERM;
-        return -1;
-      }
-      metric_name = metric->gauge_name;
-      metric_id = metric->gauge_id;
-      break;
+  if (pr_table_count(labels) <= 0) {
+    errno = EINVAL;
+    return -1;
+  }
 
-    case PROM_METRIC_TYPE_HISTOGRAM:
-      errno = EPERM;
-      return -1;
+  /* OpenMetrics limits the names and values of exemplar labels to 128
+   * characters, combined.
+   */
+  pr_table_rewind(labels);
+  key = pr_table_next(labels);
+  while (key != NULL) {
+    const char *val;
+
+    val = pr_table_get(labels, key, NULL);
+    total_len += strlen(key) + (val != NULL ? strlen(val) : 0);
+    key = pr_table_next(labels);
+  }
 
-    default:
-      errno = EINVAL;
-      return -1;
+  if (total_len > PROM_METRIC_EXEMPLAR_MAX_LABELS_LEN) {
+    errno = EINVAL;
+    return -1;
   }
 
   tmp_pool = make_sub_pool(p);
   text = prom_text_create(tmp_pool);
   label_str = prom_text_from_labels(tmp_pool, text, labels);
 
-  res = prom_metric_db_sample_incr(p, metric->dbh, metric_id, (double) val,
-    label_str);
-  xerrno = errno;
-
-  if (res < 0) {
-   pr_trace_msg(trace_channel, 12, "error incrementing '%s' by %lu: %s",
-      metric_name, (unsigned long) val, strerror(xerrno));
+  /* The exemplars are stored one per line. */
+  if (label_str == NULL ||
+      strchr(label_str, '\n') != NULL) {
+    prom_text_destroy(text);
+    destroy_pool(tmp_pool);
+    errno = EINVAL;
+    return -1;
   }
 
+  exemplar_labels = pstrdup(p, label_str);
+
   prom_text_destroy(text);
   destroy_pool(tmp_pool);
-  errno = xerrno;
-  return res;
+  return 0;
 }
 
-int prom_metric_incr(pool *p, const struct prom_metric *metric, uint32_t val,
-    pr_table_t *labels) {
+int prom_metric_set_base_labels(pool *p, pr_table_t *labels) {
+  register unsigned int i;
+  int count = 0;
+  const void *key;
+  const char **names;
 
-  if (metric == NULL) {
+  if (p == NULL) {
     errno = EINVAL;
     return -1;
   }
 
-  /* Increment operation only supported for counters/gauges. */
-  if (metric->counter_name == NULL &&
-      metric->gauge_name == NULL) {
-    errno = EPERM;
-    return -1;
+  if (base_labels_pool != NULL) {
+    destroy_pool(base_labels_pool);
+    base_labels_pool = NULL;
   }
 
-  if (metric->counter_name != NULL) {
-    int res;
+  base_label_count = 0;
+  base_label_names = base_label_texts = NULL;
+  base_label_textlens = NULL;
 
-    res = prom_metric_incr_type(p, metric, val, labels,
-      PROM_METRIC_TYPE_COUNTER);
-    if (res < 0) {
-      return -1;
-    }
+  if (labels != NULL) {
+    count = pr_table_count(labels);
   }
 
-  if (metric->gauge_name != NULL) {
-    int res;
+  if (count <= 0) {
+    return 0;
+  }
 
-    res = prom_metric_incr_type(p, metric, val, labels, PROM_METRIC_TYPE_GAUGE);
-    if (res < 0) {
-      return -1;
-    }
+  base_labels_pool = make_sub_pool(p);
+  pr_pool_tag(base_labels_pool, "Prometheus base labels pool");
+
+  names = pcalloc(base_labels_pool, sizeof(char *) * count);
+  base_label_texts = pcalloc(base_labels_pool, sizeof(char *) * count);
+  base_label_textlens = pcalloc(base_labels_pool, sizeof(size_t) * count);
+
+  i = 0;
+  pr_table_rewind(labels);
+  key = pr_table_next(labels);
+  while (key != NULL &&
+         i < (unsigned int) count) {
+    names[i++] = pstrdup(base_labels_pool, key);
+    key = pr_table_next(labels);
   }
 
+  sort_label_names(names, NULL, count);
+
+  for (i = 0; i < (unsigned int) count; i++) {
+    const char *val;
+
+    val = pr_table_get(labels, names[i], NULL);
+    base_label_texts[i] = pstrcat(base_labels_pool, names[i], "=\"",
+      val != NULL ? val : "", "\"", NULL);
+    base_label_textlens[i] = strlen(base_label_texts[i]);
+  }
+
+  base_label_names = names;
+  base_label_count = count;
+
   return 0;
 }
 
-int prom_metric_observe(pool *p, const struct prom_metric *metric, double val,
-    pr_table_t *labels) {
-  register int i;
-  int res;
-  pool *tmp_pool;
-  struct prom_text *text;
-  const char *label_str;
+struct prom_metric *prom_metric_create(pool *p, const char *name,
+    struct prom_dbh *dbh) {
+  pool *metric_pool;
+  struct prom_metric *metric;
 
   if (p == NULL ||
-      metric == NULL) {
+      name == NULL ||
+      dbh == NULL) {
     errno = EINVAL;
-    return -1;
+    return NULL;
   }
 
-  /* Observe operation only supported for histograms. */
-  if (metric->histogram_name == NULL) {
-    errno = EPERM;
-    return -1;
-  }
+  metric_pool = make_sub_pool(p);
+  pr_pool_tag(metric_pool, "Prometheus metric pool");
 
-  tmp_pool = make_sub_pool(p);
+  metric = pcalloc(metric_pool, sizeof(struct prom_metric));
+  metric->pool = metric_pool;
+  metric->name = pstrdup(metric->pool, name);
+  metric->dbh = dbh;
 
-  /* We start with the largest bucket, and work our way down. */
-  for (i = metric->histogram_bucket_count-1; i >= 0; i--) {
-    struct prom_histogram_bucket *bucket;
+  return metric;
+}
 
-    bucket = ((struct prom_histogram_bucket **) metric->histogram_buckets)[i];
-    if (val > bucket->upper_bound &&
-        bucket->is_inf_bucket == FALSE) {
-      /* Value is too large for this bucket. */
-      break;
-    }
+int prom_metric_destroy(pool *p, struct prom_metric *metric) {
+  if (metric == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
 
-    (void) pr_table_add(labels, "le", bucket->upper_bound_text, 0);
-    text = prom_text_create(tmp_pool);
-    label_str = prom_text_from_labels(tmp_pool, text, labels);
+  destroy_pool(metric->pool);
+  return 0;
+}
 
-    res = prom_metric_db_sample_incr(p, metric->dbh, bucket->bucket_id,
-      (double) 1.0, label_str);
-    if (res < 0) {
-      pr_trace_msg(trace_channel, 12, "error observing '%s' with %g: %s",
-        metric->histogram_name, val, strerror(errno));
-    }
+/* Returns the suffix with which the given type's name was added, or the empty
+ * string for none.
+ */
+static const char *definition_suffix(const struct prom_metric *metric,
+    const char *type_name) {
+  size_t namelen;
 
-    prom_text_destroy(text);
-    (void) pr_table_remove(labels, "le", NULL);
+  namelen = strlen(metric->name);
+  if (strlen(type_name) <= namelen) {
+    return "";
   }
 
-  text = prom_text_create(tmp_pool);
-  label_str = prom_text_from_labels(tmp_pool, text, labels);
+  return type_name + namelen + 1;
+}
 
-  res = prom_metric_db_sample_incr(p, metric->dbh, metric->histogram_count_id,
-    (double) 1.0, label_str);
-  if (res < 0) {
-    pr_trace_msg(trace_channel, 12, "error incrementing '%s' by %lu: %s",
-      metric->histogram_count_name, (unsigned long) val, strerror(errno));
-  }
+static const char *definition_doubles(pool *p, const double *vals,
+    unsigned int count) {
+  register unsigned int i;
+  const char *text = "";
 
-  res = prom_metric_db_sample_incr(p, metric->dbh, metric->histogram_sum_id,
-    val, label_str);
-  if (res < 0) {
-    pr_trace_msg(trace_channel, 12, "error incrementing '%s' by %lu: %s",
-      metric->histogram_sum_name, (unsigned long) val, strerror(errno));
-  }
+  for (i = 0; i < count; i++) {
+    char buf[PROM_TEXT_DOUBLE_MAX_LEN];
 
-  prom_text_destroy(text);
-  destroy_pool(tmp_pool);
+    (void) prom_text_format_double(buf, sizeof(buf), vals[i]);
+    text = pstrcat(p, text, i > 0 ? "," : "", buf, NULL);
+  }
 
-  return 0;
+  return text;
 }
 
-int prom_metric_set(pool *p, const struct prom_metric *metric, uint32_t val,
-    pr_table_t *labels) {
-  int res, xerrno;
-  pool *tmp_pool;
-  struct prom_text *text;
-  const char *label_str;
+const char *prom_metric_get_definition(pool *p,
+    const struct prom_metric *metric) {
+  register unsigned int i;
+  const char *def;
 
   if (p == NULL ||
       metric == NULL) {
     errno = EINVAL;
-    return -1;
+    return NULL;
   }
 
-  /* Set operation only supported for gauges. */
-  if (metric->gauge_name == NULL) {
-    errno = EPERM;
-    return -1;
+  def = pstrcat(p, "metric\t", metric->name, "\n", NULL);
+
+  if (metric->counter_name != NULL) {
+    def = pstrcat(p, def, "counter\t",
+      definition_suffix(metric, metric->counter_name), "\t",
+      metric->counter_help, "\n", NULL);
   }
 
-  tmp_pool = make_sub_pool(p);
-  text = prom_text_create(tmp_pool);
-  label_str = prom_text_from_labels(tmp_pool, text, labels);
-  res = prom_metric_db_sample_set(p, metric->dbh, metric->gauge_id,
-    (double) val, label_str);
-  xerrno = errno;
+  if (metric->gauge_name != NULL) {
+    def = pstrcat(p, def, "gauge\t",
+      definition_suffix(metric, metric->gauge_name), "\t",
+      metric->gauge_help, "\n", NULL);
+  }
 
-  prom_text_destroy(text);
-  destroy_pool(tmp_pool);
-  errno = xerrno;
-  return res;
-}
+  if (metric->histogram_name != NULL) {
+    double *bounds;
+    unsigned int bucket_count;
 
-int prom_metric_add_counter(struct prom_metric *metric, const char *suffix,
-    const char *help_text) {
-  int res;
-  int64_t counter_id;
+    /* The "+Inf" bucket is implied. */
+    bucket_count = metric->histogram_bucket_count - 1;
+    bounds = palloc(p, sizeof(double) * (bucket_count + 1));
+    for (i = 0; i < bucket_count; i++) {
+      bounds[i] = metric->histogram_buckets[i]->upper_bound;
+    }
 
-  if (metric == NULL ||
-      help_text == NULL) {
-    errno = EINVAL;
-    return -1;
-  }
+    def = pstrcat(p, def, "histogram\t",
+      definition_suffix(metric, metric->histogram_name), "\t",
+      definition_doubles(p, bounds, bucket_count), "\t",
+      metric->histogram_help, "\n", NULL);
 
-  if (suffix != NULL) {
-    metric->counter_name = pstrcat(metric->pool, metric->name, "_", suffix,
-      NULL);
+    if (metric->histogram_native == TRUE) {
+      char schema[16];
 
-  } else {
-    metric->counter_name = metric->name;
+      snprintf(schema, sizeof(schema)-1, "%d", metric->histogram_schema);
+      def = pstrcat(p, def, "native\t", schema, "\n", NULL);
+    }
   }
 
-  metric->counter_namelen = strlen(metric->counter_name);
-  metric->counter_help = pstrdup(metric->pool, help_text);
-  metric->counter_helplen = strlen(metric->counter_help);
-
-  res = prom_metric_db_exists(metric->pool, metric->dbh, metric->counter_name);
-  if (res == 0) {
-    pr_trace_msg(trace_channel, 3, "'%s' metric already exists in database",
-      metric->counter_name);
-    errno = EEXIST;
-    return -1;
+  if (metric->summary_name != NULL) {
+    def = pstrcat(p, def, "summary\t",
+      definition_suffix(metric, metric->summary_name), "\t",
+      definition_doubles(p, metric->summary_quantiles,
+        metric->summary_quantile_count), "\t",
+      metric->summary_help, "\n", NULL);
   }
 
-  res = prom_metric_db_create(metric->pool, metric->dbh, metric->counter_name,
-    PROM_METRIC_TYPE_COUNTER, &counter_id);
-  if (res < 0) {
-    pr_trace_msg(trace_channel, 3, "error adding '%s' metric to database: %s",
-      metric->counter_name, strerror(errno));
-    errno = EEXIST;
-    return -1;
+  if (metric->label_count > 0) {
+    const char **names;
+
+    /* The label names are kept sorted; give them in declaration order. */
+    names = pcalloc(p, sizeof(char *) * metric->label_count);
+    for (i = 0; i < metric->label_count; i++) {
+      names[metric->label_value_idxs[i]] = metric->label_names[i];
+    }
+
+    def = pstrcat(p, def, "labels\t", NULL);
+    for (i = 0; i < metric->label_count; i++) {
+      def = pstrcat(p, def, i > 0 ? "," : "", names[i], NULL);
+    }
+    def = pstrcat(p, def, "\n", NULL);
   }
 
-  metric->counter_id = counter_id;
-  pr_trace_msg(trace_channel, 27,
-    "added '%s' counter metric (ID %lld) to database", metric->counter_name,
-    (long long int) metric->counter_id);
-  return 0;
+  return def;
 }
 
-int prom_metric_add_gauge(struct prom_metric *metric, const char *suffix,
-    const char *help_text) {
-  int res;
-  int64_t gauge_id;
+/* Splits the given line into at most `max` tab-separated fields; the last
+ * field gets the remainder of the line.
+ */
+static unsigned int definition_fields(char *line, char **fields,
+    unsigned int max) {
+  unsigned int count = 0;
 
-  if (metric == NULL ||
-      help_text == NULL) {
-    errno = EINVAL;
-    return -1;
-  }
+  while (count < max) {
+    char *ptr;
 
-  if (suffix != NULL) {
-    metric->gauge_name = pstrcat(metric->pool, metric->name, "_", suffix,
-      NULL);
+    fields[count++] = line;
+    if (count == max) {
+      break;
+    }
 
-  } else {
-    metric->gauge_name = metric->name;
+    ptr = strchr(line, '\t');
+    if (ptr == NULL) {
+      break;
+    }
+
+    *ptr = '\0';
+    line = ptr + 1;
   }
 
-  metric->gauge_namelen = strlen(metric->gauge_name);
-  metric->gauge_help = pstrdup(metric->pool, help_text);
-  metric->gauge_helplen = strlen(metric->gauge_help);
+  return count;
+}
 
-  res = prom_metric_db_exists(metric->pool, metric->dbh, metric->gauge_name);
-  if (res == 0) {
-    pr_trace_msg(trace_channel, 3, "'%s' metric already exists in database",
-      metric->gauge_name);
-    errno = EEXIST;
-    return -1;
+/* Parses the given comma-separated doubles, e.g. "1,5,10". */
+static double *definition_parse_doubles(pool *p, char *text,
+    unsigned int *count) {
+  double *vals;
+  unsigned int max = 1;
+  char *ptr;
+
+  *count = 0;
+  if (*text == '\0') {
+    return NULL;
   }
 
-  res = prom_metric_db_create(metric->pool, metric->dbh, metric->gauge_name,
-    PROM_METRIC_TYPE_GAUGE, &gauge_id);
-  if (res < 0) {
-    pr_trace_msg(trace_channel, 3, "error adding '%s' metric to database: %s",
-      metric->gauge_name, strerror(errno));
-    errno = EEXIST;
-    return -1;
+  for (ptr = text; *ptr; ptr++) {
+    if (*ptr == ',') {
+      max++;
+    }
   }
 
-  metric->gauge_id = gauge_id;
-  pr_trace_msg(trace_channel, 27,
-    "added '%s' gauge metric (ID %lld) to database", metric->gauge_name,
-    (long long int) metric->gauge_id);
-  return 0;
-}
+  vals = palloc(p, sizeof(double) * max);
 
-static const char *get_double_text(pool *p, double val) {
-  char *text;
-  size_t text_len;
+  ptr = text;
+  while (*count < max) {
+    char *endp = NULL;
 
-  text_len = 50;
-  text = pcalloc(p, text_len);
-  snprintf(text, text_len-1, "%f", val);
+    vals[*count] = strtod(ptr, &endp);
+    if (endp == ptr ||
+        (*endp != ',' && *endp != '\0')) {
+      errno = EINVAL;
+      return NULL;
+    }
 
-  if (strstr(text, ".") == NULL) {
-    strcat(text, ".0");
+    (*count)++;
+    if (*endp == '\0') {
+      break;
+    }
+
+    ptr = endp + 1;
   }
 
-  return text;
+  return vals;
 }
 
-int prom_metric_add_histogram(struct prom_metric *metric, const char *suffix,
-    const char *help_text, unsigned int bucket_count, ...) {
-  register unsigned int i;
-  int res, xerrno = 0, have_error = FALSE;
-  va_list ap;
+static int metric_add_definition(pool *p, struct prom_metric *metric,
+    char *line) {
+  char *fields[4], *suffix;
+  unsigned int count;
 
-  if (metric == NULL ||
-      help_text == NULL) {
+  count = definition_fields(line, fields, 2);
+  if (count < 2) {
     errno = EINVAL;
     return -1;
   }
 
-  if (suffix != NULL) {
-    metric->histogram_name = pstrcat(metric->pool, metric->name, "_", suffix,
-      NULL);
-
-  } else {
-    metric->histogram_name = metric->name;
-  }
+  if (strcmp(fields[0], "counter") == 0 ||
+      strcmp(fields[0], "gauge") == 0) {
+    count = definition_fields(fields[1], fields + 1, 2) + 1;
+    if (count < 3) {
+      errno = EINVAL;
+      return -1;
+    }
 
-  metric->histogram_namelen = strlen(metric->histogram_name);
-  metric->histogram_help = pstrdup(metric->pool, help_text);
-  metric->histogram_helplen = strlen(metric->histogram_help);
+    suffix = *fields[1] != '\0' ? fields[1] : NULL;
+    if (fields[0][0] == 'c') {
+      return prom_metric_add_counter(metric, suffix, fields[2]);
+    }
 
-  /* Add one more for the "+Inf" bucket. */
-  metric->histogram_bucket_count = bucket_count + 1;
-  metric->histogram_buckets = pcalloc(metric->pool,
-    sizeof(struct prom_histogram_bucket *) * metric->histogram_bucket_count);
-  for (i = 0; i < metric->histogram_bucket_count; i++) {
-    metric->histogram_buckets[i] = pcalloc(metric->pool,
-      sizeof(struct prom_histogram_bucket));
+    return prom_metric_add_gauge(metric, suffix, fields[2]);
   }
 
-  va_start(ap, bucket_count);
-  for (i = 0; i < metric->histogram_bucket_count; i++) {
-    struct prom_histogram_bucket *bucket;
-    const char *sample_name;
-
-    bucket = ((struct prom_histogram_bucket **) metric->histogram_buckets)[i];
+  if (strcmp(fields[0], "histogram") == 0 ||
+      strcmp(fields[0], "summary") == 0) {
+    double *vals;
+    unsigned int nvals = 0;
 
-    if (i != metric->histogram_bucket_count-1) {
-      bucket->upper_bound = va_arg(ap, double);
-      bucket->upper_bound_text = get_double_text(metric->pool,
-        bucket->upper_bound);
-      sample_name = pstrcat(metric->pool, metric->histogram_name, "_",
-        bucket->upper_bound_text, NULL);
+    count = definition_fields(fields[1], fields + 1, 3) + 1;
+    if (count < 4) {
+      errno = EINVAL;
+      return -1;
+    }
 
-    } else {
-      /* The "+Inf" bucket. */
-      bucket->is_inf_bucket = TRUE;
-      bucket->upper_bound_text = pstrdup(metric->pool, "+Inf");
-      sample_name = pstrcat(metric->pool, metric->histogram_name, "_inf", NULL);
+    vals = definition_parse_doubles(p, fields[2], &nvals);
+    if (vals == NULL &&
+        nvals > 0) {
+      return -1;
     }
 
-    res = prom_metric_db_exists(metric->pool, metric->dbh, sample_name);
-    if (res == 0) {
-      pr_trace_msg(trace_channel, 3, "'%s' metric already exists in database",
-        sample_name);
-      xerrno = EEXIST;
-      have_error = TRUE;
-      break;
+    suffix = *fields[1] != '\0' ? fields[1] : NULL;
+    if (fields[0][0] == 'h') {
+      return metric_add_histogram(metric, suffix, fields[3], nvals, vals);
     }
 
-    res = prom_metric_db_create(metric->pool, metric->dbh,
-      sample_name, PROM_METRIC_TYPE_HISTOGRAM, &(bucket->bucket_id));
-    if (res < 0) {
-      pr_trace_msg(trace_channel, 3, "error adding '%s' metric to database: %s",
-        sample_name, strerror(errno));
-      xerrno = EEXIST;
-      have_error = TRUE;
-      break;
+    if (nvals == 0) {
+      errno = EINVAL;
+      return -1;
     }
-  }
-  va_end(ap);
 
-  if (have_error == TRUE) {
-    errno = xerrno;
-    return -1;
+    return metric_add_summary(metric, suffix, fields[3], nvals, vals);
   }
 
-  /* The histogram "count" sample. */
-  metric->histogram_count_name = pstrcat(metric->pool, metric->histogram_name,
-    "_count", NULL);
-  res = prom_metric_db_exists(metric->pool, metric->dbh,
-    metric->histogram_count_name);
-  if (res == 0) {
-    pr_trace_msg(trace_channel, 3, "'%s' metric already exists in database",
-      metric->histogram_count_name);
-    errno = EEXIST;
-    return -1;
+  if (strcmp(fields[0], "native") == 0) {
+    return prom_metric_set_native_histogram(metric, atoi(fields[1]));
   }
 
-  res = prom_metric_db_create(metric->pool, metric->dbh,
-    metric->histogram_count_name, PROM_METRIC_TYPE_HISTOGRAM,
-    &(metric->histogram_count_id));
-  if (res < 0) {
-    pr_trace_msg(trace_channel, 3, "error adding '%s' metric to database: %s",
-      metric->histogram_count_name, strerror(errno));
-    errno = EEXIST;
-    return -1;
-  }
+  if (strcmp(fields[0], "labels") == 0) {
+    const char **names;
+    unsigned int label_count = 1;
+    char *ptr;
 
-  /* The histogram "sum" sample. */
-  metric->histogram_sum_name = pstrcat(metric->pool, metric->histogram_name,
-    "_sum", NULL);
-  res = prom_metric_db_exists(metric->pool, metric->dbh,
-    metric->histogram_sum_name);
-  if (res == 0) {
-    pr_trace_msg(trace_channel, 3, "'%s' metric already exists in database",
-      metric->histogram_sum_name);
-    errno = EEXIST;
-    return -1;
-  }
+    if (*fields[1] == '\0') {
+      errno = EINVAL;
+      return -1;
+    }
 
-  res = prom_metric_db_create(metric->pool, metric->dbh,
-    metric->histogram_sum_name, PROM_METRIC_TYPE_HISTOGRAM,
-    &(metric->histogram_sum_id));
-  if (res < 0) {
-    pr_trace_msg(trace_channel, 3, "error adding '%s' metric to database: %s",
-      metric->histogram_sum_name, strerror(errno));
-    errno = EEXIST;
-    return -1;
-  }
+    for (ptr = fields[1]; *ptr; ptr++) {
+      if (*ptr == ',') {
+        label_count++;
+      }
+    }
 
-  pr_trace_msg(trace_channel, 27,
-    "added '%s' histogram metric (count ID %lld, sum ID %lld) to database",
-    metric->histogram_name, (long long) metric->histogram_count_id,
-    (long long) metric->histogram_sum_id);
-  return 0;
-}
+    names = palloc(p, sizeof(char *) * label_count);
+    label_count = 0;
 
-int prom_metric_set_dbh(struct prom_metric *metric, struct prom_dbh *dbh) {
-  if (metric == NULL ||
-      dbh == NULL) {
-    errno = EINVAL;
-    return -1;
+    ptr = fields[1];
+    while (ptr != NULL) {
+      char *next;
+
+      next = strchr(ptr, ',');
+      if (next != NULL) {
+        *next++ = '\0';
+      }
+
+      names[label_count++] = ptr;
+      ptr = next;
+    }
+
+    return metric_set_label_names(metric, label_count, names);
   }
 
-  metric->dbh = dbh;
-  return 0;
+  pr_trace_msg(trace_channel, 3, "unknown metric definition line '%s'",
+    fields[0]);
+  errno = EINVAL;
+  return -1;
 }
 
-struct prom_metric *prom_metric_create(pool *p, const char *name,
-    struct prom_dbh *dbh) {
-  pool *metric_pool;
+struct prom_metric *prom_metric_create_from_definition(pool *p,
+    const char *definition, struct prom_dbh *dbh) {
+  pool *tmp_pool;
   struct prom_metric *metric;
+  char *def, *line, *ptr;
+  int xerrno;
 
   if (p == NULL ||
-      name == NULL ||
+      definition == NULL ||
       dbh == NULL) {
     errno = EINVAL;
     return NULL;
   }
 
-  metric_pool = make_sub_pool(p);
-  pr_pool_tag(metric_pool, "Prometheus metric pool");
+  if (strncmp(definition, "metric\t", 7) != 0) {
+    errno = EINVAL;
+    return NULL;
+  }
 
-  metric = pcalloc(metric_pool, sizeof(struct prom_metric));
-  metric->pool = metric_pool;
-  metric->name = pstrdup(metric->pool, name);
-  metric->dbh = dbh;
+  tmp_pool = make_sub_pool(p);
+  def = pstrdup(tmp_pool, definition + 7);
 
-  return metric;
-}
+  ptr = strchr(def, '\n');
+  if (ptr != NULL) {
+    *ptr++ = '\0';
+  }
 
-int prom_metric_destroy(pool *p, struct prom_metric *metric) {
+  metric = prom_metric_create(p, def, dbh);
   if (metric == NULL) {
-    errno = EINVAL;
-    return -1;
+    xerrno = errno;
+
+    destroy_pool(tmp_pool);
+    errno = xerrno;
+    return NULL;
   }
 
-  destroy_pool(metric->pool);
-  return 0;
+  line = ptr;
+  while (line != NULL &&
+         *line != '\0') {
+    ptr = strchr(line, '\n');
+    if (ptr != NULL) {
+      *ptr++ = '\0';
+    }
+
+    if (metric_add_definition(tmp_pool, metric, line) < 0) {
+      xerrno = errno;
+
+      pr_trace_msg(trace_channel, 3,
+        "error creating '%s' metric from definition: %s",
+        prom_metric_get_name(metric), strerror(xerrno));
+      (void) prom_metric_destroy(p, metric);
+      destroy_pool(tmp_pool);
+
+      errno = xerrno;
+      return NULL;
+    }
+
+    line = ptr;
+  }
+
+  destroy_pool(tmp_pool);
+  return metric;
 }
 
 struct prom_dbh *prom_metric_init(pool *p, const char *tables_path) {
@@ -0,0 +1,409 @@
+/*
+ * ProFTPD - mod_prometheus metrics write-behind buffer implementation
+ * Copyright (c) 2021-2023 TJ Saunders
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+#include "mod_prometheus.h"
+#include "prometheus/db.h"
+#include "prometheus/metric/db.h"
+#include "prometheus/metric/buffer.h"
+
+/* The buffer holds one entry per metric ID/label text combination (and, for
+ * histograms and summaries, per bucket or sketch bin), in a table for
+ * lookups, and in an array for flushing in order of first use.  The entries
+ * live in their own pool, which is recreated on every flush.
+ */
+
+struct buffer_entry {
+  int64_t metric_id;
+  const char *labels;
+
+  /* For samples, the net increment; for sets, the value. */
+  double val;
+
+  /* Histogram and summary observations: `val` is the count of observations
+   * in the bucket (or sketch bin), and `sum` their total.  For histograms,
+   * the latest observation's exemplar, if any, is kept too.
+   */
+  int entry_type;
+  unsigned int bucket_idx;
+  unsigned int bucket_count;
+  int bin_key;
+  double sum;
+  char *exemplar;
+  size_t exemplarsz;
+};
+
+#define BUFFER_ENTRY_TYPE_SAMPLE	0
+#define BUFFER_ENTRY_TYPE_HISTOGRAM	1
+#define BUFFER_ENTRY_TYPE_SUMMARY	2
+#define BUFFER_ENTRY_TYPE_SET		3
+
+/* Keys which fit in this many bytes are rendered on the stack, thus adding
+ * to an existing entry does not allocate.
+ */
+#define BUFFER_KEY_BUFSZ		512
+
+struct prom_metric_buffer {
+  pool *pool;
+  struct prom_dbh *dbh;
+
+  pool *entries_pool;
+  pr_table_t *entries;
+  array_header *entry_list;
+};
+
+static const char *trace_channel = "prometheus.metric.buffer";
+
+static void buffer_reset(struct prom_metric_buffer *buffer) {
+  if (buffer->entries_pool != NULL) {
+    destroy_pool(buffer->entries_pool);
+  }
+
+  buffer->entries_pool = make_sub_pool(buffer->pool);
+  pr_pool_tag(buffer->entries_pool, "Prometheus metrics buffer entries pool");
+
+  buffer->entries = pr_table_alloc(buffer->entries_pool, 0);
+  buffer->entry_list = make_array(buffer->entries_pool, 0,
+    sizeof(struct buffer_entry *));
+}
+
+static const char *buffer_key(pool *p, const struct buffer_entry *entry,
+    char *buf, size_t bufsz) {
+  char id_text[64];
+  size_t id_len, labels_len;
+
+  memset(id_text, '\0', sizeof(id_text));
+  switch (entry->entry_type) {
+    case BUFFER_ENTRY_TYPE_HISTOGRAM:
+      snprintf(id_text, sizeof(id_text)-1, "%lld/%u",
+        (long long) entry->metric_id, entry->bucket_idx);
+      break;
+
+    case BUFFER_ENTRY_TYPE_SUMMARY:
+      snprintf(id_text, sizeof(id_text)-1, "%lld/s%d",
+        (long long) entry->metric_id, entry->bin_key);
+      break;
+
+    default:
+      snprintf(id_text, sizeof(id_text)-1, "%lld",
+        (long long) entry->metric_id);
+      break;
+  }
+
+  id_len = strlen(id_text);
+  labels_len = strlen(entry->labels);
+  if (id_len + labels_len + 2 > bufsz) {
+    return pstrcat(p, id_text, ":", entry->labels, NULL);
+  }
+
+  memcpy(buf, id_text, id_len);
+  buf[id_len] = ':';
+  memcpy(buf + id_len + 1, entry->labels, labels_len + 1);
+  return buf;
+}
+
+/* Keeps the latest exemplar, reusing the space of the previous one when it
+ * fits.  Exemplars differ mostly in their value and time, so some slack is
+ * allocated.
+ */
+static void buffer_set_exemplar(struct prom_metric_buffer *buffer,
+    struct buffer_entry *entry, const char *exemplar) {
+  size_t len;
+
+  len = strlen(exemplar);
+  if (entry->exemplar == NULL ||
+      len >= entry->exemplarsz) {
+    entry->exemplarsz = len + 32;
+    entry->exemplar = palloc(buffer->entries_pool, entry->exemplarsz);
+  }
+
+  memcpy(entry->exemplar, exemplar, len + 1);
+}
+
+static int buffer_write(pool *p, struct prom_metric_buffer *buffer,
+    const struct buffer_entry *entry) {
+  switch (entry->entry_type) {
+    case BUFFER_ENTRY_TYPE_HISTOGRAM:
+      return prom_metric_db_histogram_add(p, buffer->dbh, entry->metric_id,
+        entry->bucket_idx, entry->bucket_count, entry->val, entry->sum,
+        entry->labels, entry->exemplar);
+
+    case BUFFER_ENTRY_TYPE_SUMMARY:
+      return prom_metric_db_summary_add(p, buffer->dbh, entry->metric_id,
+        entry->bin_key, entry->val, entry->sum, entry->labels);
+
+    case BUFFER_ENTRY_TYPE_SET:
+      return prom_metric_db_sample_set(p, buffer->dbh, entry->metric_id,
+        entry->val, entry->labels);
+
+    default:
+      break;
+  }
+
+  return prom_metric_db_sample_incr(p, buffer->dbh, entry->metric_id,
+    entry->val, entry->labels);
+}
+
+static int buffer_add(pool *p, struct prom_metric_buffer *buffer,
+    const struct buffer_entry *add) {
+  const char *key;
+  char key_buf[BUFFER_KEY_BUFSZ];
+  struct buffer_entry *entry;
+
+  key = buffer_key(p, add, key_buf, sizeof(key_buf));
+
+  entry = (struct buffer_entry *) pr_table_get(buffer->entries, key, NULL);
+  if (entry != NULL) {
+    if (add->entry_type == BUFFER_ENTRY_TYPE_SET) {
+      entry->entry_type = BUFFER_ENTRY_TYPE_SET;
+      entry->val = add->val;
+      return 0;
+    }
+
+    entry->val += add->val;
+    entry->sum += add->sum;
+
+    if (add->exemplar != NULL) {
+      buffer_set_exemplar(buffer, entry, add->exemplar);
+    }
+
+    return 0;
+  }
+
+  entry = pcalloc(buffer->entries_pool, sizeof(struct buffer_entry));
+  memcpy(entry, add, sizeof(struct buffer_entry));
+  entry->labels = pstrdup(buffer->entries_pool, add->labels);
+  entry->exemplar = NULL;
+  entry->exemplarsz = 0;
+  if (add->exemplar != NULL) {
+    buffer_set_exemplar(buffer, entry, add->exemplar);
+  }
+
+  if (pr_table_add(buffer->entries, pstrdup(buffer->entries_pool, key), entry,
+      sizeof(struct buffer_entry *)) < 0) {
+    /* If we cannot track this sample (e.g. too many distinct samples), write
+     * it through to the database directly.
+     */
+    pr_trace_msg(trace_channel, 9,
+      "error buffering sample for metric ID %lld: %s, writing through",
+      (long long) add->metric_id, strerror(errno));
+    return buffer_write(p, buffer, add);
+  }
+
+  *((struct buffer_entry **) push_array(buffer->entry_list)) = entry;
+  return 0;
+}
+
+int prom_metric_buffer_add(pool *p, struct prom_metric_buffer *buffer,
+    int64_t metric_id, double sample_val, const char *sample_labels) {
+  struct buffer_entry entry;
+
+  if (p == NULL ||
+      buffer == NULL ||
+      sample_labels == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  memset(&entry, 0, sizeof(entry));
+  entry.metric_id = metric_id;
+  entry.labels = sample_labels;
+  entry.val = sample_val;
+
+  return buffer_add(p, buffer, &entry);
+}
+
+int prom_metric_buffer_set(pool *p, struct prom_metric_buffer *buffer,
+    int64_t metric_id, double sample_val, const char *sample_labels) {
+  struct buffer_entry entry;
+
+  if (p == NULL ||
+      buffer == NULL ||
+      sample_labels == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  memset(&entry, 0, sizeof(entry));
+  entry.metric_id = metric_id;
+  entry.labels = sample_labels;
+  entry.val = sample_val;
+  entry.entry_type = BUFFER_ENTRY_TYPE_SET;
+
+  return buffer_add(p, buffer, &entry);
+}
+
+int prom_metric_buffer_add_histogram(pool *p,
+    struct prom_metric_buffer *buffer, int64_t metric_id,
+    unsigned int bucket_idx, unsigned int bucket_count, double sum,
+    const char *sample_labels, const char *exemplar) {
+  struct buffer_entry entry;
+
+  if (p == NULL ||
+      buffer == NULL ||
+      sample_labels == NULL ||
+      bucket_idx >= bucket_count) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  memset(&entry, 0, sizeof(entry));
+  entry.metric_id = metric_id;
+  entry.labels = sample_labels;
+  entry.val = 1.0;
+  entry.entry_type = BUFFER_ENTRY_TYPE_HISTOGRAM;
+  entry.bucket_idx = bucket_idx;
+  entry.bucket_count = bucket_count;
+  entry.sum = sum;
+  entry.exemplar = (char *) exemplar;
+
+  return buffer_add(p, buffer, &entry);
+}
+
+int prom_metric_buffer_add_summary(pool *p, struct prom_metric_buffer *buffer,
+    int64_t metric_id, int bin_key, double sum, const char *sample_labels) {
+  struct buffer_entry entry;
+
+  if (p == NULL ||
+      buffer == NULL ||
+      sample_labels == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  memset(&entry, 0, sizeof(entry));
+  entry.metric_id = metric_id;
+  entry.labels = sample_labels;
+  entry.val = 1.0;
+  entry.entry_type = BUFFER_ENTRY_TYPE_SUMMARY;
+  entry.bin_key = bin_key;
+  entry.sum = sum;
+
+  return buffer_add(p, buffer, &entry);
+}
+
+int prom_metric_buffer_flush(pool *p, struct prom_metric_buffer *buffer) {
+  register unsigned int i;
+  struct buffer_entry **entries;
+  array_header *busy_entries;
+  int count = 0;
+
+  if (p == NULL ||
+      buffer == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  busy_entries = make_array(p, 0, sizeof(struct buffer_entry));
+
+  entries = buffer->entry_list->elts;
+  for (i = 0; i < buffer->entry_list->nelts; i++) {
+    struct buffer_entry *entry;
+
+    entry = entries[i];
+    if (buffer_write(p, buffer, entry) < 0) {
+      if (errno == EAGAIN) {
+        struct buffer_entry *busy_entry;
+
+        busy_entry = push_array(busy_entries);
+        memcpy(busy_entry, entry, sizeof(struct buffer_entry));
+        busy_entry->labels = pstrdup(p, entry->labels);
+        if (entry->exemplar != NULL) {
+          busy_entry->exemplar = pstrdup(p, entry->exemplar);
+        }
+        continue;
+      }
+
+      pr_trace_msg(trace_channel, 3,
+        "error flushing sample for metric ID %lld: %s",
+        (long long) entry->metric_id, strerror(errno));
+      continue;
+    }
+
+    count++;
+  }
+
+  pr_trace_msg(trace_channel, 15, "flushed %d of %d buffered samples", count,
+    buffer->entry_list->nelts);
+
+  /* Note that we discard any samples which failed to be written, rather
+   * than retrying them (and failing) indefinitely.  The exception is those
+   * samples which found the database busy; they are kept for the next flush.
+   */
+  buffer_reset(buffer);
+
+  if (busy_entries->nelts > 0) {
+    struct buffer_entry *busy;
+
+    pr_trace_msg(trace_channel, 9,
+      "database busy, keeping %d samples for next flush", busy_entries->nelts);
+
+    busy = busy_entries->elts;
+    for (i = 0; i < busy_entries->nelts; i++) {
+      (void) buffer_add(p, buffer, &(busy[i]));
+    }
+  }
+
+  return count;
+}
+
+int prom_metric_buffer_count(struct prom_metric_buffer *buffer) {
+  if (buffer == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  return buffer->entry_list->nelts;
+}
+
+int prom_metric_buffer_destroy(struct prom_metric_buffer *buffer) {
+  if (buffer == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  destroy_pool(buffer->pool);
+  return 0;
+}
+
+struct prom_metric_buffer *prom_metric_buffer_create(pool *p,
+    struct prom_dbh *dbh) {
+  pool *buffer_pool;
+  struct prom_metric_buffer *buffer;
+
+  if (p == NULL ||
+      dbh == NULL) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  buffer_pool = make_sub_pool(p);
+  pr_pool_tag(buffer_pool, "Prometheus metrics buffer pool");
+
+  buffer = pcalloc(buffer_pool, sizeof(struct prom_metric_buffer));
+  buffer->pool = buffer_pool;
+  buffer->dbh = dbh;
+  buffer_reset(buffer);
+
+  return buffer;
+}
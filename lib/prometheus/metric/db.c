@@ -25,12 +25,28 @@
 #include "mod_prometheus.h"
 #include "prometheus/db.h"
 #include "prometheus/metric/db.h"
+#include "prometheus/metric/sketch.h"
 
 #define PROM_METRICS_DB_SCHEMA_NAME	"prom_metrics"
-#define PROM_METRICS_DB_SCHEMA_VERSION	1
+#define PROM_METRICS_DB_SCHEMA_VERSION	6
 
 static const char *trace_channel = "prometheus.metric.db";
 
+/* Database busy errors (EAGAIN) are passed through, so that callers can
+ * defer or drop the update; all other errors are reported as EPERM.
+ */
+static int db_errno(int xerrno) {
+  return xerrno == EAGAIN ? EAGAIN : EPERM;
+}
+
+/* Label sets are interned in the label_sets table; each process keeps a cache
+ * of the label_set_id for each rendered label set it has used, for the
+ * handle with which those IDs were obtained.
+ */
+static pool *label_sets_pool = NULL;
+static pr_table_t *label_sets_cache = NULL;
+static struct prom_dbh *label_sets_dbh = NULL;
+
 static int metrics_db_add_schema(pool *p, struct prom_dbh *dbh,
     const char *db_path) {
   int res;
@@ -61,15 +77,47 @@ static int metrics_db_add_schema(pool *p, struct prom_dbh *dbh,
     return -1;
   }
 
+  /* CREATE TABLE label_sets (
+   *   label_set_id INTEGER NOT NULL PRIMARY KEY,
+   *   label_set TEXT NOT NULL
+   * );
+   *
+   * Each distinct rendered label set, e.g. '{protocol="ftp"}', is stored
+   * once; samples refer to it by ID.
+   */
+  stmt = "CREATE TABLE IF NOT EXISTS label_sets (label_set_id INTEGER NOT NULL PRIMARY KEY, label_set TEXT NOT NULL);";
+  res = prom_db_exec_stmt(p, dbh, stmt, &errstr);
+  if (res < 0) {
+    (void) pr_log_writefile(prometheus_logfd, MOD_PROMETHEUS_VERSION,
+      "error executing '%s': %s", stmt, errstr);
+    errno = EPERM;
+    return -1;
+  }
+
+  /* CREATE UNIQUE INDEX label_set_idx */
+  stmt = "CREATE UNIQUE INDEX IF NOT EXISTS label_set_idx ON label_sets (label_set);";
+  res = prom_db_exec_stmt(p, dbh, stmt, &errstr);
+  if (res < 0) {
+    (void) pr_log_writefile(prometheus_logfd, MOD_PROMETHEUS_VERSION,
+      "error executing '%s': %s", stmt, errstr);
+    errno = EPERM;
+    return -1;
+  }
+
   /* CREATE TABLE metric_samples (
    *   sample_id INTEGER NOT NULL PRIMARY KEY,
    *   metric_id INTEGER NOT NULL,
    *   sample_value DOUBLE NOT NULL,
-   *   sample_labels TEXT NOT NULL,
-   *   FOREIGN KEY (metric_id) REFERENCES metrics (metric_id)
+   *   label_set_id INTEGER NOT NULL,
+   *   created DOUBLE,
+   *   FOREIGN KEY (metric_id) REFERENCES metrics (metric_id),
+   *   FOREIGN KEY (label_set_id) REFERENCES label_sets (label_set_id)
    * );
+   *
+   * The created column holds the Unix time at which the sample was first
+   * written; it is only set when the row is inserted.
    */
-  stmt = "CREATE TABLE IF NOT EXISTS metric_samples (sample_id INTEGER NOT NULL PRIMARY KEY, metric_id INTEGER NOT NULL, sample_value DOUBLE NOT NULL, sample_labels TEXT NOT NULL, FOREIGN KEY (metric_id) REFERENCES metrics (metric_id));";
+  stmt = "CREATE TABLE IF NOT EXISTS metric_samples (sample_id INTEGER NOT NULL PRIMARY KEY, metric_id INTEGER NOT NULL, sample_value DOUBLE NOT NULL, label_set_id INTEGER NOT NULL, created DOUBLE, FOREIGN KEY (metric_id) REFERENCES metrics (metric_id), FOREIGN KEY (label_set_id) REFERENCES label_sets (label_set_id));";
   res = prom_db_exec_stmt(p, dbh, stmt, &errstr);
   if (res < 0) {
     (void) pr_log_writefile(prometheus_logfd, MOD_PROMETHEUS_VERSION,
@@ -88,8 +136,83 @@ static int metrics_db_add_schema(pool *p, struct prom_dbh *dbh,
     return -1;
   }
 
-  /* CREATE INDEX metric_id_sample_labels_idx */
-  stmt = "CREATE INDEX IF NOT EXISTS metric_id_sample_labels_idx ON metric_samples (metric_id, sample_labels);";
+  /* CREATE UNIQUE INDEX metric_id_label_set_id_idx
+   *
+   * Note that this index must be UNIQUE; the sample update statements rely
+   * on it for detecting (and resolving) conflicts.
+   */
+  stmt = "CREATE UNIQUE INDEX IF NOT EXISTS metric_id_label_set_id_idx ON metric_samples (metric_id, label_set_id);";
+  res = prom_db_exec_stmt(p, dbh, stmt, &errstr);
+  if (res < 0) {
+    (void) pr_log_writefile(prometheus_logfd, MOD_PROMETHEUS_VERSION,
+      "error executing '%s': %s", stmt, errstr);
+    errno = EPERM;
+    return -1;
+  }
+
+  /* CREATE TABLE histogram_samples (
+   *   metric_id INTEGER NOT NULL,
+   *   label_set_id INTEGER NOT NULL,
+   *   bucket_counts BLOB,
+   *   sample_count DOUBLE NOT NULL,
+   *   sample_sum DOUBLE NOT NULL,
+   *   created DOUBLE,
+   *   exemplars TEXT,
+   *   FOREIGN KEY (metric_id) REFERENCES metrics (metric_id),
+   *   FOREIGN KEY (label_set_id) REFERENCES label_sets (label_set_id)
+   * );
+   *
+   * The bucket_counts are packed per-bucket (i.e. non-cumulative) counts, as
+   * maintained by the prom_slot_add() function; an observation thus updates
+   * a single row.  The cumulative counts are computed when scraped.  The
+   * exemplars are the latest exemplar for each bucket, as maintained by the
+   * prom_exemplar_set() function, in that same update.
+   */
+  stmt = "CREATE TABLE IF NOT EXISTS histogram_samples (metric_id INTEGER NOT NULL, label_set_id INTEGER NOT NULL, bucket_counts BLOB, sample_count DOUBLE NOT NULL, sample_sum DOUBLE NOT NULL, created DOUBLE, exemplars TEXT, FOREIGN KEY (metric_id) REFERENCES metrics (metric_id), FOREIGN KEY (label_set_id) REFERENCES label_sets (label_set_id));";
+  res = prom_db_exec_stmt(p, dbh, stmt, &errstr);
+  if (res < 0) {
+    (void) pr_log_writefile(prometheus_logfd, MOD_PROMETHEUS_VERSION,
+      "error executing '%s': %s", stmt, errstr);
+    errno = EPERM;
+    return -1;
+  }
+
+  /* CREATE UNIQUE INDEX histogram_id_label_set_id_idx */
+  stmt = "CREATE UNIQUE INDEX IF NOT EXISTS histogram_id_label_set_id_idx ON histogram_samples (metric_id, label_set_id);";
+  res = prom_db_exec_stmt(p, dbh, stmt, &errstr);
+  if (res < 0) {
+    (void) pr_log_writefile(prometheus_logfd, MOD_PROMETHEUS_VERSION,
+      "error executing '%s': %s", stmt, errstr);
+    errno = EPERM;
+    return -1;
+  }
+
+  /* CREATE TABLE summary_samples (
+   *   metric_id INTEGER NOT NULL,
+   *   label_set_id INTEGER NOT NULL,
+   *   bin_key INTEGER NOT NULL,
+   *   bin_count DOUBLE NOT NULL,
+   *   bin_sum DOUBLE NOT NULL,
+   *   created DOUBLE,
+   *   FOREIGN KEY (metric_id) REFERENCES metrics (metric_id),
+   *   FOREIGN KEY (label_set_id) REFERENCES label_sets (label_set_id)
+   * );
+   *
+   * Each row is one bin of a summary's quantile sketch; the bin keys are
+   * bounded, and thus so are the rows per label set.  The summary's count
+   * and sum are the totals of its bins.
+   */
+  stmt = "CREATE TABLE IF NOT EXISTS summary_samples (metric_id INTEGER NOT NULL, label_set_id INTEGER NOT NULL, bin_key INTEGER NOT NULL, bin_count DOUBLE NOT NULL, bin_sum DOUBLE NOT NULL, created DOUBLE, FOREIGN KEY (metric_id) REFERENCES metrics (metric_id), FOREIGN KEY (label_set_id) REFERENCES label_sets (label_set_id));";
+  res = prom_db_exec_stmt(p, dbh, stmt, &errstr);
+  if (res < 0) {
+    (void) pr_log_writefile(prometheus_logfd, MOD_PROMETHEUS_VERSION,
+      "error executing '%s': %s", stmt, errstr);
+    errno = EPERM;
+    return -1;
+  }
+
+  /* CREATE UNIQUE INDEX summary_id_label_set_id_bin_key_idx */
+  stmt = "CREATE UNIQUE INDEX IF NOT EXISTS summary_id_label_set_id_bin_key_idx ON summary_samples (metric_id, label_set_id, bin_key);";
   res = prom_db_exec_stmt(p, dbh, stmt, &errstr);
   if (res < 0) {
     (void) pr_log_writefile(prometheus_logfd, MOD_PROMETHEUS_VERSION,
@@ -113,6 +236,22 @@ static int metrics_db_truncate_tables(pool *p, struct prom_dbh *dbh) {
     errno = EPERM;
     return -1;
   }
+  stmt = "DELETE FROM histogram_samples;";
+  res = prom_db_exec_stmt(p, dbh, stmt, &errstr);
+  if (res < 0) {
+    (void) pr_log_writefile(prometheus_logfd, MOD_PROMETHEUS_VERSION,
+      "error executing '%s': %s", stmt, errstr);
+    errno = EPERM;
+    return -1;
+  }
+  stmt = "DELETE FROM summary_samples;";
+  res = prom_db_exec_stmt(p, dbh, stmt, &errstr);
+  if (res < 0) {
+    (void) pr_log_writefile(prometheus_logfd, MOD_PROMETHEUS_VERSION,
+      "error executing '%s': %s", stmt, errstr);
+    errno = EPERM;
+    return -1;
+  }
 
   stmt = "DELETE FROM metrics;";
   res = prom_db_exec_stmt(p, dbh, stmt, &errstr);
@@ -123,6 +262,15 @@ static int metrics_db_truncate_tables(pool *p, struct prom_dbh *dbh) {
     return -1;
   }
 
+  stmt = "DELETE FROM label_sets;";
+  res = prom_db_exec_stmt(p, dbh, stmt, &errstr);
+  if (res < 0) {
+    (void) pr_log_writefile(prometheus_logfd, MOD_PROMETHEUS_VERSION,
+      "error executing '%s': %s", stmt, errstr);
+    errno = EPERM;
+    return -1;
+  }
+
   /* Note: don't forget to rebuild the indices, too! */
 
   index_name = "sample_id_idx";
@@ -143,6 +291,33 @@ static int metrics_db_truncate_tables(pool *p, struct prom_dbh *dbh) {
     return -1;
   }
 
+  index_name = "label_set_idx";
+  res = prom_db_reindex(p, dbh, index_name, &errstr);
+  if (res < 0) {
+    (void) pr_log_writefile(prometheus_logfd, MOD_PROMETHEUS_VERSION,
+      "error reindexing '%s': %s", index_name, errstr);
+    errno = EPERM;
+    return -1;
+  }
+
+  index_name = "histogram_id_label_set_id_idx";
+  res = prom_db_reindex(p, dbh, index_name, &errstr);
+  if (res < 0) {
+    (void) pr_log_writefile(prometheus_logfd, MOD_PROMETHEUS_VERSION,
+      "error reindexing '%s': %s", index_name, errstr);
+    errno = EPERM;
+    return -1;
+  }
+
+  index_name = "summary_id_label_set_id_bin_key_idx";
+  res = prom_db_reindex(p, dbh, index_name, &errstr);
+  if (res < 0) {
+    (void) pr_log_writefile(prometheus_logfd, MOD_PROMETHEUS_VERSION,
+      "error reindexing '%s': %s", index_name, errstr);
+    errno = EPERM;
+    return -1;
+  }
+
   return 0;
 }
 
@@ -242,31 +417,44 @@ int prom_metric_db_exists(pool *p, struct prom_dbh *dbh,
   return 0;
 }
 
-int prom_metric_db_sample_exists(pool *p, struct prom_dbh *dbh,
-    int64_t metric_id, const char *sample_labels) {
+static void label_sets_reset(pool *p, struct prom_dbh *dbh) {
+  /* A NULL pool means that the cached handle is being closed, and its cache
+   * can be destroyed.  Otherwise, the previous cache pool (whose parent may
+   * already be gone) is left for its parent pool to clean up.
+   */
+  if (p == NULL &&
+      label_sets_pool != NULL) {
+    destroy_pool(label_sets_pool);
+  }
+
+  label_sets_pool = NULL;
+  label_sets_cache = NULL;
+  label_sets_dbh = NULL;
+
+  if (p != NULL &&
+      dbh != NULL) {
+    label_sets_pool = make_sub_pool(p);
+    pr_pool_tag(label_sets_pool, "Prometheus label sets pool");
+
+    label_sets_cache = pr_table_alloc(label_sets_pool, 0);
+    label_sets_dbh = dbh;
+  }
+}
+
+static int label_set_lookup(pool *p, struct prom_dbh *dbh,
+    const char *label_set, int64_t *label_set_id) {
   int res, xerrno;
   const char *stmt, *errstr = NULL;
   array_header *results;
 
-  if (sample_labels == NULL) {
-    errno = EINVAL;
-    return -1;
-  }
-
-  stmt = "SELECT sample_value FROM metric_samples WHERE metric_id = ? AND sample_labels = ?;";
+  stmt = "SELECT label_set_id FROM label_sets WHERE label_set = ?;";
   res = prom_db_prepare_stmt(p, dbh, stmt);
   if (res < 0) {
     return -1;
   }
 
-  res = prom_db_bind_stmt(p, dbh, stmt, 1, PROM_DB_BIND_TYPE_INT,
-    (void *) &metric_id);
-  if (res < 0) {
-    return -1;
-  }
-
-  res = prom_db_bind_stmt(p, dbh, stmt, 2, PROM_DB_BIND_TYPE_TEXT,
-    (void *) sample_labels);
+  res = prom_db_bind_stmt(p, dbh, stmt, 1, PROM_DB_BIND_TYPE_TEXT,
+    (void *) label_set);
   if (res < 0) {
     return -1;
   }
@@ -277,7 +465,7 @@ int prom_metric_db_sample_exists(pool *p, struct prom_dbh *dbh,
   if (results == NULL) {
     pr_trace_msg(trace_channel, 7,
       "error executing '%s': %s", stmt, errstr ? errstr : strerror(xerrno));
-    errno = EPERM;
+    errno = db_errno(xerrno);
     return -1;
   }
 
@@ -286,77 +474,128 @@ int prom_metric_db_sample_exists(pool *p, struct prom_dbh *dbh,
     return -1;
   }
 
+  *label_set_id = (int64_t) strtoll(((char **) results->elts)[0], NULL, 10);
   return 0;
 }
 
-static int db_sample_create(pool *p, struct prom_dbh *dbh, int64_t metric_id,
-    double sample_val, const char *sample_labels) {
+static int label_set_create(pool *p, struct prom_dbh *dbh,
+    const char *label_set) {
   int res, xerrno;
   const char *stmt, *errstr = NULL;
-  array_header *results;
 
-  stmt = "INSERT INTO metric_samples (metric_id, sample_value, sample_labels) VALUES (?, ?, ?);";
+  /* Thanks to the UNIQUE label_set index, concurrent creation of the same
+   * label set by other processes is harmless; the losers are ignored.
+   */
+  stmt = "INSERT OR IGNORE INTO label_sets (label_set) VALUES (?);";
   res = prom_db_prepare_stmt(p, dbh, stmt);
   if (res < 0) {
     return -1;
   }
 
-  res = prom_db_bind_stmt(p, dbh, stmt, 1, PROM_DB_BIND_TYPE_INT,
-    (void *) &metric_id);
+  res = prom_db_bind_stmt(p, dbh, stmt, 1, PROM_DB_BIND_TYPE_TEXT,
+    (void *) label_set);
   if (res < 0) {
     return -1;
   }
 
-  res = prom_db_bind_stmt(p, dbh, stmt, 2, PROM_DB_BIND_TYPE_DOUBLE,
-    (void *) &sample_val);
+  res = prom_db_exec_prepared_write(p, dbh, stmt, &errstr);
+  xerrno = errno;
+
   if (res < 0) {
+    pr_trace_msg(trace_channel, 7,
+      "error executing '%s': %s", stmt, errstr ? errstr : strerror(xerrno));
+    errno = db_errno(xerrno);
     return -1;
   }
 
-  res = prom_db_bind_stmt(p, dbh, stmt, 3, PROM_DB_BIND_TYPE_TEXT,
-    (void *) sample_labels);
+  return 0;
+}
+
+/* Obtains the ID for the given rendered label set, consulting the cache
+ * first.  If `create` is true, the label set will be added if not already
+ * present; otherwise, ENOENT is returned for unknown label sets.
+ */
+static int label_set_get_id(pool *p, struct prom_dbh *dbh,
+    const char *label_set, int create, int64_t *label_set_id) {
+  int res;
+  const int64_t *cached_id;
+  int64_t *id;
+
+  if (dbh == label_sets_dbh &&
+      label_sets_cache != NULL) {
+    cached_id = pr_table_get(label_sets_cache, label_set, NULL);
+    if (cached_id != NULL) {
+      *label_set_id = *cached_id;
+      return 0;
+    }
+  }
+
+  res = label_set_lookup(p, dbh, label_set, label_set_id);
   if (res < 0) {
-    return -1;
+    if (errno != ENOENT ||
+        create == FALSE) {
+      return -1;
+    }
+
+    if (label_set_create(p, dbh, label_set) < 0) {
+      return -1;
+    }
+
+    res = label_set_lookup(p, dbh, label_set, label_set_id);
+    if (res < 0) {
+      return -1;
+    }
   }
 
-  results = prom_db_exec_prepared_stmt(p, dbh, stmt, &errstr);
-  xerrno = errno;
+  if (dbh == label_sets_dbh &&
+      label_sets_cache != NULL) {
+    id = palloc(label_sets_pool, sizeof(int64_t));
+    *id = *label_set_id;
 
-  if (results == NULL) {
-    pr_trace_msg(trace_channel, 7,
-      "error executing '%s': %s", stmt, errstr ? errstr : strerror(xerrno));
-    errno = EPERM;
-    return -1;
+    if (pr_table_add(label_sets_cache, pstrdup(label_sets_pool, label_set),
+        id, sizeof(int64_t)) < 0) {
+      pr_trace_msg(trace_channel, 9,
+        "error caching ID %lld for label set '%s': %s",
+        (long long) *label_set_id, label_set, strerror(errno));
+    }
   }
 
   return 0;
 }
 
-static int db_sample_adj(pool *p, struct prom_dbh *dbh, const char *stmt,
-    int64_t metric_id, double sample_val, const char *sample_labels) {
+int prom_metric_db_sample_exists(pool *p, struct prom_dbh *dbh,
+    int64_t metric_id, const char *sample_labels) {
   int res, xerrno;
-  const char *errstr = NULL;
+  int64_t label_set_id = 0;
+  const char *stmt, *errstr = NULL;
   array_header *results;
 
-  res = prom_db_prepare_stmt(p, dbh, stmt);
+  if (p == NULL ||
+      dbh == NULL ||
+      sample_labels == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  res = label_set_get_id(p, dbh, sample_labels, FALSE, &label_set_id);
   if (res < 0) {
     return -1;
   }
 
-  res = prom_db_bind_stmt(p, dbh, stmt, 1, PROM_DB_BIND_TYPE_DOUBLE,
-    (void *) &sample_val);
+  stmt = "SELECT sample_value FROM metric_samples WHERE metric_id = ? AND label_set_id = ?;";
+  res = prom_db_prepare_stmt(p, dbh, stmt);
   if (res < 0) {
     return -1;
   }
 
-  res = prom_db_bind_stmt(p, dbh, stmt, 2, PROM_DB_BIND_TYPE_INT,
+  res = prom_db_bind_stmt(p, dbh, stmt, 1, PROM_DB_BIND_TYPE_INT64,
     (void *) &metric_id);
   if (res < 0) {
     return -1;
   }
 
-  res = prom_db_bind_stmt(p, dbh, stmt, 3, PROM_DB_BIND_TYPE_TEXT,
-    (void *) sample_labels);
+  res = prom_db_bind_stmt(p, dbh, stmt, 2, PROM_DB_BIND_TYPE_INT64,
+    (void *) &label_set_id);
   if (res < 0) {
     return -1;
   }
@@ -367,102 +606,636 @@ static int db_sample_adj(pool *p, struct prom_dbh *dbh, const char *stmt,
   if (results == NULL) {
     pr_trace_msg(trace_channel, 7,
       "error executing '%s': %s", stmt, errstr ? errstr : strerror(xerrno));
-    errno = EPERM;
+    errno = db_errno(xerrno);
+    return -1;
+  }
+
+  if (results->nelts == 0) {
+    errno = ENOENT;
     return -1;
   }
 
   return 0;
 }
 
-int prom_metric_db_sample_decr(pool *p, struct prom_dbh *dbh,
-    int64_t metric_id, double sample_val, const char *sample_labels) {
-  int res;
-  const char *stmt;
+#if defined(HAVE_SQLITE3_UPSERT)
+/* With UPSERT support, each sample update is a single atomic statement; the
+ * UNIQUE (metric_id, label_set_id) index provides the conflict target.
+ */
+static int db_sample_upsert(pool *p, struct prom_dbh *dbh, const char *stmt,
+    int64_t metric_id, double sample_val, int64_t label_set_id) {
+  int res, xerrno;
+  const char *errstr = NULL;
 
-  /* NOTE: Beware of race conditions with other processes, due to this
-   * check-and-set sequence, for this sample.
-   *
-   * Consider using wrapping this in a BEGIN/COMMIT block; use EXCLUSIVE?
-   */
-  res = prom_metric_db_sample_exists(p, dbh, metric_id, sample_labels);
+  res = prom_db_prepare_stmt(p, dbh, stmt);
   if (res < 0) {
-    double init_val = 0.0;
-
-    if (errno != ENOENT) {
-      return -1;
-    }
-
-    res = db_sample_create(p, dbh, metric_id, init_val, sample_labels);
-    if (res < 0) {
-      return -1;
-    }
+    return -1;
   }
 
-  stmt = "UPDATE metric_samples SET sample_value = sample_value - ? WHERE metric_id = ? AND sample_labels = ?;";
-  return db_sample_adj(p, dbh, stmt, metric_id, sample_val, sample_labels);
-}
+  res = prom_db_bind_stmt(p, dbh, stmt, 1, PROM_DB_BIND_TYPE_INT64,
+    (void *) &metric_id);
+  if (res < 0) {
+    return -1;
+  }
 
-int prom_metric_db_sample_incr(pool *p, struct prom_dbh *dbh,
-    int64_t metric_id, double sample_val, const char *sample_labels) {
-  int res;
-  const char *stmt;
+  res = prom_db_bind_stmt(p, dbh, stmt, 2, PROM_DB_BIND_TYPE_INT64,
+    (void *) &label_set_id);
+  if (res < 0) {
+    return -1;
+  }
 
-  /* NOTE: Beware of race conditions with other processes, due to this
-   * check-and-set sequence, for this sample.
-   *
-   * Consider using wrapping this in a BEGIN/COMMIT block; use EXCLUSIVE?
-   */
-  res = prom_metric_db_sample_exists(p, dbh, metric_id, sample_labels);
+  res = prom_db_bind_stmt(p, dbh, stmt, 3, PROM_DB_BIND_TYPE_DOUBLE,
+    (void *) &sample_val);
   if (res < 0) {
-    double init_val = 0.0;
+    return -1;
+  }
 
-    if (errno != ENOENT) {
-      return -1;
-    }
+  res = prom_db_exec_prepared_write(p, dbh, stmt, &errstr);
+  xerrno = errno;
 
-    res = db_sample_create(p, dbh, metric_id, init_val, sample_labels);
-    if (res < 0) {
-      return -1;
-    }
+  if (res < 0) {
+    pr_trace_msg(trace_channel, 7,
+      "error executing '%s': %s", stmt, errstr ? errstr : strerror(xerrno));
+    errno = db_errno(xerrno);
+    return -1;
   }
 
-  stmt = "UPDATE metric_samples SET sample_value = sample_value + ? WHERE metric_id = ? AND sample_labels = ?;";
-  return db_sample_adj(p, dbh, stmt, metric_id, sample_val, sample_labels);
+  return 0;
 }
+#else
+static int db_sample_create(pool *p, struct prom_dbh *dbh, int64_t metric_id,
+    int64_t label_set_id) {
+  int res, xerrno;
+  const char *stmt, *errstr = NULL;
 
-int prom_metric_db_sample_set(pool *p, struct prom_dbh *dbh,
-    int64_t metric_id, double sample_val, const char *sample_labels) {
-  int res;
-  const char *stmt;
-
-  /* NOTE: Beware of race conditions with other processes, due to this
-   * check-and-set sequence, for this sample.
-   *
-   * Consider using wrapping this in a BEGIN/COMMIT block; use EXCLUSIVE?
+  /* Thanks to the UNIQUE (metric_id, label_set_id) index, concurrent
+   * creation of the same sample by other processes is harmless; the losers
+   * are ignored.
    */
-  res = prom_metric_db_sample_exists(p, dbh, metric_id, sample_labels);
+  stmt = "INSERT OR IGNORE INTO metric_samples (metric_id, sample_value, label_set_id, created) VALUES (?, 0.0, ?, prom_now());";
+  res = prom_db_prepare_stmt(p, dbh, stmt);
   if (res < 0) {
-    double init_val = 0.0;
-
-    if (errno != ENOENT) {
-      return -1;
-    }
+    return -1;
+  }
 
-    res = db_sample_create(p, dbh, metric_id, init_val, sample_labels);
+  res = prom_db_bind_stmt(p, dbh, stmt, 1, PROM_DB_BIND_TYPE_INT64,
+    (void *) &metric_id);
+  if (res < 0) {
+    return -1;
+  }
+
+  res = prom_db_bind_stmt(p, dbh, stmt, 2, PROM_DB_BIND_TYPE_INT64,
+    (void *) &label_set_id);
+  if (res < 0) {
+    return -1;
+  }
+
+  res = prom_db_exec_prepared_write(p, dbh, stmt, &errstr);
+  xerrno = errno;
+
+  if (res < 0) {
+    pr_trace_msg(trace_channel, 7,
+      "error executing '%s': %s", stmt, errstr ? errstr : strerror(xerrno));
+    errno = db_errno(xerrno);
+    return -1;
+  }
+
+  return 0;
+}
+
+static int db_sample_adj(pool *p, struct prom_dbh *dbh, const char *stmt,
+    int64_t metric_id, double sample_val, int64_t label_set_id) {
+  int res, xerrno;
+  const char *errstr = NULL;
+
+  res = db_sample_create(p, dbh, metric_id, label_set_id);
+  if (res < 0) {
+    return -1;
+  }
+
+  res = prom_db_prepare_stmt(p, dbh, stmt);
+  if (res < 0) {
+    return -1;
+  }
+
+  res = prom_db_bind_stmt(p, dbh, stmt, 1, PROM_DB_BIND_TYPE_DOUBLE,
+    (void *) &sample_val);
+  if (res < 0) {
+    return -1;
+  }
+
+  res = prom_db_bind_stmt(p, dbh, stmt, 2, PROM_DB_BIND_TYPE_INT64,
+    (void *) &metric_id);
+  if (res < 0) {
+    return -1;
+  }
+
+  res = prom_db_bind_stmt(p, dbh, stmt, 3, PROM_DB_BIND_TYPE_INT64,
+    (void *) &label_set_id);
+  if (res < 0) {
+    return -1;
+  }
+
+  res = prom_db_exec_prepared_write(p, dbh, stmt, &errstr);
+  xerrno = errno;
+
+  if (res < 0) {
+    pr_trace_msg(trace_channel, 7,
+      "error executing '%s': %s", stmt, errstr ? errstr : strerror(xerrno));
+    errno = db_errno(xerrno);
+    return -1;
+  }
+
+  return 0;
+}
+#endif /* HAVE_SQLITE3_UPSERT */
+
+int prom_metric_db_sample_decr(pool *p, struct prom_dbh *dbh,
+    int64_t metric_id, double sample_val, const char *sample_labels) {
+  int64_t label_set_id = 0;
+  const char *stmt;
+
+  if (p == NULL ||
+      dbh == NULL ||
+      sample_labels == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (label_set_get_id(p, dbh, sample_labels, TRUE, &label_set_id) < 0) {
+    return -1;
+  }
+
+#if defined(HAVE_SQLITE3_UPSERT)
+  stmt = "INSERT INTO metric_samples (metric_id, label_set_id, sample_value, created) VALUES (?, ?, 0.0 - ?, prom_now()) ON CONFLICT (metric_id, label_set_id) DO UPDATE SET sample_value = sample_value + excluded.sample_value;";
+  return db_sample_upsert(p, dbh, stmt, metric_id, sample_val, label_set_id);
+#else
+  stmt = "UPDATE metric_samples SET sample_value = sample_value - ? WHERE metric_id = ? AND label_set_id = ?;";
+  return db_sample_adj(p, dbh, stmt, metric_id, sample_val, label_set_id);
+#endif /* HAVE_SQLITE3_UPSERT */
+}
+
+int prom_metric_db_sample_incr(pool *p, struct prom_dbh *dbh,
+    int64_t metric_id, double sample_val, const char *sample_labels) {
+  int64_t label_set_id = 0;
+  const char *stmt;
+
+  if (p == NULL ||
+      dbh == NULL ||
+      sample_labels == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (label_set_get_id(p, dbh, sample_labels, TRUE, &label_set_id) < 0) {
+    return -1;
+  }
+
+#if defined(HAVE_SQLITE3_UPSERT)
+  stmt = "INSERT INTO metric_samples (metric_id, label_set_id, sample_value, created) VALUES (?, ?, ?, prom_now()) ON CONFLICT (metric_id, label_set_id) DO UPDATE SET sample_value = sample_value + excluded.sample_value;";
+  return db_sample_upsert(p, dbh, stmt, metric_id, sample_val, label_set_id);
+#else
+  stmt = "UPDATE metric_samples SET sample_value = sample_value + ? WHERE metric_id = ? AND label_set_id = ?;";
+  return db_sample_adj(p, dbh, stmt, metric_id, sample_val, label_set_id);
+#endif /* HAVE_SQLITE3_UPSERT */
+}
+
+int prom_metric_db_sample_set(pool *p, struct prom_dbh *dbh,
+    int64_t metric_id, double sample_val, const char *sample_labels) {
+  int64_t label_set_id = 0;
+  const char *stmt;
+
+  if (p == NULL ||
+      dbh == NULL ||
+      sample_labels == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (label_set_get_id(p, dbh, sample_labels, TRUE, &label_set_id) < 0) {
+    return -1;
+  }
+
+#if defined(HAVE_SQLITE3_UPSERT)
+  stmt = "INSERT INTO metric_samples (metric_id, label_set_id, sample_value, created) VALUES (?, ?, ?, prom_now()) ON CONFLICT (metric_id, label_set_id) DO UPDATE SET sample_value = excluded.sample_value;";
+  return db_sample_upsert(p, dbh, stmt, metric_id, sample_val, label_set_id);
+#else
+  stmt = "UPDATE metric_samples SET sample_value = ? WHERE metric_id = ? AND label_set_id = ?;";
+  return db_sample_adj(p, dbh, stmt, metric_id, sample_val, label_set_id);
+#endif /* HAVE_SQLITE3_UPSERT */
+}
+
+const array_header *prom_metric_db_sample_get(pool *p, struct prom_dbh *dbh,
+    int64_t metric_id) {
+  int res, xerrno;
+  const char *stmt, *errstr = NULL;
+  array_header *results;
+
+  if (p == NULL ||
+      dbh == NULL) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  stmt = "SELECT metric_samples.sample_value, label_sets.label_set FROM metric_samples JOIN label_sets ON metric_samples.label_set_id = label_sets.label_set_id WHERE metric_samples.metric_id = ? ORDER BY label_sets.label_set ASC;";
+  res = prom_db_prepare_stmt(p, dbh, stmt);
+  if (res < 0) {
+    return NULL;
+  }
+
+  res = prom_db_bind_stmt(p, dbh, stmt, 1, PROM_DB_BIND_TYPE_INT64,
+    (void *) &metric_id);
+  if (res < 0) {
+    return NULL;
+  }
+
+  results = prom_db_exec_prepared_stmt(p, dbh, stmt, &errstr);
+  xerrno = errno;
+
+  if (results == NULL) {
+    pr_trace_msg(trace_channel, 7,
+      "error executing '%s': %s", stmt, errstr ? errstr : strerror(xerrno));
+    errno = EPERM;
+    return NULL;
+  }
+
+  return results;
+}
+
+/* Binds the exemplar text, if any, or NULL, which leaves the exemplars of
+ * the row as they are.
+ */
+static int db_bind_exemplar(pool *p, struct prom_dbh *dbh, const char *stmt,
+    int idx, const char *exemplar) {
+  if (exemplar == NULL) {
+    return prom_db_bind_stmt(p, dbh, stmt, idx, PROM_DB_BIND_TYPE_NULL, NULL);
+  }
+
+  return prom_db_bind_stmt(p, dbh, stmt, idx, PROM_DB_BIND_TYPE_TEXT,
+    (void *) exemplar);
+}
+
+#if defined(HAVE_SQLITE3_UPSERT)
+static int db_histogram_upsert(pool *p, struct prom_dbh *dbh,
+    int64_t metric_id, int64_t label_set_id, unsigned int bucket_idx,
+    unsigned int bucket_count, int64_t count, double sum,
+    const char *exemplar) {
+  int res, xerrno;
+  const char *stmt, *errstr = NULL;
+
+  /* The observation is recorded in its bucket, the count, the sum, and the
+   * bucket's exemplar (if any) with a single atomic statement.
+   */
+  stmt = "INSERT INTO histogram_samples (metric_id, label_set_id, bucket_counts, sample_count, sample_sum, created, exemplars) VALUES (?1, ?2, prom_slot_add(NULL, ?3, ?4, ?5), ?5, ?6, prom_now(), prom_exemplar_set(NULL, ?3, ?7)) ON CONFLICT (metric_id, label_set_id) DO UPDATE SET bucket_counts = prom_slot_add(bucket_counts, ?3, ?4, ?5), sample_count = sample_count + excluded.sample_count, sample_sum = sample_sum + excluded.sample_sum, exemplars = prom_exemplar_set(exemplars, ?3, ?7);";
+  res = prom_db_prepare_stmt(p, dbh, stmt);
+  if (res < 0) {
+    return -1;
+  }
+
+  res = prom_db_bind_stmt(p, dbh, stmt, 1, PROM_DB_BIND_TYPE_INT64,
+    (void *) &metric_id);
+  if (res < 0) {
+    return -1;
+  }
+
+  res = prom_db_bind_stmt(p, dbh, stmt, 2, PROM_DB_BIND_TYPE_INT64,
+    (void *) &label_set_id);
+  if (res < 0) {
+    return -1;
+  }
+
+  res = prom_db_bind_stmt(p, dbh, stmt, 3, PROM_DB_BIND_TYPE_INT,
+    (void *) &bucket_idx);
+  if (res < 0) {
+    return -1;
+  }
+
+  res = prom_db_bind_stmt(p, dbh, stmt, 4, PROM_DB_BIND_TYPE_INT,
+    (void *) &bucket_count);
+  if (res < 0) {
+    return -1;
+  }
+
+  res = prom_db_bind_stmt(p, dbh, stmt, 5, PROM_DB_BIND_TYPE_INT64,
+    (void *) &count);
+  if (res < 0) {
+    return -1;
+  }
+
+  res = prom_db_bind_stmt(p, dbh, stmt, 6, PROM_DB_BIND_TYPE_DOUBLE,
+    (void *) &sum);
+  if (res < 0) {
+    return -1;
+  }
+
+  res = db_bind_exemplar(p, dbh, stmt, 7, exemplar);
+  if (res < 0) {
+    return -1;
+  }
+
+  res = prom_db_exec_prepared_write(p, dbh, stmt, &errstr);
+  xerrno = errno;
+
+  if (res < 0) {
+    pr_trace_msg(trace_channel, 7,
+      "error executing '%s': %s", stmt, errstr ? errstr : strerror(xerrno));
+    errno = db_errno(xerrno);
+    return -1;
+  }
+
+  return 0;
+}
+#else
+static int db_histogram_create(pool *p, struct prom_dbh *dbh,
+    int64_t metric_id, int64_t label_set_id) {
+  int res, xerrno;
+  const char *stmt, *errstr = NULL;
+
+  stmt = "INSERT OR IGNORE INTO histogram_samples (metric_id, label_set_id, bucket_counts, sample_count, sample_sum, created) VALUES (?, ?, NULL, 0.0, 0.0, prom_now());";
+  res = prom_db_prepare_stmt(p, dbh, stmt);
+  if (res < 0) {
+    return -1;
+  }
+
+  res = prom_db_bind_stmt(p, dbh, stmt, 1, PROM_DB_BIND_TYPE_INT64,
+    (void *) &metric_id);
+  if (res < 0) {
+    return -1;
+  }
+
+  res = prom_db_bind_stmt(p, dbh, stmt, 2, PROM_DB_BIND_TYPE_INT64,
+    (void *) &label_set_id);
+  if (res < 0) {
+    return -1;
+  }
+
+  res = prom_db_exec_prepared_write(p, dbh, stmt, &errstr);
+  xerrno = errno;
+
+  if (res < 0) {
+    pr_trace_msg(trace_channel, 7,
+      "error executing '%s': %s", stmt, errstr ? errstr : strerror(xerrno));
+    errno = db_errno(xerrno);
+    return -1;
+  }
+
+  return 0;
+}
+
+static int db_histogram_adj(pool *p, struct prom_dbh *dbh, int64_t metric_id,
+    int64_t label_set_id, unsigned int bucket_idx, unsigned int bucket_count,
+    int64_t count, double sum, const char *exemplar) {
+  int res, xerrno;
+  const char *stmt, *errstr = NULL;
+
+  res = db_histogram_create(p, dbh, metric_id, label_set_id);
+  if (res < 0) {
+    return -1;
+  }
+
+  stmt = "UPDATE histogram_samples SET bucket_counts = prom_slot_add(bucket_counts, ?1, ?2, ?3), sample_count = sample_count + ?3, sample_sum = sample_sum + ?4, exemplars = prom_exemplar_set(exemplars, ?1, ?7) WHERE metric_id = ?5 AND label_set_id = ?6;";
+  res = prom_db_prepare_stmt(p, dbh, stmt);
+  if (res < 0) {
+    return -1;
+  }
+
+  res = prom_db_bind_stmt(p, dbh, stmt, 1, PROM_DB_BIND_TYPE_INT,
+    (void *) &bucket_idx);
+  if (res < 0) {
+    return -1;
+  }
+
+  res = prom_db_bind_stmt(p, dbh, stmt, 2, PROM_DB_BIND_TYPE_INT,
+    (void *) &bucket_count);
+  if (res < 0) {
+    return -1;
+  }
+
+  res = prom_db_bind_stmt(p, dbh, stmt, 3, PROM_DB_BIND_TYPE_INT64,
+    (void *) &count);
+  if (res < 0) {
+    return -1;
+  }
+
+  res = prom_db_bind_stmt(p, dbh, stmt, 4, PROM_DB_BIND_TYPE_DOUBLE,
+    (void *) &sum);
+  if (res < 0) {
+    return -1;
+  }
+
+  res = prom_db_bind_stmt(p, dbh, stmt, 5, PROM_DB_BIND_TYPE_INT64,
+    (void *) &metric_id);
+  if (res < 0) {
+    return -1;
+  }
+
+  res = prom_db_bind_stmt(p, dbh, stmt, 6, PROM_DB_BIND_TYPE_INT64,
+    (void *) &label_set_id);
+  if (res < 0) {
+    return -1;
+  }
+
+  res = db_bind_exemplar(p, dbh, stmt, 7, exemplar);
+  if (res < 0) {
+    return -1;
+  }
+
+  res = prom_db_exec_prepared_write(p, dbh, stmt, &errstr);
+  xerrno = errno;
+
+  if (res < 0) {
+    pr_trace_msg(trace_channel, 7,
+      "error executing '%s': %s", stmt, errstr ? errstr : strerror(xerrno));
+    errno = db_errno(xerrno);
+    return -1;
+  }
+
+  return 0;
+}
+#endif /* HAVE_SQLITE3_UPSERT */
+
+int prom_metric_db_histogram_add(pool *p, struct prom_dbh *dbh,
+    int64_t metric_id, unsigned int bucket_idx, unsigned int bucket_count,
+    double count, double sum, const char *sample_labels,
+    const char *exemplar) {
+  int64_t label_set_id = 0;
+
+  if (p == NULL ||
+      dbh == NULL ||
+      sample_labels == NULL ||
+      bucket_idx >= bucket_count) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (label_set_get_id(p, dbh, sample_labels, TRUE, &label_set_id) < 0) {
+    return -1;
+  }
+
+#if defined(HAVE_SQLITE3_UPSERT)
+  return db_histogram_upsert(p, dbh, metric_id, label_set_id, bucket_idx,
+    bucket_count, (int64_t) count, sum, exemplar);
+#else
+  return db_histogram_adj(p, dbh, metric_id, label_set_id, bucket_idx,
+    bucket_count, (int64_t) count, sum, exemplar);
+#endif /* HAVE_SQLITE3_UPSERT */
+}
+
+struct histogram_get_data {
+  pool *pool;
+  array_header *histograms;
+};
+
+/* Unpacks the little-endian 64-bit bucket counts maintained by
+ * prom_slot_add().
+ */
+static const double *histogram_bucket_counts(pool *p,
+    const unsigned char *blob, size_t blobsz, unsigned int *bucket_count) {
+  register unsigned int i, j;
+  double *bucket_counts;
+
+  *bucket_count = blobsz / sizeof(uint64_t);
+  bucket_counts = pcalloc(p, sizeof(double) * (*bucket_count + 1));
+
+  for (i = 0; i < *bucket_count; i++) {
+    uint64_t val = 0;
+
+    for (j = 0; j < sizeof(uint64_t); j++) {
+      val |= ((uint64_t) blob[(i * sizeof(uint64_t)) + j]) << (j * 8);
+    }
+
+    bucket_counts[i] = (double) ((int64_t) val);
+  }
+
+  return bucket_counts;
+}
+
+/* Unpacks the "<slot> <exemplar>" lines maintained by prom_exemplar_set()
+ * into the exemplar for each bucket.  Returns NULL if there are none.
+ */
+static const char **histogram_bucket_exemplars(pool *p, const char *text,
+    size_t textlen, unsigned int bucket_count) {
+  const char **exemplars = NULL, *ptr, *end;
+
+  ptr = text;
+  end = text + textlen;
+  while (ptr < end) {
+    const char *eol, *exemplar;
+    char *tmp = NULL;
+    unsigned long slot;
+
+    eol = memchr(ptr, '\n', end - ptr);
+    if (eol == NULL) {
+      eol = end;
+    }
+
+    slot = strtoul(ptr, &tmp, 10);
+    if (tmp != NULL &&
+        tmp < eol &&
+        *tmp == ' ' &&
+        slot < bucket_count) {
+      exemplar = tmp + 1;
+
+      if (exemplars == NULL) {
+        exemplars = pcalloc(p, sizeof(char *) * bucket_count);
+      }
+
+      exemplars[slot] = pstrndup(p, exemplar, eol - exemplar);
+    }
+
+    ptr = eol + 1;
+  }
+
+  return exemplars;
+}
+
+/* Reads the histogram row whose columns (metric ID, bucket counts, count,
+ * sum, labels, created, exemplars) start at the given column.
+ */
+static int histogram_row_add(pool *p, array_header *histograms,
+    struct prom_db_row *row, int col) {
+  struct prom_metric_db_histogram *histogram;
+  const void *blob;
+  const char *labels, *exemplars;
+  size_t blobsz = 0, labelslen = 0, exemplarslen = 0;
+
+  histogram = push_array(histograms);
+
+  if (prom_db_row_get_int64(row, col, &(histogram->metric_id)) < 0 ||
+      prom_db_row_get_double(row, col + 2, &(histogram->sample_count)) < 0 ||
+      prom_db_row_get_double(row, col + 3, &(histogram->sample_sum)) < 0) {
+    return -1;
+  }
+
+  /* The bucket counts are NULL until the first observation. */
+  blob = prom_db_row_get_blob(row, col + 1, &blobsz);
+  histogram->bucket_counts = histogram_bucket_counts(p, blob,
+    blob != NULL ? blobsz : 0, &(histogram->bucket_count));
+
+  labels = prom_db_row_get_text(row, col + 4, &labelslen);
+  if (labels == NULL) {
+    return -1;
+  }
+
+  histogram->sample_labels = pstrndup(p, labels, labelslen);
+  histogram->sample_labelslen = labelslen;
+
+  if (prom_db_row_get_double(row, col + 5, &(histogram->created)) < 0) {
+    return -1;
+  }
+
+  exemplars = prom_db_row_get_text(row, col + 6, &exemplarslen);
+  histogram->bucket_exemplars = histogram_bucket_exemplars(p, exemplars,
+    exemplars != NULL ? exemplarslen : 0, histogram->bucket_count);
+  return 0;
+}
+
+static int histogram_get_cb(struct prom_db_row *row, void *user_data) {
+  struct histogram_get_data *data;
+
+  data = user_data;
+  return histogram_row_add(data->pool, data->histograms, row, 0);
+}
+
+static const array_header *histogram_get(pool *p, struct prom_dbh *dbh,
+    const char *stmt, int64_t *metric_id) {
+  int res, xerrno;
+  const char *errstr = NULL;
+  struct histogram_get_data data;
+
+  res = prom_db_prepare_stmt(p, dbh, stmt);
+  if (res < 0) {
+    return NULL;
+  }
+
+  if (metric_id != NULL) {
+    res = prom_db_bind_stmt(p, dbh, stmt, 1, PROM_DB_BIND_TYPE_INT64,
+      (void *) metric_id);
     if (res < 0) {
-      return -1;
+      return NULL;
     }
   }
 
-  stmt = "UPDATE metric_samples SET sample_value = ? WHERE metric_id = ? AND sample_labels = ?;";
-  return db_sample_adj(p, dbh, stmt, metric_id, sample_val, sample_labels);
+  data.pool = p;
+  data.histograms = make_array(p, 8, sizeof(struct prom_metric_db_histogram));
+
+  res = prom_db_exec_prepared_stmt_rows(p, dbh, stmt, histogram_get_cb,
+    &data, &errstr);
+  xerrno = errno;
+
+  if (res < 0) {
+    pr_trace_msg(trace_channel, 7,
+      "error executing '%s': %s", stmt, errstr ? errstr : strerror(xerrno));
+    errno = EPERM;
+    return NULL;
+  }
+
+  return data.histograms;
 }
 
-const array_header *prom_metric_db_sample_get(pool *p, struct prom_dbh *dbh,
-    int64_t metric_id) {
-  int res, xerrno;
-  const char *stmt, *errstr = NULL;
-  array_header *results;
+const array_header *prom_metric_db_histogram_get(pool *p,
+    struct prom_dbh *dbh, int64_t metric_id) {
+  const char *stmt;
 
   if (p == NULL ||
       dbh == NULL) {
@@ -470,40 +1243,452 @@ const array_header *prom_metric_db_sample_get(pool *p, struct prom_dbh *dbh,
     return NULL;
   }
 
-  stmt = "SELECT sample_value, sample_labels FROM metric_samples WHERE metric_id = ? ORDER BY sample_labels ASC;";
+  stmt = "SELECT histogram_samples.metric_id, histogram_samples.bucket_counts, histogram_samples.sample_count, histogram_samples.sample_sum, label_sets.label_set, histogram_samples.created, histogram_samples.exemplars FROM histogram_samples JOIN label_sets ON histogram_samples.label_set_id = label_sets.label_set_id WHERE histogram_samples.metric_id = ? ORDER BY label_sets.label_set ASC;";
+  return histogram_get(p, dbh, stmt, &metric_id);
+}
+
+/* Executes the given summary bin statement; the count and sum are only bound
+ * if provided.
+ */
+static int db_summary_exec(pool *p, struct prom_dbh *dbh, const char *stmt,
+    int64_t metric_id, int64_t label_set_id, int bin_key, double *count,
+    double *sum) {
+  int res, xerrno;
+  const char *errstr = NULL;
+
   res = prom_db_prepare_stmt(p, dbh, stmt);
   if (res < 0) {
-    return NULL;
+    return -1;
   }
 
-  res = prom_db_bind_stmt(p, dbh, stmt, 1, PROM_DB_BIND_TYPE_INT,
+  res = prom_db_bind_stmt(p, dbh, stmt, 1, PROM_DB_BIND_TYPE_INT64,
     (void *) &metric_id);
+  if (res < 0) {
+    return -1;
+  }
+
+  res = prom_db_bind_stmt(p, dbh, stmt, 2, PROM_DB_BIND_TYPE_INT64,
+    (void *) &label_set_id);
+  if (res < 0) {
+    return -1;
+  }
+
+  res = prom_db_bind_stmt(p, dbh, stmt, 3, PROM_DB_BIND_TYPE_INT,
+    (void *) &bin_key);
+  if (res < 0) {
+    return -1;
+  }
+
+  if (count != NULL) {
+    res = prom_db_bind_stmt(p, dbh, stmt, 4, PROM_DB_BIND_TYPE_DOUBLE,
+      (void *) count);
+    if (res < 0) {
+      return -1;
+    }
+
+    res = prom_db_bind_stmt(p, dbh, stmt, 5, PROM_DB_BIND_TYPE_DOUBLE,
+      (void *) sum);
+    if (res < 0) {
+      return -1;
+    }
+  }
+
+  res = prom_db_exec_prepared_write(p, dbh, stmt, &errstr);
+  xerrno = errno;
+
+  if (res < 0) {
+    pr_trace_msg(trace_channel, 7,
+      "error executing '%s': %s", stmt, errstr ? errstr : strerror(xerrno));
+    errno = db_errno(xerrno);
+    return -1;
+  }
+
+  return 0;
+}
+
+int prom_metric_db_summary_add(pool *p, struct prom_dbh *dbh,
+    int64_t metric_id, int bin_key, double count, double sum,
+    const char *sample_labels) {
+  int64_t label_set_id = 0;
+  const char *stmt;
+
+  if (p == NULL ||
+      dbh == NULL ||
+      sample_labels == NULL ||
+      count < 0.0) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (label_set_get_id(p, dbh, sample_labels, TRUE, &label_set_id) < 0) {
+    return -1;
+  }
+
+#if defined(HAVE_SQLITE3_UPSERT)
+  stmt = "INSERT INTO summary_samples (metric_id, label_set_id, bin_key, bin_count, bin_sum, created) VALUES (?1, ?2, ?3, ?4, ?5, prom_now()) ON CONFLICT (metric_id, label_set_id, bin_key) DO UPDATE SET bin_count = bin_count + excluded.bin_count, bin_sum = bin_sum + excluded.bin_sum;";
+  return db_summary_exec(p, dbh, stmt, metric_id, label_set_id, bin_key,
+    &count, &sum);
+#else
+  /* Thanks to the UNIQUE (metric_id, label_set_id, bin_key) index,
+   * concurrent creation of the same bin by other processes is harmless.
+   */
+  stmt = "INSERT OR IGNORE INTO summary_samples (metric_id, label_set_id, bin_key, bin_count, bin_sum, created) VALUES (?1, ?2, ?3, 0.0, 0.0, prom_now());";
+  if (db_summary_exec(p, dbh, stmt, metric_id, label_set_id, bin_key,
+      NULL, NULL) < 0) {
+    return -1;
+  }
+
+  stmt = "UPDATE summary_samples SET bin_count = bin_count + ?4, bin_sum = bin_sum + ?5 WHERE metric_id = ?1 AND label_set_id = ?2 AND bin_key = ?3;";
+  return db_summary_exec(p, dbh, stmt, metric_id, label_set_id, bin_key,
+    &count, &sum);
+#endif /* HAVE_SQLITE3_UPSERT */
+}
+
+struct summary_get_data {
+  pool *pool;
+  array_header *summaries;
+  array_header *bins;
+};
+
+/* Reads the summary bin row whose columns (metric ID, bin key, bin count,
+ * bin sum, labels, created) start at the given column.  The rows are ordered
+ * by metric ID, labels, and bin key; consecutive rows for the same metric ID
+ * and labels are the bins of one summary.
+ */
+static int summary_row_add(struct summary_get_data *data,
+    struct prom_db_row *row, int col) {
+  struct prom_metric_db_summary *summary = NULL;
+  struct prom_sketch_bin *bin;
+  int64_t metric_id = 0, bin_key = 0;
+  double bin_count = 0.0, bin_sum = 0.0, created = 0.0;
+  const char *labels;
+  size_t labelslen = 0;
+
+  if (prom_db_row_get_int64(row, col, &metric_id) < 0 ||
+      prom_db_row_get_int64(row, col + 1, &bin_key) < 0 ||
+      prom_db_row_get_double(row, col + 2, &bin_count) < 0 ||
+      prom_db_row_get_double(row, col + 3, &bin_sum) < 0 ||
+      prom_db_row_get_double(row, col + 5, &created) < 0) {
+    return -1;
+  }
+
+  labels = prom_db_row_get_text(row, col + 4, &labelslen);
+  if (labels == NULL) {
+    return -1;
+  }
+
+  if (data->summaries->nelts > 0) {
+    summary = ((struct prom_metric_db_summary *) data->summaries->elts) +
+      (data->summaries->nelts - 1);
+
+    if (summary->metric_id != metric_id ||
+        summary->sample_labelslen != labelslen ||
+        strncmp(summary->sample_labels, labels, labelslen) != 0) {
+      summary = NULL;
+    }
+  }
+
+  if (summary == NULL) {
+    summary = push_array(data->summaries);
+    memset(summary, 0, sizeof(struct prom_metric_db_summary));
+    summary->metric_id = metric_id;
+    summary->sample_labels = pstrndup(data->pool, labels, labelslen);
+    summary->sample_labelslen = labelslen;
+
+    data->bins = make_array(data->pool, 8, sizeof(struct prom_sketch_bin));
+  }
+
+  /* The summary was created along with its first bin. */
+  if (created > 0.0 &&
+      (summary->created == 0.0 || created < summary->created)) {
+    summary->created = created;
+  }
+
+  bin = push_array(data->bins);
+  bin->key = (int) bin_key;
+  bin->count = bin_count;
+
+  summary->bins = data->bins->elts;
+  summary->bin_count = data->bins->nelts;
+  summary->sample_count += bin_count;
+  summary->sample_sum += bin_sum;
+  return 0;
+}
+
+static int summary_get_cb(struct prom_db_row *row, void *user_data) {
+  return summary_row_add(user_data, row, 0);
+}
+
+static const array_header *summary_get(pool *p, struct prom_dbh *dbh,
+    const char *stmt, int64_t *metric_id) {
+  int res, xerrno;
+  const char *errstr = NULL;
+  struct summary_get_data data;
+
+  res = prom_db_prepare_stmt(p, dbh, stmt);
   if (res < 0) {
     return NULL;
   }
 
-  results = prom_db_exec_prepared_stmt(p, dbh, stmt, &errstr);
+  if (metric_id != NULL) {
+    res = prom_db_bind_stmt(p, dbh, stmt, 1, PROM_DB_BIND_TYPE_INT64,
+      (void *) metric_id);
+    if (res < 0) {
+      return NULL;
+    }
+  }
+
+  data.pool = p;
+  data.summaries = make_array(p, 8, sizeof(struct prom_metric_db_summary));
+  data.bins = NULL;
+
+  res = prom_db_exec_prepared_stmt_rows(p, dbh, stmt, summary_get_cb,
+    &data, &errstr);
   xerrno = errno;
 
-  if (results == NULL) {
+  if (res < 0) {
     pr_trace_msg(trace_channel, 7,
       "error executing '%s': %s", stmt, errstr ? errstr : strerror(xerrno));
     errno = EPERM;
     return NULL;
   }
 
-  return results;
+  return data.summaries;
+}
+
+const array_header *prom_metric_db_summary_get(pool *p, struct prom_dbh *dbh,
+    int64_t metric_id) {
+  const char *stmt;
+
+  if (p == NULL ||
+      dbh == NULL) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  stmt = "SELECT summary_samples.metric_id, summary_samples.bin_key, summary_samples.bin_count, summary_samples.bin_sum, label_sets.label_set, summary_samples.created FROM summary_samples JOIN label_sets ON summary_samples.label_set_id = label_sets.label_set_id WHERE summary_samples.metric_id = ? ORDER BY label_sets.label_set ASC, summary_samples.bin_key ASC;";
+  return summary_get(p, dbh, stmt, &metric_id);
+}
+
+/* Scans. */
+
+struct prom_metric_db_scan {
+  struct prom_db_cursor *cursor;
+
+  /* The row read, but not yet consumed (being of a later rank), if any. */
+  struct prom_db_row *row;
+  int64_t row_rank;
+};
+
+/* The kinds of rows read by a scan. */
+#define PROM_METRIC_DB_SCAN_SAMPLE	0
+#define PROM_METRIC_DB_SCAN_HISTOGRAM	1
+#define PROM_METRIC_DB_SCAN_SUMMARY	2
+
+/* The columns of each kind of row start after the rank and kind columns,
+ * and are those of the per-metric queries, so that the rows are read the
+ * same way.
+ */
+#define PROM_METRIC_DB_SCAN_COL		2
+
+static int sample_row_add(pool *p, array_header *samples,
+    struct prom_db_row *row, int col) {
+  struct prom_metric_db_sample *sample;
+  const char *labels;
+  size_t labelslen = 0;
+
+  sample = push_array(samples);
+
+  if (prom_db_row_get_int64(row, col, &(sample->metric_id)) < 0 ||
+      prom_db_row_get_double(row, col + 1, &(sample->sample_value)) < 0) {
+    return -1;
+  }
+
+  labels = prom_db_row_get_text(row, col + 2, &labelslen);
+  if (labels == NULL) {
+    return -1;
+  }
+
+  sample->sample_labels = pstrndup(p, labels, labelslen);
+  sample->sample_labelslen = labelslen;
+  sample->exemplar = NULL;
+
+  /* Note that a NULL created time (e.g. from an older row) reads as zero. */
+  if (prom_db_row_get_double(row, col + 3, &(sample->created)) < 0) {
+    return -1;
+  }
+
+  return 0;
+}
+
+struct prom_metric_db_scan *prom_metric_db_scan_open(pool *p,
+    struct prom_dbh *dbh, const array_header *ranks) {
+  register unsigned int i;
+  struct prom_metric_db_scan *scan;
+  const struct prom_metric_db_rank *elts;
+  const char *stmt, *rank_expr;
+
+  if (p == NULL ||
+      dbh == NULL ||
+      ranks == NULL) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  scan = pcalloc(p, sizeof(struct prom_metric_db_scan));
+
+  /* With no metrics, there is nothing to read. */
+  if (ranks->nelts == 0) {
+    return scan;
+  }
+
+  /* Each metric ID is mapped to its rank; the rows of any other metrics are
+   * not read.
+   */
+  rank_expr = "CASE c0";
+  elts = ranks->elts;
+  for (i = 0; i < ranks->nelts; i++) {
+    char when[64];
+
+    memset(when, '\0', sizeof(when));
+    snprintf(when, sizeof(when)-1, " WHEN %lld THEN %u",
+      (long long) elts[i].metric_id, elts[i].rank);
+    rank_expr = pstrcat(p, rank_expr, when, NULL);
+  }
+
+  rank_expr = pstrcat(p, rank_expr, " END", NULL);
+
+  /* Being a single statement, this provides a consistent point-in-time view
+   * of all of the samples, histograms, and summaries.
+   */
+  stmt = pstrcat(p, "SELECT ", rank_expr, " AS metric_rank, kind, c0, c1, c2, c3, c4, c5, c6 FROM (SELECT 0 AS kind, metric_samples.metric_id AS c0, metric_samples.sample_value AS c1, label_sets.label_set AS c2, metric_samples.created AS c3, NULL AS c4, NULL AS c5, NULL AS c6, label_sets.label_set AS label_set, 0 AS bin_key FROM metric_samples JOIN label_sets ON metric_samples.label_set_id = label_sets.label_set_id UNION ALL SELECT 1, histogram_samples.metric_id, histogram_samples.bucket_counts, histogram_samples.sample_count, histogram_samples.sample_sum, label_sets.label_set, histogram_samples.created, histogram_samples.exemplars, label_sets.label_set, 0 FROM histogram_samples JOIN label_sets ON histogram_samples.label_set_id = label_sets.label_set_id UNION ALL SELECT 2, summary_samples.metric_id, summary_samples.bin_key, summary_samples.bin_count, summary_samples.bin_sum, label_sets.label_set, summary_samples.created, NULL, label_sets.label_set, summary_samples.bin_key FROM summary_samples JOIN label_sets ON summary_samples.label_set_id = label_sets.label_set_id) WHERE metric_rank IS NOT NULL ORDER BY metric_rank ASC, c0 ASC, label_set ASC, bin_key ASC;", NULL);
+
+  scan->cursor = prom_db_cursor_open(p, dbh, stmt);
+  if (scan->cursor == NULL) {
+    return NULL;
+  }
+
+  return scan;
+}
+
+int prom_metric_db_scan_next(pool *p, struct prom_metric_db_scan *scan,
+    unsigned int rank, const array_header **samples,
+    const array_header **histograms, const array_header **summaries) {
+  struct summary_get_data summary_data;
+  array_header *sample_rows, *histogram_rows;
+
+  if (p == NULL ||
+      scan == NULL ||
+      samples == NULL ||
+      histograms == NULL ||
+      summaries == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  sample_rows = make_array(p, 1, sizeof(struct prom_metric_db_sample));
+  histogram_rows = make_array(p, 1, sizeof(struct prom_metric_db_histogram));
+
+  summary_data.pool = p;
+  summary_data.summaries = make_array(p, 1,
+    sizeof(struct prom_metric_db_summary));
+  summary_data.bins = NULL;
+
+  while (scan->cursor != NULL) {
+    int64_t kind = 0;
+    int res = 0;
+
+    pr_signals_handle();
+
+    if (scan->row == NULL) {
+      scan->row = prom_db_cursor_next(scan->cursor);
+      if (scan->row == NULL) {
+        int xerrno = errno;
+
+        (void) prom_db_cursor_close(scan->cursor);
+        scan->cursor = NULL;
+
+        if (xerrno == ENOENT) {
+          break;
+        }
+
+        errno = xerrno;
+        return -1;
+      }
+
+      if (prom_db_row_get_int64(scan->row, 0, &(scan->row_rank)) < 0) {
+        return -1;
+      }
+    }
+
+    /* Any rows for earlier ranks were not wanted; the rows for later ranks
+     * are kept until they are.
+     */
+    if (scan->row_rank > (int64_t) rank) {
+      break;
+    }
+
+    if (scan->row_rank == (int64_t) rank) {
+      if (prom_db_row_get_int64(scan->row, 1, &kind) < 0) {
+        return -1;
+      }
+
+      switch (kind) {
+        case PROM_METRIC_DB_SCAN_SAMPLE:
+          res = sample_row_add(p, sample_rows, scan->row,
+            PROM_METRIC_DB_SCAN_COL);
+          break;
+
+        case PROM_METRIC_DB_SCAN_HISTOGRAM:
+          res = histogram_row_add(p, histogram_rows, scan->row,
+            PROM_METRIC_DB_SCAN_COL);
+          break;
+
+        case PROM_METRIC_DB_SCAN_SUMMARY:
+          res = summary_row_add(&summary_data, scan->row,
+            PROM_METRIC_DB_SCAN_COL);
+          break;
+      }
+
+      if (res < 0) {
+        return -1;
+      }
+    }
+
+    scan->row = NULL;
+  }
+
+  *samples = sample_rows;
+  *histograms = histogram_rows;
+  *summaries = summary_data.summaries;
+  return 0;
 }
 
+int prom_metric_db_scan_close(struct prom_metric_db_scan *scan) {
+  if (scan == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (scan->cursor != NULL) {
+    (void) prom_db_cursor_close(scan->cursor);
+    scan->cursor = NULL;
+  }
+
+  scan->row = NULL;
+  return 0;
+}
 int prom_metric_db_close(pool *p, struct prom_dbh *dbh) {
   if (p == NULL) {
     errno = EINVAL;
     return -1;
   }
 
-  /* TODO: Implement any necessary cleanup */
-
   if (dbh != NULL) {
+    if (dbh == label_sets_dbh) {
+      label_sets_reset(NULL, NULL);
+    }
+
     if (prom_db_close(p, dbh) < 0) {
       (void) pr_log_writefile(prometheus_logfd, MOD_PROMETHEUS_VERSION,
         "error detaching database with schema '%s': %s",
@@ -546,9 +1731,69 @@ struct prom_dbh *prom_metric_db_open(pool *p, const char *tables_path) {
     return NULL;
   }
 
+  label_sets_reset(p, dbh);
+  return dbh;
+}
+
+struct prom_dbh *prom_metric_db_reopen(pool *p, const char *tables_path) {
+  int xerrno;
+  struct prom_dbh *dbh;
+  const char *db_path;
+
+  if (p == NULL ||
+      tables_path == NULL) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  db_path = pdircat(p, tables_path, "metrics.db", NULL);
+
+  /* Unlike prom_metric_db_init(), we assume that the database has already
+   * been initialized (and checked) by the daemon process; this is the fast
+   * path used by sessions, thus there are no schema version or integrity
+   * checks, and no VACUUM.
+   */
+
+  PRIVS_ROOT
+  dbh = prom_db_open(p, db_path, PROM_METRICS_DB_SCHEMA_NAME);
+  xerrno = errno;
+  PRIVS_RELINQUISH
+
+  if (dbh == NULL) {
+    (void) pr_log_writefile(prometheus_logfd, MOD_PROMETHEUS_VERSION,
+      "error reopening database '%s' for schema '%s': %s", db_path,
+      PROM_METRICS_DB_SCHEMA_NAME, strerror(xerrno));
+    errno = xerrno;
+    return NULL;
+  }
+
+  label_sets_reset(p, dbh);
   return dbh;
 }
 
+int prom_metric_db_maintain(pool *p, struct prom_dbh *dbh) {
+  int res;
+  const char *stmt, *errstr = NULL;
+
+  if (p == NULL ||
+      dbh == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  stmt = "VACUUM;";
+  res = prom_db_exec_stmt(p, dbh, stmt, &errstr);
+  if (res < 0) {
+    (void) pr_log_writefile(prometheus_logfd, MOD_PROMETHEUS_VERSION,
+      "error executing '%s': %s", stmt, errstr);
+    errno = EPERM;
+    return -1;
+  }
+
+  pr_trace_msg(trace_channel, 15, "performed maintenance on metrics database");
+  return 0;
+}
+
 struct prom_dbh *prom_metric_db_init(pool *p, const char *tables_path,
     int flags) {
   int db_flags, res, xerrno = 0;
@@ -584,6 +1829,8 @@ struct prom_dbh *prom_metric_db_init(pool *p, const char *tables_path,
     return NULL;
   }
 
+  label_sets_reset(p, dbh);
+
   if (flags & PROM_DB_OPEN_FL_SKIP_TABLE_INIT) {
     /* Skip adding/initializing tables. */
     return dbh;
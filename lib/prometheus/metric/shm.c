@@ -0,0 +1,598 @@
+/*
+ * ProFTPD - mod_prometheus shared memory metrics datastore implementation
+ * Copyright (c) 2021-2023 TJ Saunders
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+#include "mod_prometheus.h"
+#include "prometheus/metric/shm.h"
+#include "prometheus/metric/db.h"
+
+#include <sched.h>
+#include <signal.h>
+#include <sys/mman.h>
+
+/* The shared memory datastore is a fixed-size file, mmap'd by the daemon
+ * process before any session processes are forked.  It consists of a small
+ * header, followed by an open-addressed hash table of sample slots.  Slots
+ * are claimed using compare-and-swap, and are never released (the datastore
+ * is recreated on restart), so readers and writers never need to take a
+ * lock.  A slot being claimed records the PID of its claimant, so that a
+ * claim abandoned by a session which died midway can be taken over.
+ */
+
+#define PROM_METRIC_SHM_FILE_NAME	"metrics.shm"
+#define PROM_METRIC_SHM_MAGIC		0x50524f4d
+#define PROM_METRIC_SHM_VERSION		2
+
+/* Slot states.  The state of a busy slot also holds the claimant's PID, in
+ * its upper bits.
+ */
+#define PROM_METRIC_SHM_SLOT_EMPTY	0
+#define PROM_METRIC_SHM_SLOT_BUSY	1
+#define PROM_METRIC_SHM_SLOT_READY	2
+
+#define PROM_METRIC_SHM_SLOT_STATE_MASK	0x3
+#define PROM_METRIC_SHM_SLOT_OWNER_SHIFT	2
+
+/* How many times we will yield, waiting for another process to finish
+ * claiming a slot, before giving up on the update.
+ */
+#define PROM_METRIC_SHM_MAX_BUSY_SPINS	1024
+
+struct shm_header {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t nslots;
+  uint32_t nsamples;
+};
+
+struct shm_slot {
+  uint32_t state;
+  uint32_t hash;
+  int64_t metric_id;
+
+  /* The sample value, as the bits of a double. */
+  uint64_t value;
+
+  uint32_t labelslen;
+  char labels[PROM_METRIC_SHM_MAX_LABELS_LEN+4];
+};
+
+struct prom_metric_shm {
+  pool *pool;
+  const char *path;
+  void *addr;
+  size_t len;
+
+  struct shm_header *hdr;
+  struct shm_slot *slots;
+
+  /* Whether we have logged that the datastore is full. */
+  int logged_full;
+};
+
+static const char *trace_channel = "prometheus.metric.shm";
+
+#if defined(HAVE_ATOMIC_BUILTINS)
+/* FNV-1a, over the metric ID and the label text. */
+static uint32_t shm_hash(int64_t metric_id, const char *labels,
+    size_t labelslen) {
+  register unsigned int i;
+  uint32_t h = 2166136261U;
+  const unsigned char *ptr;
+
+  ptr = (const unsigned char *) &metric_id;
+  for (i = 0; i < sizeof(metric_id); i++) {
+    h ^= ptr[i];
+    h *= 16777619U;
+  }
+
+  ptr = (const unsigned char *) labels;
+  for (i = 0; i < labelslen; i++) {
+    h ^= ptr[i];
+    h *= 16777619U;
+  }
+
+  return h;
+}
+
+static uint64_t shm_double_bits(double val) {
+  uint64_t bits;
+
+  memcpy(&bits, &val, sizeof(bits));
+  return bits;
+}
+
+static double shm_bits_double(uint64_t bits) {
+  double val;
+
+  memcpy(&val, &bits, sizeof(val));
+  return val;
+}
+
+static uint32_t shm_slot_claim_state(pid_t pid) {
+  return PROM_METRIC_SHM_SLOT_BUSY |
+    ((uint32_t) pid << PROM_METRIC_SHM_SLOT_OWNER_SHIFT);
+}
+
+static int shm_slot_is_busy(uint32_t state) {
+  return (state & PROM_METRIC_SHM_SLOT_STATE_MASK) ==
+    PROM_METRIC_SHM_SLOT_BUSY;
+}
+
+/* Whether the process which started claiming the slot has since exited.
+ * Note that EPERM means that the process exists, e.g. a session running as
+ * another user.
+ */
+static int shm_slot_owner_gone(uint32_t state) {
+  pid_t pid;
+
+  pid = (pid_t) (state >> PROM_METRIC_SHM_SLOT_OWNER_SHIFT);
+  if (pid <= 0) {
+    return FALSE;
+  }
+
+  if (kill(pid, 0) < 0 &&
+      errno == ESRCH) {
+    return TRUE;
+  }
+
+  return FALSE;
+}
+
+/* Waits for a slot being claimed by another process to become ready.
+ * Returns the slot state, which is still busy if that process has exited.
+ */
+static uint32_t shm_slot_wait(struct shm_slot *slot) {
+  register unsigned int i;
+  uint32_t state;
+
+  state = __atomic_load_n(&(slot->state), __ATOMIC_ACQUIRE);
+  for (i = 0; shm_slot_is_busy(state) &&
+              i < PROM_METRIC_SHM_MAX_BUSY_SPINS; i++) {
+    if (i % 64 == 0 &&
+        shm_slot_owner_gone(state)) {
+      break;
+    }
+
+    sched_yield();
+    state = __atomic_load_n(&(slot->state), __ATOMIC_ACQUIRE);
+  }
+
+  return state;
+}
+
+/* Fills in the claimed slot for the given metric ID/labels, and marks it
+ * ready.
+ */
+static void shm_slot_fill(struct prom_metric_shm *shm, struct shm_slot *slot,
+    uint32_t hash, int64_t metric_id, const char *labels, size_t labelslen) {
+  slot->hash = hash;
+  slot->metric_id = metric_id;
+  slot->labelslen = labelslen;
+  memcpy(slot->labels, labels, labelslen);
+  slot->labels[labelslen] = '\0';
+  __atomic_store_n(&(slot->value), shm_double_bits(0.0), __ATOMIC_RELAXED);
+
+  __atomic_store_n(&(slot->state), PROM_METRIC_SHM_SLOT_READY,
+    __ATOMIC_RELEASE);
+  __atomic_add_fetch(&(shm->hdr->nsamples), 1, __ATOMIC_RELAXED);
+}
+
+/* Finds the slot for the given metric ID/labels, claiming an empty slot
+ * for them if necessary.
+ */
+static struct shm_slot *shm_get_slot(struct prom_metric_shm *shm,
+    int64_t metric_id, const char *labels) {
+  register unsigned int i;
+  uint32_t claim_state, hash, nslots;
+  size_t labelslen;
+
+  labelslen = strlen(labels);
+  if (labelslen > PROM_METRIC_SHM_MAX_LABELS_LEN) {
+    pr_trace_msg(trace_channel, 3,
+      "labels for metric ID %lld too long (%lu > max %lu): %s",
+      (long long) metric_id, (unsigned long) labelslen,
+      (unsigned long) PROM_METRIC_SHM_MAX_LABELS_LEN, labels);
+    errno = ENAMETOOLONG;
+    return NULL;
+  }
+
+  hash = shm_hash(metric_id, labels, labelslen);
+  nslots = shm->hdr->nslots;
+  claim_state = shm_slot_claim_state(getpid());
+
+  for (i = 0; i < nslots; i++) {
+    struct shm_slot *slot;
+    uint32_t state;
+
+    slot = &(shm->slots[(hash + i) % nslots]);
+    state = __atomic_load_n(&(slot->state), __ATOMIC_ACQUIRE);
+
+    if (state == PROM_METRIC_SHM_SLOT_EMPTY) {
+      uint32_t expected = PROM_METRIC_SHM_SLOT_EMPTY;
+
+      if (__atomic_compare_exchange_n(&(slot->state), &expected,
+          claim_state, FALSE, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        shm_slot_fill(shm, slot, hash, metric_id, labels, labelslen);
+
+        pr_trace_msg(trace_channel, 17,
+          "claimed slot %u for metric ID %lld, labels '%s'",
+          (hash + i) % nslots, (long long) metric_id, labels);
+        return slot;
+      }
+
+      /* Lost the race for this slot; see who won. */
+      state = expected;
+    }
+
+    if (shm_slot_is_busy(state)) {
+      state = shm_slot_wait(slot);
+
+      /* The claimant died before finishing its claim.  The slot is as good
+       * as empty, so we take the claim over, for our own labels; of any
+       * processes doing the same, only one wins.
+       */
+      if (shm_slot_is_busy(state) &&
+          shm_slot_owner_gone(state)) {
+        uint32_t expected = state;
+
+        if (__atomic_compare_exchange_n(&(slot->state), &expected,
+            claim_state, FALSE, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+          pr_trace_msg(trace_channel, 5,
+            "reclaimed slot %u, abandoned by PID %lu, for metric ID %lld, "
+            "labels '%s'", (hash + i) % nslots,
+            (unsigned long) (state >> PROM_METRIC_SHM_SLOT_OWNER_SHIFT),
+            (long long) metric_id, labels);
+          shm_slot_fill(shm, slot, hash, metric_id, labels, labelslen);
+          return slot;
+        }
+
+        state = shm_slot_wait(slot);
+      }
+
+      if (state != PROM_METRIC_SHM_SLOT_READY) {
+        /* The slot may be being claimed for these very labels.  Probing
+         * past it could claim a second slot for them, duplicating the
+         * sample; fail this update instead.
+         */
+        pr_trace_msg(trace_channel, 3,
+          "slot %u still being claimed, dropping update of metric ID %lld, "
+          "labels '%s'", (hash + i) % nslots, (long long) metric_id, labels);
+        errno = EAGAIN;
+        return NULL;
+      }
+    }
+
+    if (slot->hash == hash &&
+        slot->metric_id == metric_id &&
+        slot->labelslen == labelslen &&
+        memcmp(slot->labels, labels, labelslen) == 0) {
+      return slot;
+    }
+  }
+
+  pr_trace_msg(trace_channel, 1,
+    "no free slots (max %u) for metric ID %lld, labels '%s'", nslots,
+    (long long) metric_id, labels);
+
+  if (shm->logged_full == FALSE) {
+    (void) pr_log_pri(PR_LOG_NOTICE, MOD_PROMETHEUS_VERSION
+      ": shared memory metrics datastore full (%u samples), dropping "
+      "updates of new samples", nslots);
+    shm->logged_full = TRUE;
+  }
+
+  errno = ENOSPC;
+  return NULL;
+}
+
+static int shm_sample_add(struct prom_metric_shm *shm, int64_t metric_id,
+    double sample_val, const char *sample_labels) {
+  struct shm_slot *slot;
+  uint64_t old_bits, new_bits;
+
+  slot = shm_get_slot(shm, metric_id, sample_labels);
+  if (slot == NULL) {
+    return -1;
+  }
+
+  old_bits = __atomic_load_n(&(slot->value), __ATOMIC_RELAXED);
+  do {
+    new_bits = shm_double_bits(shm_bits_double(old_bits) + sample_val);
+  } while (!__atomic_compare_exchange_n(&(slot->value), &old_bits, new_bits,
+    TRUE, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+  return 0;
+}
+#endif /* HAVE_ATOMIC_BUILTINS */
+
+int prom_metric_shm_sample_decr(pool *p, struct prom_metric_shm *shm,
+    int64_t metric_id, double sample_val, const char *sample_labels) {
+  if (p == NULL ||
+      shm == NULL ||
+      sample_labels == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+#if defined(HAVE_ATOMIC_BUILTINS)
+  return shm_sample_add(shm, metric_id, -sample_val, sample_labels);
+#else
+  errno = ENOSYS;
+  return -1;
+#endif /* HAVE_ATOMIC_BUILTINS */
+}
+
+int prom_metric_shm_sample_incr(pool *p, struct prom_metric_shm *shm,
+    int64_t metric_id, double sample_val, const char *sample_labels) {
+  if (p == NULL ||
+      shm == NULL ||
+      sample_labels == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+#if defined(HAVE_ATOMIC_BUILTINS)
+  return shm_sample_add(shm, metric_id, sample_val, sample_labels);
+#else
+  errno = ENOSYS;
+  return -1;
+#endif /* HAVE_ATOMIC_BUILTINS */
+}
+
+int prom_metric_shm_sample_set(pool *p, struct prom_metric_shm *shm,
+    int64_t metric_id, double sample_val, const char *sample_labels) {
+#if defined(HAVE_ATOMIC_BUILTINS)
+  struct shm_slot *slot;
+#endif /* HAVE_ATOMIC_BUILTINS */
+
+  if (p == NULL ||
+      shm == NULL ||
+      sample_labels == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+#if defined(HAVE_ATOMIC_BUILTINS)
+  slot = shm_get_slot(shm, metric_id, sample_labels);
+  if (slot == NULL) {
+    return -1;
+  }
+
+  __atomic_store_n(&(slot->value), shm_double_bits(sample_val),
+    __ATOMIC_RELAXED);
+  return 0;
+#else
+  errno = ENOSYS;
+  return -1;
+#endif /* HAVE_ATOMIC_BUILTINS */
+}
+
+static int sample_cmp(const void *a, const void *b) {
+  const struct prom_metric_db_sample *sa, *sb;
+
+  sa = a;
+  sb = b;
+
+  if (sa->metric_id != sb->metric_id) {
+    return sa->metric_id < sb->metric_id ? -1 : 1;
+  }
+
+  return strcmp(sa->sample_labels, sb->sample_labels);
+}
+
+#if defined(HAVE_ATOMIC_BUILTINS)
+/* Collects the samples of the ready slots, for the given metric ID or, if
+ * `all` is true, for every metric, in a single pass over the slots.
+ */
+static array_header *shm_sample_collect(pool *p, struct prom_metric_shm *shm,
+    int64_t metric_id, int all) {
+  register unsigned int i;
+  array_header *samples;
+
+  samples = make_array(p, 1, sizeof(struct prom_metric_db_sample));
+
+  for (i = 0; i < shm->hdr->nslots; i++) {
+    struct shm_slot *slot;
+    struct prom_metric_db_sample *sample;
+
+    slot = &(shm->slots[i]);
+    if (__atomic_load_n(&(slot->state), __ATOMIC_ACQUIRE) !=
+        PROM_METRIC_SHM_SLOT_READY) {
+      continue;
+    }
+
+    if (all == FALSE &&
+        slot->metric_id != metric_id) {
+      continue;
+    }
+
+    sample = push_array(samples);
+    memset(sample, 0, sizeof(struct prom_metric_db_sample));
+    sample->metric_id = slot->metric_id;
+    sample->sample_value = shm_bits_double(__atomic_load_n(&(slot->value),
+      __ATOMIC_RELAXED));
+    sample->sample_labels = pstrndup(p, slot->labels, slot->labelslen);
+    sample->sample_labelslen = slot->labelslen;
+  }
+
+  qsort(samples->elts, samples->nelts, sizeof(struct prom_metric_db_sample),
+    sample_cmp);
+  return samples;
+}
+#endif /* HAVE_ATOMIC_BUILTINS */
+
+const array_header *prom_metric_shm_sample_get(pool *p,
+    struct prom_metric_shm *shm, int64_t metric_id) {
+  if (p == NULL ||
+      shm == NULL) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+#if defined(HAVE_ATOMIC_BUILTINS)
+  return shm_sample_collect(p, shm, metric_id, FALSE);
+#else
+  errno = ENOSYS;
+  return NULL;
+#endif /* HAVE_ATOMIC_BUILTINS */
+}
+
+const array_header *prom_metric_shm_sample_get_all(pool *p,
+    struct prom_metric_shm *shm) {
+  if (p == NULL ||
+      shm == NULL) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+#if defined(HAVE_ATOMIC_BUILTINS)
+  return shm_sample_collect(p, shm, 0, TRUE);
+#else
+  errno = ENOSYS;
+  return NULL;
+#endif /* HAVE_ATOMIC_BUILTINS */
+}
+
+int prom_metric_shm_sample_count(struct prom_metric_shm *shm) {
+  if (shm == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+#if defined(HAVE_ATOMIC_BUILTINS)
+  return (int) __atomic_load_n(&(shm->hdr->nsamples), __ATOMIC_RELAXED);
+#else
+  errno = ENOSYS;
+  return -1;
+#endif /* HAVE_ATOMIC_BUILTINS */
+}
+
+int prom_metric_shm_close(pool *p, struct prom_metric_shm *shm) {
+  if (p == NULL ||
+      shm == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (shm->addr != NULL) {
+    if (munmap(shm->addr, shm->len) < 0) {
+      pr_trace_msg(trace_channel, 3, "error unmapping '%s': %s", shm->path,
+        strerror(errno));
+    }
+
+    shm->addr = NULL;
+  }
+
+  destroy_pool(shm->pool);
+  return 0;
+}
+
+struct prom_metric_shm *prom_metric_shm_init(pool *p, const char *tables_path,
+    unsigned int max_samples) {
+#if defined(HAVE_ATOMIC_BUILTINS)
+  int fd, xerrno;
+  pool *shm_pool;
+  struct prom_metric_shm *shm;
+  const char *path;
+  size_t len;
+  void *addr;
+
+  if (p == NULL ||
+      tables_path == NULL ||
+      max_samples == 0) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  path = pdircat(p, tables_path, PROM_METRIC_SHM_FILE_NAME, NULL);
+  len = sizeof(struct shm_header) +
+    ((size_t) max_samples * sizeof(struct shm_slot));
+
+  /* Always start with a new file.  Note that we unlink any existing file,
+   * rather than truncating it; any processes from before a restart may
+   * still have the old file mapped.
+   */
+  PRIVS_ROOT
+  (void) unlink(path);
+  fd = open(path, O_RDWR|O_CREAT|O_EXCL, 0600);
+  xerrno = errno;
+  PRIVS_RELINQUISH
+
+  if (fd < 0) {
+    pr_trace_msg(trace_channel, 1, "error creating '%s': %s", path,
+      strerror(xerrno));
+    errno = xerrno;
+    return NULL;
+  }
+
+  if (ftruncate(fd, (off_t) len) < 0) {
+    xerrno = errno;
+
+    pr_trace_msg(trace_channel, 1, "error sizing '%s' to %lu bytes: %s", path,
+      (unsigned long) len, strerror(xerrno));
+    (void) close(fd);
+    errno = xerrno;
+    return NULL;
+  }
+
+  addr = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  xerrno = errno;
+  (void) close(fd);
+
+  if (addr == MAP_FAILED) {
+    pr_trace_msg(trace_channel, 1, "error mapping '%s': %s", path,
+      strerror(xerrno));
+    errno = xerrno;
+    return NULL;
+  }
+
+  shm_pool = make_sub_pool(p);
+  pr_pool_tag(shm_pool, "Prometheus shared memory metrics pool");
+
+  shm = pcalloc(shm_pool, sizeof(struct prom_metric_shm));
+  shm->pool = shm_pool;
+  shm->path = pstrdup(shm_pool, path);
+  shm->addr = addr;
+  shm->len = len;
+  shm->hdr = addr;
+  shm->slots = (struct shm_slot *) (((char *) addr) +
+    sizeof(struct shm_header));
+
+  /* The file is freshly created, thus already zero-filled, i.e. all slots
+   * are empty.
+   */
+  shm->hdr->magic = PROM_METRIC_SHM_MAGIC;
+  shm->hdr->version = PROM_METRIC_SHM_VERSION;
+  shm->hdr->nslots = max_samples;
+  shm->hdr->nsamples = 0;
+
+  pr_trace_msg(trace_channel, 9,
+    "created '%s' (%lu bytes) for %u samples", path, (unsigned long) len,
+    max_samples);
+  return shm;
+#else
+  errno = ENOSYS;
+  return NULL;
+#endif /* HAVE_ATOMIC_BUILTINS */
+}
@@ -0,0 +1,129 @@
+/*
+ * ProFTPD - mod_prometheus metrics quantile sketch implementation
+ * Copyright (c) 2021-2023 TJ Saunders
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+#include "mod_prometheus.h"
+#include "prometheus/metric/sketch.h"
+
+#include <math.h>
+
+/* The bins grow by a factor of gamma; a bin's representative value is then
+ * within the relative accuracy of every value in that bin.
+ */
+static double sketch_log_gamma = 0.0;
+static int sketch_min_key = 0;
+static int sketch_max_key = 0;
+
+static void sketch_init(void) {
+  double gamma;
+
+  if (sketch_log_gamma > 0.0) {
+    return;
+  }
+
+  gamma = (1.0 + PROM_SKETCH_RELATIVE_ACCURACY) /
+    (1.0 - PROM_SKETCH_RELATIVE_ACCURACY);
+  sketch_log_gamma = log(gamma);
+
+  /* The lowest key is reserved for the values at or below the minimum. */
+  sketch_min_key = (int) ceil(log(PROM_SKETCH_MIN_VALUE) /
+    sketch_log_gamma) - 1;
+  sketch_max_key = (int) ceil(log(PROM_SKETCH_MAX_VALUE) / sketch_log_gamma);
+}
+
+int prom_sketch_key(double val) {
+  sketch_init();
+
+  /* Note that NaN fails this comparison, too. */
+  if (!(val > PROM_SKETCH_MIN_VALUE)) {
+    return sketch_min_key;
+  }
+
+  if (val >= PROM_SKETCH_MAX_VALUE) {
+    return sketch_max_key;
+  }
+
+  return (int) ceil(log(val) / sketch_log_gamma);
+}
+
+double prom_sketch_value(int key) {
+  sketch_init();
+
+  if (key <= sketch_min_key) {
+    return 0.0;
+  }
+
+  if (key > sketch_max_key) {
+    key = sketch_max_key;
+  }
+
+  /* The bin covers (gamma^(key-1), gamma^key]; this value is equally
+   * (relatively) distant from both ends.
+   */
+  return 2.0 * exp(key * sketch_log_gamma) / (1.0 + exp(sketch_log_gamma));
+}
+
+unsigned int prom_sketch_max_bins(void) {
+  sketch_init();
+  return (unsigned int) (sketch_max_key - sketch_min_key + 1);
+}
+
+int prom_sketch_quantile(const struct prom_sketch_bin *bins,
+    unsigned int bin_count, double quantile, double *val) {
+  register unsigned int i;
+  double total = 0.0, rank, count = 0.0;
+
+  if (bins == NULL ||
+      val == NULL ||
+      quantile < 0.0 ||
+      quantile > 1.0) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  for (i = 0; i < bin_count; i++) {
+    total += bins[i].count;
+  }
+
+  if (total <= 0.0) {
+    errno = ENOENT;
+    return -1;
+  }
+
+  /* The (zero-based) rank of the value at this quantile. */
+  rank = quantile * (total - 1.0);
+
+  for (i = 0; i < bin_count; i++) {
+    count += bins[i].count;
+    if (count > rank) {
+      break;
+    }
+  }
+
+  if (i == bin_count) {
+    i = bin_count - 1;
+  }
+
+  *val = prom_sketch_value(bins[i].key);
+  return 0;
+}
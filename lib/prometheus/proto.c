@@ -0,0 +1,267 @@
+/*
+ * ProFTPD - mod_prometheus protobuf encoding implementation
+ * Copyright (c) 2021 TJ Saunders
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+#include "mod_prometheus.h"
+#include "prometheus/proto.h"
+
+struct prom_proto {
+  pool *pool;
+  unsigned char *buf;
+  size_t buflen, bufsz;
+};
+
+#define PROM_PROTO_DEFAULT_BUFFER_SIZE	256
+
+/* Wire types. */
+#define PROM_PROTO_WIRE_VARINT		0
+#define PROM_PROTO_WIRE_FIXED64		1
+#define PROM_PROTO_WIRE_LEN		2
+
+/* The longest varint, for a 64-bit value. */
+#define PROM_PROTO_MAX_VARINT_LEN	10
+
+static void ensure_proto_size(struct prom_proto *proto, size_t len) {
+  unsigned char *buf;
+  size_t bufsz;
+
+  if (proto->buflen + len <= proto->bufsz) {
+    return;
+  }
+
+  bufsz = proto->bufsz * 2;
+  while (bufsz < proto->buflen + len) {
+    bufsz *= 2;
+  }
+
+  buf = palloc(proto->pool, bufsz);
+  if (proto->buflen > 0) {
+    memcpy(buf, proto->buf, proto->buflen);
+  }
+
+  proto->buf = buf;
+  proto->bufsz = bufsz;
+}
+
+static void add_raw_varint(struct prom_proto *proto, uint64_t val) {
+  ensure_proto_size(proto, PROM_PROTO_MAX_VARINT_LEN);
+
+  while (val >= 0x80) {
+    proto->buf[proto->buflen++] = (unsigned char) ((val & 0x7f) | 0x80);
+    val >>= 7;
+  }
+
+  proto->buf[proto->buflen++] = (unsigned char) val;
+}
+
+static void add_tag(struct prom_proto *proto, unsigned int field,
+    unsigned int wire_type) {
+  add_raw_varint(proto, ((uint64_t) field << 3) | wire_type);
+}
+
+static void add_raw_bytes(struct prom_proto *proto, const void *data,
+    size_t len) {
+  if (len == 0) {
+    return;
+  }
+
+  ensure_proto_size(proto, len);
+  memcpy(proto->buf + proto->buflen, data, len);
+  proto->buflen += len;
+}
+
+static uint64_t zigzag(int64_t val) {
+  return ((uint64_t) val << 1) ^ (uint64_t) (val >> 63);
+}
+
+int prom_proto_add_varint(struct prom_proto *proto, unsigned int field,
+    uint64_t val) {
+  if (proto == NULL ||
+      field == 0) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  add_tag(proto, field, PROM_PROTO_WIRE_VARINT);
+  add_raw_varint(proto, val);
+  return 0;
+}
+
+int prom_proto_add_sint(struct prom_proto *proto, unsigned int field,
+    int64_t val) {
+  return prom_proto_add_varint(proto, field, zigzag(val));
+}
+
+int prom_proto_add_double(struct prom_proto *proto, unsigned int field,
+    double val) {
+  register unsigned int i;
+  unsigned char data[8];
+  uint64_t bits;
+
+  if (proto == NULL ||
+      field == 0) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  /* Doubles are encoded as little-endian, regardless of the host. */
+  memcpy(&bits, &val, sizeof(bits));
+  for (i = 0; i < 8; i++) {
+    data[i] = (unsigned char) (bits >> (i * 8));
+  }
+
+  add_tag(proto, field, PROM_PROTO_WIRE_FIXED64);
+  add_raw_bytes(proto, data, sizeof(data));
+  return 0;
+}
+
+int prom_proto_add_str(struct prom_proto *proto, unsigned int field,
+    const char *str, size_t len) {
+  if (proto == NULL ||
+      field == 0 ||
+      (str == NULL && len > 0)) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  add_tag(proto, field, PROM_PROTO_WIRE_LEN);
+  add_raw_varint(proto, len);
+  add_raw_bytes(proto, str, len);
+  return 0;
+}
+
+int prom_proto_add_packed_sint(struct prom_proto *proto, unsigned int field,
+    const int64_t *vals, unsigned int count) {
+  register unsigned int i;
+  size_t len = 0;
+
+  if (proto == NULL ||
+      field == 0 ||
+      (vals == NULL && count > 0)) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (count == 0) {
+    return 0;
+  }
+
+  /* The length of the packed values is needed up front. */
+  for (i = 0; i < count; i++) {
+    uint64_t val;
+
+    val = zigzag(vals[i]);
+    len++;
+    while (val >= 0x80) {
+      len++;
+      val >>= 7;
+    }
+  }
+
+  add_tag(proto, field, PROM_PROTO_WIRE_LEN);
+  add_raw_varint(proto, len);
+  for (i = 0; i < count; i++) {
+    add_raw_varint(proto, zigzag(vals[i]));
+  }
+
+  return 0;
+}
+
+int prom_proto_add_msg(struct prom_proto *proto, unsigned int field,
+    const struct prom_proto *msg) {
+  if (proto == NULL ||
+      field == 0 ||
+      msg == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  add_tag(proto, field, PROM_PROTO_WIRE_LEN);
+  add_raw_varint(proto, msg->buflen);
+  add_raw_bytes(proto, msg->buf, msg->buflen);
+  return 0;
+}
+
+int prom_proto_add_delimited(struct prom_proto *proto,
+    const struct prom_proto *msg) {
+  if (proto == NULL ||
+      msg == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  add_raw_varint(proto, msg->buflen);
+  add_raw_bytes(proto, msg->buf, msg->buflen);
+  return 0;
+}
+
+const char *prom_proto_get_buf(struct prom_proto *proto, size_t *len) {
+  if (proto == NULL ||
+      len == NULL) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  *len = proto->buflen;
+  return (const char *) proto->buf;
+}
+
+int prom_proto_reset(struct prom_proto *proto) {
+  if (proto == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  proto->buflen = 0;
+  return 0;
+}
+
+struct prom_proto *prom_proto_create(pool *p) {
+  pool *proto_pool;
+  struct prom_proto *proto;
+
+  if (p == NULL) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  proto_pool = make_sub_pool(p);
+  pr_pool_tag(proto_pool, "Prometheus protobuf pool");
+
+  proto = pcalloc(proto_pool, sizeof(struct prom_proto));
+  proto->pool = proto_pool;
+  proto->bufsz = PROM_PROTO_DEFAULT_BUFFER_SIZE;
+  proto->buf = palloc(proto_pool, proto->bufsz);
+
+  return proto;
+}
+
+int prom_proto_destroy(struct prom_proto *proto) {
+  if (proto == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  destroy_pool(proto->pool);
+  return 0;
+}
@@ -0,0 +1,595 @@
+/*
+ * ProFTPD - mod_prometheus recorder API
+ * Copyright (c) 2021-2023 TJ Saunders
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+#include "mod_prometheus.h"
+#include "prometheus/recorder.h"
+
+/* A trace consists of a header, followed by records, each starting with
+ * its type byte.  All integers and doubles are in host byte order; strings
+ * are prefixed by their 16-bit length, with PROM_RECORDER_NULL_LEN for NULL.
+ *
+ *  metric:       type, u16 handle, u32 length, definition
+ *  update:       type, u64 timestamp, u16 handle, u8 op, f64 value,
+ *                u8 count, count strings
+ *  base labels:  type, u64 timestamp, u8 count, count (name, value) strings
+ */
+
+#define PROM_RECORDER_MAGIC		0x50524f52
+#define PROM_RECORDER_VERSION		1
+
+#define PROM_RECORDER_NULL_LEN		0xffff
+#define PROM_RECORDER_MAX_STRING_LEN	(PROM_RECORDER_NULL_LEN - 1)
+#define PROM_RECORDER_MAX_DEFINITION_LEN	(64 * 1024)
+
+#define PROM_RECORDER_BUFSZ		8192
+
+struct recorder_header {
+  uint32_t magic;
+  uint32_t version;
+};
+
+struct prom_recorder {
+  pool *pool;
+  int fd;
+
+  char *buf;
+  size_t bufsz, buflen;
+
+  /* Whether the definition of each metric handle has been recorded. */
+  unsigned char defined[PROM_RECORDER_MAX_HANDLES];
+};
+
+struct prom_recorder_reader {
+  pool *pool;
+  pool *record_pool;
+  FILE *fh;
+};
+
+static const char *trace_channel = "prometheus.recorder";
+
+static uint64_t recorder_now_usecs(void) {
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return ((uint64_t) tv.tv_sec * 1000000) + tv.tv_usec;
+}
+
+static int recorder_write(int fd, const char *buf, size_t buflen) {
+  while (buflen > 0) {
+    ssize_t res;
+
+    res = write(fd, buf, buflen);
+    if (res < 0) {
+      if (errno == EINTR) {
+        pr_signals_handle();
+        continue;
+      }
+
+      return -1;
+    }
+
+    buf += res;
+    buflen -= res;
+  }
+
+  return 0;
+}
+
+int prom_recorder_flush(struct prom_recorder *recorder) {
+  if (recorder == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (recorder->buflen == 0) {
+    return 0;
+  }
+
+  if (recorder_write(recorder->fd, recorder->buf, recorder->buflen) < 0) {
+    int xerrno = errno;
+
+    pr_trace_msg(trace_channel, 3, "error writing %lu bytes of trace: %s",
+      (unsigned long) recorder->buflen, strerror(xerrno));
+
+    /* Drop the buffered records, rather than retrying them forever. */
+    recorder->buflen = 0;
+
+    errno = xerrno;
+    return -1;
+  }
+
+  recorder->buflen = 0;
+  return 0;
+}
+
+/* Ensures room in the buffer for a record of the given length, flushing the
+ * buffered records, or growing the buffer for a large record, as needed.
+ */
+static char *recorder_reserve(struct prom_recorder *recorder, size_t len) {
+  if (recorder->buflen + len > recorder->bufsz) {
+    if (prom_recorder_flush(recorder) < 0) {
+      return NULL;
+    }
+
+    if (len > recorder->bufsz) {
+      recorder->bufsz = len;
+      recorder->buf = palloc(recorder->pool, recorder->bufsz);
+    }
+  }
+
+  return recorder->buf + recorder->buflen;
+}
+
+static char *put_bytes(char *ptr, const void *data, size_t len) {
+  memcpy(ptr, data, len);
+  return ptr + len;
+}
+
+static char *put_u8(char *ptr, uint8_t val) {
+  *ptr = (char) val;
+  return ptr + 1;
+}
+
+static char *put_u16(char *ptr, uint16_t val) {
+  return put_bytes(ptr, &val, sizeof(val));
+}
+
+static char *put_string(char *ptr, const char *text, size_t len) {
+  if (text == NULL) {
+    return put_u16(ptr, PROM_RECORDER_NULL_LEN);
+  }
+
+  ptr = put_u16(ptr, (uint16_t) len);
+  return put_bytes(ptr, text, len);
+}
+
+static size_t string_len(const char *text) {
+  size_t len;
+
+  if (text == NULL) {
+    return 0;
+  }
+
+  len = strlen(text);
+  if (len > PROM_RECORDER_MAX_STRING_LEN) {
+    len = PROM_RECORDER_MAX_STRING_LEN;
+  }
+
+  return len;
+}
+
+static int recorder_add_metric(struct prom_recorder *recorder,
+    unsigned int handle, const struct prom_metric *metric) {
+  pool *tmp_pool;
+  const char *def;
+  uint16_t handle16;
+  uint32_t deflen;
+  char *ptr;
+
+  tmp_pool = make_sub_pool(recorder->pool);
+  def = prom_metric_get_definition(tmp_pool, metric);
+  if (def == NULL) {
+    int xerrno = errno;
+
+    destroy_pool(tmp_pool);
+    errno = xerrno;
+    return -1;
+  }
+
+  deflen = (uint32_t) strlen(def);
+  ptr = recorder_reserve(recorder, 1 + sizeof(handle16) + sizeof(deflen) +
+    deflen);
+  if (ptr == NULL) {
+    int xerrno = errno;
+
+    destroy_pool(tmp_pool);
+    errno = xerrno;
+    return -1;
+  }
+
+  handle16 = (uint16_t) handle;
+  ptr = put_u8(ptr, PROM_RECORDER_RECORD_METRIC);
+  ptr = put_u16(ptr, handle16);
+  ptr = put_bytes(ptr, &deflen, sizeof(deflen));
+  ptr = put_bytes(ptr, def, deflen);
+  recorder->buflen = ptr - recorder->buf;
+
+  destroy_pool(tmp_pool);
+  recorder->defined[handle] = TRUE;
+  return 0;
+}
+
+int prom_recorder_add_update(struct prom_recorder *recorder,
+    unsigned int handle, const struct prom_metric *metric, int op, double val,
+    const char **values, unsigned int nvalues) {
+  register unsigned int i;
+  uint64_t now;
+  size_t len;
+  char *ptr;
+
+  if (recorder == NULL ||
+      metric == NULL ||
+      handle >= PROM_RECORDER_MAX_HANDLES ||
+      op < PROM_RECORDER_OP_DECR ||
+      op > PROM_RECORDER_OP_OBSERVE ||
+      nvalues > PROM_RECORDER_MAX_VALUES ||
+      (values == NULL && nvalues > 0)) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (recorder->defined[handle] == FALSE) {
+    if (recorder_add_metric(recorder, handle, metric) < 0) {
+      return -1;
+    }
+  }
+
+  len = 1 + sizeof(now) + sizeof(uint16_t) + 1 + sizeof(val) + 1;
+  for (i = 0; i < nvalues; i++) {
+    len += sizeof(uint16_t) + string_len(values[i]);
+  }
+
+  ptr = recorder_reserve(recorder, len);
+  if (ptr == NULL) {
+    return -1;
+  }
+
+  now = recorder_now_usecs();
+  ptr = put_u8(ptr, PROM_RECORDER_RECORD_UPDATE);
+  ptr = put_bytes(ptr, &now, sizeof(now));
+  ptr = put_u16(ptr, (uint16_t) handle);
+  ptr = put_u8(ptr, (uint8_t) op);
+  ptr = put_bytes(ptr, &val, sizeof(val));
+  ptr = put_u8(ptr, (uint8_t) nvalues);
+
+  for (i = 0; i < nvalues; i++) {
+    ptr = put_string(ptr, values[i], string_len(values[i]));
+  }
+
+  recorder->buflen = ptr - recorder->buf;
+  return 0;
+}
+
+int prom_recorder_add_base_labels(struct prom_recorder *recorder,
+    pr_table_t *labels) {
+  register unsigned int i;
+  const void *key;
+  const char *texts[PROM_RECORDER_MAX_VALUES];
+  unsigned int ntexts = 0;
+  uint64_t now;
+  size_t len;
+  char *ptr;
+
+  if (recorder == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (labels != NULL) {
+    pr_table_rewind(labels);
+
+    key = pr_table_next(labels);
+    while (key != NULL) {
+      if (ntexts + 2 > PROM_RECORDER_MAX_VALUES) {
+        errno = EINVAL;
+        return -1;
+      }
+
+      texts[ntexts++] = key;
+      texts[ntexts++] = pr_table_get(labels, key, NULL);
+
+      key = pr_table_next(labels);
+    }
+  }
+
+  len = 1 + sizeof(now) + 1;
+  for (i = 0; i < ntexts; i++) {
+    len += sizeof(uint16_t) + string_len(texts[i]);
+  }
+
+  ptr = recorder_reserve(recorder, len);
+  if (ptr == NULL) {
+    return -1;
+  }
+
+  now = recorder_now_usecs();
+  ptr = put_u8(ptr, PROM_RECORDER_RECORD_BASE_LABELS);
+  ptr = put_bytes(ptr, &now, sizeof(now));
+  ptr = put_u8(ptr, (uint8_t) (ntexts / 2));
+
+  for (i = 0; i < ntexts; i++) {
+    ptr = put_string(ptr, texts[i], string_len(texts[i]));
+  }
+
+  recorder->buflen = ptr - recorder->buf;
+  return 0;
+}
+
+struct prom_recorder *prom_recorder_open(pool *p, const char *path) {
+  int fd, xerrno;
+  pool *recorder_pool;
+  struct prom_recorder *recorder;
+  struct stat st;
+
+  if (p == NULL ||
+      path == NULL) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  fd = open(path, O_WRONLY|O_CREAT|O_APPEND, 0600);
+  if (fd < 0) {
+    xerrno = errno;
+
+    pr_trace_msg(trace_channel, 3, "error opening trace '%s': %s", path,
+      strerror(xerrno));
+    errno = xerrno;
+    return NULL;
+  }
+
+  if (fstat(fd, &st) < 0) {
+    xerrno = errno;
+
+    (void) close(fd);
+    errno = xerrno;
+    return NULL;
+  }
+
+  if (st.st_size == 0) {
+    struct recorder_header hdr;
+
+    hdr.magic = PROM_RECORDER_MAGIC;
+    hdr.version = PROM_RECORDER_VERSION;
+
+    if (recorder_write(fd, (const char *) &hdr, sizeof(hdr)) < 0) {
+      xerrno = errno;
+
+      (void) close(fd);
+      errno = xerrno;
+      return NULL;
+    }
+  }
+
+  recorder_pool = make_sub_pool(p);
+  pr_pool_tag(recorder_pool, "Prometheus recorder pool");
+
+  recorder = pcalloc(recorder_pool, sizeof(struct prom_recorder));
+  recorder->pool = recorder_pool;
+  recorder->fd = fd;
+  recorder->bufsz = PROM_RECORDER_BUFSZ;
+  recorder->buf = palloc(recorder_pool, recorder->bufsz);
+
+  return recorder;
+}
+
+int prom_recorder_close(struct prom_recorder *recorder) {
+  int res, xerrno;
+
+  if (recorder == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  res = prom_recorder_flush(recorder);
+  xerrno = errno;
+
+  (void) close(recorder->fd);
+  destroy_pool(recorder->pool);
+
+  errno = xerrno;
+  return res;
+}
+
+struct prom_recorder_reader *prom_recorder_reader_open(pool *p,
+    const char *path) {
+  FILE *fh;
+  pool *reader_pool;
+  struct prom_recorder_reader *reader;
+  struct recorder_header hdr;
+
+  if (p == NULL ||
+      path == NULL) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  fh = fopen(path, "rb");
+  if (fh == NULL) {
+    return NULL;
+  }
+
+  if (fread(&hdr, sizeof(hdr), 1, fh) != 1 ||
+      hdr.magic != PROM_RECORDER_MAGIC ||
+      hdr.version != PROM_RECORDER_VERSION) {
+    pr_trace_msg(trace_channel, 3, "'%s' is not a supported trace", path);
+    (void) fclose(fh);
+    errno = EINVAL;
+    return NULL;
+  }
+
+  reader_pool = make_sub_pool(p);
+  pr_pool_tag(reader_pool, "Prometheus recorder reader pool");
+
+  reader = pcalloc(reader_pool, sizeof(struct prom_recorder_reader));
+  reader->pool = reader_pool;
+  reader->fh = fh;
+
+  return reader;
+}
+
+int prom_recorder_reader_close(struct prom_recorder_reader *reader) {
+  if (reader == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  (void) fclose(reader->fh);
+  destroy_pool(reader->pool);
+  return 0;
+}
+
+static int get_bytes(struct prom_recorder_reader *reader, void *data,
+    size_t len) {
+  if (len > 0 &&
+      fread(data, len, 1, reader->fh) != 1) {
+    pr_trace_msg(trace_channel, 3, "truncated trace record");
+    errno = EINVAL;
+    return -1;
+  }
+
+  return 0;
+}
+
+static int get_strings(struct prom_recorder_reader *reader,
+    const char **texts, unsigned int count) {
+  register unsigned int i;
+
+  for (i = 0; i < count; i++) {
+    uint16_t len;
+    char *text;
+
+    if (get_bytes(reader, &len, sizeof(len)) < 0) {
+      return -1;
+    }
+
+    if (len == PROM_RECORDER_NULL_LEN) {
+      texts[i] = NULL;
+      continue;
+    }
+
+    text = palloc(reader->record_pool, len + 1);
+    if (get_bytes(reader, text, len) < 0) {
+      return -1;
+    }
+
+    text[len] = '\0';
+    texts[i] = text;
+  }
+
+  return 0;
+}
+
+int prom_recorder_reader_next(struct prom_recorder_reader *reader,
+    struct prom_recorder_record *record) {
+  int type;
+  uint8_t op, count;
+  uint16_t handle;
+  uint32_t deflen;
+  char *def;
+
+  if (reader == NULL ||
+      record == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  type = fgetc(reader->fh);
+  if (type == EOF) {
+    if (ferror(reader->fh)) {
+      errno = EIO;
+      return -1;
+    }
+
+    return 0;
+  }
+
+  if (reader->record_pool != NULL) {
+    destroy_pool(reader->record_pool);
+  }
+  reader->record_pool = make_sub_pool(reader->pool);
+
+  memset(record, 0, sizeof(struct prom_recorder_record));
+  record->type = type;
+
+  switch (type) {
+    case PROM_RECORDER_RECORD_METRIC:
+      if (get_bytes(reader, &handle, sizeof(handle)) < 0 ||
+          get_bytes(reader, &deflen, sizeof(deflen)) < 0) {
+        return -1;
+      }
+
+      if (deflen > PROM_RECORDER_MAX_DEFINITION_LEN) {
+        errno = EINVAL;
+        return -1;
+      }
+
+      def = palloc(reader->record_pool, deflen + 1);
+      if (get_bytes(reader, def, deflen) < 0) {
+        return -1;
+      }
+
+      def[deflen] = '\0';
+      record->handle = handle;
+      record->definition = def;
+      break;
+
+    case PROM_RECORDER_RECORD_UPDATE:
+      if (get_bytes(reader, &(record->timestamp_usecs),
+            sizeof(record->timestamp_usecs)) < 0 ||
+          get_bytes(reader, &handle, sizeof(handle)) < 0 ||
+          get_bytes(reader, &op, sizeof(op)) < 0 ||
+          get_bytes(reader, &(record->value), sizeof(record->value)) < 0 ||
+          get_bytes(reader, &count, sizeof(count)) < 0) {
+        return -1;
+      }
+
+      if (count > PROM_RECORDER_MAX_VALUES) {
+        errno = EINVAL;
+        return -1;
+      }
+
+      record->handle = handle;
+      record->op = op;
+      record->nvalues = count;
+      if (get_strings(reader, record->values, count) < 0) {
+        return -1;
+      }
+      break;
+
+    case PROM_RECORDER_RECORD_BASE_LABELS:
+      if (get_bytes(reader, &(record->timestamp_usecs),
+            sizeof(record->timestamp_usecs)) < 0 ||
+          get_bytes(reader, &count, sizeof(count)) < 0) {
+        return -1;
+      }
+
+      if (count * 2 > PROM_RECORDER_MAX_VALUES) {
+        errno = EINVAL;
+        return -1;
+      }
+
+      record->nvalues = count * 2;
+      if (get_strings(reader, record->values, record->nvalues) < 0) {
+        return -1;
+      }
+      break;
+
+    default:
+      pr_trace_msg(trace_channel, 3, "unknown trace record type %d", type);
+      errno = EINVAL;
+      return -1;
+  }
+
+  return 1;
+}
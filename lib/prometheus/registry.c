@@ -32,6 +32,18 @@ struct prom_registry {
   const char *name;
   pr_table_t *metrics;
 
+  /* Database handle, if any, used by all metrics. */
+  struct prom_dbh *dbh;
+
+  /* Shared memory datastore, if any, used by all metrics. */
+  struct prom_metric_shm *shm;
+
+  /* Write-behind buffer, if any, used by all metrics. */
+  struct prom_metric_buffer *buffer;
+
+  /* Buffer, if any, for updates deferred due to a busy database. */
+  struct prom_metric_buffer *deferred;
+
   /* Pool/list of sorted metric names, for scraping. */
   pool *sorted_pool;
   array_header *sorted_keys;
@@ -49,6 +61,18 @@ int prom_registry_add_metric(struct prom_registry *registry,
     return -1;
   }
 
+  if (registry->shm != NULL) {
+    (void) prom_metric_set_shm(metric, registry->shm);
+  }
+
+  if (registry->buffer != NULL) {
+    (void) prom_metric_set_buffer(metric, registry->buffer);
+  }
+
+  if (registry->deferred != NULL) {
+    (void) prom_metric_set_deferred(metric, registry->deferred);
+  }
+
   res = pr_table_add(registry->metrics, prom_metric_get_name(metric),
     metric, sizeof(void *));
   return res;
@@ -74,14 +98,31 @@ const char *prom_registry_get_name(struct prom_registry *registry) {
   return registry->name;
 }
 
-/* Returns the text for all metrics in the registry. */
-const char *prom_registry_get_text(pool *p, struct prom_registry *registry) {
-  pool *tmp_pool;
-  register unsigned int i;
-  struct prom_text *text;
-  int key_count;
+struct prom_registry_iter {
+  pool *pool;
+  struct prom_registry *registry;
+
+  /* Metric names, in scrape order, and the index of the next one. */
   array_header *keys;
-  char **elts, *str;
+  unsigned int next_idx;
+
+  /* Scan of the samples of all metrics, read as each metric is rendered,
+   * if any.
+   */
+  struct prom_metric_scan *scan;
+
+  /* Exposition format, e.g. PROM_REGISTRY_FORMAT_TEXT. */
+  int format;
+
+  /* Whether the terminating newline (or EOF marker) has been returned. */
+  int done;
+};
+
+struct prom_registry_iter *prom_registry_iter_open(pool *p,
+    struct prom_registry *registry) {
+  pool *iter_pool;
+  struct prom_registry_iter *iter;
+  int key_count;
 
   if (p == NULL ||
       registry == NULL) {
@@ -98,63 +139,334 @@ const char *prom_registry_get_text(pool *p, struct prom_registry *registry) {
     return NULL;
   }
 
-  tmp_pool = make_sub_pool(p);
-  text = prom_text_create(tmp_pool);
+  iter_pool = make_sub_pool(p);
+  pr_pool_tag(iter_pool, "Prometheus registry iterator pool");
+
+  iter = pcalloc(iter_pool, sizeof(struct prom_registry_iter));
+  iter->pool = iter_pool;
+  iter->registry = registry;
+  iter->format = PROM_REGISTRY_FORMAT_TEXT;
 
   if (registry->sorted_keys != NULL) {
-    keys = registry->sorted_keys;
+    iter->keys = registry->sorted_keys;
 
   } else {
-   const void *key;
+    const void *key;
 
-   keys = make_array(tmp_pool, key_count, sizeof(char *));
+    iter->keys = make_array(iter_pool, key_count, sizeof(char *));
 
-   pr_table_rewind(registry->metrics);
-   key = pr_table_next(registry->metrics);
+    pr_table_rewind(registry->metrics);
+    key = pr_table_next(registry->metrics);
     while (key != NULL) {
       pr_signals_handle();
 
       /* No need to duplicate this text; it's a pointer to an object we
        * already have in memory.
        */
-      *((char **) push_array(keys)) = (char *) key;
+      *((char **) push_array(iter->keys)) = (char *) key;
       key = pr_table_next(registry->metrics);
     }
   }
 
-  elts = keys->elts;
-  for (i = 0; i < keys->nelts; i++) {
-    pool *iter_pool;
+  /* When using the database, read all of the samples with a single query,
+   * rather than querying for each metric (and histogram bucket) in turn.
+   * The query is stepped through as each metric is rendered, so that only
+   * the samples of one metric are in memory at a time.  Any samples kept in
+   * shared memory are likewise read in a single pass.
+   */
+  if (registry->dbh != NULL) {
+    register unsigned int i;
+    array_header *metrics;
+    char **keys;
+
+    metrics = make_array(iter_pool, iter->keys->nelts,
+      sizeof(struct prom_metric *));
+    keys = iter->keys->elts;
+    for (i = 0; i < iter->keys->nelts; i++) {
+      *((const void **) push_array(metrics)) = pr_table_get(registry->metrics,
+        keys[i], NULL);
+    }
+
+    iter->scan = prom_metric_scan_open(iter_pool, registry->dbh, metrics);
+    if (iter->scan == NULL) {
+      pr_trace_msg(trace_channel, 7,
+        "error scanning samples for '%s' registry, querying per metric: %s",
+        registry->name, strerror(errno));
+    }
+  }
+
+  return iter;
+}
+
+const char *prom_registry_iter_next(pool *p, struct prom_registry_iter *iter,
+    size_t *textlen) {
+  char **elts;
+
+  if (p == NULL ||
+      iter == NULL ||
+      textlen == NULL) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  elts = iter->keys->elts;
+  while (iter->next_idx < iter->keys->nelts) {
     struct prom_metric *metric;
-    const char *metric_text;
-    size_t metric_textlen;
+    const char *metric_name, *metric_text;
+    pr_table_t *samples = NULL;
 
-    pr_trace_msg(trace_channel, 19, "getting text for '%s' metric", elts[i]);
-    metric = (struct prom_metric *) pr_table_get(registry->metrics, elts[i],
-      NULL);
+    pr_signals_handle();
 
-    iter_pool = make_sub_pool(tmp_pool);
-    metric_text = prom_metric_get_text(iter_pool, metric, registry->name,
-      &metric_textlen);
-    if (metric_text != NULL) {
-      prom_text_add_str(text, pstrdup(tmp_pool, metric_text), metric_textlen);
+    metric_name = elts[iter->next_idx++];
+    pr_trace_msg(trace_channel, 19, "getting text for '%s' metric",
+      metric_name);
+    metric = (struct prom_metric *) pr_table_get(iter->registry->metrics,
+      metric_name, NULL);
+
+    if (iter->scan != NULL) {
+      samples = prom_metric_scan_next(p, iter->scan);
+      if (samples == NULL) {
+        pr_trace_msg(trace_channel, 7,
+          "error scanning samples for '%s' metric, querying per metric: %s",
+          metric_name, strerror(errno));
+        (void) prom_metric_scan_close(iter->scan);
+        iter->scan = NULL;
+      }
+    }
+
+    if (iter->format == PROM_REGISTRY_FORMAT_PROTOBUF) {
+      if (samples != NULL) {
+        metric_text = prom_metric_get_proto_with_samples(p, metric,
+          iter->registry->name, samples, textlen);
+
+      } else {
+        metric_text = prom_metric_get_proto(p, metric, iter->registry->name,
+          textlen);
+      }
+
+    } else if (iter->format == PROM_REGISTRY_FORMAT_OPENMETRICS) {
+      if (samples != NULL) {
+        metric_text = prom_metric_get_openmetrics_with_samples(p, metric,
+          iter->registry->name, samples, textlen);
+
+      } else {
+        metric_text = prom_metric_get_openmetrics(p, metric,
+          iter->registry->name, textlen);
+      }
+
+    } else if (samples != NULL) {
+      metric_text = prom_metric_get_text_with_samples(p, metric,
+        iter->registry->name, samples, textlen);
 
     } else {
-      pr_trace_msg(trace_channel, 7, "error getting '%s' metric text: %s",
-        elts[i], strerror(errno));
+      metric_text = prom_metric_get_text(p, metric, iter->registry->name,
+        textlen);
+    }
+
+    if (metric_text != NULL) {
+      return metric_text;
+    }
+
+    pr_trace_msg(trace_channel, 7, "error getting '%s' metric text: %s",
+      metric_name, strerror(errno));
+  }
+
+  if (iter->done == FALSE &&
+      iter->format == PROM_REGISTRY_FORMAT_TEXT) {
+    iter->done = TRUE;
+    *textlen = 1;
+    return pstrdup(p, "\n");
+  }
+
+  /* OpenMetrics requires that the exposition end with an EOF marker. */
+  if (iter->done == FALSE &&
+      iter->format == PROM_REGISTRY_FORMAT_OPENMETRICS) {
+    iter->done = TRUE;
+    *textlen = 6;
+    return pstrdup(p, "# EOF\n");
+  }
+
+  errno = ENOENT;
+  return NULL;
+}
+
+int prom_registry_iter_set_format(struct prom_registry_iter *iter,
+    int format) {
+  if (iter == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  switch (format) {
+    case PROM_REGISTRY_FORMAT_TEXT:
+    case PROM_REGISTRY_FORMAT_PROTOBUF:
+    case PROM_REGISTRY_FORMAT_OPENMETRICS:
+      iter->format = format;
+      break;
+
+    default:
+      errno = EINVAL;
+      return -1;
+  }
+
+  return 0;
+}
+
+int prom_registry_iter_close(struct prom_registry_iter *iter) {
+  if (iter == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (iter->scan != NULL) {
+    (void) prom_metric_scan_close(iter->scan);
+    iter->scan = NULL;
+  }
+
+  destroy_pool(iter->pool);
+  return 0;
+}
+
+/* Returns the text for all metrics in the registry. */
+static const char *registry_get_text(pool *p,
+    struct prom_registry *registry, int format) {
+  pool *tmp_pool;
+  struct prom_registry_iter *iter;
+  struct prom_text *text;
+  const char *str;
+
+  if (p == NULL ||
+      registry == NULL) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  tmp_pool = make_sub_pool(p);
+
+  iter = prom_registry_iter_open(tmp_pool, registry);
+  if (iter == NULL) {
+    int xerrno = errno;
+
+    destroy_pool(tmp_pool);
+    errno = xerrno;
+    return NULL;
+  }
+
+  if (format != PROM_REGISTRY_FORMAT_TEXT) {
+    (void) prom_registry_iter_set_format(iter, format);
+  }
+
+  text = prom_text_create(p);
+
+  while (TRUE) {
+    pool *iter_pool;
+    const char *metric_text;
+    size_t metric_textlen = 0;
+
+    iter_pool = make_sub_pool(tmp_pool);
+    metric_text = prom_registry_iter_next(iter_pool, iter, &metric_textlen);
+    if (metric_text == NULL) {
+      destroy_pool(iter_pool);
+      break;
     }
 
+    prom_text_add_str(text, metric_text, metric_textlen);
     destroy_pool(iter_pool);
   }
 
-  prom_text_add_byte(text, '\n');
-  str = prom_text_get_str(p, text, NULL);
+  (void) prom_registry_iter_close(iter);
+
+  /* The text is allocated from the caller's pool; return it as is. */
+  str = prom_text_get_buf(text, NULL);
+  if (str == NULL) {
+    prom_text_destroy(text);
+  }
 
-  prom_text_destroy(text);
   destroy_pool(tmp_pool);
   return str;
 }
 
+const char *prom_registry_get_text(pool *p, struct prom_registry *registry) {
+  return registry_get_text(p, registry, PROM_REGISTRY_FORMAT_TEXT);
+}
+
+const char *prom_registry_get_openmetrics(pool *p,
+    struct prom_registry *registry) {
+  return registry_get_text(p, registry, PROM_REGISTRY_FORMAT_OPENMETRICS);
+}
+
+struct registry_chunk {
+  const char *data;
+  size_t datalen;
+};
+
+/* Returns the protobuf exposition for all metrics in the registry. */
+const char *prom_registry_get_proto(pool *p, struct prom_registry *registry,
+    size_t *len) {
+  register unsigned int i;
+  pool *tmp_pool;
+  struct prom_registry_iter *iter;
+  array_header *chunks;
+  size_t total_len = 0;
+  char *buf, *ptr;
+
+  if (p == NULL ||
+      registry == NULL ||
+      len == NULL) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  tmp_pool = make_sub_pool(p);
+
+  iter = prom_registry_iter_open(tmp_pool, registry);
+  if (iter == NULL) {
+    int xerrno = errno;
+
+    destroy_pool(tmp_pool);
+    errno = xerrno;
+    return NULL;
+  }
+
+  (void) prom_registry_iter_set_format(iter, PROM_REGISTRY_FORMAT_PROTOBUF);
+
+  /* The messages are binary; collect them, then copy them out at once. */
+  chunks = make_array(tmp_pool, 0, sizeof(struct registry_chunk));
+  while (TRUE) {
+    const char *data;
+    size_t datalen = 0;
+    struct registry_chunk *chunk;
+
+    pr_signals_handle();
+
+    data = prom_registry_iter_next(tmp_pool, iter, &datalen);
+    if (data == NULL) {
+      break;
+    }
+
+    chunk = push_array(chunks);
+    chunk->data = data;
+    chunk->datalen = datalen;
+    total_len += datalen;
+  }
+
+  (void) prom_registry_iter_close(iter);
+
+  buf = ptr = palloc(p, total_len + 1);
+  for (i = 0; i < chunks->nelts; i++) {
+    struct registry_chunk *chunk;
+
+    chunk = ((struct registry_chunk *) chunks->elts) + i;
+    memcpy(ptr, chunk->data, chunk->datalen);
+    ptr += chunk->datalen;
+  }
+
+  *len = total_len;
+
+  destroy_pool(tmp_pool);
+  return buf;
+}
+
 static int metric_set_dbh_cb(const void *key_data, size_t key_datasz,
     const void *value_data, size_t value_datasz, void *user_data) {
   int res;
@@ -183,6 +495,8 @@ int prom_registry_set_dbh(struct prom_registry *registry,
     return -1;
   }
 
+  registry->dbh = dbh;
+
   res = pr_table_do(registry->metrics, metric_set_dbh_cb, dbh,
     PR_TABLE_DO_FL_ALL);
   xerrno = errno;
@@ -195,6 +509,163 @@ int prom_registry_set_dbh(struct prom_registry *registry,
   return res;
 }
 
+int prom_registry_get_data_version(pool *p, struct prom_registry *registry,
+    int64_t *version) {
+  int res;
+  uint32_t counter = 0;
+
+  if (p == NULL ||
+      registry == NULL ||
+      version == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  /* Shared memory updates do not involve the database; nor can we tell when
+   * a registry without a database handle has changed.
+   */
+  if (registry->shm != NULL ||
+      registry->dbh == NULL) {
+    errno = ENOSYS;
+    return -1;
+  }
+
+  /* We use the database change counter, rather than SQLite's data version,
+   * as the latter differs for every connection; exporter workers, each with
+   * their own connection, must agree on the version for their ETags.
+   */
+  res = prom_db_get_change_counter(p, registry->dbh, &counter);
+  if (res < 0) {
+    return -1;
+  }
+
+  *version = (int64_t) counter;
+  return 0;
+}
+
+static int metric_set_shm_cb(const void *key_data, size_t key_datasz,
+    const void *value_data, size_t value_datasz, void *user_data) {
+  int res;
+  struct prom_metric *metric;
+  struct prom_metric_shm *shm;
+
+  metric = (struct prom_metric *) value_data;
+  shm = user_data;
+
+  res = prom_metric_set_shm(metric, shm);
+  if (res < 0) {
+    pr_trace_msg(trace_channel, 7, "error setting metric shm: %s",
+      strerror(errno));
+  }
+
+  return 0;
+}
+
+int prom_registry_set_shm(struct prom_registry *registry,
+    struct prom_metric_shm *shm) {
+  int res, xerrno;
+
+  if (registry == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  registry->shm = shm;
+
+  res = pr_table_do(registry->metrics, metric_set_shm_cb, shm,
+    PR_TABLE_DO_FL_ALL);
+  xerrno = errno;
+  if (res < 0) {
+    pr_trace_msg(trace_channel, 3, "error doing registry metrics table: %s",
+      strerror(xerrno));
+  }
+
+  errno = xerrno;
+  return res;
+}
+
+static int metric_set_buffer_cb(const void *key_data, size_t key_datasz,
+    const void *value_data, size_t value_datasz, void *user_data) {
+  int res;
+  struct prom_metric *metric;
+  struct prom_metric_buffer *buffer;
+
+  metric = (struct prom_metric *) value_data;
+  buffer = user_data;
+
+  res = prom_metric_set_buffer(metric, buffer);
+  if (res < 0) {
+    pr_trace_msg(trace_channel, 7, "error setting metric buffer: %s",
+      strerror(errno));
+  }
+
+  return 0;
+}
+
+int prom_registry_set_buffer(struct prom_registry *registry,
+    struct prom_metric_buffer *buffer) {
+  int res, xerrno;
+
+  if (registry == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  registry->buffer = buffer;
+
+  res = pr_table_do(registry->metrics, metric_set_buffer_cb, buffer,
+    PR_TABLE_DO_FL_ALL);
+  xerrno = errno;
+  if (res < 0) {
+    pr_trace_msg(trace_channel, 3, "error doing registry metrics table: %s",
+      strerror(xerrno));
+  }
+
+  errno = xerrno;
+  return res;
+}
+
+static int metric_set_deferred_cb(const void *key_data, size_t key_datasz,
+    const void *value_data, size_t value_datasz, void *user_data) {
+  int res;
+  struct prom_metric *metric;
+  struct prom_metric_buffer *buffer;
+
+  metric = (struct prom_metric *) value_data;
+  buffer = user_data;
+
+  res = prom_metric_set_deferred(metric, buffer);
+  if (res < 0) {
+    pr_trace_msg(trace_channel, 7, "error setting metric deferred buffer: %s",
+      strerror(errno));
+  }
+
+  return 0;
+}
+
+int prom_registry_set_deferred(struct prom_registry *registry,
+    struct prom_metric_buffer *buffer) {
+  int res, xerrno;
+
+  if (registry == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  registry->deferred = buffer;
+
+  res = pr_table_do(registry->metrics, metric_set_deferred_cb, buffer,
+    PR_TABLE_DO_FL_ALL);
+  xerrno = errno;
+  if (res < 0) {
+    pr_trace_msg(trace_channel, 3, "error doing registry metrics table: %s",
+      strerror(xerrno));
+  }
+
+  errno = xerrno;
+  return res;
+}
+
 static int metric_keycmp(const void *a, const void *b) {
   return strcmp(*((char **) a), *((char **) b));
 }
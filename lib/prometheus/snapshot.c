@@ -0,0 +1,591 @@
+/*
+ * ProFTPD - mod_prometheus scrape snapshot implementation
+ * Copyright (c) 2021-2023 TJ Saunders
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+
+#include "mod_prometheus.h"
+#include "prometheus/snapshot.h"
+#include "prometheus/proto.h"
+
+#include <sched.h>
+#include <sys/mman.h>
+
+/* Snapshots are passed from the renderer process to the exporter processes
+ * via a file mmap'd before they are forked.  It consists of a small header,
+ * followed by two slots; the renderer writes each new snapshot into the slot
+ * not currently published, then publishes it.  Each slot has a sequence
+ * number, odd while the slot is being written, so that readers can detect
+ * (and retry) copies which overlapped a write.  A slot holds the text, then
+ * optionally the protobuf encoding and OpenMetrics text of the same snapshot.
+ */
+
+#define PROM_SNAPSHOT_FILE_NAME		"metrics.snapshot"
+#define PROM_SNAPSHOT_MAGIC		0x50524f53
+#define PROM_SNAPSHOT_VERSION		3
+
+/* How many times a reader retries copying a snapshot overwritten while it
+ * was being copied.
+ */
+#define PROM_SNAPSHOT_MAX_READ_RETRIES	8
+
+struct snapshot_header {
+  uint32_t magic;
+  uint32_t version;
+
+  /* Index of the currently published slot. */
+  uint32_t current;
+  uint32_t padding;
+
+  /* Incremented for every published snapshot. */
+  uint64_t generation;
+};
+
+struct snapshot_slot {
+  uint64_t seq;
+  uint64_t generation;
+  uint64_t textlen;
+  uint64_t protolen;
+  uint64_t omlen;
+};
+
+/* The parts of a snapshot, in slot order. */
+#define SNAPSHOT_PART_TEXT		0
+#define SNAPSHOT_PART_PROTO		1
+#define SNAPSHOT_PART_OPENMETRICS	2
+
+struct prom_snapshot {
+  pool *pool;
+  const char *path;
+  void *addr;
+  size_t len;
+  size_t max_size;
+
+  struct snapshot_header *hdr;
+};
+
+static const char *trace_channel = "prometheus.snapshot";
+
+#if defined(HAVE_ATOMIC_BUILTINS)
+static struct snapshot_slot *snapshot_get_slot(struct prom_snapshot *snapshot,
+    uint32_t idx) {
+  char *ptr;
+
+  ptr = ((char *) snapshot->addr) + sizeof(struct snapshot_header);
+  ptr += idx * (sizeof(struct snapshot_slot) + snapshot->max_size);
+  return (struct snapshot_slot *) ptr;
+}
+
+static char *snapshot_slot_text(struct snapshot_slot *slot) {
+  return ((char *) slot) + sizeof(struct snapshot_slot);
+}
+#endif /* HAVE_ATOMIC_BUILTINS */
+
+int prom_snapshot_set_with_openmetrics(pool *p,
+    struct prom_snapshot *snapshot, const char *text, size_t textlen,
+    const char *proto, size_t protolen, const char *om, size_t omlen) {
+#if defined(HAVE_ATOMIC_BUILTINS)
+  uint32_t idx;
+  uint64_t generation;
+  struct snapshot_slot *slot;
+
+  if (p == NULL ||
+      snapshot == NULL ||
+      text == NULL ||
+      (proto == NULL && protolen > 0) ||
+      (om == NULL && omlen > 0)) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (textlen > snapshot->max_size ||
+      protolen > snapshot->max_size - textlen ||
+      omlen > snapshot->max_size - textlen - protolen) {
+    pr_trace_msg(trace_channel, 1,
+      "snapshot text (%lu bytes), protobuf (%lu bytes) and OpenMetrics "
+      "(%lu bytes) exceed maximum size (%lu bytes)", (unsigned long) textlen,
+      (unsigned long) protolen, (unsigned long) omlen,
+      (unsigned long) snapshot->max_size);
+    errno = E2BIG;
+    return -1;
+  }
+
+  idx = __atomic_load_n(&(snapshot->hdr->current), __ATOMIC_ACQUIRE) ^ 1;
+  slot = snapshot_get_slot(snapshot, idx);
+  generation = __atomic_load_n(&(snapshot->hdr->generation),
+    __ATOMIC_ACQUIRE) + 1;
+
+  /* Mark the slot as being written (odd sequence number), and make sure that
+   * is visible before any of the new text.
+   */
+  __atomic_add_fetch(&(slot->seq), 1, __ATOMIC_ACQ_REL);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+  memcpy(snapshot_slot_text(slot), text, textlen);
+  if (protolen > 0) {
+    memcpy(snapshot_slot_text(slot) + textlen, proto, protolen);
+  }
+
+  if (omlen > 0) {
+    memcpy(snapshot_slot_text(slot) + textlen + protolen, om, omlen);
+  }
+
+  slot->textlen = textlen;
+  slot->protolen = protolen;
+  slot->omlen = omlen;
+  slot->generation = generation;
+
+  __atomic_add_fetch(&(slot->seq), 1, __ATOMIC_RELEASE);
+
+  /* And now publish it. */
+  __atomic_store_n(&(snapshot->hdr->current), idx, __ATOMIC_RELEASE);
+  __atomic_store_n(&(snapshot->hdr->generation), generation,
+    __ATOMIC_RELEASE);
+
+  pr_trace_msg(trace_channel, 15,
+    "published snapshot generation %llu (%lu text bytes, %lu protobuf bytes, "
+    "%lu OpenMetrics bytes)", (unsigned long long) generation,
+    (unsigned long) textlen, (unsigned long) protolen, (unsigned long) omlen);
+  return 0;
+#else
+  errno = ENOSYS;
+  return -1;
+#endif /* HAVE_ATOMIC_BUILTINS */
+}
+
+int prom_snapshot_set_with_proto(pool *p, struct prom_snapshot *snapshot,
+    const char *text, size_t textlen, const char *proto, size_t protolen) {
+  return prom_snapshot_set_with_openmetrics(p, snapshot, text, textlen, proto,
+    protolen, NULL, 0);
+}
+
+int prom_snapshot_set(pool *p, struct prom_snapshot *snapshot,
+    const char *text, size_t textlen) {
+  return prom_snapshot_set_with_openmetrics(p, snapshot, text, textlen, NULL,
+    0, NULL, 0);
+}
+
+static const char *snapshot_get(pool *p, struct prom_snapshot *snapshot,
+    int part, size_t *datalen, uint64_t *generation) {
+#if defined(HAVE_ATOMIC_BUILTINS)
+  register unsigned int i;
+
+  if (p == NULL ||
+      snapshot == NULL ||
+      datalen == NULL) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  for (i = 0; i < PROM_SNAPSHOT_MAX_READ_RETRIES; i++) {
+    uint32_t idx;
+    uint64_t seq, slot_generation, offset, len, textlen, protolen, omlen;
+    struct snapshot_slot *slot;
+    char *text;
+
+    if (__atomic_load_n(&(snapshot->hdr->generation), __ATOMIC_ACQUIRE) == 0) {
+      errno = ENOENT;
+      return NULL;
+    }
+
+    idx = __atomic_load_n(&(snapshot->hdr->current), __ATOMIC_ACQUIRE);
+    slot = snapshot_get_slot(snapshot, idx);
+
+    seq = __atomic_load_n(&(slot->seq), __ATOMIC_ACQUIRE);
+    if (seq % 2 != 0) {
+      /* Being written; try again. */
+      sched_yield();
+      continue;
+    }
+
+    textlen = slot->textlen;
+    protolen = slot->protolen;
+    omlen = slot->omlen;
+    slot_generation = slot->generation;
+    if (textlen > snapshot->max_size ||
+        protolen > snapshot->max_size - textlen ||
+        omlen > snapshot->max_size - textlen - protolen) {
+      sched_yield();
+      continue;
+    }
+
+    switch (part) {
+      case SNAPSHOT_PART_PROTO:
+        offset = textlen;
+        len = protolen;
+        break;
+
+      case SNAPSHOT_PART_OPENMETRICS:
+        offset = textlen + protolen;
+        len = omlen;
+        break;
+
+      default:
+        offset = 0;
+        len = textlen;
+        break;
+    }
+
+    text = palloc(p, len + 1);
+    memcpy(text, snapshot_slot_text(slot) + offset, len);
+    text[len] = '\0';
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&(slot->seq), __ATOMIC_ACQUIRE) != seq) {
+      /* Overwritten while we were copying it; try again. */
+      pr_trace_msg(trace_channel, 17,
+        "snapshot changed while being copied, retrying");
+      continue;
+    }
+
+    if (part != SNAPSHOT_PART_TEXT &&
+        len == 0) {
+      /* This snapshot was published without this format. */
+      errno = ENOENT;
+      return NULL;
+    }
+
+    *datalen = len;
+    if (generation != NULL) {
+      *generation = slot_generation;
+    }
+
+    return text;
+  }
+
+  errno = EAGAIN;
+  return NULL;
+#else
+  errno = ENOSYS;
+  return NULL;
+#endif /* HAVE_ATOMIC_BUILTINS */
+}
+
+const char *prom_snapshot_get(pool *p, struct prom_snapshot *snapshot,
+    size_t *textlen, uint64_t *generation) {
+  return snapshot_get(p, snapshot, SNAPSHOT_PART_TEXT, textlen, generation);
+}
+
+const char *prom_snapshot_get_proto(pool *p, struct prom_snapshot *snapshot,
+    size_t *protolen, uint64_t *generation) {
+  return snapshot_get(p, snapshot, SNAPSHOT_PART_PROTO, protolen, generation);
+}
+
+const char *prom_snapshot_get_openmetrics(pool *p,
+    struct prom_snapshot *snapshot, size_t *omlen, uint64_t *generation) {
+  return snapshot_get(p, snapshot, SNAPSHOT_PART_OPENMETRICS, omlen,
+    generation);
+}
+
+int prom_snapshot_get_generation(struct prom_snapshot *snapshot,
+    uint64_t *generation) {
+#if defined(HAVE_ATOMIC_BUILTINS)
+  if (snapshot == NULL ||
+      generation == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  *generation = __atomic_load_n(&(snapshot->hdr->generation),
+    __ATOMIC_ACQUIRE);
+  return 0;
+#else
+  errno = ENOSYS;
+  return -1;
+#endif /* HAVE_ATOMIC_BUILTINS */
+}
+
+/* Returns the protobuf encoding of the registry, plus the gauge of the time
+ * at which it was rendered.
+ */
+static const char *snapshot_render_proto(pool *p,
+    struct prom_registry *registry, const char *registry_name,
+    struct timeval *tv, size_t *len) {
+  const char *proto, *stamp_proto;
+  char *snapshot_proto, *name;
+  size_t protolen = 0, stamp_protolen = 0;
+  struct prom_proto *stamp, *family, *metric, *value;
+
+  proto = prom_registry_get_proto(p, registry, &protolen);
+  if (proto == NULL) {
+    return NULL;
+  }
+
+  stamp = prom_proto_create(p);
+  family = prom_proto_create(p);
+  metric = prom_proto_create(p);
+  value = prom_proto_create(p);
+
+  name = pstrcat(p, registry_name, "_exporter_snapshot_timestamp_seconds",
+    NULL);
+
+  prom_proto_add_double(value, PROM_PROTO_VALUE, (double) tv->tv_sec +
+    ((double) (tv->tv_usec / 1000) / 1000.0));
+  prom_proto_add_msg(metric, PROM_PROTO_METRIC_GAUGE, value);
+
+  prom_proto_add_str(family, PROM_PROTO_FAMILY_NAME, name, strlen(name));
+  prom_proto_add_str(family, PROM_PROTO_FAMILY_HELP,
+    "Time at which these metrics were rendered.", 42);
+  prom_proto_add_varint(family, PROM_PROTO_FAMILY_TYPE,
+    PROM_PROTO_TYPE_GAUGE);
+  prom_proto_add_msg(family, PROM_PROTO_FAMILY_METRIC, metric);
+  prom_proto_add_delimited(stamp, family);
+
+  stamp_proto = prom_proto_get_buf(stamp, &stamp_protolen);
+
+  snapshot_proto = palloc(p, protolen + stamp_protolen);
+  memcpy(snapshot_proto, proto, protolen);
+  memcpy(snapshot_proto + protolen, stamp_proto, stamp_protolen);
+
+  *len = protolen + stamp_protolen;
+  return snapshot_proto;
+}
+
+/* Returns the OpenMetrics text of the registry, plus the gauge of the time
+ * at which it was rendered, before the terminating EOF marker.
+ */
+static const char *snapshot_render_openmetrics(pool *p,
+    struct prom_registry *registry, const char *registry_name,
+    struct timeval *tv, size_t *len) {
+  const char *om;
+  char *snapshot_om;
+  size_t omlen, snapshot_omlen;
+
+  om = prom_registry_get_openmetrics(p, registry);
+  if (om == NULL) {
+    return NULL;
+  }
+
+  omlen = strlen(om);
+  if (omlen >= 6 &&
+      strcmp(om + omlen - 6, "# EOF\n") == 0) {
+    omlen -= 6;
+  }
+
+  snapshot_omlen = omlen + (4 * strlen(registry_name)) + 256;
+  snapshot_om = palloc(p, snapshot_omlen);
+  snapshot_omlen = snprintf(snapshot_om, snapshot_omlen,
+    "%.*s"
+    "# HELP %s_exporter_snapshot_timestamp_seconds Time at which these metrics were rendered.\n"
+    "# TYPE %s_exporter_snapshot_timestamp_seconds gauge\n"
+    "# UNIT %s_exporter_snapshot_timestamp_seconds seconds\n"
+    "%s_exporter_snapshot_timestamp_seconds %lu.%03lu\n"
+    "# EOF\n",
+    (int) omlen, om, registry_name, registry_name, registry_name,
+    registry_name, (unsigned long) tv->tv_sec,
+    (unsigned long) (tv->tv_usec / 1000));
+
+  *len = snapshot_omlen;
+  return snapshot_om;
+}
+
+int prom_snapshot_render(pool *p, struct prom_snapshot *snapshot,
+    struct prom_registry *registry) {
+  int res, xerrno;
+  pool *tmp_pool;
+  const char *registry_name, *text, *proto, *om;
+  char *snapshot_text;
+  size_t textlen, snapshot_textlen, protolen = 0, omlen = 0;
+  struct timeval tv;
+
+  if (p == NULL ||
+      snapshot == NULL ||
+      registry == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  tmp_pool = make_sub_pool(p);
+  pr_pool_tag(tmp_pool, "Prometheus snapshot rendering pool");
+
+  text = prom_registry_get_text(tmp_pool, registry);
+  if (text == NULL) {
+    xerrno = errno;
+
+    destroy_pool(tmp_pool);
+    errno = xerrno;
+    return -1;
+  }
+
+  textlen = strlen(text);
+
+  /* The registry text ends with an empty line; our gauge goes before it. */
+  if (textlen >= 2 &&
+      text[textlen-1] == '\n' &&
+      text[textlen-2] == '\n') {
+    textlen--;
+  }
+
+  /* Add a gauge of when this snapshot was rendered, so that its staleness
+   * can be determined, e.g. using
+   * `time() - proftpd_exporter_snapshot_timestamp_seconds`.
+   */
+  registry_name = prom_registry_get_name(registry);
+  gettimeofday(&tv, NULL);
+
+  snapshot_textlen = textlen + (3 * strlen(registry_name)) + 256;
+  snapshot_text = palloc(tmp_pool, snapshot_textlen);
+  snapshot_textlen = snprintf(snapshot_text, snapshot_textlen,
+    "%.*s"
+    "# HELP %s_exporter_snapshot_timestamp_seconds Time at which these metrics were rendered.\n"
+    "# TYPE %s_exporter_snapshot_timestamp_seconds gauge\n"
+    "%s_exporter_snapshot_timestamp_seconds %lu.%03lu\n\n",
+    (int) textlen, text, registry_name, registry_name, registry_name,
+    (unsigned long) tv.tv_sec, (unsigned long) (tv.tv_usec / 1000));
+
+  /* Render the protobuf exposition too, for the scrapers which ask for it.
+   * Failing that, those scrapers are served from the database instead.
+   */
+  proto = snapshot_render_proto(tmp_pool, registry, registry_name, &tv,
+    &protolen);
+  if (proto == NULL) {
+    pr_trace_msg(trace_channel, 3,
+      "error rendering snapshot protobuf, publishing text only: %s",
+      strerror(errno));
+    protolen = 0;
+  }
+
+  /* Likewise the OpenMetrics text, so that those scrapers are not served
+   * from the database, e.g. while it is busy.
+   */
+  om = snapshot_render_openmetrics(tmp_pool, registry, registry_name, &tv,
+    &omlen);
+  if (om == NULL) {
+    pr_trace_msg(trace_channel, 3,
+      "error rendering snapshot OpenMetrics text, publishing without it: %s",
+      strerror(errno));
+    omlen = 0;
+  }
+
+  res = prom_snapshot_set_with_openmetrics(tmp_pool, snapshot, snapshot_text,
+    snapshot_textlen, proto, protolen, om, omlen);
+  xerrno = errno;
+
+  destroy_pool(tmp_pool);
+  errno = xerrno;
+  return res;
+}
+
+int prom_snapshot_close(pool *p, struct prom_snapshot *snapshot) {
+  if (p == NULL ||
+      snapshot == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (snapshot->addr != NULL) {
+    if (munmap(snapshot->addr, snapshot->len) < 0) {
+      pr_trace_msg(trace_channel, 3, "error unmapping '%s': %s",
+        snapshot->path, strerror(errno));
+    }
+
+    snapshot->addr = NULL;
+  }
+
+  destroy_pool(snapshot->pool);
+  return 0;
+}
+
+struct prom_snapshot *prom_snapshot_init(pool *p, const char *tables_path,
+    size_t max_size) {
+#if defined(HAVE_ATOMIC_BUILTINS)
+  int fd, xerrno;
+  pool *snapshot_pool;
+  struct prom_snapshot *snapshot;
+  const char *path;
+  size_t len;
+  void *addr;
+
+  if (p == NULL ||
+      tables_path == NULL ||
+      max_size == 0) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  /* Keep the slots aligned. */
+  max_size = (max_size + 7) & ~((size_t) 7);
+
+  path = pdircat(p, tables_path, PROM_SNAPSHOT_FILE_NAME, NULL);
+  len = sizeof(struct snapshot_header) +
+    (2 * (sizeof(struct snapshot_slot) + max_size));
+
+  /* Always start with a new file; see prom_metric_shm_init(). */
+  PRIVS_ROOT
+  (void) unlink(path);
+  fd = open(path, O_RDWR|O_CREAT|O_EXCL, 0600);
+  xerrno = errno;
+  PRIVS_RELINQUISH
+
+  if (fd < 0) {
+    pr_trace_msg(trace_channel, 1, "error creating '%s': %s", path,
+      strerror(xerrno));
+    errno = xerrno;
+    return NULL;
+  }
+
+  if (ftruncate(fd, (off_t) len) < 0) {
+    xerrno = errno;
+
+    pr_trace_msg(trace_channel, 1, "error sizing '%s' to %lu bytes: %s", path,
+      (unsigned long) len, strerror(xerrno));
+    (void) close(fd);
+    errno = xerrno;
+    return NULL;
+  }
+
+  addr = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  xerrno = errno;
+  (void) close(fd);
+
+  if (addr == MAP_FAILED) {
+    pr_trace_msg(trace_channel, 1, "error mapping '%s': %s", path,
+      strerror(xerrno));
+    errno = xerrno;
+    return NULL;
+  }
+
+  snapshot_pool = make_sub_pool(p);
+  pr_pool_tag(snapshot_pool, "Prometheus snapshot pool");
+
+  snapshot = pcalloc(snapshot_pool, sizeof(struct prom_snapshot));
+  snapshot->pool = snapshot_pool;
+  snapshot->path = pstrdup(snapshot_pool, path);
+  snapshot->addr = addr;
+  snapshot->len = len;
+  snapshot->max_size = max_size;
+  snapshot->hdr = addr;
+
+  /* The file is freshly created, thus already zero-filled, i.e. there is no
+   * published snapshot.
+   */
+  snapshot->hdr->magic = PROM_SNAPSHOT_MAGIC;
+  snapshot->hdr->version = PROM_SNAPSHOT_VERSION;
+
+  pr_trace_msg(trace_channel, 9, "created '%s' (%lu bytes)", path,
+    (unsigned long) len);
+  return snapshot;
+#else
+  errno = ENOSYS;
+  return NULL;
+#endif /* HAVE_ATOMIC_BUILTINS */
+}
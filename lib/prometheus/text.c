@@ -25,38 +25,50 @@
 #include "mod_prometheus.h"
 #include "prometheus/text.h"
 
+#include <math.h>
+
 struct prom_text {
   pool *pool;
-  char *buf, *ptr;
-  size_t bufsz, buflen;
+  char *buf;
+
+  /* The size of the buffer, and the length of the accumulated text.  We
+   * always keep one byte spare, for the terminating NUL.
+   */
+  size_t bufsz, textlen;
+
+  /* The length, if any, of the space last reserved. */
+  size_t reserved;
+
+  /* Whether to trace each append; determined once, when created. */
+  int tracing;
 };
 
 #define PROM_TEXT_DEFAULT_BUFFER_SIZE	1024
 
 static const char *trace_channel = "prometheus.text";
 
-static void ensure_text_size(struct prom_text *text, size_t new_textsz) {
-  char *buf, *ptr;
-  size_t buflen;
+/* Grows the buffer geometrically, until it holds `len` more bytes (plus the
+ * terminating NUL).
+ */
+static void ensure_text_size(struct prom_text *text, size_t len) {
+  char *buf;
+  size_t new_bufsz;
 
-  if (new_textsz <= text->bufsz) {
+  if (text->textlen + len < text->bufsz) {
     /* Nothing to do. */
     return;
   }
 
-  ptr = pcalloc(text->pool, new_textsz);
-  memcpy(ptr, text->ptr, text->bufsz - text->buflen);
-  buf = ptr + (text->buf - text->ptr);
+  new_bufsz = text->bufsz * 2;
+  while (new_bufsz <= text->textlen + len) {
+    new_bufsz *= 2;
+  }
 
-  /* buflen is the remaining length of buffer.  So we add the increased buffer
-   * size to the existing buflen to obtain the new remaining length.
-   */
-  buflen = text->buflen + (new_textsz - text->bufsz);
+  buf = palloc(text->pool, new_bufsz);
+  memcpy(buf, text->buf, text->textlen);
 
-  text->bufsz = new_textsz;
   text->buf = buf;
-  text->buflen = buflen;
-  text->ptr = ptr;
+  text->bufsz = new_bufsz;
 }
 
 int prom_text_add_byte(struct prom_text *text, char ch) {
@@ -65,20 +77,18 @@ int prom_text_add_byte(struct prom_text *text, char ch) {
     return -1;
   }
 
-  if (text->buflen == 0) {
-    ensure_text_size(text, text->bufsz * 2);
-  }
+  ensure_text_size(text, 1);
 
-  pr_trace_msg(trace_channel, 19, "appending character (%c)", ch);
-  *(text->buf++) = ch;
-  text->buflen -= 1;
+  if (text->tracing == TRUE) {
+    pr_trace_msg(trace_channel, 19, "appending character (%c)", ch);
+  }
 
+  text->buf[text->textlen++] = ch;
+  text->reserved = 0;
   return 0;
 }
 
 int prom_text_add_str(struct prom_text *text, const char *str, size_t sz) {
-  register unsigned int i;
-
   if (text == NULL ||
       str == NULL) {
     errno = EINVAL;
@@ -89,17 +99,50 @@ int prom_text_add_str(struct prom_text *text, const char *str, size_t sz) {
     return 0;
   }
 
-  if (text->buflen < sz) {
-    ensure_text_size(text, text->bufsz * 2);
+  ensure_text_size(text, sz);
+
+  if (text->tracing == TRUE) {
+    pr_trace_msg(trace_channel, 19, "appending text '%.*s' (%lu)", (int) sz,
+      str, (unsigned long) sz);
+  }
+
+  memcpy(text->buf + text->textlen, str, sz);
+  text->textlen += sz;
+  text->reserved = 0;
+  return 0;
+}
+
+char *prom_text_reserve(struct prom_text *text, size_t sz) {
+  if (text == NULL ||
+      sz == 0) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  ensure_text_size(text, sz);
+  text->reserved = sz;
+
+  return text->buf + text->textlen;
+}
+
+int prom_text_commit(struct prom_text *text, size_t sz) {
+  if (text == NULL) {
+    errno = EINVAL;
+    return -1;
   }
 
-  pr_trace_msg(trace_channel, 19, "appending text '%.*s' (%lu)", (int) sz, str,
-    (unsigned long) sz);
-  for (i = 0; i < sz; i++) {
-    *(text->buf++) = str[i];
+  if (sz > text->reserved) {
+    errno = EPERM;
+    return -1;
   }
-  text->buflen -= sz;
 
+  if (text->tracing == TRUE) {
+    pr_trace_msg(trace_channel, 19, "committing text '%.*s' (%lu)", (int) sz,
+      text->buf + text->textlen, (unsigned long) sz);
+  }
+
+  text->textlen += sz;
+  text->reserved = 0;
   return 0;
 }
 
@@ -112,20 +155,500 @@ char *prom_text_get_str(pool *p, struct prom_text *text, size_t *sz) {
     return NULL;
   }
 
-  if (text->buflen == text->bufsz) {
+  if (text->textlen == 0) {
     /* No textual data accumulated yet. */
     errno = ENOENT;
     return NULL;
   }
 
-  str = pstrdup(p, text->ptr);
+  str = palloc(p, text->textlen + 1);
+  memcpy(str, text->buf, text->textlen);
+  str[text->textlen] = '\0';
+
   if (sz != NULL) {
-    *sz = text->buf - text->ptr;
+    *sz = text->textlen;
   }
 
   return str;
 }
 
+const char *prom_text_get_buf(struct prom_text *text, size_t *sz) {
+  if (text == NULL) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  if (text->textlen == 0) {
+    /* No textual data accumulated yet. */
+    errno = ENOENT;
+    return NULL;
+  }
+
+  text->buf[text->textlen] = '\0';
+  if (sz != NULL) {
+    *sz = text->textlen;
+  }
+
+  return text->buf;
+}
+
+/* Sample value formatting.
+ *
+ * Values are formatted as the shortest text which reads back as the same
+ * double, using the Grisu2 algorithm (Loitsch, "Printing Floating-Point
+ * Numbers Quickly and Accurately with Integers", PLDI 2010): the digits are
+ * generated using 64-bit integer arithmetic, and a table of cached powers of
+ * ten, rather than by snprintf(3).  The text always reads back as the same
+ * value; for a small fraction of values, it has one more digit than needed.
+ * Integral values, which most counter and gauge samples are, are formatted as
+ * integers directly.
+ *
+ * The layout (fixed or exponent notation) follows that of "%.17g", so that
+ * e.g. integral values are never written with exponents.
+ */
+
+struct diy_fp {
+  uint64_t f;
+  int e;
+};
+
+#define PROM_TEXT_DOUBLE_SIGNIFICAND_MASK	0x000fffffffffffffULL
+#define PROM_TEXT_DOUBLE_EXPONENT_MASK		0x7ff0000000000000ULL
+#define PROM_TEXT_DOUBLE_HIDDEN_BIT		0x0010000000000000ULL
+#define PROM_TEXT_DOUBLE_EXPONENT_BIAS		(0x3ff + 52)
+
+/* Normalized 64-bit significands, and binary exponents, of the powers of
+ * ten from 10^-348 to 10^340, in steps of 8.
+ */
+static const uint64_t cached_powers_f[] = {
+  0xfa8fd5a0081c0288ULL, 0xbaaee17fa23ebf76ULL, 0x8b16fb203055ac76ULL,
+  0xcf42894a5dce35eaULL, 0x9a6bb0aa55653b2dULL, 0xe61acf033d1a45dfULL,
+  0xab70fe17c79ac6caULL, 0xff77b1fcbebcdc4fULL, 0xbe5691ef416bd60cULL,
+  0x8dd01fad907ffc3cULL, 0xd3515c2831559a83ULL, 0x9d71ac8fada6c9b5ULL,
+  0xea9c227723ee8bcbULL, 0xaecc49914078536dULL, 0x823c12795db6ce57ULL,
+  0xc21094364dfb5637ULL, 0x9096ea6f3848984fULL, 0xd77485cb25823ac7ULL,
+  0xa086cfcd97bf97f4ULL, 0xef340a98172aace5ULL, 0xb23867fb2a35b28eULL,
+  0x84c8d4dfd2c63f3bULL, 0xc5dd44271ad3cdbaULL, 0x936b9fcebb25c996ULL,
+  0xdbac6c247d62a584ULL, 0xa3ab66580d5fdaf6ULL, 0xf3e2f893dec3f126ULL,
+  0xb5b5ada8aaff80b8ULL, 0x87625f056c7c4a8bULL, 0xc9bcff6034c13053ULL,
+  0x964e858c91ba2655ULL, 0xdff9772470297ebdULL, 0xa6dfbd9fb8e5b88fULL,
+  0xf8a95fcf88747d94ULL, 0xb94470938fa89bcfULL, 0x8a08f0f8bf0f156bULL,
+  0xcdb02555653131b6ULL, 0x993fe2c6d07b7facULL, 0xe45c10c42a2b3b06ULL,
+  0xaa242499697392d3ULL, 0xfd87b5f28300ca0eULL, 0xbce5086492111aebULL,
+  0x8cbccc096f5088ccULL, 0xd1b71758e219652cULL, 0x9c40000000000000ULL,
+  0xe8d4a51000000000ULL, 0xad78ebc5ac620000ULL, 0x813f3978f8940984ULL,
+  0xc097ce7bc90715b3ULL, 0x8f7e32ce7bea5c70ULL, 0xd5d238a4abe98068ULL,
+  0x9f4f2726179a2245ULL, 0xed63a231d4c4fb27ULL, 0xb0de65388cc8ada8ULL,
+  0x83c7088e1aab65dbULL, 0xc45d1df942711d9aULL, 0x924d692ca61be758ULL,
+  0xda01ee641a708deaULL, 0xa26da3999aef774aULL, 0xf209787bb47d6b85ULL,
+  0xb454e4a179dd1877ULL, 0x865b86925b9bc5c2ULL, 0xc83553c5c8965d3dULL,
+  0x952ab45cfa97a0b3ULL, 0xde469fbd99a05fe3ULL, 0xa59bc234db398c25ULL,
+  0xf6c69a72a3989f5cULL, 0xb7dcbf5354e9beceULL, 0x88fcf317f22241e2ULL,
+  0xcc20ce9bd35c78a5ULL, 0x98165af37b2153dfULL, 0xe2a0b5dc971f303aULL,
+  0xa8d9d1535ce3b396ULL, 0xfb9b7cd9a4a7443cULL, 0xbb764c4ca7a44410ULL,
+  0x8bab8eefb6409c1aULL, 0xd01fef10a657842cULL, 0x9b10a4e5e9913129ULL,
+  0xe7109bfba19c0c9dULL, 0xac2820d9623bf429ULL, 0x80444b5e7aa7cf85ULL,
+  0xbf21e44003acdd2dULL, 0x8e679c2f5e44ff8fULL, 0xd433179d9c8cb841ULL,
+  0x9e19db92b4e31ba9ULL, 0xeb96bf6ebadf77d9ULL, 0xaf87023b9bf0ee6bULL
+};
+
+static const int16_t cached_powers_e[] = {
+  -1220, -1193, -1166, -1140, -1113, -1087, -1060, -1034, -1007, -980,
+  -954, -927, -901, -874, -847, -821, -794, -768, -741, -715,
+  -688, -661, -635, -608, -582, -555, -529, -502, -475, -449,
+  -422, -396, -369, -343, -316, -289, -263, -236, -210, -183,
+  -157, -130, -103, -77, -50, -24, 3, 30, 56, 83,
+  109, 136, 162, 189, 216, 242, 269, 295, 322, 348,
+  375, 402, 428, 455, 481, 508, 534, 561, 588, 614,
+  641, 667, 694, 720, 747, 774, 800, 827, 853, 880,
+  907, 933, 960, 986, 1013, 1039, 1066
+};
+
+/* Powers of ten, up to the largest which fits in 64 bits. */
+static const uint64_t pow10_u64[] = {
+  1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL,
+  10000000ULL, 100000000ULL, 1000000000ULL, 10000000000ULL,
+  100000000000ULL, 1000000000000ULL, 10000000000000ULL, 100000000000000ULL,
+  1000000000000000ULL, 10000000000000000ULL, 100000000000000000ULL,
+  1000000000000000000ULL, 10000000000000000000ULL
+};
+#define PROM_TEXT_POW10_COUNT	(sizeof(pow10_u64) / sizeof(pow10_u64[0]))
+
+static struct diy_fp diy_fp_from_double(double val) {
+  struct diy_fp fp;
+  uint64_t bits;
+  int biased_e;
+
+  memcpy(&bits, &val, sizeof(bits));
+  biased_e = (int) ((bits & PROM_TEXT_DOUBLE_EXPONENT_MASK) >> 52);
+
+  fp.f = bits & PROM_TEXT_DOUBLE_SIGNIFICAND_MASK;
+  if (biased_e != 0) {
+    fp.f += PROM_TEXT_DOUBLE_HIDDEN_BIT;
+    fp.e = biased_e - PROM_TEXT_DOUBLE_EXPONENT_BIAS;
+
+  } else {
+    /* Subnormal. */
+    fp.e = 1 - PROM_TEXT_DOUBLE_EXPONENT_BIAS;
+  }
+
+  return fp;
+}
+
+/* Multiplies the significands, keeping the (rounded) upper 64 bits. */
+static struct diy_fp diy_fp_mul(struct diy_fp x, struct diy_fp y) {
+  struct diy_fp fp;
+  uint64_t a, b, c, d, ac, bc, ad, bd, tmp;
+
+  a = x.f >> 32;
+  b = x.f & 0xffffffffULL;
+  c = y.f >> 32;
+  d = y.f & 0xffffffffULL;
+
+  ac = a * c;
+  bc = b * c;
+  ad = a * d;
+  bd = b * d;
+
+  tmp = (bd >> 32) + (ad & 0xffffffffULL) + (bc & 0xffffffffULL);
+  tmp += 1ULL << 31;
+
+  fp.f = ac + (ad >> 32) + (bc >> 32) + (tmp >> 32);
+  fp.e = x.e + y.e + 64;
+  return fp;
+}
+
+static struct diy_fp diy_fp_normalize(struct diy_fp fp) {
+  while ((fp.f & PROM_TEXT_DOUBLE_HIDDEN_BIT) == 0) {
+    fp.f <<= 1;
+    fp.e--;
+  }
+
+  fp.f <<= 11;
+  fp.e -= 11;
+  return fp;
+}
+
+/* Obtains the boundaries m- and m+ of the given value: the midpoints between
+ * it and its neighbouring doubles, normalized to the same exponent.
+ */
+static void diy_fp_boundaries(struct diy_fp fp, struct diy_fp *minus,
+    struct diy_fp *plus) {
+  struct diy_fp pl, mi;
+
+  pl.f = (fp.f << 1) + 1;
+  pl.e = fp.e - 1;
+  while ((pl.f & (PROM_TEXT_DOUBLE_HIDDEN_BIT << 1)) == 0) {
+    pl.f <<= 1;
+    pl.e--;
+  }
+  pl.f <<= 10;
+  pl.e -= 10;
+
+  /* The lower boundary is closer for powers of two. */
+  if (fp.f == PROM_TEXT_DOUBLE_HIDDEN_BIT) {
+    mi.f = (fp.f << 2) - 1;
+    mi.e = fp.e - 2;
+
+  } else {
+    mi.f = (fp.f << 1) - 1;
+    mi.e = fp.e - 1;
+  }
+
+  mi.f <<= mi.e - pl.e;
+  mi.e = pl.e;
+
+  *minus = mi;
+  *plus = pl;
+}
+
+/* Selects the cached power of ten which brings the binary exponent `e` into
+ * the range [-60, -32], returning its (negated) decimal exponent in `k`.
+ */
+static struct diy_fp get_cached_power(int e, int *k) {
+  struct diy_fp fp;
+  double dk;
+  int ik;
+  unsigned int idx;
+
+  dk = (-61 - e) * 0.30102999566398114 + 347;
+  ik = (int) dk;
+  if (ik != dk) {
+    ik++;
+  }
+
+  idx = (unsigned int) ((ik >> 3) + 1);
+  *k = -(-348 + (int) (idx << 3));
+
+  fp.f = cached_powers_f[idx];
+  fp.e = cached_powers_e[idx];
+  return fp;
+}
+
+static unsigned int count_digits_u32(uint32_t n) {
+  unsigned int count = 1;
+
+  while (count < 10 &&
+         n >= pow10_u64[count]) {
+    count++;
+  }
+
+  return count;
+}
+
+/* Moves the last generated digit closer to the exact value, while it stays
+ * within the boundaries.
+ */
+static void grisu_round(char *buf, size_t len, uint64_t delta, uint64_t rest,
+    uint64_t ten_kappa, uint64_t wp_w) {
+
+  while (rest < wp_w &&
+         delta - rest >= ten_kappa &&
+         (rest + ten_kappa < wp_w ||
+          wp_w - rest > rest + ten_kappa - wp_w)) {
+    buf[len - 1]--;
+    rest += ten_kappa;
+  }
+}
+
+/* Generates the shortest digits, for the value `w` within the (scaled)
+ * boundaries `mp - delta` and `mp`.
+ */
+static size_t grisu_digits(struct diy_fp w, struct diy_fp mp, uint64_t delta,
+    char *buf, int *k) {
+  struct diy_fp one;
+  uint64_t wp_w, p2;
+  uint32_t p1;
+  int kappa;
+  size_t len = 0;
+
+  one.f = 1ULL << -mp.e;
+  one.e = mp.e;
+  wp_w = mp.f - w.f;
+
+  p1 = (uint32_t) (mp.f >> -one.e);
+  p2 = mp.f & (one.f - 1);
+
+  kappa = (int) count_digits_u32(p1);
+  while (kappa > 0) {
+    uint32_t d;
+    uint64_t tmp;
+
+    d = (uint32_t) (p1 / pow10_u64[kappa - 1]);
+    p1 %= pow10_u64[kappa - 1];
+
+    if (d != 0 ||
+        len > 0) {
+      buf[len++] = (char) ('0' + d);
+    }
+
+    kappa--;
+    tmp = ((uint64_t) p1 << -one.e) + p2;
+    if (tmp <= delta) {
+      *k += kappa;
+      grisu_round(buf, len, delta, tmp,
+        pow10_u64[kappa] << -one.e, wp_w);
+      return len;
+    }
+  }
+
+  while (TRUE) {
+    char d;
+    unsigned int idx;
+
+    p2 *= 10;
+    delta *= 10;
+    d = (char) (p2 >> -one.e);
+
+    if (d != 0 ||
+        len > 0) {
+      buf[len++] = (char) ('0' + d);
+    }
+
+    p2 &= one.f - 1;
+    kappa--;
+    if (p2 < delta) {
+      *k += kappa;
+
+      /* Past 10^19, the scaled distance no longer fits; then no rounding
+       * is done, as in the reference implementation.
+       */
+      idx = (unsigned int) -kappa;
+      grisu_round(buf, len, delta, p2, one.f,
+        idx < PROM_TEXT_POW10_COUNT ? wp_w * pow10_u64[idx] : 0);
+      return len;
+    }
+  }
+}
+
+/* Writes the shortest digits of the given (positive, finite) value into
+ * `buf`, returning their count; the value is digits * 10^k.
+ */
+static size_t grisu2(double val, char *buf, int *k) {
+  struct diy_fp v, w, w_m, w_p, c_mk;
+
+  v = diy_fp_from_double(val);
+  diy_fp_boundaries(v, &w_m, &w_p);
+
+  c_mk = get_cached_power(w_p.e, k);
+  w = diy_fp_mul(diy_fp_normalize(v), c_mk);
+  w_p = diy_fp_mul(w_p, c_mk);
+  w_m = diy_fp_mul(w_m, c_mk);
+  w_m.f++;
+  w_p.f--;
+
+  return grisu_digits(w, w_p, w_p.f - w_m.f, buf, k);
+}
+
+static size_t format_u64(char *buf, uint64_t n) {
+  char digits[20];
+  size_t len = 0, i;
+
+  do {
+    digits[len++] = (char) ('0' + (n % 10));
+    n /= 10;
+  } while (n > 0);
+
+  for (i = 0; i < len; i++) {
+    buf[i] = digits[len - i - 1];
+  }
+
+  return len;
+}
+
+/* Lays out the given digits, for the value digits * 10^k, as "%.17g" would.
+ */
+static size_t format_digits(char *buf, const char *digits, size_t ndigits,
+    int k) {
+  int exp;
+  size_t len = 0;
+
+  exp = (int) ndigits + k - 1;
+
+  if (exp >= -4 &&
+      exp < 17) {
+    if (k >= 0) {
+      /* Integral. */
+      memcpy(buf, digits, ndigits);
+      len = ndigits;
+      memset(buf + len, '0', k);
+      len += k;
+
+    } else if (exp >= 0) {
+      memcpy(buf, digits, exp + 1);
+      len = exp + 1;
+      buf[len++] = '.';
+      memcpy(buf + len, digits + exp + 1, ndigits - (exp + 1));
+      len += ndigits - (exp + 1);
+
+    } else {
+      buf[len++] = '0';
+      buf[len++] = '.';
+      memset(buf + len, '0', -exp - 1);
+      len += -exp - 1;
+      memcpy(buf + len, digits, ndigits);
+      len += ndigits;
+    }
+
+    return len;
+  }
+
+  buf[len++] = digits[0];
+  if (ndigits > 1) {
+    buf[len++] = '.';
+    memcpy(buf + len, digits + 1, ndigits - 1);
+    len += ndigits - 1;
+  }
+
+  buf[len++] = 'e';
+  if (exp < 0) {
+    buf[len++] = '-';
+    exp = -exp;
+
+  } else {
+    buf[len++] = '+';
+  }
+
+  /* As with printf(3), the exponent has at least two digits. */
+  if (exp < 10) {
+    buf[len++] = '0';
+  }
+
+  len += format_u64(buf + len, (uint64_t) exp);
+  return len;
+}
+
+int prom_text_format_double(char *buf, size_t bufsz, double val) {
+  char digits[20];
+  size_t len = 0, ndigits;
+  int k = 0;
+
+  if (buf == NULL ||
+      bufsz < PROM_TEXT_DOUBLE_MAX_LEN) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  /* Use the spellings of the exposition formats for the special values. */
+  if (isnan(val)) {
+    memcpy(buf, "NaN", 4);
+    return 3;
+  }
+
+  if (isinf(val)) {
+    if (val > 0) {
+      memcpy(buf, "+Inf", 5);
+
+    } else {
+      memcpy(buf, "-Inf", 5);
+    }
+
+    return 4;
+  }
+
+  if (signbit(val)) {
+    buf[len++] = '-';
+    val = -val;
+  }
+
+  if (val == 0.0) {
+    buf[len++] = '0';
+    buf[len] = '\0';
+    return (int) len;
+  }
+
+  /* Integral values, below 2^53, are exactly representable as integers. */
+  if (val < 9007199254740992.0 &&
+      val == (double) (uint64_t) val) {
+    len += format_u64(buf + len, (uint64_t) val);
+    buf[len] = '\0';
+    return (int) len;
+  }
+
+  ndigits = grisu2(val, digits, &k);
+  len += format_digits(buf + len, digits, ndigits, k);
+  buf[len] = '\0';
+
+  return (int) len;
+}
+
+int prom_text_add_double(struct prom_text *text, double val) {
+  char *ptr;
+  int len;
+
+  ptr = prom_text_reserve(text, PROM_TEXT_DOUBLE_MAX_LEN);
+  if (ptr == NULL) {
+    return -1;
+  }
+
+  len = prom_text_format_double(ptr, PROM_TEXT_DOUBLE_MAX_LEN, val);
+  if (len < 0) {
+    return -1;
+  }
+
+  return prom_text_commit(text, (size_t) len);
+}
+
 static int label_keycmp(const void *a, const void *b) {
   return strcmp(*((char **) a), *((char **) b));
 }
@@ -225,8 +748,9 @@ struct prom_text *prom_text_create(pool *p) {
 
   text = pcalloc(text_pool, sizeof(struct prom_text));
   text->pool = text_pool;
-  text->bufsz = text->buflen = PROM_TEXT_DEFAULT_BUFFER_SIZE;
-  text->ptr = text->buf = pcalloc(text->pool, text->bufsz);
+  text->bufsz = PROM_TEXT_DEFAULT_BUFFER_SIZE;
+  text->buf = palloc(text->pool, text->bufsz);
+  text->tracing = (pr_trace_get_level(trace_channel) >= 19);
 
   return text;
 }
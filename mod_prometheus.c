@@ -23,15 +23,19 @@
  *
  * -----DO NOT EDIT BELOW THIS LINE-----
  * $Archive: mod_prometheus.a $
- * $Libraries: -lmicrohttpd -lsqlite3$
+ * $Libraries: -lmicrohttpd -lsqlite3 -lm$
  */
 
 #include "mod_prometheus.h"
 #include "prometheus/db.h"
 #include "prometheus/registry.h"
 #include "prometheus/metric.h"
+#include "prometheus/metric/buffer.h"
 #include "prometheus/metric/db.h"
+#include "prometheus/metric/shm.h"
 #include "prometheus/http.h"
+#include "prometheus/recorder.h"
+#include "prometheus/snapshot.h"
 
 /* Defaults */
 #define PROMETHEUS_DEFAULT_EXPORTER_PORT	9273
@@ -48,13 +52,82 @@ static const char *prometheus_tables_dir = NULL;
 static uint64_t prometheus_connected_ms = 0;
 
 static struct prom_dbh *prometheus_dbh = NULL;
+static struct prom_metric_shm *prometheus_shm = NULL;
+static struct prom_metric_buffer *prometheus_buffer = NULL;
 static struct prom_registry *prometheus_registry = NULL;
 static struct prom_http *prometheus_exporter_http = NULL;
 static pid_t prometheus_exporter_pid = 0;
 
+/* Write-behind buffering: the number of seconds between flushes of the
+ * session's buffered samples (-1 means no buffering), and when we last
+ * flushed.
+ */
+static int prometheus_flush_interval = -1;
+static time_t prometheus_flushed = 0;
+
+/* Update budget: the number of microseconds that a metric update may wait
+ * on a busy database (0 means no limit), the buffer for the updates deferred
+ * because of it, and the counts of deferred/dropped updates last reported.
+ */
+static unsigned long prometheus_update_budget = 0;
+static struct prom_metric_buffer *prometheus_deferred = NULL;
+static uint64_t prometheus_deferred_count = 0;
+static uint64_t prometheus_dropped_count = 0;
+
+/* Native histograms: whether our histograms also have native (sparse,
+ * exponential) buckets, and the schema (resolution) of those buckets.
+ */
+static int prometheus_native_histograms = FALSE;
+static int prometheus_native_schema = 0;
+
+/* Recording: the trace of this session's metric updates, if any; see
+ * PrometheusRecordDirectory.
+ */
+static struct prom_recorder *prometheus_recorder = NULL;
+
+/* Scratch pool for event updates, cleared after each update; see
+ * prom_event_metric().
+ */
+static pool *prometheus_event_pool = NULL;
+
 static int prometheus_saw_user_cmd = FALSE;
 static int prometheus_saw_pass_cmd = FALSE;
 
+/* Handles of our metrics, resolved once, as they are registered, rather than
+ * looked up by name for every update.
+ */
+enum prom_metric_id {
+  PROM_METRIC_ID_AUTH = 0,
+  PROM_METRIC_ID_AUTH_ERROR,
+  PROM_METRIC_ID_CONNECTION,
+  PROM_METRIC_ID_DIRECTORY_LIST,
+  PROM_METRIC_ID_DIRECTORY_LIST_ERROR,
+  PROM_METRIC_ID_FILE_DOWNLOAD,
+  PROM_METRIC_ID_FILE_DOWNLOAD_ERROR,
+  PROM_METRIC_ID_FILE_UPLOAD,
+  PROM_METRIC_ID_FILE_UPLOAD_ERROR,
+  PROM_METRIC_ID_LOGIN,
+  PROM_METRIC_ID_LOGIN_ERROR,
+  PROM_METRIC_ID_TIMEOUT,
+  PROM_METRIC_ID_HANDSHAKE_ERROR,
+  PROM_METRIC_ID_SFTP_PROTOCOL,
+  PROM_METRIC_ID_TLS_PROTOCOL,
+  PROM_METRIC_ID_CONNECTION_REFUSED,
+  PROM_METRIC_ID_LOG_MESSAGE,
+  PROM_METRIC_ID_METRICS_UPDATES_DEFERRED,
+  PROM_METRIC_ID_METRICS_UPDATES_DROPPED,
+  PROM_METRIC_ID_SEGFAULT,
+  PROM_METRIC_ID_BUILD_INFO,
+  PROM_METRIC_ID_STARTUP_TIME,
+
+  PROM_METRIC_ID_MAX
+};
+
+static struct prom_metric *prometheus_metrics[PROM_METRIC_ID_MAX];
+
+/* The protocol of the rendered base "protocol" label, if any. */
+static char prometheus_protocol[32];
+
 /* Number of seconds to wait for the exporter process to stop before
  * we terminate it with extreme prejudice.
  *
@@ -63,29 +136,26 @@ static int prometheus_saw_pass_cmd = FALSE;
  */
 static time_t prometheus_exporter_timeout = 1;
 
-/* mod_prometheus option flags */
-#define PROM_OPT_ENABLE_LOG_MESSAGE_METRICS		0x001
+/* Number of seconds between maintenance runs (e.g. VACUUM) of the metrics
+ * database, performed by the exporter process.
+ */
+#define PROM_METRICS_DB_MAINTENANCE_INTERVAL	3600
 
-static void prom_event_decr(const char *metric_name, uint32_t decr, ...)
-#if defined(__GNUC__)
-      __attribute__ ((sentinel));
-#else
-      ;
-#endif /* GNUC */
+/* Upper bound on the number of exporter worker processes. */
+#define PROM_EXPORTER_MAX_WORKERS		256
 
-static void prom_event_incr(const char *metric_name, uint32_t incr, ...)
-#if defined(__GNUC__)
-      __attribute__ ((sentinel));
-#else
-      ;
-#endif /* GNUC */
+/* mod_prometheus option flags */
+#define PROM_OPT_ENABLE_LOG_MESSAGE_METRICS		0x001
+#define PROM_OPT_USE_SHARED_MEMORY			0x002
+#define PROM_OPT_NO_EXEMPLARS				0x004
+#define PROM_OPT_ENABLE_SUMMARY_METRICS			0x008
 
-static void prom_event_observe(const char *metric_name, double observed, ...)
-#if defined(__GNUC__)
-      __attribute__ ((sentinel));
-#else
-      ;
-#endif /* GNUC */
+static void prom_event_decr(enum prom_metric_id metric_id, uint32_t decr,
+  const char *value1, const char *value2);
+static void prom_event_incr(enum prom_metric_id metric_id, uint32_t incr,
+  const char *value1, const char *value2);
+static void prom_event_observe(enum prom_metric_id metric_id, double observed,
+  const char *value1, const char *value2);
 
 static const char *trace_channel = "prometheus";
 
@@ -247,11 +317,67 @@ static void prom_daemonize(const char *daemon_dir) {
   pr_fsio_chdir(daemon_dir, 0);
 }
 
+/* The exporter's background process renders any snapshots, and performs
+ * the periodic maintenance of the metrics database, using its own handle;
+ * neither is thus done on the request path.  It runs until its exporter
+ * process goes away.
+ */
+static void prom_exporter_background_loop(pool *p,
+    struct prom_snapshot *snapshot, int interval, struct prom_dbh *maint_dbh,
+    pid_t parent_pid) {
+  time_t last_maintenance, next_render = 0;
+
+  last_maintenance = time(NULL);
+
+  while (getppid() == parent_pid) {
+    pool *tmp_pool;
+    time_t now;
+
+    pr_signals_handle();
+
+    tmp_pool = make_sub_pool(p);
+    pr_pool_tag(tmp_pool, "Prometheus exporter background pool");
+
+    now = time(NULL);
+    if (snapshot != NULL &&
+        now >= next_render) {
+      if (prom_snapshot_render(tmp_pool, snapshot, prometheus_registry) < 0) {
+        pr_trace_msg(trace_channel, 3,
+          "renderer error rendering metrics snapshot: %s", strerror(errno));
+      }
+
+      next_render = now + interval;
+    }
+
+    if (maint_dbh != NULL &&
+        (now - last_maintenance) >=
+          (time_t) PROM_METRICS_DB_MAINTENANCE_INTERVAL) {
+      pr_trace_msg(trace_channel, 17, "%s", "running scheduled maintenance");
+
+      if (prom_metric_db_maintain(tmp_pool, maint_dbh) < 0) {
+        pr_trace_msg(trace_channel, 3,
+          "exporter error performing metrics database maintenance: %s",
+          strerror(errno));
+      }
+
+      last_maintenance = now;
+    }
+
+    destroy_pool(tmp_pool);
+    (void) pr_timer_usleep(1000 * 1000);
+  }
+}
+
 static pid_t prom_exporter_start(pool *p, const pr_netaddr_t *exporter_addr,
     const char *username, const char *password) {
-  pid_t exporter_pid;
-  struct prom_dbh *dbh;
+  pid_t exporter_pid, parent_pid = 0;
+  struct prom_dbh *dbh, *maint_dbh = NULL;
+  struct prom_snapshot *snapshot = NULL;
+  config_rec *c;
   char *exporter_chroot = NULL;
+  unsigned int max_conns = 0, nworkers = 1, worker_id = 0;
+  int http_flags = 0, is_background = FALSE, snapshot_interval = -1;
+  char etag_id[40];
 
   exporter_pid = fork();
   switch (exporter_pid) {
@@ -286,6 +412,98 @@ static pid_t prom_exporter_start(pool *p, const pr_netaddr_t *exporter_addr,
   /* Remove our event listeners. */
   pr_event_unregister(&prometheus_module, NULL, NULL);
 
+  c = find_config(main_server->conf, CONF_PARAM, "PrometheusExporterWorkers",
+    FALSE);
+  if (c != NULL) {
+    nworkers = *((unsigned int *) c->argv[0]);
+    max_conns = *((unsigned int *) c->argv[1]);
+  }
+
+  c = find_config(main_server->conf, CONF_PARAM, "PrometheusSnapshotInterval",
+    FALSE);
+  if (c != NULL) {
+    snapshot_interval = *((int *) c->argv[0]);
+  }
+
+  /* The snapshot area is created before any forking, so that all of the
+   * exporter workers, and the background process, share the same mapping.
+   */
+  if (snapshot_interval > 0) {
+    snapshot = prom_snapshot_init(prometheus_pool, prometheus_tables_dir,
+      PROM_SNAPSHOT_DEFAULT_MAX_SIZE);
+    if (snapshot == NULL) {
+      (void) pr_log_writefile(prometheus_logfd, MOD_PROMETHEUS_VERSION,
+        "unable to create metrics snapshot in '%s': %s", prometheus_tables_dir,
+        strerror(errno));
+    }
+  }
+
+  /* The ETag ID is chosen before forking, so that all of the exporter
+   * workers give the same ETags for the same data, whichever of them handles
+   * a request.
+   */
+  memset(etag_id, '\0', sizeof(etag_id));
+  snprintf(etag_id, sizeof(etag_id)-1, "%lx.%lx", (unsigned long) session.pid,
+    (unsigned long) time(NULL));
+
+  /* Fork any additional exporter workers.  These all listen on the same
+   * address, each with its own database handle (opened below).
+   */
+  if (nworkers > 1) {
+    register unsigned int i;
+
+    http_flags |= PROM_HTTP_FL_SHARED_ADDR;
+
+    for (i = 1; i < nworkers; i++) {
+      pid_t worker_pid;
+
+      worker_pid = fork();
+      if (worker_pid < 0) {
+        (void) pr_log_writefile(prometheus_logfd, MOD_PROMETHEUS_VERSION,
+          "unable to fork exporter worker: %s", strerror(errno));
+        break;
+      }
+
+      if (worker_pid == 0) {
+        parent_pid = session.pid;
+        session.pid = getpid();
+        worker_id = i;
+
+        pr_trace_msg(trace_channel, 3, "forked exporter worker #%u PID %lu",
+          worker_id, (unsigned long) session.pid);
+        break;
+      }
+    }
+  }
+
+  /* The original exporter process forks the background process, which
+   * renders the metrics into the snapshot area, if any, and maintains the
+   * database, off the request path.
+   */
+  if (worker_id == 0) {
+    pid_t background_pid;
+
+    background_pid = fork();
+    if (background_pid < 0) {
+      (void) pr_log_writefile(prometheus_logfd, MOD_PROMETHEUS_VERSION,
+        "unable to fork exporter background process: %s", strerror(errno));
+
+      /* Without a renderer, the snapshot would never be updated. */
+      if (snapshot != NULL) {
+        (void) prom_snapshot_close(prometheus_pool, snapshot);
+        snapshot = NULL;
+      }
+
+    } else if (background_pid == 0) {
+      parent_pid = session.pid;
+      session.pid = getpid();
+      is_background = TRUE;
+
+      pr_trace_msg(trace_channel, 3, "forked exporter background PID %lu",
+        (unsigned long) session.pid);
+    }
+  }
+
   /* Close any database handle inherited from our parent, and open a new
    * one, per SQLite3 recommendation.
    */
@@ -302,6 +520,19 @@ static pid_t prom_exporter_start(pool *p, const pr_netaddr_t *exporter_addr,
       strerror(errno));
   }
 
+  /* The exporter owns the periodic maintenance of the metrics database, so
+   * that sessions need not do so at connect time.  This requires a writable
+   * handle, which we open now, before we chroot.
+   */
+  if (is_background == TRUE) {
+    maint_dbh = prom_metric_db_reopen(prometheus_pool, prometheus_tables_dir);
+    if (maint_dbh == NULL) {
+      pr_trace_msg(trace_channel, 3,
+        "exporter error opening '%s' database for maintenance: %s",
+        prometheus_tables_dir, strerror(errno));
+    }
+  }
+
   PRIVS_ROOT
   if (getuid() == PR_ROOT_UID) {
     int res;
@@ -335,8 +566,6 @@ static pid_t prom_exporter_start(pool *p, const pr_netaddr_t *exporter_addr,
     }
   }
 
-  pr_proctitle_set("(listening for Prometheus requests)");
-
   /* Make the exporter process have the identity of the configured daemon
    * User/Group.
    */
@@ -344,12 +573,51 @@ static pid_t prom_exporter_start(pool *p, const pr_netaddr_t *exporter_addr,
   session.gid = getegid();
   PRIVS_REVOKE
 
+  if (is_background == TRUE) {
+    pr_proctitle_set("(maintaining Prometheus metrics)");
+
+    /* This function will return once the exporter exits. */
+    prom_exporter_background_loop(p, snapshot, snapshot_interval, maint_dbh,
+      parent_pid);
+
+    pr_trace_msg(trace_channel, 3, "exporter background PID %lu exiting",
+      (unsigned long) session.pid);
+    exit(0);
+  }
+
+  pr_proctitle_set("(listening for Prometheus requests)");
+
   prometheus_exporter_http = prom_http_start(p, exporter_addr,
-    prometheus_registry, username, password);
+    prometheus_registry, username, password, max_conns, http_flags);
   if (prometheus_exporter_http == NULL) {
     return 0;
   }
 
+  (void) prom_http_set_etag_id(prometheus_exporter_http, etag_id);
+
+  if (parent_pid != 0) {
+    (void) prom_http_set_parent(prometheus_exporter_http, parent_pid);
+  }
+
+  if (snapshot != NULL) {
+    (void) prom_http_set_snapshot(prometheus_exporter_http, snapshot);
+  }
+
+  c = find_config(main_server->conf, CONF_PARAM, "PrometheusCompression",
+    FALSE);
+  if (c != NULL) {
+    int level, strategy;
+
+    level = *((int *) c->argv[0]);
+    strategy = *((int *) c->argv[1]);
+
+    if (prom_http_set_compression(prometheus_exporter_http, level,
+        strategy) < 0) {
+      pr_trace_msg(trace_channel, 3,
+        "error setting exporter compression: %s", strerror(errno));
+    }
+  }
+
   if (exporter_chroot != NULL) {
     (void) pr_log_writefile(prometheus_logfd, MOD_PROMETHEUS_VERSION,
       "exporter process running with UID %s, GID %s, restricted to '%s'",
@@ -475,154 +743,230 @@ static void prom_exporter_stop(pid_t exporter_pid) {
   prometheus_exporter_http = NULL;
 }
 
-static pr_table_t *prom_get_labels(pool *p) {
+/* The base "protocol" label is rendered once, and again only when the
+ * session's protocol changes (e.g. to "ftps", after AUTH TLS).
+ */
+static void prom_set_base_labels(void) {
+  pool *tmp_pool;
   pr_table_t *labels;
+  const char *protocol;
 
-  labels = pr_table_nalloc(p, 0, 2);
-  (void) pr_table_add(labels, "protocol", pr_session_get_protocol(0), 0);
+  protocol = pr_session_get_protocol(0);
+  if (prometheus_protocol[0] != '\0' &&
+      strcmp(prometheus_protocol, protocol) == 0) {
+    return;
+  }
 
-  return labels;
-}
+  sstrncpy(prometheus_protocol, protocol, sizeof(prometheus_protocol));
 
-static const struct prom_metric *prom_metric_with_labels(pool *p,
-    const char *metric_name, pr_table_t *labels, va_list ap) {
-  char *key;
-  const struct prom_metric *metric;
+  tmp_pool = make_sub_pool(prometheus_pool);
+  labels = pr_table_nalloc(tmp_pool, 0, 1);
+  (void) pr_table_add(labels, "protocol", protocol, 0);
 
-  metric = prom_registry_get_metric(prometheus_registry, metric_name);
-  if (metric == NULL) {
-    pr_trace_msg(trace_channel, 17, "unknown metric name '%s' requested",
-      metric_name);
-    return NULL;
+  if (prom_metric_set_base_labels(prometheus_pool, labels) < 0) {
+    pr_trace_msg(trace_channel, 3, "error setting base labels: %s",
+      strerror(errno));
+    prometheus_protocol[0] = '\0';
+
+  } else if (prometheus_recorder != NULL) {
+    (void) prom_recorder_add_base_labels(prometheus_recorder, labels);
   }
 
-  key = va_arg(ap, char *);
-  while (key != NULL) {
-    char *val;
+  destroy_pool(tmp_pool);
+}
 
-    pr_signals_handle();
+static void prom_clear_base_labels(void) {
+  (void) prom_metric_set_base_labels(prometheus_pool, NULL);
+  prometheus_protocol[0] = '\0';
+}
 
-    val = va_arg(ap, char *);
+static int prom_register_metric(enum prom_metric_id metric_id,
+    struct prom_metric *metric) {
+  if (prom_registry_add_metric(prometheus_registry, metric) < 0) {
+    pr_trace_msg(trace_channel, 1, "error registering metric '%s': %s",
+      prom_metric_get_name(metric), strerror(errno));
+    return -1;
+  }
 
-    /* Any labels provided by the caller take precedence. */
-    if (pr_table_exists(labels, key) > 0) {
-      (void) pr_table_set(labels, key, pstrdup(p, val), 0);
+  prometheus_metrics[metric_id] = metric;
+  return 0;
+}
 
-    } else {
-      (void) pr_table_add_dup(labels, key, val, 0);
-    }
+static void prom_unregister_metrics(void) {
+  memset(prometheus_metrics, 0, sizeof(prometheus_metrics));
+}
 
-    key = va_arg(ap, char *);
+/* Appends the given update to this session's trace, if recording. */
+static void prom_record_update(enum prom_metric_id metric_id,
+    const struct prom_metric *metric, int op, double val,
+    const char **values, unsigned int nvalues) {
+  if (prometheus_recorder == NULL) {
+    return;
   }
-  va_end(ap);
 
-  return metric;
+  if (prom_recorder_add_update(prometheus_recorder, (unsigned int) metric_id,
+      metric, op, val, values, nvalues) < 0) {
+    pr_trace_msg(trace_channel, 19, "error recording update of %s: %s",
+      prom_metric_get_name((struct prom_metric *) metric), strerror(errno));
+  }
 }
 
-static void prom_event_decr(const char *metric_name, uint32_t decr, ...) {
-  int res;
-  pool *tmp_pool;
-  va_list ap;
-  const struct prom_metric *metric;
-  pr_table_t *labels;
+/* Event updates give the values of the metric's labels positionally, as
+ * declared in create_metrics(); at most two are used.  The label text is not
+ * allocated, but the datastore may allocate error messages (e.g. for every
+ * update which finds the database busy) and query results, so each update
+ * uses the event scratch pool, cleared once the update is done, rather than
+ * the long-lived session pool.
+ */
+static struct prom_metric *prom_event_metric(enum prom_metric_id metric_id,
+    pool **p) {
+  struct prom_metric *metric;
 
-  if (session.pool != NULL) {
-    tmp_pool = make_sub_pool(session.pool);
+  metric = prometheus_metrics[metric_id];
+  if (metric == NULL) {
+    pr_trace_msg(trace_channel, 17, "unregistered metric ID %u requested",
+      (unsigned int) metric_id);
+    return NULL;
+  }
 
-  } else {
-    tmp_pool = make_sub_pool(prometheus_pool);
+  if (prometheus_event_pool == NULL) {
+    prometheus_event_pool = make_sub_pool(prometheus_pool);
+    pr_pool_tag(prometheus_event_pool, "Prometheus event update pool");
   }
 
-  labels = prom_get_labels(tmp_pool);
+  *p = prometheus_event_pool;
+  prom_set_base_labels();
 
-  va_start(ap, decr);
-  metric = prom_metric_with_labels(tmp_pool, metric_name, labels, ap);
-  va_end(ap);
+  return metric;
+}
+
+static void prom_event_decr(enum prom_metric_id metric_id, uint32_t decr,
+    const char *value1, const char *value2) {
+  pool *p = NULL;
+  struct prom_metric *metric;
+  const char *values[2];
 
+  metric = prom_event_metric(metric_id, &p);
   if (metric == NULL) {
-    destroy_pool(tmp_pool);
     return;
   }
 
-  res = prom_metric_decr(tmp_pool, metric, decr, labels);
-  if (res < 0) {
-    pr_trace_msg(trace_channel, 19, "error decrementing %s: %s", metric_name,
-      strerror(errno));
+  values[0] = value1;
+  values[1] = value2;
+  prom_record_update(metric_id, metric, PROM_RECORDER_OP_DECR, decr, values, 2);
+
+  if (prom_metric_decr_values(p, metric, decr, values) < 0) {
+    pr_trace_msg(trace_channel, 19, "error decrementing %s: %s",
+      prom_metric_get_name(metric), strerror(errno));
   }
 
-  destroy_pool(tmp_pool);
+  clear_pool(p);
 }
 
-static void prom_event_incr(const char *metric_name, uint32_t incr, ...) {
-  int res;
-  pool *tmp_pool;
-  va_list ap;
-  const struct prom_metric *metric;
-  pr_table_t *labels;
+static void prom_event_incr(enum prom_metric_id metric_id, uint32_t incr,
+    const char *value1, const char *value2) {
+  pool *p = NULL;
+  struct prom_metric *metric;
+  const char *values[2];
 
-  if (session.pool != NULL) {
-    tmp_pool = make_sub_pool(session.pool);
+  metric = prom_event_metric(metric_id, &p);
+  if (metric == NULL) {
+    return;
+  }
 
-  } else {
-    tmp_pool = make_sub_pool(prometheus_pool);
+  values[0] = value1;
+  values[1] = value2;
+  prom_record_update(metric_id, metric, PROM_RECORDER_OP_INCR, incr, values, 2);
+
+  if (prom_metric_incr_values(p, metric, incr, values) < 0) {
+    pr_trace_msg(trace_channel, 19, "error incrementing %s: %s",
+      prom_metric_get_name(metric), strerror(errno));
   }
 
-  labels = prom_get_labels(tmp_pool);
+  clear_pool(p);
+}
 
-  va_start(ap, incr);
-  metric = prom_metric_with_labels(tmp_pool, metric_name, labels, ap);
-  va_end(ap);
+static void prom_event_observe(enum prom_metric_id metric_id, double observed,
+    const char *value1, const char *value2) {
+  pool *p = NULL;
+  struct prom_metric *metric;
+  const char *values[2];
 
+  metric = prom_event_metric(metric_id, &p);
   if (metric == NULL) {
-    destroy_pool(tmp_pool);
     return;
   }
 
-  res = prom_metric_incr(tmp_pool, metric, incr, labels);
-  if (res < 0) {
-    pr_trace_msg(trace_channel, 19, "error incrementing %s: %s", metric_name,
-      strerror(errno));
+  values[0] = value1;
+  values[1] = value2;
+  prom_record_update(metric_id, metric, PROM_RECORDER_OP_OBSERVE, observed,
+    values, 2);
+
+  if (prom_metric_observe_values(p, metric, observed, values) < 0) {
+    pr_trace_msg(trace_channel, 19, "error observing %s: %s",
+      prom_metric_get_name(metric), strerror(errno));
   }
 
-  destroy_pool(tmp_pool);
+  clear_pool(p);
 }
 
-static void prom_event_observe(const char *metric_name, double observed, ...) {
-  int res;
-  pool *tmp_pool;
-  va_list ap;
-  const struct prom_metric *metric;
-  pr_table_t *labels;
+/* Configuration handlers
+ */
 
-  if (session.pool != NULL) {
-    tmp_pool = make_sub_pool(session.pool);
+/* usage: PrometheusCompression level|"default" [strategy] */
+MODRET set_prometheuscompression(cmd_rec *cmd) {
+  int level = -1, strategy = PROM_HTTP_COMPRESS_STRATEGY_DEFAULT;
+  config_rec *c;
 
-  } else {
-    tmp_pool = make_sub_pool(prometheus_pool);
+  if (cmd->argc < 2 ||
+      cmd->argc > 3) {
+    CONF_ERROR(cmd, "wrong number of parameters");
   }
 
-  labels = prom_get_labels(tmp_pool);
+  CHECK_CONF(cmd, CONF_ROOT);
 
-  va_start(ap, observed);
-  metric = prom_metric_with_labels(tmp_pool, metric_name, labels, ap);
-  va_end(ap);
+  if (strcasecmp(cmd->argv[1], "default") != 0) {
+    char *ptr = NULL;
 
-  if (metric == NULL) {
-    destroy_pool(tmp_pool);
-    return;
+    level = (int) strtol(cmd->argv[1], &ptr, 10);
+    if ((ptr != NULL && *ptr) ||
+        level < 0 ||
+        level > 9) {
+      CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, "invalid compression level: '",
+        cmd->argv[1], "'", NULL));
+    }
   }
 
-  res = prom_metric_observe(tmp_pool, metric, observed, labels);
-  if (res < 0) {
-    pr_trace_msg(trace_channel, 19, "error observing %s: %s", metric_name,
-      strerror(errno));
+  if (cmd->argc == 3) {
+    if (strcasecmp(cmd->argv[2], "default") == 0) {
+      strategy = PROM_HTTP_COMPRESS_STRATEGY_DEFAULT;
+
+    } else if (strcasecmp(cmd->argv[2], "filtered") == 0) {
+      strategy = PROM_HTTP_COMPRESS_STRATEGY_FILTERED;
+
+    } else if (strcasecmp(cmd->argv[2], "huffman") == 0) {
+      strategy = PROM_HTTP_COMPRESS_STRATEGY_HUFFMAN_ONLY;
+
+    } else if (strcasecmp(cmd->argv[2], "rle") == 0) {
+      strategy = PROM_HTTP_COMPRESS_STRATEGY_RLE;
+
+    } else if (strcasecmp(cmd->argv[2], "fixed") == 0) {
+      strategy = PROM_HTTP_COMPRESS_STRATEGY_FIXED;
+
+    } else {
+      CONF_ERROR(cmd, pstrcat(cmd->tmp_pool,
+        "unknown compression strategy: '", cmd->argv[2], "'", NULL));
+    }
   }
 
-  destroy_pool(tmp_pool);
-}
+  c = add_config_param(cmd->argv[0], 2, NULL, NULL);
+  c->argv[0] = pcalloc(c->pool, sizeof(int));
+  *((int *) c->argv[0]) = level;
+  c->argv[1] = pcalloc(c->pool, sizeof(int));
+  *((int *) c->argv[1]) = strategy;
 
-/* Configuration handlers
- */
+  return PR_HANDLED(cmd);
+}
 
 /* usage: PrometheusEngine on|off */
 MODRET set_prometheusengine(cmd_rec *cmd) {
@@ -745,6 +1089,70 @@ MODRET set_prometheusexporter(cmd_rec *cmd) {
   return PR_HANDLED(cmd);
 }
 
+/* usage: PrometheusExporterWorkers count [max-connections] */
+MODRET set_prometheusexporterworkers(cmd_rec *cmd) {
+  register unsigned int i;
+  unsigned int vals[2] = { 1, 0 };
+  config_rec *c;
+
+  if (cmd->argc < 2 ||
+      cmd->argc > 3) {
+    CONF_ERROR(cmd, "wrong number of parameters");
+  }
+
+  CHECK_CONF(cmd, CONF_ROOT);
+
+  for (i = 1; i < cmd->argc; i++) {
+    char *ptr = NULL;
+    long val;
+
+    val = strtol(cmd->argv[i], &ptr, 10);
+    if ((ptr != NULL && *ptr) ||
+        val < 1 ||
+        (i == 1 && val > PROM_EXPORTER_MAX_WORKERS) ||
+        (i == 2 && val > PROM_HTTP_MAX_CONNECTIONS)) {
+      CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, "invalid parameter: '",
+        cmd->argv[i], "'", NULL));
+    }
+
+    vals[i-1] = (unsigned int) val;
+  }
+
+  c = add_config_param(cmd->argv[0], 2, NULL, NULL);
+  c->argv[0] = pcalloc(c->pool, sizeof(unsigned int));
+  *((unsigned int *) c->argv[0]) = vals[0];
+  c->argv[1] = pcalloc(c->pool, sizeof(unsigned int));
+  *((unsigned int *) c->argv[1]) = vals[1];
+
+  return PR_HANDLED(cmd);
+}
+
+/* usage: PrometheusFlushInterval secs|"off" */
+MODRET set_prometheusflushinterval(cmd_rec *cmd) {
+  int interval = -1;
+  config_rec *c;
+
+  CHECK_ARGS(cmd, 1);
+  CHECK_CONF(cmd, CONF_ROOT);
+
+  if (strcasecmp(cmd->argv[1], "off") != 0) {
+    char *ptr = NULL;
+
+    interval = (int) strtol(cmd->argv[1], &ptr, 10);
+    if ((ptr != NULL && *ptr) ||
+        interval < 0) {
+      CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, "invalid flush interval: '",
+        cmd->argv[1], "'", NULL));
+    }
+  }
+
+  c = add_config_param(cmd->argv[0], 1, NULL);
+  c->argv[0] = pcalloc(c->pool, sizeof(int));
+  *((int *) c->argv[0]) = interval;
+
+  return PR_HANDLED(cmd);
+}
+
 /* usage: PrometheusLog path|"none" */
 MODRET set_prometheuslog(cmd_rec *cmd) {
   CHECK_ARGS(cmd, 1);
@@ -754,6 +1162,37 @@ MODRET set_prometheuslog(cmd_rec *cmd) {
   return PR_HANDLED(cmd);
 }
 
+/* usage: PrometheusNativeHistograms schema|"off" */
+MODRET set_prometheusnativehistograms(cmd_rec *cmd) {
+  int enabled = FALSE, schema = 0;
+  config_rec *c;
+
+  CHECK_ARGS(cmd, 1);
+  CHECK_CONF(cmd, CONF_ROOT);
+
+  if (strcasecmp(cmd->argv[1], "off") != 0) {
+    char *ptr = NULL;
+
+    schema = (int) strtol(cmd->argv[1], &ptr, 10);
+    if ((ptr != NULL && *ptr) ||
+        schema < PROM_METRIC_NATIVE_SCHEMA_MIN ||
+        schema > PROM_METRIC_NATIVE_SCHEMA_MAX) {
+      CONF_ERROR(cmd, pstrcat(cmd->tmp_pool,
+        "invalid native histogram schema: '", cmd->argv[1], "'", NULL));
+    }
+
+    enabled = TRUE;
+  }
+
+  c = add_config_param(cmd->argv[0], 2, NULL, NULL);
+  c->argv[0] = pcalloc(c->pool, sizeof(int));
+  *((int *) c->argv[0]) = enabled;
+  c->argv[1] = pcalloc(c->pool, sizeof(int));
+  *((int *) c->argv[1]) = schema;
+
+  return PR_HANDLED(cmd);
+}
+
 /* usage: PrometheusOptions opt1 ... optN */
 MODRET set_prometheusoptions(cmd_rec *cmd) {
   config_rec *c = NULL;
@@ -772,6 +1211,15 @@ MODRET set_prometheusoptions(cmd_rec *cmd) {
     if (strcasecmp(cmd->argv[i], "EnableLogMessageMetrics") == 0) {
       opts |= PROM_OPT_ENABLE_LOG_MESSAGE_METRICS;
 
+    } else if (strcasecmp(cmd->argv[i], "UseSharedMemory") == 0) {
+      opts |= PROM_OPT_USE_SHARED_MEMORY;
+
+    } else if (strcasecmp(cmd->argv[i], "NoExemplars") == 0) {
+      opts |= PROM_OPT_NO_EXEMPLARS;
+
+    } else if (strcasecmp(cmd->argv[i], "EnableSummaryMetrics") == 0) {
+      opts |= PROM_OPT_ENABLE_SUMMARY_METRICS;
+
     } else {
       CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, ": unknown PrometheusOption '",
         cmd->argv[i], "'", NULL));
@@ -784,6 +1232,93 @@ MODRET set_prometheusoptions(cmd_rec *cmd) {
   return PR_HANDLED(cmd);
 }
 
+/* usage: PrometheusRecordDirectory path */
+MODRET set_prometheusrecorddirectory(cmd_rec *cmd) {
+  struct stat st;
+  char *path;
+
+  CHECK_ARGS(cmd, 1);
+  CHECK_CONF(cmd, CONF_ROOT);
+
+  path = cmd->argv[1];
+  if (*path != '/') {
+    CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, "must be a full path: '", path, "'",
+      NULL));
+  }
+
+  if (stat(path, &st) < 0) {
+    CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, "unable to stat '", path, "': ",
+      strerror(errno), NULL));
+  }
+
+  if (!S_ISDIR(st.st_mode)) {
+    CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, "'", path, "' is not a directory",
+      NULL));
+  }
+
+  (void) add_config_param_str(cmd->argv[0], 1, path);
+  return PR_HANDLED(cmd);
+}
+
+/* usage: PrometheusSnapshotInterval secs|"off" */
+MODRET set_prometheussnapshotinterval(cmd_rec *cmd) {
+  int interval = -1;
+  config_rec *c;
+
+  CHECK_ARGS(cmd, 1);
+  CHECK_CONF(cmd, CONF_ROOT);
+
+  if (strcasecmp(cmd->argv[1], "off") != 0) {
+    char *ptr = NULL;
+
+    interval = (int) strtol(cmd->argv[1], &ptr, 10);
+    if ((ptr != NULL && *ptr) ||
+        interval <= 0) {
+      CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, "invalid snapshot interval: '",
+        cmd->argv[1], "'", NULL));
+    }
+  }
+
+  c = add_config_param(cmd->argv[0], 1, NULL);
+  c->argv[0] = pcalloc(c->pool, sizeof(int));
+  *((int *) c->argv[0]) = interval;
+
+  return PR_HANDLED(cmd);
+}
+
+/* usage: PrometheusUpdateBudget millisecs|"off" */
+MODRET set_prometheusupdatebudget(cmd_rec *cmd) {
+  unsigned long budget = 0;
+  config_rec *c;
+
+  CHECK_ARGS(cmd, 1);
+  CHECK_CONF(cmd, CONF_ROOT);
+
+  if (strcasecmp(cmd->argv[1], "off") != 0) {
+    char *ptr = NULL;
+    double millis;
+
+    millis = strtod(cmd->argv[1], &ptr);
+    if ((ptr != NULL && *ptr) ||
+        millis <= 0.0 ||
+        millis > 60000.0) {
+      CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, "invalid update budget: '",
+        cmd->argv[1], "'", NULL));
+    }
+
+    budget = (unsigned long) (millis * 1000);
+    if (budget == 0) {
+      budget = 1;
+    }
+  }
+
+  c = add_config_param(cmd->argv[0], 1, NULL);
+  c->argv[0] = pcalloc(c->pool, sizeof(unsigned long));
+  *((unsigned long *) c->argv[0]) = budget;
+
+  return PR_HANDLED(cmd);
+}
+
 /* usage: PrometheusTables path */
 MODRET set_prometheustables(cmd_rec *cmd) {
   int res;
@@ -858,79 +1393,251 @@ MODRET set_prometheustables(cmd_rec *cmd) {
           exporter_chroot, "': ", strerror(errno), NULL));
       }
 
-    } else {
-      mode_t dir_mode, expected_mode;
+    } else {
+      mode_t dir_mode, expected_mode;
+
+      dir_mode = st.st_mode;
+      dir_mode &= ~S_IFMT;
+      expected_mode = (S_IXUSR|S_IXGRP|S_IXOTH);
+
+      if (dir_mode != expected_mode) {
+        CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, "directory '", exporter_chroot,
+          "' has incorrect permissions (not 0111 as required)", NULL));
+      }
+    }
+  }
+
+  (void) add_config_param_str(cmd->argv[0], 1, path);
+  return PR_HANDLED(cmd);
+}
+
+/* Command handlers
+ */
+
+/* Command updates use only the base labels. */
+static void prom_cmd_decr(cmd_rec *cmd, enum prom_metric_id metric_id) {
+  const struct prom_metric *metric;
+
+  metric = prometheus_metrics[metric_id];
+  if (metric != NULL) {
+    prom_set_base_labels();
+    prom_record_update(metric_id, metric, PROM_RECORDER_OP_DECR, 1, NULL, 0);
+    prom_metric_decr_values(cmd->tmp_pool, metric, 1, NULL);
+
+  } else {
+    pr_trace_msg(trace_channel, 19, "%s: unregistered metric ID %u requested",
+      (char *) cmd->argv[0], (unsigned int) metric_id);
+  }
+}
+
+static void prom_cmd_incr_type(cmd_rec *cmd, enum prom_metric_id metric_id,
+    int metric_type) {
+  const struct prom_metric *metric;
+
+  metric = prometheus_metrics[metric_id];
+  if (metric != NULL) {
+    prom_set_base_labels();
+    prom_record_update(metric_id, metric,
+      metric_type == PROM_METRIC_TYPE_COUNTER ?
+        PROM_RECORDER_OP_INCR_COUNTER : PROM_RECORDER_OP_INCR_GAUGE, 1,
+      NULL, 0);
+    prom_metric_incr_type_values(cmd->tmp_pool, metric, 1, NULL, metric_type);
+
+  } else {
+    pr_trace_msg(trace_channel, 19, "%s: unregistered metric ID %u requested",
+      (char *) cmd->argv[0], (unsigned int) metric_id);
+  }
+}
+
+static void prom_cmd_observe(cmd_rec *cmd, enum prom_metric_id metric_id,
+    double val) {
+  const struct prom_metric *metric;
+
+  metric = prometheus_metrics[metric_id];
+  if (metric != NULL) {
+    prom_set_base_labels();
+    prom_record_update(metric_id, metric, PROM_RECORDER_OP_OBSERVE, val, NULL,
+      0);
+    prom_metric_observe_values(cmd->tmp_pool, metric, val, NULL);
+
+  } else {
+    pr_trace_msg(trace_channel, 19, "%s: unregistered metric ID %u requested",
+      (char *) cmd->argv[0], (unsigned int) metric_id);
+  }
+}
+
+/* Counts the updates deferred or dropped, since we last looked, because the
+ * database (or shared memory datastore) was busy.
+ */
+static void prom_busy_report(void) {
+  uint64_t deferred = 0, dropped = 0;
+
+  if (prometheus_update_budget == 0 &&
+      prometheus_shm == NULL) {
+    return;
+  }
+
+  if (prom_metric_get_busy_counts(&deferred, &dropped) < 0) {
+    return;
+  }
+
+  if (deferred > prometheus_deferred_count) {
+    prom_event_incr(PROM_METRIC_ID_METRICS_UPDATES_DEFERRED,
+      (uint32_t) (deferred - prometheus_deferred_count), NULL, NULL);
+  }
+
+  if (dropped > prometheus_dropped_count) {
+    prom_event_incr(PROM_METRIC_ID_METRICS_UPDATES_DROPPED,
+      (uint32_t) (dropped - prometheus_dropped_count), NULL, NULL);
+  }
+
+  /* The updates of these counters may themselves be deferred; those are
+   * not counted.
+   */
+  (void) prom_metric_get_busy_counts(&prometheus_deferred_count,
+    &prometheus_dropped_count);
+}
+
+static int prom_deferred_count(void) {
+  if (prometheus_deferred == NULL ||
+      prometheus_deferred == prometheus_buffer) {
+    return 0;
+  }
+
+  return prom_metric_buffer_count(prometheus_deferred);
+}
+
+/* Updates written directly to the database are wrapped in a transaction,
+ * per command.  Buffered (or shared memory) updates need none; the buffer
+ * is written in a transaction of its own, when flushed.
+ */
+static int prom_cmd_use_txn(void) {
+  return (prometheus_buffer == NULL && prometheus_shm == NULL);
+}
+
+static void prom_cmd_begin_txn(void) {
+  if (prom_cmd_use_txn() == TRUE) {
+    prom_db_begin_txn(prometheus_pool, prometheus_dbh, NULL);
+  }
+}
+
+static void prom_cmd_commit_txn(void) {
+  if (prom_cmd_use_txn() == TRUE) {
+    prom_db_commit_txn(prometheus_pool, prometheus_dbh, NULL);
+  }
+}
+
+/* Writes any buffered, or deferred, samples to the database.  Without a
+ * buffer, the caller's per-command transaction, if any, is used.
+ */
+static void prom_buffer_flush(void) {
+  pool *tmp_pool;
+  int res, use_txn;
+
+  if (prometheus_buffer == NULL &&
+      prometheus_deferred == NULL) {
+    return;
+  }
 
-      dir_mode = st.st_mode;
-      dir_mode &= ~S_IFMT;
-      expected_mode = (S_IXUSR|S_IXGRP|S_IXOTH);
+  /* Report any deferred/dropped updates first, so that those counts are
+   * written as well.
+   */
+  prom_busy_report();
 
-      if (dir_mode != expected_mode) {
-        CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, "directory '", exporter_chroot,
-          "' has incorrect permissions (not 0111 as required)", NULL));
-      }
+  if ((prometheus_buffer == NULL ||
+       prom_metric_buffer_count(prometheus_buffer) == 0) &&
+      prom_deferred_count() == 0) {
+    if (prometheus_buffer != NULL) {
+      prometheus_flushed = time(NULL);
     }
+
+    return;
   }
 
-  (void) add_config_param_str(cmd->argv[0], 1, path);
-  return PR_HANDLED(cmd);
-}
+  tmp_pool = make_sub_pool(prometheus_pool);
 
-/* Command handlers
- */
+  use_txn = (prom_cmd_use_txn() == FALSE);
+  if (use_txn) {
+    prom_db_begin_txn(prometheus_pool, prometheus_dbh, NULL);
+  }
 
-static void prom_cmd_decr(cmd_rec *cmd, const char *metric_name,
-    pr_table_t *labels) {
-  const struct prom_metric *metric;
+  if (prometheus_buffer != NULL) {
+    prometheus_flushed = time(NULL);
 
-  metric = prom_registry_get_metric(prometheus_registry, metric_name);
-  if (metric != NULL) {
-    if (labels == NULL) {
-      labels = prom_get_labels(cmd->tmp_pool);
+    if (prom_metric_buffer_count(prometheus_buffer) > 0) {
+      res = prom_metric_buffer_flush(tmp_pool, prometheus_buffer);
+      if (res < 0) {
+        pr_trace_msg(trace_channel, 3, "error flushing buffered samples: %s",
+          strerror(errno));
+      }
     }
+  }
 
-    prom_metric_decr(cmd->tmp_pool, metric, 1, labels);
+  if (prom_deferred_count() > 0) {
+    res = prom_metric_buffer_flush(tmp_pool, prometheus_deferred);
+    if (res < 0) {
+      pr_trace_msg(trace_channel, 3, "error flushing deferred samples: %s",
+        strerror(errno));
+    }
+  }
 
-  } else {
-    pr_trace_msg(trace_channel, 19, "%s: unknown '%s' metric requested",
-      (char *) cmd->argv[0], metric_name);
+  if (use_txn) {
+    prom_db_commit_txn(prometheus_pool, prometheus_dbh, NULL);
   }
+
+  destroy_pool(tmp_pool);
 }
 
-static void prom_cmd_incr_type(cmd_rec *cmd, const char *metric_name,
-    pr_table_t *labels, int metric_type) {
-  const struct prom_metric *metric;
+static int prom_buffer_flush_due(void) {
+  /* Deferred samples are retried after every command. */
+  if (prom_deferred_count() > 0) {
+    return TRUE;
+  }
 
-  metric = prom_registry_get_metric(prometheus_registry, metric_name);
-  if (metric != NULL) {
-    if (labels == NULL) {
-      labels = prom_get_labels(cmd->tmp_pool);
-    }
+  if (prometheus_buffer == NULL ||
+      prom_metric_buffer_count(prometheus_buffer) == 0) {
+    return FALSE;
+  }
 
-    prom_metric_incr_type(cmd->tmp_pool, metric, 1, labels, metric_type);
+  /* An interval of zero means we only flush at the end of transfers, and
+   * of the session.
+   */
+  if (prometheus_flush_interval == 0) {
+    return FALSE;
+  }
 
-  } else {
-    pr_trace_msg(trace_channel, 19, "%s: unknown '%s' metric requested",
-      (char *) cmd->argv[0], metric_name);
+  /* Without an interval, the buffer is only used for the sake of summary
+   * and native histogram bins; it is written after every command.
+   */
+  if (prometheus_flush_interval < 0) {
+    return TRUE;
   }
-}
 
-static void prom_cmd_observe(cmd_rec *cmd, const char *metric_name, double val,
-    pr_table_t *labels) {
-  const struct prom_metric *metric;
+  if ((time(NULL) - prometheus_flushed) < prometheus_flush_interval) {
+    return FALSE;
+  }
 
-  metric = prom_registry_get_metric(prometheus_registry, metric_name);
-  if (metric != NULL) {
-    if (labels == NULL) {
-      labels = prom_get_labels(cmd->tmp_pool);
-    }
+  return TRUE;
+}
 
-    prom_metric_observe(cmd->tmp_pool, metric, val, labels);
+MODRET prom_log_any(cmd_rec *cmd) {
+  if (prometheus_engine == FALSE) {
+    return PR_DECLINED(cmd);
+  }
 
-  } else {
-    pr_trace_msg(trace_channel, 19, "%s: unknown '%s' metric requested",
-      (char *) cmd->argv[0], metric_name);
+  /* Flush buffered samples, if due, once all of the other command handlers
+   * (and their updates) are done.
+   */
+  if (prom_buffer_flush_due() == TRUE) {
+    prom_buffer_flush();
+  }
+
+  /* Shared memory updates are not buffered; report their drops here. */
+  if (prometheus_shm != NULL) {
+    prom_busy_report();
   }
+
+  return PR_DECLINED(cmd);
 }
 
 MODRET prom_pre_list(cmd_rec *cmd) {
@@ -938,24 +1645,25 @@ MODRET prom_pre_list(cmd_rec *cmd) {
     return PR_DECLINED(cmd);
   }
 
-  prom_cmd_incr_type(cmd, "directory_list", NULL, PROM_METRIC_TYPE_GAUGE);
+  prom_cmd_incr_type(cmd, PROM_METRIC_ID_DIRECTORY_LIST,
+    PROM_METRIC_TYPE_GAUGE);
   return PR_DECLINED(cmd);
 }
 
 MODRET prom_log_list(cmd_rec *cmd) {
-  const char *metric_name;
+  enum prom_metric_id metric_id;
 
   if (prometheus_engine == FALSE) {
     return PR_DECLINED(cmd);
   }
 
-  prom_db_begin_txn(prometheus_pool, prometheus_dbh, NULL);
+  prom_cmd_begin_txn();
 
-  metric_name = "directory_list";
-  prom_cmd_incr_type(cmd, metric_name, NULL, PROM_METRIC_TYPE_COUNTER);
-  prom_cmd_decr(cmd, metric_name, NULL);
+  metric_id = PROM_METRIC_ID_DIRECTORY_LIST;
+  prom_cmd_incr_type(cmd, metric_id, PROM_METRIC_TYPE_COUNTER);
+  prom_cmd_decr(cmd, metric_id);
 
-  prom_db_commit_txn(prometheus_pool, prometheus_dbh, NULL);
+  prom_cmd_commit_txn();
   return PR_DECLINED(cmd);
 }
 
@@ -964,13 +1672,13 @@ MODRET prom_err_list(cmd_rec *cmd) {
     return PR_DECLINED(cmd);
   }
 
-  prom_db_begin_txn(prometheus_pool, prometheus_dbh, NULL);
+  prom_cmd_begin_txn();
 
-  prom_cmd_incr_type(cmd, "directory_list_error", NULL,
+  prom_cmd_incr_type(cmd, PROM_METRIC_ID_DIRECTORY_LIST_ERROR,
     PROM_METRIC_TYPE_COUNTER);
-  prom_cmd_decr(cmd, "directory_list", NULL);
+  prom_cmd_decr(cmd, PROM_METRIC_ID_DIRECTORY_LIST);
 
-  prom_db_commit_txn(prometheus_pool, prometheus_dbh, NULL);
+  prom_cmd_commit_txn();
   return PR_DECLINED(cmd);
 }
 
@@ -985,7 +1693,7 @@ MODRET prom_pre_user(cmd_rec *cmd) {
    * Logins end either at successful login, or end of connection.
    */
   if (prometheus_saw_user_cmd == FALSE) {
-    prom_cmd_incr_type(cmd, "login", NULL, PROM_METRIC_TYPE_GAUGE);
+    prom_cmd_incr_type(cmd, PROM_METRIC_ID_LOGIN, PROM_METRIC_TYPE_GAUGE);
     prometheus_saw_user_cmd = TRUE;
     prometheus_saw_pass_cmd = FALSE;
   }
@@ -1009,8 +1717,7 @@ MODRET prom_pre_pass(cmd_rec *cmd) {
 }
 
 MODRET prom_log_pass(cmd_rec *cmd) {
-  const char *metric_name;
-  pr_table_t *labels;
+  enum prom_metric_id metric_id;
   uint64_t now_ms = 0;
 
   if (prometheus_engine == FALSE) {
@@ -1021,26 +1728,24 @@ MODRET prom_log_pass(cmd_rec *cmd) {
     return PR_DECLINED(cmd);
   }
 
-  prom_db_begin_txn(prometheus_pool, prometheus_dbh, NULL);
+  prom_cmd_begin_txn();
 
   /* Easiest way for us to check for anonymous logins is here; the <Anonymous>
    * auth flow does not use the "mod_auth.authentication-code" event.
    */
   if (session.sf_flags & SF_ANON) {
-    prom_event_incr("auth", 1, "method", "anonymous", NULL);
+    prom_event_incr(PROM_METRIC_ID_AUTH, 1, "anonymous", NULL);
   }
 
-  metric_name = "login";
-  labels = prom_get_labels(cmd->tmp_pool);
-
-  prom_cmd_incr_type(cmd, metric_name, labels, PROM_METRIC_TYPE_COUNTER);
-  prom_cmd_decr(cmd, metric_name, labels);
+  metric_id = PROM_METRIC_ID_LOGIN;
+  prom_cmd_incr_type(cmd, metric_id, PROM_METRIC_TYPE_COUNTER);
+  prom_cmd_decr(cmd, metric_id);
 
   pr_gettimeofday_millis(&now_ms);
-  prom_cmd_observe(cmd, metric_name,
-    (double) ((now_ms - prometheus_connected_ms) / 1000), labels);
+  prom_cmd_observe(cmd, metric_id,
+    (double) ((now_ms - prometheus_connected_ms) / 1000));
 
-  prom_db_commit_txn(prometheus_pool, prometheus_dbh, NULL);
+  prom_cmd_commit_txn();
   return PR_DECLINED(cmd);
 }
 
@@ -1049,7 +1754,7 @@ MODRET prom_err_login(cmd_rec *cmd) {
     return PR_DECLINED(cmd);
   }
 
-  prom_cmd_incr_type(cmd, "login_error", NULL, PROM_METRIC_TYPE_COUNTER);
+  prom_cmd_incr_type(cmd, PROM_METRIC_ID_LOGIN_ERROR, PROM_METRIC_TYPE_COUNTER);
 
   /* Note that we never decrement the "login" gauge here.  Why not?  A
    * failed USER or PASS command could happen for multiple reasons (bad
@@ -1066,27 +1771,28 @@ MODRET prom_pre_retr(cmd_rec *cmd) {
     return PR_DECLINED(cmd);
   }
 
-  prom_cmd_incr_type(cmd, "file_download", NULL, PROM_METRIC_TYPE_GAUGE);
+  prom_cmd_incr_type(cmd, PROM_METRIC_ID_FILE_DOWNLOAD, PROM_METRIC_TYPE_GAUGE);
   return PR_DECLINED(cmd);
 }
 
 MODRET prom_log_retr(cmd_rec *cmd) {
-  const char *metric_name;
-  pr_table_t *labels;
+  enum prom_metric_id metric_id;
 
   if (prometheus_engine == FALSE) {
     return PR_DECLINED(cmd);
   }
 
-  prom_db_begin_txn(prometheus_pool, prometheus_dbh, NULL);
+  prom_cmd_begin_txn();
 
-  metric_name = "file_download";
-  labels = prom_get_labels(cmd->tmp_pool);
-  prom_cmd_incr_type(cmd, metric_name, labels, PROM_METRIC_TYPE_COUNTER);
-  prom_cmd_decr(cmd, metric_name, labels);
-  prom_cmd_observe(cmd, metric_name, session.xfer.total_bytes, labels);
+  metric_id = PROM_METRIC_ID_FILE_DOWNLOAD;
+  prom_cmd_incr_type(cmd, metric_id, PROM_METRIC_TYPE_COUNTER);
+  prom_cmd_decr(cmd, metric_id);
+  prom_cmd_observe(cmd, metric_id, session.xfer.total_bytes);
 
-  prom_db_commit_txn(prometheus_pool, prometheus_dbh, NULL);
+  /* Transfers are a natural point at which to flush. */
+  prom_buffer_flush();
+
+  prom_cmd_commit_txn();
   return PR_DECLINED(cmd);
 }
 
@@ -1095,13 +1801,16 @@ MODRET prom_err_retr(cmd_rec *cmd) {
     return PR_DECLINED(cmd);
   }
 
-  prom_db_begin_txn(prometheus_pool, prometheus_dbh, NULL);
+  prom_cmd_begin_txn();
 
-  prom_cmd_incr_type(cmd, "file_download_error", NULL,
+  prom_cmd_incr_type(cmd, PROM_METRIC_ID_FILE_DOWNLOAD_ERROR,
     PROM_METRIC_TYPE_COUNTER);
-  prom_cmd_decr(cmd, "file_download", NULL);
+  prom_cmd_decr(cmd, PROM_METRIC_ID_FILE_DOWNLOAD);
+
+  /* Transfers are a natural point at which to flush. */
+  prom_buffer_flush();
 
-  prom_db_commit_txn(prometheus_pool, prometheus_dbh, NULL);
+  prom_cmd_commit_txn();
   return PR_DECLINED(cmd);
 }
 
@@ -1110,27 +1819,28 @@ MODRET prom_pre_stor(cmd_rec *cmd) {
     return PR_DECLINED(cmd);
   }
 
-  prom_cmd_incr_type(cmd, "file_upload", NULL, PROM_METRIC_TYPE_GAUGE);
+  prom_cmd_incr_type(cmd, PROM_METRIC_ID_FILE_UPLOAD, PROM_METRIC_TYPE_GAUGE);
   return PR_DECLINED(cmd);
 }
 
 MODRET prom_log_stor(cmd_rec *cmd) {
-  const char *metric_name;
-  pr_table_t *labels;
+  enum prom_metric_id metric_id;
 
   if (prometheus_engine == FALSE) {
     return PR_DECLINED(cmd);
   }
 
-  prom_db_begin_txn(prometheus_pool, prometheus_dbh, NULL);
+  prom_cmd_begin_txn();
+
+  metric_id = PROM_METRIC_ID_FILE_UPLOAD;
+  prom_cmd_incr_type(cmd, metric_id, PROM_METRIC_TYPE_COUNTER);
+  prom_cmd_decr(cmd, metric_id);
+  prom_cmd_observe(cmd, metric_id, session.xfer.total_bytes);
 
-  metric_name = "file_upload";
-  labels = prom_get_labels(cmd->tmp_pool);
-  prom_cmd_incr_type(cmd, metric_name, labels, PROM_METRIC_TYPE_COUNTER);
-  prom_cmd_decr(cmd, metric_name, labels);
-  prom_cmd_observe(cmd, metric_name, session.xfer.total_bytes, labels);
+  /* Transfers are a natural point at which to flush. */
+  prom_buffer_flush();
 
-  prom_db_commit_txn(prometheus_pool, prometheus_dbh, NULL);
+  prom_cmd_commit_txn();
   return PR_DECLINED(cmd);
 }
 
@@ -1139,25 +1849,28 @@ MODRET prom_err_stor(cmd_rec *cmd) {
     return PR_DECLINED(cmd);
   }
 
-  prom_db_begin_txn(prometheus_pool, prometheus_dbh, NULL);
+  prom_cmd_begin_txn();
 
-  prom_cmd_incr_type(cmd, "file_upload_error", NULL,
+  prom_cmd_incr_type(cmd, PROM_METRIC_ID_FILE_UPLOAD_ERROR,
     PROM_METRIC_TYPE_COUNTER);
-  prom_cmd_decr(cmd, "file_upload", NULL);
+  prom_cmd_decr(cmd, PROM_METRIC_ID_FILE_UPLOAD);
 
-  prom_db_commit_txn(prometheus_pool, prometheus_dbh, NULL);
+  /* Transfers are a natural point at which to flush. */
+  prom_buffer_flush();
+
+  prom_cmd_commit_txn();
   return PR_DECLINED(cmd);
 }
 
 MODRET prom_log_auth(cmd_rec *cmd) {
-  const char *metric_name;
+  enum prom_metric_id metric_id;
   const struct prom_metric *metric;
 
   if (prometheus_engine == FALSE) {
     return PR_DECLINED(cmd);
   }
 
-  prom_db_begin_txn(prometheus_pool, prometheus_dbh, NULL);
+  prom_cmd_begin_txn();
 
   /* Note: we are not currently properly incrementing
    * session{protocol="ftps"} for FTPS connections accepted using the
@@ -1170,13 +1883,10 @@ MODRET prom_log_auth(cmd_rec *cmd) {
    * increment those counts for implicit FTPS connections.
    */
 
-  metric_name = "tls_protocol";
-  metric = prom_registry_get_metric(prometheus_registry, metric_name);
+  metric_id = PROM_METRIC_ID_TLS_PROTOCOL;
+  metric = prometheus_metrics[metric_id];
   if (metric != NULL) {
-    pr_table_t *labels;
-    const char *tls_version;
-
-    labels = prom_get_labels(cmd->tmp_pool);
+    const char *tls_version, *values[1];
 
     tls_version = pr_table_get(session.notes, "TLS_PROTOCOL", NULL);
     if (tls_version == NULL) {
@@ -1184,18 +1894,17 @@ MODRET prom_log_auth(cmd_rec *cmd) {
       tls_version = pr_env_get(cmd->tmp_pool, "TLS_PROTOCOL");
     }
 
-    if (tls_version != NULL) {
-      (void) pr_table_add_dup(labels, "version", tls_version, 0);
-    }
+    values[0] = tls_version;
 
-    prom_metric_incr(cmd->tmp_pool, metric, 1, labels);
+    prom_set_base_labels();
+    prom_metric_incr_values(cmd->tmp_pool, metric, 1, values);
 
   } else {
-    pr_trace_msg(trace_channel, 19, "%s: unknown '%s' metric requested",
-      (char *) cmd->argv[0], metric_name);
+    pr_trace_msg(trace_channel, 19, "%s: unregistered metric ID %u requested",
+      (char *) cmd->argv[0], (unsigned int) metric_id);
   }
 
-  prom_db_commit_txn(prometheus_pool, prometheus_dbh, NULL);
+  prom_cmd_commit_txn();
   return PR_DECLINED(cmd);
 }
 
@@ -1213,51 +1922,56 @@ static void prom_auth_code_ev(const void *event_data, void *user_data) {
 
   switch (auth_code) {
     case PR_AUTH_OK_NO_PASS:
-      prom_event_incr("auth", 1, "method", session.rfc2228_mech, NULL);
+      prom_event_incr(PROM_METRIC_ID_AUTH, 1, session.rfc2228_mech, NULL);
       break;
 
     case PR_AUTH_RFC2228_OK:
-      prom_event_incr("auth", 1, "method", "certificate", NULL);
+      prom_event_incr(PROM_METRIC_ID_AUTH, 1, "certificate", NULL);
       break;
 
     case PR_AUTH_OK:
-      prom_event_incr("auth", 1, "method", "password", NULL);
+      prom_event_incr(PROM_METRIC_ID_AUTH, 1, "password", NULL);
       break;
 
     case PR_AUTH_NOPWD:
-      prom_event_incr("auth_error", 1, "reason", "unknown user", NULL);
+      prom_event_incr(PROM_METRIC_ID_AUTH_ERROR, 1, NULL, "unknown user");
       break;
 
     case PR_AUTH_BADPWD:
-      prom_event_incr("auth_error", 1, "reason", "bad password", NULL);
+      prom_event_incr(PROM_METRIC_ID_AUTH_ERROR, 1, NULL, "bad password");
       break;
 
     default:
-      prom_event_incr("auth_error", 1, NULL);
+      prom_event_incr(PROM_METRIC_ID_AUTH_ERROR, 1, NULL, NULL);
       break;
   }
 }
 
 static void prom_connect_ev(const void *event_data, void *user_data) {
-  int flags;
   struct prom_dbh *dbh;
 
   /* Close any database handle inherited from our parent, and open a new
    * one, per SQLite3 recommendation.
    *
+   * Note that we only reopen the database here; the daemon process has
+   * already initialized and checked it, and the exporter process handles
+   * any maintenance.  This keeps the connect path cheap, regardless of the
+   * size of the database.
+   *
    * NOTE: session.pool does NOT exist yet.
    */
   (void) prom_db_close(prometheus_pool, prometheus_dbh);
   prometheus_dbh = NULL;
 
-  flags = PROM_DB_OPEN_FL_VACUUM|PROM_DB_OPEN_FL_SKIP_TABLE_INIT;
-  dbh = prom_metric_db_init(prometheus_pool, prometheus_tables_dir, flags);
+  dbh = prom_metric_db_reopen(prometheus_pool, prometheus_tables_dir);
   if (dbh == NULL) {
     pr_trace_msg(trace_channel, 1,
-      "error initializing '%s' metrics db at connect time: %s",
+      "error reopening '%s' metrics db at connect time: %s",
       prometheus_tables_dir, strerror(errno));
 
   } else {
+    prometheus_dbh = dbh;
+
     if (prom_registry_set_dbh(prometheus_registry, dbh) < 0) {
       pr_trace_msg(trace_channel, 3, "error setting registry dbh: %s",
         strerror(errno));
@@ -1270,7 +1984,15 @@ static void prom_exit_ev(const void *event_data, void *user_data) {
     return;
   }
 
-  prom_db_begin_txn(prometheus_pool, prometheus_dbh, NULL);
+  /* The client is done with us, so our final updates, and any deferred
+   * ones, can wait on a busy database as usual.
+   */
+  if (prometheus_update_budget > 0 &&
+      prometheus_dbh != NULL) {
+    (void) prom_db_set_busy_budget(prometheus_dbh, 0);
+  }
+
+  prom_cmd_begin_txn();
 
   switch (session.disconnect_reason) {
     case PR_SESS_DISCONNECT_BANNED:
@@ -1281,17 +2003,17 @@ static void prom_exit_ev(const void *event_data, void *user_data) {
 
       reason = pr_table_get(session.notes, "core.disconnect-details", NULL);
       if (reason != NULL) {
-        prom_event_incr("connection_refused", 1, "reason", reason, NULL);
+        prom_event_incr(PROM_METRIC_ID_CONNECTION_REFUSED, 1, reason, NULL);
 
       } else {
-        prom_event_incr("connection_refused", 1, NULL);
+        prom_event_incr(PROM_METRIC_ID_CONNECTION_REFUSED, 1, NULL, NULL);
       }
       break;
     }
 
     case PR_SESS_DISCONNECT_SEGFAULT:
-      prom_event_decr("connection", 1, NULL);
-      prom_event_incr("segfault", 1, NULL);
+      prom_event_decr(PROM_METRIC_ID_CONNECTION, 1, NULL, NULL);
+      prom_event_incr(PROM_METRIC_ID_SEGFAULT, 1, NULL, NULL);
       break;
 
     default: {
@@ -1300,23 +2022,29 @@ static void prom_exit_ev(const void *event_data, void *user_data) {
       if (prometheus_saw_user_cmd == TRUE &&
           session.user == NULL) {
         /* Login was started, but not completed. */
-        prom_event_decr("login", 1, NULL);
+        prom_event_decr(PROM_METRIC_ID_LOGIN, 1, NULL, NULL);
 
         if (prometheus_saw_pass_cmd == FALSE) {
-          prom_event_incr("auth_error", 1, "reason", "incomplete", NULL);
+          prom_event_incr(PROM_METRIC_ID_AUTH_ERROR, 1, NULL, "incomplete");
         }
       }
 
-      prom_event_decr("connection", 1, NULL);
+      prom_event_decr(PROM_METRIC_ID_CONNECTION, 1, NULL, NULL);
 
       pr_gettimeofday_millis(&now_ms);
-      prom_event_observe("connection",
-        (double) ((now_ms - prometheus_connected_ms) / 1000), NULL);
+      prom_event_observe(PROM_METRIC_ID_CONNECTION,
+        (double) ((now_ms - prometheus_connected_ms) / 1000), NULL, NULL);
       break;
     }
   }
 
-  prom_db_commit_txn(prometheus_pool, prometheus_dbh, NULL);
+  prom_buffer_flush();
+  prom_cmd_commit_txn();
+
+  if (prometheus_recorder != NULL) {
+    (void) prom_recorder_close(prometheus_recorder);
+    prometheus_recorder = NULL;
+  }
 
   prom_http_free();
 
@@ -1327,20 +2055,8 @@ static void prom_exit_ev(const void *event_data, void *user_data) {
 }
 
 static void prom_log_msg_ev(const void *event_data, void *user_data) {
-  pool *tmp_pool;
-  int res;
-  const char *metric_name, *level_text = NULL;
-  const struct prom_metric *metric;
+  const char *level_text = NULL;
   const pr_log_event_t *le;
-  pr_table_t *labels;
-
-  metric_name = "log_message";
-  metric = prom_registry_get_metric(prometheus_registry, metric_name);
-  if (metric == NULL) {
-    pr_trace_msg(trace_channel, 17, "unknown metric name '%s' requested",
-      metric_name);
-    return;
-  }
 
   le = event_data;
   switch (le->log_level) {
@@ -1385,22 +2101,14 @@ static void prom_log_msg_ev(const void *event_data, void *user_data) {
     return;
   }
 
-  if (session.pool != NULL) {
-    tmp_pool = make_sub_pool(session.pool);
-
-  } else {
-    tmp_pool = make_sub_pool(prometheus_pool);
-  }
+  prom_event_incr(PROM_METRIC_ID_LOG_MESSAGE, 1, level_text, NULL);
+}
 
-  labels = prom_get_labels(tmp_pool);
-  (void) pr_table_add_dup(labels, "level", level_text, 0);
-  res = prom_metric_incr(tmp_pool, metric, 1, labels);
-  if (res < 0) {
-    pr_trace_msg(trace_channel, 19, "error increment %s: %s", metric_name,
-      strerror(errno));
+static void prom_shm_close(void) {
+  if (prometheus_shm != NULL) {
+    (void) prom_metric_shm_close(prometheus_pool, prometheus_shm);
+    prometheus_shm = NULL;
   }
-
-  destroy_pool(tmp_pool);
 }
 
 #if defined(PR_SHARED_MODULE)
@@ -1416,20 +2124,56 @@ static void prom_mod_unload_ev(const void *event_data, void *user_data) {
   prometheus_dbh = NULL;
   prometheus_exporter_http = NULL;
 
+  prom_shm_close();
+
   (void) prom_registry_free(prometheus_registry);
   prometheus_registry = NULL;
+  prom_unregister_metrics();
   prometheus_tables_dir = NULL;
 
+  prom_clear_base_labels();
   destroy_pool(prometheus_pool);
   prometheus_pool = NULL;
+  prometheus_event_pool = NULL;
 
   (void) close(prometheus_logfd);
   prometheus_logfd = -1;
 }
 #endif /* PR_SHARED_MODULE */
 
+/* Adds native buckets, if configured, to the metric's histogram.  The
+ * classic buckets remain, for scrapers which do not use native histograms.
+ */
+static void add_native_histogram(struct prom_metric *metric) {
+  if (prometheus_native_histograms == FALSE) {
+    return;
+  }
+
+  if (prom_metric_set_native_histogram(metric,
+      prometheus_native_schema) < 0) {
+    pr_trace_msg(trace_channel, 1,
+      "error adding native histogram to metric '%s': %s",
+      prom_metric_get_name(metric), strerror(errno));
+  }
+}
+
+/* Summaries add series of their own, and a database write (of their sketch
+ * bins) per observation, thus they are only added on request.
+ */
+static void add_summary(struct prom_metric *metric, const char *name,
+    const char *help) {
+  if (!(prometheus_opts & PROM_OPT_ENABLE_SUMMARY_METRICS)) {
+    return;
+  }
+
+  if (prom_metric_add_summary(metric, name, help, 3, 0.5, 0.9, 0.99) < 0) {
+    pr_trace_msg(trace_channel, 1,
+      "error adding summary to metric '%s': %s",
+      prom_metric_get_name(metric), strerror(errno));
+  }
+}
+
 static void create_session_metrics(pool *p, struct prom_dbh *dbh) {
-  int res;
   struct prom_metric *metric;
 
   /* Session metrics:
@@ -1454,20 +2198,14 @@ static void create_session_metrics(pool *p, struct prom_dbh *dbh) {
   metric = prom_metric_create(prometheus_pool, "auth", dbh);
   prom_metric_add_counter(metric, "total",
     "Number of successful authentications");
-  res = prom_registry_add_metric(prometheus_registry, metric);
-  if (res < 0) {
-    pr_trace_msg(trace_channel, 1, "error registering metric '%s': %s",
-      prom_metric_get_name(metric), strerror(errno));
-  }
+  prom_metric_set_label_names(metric, 1, "method");
+  (void) prom_register_metric(PROM_METRIC_ID_AUTH, metric);
 
   metric = prom_metric_create(prometheus_pool, "auth_error", dbh);
   prom_metric_add_counter(metric, "total",
     "Number of failed authentications");
-  res = prom_registry_add_metric(prometheus_registry, metric);
-  if (res < 0) {
-    pr_trace_msg(trace_channel, 1, "error registering metric '%s': %s",
-      prom_metric_get_name(metric), strerror(errno));
-  }
+  prom_metric_set_label_names(metric, 2, "method", "reason");
+  (void) prom_register_metric(PROM_METRIC_ID_AUTH_ERROR, metric);
 
   metric = prom_metric_create(prometheus_pool, "connection", dbh);
   prom_metric_add_counter(metric, "total", "Number of connections");
@@ -1480,30 +2218,19 @@ static void create_session_metrics(pool *p, struct prom_dbh *dbh) {
     "Connection durations in seconds", 11, (double) 1, (double) 5, (double) 10,
     (double) 30, (double) 60, (double) 300, (double) 600, (double) 1800,
     (double) 3600, (double) 21600, (double) 86400);
-  res = prom_registry_add_metric(prometheus_registry, metric);
-  if (res < 0) {
-    pr_trace_msg(trace_channel, 1, "error registering metric '%s': %s",
-      prom_metric_get_name(metric), strerror(errno));
-  }
+  add_native_histogram(metric);
+  (void) prom_register_metric(PROM_METRIC_ID_CONNECTION, metric);
 
   metric = prom_metric_create(prometheus_pool, "directory_list", dbh);
   prom_metric_add_counter(metric, "total",
     "Number of successful directory listings");
   prom_metric_add_gauge(metric, "count", "Current count of directory listings");
-  res = prom_registry_add_metric(prometheus_registry, metric);
-  if (res < 0) {
-    pr_trace_msg(trace_channel, 1, "error registering metric '%s': %s",
-      prom_metric_get_name(metric), strerror(errno));
-  }
+  (void) prom_register_metric(PROM_METRIC_ID_DIRECTORY_LIST, metric);
 
   metric = prom_metric_create(prometheus_pool, "directory_list_error", dbh);
   prom_metric_add_counter(metric, "total",
     "Number of failed directory listings");
-  res = prom_registry_add_metric(prometheus_registry, metric);
-  if (res < 0) {
-    pr_trace_msg(trace_channel, 1, "error registering metric '%s': %s",
-      prom_metric_get_name(metric), strerror(errno));
-  }
+  (void) prom_register_metric(PROM_METRIC_ID_DIRECTORY_LIST_ERROR, metric);
 
   metric = prom_metric_create(prometheus_pool, "file_download", dbh);
   prom_metric_add_counter(metric, "total",
@@ -1518,19 +2245,14 @@ static void create_session_metrics(pool *p, struct prom_dbh *dbh) {
     (double) 102400, (double) 1048576, (double) 10485760, (double) 52428800,
     (double) 104857600, (double) 524288000, (double) 1073741824,
     (double) 107374182400);
-  res = prom_registry_add_metric(prometheus_registry, metric);
-  if (res < 0) {
-    pr_trace_msg(trace_channel, 1, "error registering metric '%s': %s",
-      prom_metric_get_name(metric), strerror(errno));
-  }
+  add_native_histogram(metric);
+  add_summary(metric, "transfer_bytes",
+    "Quantiles of data downloaded in bytes");
+  (void) prom_register_metric(PROM_METRIC_ID_FILE_DOWNLOAD, metric);
 
   metric = prom_metric_create(prometheus_pool, "file_download_error", dbh);
   prom_metric_add_counter(metric, "total", "Number of failed file downloads");
-  res = prom_registry_add_metric(prometheus_registry, metric);
-  if (res < 0) {
-    pr_trace_msg(trace_channel, 1, "error registering metric '%s': %s",
-      prom_metric_get_name(metric), strerror(errno));
-  }
+  (void) prom_register_metric(PROM_METRIC_ID_FILE_DOWNLOAD_ERROR, metric);
 
   metric = prom_metric_create(prometheus_pool, "file_upload", dbh);
   prom_metric_add_counter(metric, "total", "Number of successful file uploads");
@@ -1544,19 +2266,14 @@ static void create_session_metrics(pool *p, struct prom_dbh *dbh) {
     (double) 102400, (double) 1048576, (double) 10485760, (double) 52428800,
     (double) 104857600, (double) 524288000, (double) 1073741824,
     (double) 107374182400);
-  res = prom_registry_add_metric(prometheus_registry, metric);
-  if (res < 0) {
-    pr_trace_msg(trace_channel, 1, "error registering metric '%s': %s",
-      prom_metric_get_name(metric), strerror(errno));
-  }
+  add_native_histogram(metric);
+  add_summary(metric, "transfer_bytes",
+    "Quantiles of data uploaded in bytes");
+  (void) prom_register_metric(PROM_METRIC_ID_FILE_UPLOAD, metric);
 
   metric = prom_metric_create(prometheus_pool, "file_upload_error", dbh);
   prom_metric_add_counter(metric, "total", "Number of failed file uploads");
-  res = prom_registry_add_metric(prometheus_registry, metric);
-  if (res < 0) {
-    pr_trace_msg(trace_channel, 1, "error registering metric '%s': %s",
-      prom_metric_get_name(metric), strerror(errno));
-  }
+  (void) prom_register_metric(PROM_METRIC_ID_FILE_UPLOAD_ERROR, metric);
 
   metric = prom_metric_create(prometheus_pool, "login", dbh);
   prom_metric_add_counter(metric, "total", "Number of successful logins");
@@ -1569,90 +2286,76 @@ static void create_session_metrics(pool *p, struct prom_dbh *dbh) {
     "Delay before login in seconds", 11, (double) 0.01, (double) 0.025,
     (double) 0.05, (double) 0.1, (double) 0.25, (double) 0.5, (double) 1.0,
     (double) 2.5, (double) 5.0, (double) 10.0, (double) 30.0);
-  res = prom_registry_add_metric(prometheus_registry, metric);
-  if (res < 0) {
-    pr_trace_msg(trace_channel, 1, "error registering metric '%s': %s",
-      prom_metric_get_name(metric), strerror(errno));
-  }
+  add_native_histogram(metric);
+  add_summary(metric, "latency_seconds",
+    "Quantiles of delay before login in seconds");
+  (void) prom_register_metric(PROM_METRIC_ID_LOGIN, metric);
 
   metric = prom_metric_create(prometheus_pool, "login_error", dbh);
   prom_metric_add_counter(metric, "total", "Number of failed logins");
-  res = prom_registry_add_metric(prometheus_registry, metric);
-  if (res < 0) {
-    pr_trace_msg(trace_channel, 1, "error registering metric '%s': %s",
-      prom_metric_get_name(metric), strerror(errno));
-  }
+  (void) prom_register_metric(PROM_METRIC_ID_LOGIN_ERROR, metric);
 
   metric = prom_metric_create(prometheus_pool, "timeout", dbh);
   prom_metric_add_counter(metric, "total", "Number of timeouts");
-  res = prom_registry_add_metric(prometheus_registry, metric);
-  if (res < 0) {
-    pr_trace_msg(trace_channel, 1, "error registering metric '%s': %s",
-      prom_metric_get_name(metric), strerror(errno));
-  }
+  prom_metric_set_label_names(metric, 1, "reason");
+  (void) prom_register_metric(PROM_METRIC_ID_TIMEOUT, metric);
 
   metric = prom_metric_create(prometheus_pool, "handshake_error", dbh);
   prom_metric_add_counter(metric, "total",
     "Number of failed SFTP/TLS handshakes");
-  res = prom_registry_add_metric(prometheus_registry, metric);
-  if (res < 0) {
-    pr_trace_msg(trace_channel, 1, "error registering metric '%s': %s",
-      prom_metric_get_name(metric), strerror(errno));
-  }
+  prom_metric_set_label_names(metric, 2, "connection", "protocol");
+  (void) prom_register_metric(PROM_METRIC_ID_HANDSHAKE_ERROR, metric);
 
   metric = prom_metric_create(prometheus_pool, "sftp_protocol", dbh);
   prom_metric_add_counter(metric, "total",
     "Number of SFTP sessions by protocol version");
-  res = prom_registry_add_metric(prometheus_registry, metric);
-  if (res < 0) {
-    pr_trace_msg(trace_channel, 1, "error registering metric '%s': %s",
-      prom_metric_get_name(metric), strerror(errno));
-  }
+  prom_metric_set_label_names(metric, 1, "version");
+  (void) prom_register_metric(PROM_METRIC_ID_SFTP_PROTOCOL, metric);
 
   metric = prom_metric_create(prometheus_pool, "tls_protocol", dbh);
   prom_metric_add_counter(metric, "total",
     "Number of TLS sessions by protocol version");
-  res = prom_registry_add_metric(prometheus_registry, metric);
-  if (res < 0) {
-    pr_trace_msg(trace_channel, 1, "error registering metric '%s': %s",
-      prom_metric_get_name(metric), strerror(errno));
-  }
+  prom_metric_set_label_names(metric, 1, "version");
+  (void) prom_register_metric(PROM_METRIC_ID_TLS_PROTOCOL, metric);
 }
 
 static void create_server_metrics(pool *p, struct prom_dbh *dbh) {
-  int res;
   struct prom_metric *metric;
 
   /* Server metrics:
    *
    *  connection_refused
    *  log_message
+   *  metrics_updates_deferred
+   *  metrics_updates_dropped
    *  segfault
    */
 
   metric = prom_metric_create(prometheus_pool, "connection_refused", dbh);
   prom_metric_add_counter(metric, "total", "Number of refused connections");
-  res = prom_registry_add_metric(prometheus_registry, metric);
-  if (res < 0) {
-    pr_trace_msg(trace_channel, 1, "error registering metric '%s': %s",
-      prom_metric_get_name(metric), strerror(errno));
-  }
+  prom_metric_set_label_names(metric, 1, "reason");
+  (void) prom_register_metric(PROM_METRIC_ID_CONNECTION_REFUSED, metric);
 
   metric = prom_metric_create(prometheus_pool, "log_message", dbh);
   prom_metric_add_counter(metric, "total", "Number of log_messages");
-  res = prom_registry_add_metric(prometheus_registry, metric);
-  if (res < 0) {
-    pr_trace_msg(trace_channel, 1, "error registering metric '%s': %s",
-      prom_metric_get_name(metric), strerror(errno));
-  }
+  prom_metric_set_label_names(metric, 1, "level");
+  (void) prom_register_metric(PROM_METRIC_ID_LOG_MESSAGE, metric);
+
+  metric = prom_metric_create(prometheus_pool, "metrics_updates_deferred",
+    dbh);
+  prom_metric_add_counter(metric, "total",
+    "Number of metric updates deferred due to a busy metrics database");
+  (void) prom_register_metric(PROM_METRIC_ID_METRICS_UPDATES_DEFERRED, metric);
+
+  metric = prom_metric_create(prometheus_pool, "metrics_updates_dropped",
+    dbh);
+  prom_metric_add_counter(metric, "total",
+    "Number of metric updates dropped due to a busy metrics datastore");
+  (void) prom_register_metric(PROM_METRIC_ID_METRICS_UPDATES_DROPPED, metric);
 
   metric = prom_metric_create(prometheus_pool, "segfault", dbh);
   prom_metric_add_counter(metric, "total", "Number of segfaults");
-  res = prom_registry_add_metric(prometheus_registry, metric);
-  if (res < 0) {
-    pr_trace_msg(trace_channel, 1, "error registering metric '%s': %s",
-      prom_metric_get_name(metric), strerror(errno));
-  }
+  (void) prom_register_metric(PROM_METRIC_ID_SEGFAULT, metric);
 }
 
 static void create_metrics(struct prom_dbh *dbh) {
@@ -1665,12 +2368,8 @@ static void create_metrics(struct prom_dbh *dbh) {
 
   metric = prom_metric_create(prometheus_pool, "build_info", dbh);
   prom_metric_add_counter(metric, NULL, "ProFTPD build information");
-  res = prom_registry_add_metric(prometheus_registry, metric);
-  if (res < 0) {
-    pr_trace_msg(trace_channel, 1, "error registering metric '%s': %s",
-      prom_metric_get_name(metric), strerror(errno));
-
-  } else {
+  res = prom_register_metric(PROM_METRIC_ID_BUILD_INFO, metric);
+  if (res == 0) {
     pr_table_t *labels;
 
     labels = pr_table_nalloc(tmp_pool, 0, 2);
@@ -1688,12 +2387,8 @@ static void create_metrics(struct prom_dbh *dbh) {
   metric = prom_metric_create(prometheus_pool, "startup_time", dbh);
   prom_metric_add_counter(metric, NULL,
     "ProFTPD startup time, in unixtime seconds");
-  res = prom_registry_add_metric(prometheus_registry, metric);
-  if (res < 0) {
-    pr_trace_msg(trace_channel, 1, "error registering metric '%s': %s",
-      prom_metric_get_name(metric), strerror(errno));
-
-  } else {
+  res = prom_register_metric(PROM_METRIC_ID_STARTUP_TIME, metric);
+  if (res == 0) {
     time_t now;
 
     now = time(NULL);
@@ -1766,6 +2461,30 @@ static void prom_postparse_ev(const void *event_data, void *user_data) {
 
   prometheus_registry = prom_registry_init(prometheus_pool, "proftpd");
 
+  if (prometheus_opts & PROM_OPT_USE_SHARED_MEMORY) {
+    /* Create the shared memory datastore now, before any session processes
+     * (or the exporter process) are forked, so that they all inherit the
+     * same mapping.
+     */
+    prometheus_shm = prom_metric_shm_init(prometheus_pool,
+      prometheus_tables_dir, PROM_METRIC_SHM_DEFAULT_MAX_SAMPLES);
+    if (prometheus_shm == NULL) {
+      pr_log_pri(PR_LOG_NOTICE, MOD_PROMETHEUS_VERSION
+        ": unable to create shared memory metrics datastore, using "
+        "database: %s", strerror(errno));
+
+    } else {
+      (void) prom_registry_set_shm(prometheus_registry, prometheus_shm);
+    }
+  }
+
+  c = find_config(main_server->conf, CONF_PARAM, "PrometheusNativeHistograms",
+    FALSE);
+  if (c != NULL) {
+    prometheus_native_histograms = *((int *) c->argv[0]);
+    prometheus_native_schema = *((int *) c->argv[1]);
+  }
+
   /* Create our known metrics, and register them. */
   create_metrics(prometheus_dbh);
 
@@ -1780,6 +2499,8 @@ static void prom_postparse_ev(const void *event_data, void *user_data) {
 
     prom_registry_free(prometheus_registry);
     prometheus_registry = NULL;
+    prom_unregister_metrics();
+    prom_shm_close();
 
     return;
   }
@@ -1790,6 +2511,8 @@ static void prom_postparse_ev(const void *event_data, void *user_data) {
 
     prom_registry_free(prometheus_registry);
     prometheus_registry = NULL;
+    prom_unregister_metrics();
+    prom_shm_close();
 
     pr_log_pri(PR_LOG_ERR, MOD_PROMETHEUS_VERSION
       ": unable to initialize HTTP API, failing to start up: %s",
@@ -1820,6 +2543,8 @@ static void prom_postparse_ev(const void *event_data, void *user_data) {
 
     prom_registry_free(prometheus_registry);
     prometheus_registry = NULL;
+    prom_unregister_metrics();
+    prom_shm_close();
   }
 }
 
@@ -1839,7 +2564,9 @@ static void prom_restart_ev(const void *event_data, void *user_data) {
 
   (void) prom_registry_free(prometheus_registry);
   prometheus_registry = NULL;
+  prom_unregister_metrics();
   prometheus_tables_dir = NULL;
+  prom_shm_close();
 
   /* Close the PrometheusLog file descriptor; it will be reopened in the
    * postparse event listener.
@@ -1853,9 +2580,12 @@ static void prom_shutdown_ev(const void *event_data, void *user_data) {
 
   (void) prom_db_close(prometheus_pool, prometheus_dbh);
   prometheus_dbh = NULL;
+  prom_shm_close();
 
+  prom_clear_base_labels();
   destroy_pool(prometheus_pool);
   prometheus_pool = NULL;
+  prometheus_event_pool = NULL;
 
   (void) close(prometheus_logfd);
   prometheus_logfd = -1;
@@ -1879,7 +2609,7 @@ static void prom_timeout_idle_ev(const void *event_data, void *user_data) {
     return;
   }
 
-  prom_event_incr("timeout", 1, "reason", "TimeoutIdle", NULL);
+  prom_event_incr(PROM_METRIC_ID_TIMEOUT, 1, "TimeoutIdle", NULL);
 }
 
 static void prom_timeout_login_ev(const void *event_data, void *user_data) {
@@ -1887,7 +2617,7 @@ static void prom_timeout_login_ev(const void *event_data, void *user_data) {
     return;
   }
 
-  prom_event_incr("timeout", 1, "reason", "TimeoutLogin", NULL);
+  prom_event_incr(PROM_METRIC_ID_TIMEOUT, 1, "TimeoutLogin", NULL);
 }
 
 static void prom_timeout_noxfer_ev(const void *event_data, void *user_data) {
@@ -1895,7 +2625,7 @@ static void prom_timeout_noxfer_ev(const void *event_data, void *user_data) {
     return;
   }
 
-  prom_event_incr("timeout", 1, "reason", "TimeoutNoTransfer", NULL);
+  prom_event_incr(PROM_METRIC_ID_TIMEOUT, 1, "TimeoutNoTransfer", NULL);
 }
 
 static void prom_timeout_session_ev(const void *event_data, void *user_data) {
@@ -1903,7 +2633,7 @@ static void prom_timeout_session_ev(const void *event_data, void *user_data) {
     return;
   }
 
-  prom_event_incr("timeout", 1, "reason", "TimeoutSession", NULL);
+  prom_event_incr(PROM_METRIC_ID_TIMEOUT, 1, "TimeoutSession", NULL);
 }
 
 static void prom_timeout_stalled_ev(const void *event_data, void *user_data) {
@@ -1911,7 +2641,7 @@ static void prom_timeout_stalled_ev(const void *event_data, void *user_data) {
     return;
   }
 
-  prom_event_incr("timeout", 1, "reason", "TimeoutStalled", NULL);
+  prom_event_incr(PROM_METRIC_ID_TIMEOUT, 1, "TimeoutStalled", NULL);
 }
 
 /* mod_tls-generated events */
@@ -1925,8 +2655,7 @@ static void prom_tls_ctrl_handshake_err_ev(const void *event_data,
    * Otherwise, it would show up as "ftp", since the TLS handshake did
    * not actually succeed, and that "ftp" label would be surprising.
    */
-  prom_event_incr("handshake_error", 1, "connection", "ctrl",
-    "protocol", "ftps", NULL);
+  prom_event_incr(PROM_METRIC_ID_HANDSHAKE_ERROR, 1, "ctrl", "ftps");
 }
 
 static void prom_tls_data_handshake_err_ev(const void *event_data,
@@ -1935,7 +2664,7 @@ static void prom_tls_data_handshake_err_ev(const void *event_data,
     return;
   }
 
-  prom_event_incr("handshake_error", 1, "connection", "data", NULL);
+  prom_event_incr(PROM_METRIC_ID_HANDSHAKE_ERROR, 1, "data", NULL);
 }
 
 /* mod_sftp-generated events */
@@ -1944,7 +2673,7 @@ static void prom_ssh2_kex_err_ev(const void *event_data, void *user_data) {
     return;
   }
 
-  prom_event_incr("handshake_error", 1, NULL);
+  prom_event_incr(PROM_METRIC_ID_HANDSHAKE_ERROR, 1, NULL, NULL);
 }
 
 static void prom_ssh2_auth_hostbased_ev(const void *event_data,
@@ -1953,7 +2682,7 @@ static void prom_ssh2_auth_hostbased_ev(const void *event_data,
     return;
   }
 
-  prom_event_incr("auth", 1, "method", "hostbased", NULL);
+  prom_event_incr(PROM_METRIC_ID_AUTH, 1, "hostbased", NULL);
 }
 
 static void prom_ssh2_auth_hostbased_err_ev(const void *event_data,
@@ -1962,7 +2691,7 @@ static void prom_ssh2_auth_hostbased_err_ev(const void *event_data,
     return;
   }
 
-  prom_event_incr("auth_error", 1, "method", "hostbased", NULL);
+  prom_event_incr(PROM_METRIC_ID_AUTH_ERROR, 1, "hostbased", NULL);
 }
 
 static void prom_ssh2_auth_kbdint_ev(const void *event_data,
@@ -1971,7 +2700,7 @@ static void prom_ssh2_auth_kbdint_ev(const void *event_data,
     return;
   }
 
-  prom_event_incr("auth", 1, "method", "keyboard-interactive", NULL);
+  prom_event_incr(PROM_METRIC_ID_AUTH, 1, "keyboard-interactive", NULL);
 }
 
 static void prom_ssh2_auth_kbdint_err_ev(const void *event_data,
@@ -1980,7 +2709,7 @@ static void prom_ssh2_auth_kbdint_err_ev(const void *event_data,
     return;
   }
 
-  prom_event_incr("auth_error", 1, "method", "keyboard-interactive", NULL);
+  prom_event_incr(PROM_METRIC_ID_AUTH_ERROR, 1, "keyboard-interactive", NULL);
 }
 
 static void prom_ssh2_auth_passwd_ev(const void *event_data,
@@ -1989,7 +2718,7 @@ static void prom_ssh2_auth_passwd_ev(const void *event_data,
     return;
   }
 
-  prom_event_incr("auth", 1, "method", "password", NULL);
+  prom_event_incr(PROM_METRIC_ID_AUTH, 1, "password", NULL);
 }
 
 static void prom_ssh2_auth_passwd_err_ev(const void *event_data,
@@ -1998,7 +2727,7 @@ static void prom_ssh2_auth_passwd_err_ev(const void *event_data,
     return;
   }
 
-  prom_event_incr("auth_error", 1, "method", "password", NULL);
+  prom_event_incr(PROM_METRIC_ID_AUTH_ERROR, 1, "password", NULL);
 }
 
 static void prom_ssh2_auth_publickey_ev(const void *event_data,
@@ -2007,7 +2736,7 @@ static void prom_ssh2_auth_publickey_ev(const void *event_data,
     return;
   }
 
-  prom_event_incr("auth", 1, "method", "publickey", NULL);
+  prom_event_incr(PROM_METRIC_ID_AUTH, 1, "publickey", NULL);
 }
 
 static void prom_ssh2_auth_publickey_err_ev(const void *event_data,
@@ -2016,7 +2745,7 @@ static void prom_ssh2_auth_publickey_err_ev(const void *event_data,
     return;
   }
 
-  prom_event_incr("auth_error", 1, "method", "publickey", NULL);
+  prom_event_incr(PROM_METRIC_ID_AUTH_ERROR, 1, "publickey", NULL);
 }
 
 static void prom_ssh2_sftp_proto_version_ev(const void *event_data,
@@ -2036,19 +2765,19 @@ static void prom_ssh2_sftp_proto_version_ev(const void *event_data,
 
   switch (protocol_version) {
     case 3:
-      prom_event_incr("sftp_protocol", 1, "version", "3", NULL);
+      prom_event_incr(PROM_METRIC_ID_SFTP_PROTOCOL, 1, "3", NULL);
       break;
 
     case 4:
-      prom_event_incr("sftp_protocol", 1, "version", "4", NULL);
+      prom_event_incr(PROM_METRIC_ID_SFTP_PROTOCOL, 1, "4", NULL);
       break;
 
     case 5:
-      prom_event_incr("sftp_protocol", 1, "version", "5", NULL);
+      prom_event_incr(PROM_METRIC_ID_SFTP_PROTOCOL, 1, "5", NULL);
       break;
 
     case 6:
-      prom_event_incr("sftp_protocol", 1, "version", "6", NULL);
+      prom_event_incr(PROM_METRIC_ID_SFTP_PROTOCOL, 1, "6", NULL);
       break;
 
     default:
@@ -2099,7 +2828,7 @@ static int prom_init(void) {
 
 static int prom_sess_init(void) {
   config_rec *c;
-  const char *metric_name;
+  enum prom_metric_id metric_id;
   const struct prom_metric *metric;
 
   if (prometheus_engine == FALSE) {
@@ -2118,6 +2847,110 @@ static int prom_sess_init(void) {
     c = find_config_next(c, c->next, CONF_PARAM, "PrometheusOptions", FALSE);
   }
 
+  c = find_config(main_server->conf, CONF_PARAM, "PrometheusFlushInterval",
+    FALSE);
+  if (c != NULL) {
+    prometheus_flush_interval = *((int *) c->argv[0]);
+  }
+
+  /* Note that with the shared memory datastore, updates are cheap enough
+   * that we do not need to buffer them.  Summary and native histogram bins,
+   * however, are always kept in the database, thus are always buffered;
+   * without a flush interval, the buffer is then written after every
+   * command, along with that command's other updates.
+   */
+  if (prometheus_dbh != NULL &&
+      ((prometheus_flush_interval >= 0 && prometheus_shm == NULL) ||
+       (prometheus_opts & PROM_OPT_ENABLE_SUMMARY_METRICS) ||
+       prometheus_native_histograms == TRUE)) {
+    prometheus_buffer = prom_metric_buffer_create(prometheus_pool,
+      prometheus_dbh);
+    if (prometheus_buffer != NULL) {
+      (void) prom_registry_set_buffer(prometheus_registry, prometheus_buffer);
+      prometheus_flushed = time(NULL);
+
+    } else {
+      pr_trace_msg(trace_channel, 3, "error creating metrics buffer: %s",
+        strerror(errno));
+    }
+  }
+
+  c = find_config(main_server->conf, CONF_PARAM, "PrometheusUpdateBudget",
+    FALSE);
+  if (c != NULL) {
+    prometheus_update_budget = *((unsigned long *) c->argv[0]);
+  }
+
+  /* Counter increments and histogram observations which cannot be written
+   * within the update budget are deferred, using the write-behind buffer,
+   * if any; other updates are dropped.
+   */
+  if (prometheus_update_budget > 0 &&
+      prometheus_shm == NULL &&
+      prometheus_dbh != NULL) {
+    (void) prom_db_set_busy_budget(prometheus_dbh, prometheus_update_budget);
+
+    prometheus_deferred = prometheus_buffer;
+    if (prometheus_deferred == NULL) {
+      prometheus_deferred = prom_metric_buffer_create(prometheus_pool,
+        prometheus_dbh);
+    }
+
+    if (prometheus_deferred != NULL) {
+      (void) prom_registry_set_deferred(prometheus_registry,
+        prometheus_deferred);
+
+    } else {
+      pr_trace_msg(trace_channel, 3, "error creating deferred buffer: %s",
+        strerror(errno));
+    }
+  }
+
+  /* Histogram observations carry this session's PID (and ID, if known) as
+   * their exemplar, for OpenMetrics scrapes.
+   */
+  if (!(prometheus_opts & PROM_OPT_NO_EXEMPLARS)) {
+    pr_table_t *exemplar_labels;
+    const char *unique_id;
+    char pid_str[32];
+
+    exemplar_labels = pr_table_nalloc(session.pool, 0, 2);
+
+    memset(pid_str, '\0', sizeof(pid_str));
+    snprintf(pid_str, sizeof(pid_str)-1, "%lu", (unsigned long) getpid());
+    (void) pr_table_add_dup(exemplar_labels, "pid", pid_str, 0);
+
+    unique_id = pr_table_get(session.notes, "UNIQUE_ID", NULL);
+    if (unique_id != NULL) {
+      (void) pr_table_add_dup(exemplar_labels, "session_id", unique_id, 0);
+    }
+
+    if (prom_metric_set_exemplar_labels(prometheus_pool,
+        exemplar_labels) < 0) {
+      pr_trace_msg(trace_channel, 3, "error setting exemplar labels: %s",
+        strerror(errno));
+    }
+  }
+
+  /* Open this session's trace now, before any chroot. */
+  c = find_config(main_server->conf, CONF_PARAM, "PrometheusRecordDirectory",
+    FALSE);
+  if (c != NULL) {
+    const char *path;
+    char trace_name[64];
+
+    memset(trace_name, '\0', sizeof(trace_name));
+    snprintf(trace_name, sizeof(trace_name)-1, "%lu-%lu.trace",
+      (unsigned long) time(NULL), (unsigned long) getpid());
+    path = pdircat(session.pool, c->argv[0], trace_name, NULL);
+
+    prometheus_recorder = prom_recorder_open(prometheus_pool, path);
+    if (prometheus_recorder == NULL) {
+      pr_trace_msg(trace_channel, 3, "error opening trace '%s': %s", path,
+        strerror(errno));
+    }
+  }
+
   pr_event_register(&prometheus_module, "core.timeout-idle",
     prom_timeout_idle_ev, NULL);
   pr_event_register(&prometheus_module, "core.timeout-login",
@@ -2177,22 +3010,23 @@ static int prom_sess_init(void) {
       prom_ssh2_sftp_proto_version_ev, NULL);
   }
 
-  metric_name = "connection";
-  metric = prom_registry_get_metric(prometheus_registry, metric_name);
+  metric_id = PROM_METRIC_ID_CONNECTION;
+  metric = prometheus_metrics[metric_id];
   if (metric != NULL) {
-    pool *tmp_pool;
-    pr_table_t *labels;
-
     pr_gettimeofday_millis(&prometheus_connected_ms);
 
-    tmp_pool = make_sub_pool(session.pool);
-    labels = prom_get_labels(tmp_pool);
-    prom_metric_incr(tmp_pool, metric, 1, labels);
-    destroy_pool(tmp_pool);
+    prom_set_base_labels();
+    prom_record_update(metric_id, metric, PROM_RECORDER_OP_INCR, 1, NULL, 0);
+    prom_metric_incr_values(session.pool, metric, 1, NULL);
+
+    /* Write the connection now, rather than at the first flush, so that
+     * the gauge counts it for as long as the session lasts.
+     */
+    prom_buffer_flush();
 
   } else {
-    pr_trace_msg(trace_channel, 19, "CONNECT: unknown '%s' metric requested",
-      metric_name);
+    pr_trace_msg(trace_channel, 19,
+      "CONNECT: unregistered metric ID %u requested", (unsigned int) metric_id);
   }
 
   return 0;
@@ -2202,11 +3036,18 @@ static int prom_sess_init(void) {
  */
 
 static conftable prometheus_conftab[] = {
+  { "PrometheusCompression",	set_prometheuscompression,	NULL },
   { "PrometheusEngine",		set_prometheusengine,		NULL },
   { "PrometheusExporter",	set_prometheusexporter,		NULL },
+  { "PrometheusExporterWorkers",	set_prometheusexporterworkers,	NULL },
+  { "PrometheusFlushInterval",	set_prometheusflushinterval,	NULL },
   { "PrometheusLog",		set_prometheuslog,		NULL },
+  { "PrometheusNativeHistograms",	set_prometheusnativehistograms,	NULL },
   { "PrometheusOptions",	set_prometheusoptions,		NULL },
+  { "PrometheusRecordDirectory",	set_prometheusrecorddirectory,	NULL },
+  { "PrometheusSnapshotInterval",	set_prometheussnapshotinterval,	NULL },
   { "PrometheusTables",		set_prometheustables,		NULL },
+  { "PrometheusUpdateBudget",	set_prometheusupdatebudget,	NULL },
   { NULL }
 };
 
@@ -2244,6 +3085,10 @@ static cmdtable prometheus_cmdtab[] = {
   /* For mod_tls */
   { LOG_CMD,		C_AUTH,	G_NONE,	prom_log_auth,	FALSE,	FALSE },
 
+  /* For flushing buffered samples */
+  { LOG_CMD,		C_ANY,	G_NONE,	prom_log_any,	FALSE,	FALSE },
+  { LOG_CMD_ERR,	C_ANY,	G_NONE,	prom_log_any,	FALSE,	FALSE },
+
   { 0, NULL }
 };
 
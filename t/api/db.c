@@ -782,6 +782,226 @@ START_TEST (db_exec_prepared_stmt_test) {
 }
 END_TEST
 
+START_TEST (db_exec_prepared_write_test) {
+  int res;
+  array_header *results;
+  const char *table_path, *schema_name, *stmt, *errstr = NULL;
+  struct prom_dbh *dbh;
+
+  mark_point();
+  res = prom_db_exec_prepared_write(NULL, NULL, NULL, NULL);
+  ck_assert_msg(res < 0, "Failed to handle null pool");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got '%s' (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  res = prom_db_exec_prepared_write(p, NULL, NULL, NULL);
+  ck_assert_msg(res < 0, "Failed to handle null dbh");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got '%s' (%d)", EINVAL,
+    strerror(errno), errno);
+
+  (void) unlink(db_test_table);
+  table_path = db_test_table;
+  schema_name = "prometheus_test";
+
+  mark_point();
+  dbh = prom_db_open(p, table_path, schema_name);
+  ck_assert_msg(dbh != NULL, "Failed to open table '%s': %s", table_path,
+    strerror(errno));
+
+  mark_point();
+  res = prom_db_exec_prepared_write(p, dbh, NULL, NULL);
+  ck_assert_msg(res < 0, "Failed to handle null statement");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got '%s' (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  stmt = "INSERT INTO foo (id, name) VALUES (1, 'one');";
+  res = prom_db_exec_prepared_write(p, dbh, stmt, &errstr);
+  ck_assert_msg(res < 0, "Failed to handle unprepared statement");
+  ck_assert_msg(errno == ENOENT, "Expected ENOENT (%d), got '%s' (%d)", ENOENT,
+    strerror(errno), errno);
+
+  res = create_table(p, dbh, "foo");
+  ck_assert_msg(res == 0, "Failed to create table 'foo': %s", strerror(errno));
+
+  mark_point();
+  res = prom_db_prepare_stmt(p, dbh, stmt);
+  ck_assert_msg(res == 0, "Failed to prepare statement '%s': %s", stmt,
+    strerror(errno));
+
+  mark_point();
+  res = prom_db_exec_prepared_write(p, dbh, stmt, &errstr);
+  ck_assert_msg(res == 0,
+    "Failed to execute prepared statement '%s': %s (%s)", stmt, errstr,
+    strerror(errno));
+
+  stmt = "SELECT name FROM foo WHERE id = 1;";
+  res = prom_db_prepare_stmt(p, dbh, stmt);
+  ck_assert_msg(res == 0, "Failed to prepare statement '%s': %s", stmt,
+    strerror(errno));
+
+  results = prom_db_exec_prepared_stmt(p, dbh, stmt, &errstr);
+  ck_assert_msg(results != NULL,
+    "Failed to execute prepared statement '%s': %s (%s)", stmt, errstr,
+    strerror(errno));
+  ck_assert_msg(results->nelts == 1, "Expected 1 result, got %d",
+    results->nelts);
+  ck_assert_msg(strcmp(((char **) results->elts)[0], "one") == 0,
+    "Expected 'one', got '%s'", ((char **) results->elts)[0]);
+
+  res = prom_db_close(p, dbh);
+  ck_assert_msg(res == 0, "Failed to close database: %s", strerror(errno));
+
+  (void) unlink(db_test_table);
+}
+END_TEST
+
+struct rows_test_data {
+  int row_count;
+  int64_t id;
+  double val;
+  char name[32];
+  int stop;
+};
+
+static int rows_test_cb(struct prom_db_row *row, void *user_data) {
+  struct rows_test_data *data;
+  const char *text;
+  size_t textlen = 0;
+  int64_t ignored = 0;
+
+  data = user_data;
+  data->row_count++;
+
+  if (data->stop == TRUE) {
+    errno = EINTR;
+    return -1;
+  }
+
+  if (prom_db_row_get_int64(row, 0, &(data->id)) < 0 ||
+      prom_db_row_get_double(row, 0, &(data->val)) < 0) {
+    return -1;
+  }
+
+  text = prom_db_row_get_text(row, 1, &textlen);
+  if (text == NULL ||
+      textlen >= sizeof(data->name)) {
+    return -1;
+  }
+  memcpy(data->name, text, textlen);
+
+  /* Out-of-range columns are rejected. */
+  if (prom_db_row_get_int64(row, 2, &ignored) == 0 ||
+      errno != EINVAL) {
+    return -1;
+  }
+
+  return 0;
+}
+
+START_TEST (db_exec_prepared_stmt_rows_test) {
+  int res;
+  const char *table_path, *schema_name, *stmt, *errstr = NULL;
+  int64_t id;
+  struct prom_dbh *dbh;
+  struct rows_test_data data;
+
+  mark_point();
+  res = prom_db_exec_prepared_stmt_rows(NULL, NULL, NULL, NULL, NULL, NULL);
+  ck_assert_msg(res < 0, "Failed to handle null pool");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got '%s' (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  res = prom_db_exec_prepared_stmt_rows(p, NULL, NULL, NULL, NULL, NULL);
+  ck_assert_msg(res < 0, "Failed to handle null dbh");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got '%s' (%d)", EINVAL,
+    strerror(errno), errno);
+
+  (void) unlink(db_test_table);
+  table_path = db_test_table;
+  schema_name = "prometheus_test";
+
+  mark_point();
+  dbh = prom_db_open(p, table_path, schema_name);
+  ck_assert_msg(dbh != NULL, "Failed to open table '%s': %s", table_path,
+    strerror(errno));
+
+  res = create_table(p, dbh, "foo");
+  ck_assert_msg(res == 0, "Failed to create table 'foo': %s", strerror(errno));
+
+  mark_point();
+  stmt = "SELECT id, name FROM foo;";
+  res = prom_db_exec_prepared_stmt_rows(p, dbh, stmt, NULL, NULL, NULL);
+  ck_assert_msg(res < 0, "Failed to handle null callback");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got '%s' (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  memset(&data, 0, sizeof(data));
+  res = prom_db_exec_prepared_stmt_rows(p, dbh, stmt, rows_test_cb, &data,
+    &errstr);
+  ck_assert_msg(res < 0, "Failed to handle unprepared statement");
+  ck_assert_msg(errno == ENOENT, "Expected ENOENT (%d), got '%s' (%d)", ENOENT,
+    strerror(errno), errno);
+
+  /* Make sure that 64-bit values survive binding. */
+  mark_point();
+  stmt = "INSERT INTO foo (id, name) VALUES (?, 'bar');";
+  res = prom_db_prepare_stmt(p, dbh, stmt);
+  ck_assert_msg(res == 0, "Failed to prepare statement '%s': %s", stmt,
+    strerror(errno));
+
+  id = ((int64_t) 1) << 40;
+  res = prom_db_bind_stmt(p, dbh, stmt, 1, PROM_DB_BIND_TYPE_INT64,
+    (void *) &id);
+  ck_assert_msg(res == 0, "Failed to bind INT64 value: %s", strerror(errno));
+
+  ck_assert_msg(prom_db_exec_prepared_stmt(p, dbh, stmt, &errstr) != NULL,
+    "Failed to execute statement '%s': %s", stmt, errstr);
+
+  mark_point();
+  stmt = "SELECT id, name FROM foo;";
+  res = prom_db_prepare_stmt(p, dbh, stmt);
+  ck_assert_msg(res == 0, "Failed to prepare statement '%s': %s", stmt,
+    strerror(errno));
+
+  memset(&data, 0, sizeof(data));
+  res = prom_db_exec_prepared_stmt_rows(p, dbh, stmt, rows_test_cb, &data,
+    &errstr);
+  ck_assert_msg(res == 1, "Expected 1 row, got %d (%s)", res,
+    strerror(errno));
+  ck_assert_msg(data.id == id, "Expected id %lld, got %lld", (long long) id,
+    (long long) data.id);
+  ck_assert_msg(data.val == (double) id, "Expected value %g, got %g",
+    (double) id, data.val);
+  ck_assert_msg(strcmp(data.name, "bar") == 0, "Expected 'bar', got '%s'",
+    data.name);
+
+  /* Callback errors stop the iteration. */
+  mark_point();
+  res = prom_db_prepare_stmt(p, dbh, stmt);
+  ck_assert_msg(res == 0, "Failed to prepare statement '%s': %s", stmt,
+    strerror(errno));
+
+  memset(&data, 0, sizeof(data));
+  data.stop = TRUE;
+  res = prom_db_exec_prepared_stmt_rows(p, dbh, stmt, rows_test_cb, &data,
+    &errstr);
+  ck_assert_msg(res < 0, "Failed to handle callback error");
+  ck_assert_msg(errno == EINTR, "Expected EINTR (%d), got '%s' (%d)", EINTR,
+    strerror(errno), errno);
+  ck_assert_msg(data.row_count == 1, "Expected 1 row, got %d",
+    data.row_count);
+
+  res = prom_db_close(p, dbh);
+  ck_assert_msg(res == 0, "Failed to close database: %s", strerror(errno));
+
+  (void) unlink(db_test_table);
+}
+END_TEST
+
 START_TEST (db_reindex_test) {
   int res;
   const char *table_path, *schema_name, *index_name, *errstr = NULL;
@@ -873,6 +1093,166 @@ START_TEST (db_last_row_id_test) {
 }
 END_TEST
 
+START_TEST (db_get_change_counter_test) {
+  int res;
+  const char *table_path, *schema_name, *stmt;
+  uint32_t counter = 0, other_counter = 0;
+  struct prom_dbh *dbh, *other_dbh;
+
+  mark_point();
+  res = prom_db_get_change_counter(NULL, NULL, NULL);
+  ck_assert_msg(res < 0, "Failed to handle null pool");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  res = prom_db_get_change_counter(p, NULL, NULL);
+  ck_assert_msg(res < 0, "Failed to handle null dbh");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  (void) unlink(db_test_table);
+  table_path = db_test_table;
+  schema_name = "prometheus_test";
+
+  mark_point();
+  dbh = prom_db_open(p, table_path, schema_name);
+  ck_assert_msg(dbh != NULL, "Failed to open table '%s': %s", table_path,
+    strerror(errno));
+
+  mark_point();
+  res = prom_db_get_change_counter(p, dbh, NULL);
+  ck_assert_msg(res < 0, "Failed to handle null counter");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  stmt = "CREATE TABLE foo (id INTEGER);";
+  res = prom_db_exec_stmt(p, dbh, stmt, NULL);
+  ck_assert_msg(res == 0, "Failed to execute '%s': %s", stmt,
+    strerror(errno));
+
+  res = prom_db_get_change_counter(p, dbh, &counter);
+  ck_assert_msg(res == 0, "Failed to get change counter: %s",
+    strerror(errno));
+
+  /* Every connection sees the same counter... */
+  mark_point();
+  other_dbh = prom_db_open(p, table_path, schema_name);
+  ck_assert_msg(other_dbh != NULL, "Failed to open table '%s': %s",
+    table_path, strerror(errno));
+
+  res = prom_db_get_change_counter(p, other_dbh, &other_counter);
+  ck_assert_msg(res == 0, "Failed to get change counter: %s",
+    strerror(errno));
+  ck_assert_msg(other_counter == counter, "Expected counter %lu, got %lu",
+    (unsigned long) counter, (unsigned long) other_counter);
+
+  /* ...which changes with the changes committed by any of them. */
+  stmt = "INSERT INTO foo (id) VALUES (1);";
+  res = prom_db_exec_stmt(p, other_dbh, stmt, NULL);
+  ck_assert_msg(res == 0, "Failed to execute '%s': %s", stmt,
+    strerror(errno));
+
+  res = prom_db_get_change_counter(p, dbh, &other_counter);
+  ck_assert_msg(res == 0, "Failed to get change counter: %s",
+    strerror(errno));
+  ck_assert_msg(other_counter != counter, "Expected counter to change");
+
+  counter = other_counter;
+  stmt = "INSERT INTO foo (id) VALUES (2);";
+  res = prom_db_exec_stmt(p, dbh, stmt, NULL);
+  ck_assert_msg(res == 0, "Failed to execute '%s': %s", stmt,
+    strerror(errno));
+
+  res = prom_db_get_change_counter(p, other_dbh, &other_counter);
+  ck_assert_msg(res == 0, "Failed to get change counter: %s",
+    strerror(errno));
+  ck_assert_msg(other_counter != counter, "Expected counter to change");
+
+  res = prom_db_close(p, other_dbh);
+  ck_assert_msg(res == 0, "Failed to close database: %s", strerror(errno));
+
+  res = prom_db_close(p, dbh);
+  ck_assert_msg(res == 0, "Failed to close database: %s", strerror(errno));
+
+  (void) unlink(db_test_table);
+}
+END_TEST
+
+START_TEST (db_get_data_version_test) {
+  int res;
+  const char *table_path, *schema_name, *stmt;
+  int64_t version = 0, other_version = 0;
+  struct prom_dbh *dbh, *other_dbh;
+
+  mark_point();
+  res = prom_db_get_data_version(NULL, NULL, NULL);
+  ck_assert_msg(res < 0, "Failed to handle null pool");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  res = prom_db_get_data_version(p, NULL, NULL);
+  ck_assert_msg(res < 0, "Failed to handle null dbh");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  (void) unlink(db_test_table);
+  table_path = db_test_table;
+  schema_name = "prometheus_test";
+
+  mark_point();
+  dbh = prom_db_open(p, table_path, schema_name);
+  ck_assert_msg(dbh != NULL, "Failed to open table '%s': %s", table_path,
+    strerror(errno));
+
+  mark_point();
+  res = prom_db_get_data_version(p, dbh, NULL);
+  ck_assert_msg(res < 0, "Failed to handle null version");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  res = prom_db_get_data_version(p, dbh, &version);
+  ck_assert_msg(res == 0, "Failed to get data version: %s", strerror(errno));
+
+  /* Changes made by this connection do not change its data version... */
+  stmt = "CREATE TABLE foo (id INTEGER);";
+  res = prom_db_exec_stmt(p, dbh, stmt, NULL);
+  ck_assert_msg(res == 0, "Failed to execute '%s': %s", stmt,
+    strerror(errno));
+
+  res = prom_db_get_data_version(p, dbh, &other_version);
+  ck_assert_msg(res == 0, "Failed to get data version: %s", strerror(errno));
+  ck_assert_msg(other_version == version, "Expected version %lld, got %lld",
+    (long long) version, (long long) other_version);
+
+  /* ...but changes committed by other connections do. */
+  mark_point();
+  other_dbh = prom_db_open(p, table_path, schema_name);
+  ck_assert_msg(other_dbh != NULL, "Failed to open table '%s': %s",
+    table_path, strerror(errno));
+
+  stmt = "INSERT INTO foo (id) VALUES (1);";
+  res = prom_db_exec_stmt(p, other_dbh, stmt, NULL);
+  ck_assert_msg(res == 0, "Failed to execute '%s': %s", stmt,
+    strerror(errno));
+
+  res = prom_db_get_data_version(p, dbh, &other_version);
+  ck_assert_msg(res == 0, "Failed to get data version: %s", strerror(errno));
+  ck_assert_msg(other_version != version, "Expected version to change");
+
+  res = prom_db_close(p, other_dbh);
+  ck_assert_msg(res == 0, "Failed to close database: %s", strerror(errno));
+
+  res = prom_db_close(p, dbh);
+  ck_assert_msg(res == 0, "Failed to close database: %s", strerror(errno));
+
+  (void) unlink(db_test_table);
+}
+END_TEST
+
 START_TEST (db_begin_txn_test) {
   int res;
   const char *table_path, *schema_name;
@@ -951,6 +1331,173 @@ START_TEST (db_commit_txn_test) {
 }
 END_TEST
 
+START_TEST (db_set_busy_budget_test) {
+  int res;
+  const char *table_path, *schema_name, *stmt;
+  struct prom_dbh *dbh, *other_dbh;
+  struct timeval start, end;
+  long elapsed_ms;
+
+  mark_point();
+  res = prom_db_set_busy_budget(NULL, 0);
+  fail_unless(res < 0, "Failed to handle null dbh");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got '%s' (%d)", EINVAL,
+    strerror(errno), errno);
+
+  (void) unlink(db_test_table);
+  table_path = db_test_table;
+  schema_name = "prometheus_test";
+
+  dbh = prom_db_open(p, table_path, schema_name);
+  fail_unless(dbh != NULL, "Failed to open table '%s': %s", table_path,
+    strerror(errno));
+
+  stmt = "CREATE TABLE foo (id INTEGER);";
+  res = prom_db_exec_stmt(p, dbh, stmt, NULL);
+  fail_unless(res == 0, "Failed to execute '%s': %s", stmt, strerror(errno));
+
+  other_dbh = prom_db_open(p, table_path, schema_name);
+  fail_unless(other_dbh != NULL, "Failed to open table '%s': %s", table_path,
+    strerror(errno));
+
+  mark_point();
+  res = prom_db_set_busy_budget(dbh, 5000);
+  fail_unless(res == 0, "Failed to set busy budget: %s", strerror(errno));
+
+  /* With a budget, transactions are not used. */
+  mark_point();
+  res = prom_db_begin_txn(p, dbh, NULL);
+  fail_unless(res == 0, "Failed to begin transaction: %s", strerror(errno));
+  res = prom_db_commit_txn(p, dbh, NULL);
+  fail_unless(res == 0, "Failed to commit transaction: %s", strerror(errno));
+
+  /* Hold the database lock via the other handle. */
+  stmt = "BEGIN EXCLUSIVE;";
+  res = prom_db_exec_stmt(p, other_dbh, stmt, NULL);
+  fail_unless(res == 0, "Failed to execute '%s': %s", stmt, strerror(errno));
+
+  mark_point();
+  gettimeofday(&start, NULL);
+  stmt = "INSERT INTO foo (id) VALUES (1);";
+  res = prom_db_exec_stmt(p, dbh, stmt, NULL);
+  gettimeofday(&end, NULL);
+  fail_unless(res < 0, "Failed to handle busy database");
+  fail_unless(errno == EAGAIN, "Expected EAGAIN (%d), got '%s' (%d)", EAGAIN,
+    strerror(errno), errno);
+
+  elapsed_ms = ((end.tv_sec - start.tv_sec) * 1000) +
+    ((end.tv_usec - start.tv_usec) / 1000);
+  fail_unless(elapsed_ms < 1000, "Expected busy budget to be honored, took %ld ms",
+    elapsed_ms);
+
+  mark_point();
+  res = prom_db_prepare_stmt(p, dbh, stmt);
+  fail_unless(res == 0, "Failed to prepare '%s': %s", stmt, strerror(errno));
+
+  fail_unless(prom_db_exec_prepared_stmt(p, dbh, stmt, NULL) == NULL,
+    "Failed to handle busy database");
+  fail_unless(errno == EAGAIN, "Expected EAGAIN (%d), got '%s' (%d)", EAGAIN,
+    strerror(errno), errno);
+
+  stmt = "COMMIT;";
+  res = prom_db_exec_stmt(p, other_dbh, stmt, NULL);
+  fail_unless(res == 0, "Failed to execute '%s': %s", stmt, strerror(errno));
+
+  /* Once the lock is released, the statement succeeds. */
+  mark_point();
+  stmt = "INSERT INTO foo (id) VALUES (1);";
+  res = prom_db_prepare_stmt(p, dbh, stmt);
+  fail_unless(res == 0, "Failed to prepare '%s': %s", stmt, strerror(errno));
+  fail_unless(prom_db_exec_prepared_stmt(p, dbh, stmt, NULL) != NULL,
+    "Failed to execute '%s': %s", stmt, strerror(errno));
+
+  (void) prom_db_close(p, other_dbh);
+  (void) prom_db_close(p, dbh);
+  (void) unlink(db_test_table);
+}
+END_TEST
+
+START_TEST (db_get_busy_stats_test) {
+  int res;
+  const char *table_path, *schema_name, *stmt;
+  struct prom_dbh *dbh, *other_dbh;
+  uint64_t busy_errors = 0, busy_sleeps = 0;
+
+  mark_point();
+  res = prom_db_get_busy_stats(NULL, NULL, NULL);
+  fail_unless(res < 0, "Failed to handle null dbh");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got '%s' (%d)", EINVAL,
+    strerror(errno), errno);
+
+  (void) unlink(db_test_table);
+  table_path = db_test_table;
+  schema_name = "prometheus_test";
+
+  dbh = prom_db_open(p, table_path, schema_name);
+  fail_unless(dbh != NULL, "Failed to open table '%s': %s", table_path,
+    strerror(errno));
+
+  mark_point();
+  res = prom_db_get_busy_stats(dbh, NULL, NULL);
+  fail_unless(res == 0, "Failed to get busy stats: %s", strerror(errno));
+
+  res = prom_db_get_busy_stats(dbh, &busy_errors, &busy_sleeps);
+  fail_unless(res == 0, "Failed to get busy stats: %s", strerror(errno));
+  fail_unless(busy_errors == 0, "Expected 0 busy errors, got %lu",
+    (unsigned long) busy_errors);
+  fail_unless(busy_sleeps == 0, "Expected 0 busy sleeps, got %lu",
+    (unsigned long) busy_sleeps);
+
+  stmt = "CREATE TABLE foo (id INTEGER);";
+  res = prom_db_exec_stmt(p, dbh, stmt, NULL);
+  fail_unless(res == 0, "Failed to execute '%s': %s", stmt, strerror(errno));
+
+  other_dbh = prom_db_open(p, table_path, schema_name);
+  fail_unless(other_dbh != NULL, "Failed to open table '%s': %s", table_path,
+    strerror(errno));
+
+  res = prom_db_set_busy_budget(dbh, 5000);
+  fail_unless(res == 0, "Failed to set busy budget: %s", strerror(errno));
+
+  /* Hold the database lock via the other handle. */
+  stmt = "BEGIN EXCLUSIVE;";
+  res = prom_db_exec_stmt(p, other_dbh, stmt, NULL);
+  fail_unless(res == 0, "Failed to execute '%s': %s", stmt, strerror(errno));
+
+  stmt = "INSERT INTO foo (id) VALUES (1);";
+  res = prom_db_prepare_stmt(p, dbh, stmt);
+  fail_unless(res == 0, "Failed to prepare '%s': %s", stmt, strerror(errno));
+
+  mark_point();
+  res = prom_db_exec_prepared_write(p, dbh, stmt, NULL);
+  fail_unless(res < 0, "Failed to handle busy database");
+  fail_unless(errno == EAGAIN, "Expected EAGAIN (%d), got '%s' (%d)", EAGAIN,
+    strerror(errno), errno);
+
+  res = prom_db_get_busy_stats(dbh, &busy_errors, &busy_sleeps);
+  fail_unless(res == 0, "Failed to get busy stats: %s", strerror(errno));
+  fail_unless(busy_errors == 1, "Expected 1 busy error, got %lu",
+    (unsigned long) busy_errors);
+  fail_unless(busy_sleeps > 0, "Expected busy sleeps, got none");
+
+  /* The other handle, holding the lock, was never busy. */
+  res = prom_db_get_busy_stats(other_dbh, &busy_errors, &busy_sleeps);
+  fail_unless(res == 0, "Failed to get busy stats: %s", strerror(errno));
+  fail_unless(busy_errors == 0, "Expected 0 busy errors, got %lu",
+    (unsigned long) busy_errors);
+  fail_unless(busy_sleeps == 0, "Expected 0 busy sleeps, got %lu",
+    (unsigned long) busy_sleeps);
+
+  stmt = "COMMIT;";
+  res = prom_db_exec_stmt(p, other_dbh, stmt, NULL);
+  fail_unless(res == 0, "Failed to execute '%s': %s", stmt, strerror(errno));
+
+  (void) prom_db_close(p, other_dbh);
+  (void) prom_db_close(p, dbh);
+  (void) unlink(db_test_table);
+}
+END_TEST
+
 Suite *tests_get_db_suite(void) {
   Suite *suite;
   TCase *testcase;
@@ -970,10 +1517,16 @@ Suite *tests_get_db_suite(void) {
   tcase_add_test(testcase, db_finish_stmt_test);
   tcase_add_test(testcase, db_bind_stmt_test);
   tcase_add_test(testcase, db_exec_prepared_stmt_test);
+  tcase_add_test(testcase, db_exec_prepared_write_test);
+  tcase_add_test(testcase, db_exec_prepared_stmt_rows_test);
   tcase_add_test(testcase, db_reindex_test);
   tcase_add_test(testcase, db_last_row_id_test);
+  tcase_add_test(testcase, db_get_data_version_test);
+  tcase_add_test(testcase, db_get_change_counter_test);
   tcase_add_test(testcase, db_begin_txn_test);
   tcase_add_test(testcase, db_commit_txn_test);
+  tcase_add_test(testcase, db_set_busy_budget_test);
+  tcase_add_test(testcase, db_get_busy_stats_test);
 
   suite_add_tcase(suite, testcase);
   return suite;
@@ -104,13 +104,13 @@ START_TEST (http_start_test) {
   struct prom_registry *registry;
 
   mark_point();
-  http = prom_http_start(NULL, NULL, NULL, NULL, NULL);
+  http = prom_http_start(NULL, NULL, NULL, NULL, NULL, 0, 0);
   ck_assert_msg(http == NULL, "Failed to handle null pool");
   ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
     strerror(errno), errno);
 
   mark_point();
-  http = prom_http_start(p, NULL, NULL, NULL, NULL);
+  http = prom_http_start(p, NULL, NULL, NULL, NULL, 0, 0);
   ck_assert_msg(http == NULL, "Failed to handle null addr");
   ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
     strerror(errno), errno);
@@ -121,7 +121,7 @@ START_TEST (http_start_test) {
   pr_netaddr_set_sockaddr_any(addr);
   pr_netaddr_set_port2(addr, 0);
 
-  http = prom_http_start(p, addr, NULL, NULL, NULL);
+  http = prom_http_start(p, addr, NULL, NULL, NULL, 0, 0);
   ck_assert_msg(http == NULL, "Failed to handle null registry");
   ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
     strerror(errno), errno);
@@ -130,12 +130,159 @@ START_TEST (http_start_test) {
 
   /* Note: We don't need a real registry here, just a non-null pointer. */
   registry = pcalloc(p, 8);
-  http = prom_http_start(p, addr, registry, NULL, NULL);
+  http = prom_http_start(p, addr, registry, NULL, NULL, 0, 0);
   ck_assert_msg(http != NULL, "Failed to start http: %s", strerror(errno));
 
   mark_point();
   res = prom_http_stop(p, http);
   ck_assert_msg(res == 0, "Failed to stop http: %s", strerror(errno));
+
+  mark_point();
+  http = prom_http_start(p, addr, registry, NULL, NULL,
+    PROM_HTTP_MAX_CONNECTIONS + 1, 0);
+  ck_assert_msg(http == NULL, "Failed to handle too many connections");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  http = prom_http_start(p, addr, registry, NULL, NULL, 8,
+    PROM_HTTP_FL_SHARED_ADDR);
+  ck_assert_msg(http != NULL, "Failed to start http: %s", strerror(errno));
+
+  mark_point();
+  res = prom_http_stop(p, http);
+  ck_assert_msg(res == 0, "Failed to stop http: %s", strerror(errno));
+}
+END_TEST
+
+START_TEST (http_set_parent_test) {
+  int res;
+  struct prom_http *http;
+
+  mark_point();
+  res = prom_http_set_parent(NULL, 0);
+  ck_assert_msg(res < 0, "Failed to handle null http");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  /* Note: We don't need a real http here, just a non-null pointer. */
+  mark_point();
+  http = pcalloc(p, 128);
+  res = prom_http_set_parent(http, getppid());
+  ck_assert_msg(res == 0, "Failed to set parent: %s", strerror(errno));
+}
+END_TEST
+
+START_TEST (http_set_etag_id_test) {
+  int res;
+  pr_netaddr_t *addr;
+  struct prom_http *http;
+  struct prom_registry *registry;
+
+  mark_point();
+  res = prom_http_set_etag_id(NULL, NULL);
+  ck_assert_msg(res < 0, "Failed to handle null http");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  addr = pr_netaddr_alloc(p);
+  pr_netaddr_set_family(addr, AF_INET);
+  pr_netaddr_set_sockaddr_any(addr);
+  pr_netaddr_set_port2(addr, 0);
+
+  /* Note: We don't need a real registry here, just a non-null pointer. */
+  registry = pcalloc(p, 8);
+  http = prom_http_start(p, addr, registry, NULL, NULL, 0, 0);
+  ck_assert_msg(http != NULL, "Failed to start http: %s", strerror(errno));
+
+  mark_point();
+  res = prom_http_set_etag_id(http, NULL);
+  ck_assert_msg(res < 0, "Failed to handle null ETag ID");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  res = prom_http_set_etag_id(http,
+    "0123456789012345678901234567890123456789");
+  ck_assert_msg(res < 0, "Failed to handle overlong ETag ID");
+  ck_assert_msg(errno == ENAMETOOLONG,
+    "Expected ENAMETOOLONG (%d), got %s (%d)", ENAMETOOLONG, strerror(errno),
+    errno);
+
+  mark_point();
+  res = prom_http_set_etag_id(http, "1f2e.5f3a9c1b");
+  ck_assert_msg(res == 0, "Failed to set ETag ID: %s", strerror(errno));
+
+  mark_point();
+  res = prom_http_stop(p, http);
+  ck_assert_msg(res == 0, "Failed to stop http: %s", strerror(errno));
+}
+END_TEST
+
+START_TEST (http_set_compression_test) {
+  int res;
+  pr_netaddr_t *addr;
+  struct prom_http *http;
+  struct prom_registry *registry;
+
+  mark_point();
+  res = prom_http_set_compression(NULL, 0, 0);
+  ck_assert_msg(res < 0, "Failed to handle null http");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  addr = pr_netaddr_alloc(p);
+  pr_netaddr_set_family(addr, AF_INET);
+  pr_netaddr_set_sockaddr_any(addr);
+  pr_netaddr_set_port2(addr, 0);
+
+  /* Note: We don't need a real registry here, just a non-null pointer. */
+  registry = pcalloc(p, 8);
+  http = prom_http_start(p, addr, registry, NULL, NULL, 0, 0);
+  ck_assert_msg(http != NULL, "Failed to start http: %s", strerror(errno));
+
+  mark_point();
+  res = prom_http_set_compression(http, 10,
+    PROM_HTTP_COMPRESS_STRATEGY_DEFAULT);
+  ck_assert_msg(res < 0, "Failed to handle invalid level");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  res = prom_http_set_compression(http, -2,
+    PROM_HTTP_COMPRESS_STRATEGY_DEFAULT);
+  ck_assert_msg(res < 0, "Failed to handle invalid level");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  res = prom_http_set_compression(http, 1, -1);
+  ck_assert_msg(res < 0, "Failed to handle invalid strategy");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  res = prom_http_set_compression(http, 1,
+    PROM_HTTP_COMPRESS_STRATEGY_FIXED + 1);
+  ck_assert_msg(res < 0, "Failed to handle invalid strategy");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  res = prom_http_set_compression(http, -1,
+    PROM_HTTP_COMPRESS_STRATEGY_DEFAULT);
+  ck_assert_msg(res == 0, "Failed to set compression: %s", strerror(errno));
+
+  mark_point();
+  res = prom_http_set_compression(http, 9,
+    PROM_HTTP_COMPRESS_STRATEGY_FILTERED);
+  ck_assert_msg(res == 0, "Failed to set compression: %s", strerror(errno));
+
+  mark_point();
+  res = prom_http_stop(p, http);
+  ck_assert_msg(res == 0, "Failed to stop http: %s", strerror(errno));
 }
 END_TEST
 
@@ -169,6 +316,9 @@ Suite *tests_get_http_suite(void) {
   tcase_add_test(testcase, http_free_test);
   tcase_add_test(testcase, http_stop_test);
   tcase_add_test(testcase, http_start_test);
+  tcase_add_test(testcase, http_set_parent_test);
+  tcase_add_test(testcase, http_set_etag_id_test);
+  tcase_add_test(testcase, http_set_compression_test);
   tcase_add_test(testcase, http_run_loop_test);
 
   suite_add_tcase(suite, testcase);
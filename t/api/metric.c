@@ -27,6 +27,7 @@
 #include "tests.h"
 #include "prometheus/db.h"
 #include "prometheus/metric.h"
+#include "prometheus/metric/db.h"
 
 static pool *p = NULL;
 static const char *test_dir = "/tmp/prt-mod_prometheus-test-metrics";
@@ -314,56 +315,17 @@ START_TEST (metric_add_histogram_test) {
 }
 END_TEST
 
-START_TEST (metric_set_dbh_test) {
-  int res;
-  struct prom_metric *metric;
-  struct prom_dbh *dbh;
-
-  mark_point();
-  res = prom_metric_set_dbh(NULL, NULL);
-  ck_assert_msg(res < 0, "Failed to handle null metric");
-  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
-    strerror(errno), errno);
-
-  /* For purposes of testing, this does not have to be a real dbh. */
-  mark_point();
-  dbh = palloc(p, 8);
-  metric = prom_metric_create(p, "test", dbh);
-  ck_assert_msg(metric != NULL, "Failed to create metric: %s", strerror(errno));
-
-  mark_point();
-  res = prom_metric_set_dbh(metric, NULL);
-  ck_assert_msg(res < 0, "Failed to handle null dbh");
-  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
-    strerror(errno), errno);
-
-  mark_point();
-  res = prom_metric_set_dbh(metric, dbh);
-  ck_assert_msg(res == 0, "Failed to set dbh: %s", strerror(errno));
-
-  prom_metric_destroy(p, metric);
-}
-END_TEST
-
-START_TEST (metric_get_test) {
+START_TEST (metric_add_summary_test) {
   int res;
-  const char *name;
   struct prom_dbh *dbh;
   struct prom_metric *metric;
-  const array_header *results;
 
   (void) tests_rmpath(p, test_dir);
   (void) tests_mkpath(p, test_dir);
 
   mark_point();
-  results = prom_metric_get(NULL, NULL, 0, NULL, NULL);
-  ck_assert_msg(results == NULL, "Failed to handle null pool");
-  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
-    strerror(errno), errno);
-
-  mark_point();
-  results = prom_metric_get(p, NULL, 0, NULL, NULL);
-  ck_assert_msg(results == NULL, "Failed to handle null metric");
+  res = prom_metric_add_summary(NULL, NULL, NULL, 0);
+  ck_assert_msg(res < 0, "Failed to handle null metric");
   ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
     strerror(errno), errno);
 
@@ -372,33 +334,31 @@ START_TEST (metric_get_test) {
   ck_assert_msg(dbh != NULL, "Failed to init metrics: %s", strerror(errno));
 
   mark_point();
-  name = "test";
-  metric = prom_metric_create(p, name, dbh);
+  metric = prom_metric_create(p, "test", dbh);
   ck_assert_msg(metric != NULL, "Failed to create metric: %s", strerror(errno));
 
   mark_point();
-  results = prom_metric_get(p, metric, -1, NULL, NULL);
-  ck_assert_msg(results == NULL, "Failed to handle unknown metric type");
+  res = prom_metric_add_summary(metric, NULL, NULL, 0);
+  ck_assert_msg(res < 0, "Failed to handle null help");
   ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
     strerror(errno), errno);
 
   mark_point();
-  results = prom_metric_get(p, metric, PROM_METRIC_TYPE_COUNTER, NULL, NULL);
-  ck_assert_msg(results == NULL, "Failed to handle counter-less metric");
-  ck_assert_msg(errno == EPERM, "Expected EPERM (%d), got %s (%d)", EPERM,
+  res = prom_metric_add_summary(metric, "weight", "testing", 0);
+  ck_assert_msg(res < 0, "Failed to handle zero quantiles");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
     strerror(errno), errno);
 
   mark_point();
-  results = prom_metric_get(p, metric, PROM_METRIC_TYPE_GAUGE, NULL, NULL);
-  ck_assert_msg(results == NULL, "Failed to handle gauge-less metric");
-  ck_assert_msg(errno == EPERM, "Expected EPERM (%d), got %s (%d)", EPERM,
+  res = prom_metric_add_summary(metric, "weight", "testing", 1, 1.5);
+  ck_assert_msg(res < 0, "Failed to handle out-of-range quantile");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
     strerror(errno), errno);
 
   mark_point();
-  results = prom_metric_get(p, metric, PROM_METRIC_TYPE_HISTOGRAM, NULL, NULL);
-  ck_assert_msg(results == NULL, "Failed to handle histogram-less metric");
-  ck_assert_msg(errno == EPERM, "Expected EPERM (%d), got %s (%d)", EPERM,
-    strerror(errno), errno);
+  res = prom_metric_add_summary(metric, "weight", "testing", 2, 0.5, 0.99);
+  ck_assert_msg(res == 0, "Failed to add summary to metric: %s",
+    strerror(errno));
 
   mark_point();
   res = prom_metric_destroy(p, metric);
@@ -410,26 +370,16 @@ START_TEST (metric_get_test) {
 }
 END_TEST
 
-START_TEST (metric_decr_test) {
+START_TEST (metric_set_native_histogram_test) {
   int res;
-  const char *name;
   struct prom_dbh *dbh;
   struct prom_metric *metric;
-  uint32_t decr_val = 32;
-  pr_table_t *labels;
-  const array_header *results;
 
   (void) tests_rmpath(p, test_dir);
   (void) tests_mkpath(p, test_dir);
 
   mark_point();
-  res = prom_metric_decr(NULL, NULL, 0, NULL);
-  ck_assert_msg(res < 0, "Failed to handle null pool");
-  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
-    strerror(errno), errno);
-
-  mark_point();
-  res = prom_metric_decr(p, NULL, 0, NULL);
+  res = prom_metric_set_native_histogram(NULL, 0);
   ck_assert_msg(res < 0, "Failed to handle null metric");
   ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
     strerror(errno), errno);
@@ -439,46 +389,36 @@ START_TEST (metric_decr_test) {
   ck_assert_msg(dbh != NULL, "Failed to init metrics: %s", strerror(errno));
 
   mark_point();
-  name = "test";
-  metric = prom_metric_create(p, name, dbh);
+  metric = prom_metric_create(p, "test", dbh);
   ck_assert_msg(metric != NULL, "Failed to create metric: %s", strerror(errno));
 
   mark_point();
-  res = prom_metric_decr(p, metric, decr_val, NULL);
-  ck_assert_msg(res < 0, "Failed to handle gauge-less metric");
+  res = prom_metric_set_native_histogram(metric, 0);
+  ck_assert_msg(res < 0, "Failed to handle metric without histogram");
   ck_assert_msg(errno == EPERM, "Expected EPERM (%d), got %s (%d)", EPERM,
     strerror(errno), errno);
 
-  mark_point();
-  res = prom_metric_add_gauge(metric, "count", "testing");
-  ck_assert_msg(res == 0, "Failed to add gauge to metric: %s", strerror(errno));
+  res = prom_metric_add_histogram(metric, "weight", "testing", 0);
+  ck_assert_msg(res == 0, "Failed to add histogram to metric: %s",
+    strerror(errno));
 
   mark_point();
-  res = prom_metric_decr(p, metric, decr_val, NULL);
-  ck_assert_msg(res == 0, "Failed to decrement metric: %s", strerror(errno));
+  res = prom_metric_set_native_histogram(metric,
+    PROM_METRIC_NATIVE_SCHEMA_MAX + 1);
+  ck_assert_msg(res < 0, "Failed to handle out-of-range schema");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
 
   mark_point();
-  results = prom_metric_get(p, metric, PROM_METRIC_TYPE_GAUGE, NULL, NULL);
-  ck_assert_msg(results != NULL, "Failed to get label-less gauge samples: %s",
+  res = prom_metric_set_native_histogram(metric, 3);
+  ck_assert_msg(res == 0, "Failed to set native histogram: %s",
     strerror(errno));
-  ck_assert_msg(results->nelts == 2, "Expected 2 results, got %d",
-    results->nelts);
-
-  /* Now, provide labels. */
-  labels = pr_table_nalloc(p, 0, 2);
-  (void) pr_table_add_dup(labels, "protocol", "ftp", 0);
-  (void) pr_table_add_dup(labels, "foo", "BAR", 0);
-
-  mark_point();
-  res = prom_metric_decr(p, metric, decr_val, labels);
-  ck_assert_msg(res == 0, "Failed to decrement metric: %s", strerror(errno));
 
   mark_point();
-  results = prom_metric_get(p, metric, PROM_METRIC_TYPE_GAUGE, NULL, NULL);
-  ck_assert_msg(results != NULL, "Failed to get labeled gauge samples: %s",
-    strerror(errno));
-  ck_assert_msg(results->nelts == 4, "Expected 4 results, got %d",
-    results->nelts);
+  res = prom_metric_set_native_histogram(metric, 3);
+  ck_assert_msg(res < 0, "Failed to handle existing native histogram");
+  ck_assert_msg(errno == EEXIST, "Expected EEXIST (%d), got %s (%d)", EEXIST,
+    strerror(errno), errno);
 
   mark_point();
   res = prom_metric_destroy(p, metric);
@@ -490,122 +430,175 @@ START_TEST (metric_decr_test) {
 }
 END_TEST
 
-START_TEST (metric_incr_type_test) {
+START_TEST (metric_set_dbh_test) {
   int res;
-  const char *name;
-  struct prom_dbh *dbh;
   struct prom_metric *metric;
-  uint32_t incr_val = 66;
-  pr_table_t *labels;
-  const array_header *results;
-
-  (void) tests_rmpath(p, test_dir);
-  (void) tests_mkpath(p, test_dir);
+  struct prom_dbh *dbh;
 
   mark_point();
-  res = prom_metric_incr_type(NULL, NULL, 0, NULL, 0);
-  ck_assert_msg(res < 0, "Failed to handle null pool");
+  res = prom_metric_set_dbh(NULL, NULL);
+  ck_assert_msg(res < 0, "Failed to handle null metric");
   ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
     strerror(errno), errno);
 
+  /* For purposes of testing, this does not have to be a real dbh. */
   mark_point();
-  res = prom_metric_incr_type(p, NULL, 0, NULL, 0);
-  ck_assert_msg(res < 0, "Failed to handle null metric");
+  dbh = palloc(p, 8);
+  metric = prom_metric_create(p, "test", dbh);
+  ck_assert_msg(metric != NULL, "Failed to create metric: %s", strerror(errno));
+
+  mark_point();
+  res = prom_metric_set_dbh(metric, NULL);
+  ck_assert_msg(res < 0, "Failed to handle null dbh");
   ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
     strerror(errno), errno);
 
   mark_point();
-  dbh = prom_metric_init(p, test_dir);
-  ck_assert_msg(dbh != NULL, "Failed to init metrics: %s", strerror(errno));
+  res = prom_metric_set_dbh(metric, dbh);
+  ck_assert_msg(res == 0, "Failed to set dbh: %s", strerror(errno));
 
-  mark_point();
-  name = "test";
-  metric = prom_metric_create(p, name, dbh);
-  ck_assert_msg(metric != NULL, "Failed to create metric: %s", strerror(errno));
+  prom_metric_destroy(p, metric);
+}
+END_TEST
+
+START_TEST (metric_set_shm_test) {
+  register unsigned int i;
+  int res;
+  uint64_t deferred = 0, dropped = 0, prev_deferred = 0, prev_dropped = 0;
+  struct prom_dbh *dbh;
+  struct prom_metric *metric;
+  struct prom_metric_shm *shm;
+  const array_header *results;
+  char **elts;
+  const char *text;
+  size_t textlen = 0;
+  struct prom_metric_scan *scan;
+  array_header *metrics;
+  pr_table_t *samples;
+
+  (void) tests_rmpath(p, test_dir);
+  (void) tests_mkpath(p, test_dir);
 
   mark_point();
-  res = prom_metric_incr_type(p, metric, incr_val, NULL, 0);
-  ck_assert_msg(res < 0, "Failed to handle unknown metric type");
+  res = prom_metric_set_shm(NULL, NULL);
+  ck_assert_msg(res < 0, "Failed to handle null metric");
   ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
     strerror(errno), errno);
 
   mark_point();
-  res = prom_metric_incr_type(p, metric, incr_val, NULL,
-    PROM_METRIC_TYPE_COUNTER);
-  ck_assert_msg(res < 0, "Failed to handle counter-less metric");
-  ck_assert_msg(errno == EPERM, "Expected EPERM (%d), got %s (%d)", EPERM,
-    strerror(errno), errno);
+  dbh = prom_metric_init(p, test_dir);
+  ck_assert_msg(dbh != NULL, "Failed to init metrics: %s", strerror(errno));
 
   mark_point();
-  res = prom_metric_incr_type(p, metric, incr_val, NULL,
-    PROM_METRIC_TYPE_GAUGE);
-  ck_assert_msg(res < 0, "Failed to handle gauge-less metric");
-  ck_assert_msg(errno == EPERM, "Expected EPERM (%d), got %s (%d)", EPERM,
-    strerror(errno), errno);
+  shm = prom_metric_shm_init(p, test_dir, 8);
+  ck_assert_msg(shm != NULL, "Failed to init shm: %s", strerror(errno));
 
   mark_point();
+  metric = prom_metric_create(p, "test", dbh);
+  ck_assert_msg(metric != NULL, "Failed to create metric: %s", strerror(errno));
+
   res = prom_metric_add_counter(metric, "total", "testing");
-  ck_assert_msg(res == 0, "Failed to add counter to metric: %s", strerror(errno));
+  ck_assert_msg(res == 0, "Failed to add counter to metric: %s",
+    strerror(errno));
 
   mark_point();
-  res = prom_metric_incr_type(p, metric, incr_val, NULL,
-    PROM_METRIC_TYPE_COUNTER);
+  res = prom_metric_set_shm(metric, shm);
+  ck_assert_msg(res == 0, "Failed to set shm: %s", strerror(errno));
+
+  mark_point();
+  res = prom_metric_incr(p, metric, 2, NULL);
   ck_assert_msg(res == 0, "Failed to increment metric: %s", strerror(errno));
 
+  ck_assert_msg(prom_metric_shm_sample_count(shm) == 1,
+    "Expected 1 shm sample, got %d", prom_metric_shm_sample_count(shm));
+
   mark_point();
   results = prom_metric_get(p, metric, PROM_METRIC_TYPE_COUNTER, NULL, NULL);
-  ck_assert_msg(results != NULL, "Failed to get label-less counter samples: %s",
+  ck_assert_msg(results != NULL, "Failed to get counter results: %s",
     strerror(errno));
   ck_assert_msg(results->nelts == 2, "Expected 2 results, got %d",
     results->nelts);
+  elts = results->elts;
+  ck_assert_msg(strcmp(elts[0], "2") == 0, "Expected '2', got '%s'", elts[0]);
 
-  /* Now, provide labels. */
-  labels = pr_table_nalloc(p, 0, 2);
-  (void) pr_table_add_dup(labels, "protocol", "ftp", 0);
-  (void) pr_table_add_dup(labels, "foo", "BAR", 0);
+  /* Updates which find the datastore full are counted as dropped. */
+  mark_point();
+  res = prom_metric_get_busy_counts(&prev_deferred, &prev_dropped);
+  ck_assert_msg(res == 0, "Failed to get busy counts: %s", strerror(errno));
+
+  for (i = 0; i < 8; i++) {
+    pr_table_t *labels;
+    char label_text[8];
+
+    snprintf(label_text, sizeof(label_text), "%u", i);
+    labels = pr_table_nalloc(p, 0, 1);
+    (void) pr_table_add_dup(labels, "n", label_text, 0);
+    res = prom_metric_incr(p, metric, 1, labels);
+  }
+
+  ck_assert_msg(res < 0, "Failed to handle full datastore");
+  ck_assert_msg(errno == ENOSPC, "Expected ENOSPC (%d), got %s (%d)", ENOSPC,
+    strerror(errno), errno);
+
+  res = prom_metric_get_busy_counts(&deferred, &dropped);
+  ck_assert_msg(res == 0, "Failed to get busy counts: %s", strerror(errno));
+  ck_assert_msg(dropped == prev_dropped + 1, "Expected %lu dropped, got %lu",
+    (unsigned long) (prev_dropped + 1), (unsigned long) dropped);
+  ck_assert_msg(deferred == prev_deferred, "Expected %lu deferred, got %lu",
+    (unsigned long) prev_deferred, (unsigned long) deferred);
+
+  /* Scans read the shared memory samples, too. */
+  metrics = make_array(p, 1, sizeof(struct prom_metric *));
+  *((struct prom_metric **) push_array(metrics)) = metric;
 
   mark_point();
-  res = prom_metric_incr_type(p, metric, incr_val, labels,
-    PROM_METRIC_TYPE_COUNTER);
-  ck_assert_msg(res == 0, "Failed to increment metric: %s", strerror(errno));
+  scan = prom_metric_scan_open(p, dbh, metrics);
+  ck_assert_msg(scan != NULL, "Failed to open scan: %s", strerror(errno));
+
+  samples = prom_metric_scan_next(p, scan);
+  ck_assert_msg(samples != NULL, "Failed to scan samples: %s",
+    strerror(errno));
+  (void) prom_metric_scan_close(scan);
+
+  text = prom_metric_get_text_with_samples(p, metric, "prt", samples,
+    &textlen);
+  ck_assert_msg(text != NULL, "Failed to get metric text: %s", strerror(errno));
+  ck_assert_msg(strstr(text, "prt_test_total 2\n") != NULL,
+    "Expected counter sample in '%s'", text);
+  ck_assert_msg(strstr(text, "prt_test_total{n=\"0\"} 1\n") != NULL,
+    "Expected labeled counter sample in '%s'", text);
 
+  /* Reverting to the database should not see the shared memory samples. */
   mark_point();
+  res = prom_metric_set_shm(metric, NULL);
+  ck_assert_msg(res == 0, "Failed to clear shm: %s", strerror(errno));
+
   results = prom_metric_get(p, metric, PROM_METRIC_TYPE_COUNTER, NULL, NULL);
-  ck_assert_msg(results != NULL, "Failed to get labeled counter samples: %s",
+  ck_assert_msg(results != NULL, "Failed to get counter results: %s",
     strerror(errno));
-  ck_assert_msg(results->nelts == 4, "Expected 4 results, got %d",
+  ck_assert_msg(results->nelts == 0, "Expected 0 results, got %d",
     results->nelts);
 
-  mark_point();
-  res = prom_metric_destroy(p, metric);
-  ck_assert_msg(res == 0, "Failed to destroy metric: %s", strerror(errno));
-
-  res = prom_metric_free(p, dbh);
-  ck_assert_msg(res == 0, "Failed to free metrics: %s", strerror(errno));
+  prom_metric_destroy(p, metric);
+  (void) prom_metric_shm_close(p, shm);
+  (void) prom_metric_free(p, dbh);
   (void) tests_rmpath(p, test_dir);
 }
 END_TEST
 
-START_TEST (metric_incr_test) {
+START_TEST (metric_set_buffer_test) {
   int res;
-  const char *name;
   struct prom_dbh *dbh;
   struct prom_metric *metric;
-  uint32_t incr_val = 66;
-  pr_table_t *labels;
+  struct prom_metric_buffer *buffer;
   const array_header *results;
+  char **elts;
 
   (void) tests_rmpath(p, test_dir);
   (void) tests_mkpath(p, test_dir);
 
   mark_point();
-  res = prom_metric_incr(NULL, NULL, 0, NULL);
-  ck_assert_msg(res < 0, "Failed to handle null pool");
-  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
-    strerror(errno), errno);
-
-  mark_point();
-  res = prom_metric_incr(p, NULL, 0, NULL);
+  res = prom_metric_set_buffer(NULL, NULL);
   ck_assert_msg(res < 0, "Failed to handle null metric");
   ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
     strerror(errno), errno);
@@ -614,156 +607,234 @@ START_TEST (metric_incr_test) {
   dbh = prom_metric_init(p, test_dir);
   ck_assert_msg(dbh != NULL, "Failed to init metrics: %s", strerror(errno));
 
+  buffer = prom_metric_buffer_create(p, dbh);
+  ck_assert_msg(buffer != NULL, "Failed to create buffer: %s",
+    strerror(errno));
+
   mark_point();
-  name = "test";
-  metric = prom_metric_create(p, name, dbh);
+  metric = prom_metric_create(p, "test", dbh);
   ck_assert_msg(metric != NULL, "Failed to create metric: %s", strerror(errno));
 
-  mark_point();
-  res = prom_metric_incr(p, metric, incr_val, NULL);
-  ck_assert_msg(res < 0, "Failed to handle counter-less metric");
-  ck_assert_msg(errno == EPERM, "Expected EPERM (%d), got %s (%d)", EPERM,
-    strerror(errno), errno);
+  res = prom_metric_add_counter(metric, "total", "testing");
+  ck_assert_msg(res == 0, "Failed to add counter to metric: %s",
+    strerror(errno));
+
+  res = prom_metric_add_gauge(metric, "count", "testing");
+  ck_assert_msg(res == 0, "Failed to add gauge to metric: %s",
+    strerror(errno));
 
   mark_point();
-  res = prom_metric_add_counter(metric, "total", "testing");
-  ck_assert_msg(res == 0, "Failed to add counter to metric: %s", strerror(errno));
+  res = prom_metric_set_buffer(metric, buffer);
+  ck_assert_msg(res == 0, "Failed to set buffer: %s", strerror(errno));
 
+  /* The counter and gauge increments are both buffered. */
   mark_point();
-  res = prom_metric_incr(p, metric, incr_val, NULL);
+  res = prom_metric_incr(p, metric, 3, NULL);
   ck_assert_msg(res == 0, "Failed to increment metric: %s", strerror(errno));
 
-  mark_point();
+  res = prom_metric_buffer_count(buffer);
+  ck_assert_msg(res == 2, "Expected 2 buffered samples, got %d", res);
+
   results = prom_metric_get(p, metric, PROM_METRIC_TYPE_COUNTER, NULL, NULL);
-  ck_assert_msg(results != NULL, "Failed to get label-less counter samples: %s",
+  ck_assert_msg(results != NULL, "Failed to get counter results: %s",
     strerror(errno));
-  ck_assert_msg(results->nelts == 2, "Expected 2 results, got %d",
+  ck_assert_msg(results->nelts == 0, "Expected 0 results, got %d",
     results->nelts);
 
-  /* Now, provide labels. */
-  labels = pr_table_nalloc(p, 0, 2);
-  (void) pr_table_add_dup(labels, "protocol", "ftp", 0);
-  (void) pr_table_add_dup(labels, "foo", "BAR", 0);
+  results = prom_metric_get(p, metric, PROM_METRIC_TYPE_GAUGE, NULL, NULL);
+  ck_assert_msg(results != NULL, "Failed to get gauge results: %s",
+    strerror(errno));
+  ck_assert_msg(results->nelts == 0, "Expected 0 results, got %d",
+    results->nelts);
 
+  /* Gauge decrements are netted against the buffered increments. */
   mark_point();
-  res = prom_metric_incr(p, metric, incr_val, labels);
-  ck_assert_msg(res == 0, "Failed to increment metric: %s", strerror(errno));
+  res = prom_metric_decr(p, metric, 1, NULL);
+  ck_assert_msg(res == 0, "Failed to decrement metric: %s", strerror(errno));
+
+  res = prom_metric_buffer_count(buffer);
+  ck_assert_msg(res == 2, "Expected 2 buffered samples, got %d", res);
 
   mark_point();
+  res = prom_metric_buffer_flush(p, buffer);
+  ck_assert_msg(res == 2, "Expected 2 flushed samples, got %d", res);
+
   results = prom_metric_get(p, metric, PROM_METRIC_TYPE_COUNTER, NULL, NULL);
-  ck_assert_msg(results != NULL, "Failed to get labeled counter samples: %s",
+  ck_assert_msg(results != NULL, "Failed to get counter results: %s",
     strerror(errno));
-  ck_assert_msg(results->nelts == 4, "Expected 4 results, got %d",
+  ck_assert_msg(results->nelts == 2, "Expected 2 results, got %d",
     results->nelts);
+  elts = results->elts;
+  ck_assert_msg(strtod(elts[0], NULL) == 3.0, "Expected 3, got '%s'", elts[0]);
 
-  mark_point();
-  res = prom_metric_destroy(p, metric);
-  ck_assert_msg(res == 0, "Failed to destroy metric: %s", strerror(errno));
+  results = prom_metric_get(p, metric, PROM_METRIC_TYPE_GAUGE, NULL, NULL);
+  ck_assert_msg(results != NULL, "Failed to get gauge results: %s",
+    strerror(errno));
+  ck_assert_msg(results->nelts == 2, "Expected 2 results, got %d",
+    results->nelts);
+  elts = results->elts;
+  ck_assert_msg(strtod(elts[0], NULL) == 2.0, "Expected 2, got '%s'", elts[0]);
 
-  res = prom_metric_free(p, dbh);
-  ck_assert_msg(res == 0, "Failed to free metrics: %s", strerror(errno));
+  /* A set replaces the buffered deltas; later deltas apply to it. */
+  mark_point();
+  res = prom_metric_decr(p, metric, 1, NULL);
+  ck_assert_msg(res == 0, "Failed to decrement metric: %s", strerror(errno));
+
+  res = prom_metric_set(p, metric, 7, NULL);
+  ck_assert_msg(res == 0, "Failed to set metric: %s", strerror(errno));
+
+  res = prom_metric_decr(p, metric, 2, NULL);
+  ck_assert_msg(res == 0, "Failed to decrement metric: %s", strerror(errno));
+
+  res = prom_metric_buffer_flush(p, buffer);
+  ck_assert_msg(res == 1, "Expected 1 flushed sample, got %d", res);
+
+  results = prom_metric_get(p, metric, PROM_METRIC_TYPE_GAUGE, NULL, NULL);
+  ck_assert_msg(results != NULL, "Failed to get gauge results: %s",
+    strerror(errno));
+  elts = results->elts;
+  ck_assert_msg(strtod(elts[0], NULL) == 5.0, "Expected 5, got '%s'", elts[0]);
+
+  prom_metric_destroy(p, metric);
+  (void) prom_metric_buffer_destroy(buffer);
+  (void) prom_metric_free(p, dbh);
   (void) tests_rmpath(p, test_dir);
 }
 END_TEST
 
-START_TEST (metric_incr_counter_gauge_test) {
+START_TEST (metric_set_deferred_test) {
   int res;
-  const char *name;
-  struct prom_dbh *dbh;
+  struct prom_dbh *dbh, *other_dbh;
   struct prom_metric *metric;
-  uint32_t incr_val = 66;
-  pr_table_t *labels;
+  struct prom_metric_buffer *buffer;
   const array_header *results;
+  const char *stmt;
+  uint64_t deferred = 0, dropped = 0, prev_deferred = 0, prev_dropped = 0;
+  char **elts;
 
   (void) tests_rmpath(p, test_dir);
   (void) tests_mkpath(p, test_dir);
 
   mark_point();
+  res = prom_metric_set_deferred(NULL, NULL);
+  ck_assert_msg(res < 0, "Failed to handle null metric");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  res = prom_metric_get_busy_counts(NULL, NULL);
+  ck_assert_msg(res < 0, "Failed to handle null counts");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
   dbh = prom_metric_init(p, test_dir);
   ck_assert_msg(dbh != NULL, "Failed to init metrics: %s", strerror(errno));
 
-  mark_point();
-  name = "test";
-  metric = prom_metric_create(p, name, dbh);
+  other_dbh = prom_metric_db_reopen(p, test_dir);
+  ck_assert_msg(other_dbh != NULL, "Failed to open metrics: %s",
+    strerror(errno));
+
+  buffer = prom_metric_buffer_create(p, dbh);
+  ck_assert_msg(buffer != NULL, "Failed to create buffer: %s",
+    strerror(errno));
+
+  metric = prom_metric_create(p, "test", dbh);
   ck_assert_msg(metric != NULL, "Failed to create metric: %s", strerror(errno));
 
-  mark_point();
   res = prom_metric_add_counter(metric, "total", "testing");
-  ck_assert_msg(res == 0, "Failed to add counter to metric: %s", strerror(errno));
+  ck_assert_msg(res == 0, "Failed to add counter to metric: %s",
+    strerror(errno));
 
   res = prom_metric_add_gauge(metric, "count", "testing");
-  ck_assert_msg(res == 0, "Failed to add gauge to metric: %s", strerror(errno));
-
-  mark_point();
-  res = prom_metric_incr(p, metric, incr_val, NULL);
-  ck_assert_msg(res == 0, "Failed to increment metric: %s", strerror(errno));
+  ck_assert_msg(res == 0, "Failed to add gauge to metric: %s",
+    strerror(errno));
 
   mark_point();
-  results = prom_metric_get(p, metric, PROM_METRIC_TYPE_COUNTER, NULL, NULL);
-  ck_assert_msg(results != NULL, "Failed to get label-less counter samples: %s",
+  res = prom_metric_set_deferred(metric, buffer);
+  ck_assert_msg(res == 0, "Failed to set deferred buffer: %s",
     strerror(errno));
-  ck_assert_msg(results->nelts == 2, "Expected 2 results, got %d",
-    results->nelts);
 
-  results = prom_metric_get(p, metric, PROM_METRIC_TYPE_GAUGE, NULL, NULL);
-  ck_assert_msg(results != NULL, "Failed to get label-less gauge samples: %s",
-    strerror(errno));
-  ck_assert_msg(results->nelts == 2, "Expected 2 results, got %d",
-    results->nelts);
+  res = prom_db_set_busy_budget(dbh, 1000);
+  ck_assert_msg(res == 0, "Failed to set busy budget: %s", strerror(errno));
 
-  /* Now, provide labels. */
-  labels = pr_table_nalloc(p, 0, 2);
-  (void) pr_table_add_dup(labels, "protocol", "ftp", 0);
-  (void) pr_table_add_dup(labels, "foo", "BAR", 0);
+  res = prom_metric_get_busy_counts(&prev_deferred, &prev_dropped);
+  ck_assert_msg(res == 0, "Failed to get busy counts: %s", strerror(errno));
+
+  /* Hold the database lock via the other handle. */
+  stmt = "BEGIN EXCLUSIVE;";
+  res = prom_db_exec_stmt(p, other_dbh, stmt, NULL);
+  ck_assert_msg(res == 0, "Failed to execute '%s': %s", stmt,
+    strerror(errno));
 
+  /* The counter increment is deferred; the gauge increment is dropped. */
   mark_point();
-  res = prom_metric_incr(p, metric, incr_val, labels);
-  ck_assert_msg(res == 0, "Failed to increment metric: %s", strerror(errno));
+  res = prom_metric_incr(p, metric, 3, NULL);
+  ck_assert_msg(res < 0, "Failed to handle busy database");
+  ck_assert_msg(errno == EAGAIN, "Expected EAGAIN (%d), got %s (%d)", EAGAIN,
+    strerror(errno), errno);
 
+  res = prom_metric_buffer_count(buffer);
+  ck_assert_msg(res == 1, "Expected 1 deferred sample, got %d", res);
+
+  res = prom_metric_get_busy_counts(&deferred, &dropped);
+  ck_assert_msg(res == 0, "Failed to get busy counts: %s", strerror(errno));
+  ck_assert_msg(deferred == prev_deferred + 1, "Expected %llu deferred, got %llu",
+    (unsigned long long) prev_deferred + 1, (unsigned long long) deferred);
+  ck_assert_msg(dropped == prev_dropped + 1, "Expected %llu dropped, got %llu",
+    (unsigned long long) prev_dropped + 1, (unsigned long long) dropped);
+
+  /* Flushing while the database is still busy keeps the sample. */
   mark_point();
-  results = prom_metric_get(p, metric, PROM_METRIC_TYPE_COUNTER, NULL, NULL);
-  ck_assert_msg(results != NULL, "Failed to get labeled counter samples: %s",
-    strerror(errno));
-  ck_assert_msg(results->nelts == 4, "Expected 4 results, got %d",
-    results->nelts);
+  res = prom_metric_buffer_flush(p, buffer);
+  ck_assert_msg(res == 0, "Expected 0 flushed samples, got %d", res);
 
-  results = prom_metric_get(p, metric, PROM_METRIC_TYPE_GAUGE, NULL, NULL);
-  ck_assert_msg(results != NULL, "Failed to get labeled gauge samples: %s",
+  res = prom_metric_buffer_count(buffer);
+  ck_assert_msg(res == 1, "Expected 1 deferred sample, got %d", res);
+
+  stmt = "COMMIT;";
+  res = prom_db_exec_stmt(p, other_dbh, stmt, NULL);
+  ck_assert_msg(res == 0, "Failed to execute '%s': %s", stmt,
     strerror(errno));
-  ck_assert_msg(results->nelts == 4, "Expected 4 results, got %d",
-    results->nelts);
 
   mark_point();
-  res = prom_metric_destroy(p, metric);
-  ck_assert_msg(res == 0, "Failed to destroy metric: %s", strerror(errno));
+  res = prom_metric_buffer_flush(p, buffer);
+  ck_assert_msg(res == 1, "Expected 1 flushed sample, got %d", res);
 
-  res = prom_metric_free(p, dbh);
-  ck_assert_msg(res == 0, "Failed to free metrics: %s", strerror(errno));
+  results = prom_metric_get(p, metric, PROM_METRIC_TYPE_COUNTER, NULL, NULL);
+  ck_assert_msg(results != NULL, "Failed to get counter results: %s",
+    strerror(errno));
+  ck_assert_msg(results->nelts == 2, "Expected 2 results, got %d",
+    results->nelts);
+  elts = results->elts;
+  ck_assert_msg(strtod(elts[0], NULL) == 3.0, "Expected 3, got '%s'", elts[0]);
+
+  prom_metric_destroy(p, metric);
+  (void) prom_metric_buffer_destroy(buffer);
+  (void) prom_db_close(p, other_dbh);
+  (void) prom_metric_free(p, dbh);
   (void) tests_rmpath(p, test_dir);
 }
 END_TEST
 
-START_TEST (metric_observe_test) {
+START_TEST (metric_get_test) {
   int res;
   const char *name;
   struct prom_dbh *dbh;
   struct prom_metric *metric;
-  double observed_val = 3.1415;
-  pr_table_t *labels;
-  const array_header *results, *counts = NULL, *sums = NULL;
+  const array_header *results;
 
   (void) tests_rmpath(p, test_dir);
   (void) tests_mkpath(p, test_dir);
 
   mark_point();
-  res = prom_metric_observe(NULL, NULL, 0, NULL);
-  ck_assert_msg(res < 0, "Failed to handle null pool");
+  results = prom_metric_get(NULL, NULL, 0, NULL, NULL);
+  ck_assert_msg(results == NULL, "Failed to handle null pool");
   ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
     strerror(errno), errno);
 
   mark_point();
-  res = prom_metric_observe(p, NULL, 0, NULL);
-  ck_assert_msg(res < 0, "Failed to handle null metric");
+  results = prom_metric_get(p, NULL, 0, NULL, NULL);
+  ck_assert_msg(results == NULL, "Failed to handle null metric");
   ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
     strerror(errno), errno);
 
@@ -777,61 +848,28 @@ START_TEST (metric_observe_test) {
   ck_assert_msg(metric != NULL, "Failed to create metric: %s", strerror(errno));
 
   mark_point();
-  res = prom_metric_observe(p, metric, observed_val, NULL);
-  ck_assert_msg(res < 0, "Failed to handle histogram-less metric");
-  ck_assert_msg(errno == EPERM, "Expected EPERM (%d), got %s (%d)", EPERM,
+  results = prom_metric_get(p, metric, -1, NULL, NULL);
+  ck_assert_msg(results == NULL, "Failed to handle unknown metric type");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
     strerror(errno), errno);
 
   mark_point();
-  res = prom_metric_add_histogram(metric, "units", "testing", 0);
-  ck_assert_msg(res == 0, "Failed to add histogram to metric: %s",
-    strerror(errno));
-
-  mark_point();
-  res = prom_metric_observe(p, metric, observed_val, NULL);
-  ck_assert_msg(res == 0, "Failed to observe metric: %s", strerror(errno));
-
-  mark_point();
-  results = prom_metric_get(p, metric, PROM_METRIC_TYPE_HISTOGRAM, &counts,
-    &sums);
-  ck_assert_msg(results != NULL, "Failed get histogram results: %s",
-    strerror(errno));
-  ck_assert_msg(results->nelts == 2, "Expected 2 bucket results, got %d",
-    results->nelts);
-  ck_assert_msg(counts != NULL, "Failed get histogram count results: %s",
-    strerror(errno));
-  ck_assert_msg(counts->nelts == 2, "Expected 2 count results, got %d",
-    counts->nelts);
-  ck_assert_msg(sums != NULL, "Failed get histogram sum results: %s",
-    strerror(errno));
-  ck_assert_msg(sums->nelts == 2, "Expected 2 sum results, got %d",
-    sums->nelts);
-
-  /* Now, provide labels. */
-  labels = pr_table_nalloc(p, 0, 2);
-  (void) pr_table_add_dup(labels, "protocol", "ftp", 0);
-  (void) pr_table_add_dup(labels, "foo", "BAR", 0);
+  results = prom_metric_get(p, metric, PROM_METRIC_TYPE_COUNTER, NULL, NULL);
+  ck_assert_msg(results == NULL, "Failed to handle counter-less metric");
+  ck_assert_msg(errno == EPERM, "Expected EPERM (%d), got %s (%d)", EPERM,
+    strerror(errno), errno);
 
   mark_point();
-  res = prom_metric_observe(p, metric, observed_val, labels);
-  ck_assert_msg(res == 0, "Failed to observe metric: %s", strerror(errno));
+  results = prom_metric_get(p, metric, PROM_METRIC_TYPE_GAUGE, NULL, NULL);
+  ck_assert_msg(results == NULL, "Failed to handle gauge-less metric");
+  ck_assert_msg(errno == EPERM, "Expected EPERM (%d), got %s (%d)", EPERM,
+    strerror(errno), errno);
 
   mark_point();
-  counts = sums = NULL;
-  results = prom_metric_get(p, metric, PROM_METRIC_TYPE_HISTOGRAM, &counts,
-    &sums);
-  ck_assert_msg(results != NULL, "Failed to get histogram results: %s",
-    strerror(errno));
-  ck_assert_msg(results->nelts == 4, "Expected 4 bucket results, got %d",
-    results->nelts);
-  ck_assert_msg(counts != NULL, "Failed to get histogram count results: %s",
-    strerror(errno));
-  ck_assert_msg(counts->nelts == 4, "Expected 4 count results, got %d",
-    counts->nelts);
-  ck_assert_msg(sums != NULL, "Failed to get histogram sum results: %s",
-    strerror(errno));
-  ck_assert_msg(sums->nelts == 4, "Expected 4 sum results, got %d",
-    sums->nelts);
+  results = prom_metric_get(p, metric, PROM_METRIC_TYPE_HISTOGRAM, NULL, NULL);
+  ck_assert_msg(results == NULL, "Failed to handle histogram-less metric");
+  ck_assert_msg(errno == EPERM, "Expected EPERM (%d), got %s (%d)", EPERM,
+    strerror(errno), errno);
 
   mark_point();
   res = prom_metric_destroy(p, metric);
@@ -843,12 +881,12 @@ START_TEST (metric_observe_test) {
 }
 END_TEST
 
-START_TEST (metric_set_test) {
+START_TEST (metric_decr_test) {
   int res;
   const char *name;
   struct prom_dbh *dbh;
   struct prom_metric *metric;
-  uint32_t set_val = 42;
+  uint32_t decr_val = 32;
   pr_table_t *labels;
   const array_header *results;
 
@@ -856,13 +894,13 @@ START_TEST (metric_set_test) {
   (void) tests_mkpath(p, test_dir);
 
   mark_point();
-  res = prom_metric_set(NULL, NULL, 0, NULL);
+  res = prom_metric_decr(NULL, NULL, 0, NULL);
   ck_assert_msg(res < 0, "Failed to handle null pool");
   ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
     strerror(errno), errno);
 
   mark_point();
-  res = prom_metric_set(p, NULL, 0, NULL);
+  res = prom_metric_decr(p, NULL, 0, NULL);
   ck_assert_msg(res < 0, "Failed to handle null metric");
   ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
     strerror(errno), errno);
@@ -877,7 +915,7 @@ START_TEST (metric_set_test) {
   ck_assert_msg(metric != NULL, "Failed to create metric: %s", strerror(errno));
 
   mark_point();
-  res = prom_metric_set(p, metric, set_val, NULL);
+  res = prom_metric_decr(p, metric, decr_val, NULL);
   ck_assert_msg(res < 0, "Failed to handle gauge-less metric");
   ck_assert_msg(errno == EPERM, "Expected EPERM (%d), got %s (%d)", EPERM,
     strerror(errno), errno);
@@ -887,8 +925,8 @@ START_TEST (metric_set_test) {
   ck_assert_msg(res == 0, "Failed to add gauge to metric: %s", strerror(errno));
 
   mark_point();
-  res = prom_metric_set(p, metric, set_val, NULL);
-  ck_assert_msg(res == 0, "Failed to set metric: %s", strerror(errno));
+  res = prom_metric_decr(p, metric, decr_val, NULL);
+  ck_assert_msg(res == 0, "Failed to decrement metric: %s", strerror(errno));
 
   mark_point();
   results = prom_metric_get(p, metric, PROM_METRIC_TYPE_GAUGE, NULL, NULL);
@@ -903,8 +941,8 @@ START_TEST (metric_set_test) {
   (void) pr_table_add_dup(labels, "foo", "BAR", 0);
 
   mark_point();
-  res = prom_metric_set(p, metric, set_val, labels);
-  ck_assert_msg(res == 0, "Failed to set metric: %s", strerror(errno));
+  res = prom_metric_decr(p, metric, decr_val, labels);
+  ck_assert_msg(res == 0, "Failed to decrement metric: %s", strerror(errno));
 
   mark_point();
   results = prom_metric_get(p, metric, PROM_METRIC_TYPE_GAUGE, NULL, NULL);
@@ -923,17 +961,30 @@ START_TEST (metric_set_test) {
 }
 END_TEST
 
-START_TEST (metric_get_text_test) {
+START_TEST (metric_incr_type_test) {
   int res;
-  const char *name, *text;
-  size_t textlen = 0;
+  const char *name;
   struct prom_dbh *dbh;
   struct prom_metric *metric;
+  uint32_t incr_val = 66;
   pr_table_t *labels;
+  const array_header *results;
 
   (void) tests_rmpath(p, test_dir);
   (void) tests_mkpath(p, test_dir);
 
+  mark_point();
+  res = prom_metric_incr_type(NULL, NULL, 0, NULL, 0);
+  ck_assert_msg(res < 0, "Failed to handle null pool");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  res = prom_metric_incr_type(p, NULL, 0, NULL, 0);
+  ck_assert_msg(res < 0, "Failed to handle null metric");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
   mark_point();
   dbh = prom_metric_init(p, test_dir);
   ck_assert_msg(dbh != NULL, "Failed to init metrics: %s", strerror(errno));
@@ -944,75 +995,214 @@ START_TEST (metric_get_text_test) {
   ck_assert_msg(metric != NULL, "Failed to create metric: %s", strerror(errno));
 
   mark_point();
-  res = prom_metric_add_counter(metric, "total", "counter testing");
-  ck_assert_msg(res == 0, "Failed to add counter to metric: %s", strerror(errno));
+  res = prom_metric_incr_type(p, metric, incr_val, NULL, 0);
+  ck_assert_msg(res < 0, "Failed to handle unknown metric type");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
 
   mark_point();
-  res = prom_metric_add_gauge(metric, "count", "gauge testing");
-  ck_assert_msg(res == 0, "Failed to add gauge to metric: %s", strerror(errno));
+  res = prom_metric_incr_type(p, metric, incr_val, NULL,
+    PROM_METRIC_TYPE_COUNTER);
+  ck_assert_msg(res < 0, "Failed to handle counter-less metric");
+  ck_assert_msg(errno == EPERM, "Expected EPERM (%d), got %s (%d)", EPERM,
+    strerror(errno), errno);
 
   mark_point();
-  res = prom_metric_add_histogram(metric, "weight", "histogram testing", 0);
-  ck_assert_msg(res == 0, "Failed to add histogram to metric: %s",
-    strerror(errno));
+  res = prom_metric_incr_type(p, metric, incr_val, NULL,
+    PROM_METRIC_TYPE_GAUGE);
+  ck_assert_msg(res < 0, "Failed to handle gauge-less metric");
+  ck_assert_msg(errno == EPERM, "Expected EPERM (%d), got %s (%d)", EPERM,
+    strerror(errno), errno);
 
   mark_point();
-  res = prom_metric_incr(p, metric, 6, NULL);
+  res = prom_metric_add_counter(metric, "total", "testing");
+  ck_assert_msg(res == 0, "Failed to add counter to metric: %s", strerror(errno));
+
+  mark_point();
+  res = prom_metric_incr_type(p, metric, incr_val, NULL,
+    PROM_METRIC_TYPE_COUNTER);
   ck_assert_msg(res == 0, "Failed to increment metric: %s", strerror(errno));
 
+  mark_point();
+  results = prom_metric_get(p, metric, PROM_METRIC_TYPE_COUNTER, NULL, NULL);
+  ck_assert_msg(results != NULL, "Failed to get label-less counter samples: %s",
+    strerror(errno));
+  ck_assert_msg(results->nelts == 2, "Expected 2 results, got %d",
+    results->nelts);
+
   /* Now, provide labels. */
   labels = pr_table_nalloc(p, 0, 2);
   (void) pr_table_add_dup(labels, "protocol", "ftp", 0);
   (void) pr_table_add_dup(labels, "foo", "BAR", 0);
 
   mark_point();
-  res = prom_metric_incr(p, metric, 8, labels);
+  res = prom_metric_incr_type(p, metric, incr_val, labels,
+    PROM_METRIC_TYPE_COUNTER);
   ck_assert_msg(res == 0, "Failed to increment metric: %s", strerror(errno));
 
   mark_point();
-  res = prom_metric_observe(p, metric, 76.42, labels);
-  ck_assert_msg(res == 0, "Failed to observe metric: %s", strerror(errno));
+  results = prom_metric_get(p, metric, PROM_METRIC_TYPE_COUNTER, NULL, NULL);
+  ck_assert_msg(results != NULL, "Failed to get labeled counter samples: %s",
+    strerror(errno));
+  ck_assert_msg(results->nelts == 4, "Expected 4 results, got %d",
+    results->nelts);
 
   mark_point();
-  text = prom_metric_get_text(p, metric, "prt", &textlen);
-  ck_assert_msg(text != NULL, "Failed to get metric text: %s", strerror(errno));
-  ck_assert_msg(textlen > 0, "Expected text data, got %lu",
-    (unsigned long) textlen);
+  res = prom_metric_destroy(p, metric);
+  ck_assert_msg(res == 0, "Failed to destroy metric: %s", strerror(errno));
 
-  /* Use strstr(3) to assert bits of text. */
-  ck_assert_msg(strstr(text, "# HELP prt_test_total") != NULL,
-    "Expected counter HELP text");
-  ck_assert_msg(strstr(text, "# TYPE prt_test_total counter") != NULL,
-    "Expected counter TYPE text");
-  ck_assert_msg(strstr(text, "prt_test_total 6") != NULL,
-    "Expected label-less counter sample");
-  ck_assert_msg(
-    strstr(text, "prt_test_total{foo=\"BAR\",protocol=\"ftp\"} 8") != NULL,
-    "Expected labeled counter sample");
+  res = prom_metric_free(p, dbh);
+  ck_assert_msg(res == 0, "Failed to free metrics: %s", strerror(errno));
+  (void) tests_rmpath(p, test_dir);
+}
+END_TEST
 
-  ck_assert_msg(strstr(text, "# HELP prt_test_count") != NULL,
-    "Expected gauge HELP text");
-  ck_assert_msg(strstr(text, "# TYPE prt_test_count gauge") != NULL,
-    "Expected gauge TYPE text");
-  ck_assert_msg(strstr(text, "prt_test_count 6") != NULL,
-    "Expected label-less gauge sample");
-  ck_assert_msg(
-    strstr(text, "prt_test_count{foo=\"BAR\",protocol=\"ftp\"} 8") != NULL,
-    "Expected labeled gauge sample");
+START_TEST (metric_incr_test) {
+  int res;
+  const char *name;
+  struct prom_dbh *dbh;
+  struct prom_metric *metric;
+  uint32_t incr_val = 66;
+  pr_table_t *labels;
+  const array_header *results;
 
-  ck_assert_msg(strstr(text, "# HELP prt_test_weight") != NULL,
-    "Expected histogram HELP text");
-  ck_assert_msg(strstr(text, "# TYPE prt_test_weight histogram") != NULL,
-    "Expected histogram TYPE text");
-  ck_assert_msg(
-    strstr(text, "prt_test_weight_bucket{foo=\"BAR\",le=\"+Inf\",protocol=\"ftp\"} 1") != NULL,
-    "Expected labeled histogram bucket sample");
-  ck_assert_msg(
-    strstr(text, "prt_test_weight_count{foo=\"BAR\",protocol=\"ftp\"} 1") != NULL,
-    "Expected labeled histogram count sample");
-  ck_assert_msg(
-    strstr(text, "prt_test_weight_sum{foo=\"BAR\",protocol=\"ftp\"} 76.42") != NULL,
-    "Expected labeled histogram sum sample");
+  (void) tests_rmpath(p, test_dir);
+  (void) tests_mkpath(p, test_dir);
+
+  mark_point();
+  res = prom_metric_incr(NULL, NULL, 0, NULL);
+  ck_assert_msg(res < 0, "Failed to handle null pool");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  res = prom_metric_incr(p, NULL, 0, NULL);
+  ck_assert_msg(res < 0, "Failed to handle null metric");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  dbh = prom_metric_init(p, test_dir);
+  ck_assert_msg(dbh != NULL, "Failed to init metrics: %s", strerror(errno));
+
+  mark_point();
+  name = "test";
+  metric = prom_metric_create(p, name, dbh);
+  ck_assert_msg(metric != NULL, "Failed to create metric: %s", strerror(errno));
+
+  mark_point();
+  res = prom_metric_incr(p, metric, incr_val, NULL);
+  ck_assert_msg(res < 0, "Failed to handle counter-less metric");
+  ck_assert_msg(errno == EPERM, "Expected EPERM (%d), got %s (%d)", EPERM,
+    strerror(errno), errno);
+
+  mark_point();
+  res = prom_metric_add_counter(metric, "total", "testing");
+  ck_assert_msg(res == 0, "Failed to add counter to metric: %s", strerror(errno));
+
+  mark_point();
+  res = prom_metric_incr(p, metric, incr_val, NULL);
+  ck_assert_msg(res == 0, "Failed to increment metric: %s", strerror(errno));
+
+  mark_point();
+  results = prom_metric_get(p, metric, PROM_METRIC_TYPE_COUNTER, NULL, NULL);
+  ck_assert_msg(results != NULL, "Failed to get label-less counter samples: %s",
+    strerror(errno));
+  ck_assert_msg(results->nelts == 2, "Expected 2 results, got %d",
+    results->nelts);
+
+  /* Now, provide labels. */
+  labels = pr_table_nalloc(p, 0, 2);
+  (void) pr_table_add_dup(labels, "protocol", "ftp", 0);
+  (void) pr_table_add_dup(labels, "foo", "BAR", 0);
+
+  mark_point();
+  res = prom_metric_incr(p, metric, incr_val, labels);
+  ck_assert_msg(res == 0, "Failed to increment metric: %s", strerror(errno));
+
+  mark_point();
+  results = prom_metric_get(p, metric, PROM_METRIC_TYPE_COUNTER, NULL, NULL);
+  ck_assert_msg(results != NULL, "Failed to get labeled counter samples: %s",
+    strerror(errno));
+  ck_assert_msg(results->nelts == 4, "Expected 4 results, got %d",
+    results->nelts);
+
+  mark_point();
+  res = prom_metric_destroy(p, metric);
+  ck_assert_msg(res == 0, "Failed to destroy metric: %s", strerror(errno));
+
+  res = prom_metric_free(p, dbh);
+  ck_assert_msg(res == 0, "Failed to free metrics: %s", strerror(errno));
+  (void) tests_rmpath(p, test_dir);
+}
+END_TEST
+
+START_TEST (metric_incr_counter_gauge_test) {
+  int res;
+  const char *name;
+  struct prom_dbh *dbh;
+  struct prom_metric *metric;
+  uint32_t incr_val = 66;
+  pr_table_t *labels;
+  const array_header *results;
+
+  (void) tests_rmpath(p, test_dir);
+  (void) tests_mkpath(p, test_dir);
+
+  mark_point();
+  dbh = prom_metric_init(p, test_dir);
+  ck_assert_msg(dbh != NULL, "Failed to init metrics: %s", strerror(errno));
+
+  mark_point();
+  name = "test";
+  metric = prom_metric_create(p, name, dbh);
+  ck_assert_msg(metric != NULL, "Failed to create metric: %s", strerror(errno));
+
+  mark_point();
+  res = prom_metric_add_counter(metric, "total", "testing");
+  ck_assert_msg(res == 0, "Failed to add counter to metric: %s", strerror(errno));
+
+  res = prom_metric_add_gauge(metric, "count", "testing");
+  ck_assert_msg(res == 0, "Failed to add gauge to metric: %s", strerror(errno));
+
+  mark_point();
+  res = prom_metric_incr(p, metric, incr_val, NULL);
+  ck_assert_msg(res == 0, "Failed to increment metric: %s", strerror(errno));
+
+  mark_point();
+  results = prom_metric_get(p, metric, PROM_METRIC_TYPE_COUNTER, NULL, NULL);
+  ck_assert_msg(results != NULL, "Failed to get label-less counter samples: %s",
+    strerror(errno));
+  ck_assert_msg(results->nelts == 2, "Expected 2 results, got %d",
+    results->nelts);
+
+  results = prom_metric_get(p, metric, PROM_METRIC_TYPE_GAUGE, NULL, NULL);
+  ck_assert_msg(results != NULL, "Failed to get label-less gauge samples: %s",
+    strerror(errno));
+  ck_assert_msg(results->nelts == 2, "Expected 2 results, got %d",
+    results->nelts);
+
+  /* Now, provide labels. */
+  labels = pr_table_nalloc(p, 0, 2);
+  (void) pr_table_add_dup(labels, "protocol", "ftp", 0);
+  (void) pr_table_add_dup(labels, "foo", "BAR", 0);
+
+  mark_point();
+  res = prom_metric_incr(p, metric, incr_val, labels);
+  ck_assert_msg(res == 0, "Failed to increment metric: %s", strerror(errno));
+
+  mark_point();
+  results = prom_metric_get(p, metric, PROM_METRIC_TYPE_COUNTER, NULL, NULL);
+  ck_assert_msg(results != NULL, "Failed to get labeled counter samples: %s",
+    strerror(errno));
+  ck_assert_msg(results->nelts == 4, "Expected 4 results, got %d",
+    results->nelts);
+
+  results = prom_metric_get(p, metric, PROM_METRIC_TYPE_GAUGE, NULL, NULL);
+  ck_assert_msg(results != NULL, "Failed to get labeled gauge samples: %s",
+    strerror(errno));
+  ck_assert_msg(results->nelts == 4, "Expected 4 results, got %d",
+    results->nelts);
 
   mark_point();
   res = prom_metric_destroy(p, metric);
@@ -1024,6 +1214,1351 @@ START_TEST (metric_get_text_test) {
 }
 END_TEST
 
+START_TEST (metric_observe_test) {
+  int res;
+  const char *name;
+  struct prom_dbh *dbh;
+  struct prom_metric *metric;
+  double observed_val = 3.1415;
+  pr_table_t *labels;
+  const array_header *results, *counts = NULL, *sums = NULL;
+
+  (void) tests_rmpath(p, test_dir);
+  (void) tests_mkpath(p, test_dir);
+
+  mark_point();
+  res = prom_metric_observe(NULL, NULL, 0, NULL);
+  ck_assert_msg(res < 0, "Failed to handle null pool");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  res = prom_metric_observe(p, NULL, 0, NULL);
+  ck_assert_msg(res < 0, "Failed to handle null metric");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  dbh = prom_metric_init(p, test_dir);
+  ck_assert_msg(dbh != NULL, "Failed to init metrics: %s", strerror(errno));
+
+  mark_point();
+  name = "test";
+  metric = prom_metric_create(p, name, dbh);
+  ck_assert_msg(metric != NULL, "Failed to create metric: %s", strerror(errno));
+
+  mark_point();
+  res = prom_metric_observe(p, metric, observed_val, NULL);
+  ck_assert_msg(res < 0, "Failed to handle histogram-less metric");
+  ck_assert_msg(errno == EPERM, "Expected EPERM (%d), got %s (%d)", EPERM,
+    strerror(errno), errno);
+
+  mark_point();
+  res = prom_metric_add_histogram(metric, "units", "testing", 0);
+  ck_assert_msg(res == 0, "Failed to add histogram to metric: %s",
+    strerror(errno));
+
+  mark_point();
+  res = prom_metric_observe(p, metric, observed_val, NULL);
+  ck_assert_msg(res == 0, "Failed to observe metric: %s", strerror(errno));
+
+  mark_point();
+  results = prom_metric_get(p, metric, PROM_METRIC_TYPE_HISTOGRAM, &counts,
+    &sums);
+  ck_assert_msg(results != NULL, "Failed get histogram results: %s",
+    strerror(errno));
+  ck_assert_msg(results->nelts == 2, "Expected 2 bucket results, got %d",
+    results->nelts);
+  ck_assert_msg(counts != NULL, "Failed get histogram count results: %s",
+    strerror(errno));
+  ck_assert_msg(counts->nelts == 2, "Expected 2 count results, got %d",
+    counts->nelts);
+  ck_assert_msg(sums != NULL, "Failed get histogram sum results: %s",
+    strerror(errno));
+  ck_assert_msg(sums->nelts == 2, "Expected 2 sum results, got %d",
+    sums->nelts);
+
+  /* Now, provide labels. */
+  labels = pr_table_nalloc(p, 0, 2);
+  (void) pr_table_add_dup(labels, "protocol", "ftp", 0);
+  (void) pr_table_add_dup(labels, "foo", "BAR", 0);
+
+  mark_point();
+  res = prom_metric_observe(p, metric, observed_val, labels);
+  ck_assert_msg(res == 0, "Failed to observe metric: %s", strerror(errno));
+
+  mark_point();
+  counts = sums = NULL;
+  results = prom_metric_get(p, metric, PROM_METRIC_TYPE_HISTOGRAM, &counts,
+    &sums);
+  ck_assert_msg(results != NULL, "Failed to get histogram results: %s",
+    strerror(errno));
+  ck_assert_msg(results->nelts == 4, "Expected 4 bucket results, got %d",
+    results->nelts);
+  ck_assert_msg(counts != NULL, "Failed to get histogram count results: %s",
+    strerror(errno));
+  ck_assert_msg(counts->nelts == 4, "Expected 4 count results, got %d",
+    counts->nelts);
+  ck_assert_msg(sums != NULL, "Failed to get histogram sum results: %s",
+    strerror(errno));
+  ck_assert_msg(sums->nelts == 4, "Expected 4 sum results, got %d",
+    sums->nelts);
+
+  mark_point();
+  res = prom_metric_destroy(p, metric);
+  ck_assert_msg(res == 0, "Failed to destroy metric: %s", strerror(errno));
+
+  res = prom_metric_free(p, dbh);
+  ck_assert_msg(res == 0, "Failed to free metrics: %s", strerror(errno));
+  (void) tests_rmpath(p, test_dir);
+}
+END_TEST
+
+START_TEST (metric_set_test) {
+  int res;
+  const char *name;
+  struct prom_dbh *dbh;
+  struct prom_metric *metric;
+  uint32_t set_val = 42;
+  pr_table_t *labels;
+  const array_header *results;
+
+  (void) tests_rmpath(p, test_dir);
+  (void) tests_mkpath(p, test_dir);
+
+  mark_point();
+  res = prom_metric_set(NULL, NULL, 0, NULL);
+  ck_assert_msg(res < 0, "Failed to handle null pool");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  res = prom_metric_set(p, NULL, 0, NULL);
+  ck_assert_msg(res < 0, "Failed to handle null metric");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  dbh = prom_metric_init(p, test_dir);
+  ck_assert_msg(dbh != NULL, "Failed to init metrics: %s", strerror(errno));
+
+  mark_point();
+  name = "test";
+  metric = prom_metric_create(p, name, dbh);
+  ck_assert_msg(metric != NULL, "Failed to create metric: %s", strerror(errno));
+
+  mark_point();
+  res = prom_metric_set(p, metric, set_val, NULL);
+  ck_assert_msg(res < 0, "Failed to handle gauge-less metric");
+  ck_assert_msg(errno == EPERM, "Expected EPERM (%d), got %s (%d)", EPERM,
+    strerror(errno), errno);
+
+  mark_point();
+  res = prom_metric_add_gauge(metric, "count", "testing");
+  ck_assert_msg(res == 0, "Failed to add gauge to metric: %s", strerror(errno));
+
+  mark_point();
+  res = prom_metric_set(p, metric, set_val, NULL);
+  ck_assert_msg(res == 0, "Failed to set metric: %s", strerror(errno));
+
+  mark_point();
+  results = prom_metric_get(p, metric, PROM_METRIC_TYPE_GAUGE, NULL, NULL);
+  ck_assert_msg(results != NULL, "Failed to get label-less gauge samples: %s",
+    strerror(errno));
+  ck_assert_msg(results->nelts == 2, "Expected 2 results, got %d",
+    results->nelts);
+
+  /* Now, provide labels. */
+  labels = pr_table_nalloc(p, 0, 2);
+  (void) pr_table_add_dup(labels, "protocol", "ftp", 0);
+  (void) pr_table_add_dup(labels, "foo", "BAR", 0);
+
+  mark_point();
+  res = prom_metric_set(p, metric, set_val, labels);
+  ck_assert_msg(res == 0, "Failed to set metric: %s", strerror(errno));
+
+  mark_point();
+  results = prom_metric_get(p, metric, PROM_METRIC_TYPE_GAUGE, NULL, NULL);
+  ck_assert_msg(results != NULL, "Failed to get labeled gauge samples: %s",
+    strerror(errno));
+  ck_assert_msg(results->nelts == 4, "Expected 4 results, got %d",
+    results->nelts);
+
+  mark_point();
+  res = prom_metric_destroy(p, metric);
+  ck_assert_msg(res == 0, "Failed to destroy metric: %s", strerror(errno));
+
+  res = prom_metric_free(p, dbh);
+  ck_assert_msg(res == 0, "Failed to free metrics: %s", strerror(errno));
+  (void) tests_rmpath(p, test_dir);
+}
+END_TEST
+
+START_TEST (metric_get_text_test) {
+  int res;
+  const char *name, *text;
+  size_t textlen = 0;
+  struct prom_dbh *dbh;
+  struct prom_metric *metric;
+  pr_table_t *labels;
+
+  (void) tests_rmpath(p, test_dir);
+  (void) tests_mkpath(p, test_dir);
+
+  mark_point();
+  dbh = prom_metric_init(p, test_dir);
+  ck_assert_msg(dbh != NULL, "Failed to init metrics: %s", strerror(errno));
+
+  mark_point();
+  name = "test";
+  metric = prom_metric_create(p, name, dbh);
+  ck_assert_msg(metric != NULL, "Failed to create metric: %s", strerror(errno));
+
+  mark_point();
+  res = prom_metric_add_counter(metric, "total", "counter testing");
+  ck_assert_msg(res == 0, "Failed to add counter to metric: %s", strerror(errno));
+
+  mark_point();
+  res = prom_metric_add_gauge(metric, "count", "gauge testing");
+  ck_assert_msg(res == 0, "Failed to add gauge to metric: %s", strerror(errno));
+
+  mark_point();
+  res = prom_metric_add_histogram(metric, "weight", "histogram testing", 0);
+  ck_assert_msg(res == 0, "Failed to add histogram to metric: %s",
+    strerror(errno));
+
+  mark_point();
+  res = prom_metric_incr(p, metric, 6, NULL);
+  ck_assert_msg(res == 0, "Failed to increment metric: %s", strerror(errno));
+
+  /* Now, provide labels. */
+  labels = pr_table_nalloc(p, 0, 2);
+  (void) pr_table_add_dup(labels, "protocol", "ftp", 0);
+  (void) pr_table_add_dup(labels, "foo", "BAR", 0);
+
+  mark_point();
+  res = prom_metric_incr(p, metric, 8, labels);
+  ck_assert_msg(res == 0, "Failed to increment metric: %s", strerror(errno));
+
+  mark_point();
+  res = prom_metric_observe(p, metric, 76.42, labels);
+  ck_assert_msg(res == 0, "Failed to observe metric: %s", strerror(errno));
+
+  mark_point();
+  text = prom_metric_get_text(p, metric, "prt", &textlen);
+  ck_assert_msg(text != NULL, "Failed to get metric text: %s", strerror(errno));
+  ck_assert_msg(textlen > 0, "Expected text data, got %lu",
+    (unsigned long) textlen);
+
+  /* Use strstr(3) to assert bits of text. */
+  ck_assert_msg(strstr(text, "# HELP prt_test_total") != NULL,
+    "Expected counter HELP text");
+  ck_assert_msg(strstr(text, "# TYPE prt_test_total counter") != NULL,
+    "Expected counter TYPE text");
+  ck_assert_msg(strstr(text, "prt_test_total 6") != NULL,
+    "Expected label-less counter sample");
+  ck_assert_msg(
+    strstr(text, "prt_test_total{foo=\"BAR\",protocol=\"ftp\"} 8") != NULL,
+    "Expected labeled counter sample");
+
+  ck_assert_msg(strstr(text, "# HELP prt_test_count") != NULL,
+    "Expected gauge HELP text");
+  ck_assert_msg(strstr(text, "# TYPE prt_test_count gauge") != NULL,
+    "Expected gauge TYPE text");
+  ck_assert_msg(strstr(text, "prt_test_count 6") != NULL,
+    "Expected label-less gauge sample");
+  ck_assert_msg(
+    strstr(text, "prt_test_count{foo=\"BAR\",protocol=\"ftp\"} 8") != NULL,
+    "Expected labeled gauge sample");
+
+  ck_assert_msg(strstr(text, "# HELP prt_test_weight") != NULL,
+    "Expected histogram HELP text");
+  ck_assert_msg(strstr(text, "# TYPE prt_test_weight histogram") != NULL,
+    "Expected histogram TYPE text");
+  ck_assert_msg(
+    strstr(text, "prt_test_weight_bucket{foo=\"BAR\",le=\"+Inf\",protocol=\"ftp\"} 1") != NULL,
+    "Expected labeled histogram bucket sample");
+  ck_assert_msg(
+    strstr(text, "prt_test_weight_count{foo=\"BAR\",protocol=\"ftp\"} 1") != NULL,
+    "Expected labeled histogram count sample");
+  ck_assert_msg(
+    strstr(text, "prt_test_weight_sum{foo=\"BAR\",protocol=\"ftp\"} 76.42") != NULL,
+    "Expected labeled histogram sum sample");
+
+  mark_point();
+  res = prom_metric_destroy(p, metric);
+  ck_assert_msg(res == 0, "Failed to destroy metric: %s", strerror(errno));
+
+  res = prom_metric_free(p, dbh);
+  ck_assert_msg(res == 0, "Failed to free metrics: %s", strerror(errno));
+  (void) tests_rmpath(p, test_dir);
+}
+END_TEST
+
+START_TEST (metric_get_text_with_samples_test) {
+  int res;
+  const char *name, *text, *expected, *ptr, *inf_ptr;
+  size_t textlen = 0, expectedlen = 0;
+  struct prom_dbh *dbh;
+  struct prom_metric *metric;
+  struct prom_metric_scan *scan;
+  array_header *metrics;
+  pr_table_t *labels, *samples;
+
+  (void) tests_rmpath(p, test_dir);
+  (void) tests_mkpath(p, test_dir);
+
+  mark_point();
+  scan = prom_metric_scan_open(NULL, NULL, NULL);
+  ck_assert_msg(scan == NULL, "Failed to handle null pool");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  scan = prom_metric_scan_open(p, NULL, NULL);
+  ck_assert_msg(scan == NULL, "Failed to handle null dbh");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  dbh = prom_metric_init(p, test_dir);
+  ck_assert_msg(dbh != NULL, "Failed to init metrics: %s", strerror(errno));
+
+  mark_point();
+  name = "test";
+  metric = prom_metric_create(p, name, dbh);
+  ck_assert_msg(metric != NULL, "Failed to create metric: %s", strerror(errno));
+
+  mark_point();
+  text = prom_metric_get_text_with_samples(p, metric, "prt", NULL, &textlen);
+  ck_assert_msg(text == NULL, "Failed to handle null samples");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  res = prom_metric_add_counter(metric, "total", "counter testing");
+  ck_assert_msg(res == 0, "Failed to add counter to metric: %s", strerror(errno));
+
+  mark_point();
+  res = prom_metric_add_histogram(metric, "weight", "histogram testing", 2,
+    (double) 1.0, (double) 100.0);
+  ck_assert_msg(res == 0, "Failed to add histogram to metric: %s",
+    strerror(errno));
+
+  labels = pr_table_nalloc(p, 0, 2);
+  (void) pr_table_add_dup(labels, "protocol", "ftp", 0);
+
+  mark_point();
+  res = prom_metric_incr(p, metric, 3, labels);
+  ck_assert_msg(res == 0, "Failed to increment metric: %s", strerror(errno));
+
+  mark_point();
+  res = prom_metric_observe(p, metric, 76.42, labels);
+  ck_assert_msg(res == 0, "Failed to observe metric: %s", strerror(errno));
+
+  metrics = make_array(p, 1, sizeof(struct prom_metric *));
+  *((struct prom_metric **) push_array(metrics)) = metric;
+
+  mark_point();
+  scan = prom_metric_scan_open(p, dbh, metrics);
+  ck_assert_msg(scan != NULL, "Failed to open scan: %s", strerror(errno));
+
+  samples = prom_metric_scan_next(p, scan);
+  ck_assert_msg(samples != NULL, "Failed to scan samples: %s",
+    strerror(errno));
+
+  res = prom_metric_scan_close(scan);
+  ck_assert_msg(res == 0, "Failed to close scan: %s", strerror(errno));
+
+  mark_point();
+  text = prom_metric_get_text_with_samples(p, metric, "prt", samples,
+    &textlen);
+  ck_assert_msg(text != NULL, "Failed to get metric text: %s", strerror(errno));
+
+  /* The text should be the same as that obtained by querying per metric. */
+  mark_point();
+  expected = prom_metric_get_text(p, metric, "prt", &expectedlen);
+  ck_assert_msg(expected != NULL, "Failed to get metric text: %s",
+    strerror(errno));
+  ck_assert_msg(textlen == expectedlen && strcmp(text, expected) == 0,
+    "Expected '%s', got '%s'", expected, text);
+
+  ck_assert_msg(strstr(text, "prt_test_total{protocol=\"ftp\"} 3") != NULL,
+    "Expected labeled counter sample, got '%s'", text);
+
+  /* The "+Inf" bucket must follow the other buckets. */
+  ptr = strstr(text, "prt_test_weight_bucket{le=\"100.000000\",protocol=\"ftp\"} 1");
+  ck_assert_msg(ptr != NULL, "Expected 100.0 bucket sample, got '%s'", text);
+  inf_ptr = strstr(text, "prt_test_weight_bucket{le=\"+Inf\",protocol=\"ftp\"} 1");
+  ck_assert_msg(inf_ptr != NULL, "Expected +Inf bucket sample, got '%s'", text);
+  ck_assert_msg(inf_ptr > ptr, "Expected +Inf bucket last, got '%s'", text);
+
+  mark_point();
+  res = prom_metric_destroy(p, metric);
+  ck_assert_msg(res == 0, "Failed to destroy metric: %s", strerror(errno));
+
+  res = prom_metric_free(p, dbh);
+  ck_assert_msg(res == 0, "Failed to free metrics: %s", strerror(errno));
+  (void) tests_rmpath(p, test_dir);
+}
+END_TEST
+
+START_TEST (metric_observe_cumulative_test) {
+  register unsigned int i;
+  int res;
+  struct prom_dbh *dbh;
+  struct prom_metric *metric;
+  struct prom_metric_shm *shm;
+  pr_table_t *labels;
+  const char *text;
+  size_t textlen;
+  double observed_vals[] = { 0.5, 5.0, 5.0, 50.0, 500.0 };
+
+  (void) tests_rmpath(p, test_dir);
+  (void) tests_mkpath(p, test_dir);
+
+  mark_point();
+  dbh = prom_metric_init(p, test_dir);
+  ck_assert_msg(dbh != NULL, "Failed to init metrics: %s", strerror(errno));
+
+  mark_point();
+  shm = prom_metric_shm_init(p, test_dir, 16);
+  ck_assert_msg(shm != NULL, "Failed to init shm: %s", strerror(errno));
+
+  mark_point();
+  metric = prom_metric_create(p, "test", dbh);
+  ck_assert_msg(metric != NULL, "Failed to create metric: %s", strerror(errno));
+
+  res = prom_metric_add_histogram(metric, "weight", "histogram testing", 3,
+    (double) 1.0, (double) 10.0, (double) 100.0);
+  ck_assert_msg(res == 0, "Failed to add histogram to metric: %s",
+    strerror(errno));
+
+  labels = pr_table_nalloc(p, 0, 2);
+  (void) pr_table_add_dup(labels, "protocol", "ftp", 0);
+  (void) pr_table_add_dup(labels, "foo", "BAR", 0);
+
+  /* The same cumulative counts are expected from both datastores. */
+  for (i = 0; i < 2; i++) {
+    register unsigned int j;
+
+    mark_point();
+    res = prom_metric_set_shm(metric, i == 0 ? NULL : shm);
+    ck_assert_msg(res == 0, "Failed to set shm: %s", strerror(errno));
+
+    for (j = 0; j < 5; j++) {
+      res = prom_metric_observe(p, metric, observed_vals[j], labels);
+      ck_assert_msg(res == 0, "Failed to observe metric: %s", strerror(errno));
+    }
+
+    mark_point();
+    text = prom_metric_get_text(p, metric, "prt", &textlen);
+    ck_assert_msg(text != NULL, "Failed to get metric text: %s",
+      strerror(errno));
+
+    ck_assert_msg(strstr(text, "prt_test_weight_bucket{foo=\"BAR\",le=\"1.000000\",protocol=\"ftp\"} 1\n") != NULL,
+      "Expected 1.0 bucket sample, got '%s'", text);
+    ck_assert_msg(strstr(text, "prt_test_weight_bucket{foo=\"BAR\",le=\"10.000000\",protocol=\"ftp\"} 3\n") != NULL,
+      "Expected 10.0 bucket sample, got '%s'", text);
+    ck_assert_msg(strstr(text, "prt_test_weight_bucket{foo=\"BAR\",le=\"100.000000\",protocol=\"ftp\"} 4\n") != NULL,
+      "Expected 100.0 bucket sample, got '%s'", text);
+    ck_assert_msg(strstr(text, "prt_test_weight_bucket{foo=\"BAR\",le=\"+Inf\",protocol=\"ftp\"} 5\n") != NULL,
+      "Expected +Inf bucket sample, got '%s'", text);
+    ck_assert_msg(strstr(text, "prt_test_weight_count{foo=\"BAR\",protocol=\"ftp\"} 5\n") != NULL,
+      "Expected count sample, got '%s'", text);
+    ck_assert_msg(strstr(text, "prt_test_weight_sum{foo=\"BAR\",protocol=\"ftp\"} 560.5\n") != NULL,
+      "Expected sum sample, got '%s'", text);
+  }
+
+  /* Unlabeled observations get just the "le" label. */
+  mark_point();
+  res = prom_metric_observe(p, metric, 0.25, NULL);
+  ck_assert_msg(res == 0, "Failed to observe metric: %s", strerror(errno));
+
+  text = prom_metric_get_text(p, metric, "prt", &textlen);
+  ck_assert_msg(text != NULL, "Failed to get metric text: %s",
+    strerror(errno));
+  ck_assert_msg(strstr(text, "prt_test_weight_bucket{le=\"1.000000\"} 1\n") != NULL,
+    "Expected unlabeled bucket sample, got '%s'", text);
+  ck_assert_msg(strstr(text, "prt_test_weight_bucket{le=\"+Inf\"} 1\n") != NULL,
+    "Expected unlabeled +Inf bucket sample, got '%s'", text);
+
+  prom_metric_destroy(p, metric);
+  (void) prom_metric_shm_close(p, shm);
+  (void) prom_metric_free(p, dbh);
+  (void) tests_rmpath(p, test_dir);
+}
+END_TEST
+
+START_TEST (metric_observe_summary_test) {
+  register unsigned int i;
+  int res;
+  struct prom_dbh *dbh;
+  struct prom_metric *metric;
+  struct prom_metric_shm *shm;
+  pr_table_t *labels;
+  const char *text;
+  size_t textlen;
+
+  (void) tests_rmpath(p, test_dir);
+  (void) tests_mkpath(p, test_dir);
+
+  mark_point();
+  dbh = prom_metric_init(p, test_dir);
+  ck_assert_msg(dbh != NULL, "Failed to init metrics: %s", strerror(errno));
+
+  mark_point();
+  shm = prom_metric_shm_init(p, test_dir, 256);
+  ck_assert_msg(shm != NULL, "Failed to init shm: %s", strerror(errno));
+
+  mark_point();
+  metric = prom_metric_create(p, "test", dbh);
+  ck_assert_msg(metric != NULL, "Failed to create metric: %s", strerror(errno));
+
+  res = prom_metric_add_summary(metric, "latency", "summary testing", 2,
+    0.5, 0.99);
+  ck_assert_msg(res == 0, "Failed to add summary to metric: %s",
+    strerror(errno));
+
+  labels = pr_table_nalloc(p, 0, 2);
+  (void) pr_table_add_dup(labels, "protocol", "ftp", 0);
+  (void) pr_table_add_dup(labels, "foo", "BAR", 0);
+
+  /* Summaries are kept in the database even when using shared memory, thus
+   * the second round of observations adds to the first.
+   */
+  for (i = 0; i < 2; i++) {
+    register unsigned int j;
+    const char *ptr, *prefix;
+    char expected[128];
+    double val;
+
+    mark_point();
+    res = prom_metric_set_shm(metric, i == 0 ? NULL : shm);
+    ck_assert_msg(res == 0, "Failed to set shm: %s", strerror(errno));
+
+    for (j = 1; j <= 100; j++) {
+      res = prom_metric_observe(p, metric, (double) j, labels);
+      ck_assert_msg(res == 0, "Failed to observe metric: %s", strerror(errno));
+    }
+
+    mark_point();
+    text = prom_metric_get_text(p, metric, "prt", &textlen);
+    ck_assert_msg(text != NULL, "Failed to get metric text: %s",
+      strerror(errno));
+
+    ck_assert_msg(strstr(text, "# TYPE prt_test_latency summary\n") != NULL,
+      "Expected summary type, got '%s'", text);
+
+    prefix = "prt_test_latency{foo=\"BAR\",protocol=\"ftp\",quantile=\"0.5\"} ";
+    ptr = strstr(text, prefix);
+    ck_assert_msg(ptr != NULL, "Expected 0.5 quantile sample, got '%s'", text);
+    val = strtod(ptr + strlen(prefix), NULL);
+    ck_assert_msg(val >= 49.0 && val <= 52.0,
+      "Expected 0.5 quantile near 50.5, got %g", val);
+
+    prefix = "prt_test_latency{foo=\"BAR\",protocol=\"ftp\",quantile=\"0.99\"} ";
+    ptr = strstr(text, prefix);
+    ck_assert_msg(ptr != NULL, "Expected 0.99 quantile sample, got '%s'",
+      text);
+    val = strtod(ptr + strlen(prefix), NULL);
+    ck_assert_msg(val >= 97.0 && val <= 101.0,
+      "Expected 0.99 quantile near 99, got %g", val);
+
+    snprintf(expected, sizeof(expected),
+      "prt_test_latency_count{foo=\"BAR\",protocol=\"ftp\"} %u\n",
+      100 * (i + 1));
+    ck_assert_msg(strstr(text, expected) != NULL,
+      "Expected count sample '%s', got '%s'", expected, text);
+    snprintf(expected, sizeof(expected),
+      "prt_test_latency_sum{foo=\"BAR\",protocol=\"ftp\"} %u\n",
+      5050 * (i + 1));
+    ck_assert_msg(strstr(text, expected) != NULL,
+      "Expected sum sample '%s', got '%s'", expected, text);
+  }
+
+  ck_assert_msg(prom_metric_shm_sample_count(shm) == 0,
+    "Expected no shm samples, got %d", prom_metric_shm_sample_count(shm));
+
+  /* Unlabeled observations get just the "quantile" label. */
+  mark_point();
+  res = prom_metric_observe(p, metric, 0.25, NULL);
+  ck_assert_msg(res == 0, "Failed to observe metric: %s", strerror(errno));
+
+  text = prom_metric_get_text(p, metric, "prt", &textlen);
+  ck_assert_msg(text != NULL, "Failed to get metric text: %s",
+    strerror(errno));
+  ck_assert_msg(strstr(text, "prt_test_latency{quantile=\"0.5\"} ") != NULL,
+    "Expected unlabeled quantile sample, got '%s'", text);
+  ck_assert_msg(strstr(text, "prt_test_latency_count 1\n") != NULL,
+    "Expected unlabeled count sample, got '%s'", text);
+
+  prom_metric_destroy(p, metric);
+  (void) prom_metric_shm_close(p, shm);
+  (void) prom_metric_free(p, dbh);
+  (void) tests_rmpath(p, test_dir);
+}
+END_TEST
+
+START_TEST (metric_observe_native_test) {
+  register unsigned int i;
+  int res;
+  struct prom_dbh *dbh;
+  struct prom_metric *metric;
+  struct prom_metric_shm *shm;
+  struct prom_metric_buffer *buffer;
+  const char *text;
+  size_t textlen;
+  double observed_vals[] = { 1.0, 2.0, 2.0, 8.0 };
+
+  (void) tests_rmpath(p, test_dir);
+  (void) tests_mkpath(p, test_dir);
+
+  mark_point();
+  dbh = prom_metric_init(p, test_dir);
+  ck_assert_msg(dbh != NULL, "Failed to init metrics: %s", strerror(errno));
+
+  mark_point();
+  shm = prom_metric_shm_init(p, test_dir, 64);
+  ck_assert_msg(shm != NULL, "Failed to init shm: %s", strerror(errno));
+
+  mark_point();
+  metric = prom_metric_create(p, "test", dbh);
+  ck_assert_msg(metric != NULL, "Failed to create metric: %s", strerror(errno));
+
+  /* A histogram with no bucket bounds has only native buckets. */
+  res = prom_metric_add_histogram(metric, "weight", "histogram testing", 0);
+  ck_assert_msg(res == 0, "Failed to add histogram to metric: %s",
+    strerror(errno));
+
+  res = prom_metric_set_native_histogram(metric, 0);
+  ck_assert_msg(res == 0, "Failed to set native histogram: %s",
+    strerror(errno));
+
+  /* Native buckets are kept in the database even when using shared memory,
+   * thus the second round of observations adds to the first.
+   */
+  for (i = 0; i < 2; i++) {
+    register unsigned int j;
+    char expected[128];
+
+    mark_point();
+    res = prom_metric_set_shm(metric, i == 0 ? NULL : shm);
+    ck_assert_msg(res == 0, "Failed to set shm: %s", strerror(errno));
+
+    for (j = 0; j < 4; j++) {
+      res = prom_metric_observe(p, metric, observed_vals[j], NULL);
+      ck_assert_msg(res == 0, "Failed to observe metric: %s", strerror(errno));
+    }
+
+    mark_point();
+    text = prom_metric_get_text(p, metric, "prt", &textlen);
+    ck_assert_msg(text != NULL, "Failed to get metric text: %s",
+      strerror(errno));
+
+    /* With schema 0, the bucket bounds are powers of 2. */
+    snprintf(expected, sizeof(expected),
+      "prt_test_weight_bucket{le=\"1\"} %u\n", 1 * (i + 1));
+    ck_assert_msg(strstr(text, expected) != NULL,
+      "Expected 1 bucket sample '%s', got '%s'", expected, text);
+    snprintf(expected, sizeof(expected),
+      "prt_test_weight_bucket{le=\"2\"} %u\n", 3 * (i + 1));
+    ck_assert_msg(strstr(text, expected) != NULL,
+      "Expected 2 bucket sample '%s', got '%s'", expected, text);
+    snprintf(expected, sizeof(expected),
+      "prt_test_weight_bucket{le=\"8\"} %u\n", 4 * (i + 1));
+    ck_assert_msg(strstr(text, expected) != NULL,
+      "Expected 8 bucket sample '%s', got '%s'", expected, text);
+    ck_assert_msg(strstr(text, "prt_test_weight_bucket{le=\"4\"}") == NULL,
+      "Expected no empty 4 bucket sample, got '%s'", text);
+    snprintf(expected, sizeof(expected),
+      "prt_test_weight_bucket{le=\"+Inf\"} %u\n", 4 * (i + 1));
+    ck_assert_msg(strstr(text, expected) != NULL,
+      "Expected +Inf bucket sample '%s', got '%s'", expected, text);
+    snprintf(expected, sizeof(expected), "prt_test_weight_count %u\n",
+      4 * (i + 1));
+    ck_assert_msg(strstr(text, expected) != NULL,
+      "Expected count sample '%s', got '%s'", expected, text);
+    snprintf(expected, sizeof(expected), "prt_test_weight_sum %u\n",
+      13 * (i + 1));
+    ck_assert_msg(strstr(text, expected) != NULL,
+      "Expected sum sample '%s', got '%s'", expected, text);
+  }
+
+  ck_assert_msg(prom_metric_shm_sample_count(shm) == 0,
+    "Expected no shm samples, got %d", prom_metric_shm_sample_count(shm));
+
+  /* With a buffer, the native buckets are only written once flushed, even
+   * when using shared memory.
+   */
+  mark_point();
+  buffer = prom_metric_buffer_create(p, dbh);
+  ck_assert_msg(buffer != NULL, "Failed to create buffer: %s",
+    strerror(errno));
+
+  res = prom_metric_set_buffer(metric, buffer);
+  ck_assert_msg(res == 0, "Failed to set buffer: %s", strerror(errno));
+
+  for (i = 0; i < 4; i++) {
+    res = prom_metric_observe(p, metric, observed_vals[i], NULL);
+    ck_assert_msg(res == 0, "Failed to observe metric: %s", strerror(errno));
+  }
+
+  ck_assert_msg(prom_metric_buffer_count(buffer) > 0,
+    "Expected buffered bins, got %d", prom_metric_buffer_count(buffer));
+
+  text = prom_metric_get_text(p, metric, "prt", &textlen);
+  ck_assert_msg(text != NULL, "Failed to get metric text: %s",
+    strerror(errno));
+  ck_assert_msg(strstr(text, "prt_test_weight_count 8\n") != NULL,
+    "Expected unflushed count sample, got '%s'", text);
+
+  mark_point();
+  res = prom_metric_buffer_flush(p, buffer);
+  ck_assert_msg(res >= 0, "Failed to flush buffer: %s", strerror(errno));
+
+  text = prom_metric_get_text(p, metric, "prt", &textlen);
+  ck_assert_msg(text != NULL, "Failed to get metric text: %s",
+    strerror(errno));
+  ck_assert_msg(strstr(text, "prt_test_weight_count 12\n") != NULL,
+    "Expected flushed count sample, got '%s'", text);
+
+  (void) prom_metric_set_buffer(metric, NULL);
+  (void) prom_metric_buffer_destroy(buffer);
+
+  prom_metric_destroy(p, metric);
+  (void) prom_metric_shm_close(p, shm);
+  (void) prom_metric_free(p, dbh);
+  (void) tests_rmpath(p, test_dir);
+}
+END_TEST
+
+static void assert_proto(const char *buf, size_t buflen,
+    const unsigned char *expected, size_t expected_len) {
+  register unsigned int i;
+
+  ck_assert_msg(buflen == expected_len, "Expected %lu bytes, got %lu",
+    (unsigned long) expected_len, (unsigned long) buflen);
+
+  for (i = 0; i < buflen; i++) {
+    ck_assert_msg((unsigned char) buf[i] == expected[i],
+      "Expected 0x%02x at offset %u, got 0x%02x", expected[i], i,
+      (unsigned char) buf[i]);
+  }
+}
+
+START_TEST (metric_get_proto_test) {
+  int res;
+  struct prom_dbh *dbh;
+  struct prom_metric *metric;
+  pr_table_t *labels;
+  const char *buf;
+  size_t buflen = 0;
+  const unsigned char expected_counter[] = {
+    0x42,
+      0x0a, 0x0e, 'p', 'r', 't', '_', 't', 'e', 's', 't', '_', 't', 'o', 't',
+        'a', 'l',
+      0x12, 0x10, 'c', 'o', 'u', 'n', 't', 'e', 'r', ' ', 't', 'e', 's', 't',
+        'i', 'n', 'g', '.',
+      0x18, 0x00,
+      0x22, 0x1c,
+        0x0a, 0x0f,
+          0x0a, 0x08, 'p', 'r', 'o', 't', 'o', 'c', 'o', 'l',
+          0x12, 0x03, 'f', 't', 'p',
+        0x1a, 0x09,
+          0x09, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x40
+  };
+  const unsigned char expected_histogram[] = {
+    0x54,
+      0x0a, 0x0f, 'p', 'r', 't', '_', 't', 'e', 's', 't', '_', 'w', 'e', 'i',
+        'g', 'h', 't',
+      0x12, 0x12, 'h', 'i', 's', 't', 'o', 'g', 'r', 'a', 'm', ' ', 't', 'e',
+        's', 't', 'i', 'n', 'g', '.',
+      0x18, 0x04,
+      0x22, 0x2b,
+        0x3a, 0x29,
+          /* Count, sum, schema, zero threshold, zero count. */
+          0x08, 0x04,
+          0x11, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x2a, 0x40,
+          0x28, 0x00,
+          0x31, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xf0, 0x37,
+          0x38, 0x00,
+          /* Spans of buckets 0-1, and 3; then the deltas 1, 1, -1. */
+          0x62, 0x04, 0x08, 0x00, 0x10, 0x02,
+          0x62, 0x04, 0x08, 0x02, 0x10, 0x01,
+          0x6a, 0x03, 0x02, 0x02, 0x01
+  };
+
+  (void) tests_rmpath(p, test_dir);
+  (void) tests_mkpath(p, test_dir);
+
+  mark_point();
+  buf = prom_metric_get_proto(NULL, NULL, NULL, NULL);
+  ck_assert_msg(buf == NULL, "Failed to handle null pool");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  dbh = prom_metric_init(p, test_dir);
+  ck_assert_msg(dbh != NULL, "Failed to init metrics: %s", strerror(errno));
+
+  mark_point();
+  metric = prom_metric_create(p, "test", dbh);
+  ck_assert_msg(metric != NULL, "Failed to create metric: %s", strerror(errno));
+
+  mark_point();
+  buf = prom_metric_get_proto(p, metric, "prt", NULL);
+  ck_assert_msg(buf == NULL, "Failed to handle null len");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  res = prom_metric_add_counter(metric, "total", "counter testing");
+  ck_assert_msg(res == 0, "Failed to add counter to metric: %s",
+    strerror(errno));
+
+  labels = pr_table_nalloc(p, 0, 1);
+  (void) pr_table_add_dup(labels, "protocol", "ftp", 0);
+
+  res = prom_metric_incr(p, metric, 2, labels);
+  ck_assert_msg(res == 0, "Failed to increment metric: %s", strerror(errno));
+
+  mark_point();
+  buf = prom_metric_get_proto(p, metric, "prt", &buflen);
+  ck_assert_msg(buf != NULL, "Failed to get metric protobuf: %s",
+    strerror(errno));
+  assert_proto(buf, buflen, expected_counter, sizeof(expected_counter));
+
+  prom_metric_destroy(p, metric);
+
+  mark_point();
+  metric = prom_metric_create(p, "test", dbh);
+  ck_assert_msg(metric != NULL, "Failed to create metric: %s", strerror(errno));
+
+  res = prom_metric_add_histogram(metric, "weight", "histogram testing", 0);
+  ck_assert_msg(res == 0, "Failed to add histogram to metric: %s",
+    strerror(errno));
+
+  res = prom_metric_set_native_histogram(metric, 0);
+  ck_assert_msg(res == 0, "Failed to set native histogram: %s",
+    strerror(errno));
+
+  (void) prom_metric_observe(p, metric, 1.0, NULL);
+  (void) prom_metric_observe(p, metric, 2.0, NULL);
+  (void) prom_metric_observe(p, metric, 2.0, NULL);
+  (void) prom_metric_observe(p, metric, 8.0, NULL);
+
+  mark_point();
+  buf = prom_metric_get_proto(p, metric, "prt", &buflen);
+  ck_assert_msg(buf != NULL, "Failed to get metric protobuf: %s",
+    strerror(errno));
+  assert_proto(buf, buflen, expected_histogram, sizeof(expected_histogram));
+
+  prom_metric_destroy(p, metric);
+  (void) prom_metric_free(p, dbh);
+  (void) tests_rmpath(p, test_dir);
+}
+END_TEST
+
+START_TEST (metric_set_exemplar_labels_test) {
+  int res;
+  pr_table_t *labels;
+  char *long_value;
+
+  mark_point();
+  res = prom_metric_set_exemplar_labels(NULL, NULL);
+  ck_assert_msg(res < 0, "Failed to handle null pool");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  res = prom_metric_set_exemplar_labels(p, NULL);
+  ck_assert_msg(res == 0, "Failed to clear exemplar labels: %s",
+    strerror(errno));
+
+  labels = pr_table_nalloc(p, 0, 1);
+
+  mark_point();
+  res = prom_metric_set_exemplar_labels(p, labels);
+  ck_assert_msg(res < 0, "Failed to handle empty labels");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  long_value = pcalloc(p, PROM_METRIC_EXEMPLAR_MAX_LABELS_LEN + 1);
+  memset(long_value, 'a', PROM_METRIC_EXEMPLAR_MAX_LABELS_LEN);
+  (void) pr_table_add_dup(labels, "session_id", long_value, 0);
+
+  mark_point();
+  res = prom_metric_set_exemplar_labels(p, labels);
+  ck_assert_msg(res < 0, "Failed to handle too-long labels");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  labels = pr_table_nalloc(p, 0, 1);
+  (void) pr_table_add_dup(labels, "pid", "1", 0);
+
+  mark_point();
+  res = prom_metric_set_exemplar_labels(p, labels);
+  ck_assert_msg(res == 0, "Failed to set exemplar labels: %s",
+    strerror(errno));
+
+  (void) prom_metric_set_exemplar_labels(p, NULL);
+}
+END_TEST
+
+START_TEST (metric_get_openmetrics_test) {
+  int res;
+  struct prom_dbh *dbh;
+  struct prom_metric *metric;
+  struct prom_metric_scan *scan;
+  array_header *metrics;
+  pr_table_t *labels, *samples;
+  const char *text, *expected;
+  size_t textlen = 0;
+
+  (void) tests_rmpath(p, test_dir);
+  (void) tests_mkpath(p, test_dir);
+
+  mark_point();
+  text = prom_metric_get_openmetrics(NULL, NULL, NULL, NULL);
+  ck_assert_msg(text == NULL, "Failed to handle null pool");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  dbh = prom_metric_init(p, test_dir);
+  ck_assert_msg(dbh != NULL, "Failed to init metrics: %s", strerror(errno));
+
+  mark_point();
+  metric = prom_metric_create(p, "test", dbh);
+  ck_assert_msg(metric != NULL, "Failed to create metric: %s", strerror(errno));
+
+  mark_point();
+  text = prom_metric_get_openmetrics(p, metric, "prt", NULL);
+  ck_assert_msg(text == NULL, "Failed to handle null textlen");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  res = prom_metric_add_counter(metric, "total", "counter testing");
+  ck_assert_msg(res == 0, "Failed to add counter to metric: %s",
+    strerror(errno));
+
+  mark_point();
+  text = prom_metric_get_openmetrics(p, metric, "prt", &textlen);
+  ck_assert_msg(text != NULL, "Failed to get OpenMetrics text: %s",
+    strerror(errno));
+  expected = "# HELP prt_test counter testing.\n"
+    "# TYPE prt_test counter\n"
+    "prt_test_total 0\n";
+  ck_assert_msg(strcmp(text, expected) == 0, "Expected '%s', got '%s'",
+    expected, text);
+  ck_assert_msg(textlen == strlen(expected), "Expected %lu, got %lu",
+    (unsigned long) strlen(expected), (unsigned long) textlen);
+
+  labels = pr_table_nalloc(p, 0, 1);
+  (void) pr_table_add_dup(labels, "protocol", "ftp", 0);
+
+  res = prom_metric_incr(p, metric, 2, labels);
+  ck_assert_msg(res == 0, "Failed to increment metric: %s", strerror(errno));
+
+  mark_point();
+  metrics = make_array(p, 1, sizeof(struct prom_metric *));
+  *((struct prom_metric **) push_array(metrics)) = metric;
+  scan = prom_metric_scan_open(p, dbh, metrics);
+  samples = prom_metric_scan_next(p, scan);
+  (void) prom_metric_scan_close(scan);
+
+  text = prom_metric_get_openmetrics_with_samples(p, metric, "prt", samples,
+    &textlen);
+  ck_assert_msg(text != NULL, "Failed to get OpenMetrics text: %s",
+    strerror(errno));
+  expected = "# HELP prt_test counter testing.\n"
+    "# TYPE prt_test counter\n"
+    "prt_test_total{protocol=\"ftp\"} 2\n"
+    "prt_test_created{protocol=\"ftp\"} ";
+  ck_assert_msg(strncmp(text, expected, strlen(expected)) == 0,
+    "Expected '%s', got '%s'", expected, text);
+
+  prom_metric_destroy(p, metric);
+
+  mark_point();
+  metric = prom_metric_create(p, "test", dbh);
+  ck_assert_msg(metric != NULL, "Failed to create metric: %s", strerror(errno));
+
+  res = prom_metric_add_histogram(metric, "seconds", "histogram testing", 2,
+    (double) 1.0, (double) 5.0);
+  ck_assert_msg(res == 0, "Failed to add histogram to metric: %s",
+    strerror(errno));
+
+  labels = pr_table_nalloc(p, 0, 1);
+  (void) pr_table_add_dup(labels, "pid", "1", 0);
+  res = prom_metric_set_exemplar_labels(p, labels);
+  ck_assert_msg(res == 0, "Failed to set exemplar labels: %s",
+    strerror(errno));
+
+  (void) prom_metric_observe(p, metric, 2.1, NULL);
+  (void) prom_metric_set_exemplar_labels(p, NULL);
+  (void) prom_metric_observe(p, metric, 0.5, NULL);
+
+  mark_point();
+  text = prom_metric_get_openmetrics(p, metric, "prt", &textlen);
+  ck_assert_msg(text != NULL, "Failed to get OpenMetrics text: %s",
+    strerror(errno));
+  expected = "# TYPE prt_test_seconds histogram\n"
+    "# UNIT prt_test_seconds seconds\n"
+    "prt_test_seconds_bucket{le=\"1.000000\"} 1\n"
+    "prt_test_seconds_bucket{le=\"5.000000\"} 2 # {pid=\"1\"} 2.1 ";
+  ck_assert_msg(strstr(text, expected) != NULL, "Expected '%s', got '%s'",
+    expected, text);
+
+  expected = "prt_test_seconds_bucket{le=\"+Inf\"} 2\n"
+    "prt_test_seconds_count 2\n"
+    "prt_test_seconds_sum 2.6\n"
+    "prt_test_seconds_created ";
+  ck_assert_msg(strstr(text, expected) != NULL, "Expected '%s', got '%s'",
+    expected, text);
+
+  prom_metric_destroy(p, metric);
+  (void) prom_metric_free(p, dbh);
+  (void) tests_rmpath(p, test_dir);
+}
+END_TEST
+
+START_TEST (metric_set_label_names_test) {
+  int res;
+  struct prom_dbh *dbh;
+  struct prom_metric *metric;
+
+  (void) tests_rmpath(p, test_dir);
+  (void) tests_mkpath(p, test_dir);
+
+  mark_point();
+  res = prom_metric_set_label_names(NULL, 0);
+  ck_assert_msg(res < 0, "Failed to handle null metric");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  dbh = prom_metric_init(p, test_dir);
+  ck_assert_msg(dbh != NULL, "Failed to init metrics: %s", strerror(errno));
+
+  mark_point();
+  metric = prom_metric_create(p, "test", dbh);
+  ck_assert_msg(metric != NULL, "Failed to create metric: %s", strerror(errno));
+
+  mark_point();
+  res = prom_metric_set_label_names(metric, 2, "reason", NULL);
+  ck_assert_msg(res < 0, "Failed to handle null label name");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  res = prom_metric_set_label_names(metric, 2, "reason", "reason");
+  ck_assert_msg(res < 0, "Failed to handle duplicate label names");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  res = prom_metric_set_label_names(metric, 2, "reason", "method");
+  ck_assert_msg(res == 0, "Failed to set label names: %s", strerror(errno));
+
+  mark_point();
+  res = prom_metric_set_label_names(metric, 0);
+  ck_assert_msg(res == 0, "Failed to clear label names: %s", strerror(errno));
+
+  prom_metric_destroy(p, metric);
+  (void) prom_metric_free(p, dbh);
+  (void) tests_rmpath(p, test_dir);
+}
+END_TEST
+
+START_TEST (metric_set_base_labels_test) {
+  int res;
+  pr_table_t *labels;
+
+  mark_point();
+  res = prom_metric_set_base_labels(NULL, NULL);
+  ck_assert_msg(res < 0, "Failed to handle null pool");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  labels = pr_table_nalloc(p, 0, 1);
+  (void) pr_table_add_dup(labels, "protocol", "ftp", 0);
+
+  mark_point();
+  res = prom_metric_set_base_labels(p, labels);
+  ck_assert_msg(res == 0, "Failed to set base labels: %s", strerror(errno));
+
+  mark_point();
+  res = prom_metric_set_base_labels(p, NULL);
+  ck_assert_msg(res == 0, "Failed to clear base labels: %s", strerror(errno));
+}
+END_TEST
+
+START_TEST (metric_get_definition_test) {
+  const char *def, *expected;
+  struct prom_dbh *dbh;
+  struct prom_metric *metric;
+
+  mark_point();
+  def = prom_metric_get_definition(NULL, NULL);
+  ck_assert_msg(def == NULL, "Failed to handle null pool");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  def = prom_metric_get_definition(p, NULL);
+  ck_assert_msg(def == NULL, "Failed to handle null metric");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  dbh = prom_metric_init(p, test_dir);
+  ck_assert_msg(dbh != NULL, "Failed to init metrics: %s", strerror(errno));
+
+  metric = prom_metric_create(p, "test", dbh);
+  ck_assert_msg(metric != NULL, "Failed to create metric: %s", strerror(errno));
+
+  mark_point();
+  def = prom_metric_get_definition(p, metric);
+  ck_assert_msg(def != NULL, "Failed to get definition: %s", strerror(errno));
+  expected = "metric\ttest\n";
+  ck_assert_msg(strcmp(def, expected) == 0, "Expected '%s', got '%s'",
+    expected, def);
+
+  (void) prom_metric_add_counter(metric, NULL, "counter help");
+  (void) prom_metric_add_gauge(metric, "count", "gauge help");
+  (void) prom_metric_add_histogram(metric, "seconds", "histogram help", 3,
+    (double) 0.5, (double) 1, (double) 10);
+  (void) prom_metric_set_native_histogram(metric, 3);
+  (void) prom_metric_add_summary(metric, "bytes", "summary help", 2,
+    (double) 0.5, (double) 0.99);
+  (void) prom_metric_set_label_names(metric, 2, "reason", "method");
+
+  mark_point();
+  def = prom_metric_get_definition(p, metric);
+  ck_assert_msg(def != NULL, "Failed to get definition: %s", strerror(errno));
+  expected = "metric\ttest\n"
+    "counter\t\tcounter help\n"
+    "gauge\tcount\tgauge help\n"
+    "histogram\tseconds\t0.5,1,10\thistogram help\n"
+    "native\t3\n"
+    "summary\tbytes\t0.5,0.99\tsummary help\n"
+    "labels\treason,method\n";
+  ck_assert_msg(strcmp(def, expected) == 0, "Expected '%s', got '%s'",
+    expected, def);
+
+  prom_metric_destroy(p, metric);
+  (void) prom_metric_free(p, dbh);
+}
+END_TEST
+
+START_TEST (metric_create_from_definition_test) {
+  const char *def, *expected;
+  struct prom_dbh *dbh;
+  struct prom_metric *metric;
+
+  mark_point();
+  metric = prom_metric_create_from_definition(NULL, NULL, NULL);
+  ck_assert_msg(metric == NULL, "Failed to handle null pool");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  metric = prom_metric_create_from_definition(p, NULL, NULL);
+  ck_assert_msg(metric == NULL, "Failed to handle null definition");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  dbh = prom_metric_init(p, test_dir);
+  ck_assert_msg(dbh != NULL, "Failed to init metrics: %s", strerror(errno));
+
+  mark_point();
+  metric = prom_metric_create_from_definition(p, "metric\ttest\n", NULL);
+  ck_assert_msg(metric == NULL, "Failed to handle null dbh");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  metric = prom_metric_create_from_definition(p, "counter\t\thelp\n", dbh);
+  ck_assert_msg(metric == NULL, "Failed to handle missing metric name");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  metric = prom_metric_create_from_definition(p,
+    "metric\ttest\nfoo\tbar\n", dbh);
+  ck_assert_msg(metric == NULL, "Failed to handle unknown definition line");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  metric = prom_metric_create_from_definition(p,
+    "metric\ttest\nhistogram\tseconds\t1,x\thelp\n", dbh);
+  ck_assert_msg(metric == NULL, "Failed to handle bad bucket bounds");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  expected = "metric\ttest\n"
+    "counter\ttotal\tcounter help\n"
+    "gauge\tcount\tgauge help\n"
+    "histogram\tseconds\t0.5,1,10\thistogram help\n"
+    "native\t3\n"
+    "summary\tbytes\t0.5,0.99\tsummary help\n"
+    "labels\treason,method\n";
+
+  mark_point();
+  metric = prom_metric_create_from_definition(p, expected, dbh);
+  ck_assert_msg(metric != NULL, "Failed to create metric: %s",
+    strerror(errno));
+
+  def = prom_metric_get_definition(p, metric);
+  ck_assert_msg(def != NULL, "Failed to get definition: %s", strerror(errno));
+  ck_assert_msg(strcmp(def, expected) == 0, "Expected '%s', got '%s'",
+    expected, def);
+
+  mark_point();
+  prom_metric_destroy(p, metric);
+  metric = prom_metric_create_from_definition(p, expected, dbh);
+  ck_assert_msg(metric == NULL, "Failed to handle existing metric");
+  ck_assert_msg(errno == EEXIST, "Expected EEXIST (%d), got %s (%d)", EEXIST,
+    strerror(errno), errno);
+
+  (void) prom_metric_free(p, dbh);
+}
+END_TEST
+
+START_TEST (metric_values_test) {
+  int res;
+  const char *text, *values[2];
+  size_t textlen = 0;
+  struct prom_dbh *dbh;
+  struct prom_metric *metric;
+  pr_table_t *labels;
+
+  (void) tests_rmpath(p, test_dir);
+  (void) tests_mkpath(p, test_dir);
+
+  mark_point();
+  res = prom_metric_incr_values(NULL, NULL, 1, NULL);
+  ck_assert_msg(res < 0, "Failed to handle null pool");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  dbh = prom_metric_init(p, test_dir);
+  ck_assert_msg(dbh != NULL, "Failed to init metrics: %s", strerror(errno));
+
+  metric = prom_metric_create(p, "test", dbh);
+  ck_assert_msg(metric != NULL, "Failed to create metric: %s", strerror(errno));
+
+  res = prom_metric_add_counter(metric, "total", "counter testing");
+  ck_assert_msg(res == 0, "Failed to add counter to metric: %s",
+    strerror(errno));
+
+  res = prom_metric_add_gauge(metric, "count", "gauge testing");
+  ck_assert_msg(res == 0, "Failed to add gauge to metric: %s",
+    strerror(errno));
+
+  mark_point();
+  res = prom_metric_observe_values(p, metric, 1.0, NULL);
+  ck_assert_msg(res < 0, "Failed to handle metric without histogram");
+  ck_assert_msg(errno == EPERM, "Expected EPERM (%d), got %s (%d)", EPERM,
+    strerror(errno), errno);
+
+  /* The label values are given in declaration order; the base "protocol"
+   * label is interleaved, by name.
+   */
+  res = prom_metric_set_label_names(metric, 2, "reason", "method");
+  ck_assert_msg(res == 0, "Failed to set label names: %s", strerror(errno));
+
+  labels = pr_table_nalloc(p, 0, 1);
+  (void) pr_table_add_dup(labels, "protocol", "ftp", 0);
+  res = prom_metric_set_base_labels(p, labels);
+  ck_assert_msg(res == 0, "Failed to set base labels: %s", strerror(errno));
+
+  values[0] = "timeout";
+  values[1] = NULL;
+
+  mark_point();
+  res = prom_metric_incr_values(p, metric, 2, values);
+  ck_assert_msg(res == 0, "Failed to increment metric: %s", strerror(errno));
+
+  values[0] = "unknown";
+  values[1] = "password";
+
+  mark_point();
+  res = prom_metric_incr_type_values(p, metric, 3, values,
+    PROM_METRIC_TYPE_COUNTER);
+  ck_assert_msg(res == 0, "Failed to increment metric: %s", strerror(errno));
+
+  /* The same labels, given as a table, update the same sample. */
+  (void) pr_table_add_dup(labels, "reason", "timeout", 0);
+  res = prom_metric_incr(p, metric, 1, labels);
+  ck_assert_msg(res == 0, "Failed to increment metric: %s", strerror(errno));
+
+  values[0] = "timeout";
+  values[1] = NULL;
+
+  mark_point();
+  res = prom_metric_decr_values(p, metric, 1, values);
+  ck_assert_msg(res == 0, "Failed to decrement metric: %s", strerror(errno));
+
+  mark_point();
+  text = prom_metric_get_text(p, metric, "prt", &textlen);
+  ck_assert_msg(text != NULL, "Failed to get metric text: %s",
+    strerror(errno));
+  ck_assert_msg(
+    strstr(text, "prt_test_total{protocol=\"ftp\",reason=\"timeout\"} 3\n")
+      != NULL, "Expected counter sample, got '%s'", text);
+  ck_assert_msg(
+    strstr(text, "prt_test_total{method=\"password\",protocol=\"ftp\","
+      "reason=\"unknown\"} 3\n") != NULL,
+    "Expected counter sample, got '%s'", text);
+  ck_assert_msg(
+    strstr(text, "prt_test_count{protocol=\"ftp\",reason=\"timeout\"} 2\n")
+      != NULL, "Expected gauge sample, got '%s'", text);
+
+  prom_metric_destroy(p, metric);
+
+  /* A value given for a base label name takes precedence. */
+  metric = prom_metric_create(p, "test", dbh);
+  ck_assert_msg(metric != NULL, "Failed to create metric: %s", strerror(errno));
+
+  res = prom_metric_add_histogram(metric, "weight", "histogram testing", 0);
+  ck_assert_msg(res == 0, "Failed to add histogram to metric: %s",
+    strerror(errno));
+
+  res = prom_metric_set_label_names(metric, 1, "protocol");
+  ck_assert_msg(res == 0, "Failed to set label names: %s", strerror(errno));
+
+  values[0] = "ftps";
+
+  mark_point();
+  res = prom_metric_observe_values(p, metric, 2.0, values);
+  ck_assert_msg(res == 0, "Failed to observe metric: %s", strerror(errno));
+
+  values[0] = NULL;
+
+  mark_point();
+  res = prom_metric_observe_values(p, metric, 4.0, values);
+  ck_assert_msg(res == 0, "Failed to observe metric: %s", strerror(errno));
+
+  mark_point();
+  text = prom_metric_get_text(p, metric, "prt", &textlen);
+  ck_assert_msg(text != NULL, "Failed to get metric text: %s",
+    strerror(errno));
+  ck_assert_msg(
+    strstr(text, "prt_test_weight_sum{protocol=\"ftps\"} 2\n") != NULL,
+    "Expected histogram sample, got '%s'", text);
+  ck_assert_msg(
+    strstr(text, "prt_test_weight_sum{protocol=\"ftp\"} 4\n") != NULL,
+    "Expected histogram sample, got '%s'", text);
+
+  (void) prom_metric_set_base_labels(p, NULL);
+  prom_metric_destroy(p, metric);
+  (void) prom_metric_free(p, dbh);
+  (void) tests_rmpath(p, test_dir);
+}
+END_TEST
+
 Suite *tests_get_metric_suite(void) {
   Suite *suite;
   TCase *testcase;
@@ -1042,7 +2577,17 @@ Suite *tests_get_metric_suite(void) {
   tcase_add_test(testcase, metric_add_counter_test);
   tcase_add_test(testcase, metric_add_gauge_test);
   tcase_add_test(testcase, metric_add_histogram_test);
+  tcase_add_test(testcase, metric_add_summary_test);
+  tcase_add_test(testcase, metric_set_native_histogram_test);
   tcase_add_test(testcase, metric_set_dbh_test);
+  tcase_add_test(testcase, metric_set_shm_test);
+  tcase_add_test(testcase, metric_set_buffer_test);
+  tcase_add_test(testcase, metric_set_deferred_test);
+  tcase_add_test(testcase, metric_set_exemplar_labels_test);
+  tcase_add_test(testcase, metric_set_label_names_test);
+  tcase_add_test(testcase, metric_set_base_labels_test);
+  tcase_add_test(testcase, metric_get_definition_test);
+  tcase_add_test(testcase, metric_create_from_definition_test);
 
   tcase_add_test(testcase, metric_get_test);
   tcase_add_test(testcase, metric_decr_test);
@@ -1050,9 +2595,16 @@ Suite *tests_get_metric_suite(void) {
   tcase_add_test(testcase, metric_incr_test);
   tcase_add_test(testcase, metric_incr_counter_gauge_test);
   tcase_add_test(testcase, metric_observe_test);
+  tcase_add_test(testcase, metric_observe_cumulative_test);
+  tcase_add_test(testcase, metric_observe_summary_test);
+  tcase_add_test(testcase, metric_observe_native_test);
   tcase_add_test(testcase, metric_set_test);
+  tcase_add_test(testcase, metric_values_test);
 
   tcase_add_test(testcase, metric_get_text_test);
+  tcase_add_test(testcase, metric_get_text_with_samples_test);
+  tcase_add_test(testcase, metric_get_proto_test);
+  tcase_add_test(testcase, metric_get_openmetrics_test);
 
   suite_add_tcase(suite, testcase);
   return suite;
@@ -0,0 +1,451 @@
+/*
+ * ProFTPD - mod_prometheus API testsuite
+ * Copyright (c) 2021-2022 TJ Saunders <tj@castaglia.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+/* Metric write-behind buffer API tests. */
+
+#include "../tests.h"
+#include "prometheus/db.h"
+#include "prometheus/metric/db.h"
+#include "prometheus/metric/buffer.h"
+
+static pool *p = NULL;
+static const char *test_dir = "/tmp/prt-mod_prometheus-test-buffer";
+
+static void set_up(void) {
+  if (p == NULL) {
+    p = permanent_pool = make_sub_pool(NULL);
+  }
+
+  (void) tests_rmpath(p, test_dir);
+  (void) tests_mkpath(p, test_dir);
+
+  if (getenv("TEST_VERBOSE") != NULL) {
+    pr_trace_set_levels("prometheus.db", 1, 20);
+    pr_trace_set_levels("prometheus.metric.buffer", 1, 20);
+  }
+
+  mark_point();
+  prom_db_init(p);
+}
+
+static void tear_down(void) {
+  if (getenv("TEST_VERBOSE") != NULL) {
+    pr_trace_set_levels("prometheus.db", 0, 0);
+    pr_trace_set_levels("prometheus.metric.buffer", 0, 0);
+  }
+
+  prom_db_free();
+  (void) tests_rmpath(p, test_dir);
+
+  if (p != NULL) {
+    destroy_pool(p);
+    p = permanent_pool = NULL;
+  }
+}
+
+START_TEST (metric_buffer_create_test) {
+  int res;
+  struct prom_metric_buffer *buffer;
+  struct prom_dbh *dbh;
+
+  mark_point();
+  buffer = prom_metric_buffer_create(NULL, NULL);
+  ck_assert_msg(buffer == NULL, "Failed to handle null pool");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  buffer = prom_metric_buffer_create(p, NULL);
+  ck_assert_msg(buffer == NULL, "Failed to handle null dbh");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  /* For purposes of testing, this does not have to be a real dbh. */
+  mark_point();
+  dbh = palloc(p, 8);
+  buffer = prom_metric_buffer_create(p, dbh);
+  ck_assert_msg(buffer != NULL, "Failed to create buffer: %s",
+    strerror(errno));
+
+  res = prom_metric_buffer_count(buffer);
+  ck_assert_msg(res == 0, "Expected 0 buffered samples, got %d", res);
+
+  mark_point();
+  res = prom_metric_buffer_destroy(NULL);
+  ck_assert_msg(res < 0, "Failed to handle null buffer");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  res = prom_metric_buffer_destroy(buffer);
+  ck_assert_msg(res == 0, "Failed to destroy buffer: %s", strerror(errno));
+}
+END_TEST
+
+START_TEST (metric_buffer_add_test) {
+  int res;
+  struct prom_metric_buffer *buffer;
+  struct prom_dbh *dbh;
+
+  mark_point();
+  res = prom_metric_buffer_add(NULL, NULL, 0, 0.0, NULL);
+  ck_assert_msg(res < 0, "Failed to handle null pool");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  res = prom_metric_buffer_add(p, NULL, 0, 0.0, NULL);
+  ck_assert_msg(res < 0, "Failed to handle null buffer");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  dbh = palloc(p, 8);
+  buffer = prom_metric_buffer_create(p, dbh);
+  ck_assert_msg(buffer != NULL, "Failed to create buffer: %s",
+    strerror(errno));
+
+  mark_point();
+  res = prom_metric_buffer_add(p, buffer, 1, 1.0, NULL);
+  ck_assert_msg(res < 0, "Failed to handle null labels");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  /* Repeated samples for the same metric ID/labels are aggregated. */
+  mark_point();
+  res = prom_metric_buffer_add(p, buffer, 1, 1.0, "");
+  ck_assert_msg(res == 0, "Failed to add sample: %s", strerror(errno));
+  res = prom_metric_buffer_add(p, buffer, 1, 2.0, "");
+  ck_assert_msg(res == 0, "Failed to add sample: %s", strerror(errno));
+
+  res = prom_metric_buffer_count(buffer);
+  ck_assert_msg(res == 1, "Expected 1 buffered sample, got %d", res);
+
+  mark_point();
+  res = prom_metric_buffer_add(p, buffer, 1, 1.0, "{protocol=\"ftp\"}");
+  ck_assert_msg(res == 0, "Failed to add sample: %s", strerror(errno));
+  res = prom_metric_buffer_add(p, buffer, 2, 1.0, "");
+  ck_assert_msg(res == 0, "Failed to add sample: %s", strerror(errno));
+
+  res = prom_metric_buffer_count(buffer);
+  ck_assert_msg(res == 3, "Expected 3 buffered samples, got %d", res);
+
+  (void) prom_metric_buffer_destroy(buffer);
+}
+END_TEST
+
+START_TEST (metric_buffer_set_test) {
+  int res, flags = PROM_DB_OPEN_FL_SKIP_VACUUM;
+  struct prom_metric_buffer *buffer;
+  struct prom_dbh *dbh;
+  const array_header *results;
+  char **elts;
+
+  mark_point();
+  res = prom_metric_buffer_set(NULL, NULL, 0, 0.0, NULL);
+  ck_assert_msg(res < 0, "Failed to handle null pool");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  res = prom_metric_buffer_set(p, NULL, 0, 0.0, NULL);
+  ck_assert_msg(res < 0, "Failed to handle null buffer");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  dbh = prom_metric_db_init(p, test_dir, flags);
+  ck_assert_msg(dbh != NULL, "Failed to init metrics db: %s", strerror(errno));
+
+  buffer = prom_metric_buffer_create(p, dbh);
+  ck_assert_msg(buffer != NULL, "Failed to create buffer: %s",
+    strerror(errno));
+
+  mark_point();
+  res = prom_metric_buffer_set(p, buffer, 1, 1.0, NULL);
+  ck_assert_msg(res < 0, "Failed to handle null labels");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  res = prom_metric_db_sample_incr(p, dbh, 1, 10.0, "");
+  ck_assert_msg(res == 0, "Failed to increment sample: %s", strerror(errno));
+
+  /* The set replaces the earlier delta, and the later delta applies to the
+   * set value.
+   */
+  mark_point();
+  res = prom_metric_buffer_add(p, buffer, 1, -3.0, "");
+  ck_assert_msg(res == 0, "Failed to add sample: %s", strerror(errno));
+  res = prom_metric_buffer_set(p, buffer, 1, 4.0, "");
+  ck_assert_msg(res == 0, "Failed to set sample: %s", strerror(errno));
+  res = prom_metric_buffer_add(p, buffer, 1, -1.0, "");
+  ck_assert_msg(res == 0, "Failed to add sample: %s", strerror(errno));
+
+  res = prom_metric_buffer_count(buffer);
+  ck_assert_msg(res == 1, "Expected 1 buffered sample, got %d", res);
+
+  mark_point();
+  res = prom_metric_buffer_flush(p, buffer);
+  ck_assert_msg(res == 1, "Expected 1 flushed sample, got %d", res);
+
+  results = prom_metric_db_sample_get(p, dbh, 1);
+  ck_assert_msg(results != NULL, "Failed to get samples: %s",
+    strerror(errno));
+  ck_assert_msg(results->nelts == 2, "Expected 2 results, got %d",
+    results->nelts);
+  elts = results->elts;
+  ck_assert_msg(strtod(elts[0], NULL) == 3.0, "Expected 3, got '%s'",
+    elts[0]);
+
+  (void) prom_metric_buffer_destroy(buffer);
+  (void) prom_metric_db_close(p, dbh);
+}
+END_TEST
+
+START_TEST (metric_buffer_flush_test) {
+  int res, flags = PROM_DB_OPEN_FL_SKIP_VACUUM;
+  struct prom_metric_buffer *buffer;
+  struct prom_dbh *dbh;
+  const array_header *results;
+  char **elts;
+
+  mark_point();
+  res = prom_metric_buffer_flush(NULL, NULL);
+  ck_assert_msg(res < 0, "Failed to handle null pool");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  res = prom_metric_buffer_flush(p, NULL);
+  ck_assert_msg(res < 0, "Failed to handle null buffer");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  dbh = prom_metric_db_init(p, test_dir, flags);
+  ck_assert_msg(dbh != NULL, "Failed to init metrics db: %s", strerror(errno));
+
+  buffer = prom_metric_buffer_create(p, dbh);
+  ck_assert_msg(buffer != NULL, "Failed to create buffer: %s",
+    strerror(errno));
+
+  mark_point();
+  res = prom_metric_buffer_flush(p, buffer);
+  ck_assert_msg(res == 0, "Expected 0 flushed samples, got %d", res);
+
+  mark_point();
+  res = prom_metric_buffer_add(p, buffer, 1, 1.5, "");
+  ck_assert_msg(res == 0, "Failed to add sample: %s", strerror(errno));
+  res = prom_metric_buffer_add(p, buffer, 1, 2.5, "");
+  ck_assert_msg(res == 0, "Failed to add sample: %s", strerror(errno));
+
+  /* Nothing is written until we flush. */
+  mark_point();
+  results = prom_metric_db_sample_get(p, dbh, 1);
+  ck_assert_msg(results != NULL, "Failed to get samples: %s", strerror(errno));
+  ck_assert_msg(results->nelts == 0, "Expected 0 results, got %d",
+    results->nelts);
+
+  mark_point();
+  res = prom_db_begin_txn(p, dbh, NULL);
+  ck_assert_msg(res == 0, "Failed to begin transaction: %s", strerror(errno));
+
+  res = prom_metric_buffer_flush(p, buffer);
+  ck_assert_msg(res == 1, "Expected 1 flushed sample, got %d", res);
+
+  res = prom_db_commit_txn(p, dbh, NULL);
+  ck_assert_msg(res == 0, "Failed to commit transaction: %s", strerror(errno));
+
+  res = prom_metric_buffer_count(buffer);
+  ck_assert_msg(res == 0, "Expected 0 buffered samples, got %d", res);
+
+  mark_point();
+  results = prom_metric_db_sample_get(p, dbh, 1);
+  ck_assert_msg(results != NULL, "Failed to get samples: %s", strerror(errno));
+  ck_assert_msg(results->nelts == 2, "Expected 2 results, got %d",
+    results->nelts);
+  elts = results->elts;
+  ck_assert_msg(strtod(elts[0], NULL) == 4.0, "Expected 4, got '%s'", elts[0]);
+
+  /* Flushed samples are added to, not replace, the existing values. */
+  mark_point();
+  res = prom_metric_buffer_add(p, buffer, 1, 1.0, "");
+  ck_assert_msg(res == 0, "Failed to add sample: %s", strerror(errno));
+
+  res = prom_metric_buffer_flush(p, buffer);
+  ck_assert_msg(res == 1, "Expected 1 flushed sample, got %d", res);
+
+  results = prom_metric_db_sample_get(p, dbh, 1);
+  ck_assert_msg(results != NULL, "Failed to get samples: %s", strerror(errno));
+  elts = results->elts;
+  ck_assert_msg(strtod(elts[0], NULL) == 5.0, "Expected 5, got '%s'", elts[0]);
+
+  (void) prom_metric_buffer_destroy(buffer);
+  res = prom_metric_db_close(p, dbh);
+  ck_assert_msg(res == 0, "Failed to close metrics db: %s", strerror(errno));
+}
+END_TEST
+
+START_TEST (metric_buffer_add_histogram_test) {
+  int res, flags = PROM_DB_OPEN_FL_SKIP_VACUUM;
+  struct prom_metric_buffer *buffer;
+  struct prom_dbh *dbh;
+  const array_header *results;
+  const struct prom_metric_db_histogram *histograms;
+
+  mark_point();
+  res = prom_metric_buffer_add_histogram(NULL, NULL, 0, 0, 0, 0.0, NULL, NULL);
+  ck_assert_msg(res < 0, "Failed to handle null pool");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  dbh = prom_metric_db_init(p, test_dir, flags);
+  ck_assert_msg(dbh != NULL, "Failed to init metrics db: %s", strerror(errno));
+
+  buffer = prom_metric_buffer_create(p, dbh);
+  ck_assert_msg(buffer != NULL, "Failed to create buffer: %s",
+    strerror(errno));
+
+  mark_point();
+  res = prom_metric_buffer_add_histogram(p, buffer, 1, 2, 2, 1.0, "", NULL);
+  ck_assert_msg(res < 0, "Failed to handle out-of-range bucket");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  /* Observations in the same bucket are accumulated in one entry. */
+  mark_point();
+  res = prom_metric_buffer_add_histogram(p, buffer, 1, 0, 2, 0.5, "", NULL);
+  ck_assert_msg(res == 0, "Failed to add observation: %s", strerror(errno));
+  res = prom_metric_buffer_add_histogram(p, buffer, 1, 0, 2, 0.25, "", NULL);
+  ck_assert_msg(res == 0, "Failed to add observation: %s", strerror(errno));
+  res = prom_metric_buffer_add_histogram(p, buffer, 1, 1, 2, 7.0, "", NULL);
+  ck_assert_msg(res == 0, "Failed to add observation: %s", strerror(errno));
+
+  res = prom_metric_buffer_count(buffer);
+  ck_assert_msg(res == 2, "Expected 2 buffered samples, got %d", res);
+
+  mark_point();
+  res = prom_metric_buffer_flush(p, buffer);
+  ck_assert_msg(res == 2, "Expected 2 flushed samples, got %d", res);
+
+  mark_point();
+  results = prom_metric_db_histogram_get(p, dbh, 1);
+  ck_assert_msg(results != NULL, "Failed to get histogram: %s",
+    strerror(errno));
+  ck_assert_msg(results->nelts == 1, "Expected 1 result, got %d",
+    results->nelts);
+
+  histograms = results->elts;
+  ck_assert_msg(histograms[0].bucket_counts[0] == 2.0 &&
+    histograms[0].bucket_counts[1] == 1.0,
+    "Expected bucket counts 2, 1; got %g, %g",
+    histograms[0].bucket_counts[0], histograms[0].bucket_counts[1]);
+  ck_assert_msg(histograms[0].sample_count == 3.0, "Expected count 3, got %g",
+    histograms[0].sample_count);
+  ck_assert_msg(histograms[0].sample_sum == 7.75, "Expected sum 7.75, got %g",
+    histograms[0].sample_sum);
+
+  (void) prom_metric_buffer_destroy(buffer);
+  res = prom_metric_db_close(p, dbh);
+  ck_assert_msg(res == 0, "Failed to close metrics db: %s", strerror(errno));
+}
+END_TEST
+
+START_TEST (metric_buffer_add_summary_test) {
+  int res, flags = PROM_DB_OPEN_FL_SKIP_VACUUM;
+  struct prom_metric_buffer *buffer;
+  struct prom_dbh *dbh;
+  const array_header *results;
+  const struct prom_metric_db_summary *summaries;
+
+  mark_point();
+  res = prom_metric_buffer_add_summary(NULL, NULL, 0, 0, 0.0, NULL);
+  ck_assert_msg(res < 0, "Failed to handle null pool");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  dbh = prom_metric_db_init(p, test_dir, flags);
+  ck_assert_msg(dbh != NULL, "Failed to init metrics db: %s", strerror(errno));
+
+  buffer = prom_metric_buffer_create(p, dbh);
+  ck_assert_msg(buffer != NULL, "Failed to create buffer: %s",
+    strerror(errno));
+
+  /* Observations in the same bin are accumulated in one entry. */
+  mark_point();
+  res = prom_metric_buffer_add_summary(p, buffer, 1, 4, 0.5, "");
+  ck_assert_msg(res == 0, "Failed to add observation: %s", strerror(errno));
+  res = prom_metric_buffer_add_summary(p, buffer, 1, 4, 0.25, "");
+  ck_assert_msg(res == 0, "Failed to add observation: %s", strerror(errno));
+  res = prom_metric_buffer_add_summary(p, buffer, 1, 9, 7.0, "");
+  ck_assert_msg(res == 0, "Failed to add observation: %s", strerror(errno));
+
+  res = prom_metric_buffer_count(buffer);
+  ck_assert_msg(res == 2, "Expected 2 buffered samples, got %d", res);
+
+  mark_point();
+  res = prom_metric_buffer_flush(p, buffer);
+  ck_assert_msg(res == 2, "Expected 2 flushed samples, got %d", res);
+
+  mark_point();
+  results = prom_metric_db_summary_get(p, dbh, 1);
+  ck_assert_msg(results != NULL, "Failed to get summary: %s", strerror(errno));
+  ck_assert_msg(results->nelts == 1, "Expected 1 result, got %d",
+    results->nelts);
+
+  summaries = results->elts;
+  ck_assert_msg(summaries[0].bin_count == 2, "Expected 2 bins, got %u",
+    summaries[0].bin_count);
+  ck_assert_msg(summaries[0].bins[0].count == 2.0 &&
+    summaries[0].bins[1].count == 1.0,
+    "Expected bin counts 2, 1; got %g, %g", summaries[0].bins[0].count,
+    summaries[0].bins[1].count);
+  ck_assert_msg(summaries[0].sample_sum == 7.75, "Expected sum 7.75, got %g",
+    summaries[0].sample_sum);
+
+  (void) prom_metric_buffer_destroy(buffer);
+  res = prom_metric_db_close(p, dbh);
+  ck_assert_msg(res == 0, "Failed to close metrics db: %s", strerror(errno));
+}
+END_TEST
+
+Suite *tests_get_metric_buffer_suite(void) {
+  Suite *suite;
+  TCase *testcase;
+
+  suite = suite_create("metric.buffer");
+  testcase = tcase_create("base");
+
+  tcase_add_checked_fixture(testcase, set_up, tear_down);
+
+  tcase_add_test(testcase, metric_buffer_create_test);
+  tcase_add_test(testcase, metric_buffer_add_test);
+  tcase_add_test(testcase, metric_buffer_set_test);
+  tcase_add_test(testcase, metric_buffer_flush_test);
+  tcase_add_test(testcase, metric_buffer_add_histogram_test);
+  tcase_add_test(testcase, metric_buffer_add_summary_test);
+
+  suite_add_tcase(suite, testcase);
+  return suite;
+}
@@ -147,6 +147,84 @@ START_TEST (metric_db_open_test) {
 }
 END_TEST
 
+START_TEST (metric_db_reopen_test) {
+  int res, flags = PROM_DB_OPEN_FL_SKIP_VACUUM;
+  int64_t metric_id = 1;
+  struct prom_dbh *dbh;
+
+  (void) tests_rmpath(p, test_dir);
+  (void) tests_mkpath(p, test_dir);
+
+  mark_point();
+  dbh = prom_metric_db_reopen(NULL, NULL);
+  ck_assert_msg(dbh == NULL, "Failed to handle null pool");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  dbh = prom_metric_db_reopen(p, NULL);
+  ck_assert_msg(dbh == NULL, "Failed to handle null path");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  dbh = prom_metric_db_init(p, test_dir, flags);
+  ck_assert_msg(dbh != NULL, "Failed to init metrics db: %s", strerror(errno));
+
+  res = prom_metric_db_close(p, dbh);
+  ck_assert_msg(res == 0, "Failed to close metrics db: %s", strerror(errno));
+
+  mark_point();
+  dbh = prom_metric_db_reopen(p, test_dir);
+  ck_assert_msg(dbh != NULL, "Failed to reopen metrics db: %s",
+    strerror(errno));
+
+  /* The reopened handle must be writable. */
+  mark_point();
+  res = prom_metric_db_sample_incr(p, dbh, metric_id, 1.0, "");
+  ck_assert_msg(res == 0, "Failed to increment metric ID %ld: %s",
+    metric_id, strerror(errno));
+
+  res = prom_metric_db_close(p, dbh);
+  ck_assert_msg(res == 0, "Failed to close metrics db: %s", strerror(errno));
+  (void) tests_rmpath(p, test_dir);
+}
+END_TEST
+
+START_TEST (metric_db_maintain_test) {
+  int res, flags = PROM_DB_OPEN_FL_SKIP_VACUUM;
+  struct prom_dbh *dbh;
+
+  (void) tests_rmpath(p, test_dir);
+  (void) tests_mkpath(p, test_dir);
+
+  mark_point();
+  res = prom_metric_db_maintain(NULL, NULL);
+  ck_assert_msg(res < 0, "Failed to handle null pool");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  res = prom_metric_db_maintain(p, NULL);
+  ck_assert_msg(res < 0, "Failed to handle null dbh");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  dbh = prom_metric_db_init(p, test_dir, flags);
+  ck_assert_msg(dbh != NULL, "Failed to init metrics db: %s", strerror(errno));
+
+  mark_point();
+  res = prom_metric_db_maintain(p, dbh);
+  ck_assert_msg(res == 0, "Failed to maintain metrics db: %s",
+    strerror(errno));
+
+  res = prom_metric_db_close(p, dbh);
+  ck_assert_msg(res == 0, "Failed to close metrics db: %s", strerror(errno));
+  (void) tests_rmpath(p, test_dir);
+}
+END_TEST
+
 START_TEST (metric_db_exists_test) {
   int res, flags = PROM_DB_OPEN_FL_SKIP_VACUUM;
   const char *metric_name = "test_metric";
@@ -231,6 +309,129 @@ START_TEST (metric_db_create_test) {
 END_TEST
 
 START_TEST (metric_db_sample_exists_test) {
+  int res, flags = PROM_DB_OPEN_FL_SKIP_VACUUM;
+  int64_t metric_id = 7;
+  struct prom_dbh *dbh;
+
+  (void) tests_rmpath(p, test_dir);
+  (void) tests_mkpath(p, test_dir);
+
+  mark_point();
+  dbh = prom_metric_db_init(p, test_dir, flags);
+  ck_assert_msg(dbh != NULL, "Failed to init metrics db: %s", strerror(errno));
+
+  mark_point();
+  res = prom_metric_db_sample_exists(p, dbh, metric_id, NULL);
+  ck_assert_msg(res < 0, "Failed to handle null sample labels");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  res = prom_metric_db_sample_exists(p, dbh, metric_id, "");
+  ck_assert_msg(res < 0, "Failed to handle nonexistent sample");
+  ck_assert_msg(errno == ENOENT, "Expected ENOENT (%d), got %s (%d)", ENOENT,
+    strerror(errno), errno);
+
+  mark_point();
+  res = prom_metric_db_sample_incr(p, dbh, metric_id, 1.0, "");
+  ck_assert_msg(res == 0, "Failed to increment metric ID %ld: %s",
+    metric_id, strerror(errno));
+
+  mark_point();
+  res = prom_metric_db_sample_exists(p, dbh, metric_id, "");
+  ck_assert_msg(res == 0, "Failed to find sample for metric ID %ld: %s",
+    metric_id, strerror(errno));
+
+  res = prom_metric_db_close(p, dbh);
+  ck_assert_msg(res == 0, "Failed to close metrics db: %s", strerror(errno));
+  (void) tests_rmpath(p, test_dir);
+}
+END_TEST
+
+START_TEST (metric_db_sample_label_sets_test) {
+  int res, flags = PROM_DB_OPEN_FL_SKIP_VACUUM;
+  struct prom_dbh *dbh;
+  const char *stmt, *errstr = NULL;
+  const array_header *results;
+  array_header *counts;
+  char **elts;
+
+  (void) tests_rmpath(p, test_dir);
+  (void) tests_mkpath(p, test_dir);
+
+  mark_point();
+  dbh = prom_metric_db_init(p, test_dir, flags);
+  ck_assert_msg(dbh != NULL, "Failed to init metrics db: %s", strerror(errno));
+
+  mark_point();
+  res = prom_metric_db_sample_incr(p, dbh, 7, 1.0, "{a=\"1\"}");
+  ck_assert_msg(res == 0, "Failed to increment sample: %s", strerror(errno));
+
+  res = prom_metric_db_sample_incr(p, dbh, 8, 1.0, "{a=\"1\"}");
+  ck_assert_msg(res == 0, "Failed to increment sample: %s", strerror(errno));
+
+  res = prom_metric_db_sample_set(p, dbh, 7, 3.0, "{a=\"2\"}");
+  ck_assert_msg(res == 0, "Failed to set sample: %s", strerror(errno));
+
+  /* Label sets are shared across metrics. */
+  mark_point();
+  stmt = "SELECT COUNT(*) FROM label_sets;";
+  res = prom_db_prepare_stmt(p, dbh, stmt);
+  ck_assert_msg(res == 0, "Failed to prepare '%s': %s", stmt,
+    strerror(errno));
+
+  counts = prom_db_exec_prepared_stmt(p, dbh, stmt, &errstr);
+  ck_assert_msg(counts != NULL, "Failed to execute '%s': %s", stmt,
+    errstr ? errstr : strerror(errno));
+  ck_assert_msg(counts->nelts == 1, "Expected 1 result, got %d",
+    counts->nelts);
+  elts = counts->elts;
+  ck_assert_msg(strcmp(elts[0], "2") == 0, "Expected 2 label sets, got %s",
+    elts[0]);
+
+  mark_point();
+  res = prom_metric_db_sample_exists(p, dbh, 8, "{a=\"2\"}");
+  ck_assert_msg(res < 0, "Failed to handle nonexistent sample");
+  ck_assert_msg(errno == ENOENT, "Expected ENOENT (%d), got %s (%d)", ENOENT,
+    strerror(errno), errno);
+
+  res = prom_metric_db_close(p, dbh);
+  ck_assert_msg(res == 0, "Failed to close metrics db: %s", strerror(errno));
+
+  /* Reopening must not reuse any IDs cached for the previous handle. */
+  mark_point();
+  dbh = prom_metric_db_reopen(p, test_dir);
+  ck_assert_msg(dbh != NULL, "Failed to reopen metrics db: %s",
+    strerror(errno));
+
+  res = prom_metric_db_sample_incr(p, dbh, 8, 2.0, "{a=\"1\"}");
+  ck_assert_msg(res == 0, "Failed to increment sample: %s", strerror(errno));
+
+  mark_point();
+  results = prom_metric_db_sample_get(p, dbh, 7);
+  ck_assert_msg(results != NULL, "Failed to get samples: %s",
+    strerror(errno));
+  ck_assert_msg(results->nelts == 4, "Expected 4 results, got %d",
+    results->nelts);
+  elts = results->elts;
+  ck_assert_msg(strcmp(elts[1], "{a=\"1\"}") == 0,
+    "Expected label set '{a=\"1\"}', got '%s'", elts[1]);
+  ck_assert_msg(strcmp(elts[3], "{a=\"2\"}") == 0,
+    "Expected label set '{a=\"2\"}', got '%s'", elts[3]);
+
+  mark_point();
+  results = prom_metric_db_sample_get(p, dbh, 8);
+  ck_assert_msg(results != NULL, "Failed to get samples: %s",
+    strerror(errno));
+  ck_assert_msg(results->nelts == 2, "Expected 2 results, got %d",
+    results->nelts);
+  elts = results->elts;
+  ck_assert_msg(strtod(elts[0], NULL) == 3.0, "Expected 3.0, got %s",
+    elts[0]);
+
+  res = prom_metric_db_close(p, dbh);
+  ck_assert_msg(res == 0, "Failed to close metrics db: %s", strerror(errno));
+  (void) tests_rmpath(p, test_dir);
 }
 END_TEST
 
@@ -271,6 +472,185 @@ START_TEST (metric_db_sample_get_test) {
 }
 END_TEST
 
+START_TEST (metric_db_scan_test) {
+  int res, flags = PROM_DB_OPEN_FL_SKIP_VACUUM;
+  struct prom_dbh *dbh;
+  struct prom_metric_db_scan *scan;
+  struct prom_metric_db_rank *rank;
+  array_header *ranks;
+  const array_header *samples = NULL, *histograms = NULL, *summaries = NULL;
+  const struct prom_metric_db_sample *sample_elts;
+  const struct prom_metric_db_histogram *histogram_elts;
+  const struct prom_metric_db_summary *summary_elts;
+
+  (void) tests_rmpath(p, test_dir);
+  (void) tests_mkpath(p, test_dir);
+
+  ranks = make_array(p, 0, sizeof(struct prom_metric_db_rank));
+
+  mark_point();
+  scan = prom_metric_db_scan_open(NULL, NULL, NULL);
+  ck_assert_msg(scan == NULL, "Failed to handle null pool");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  scan = prom_metric_db_scan_open(p, NULL, NULL);
+  ck_assert_msg(scan == NULL, "Failed to handle null dbh");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  dbh = prom_metric_db_init(p, test_dir, flags);
+  ck_assert_msg(dbh != NULL, "Failed to init metrics db: %s", strerror(errno));
+
+  mark_point();
+  scan = prom_metric_db_scan_open(p, dbh, NULL);
+  ck_assert_msg(scan == NULL, "Failed to handle null ranks");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  /* With no ranks, there is nothing to read. */
+  mark_point();
+  scan = prom_metric_db_scan_open(p, dbh, ranks);
+  ck_assert_msg(scan != NULL, "Failed to open scan: %s", strerror(errno));
+
+  res = prom_metric_db_scan_next(p, scan, 0, &samples, &histograms,
+    &summaries);
+  ck_assert_msg(res == 0, "Failed to scan: %s", strerror(errno));
+  ck_assert_msg(samples->nelts == 0, "Expected no samples, got %d",
+    samples->nelts);
+  (void) prom_metric_db_scan_close(scan);
+
+  res = prom_metric_db_sample_incr(p, dbh, 9, 1.0, "{a=\"2\"}");
+  ck_assert_msg(res == 0, "Failed to increment sample: %s", strerror(errno));
+
+  res = prom_metric_db_sample_incr(p, dbh, 7, 2.0, "");
+  ck_assert_msg(res == 0, "Failed to increment sample: %s", strerror(errno));
+
+  res = prom_metric_db_sample_incr(p, dbh, 9, 3.0, "{a=\"1\"}");
+  ck_assert_msg(res == 0, "Failed to increment sample: %s", strerror(errno));
+
+  res = prom_metric_db_sample_incr(p, dbh, 11, 4.0, "");
+  ck_assert_msg(res == 0, "Failed to increment sample: %s", strerror(errno));
+
+  res = prom_metric_db_histogram_add(p, dbh, 8, 1, 2, 1.0, 5.0, "", NULL);
+  ck_assert_msg(res == 0, "Failed to add observation: %s", strerror(errno));
+
+  res = prom_metric_db_summary_add(p, dbh, 10, 3, 1.0, 2.0, "");
+  ck_assert_msg(res == 0, "Failed to add observation: %s", strerror(errno));
+
+  res = prom_metric_db_summary_add(p, dbh, 10, -1, 1.0, 0.5, "");
+  ck_assert_msg(res == 0, "Failed to add observation: %s", strerror(errno));
+
+  /* Metric IDs 9 and 8 share rank 0; ID 7 has rank 1, and ID 10 rank 2.  ID
+   * 11 is not scanned.
+   */
+  rank = push_array(ranks);
+  rank->metric_id = 9;
+  rank->rank = 0;
+  rank = push_array(ranks);
+  rank->metric_id = 8;
+  rank->rank = 0;
+  rank = push_array(ranks);
+  rank->metric_id = 7;
+  rank->rank = 1;
+  rank = push_array(ranks);
+  rank->metric_id = 10;
+  rank->rank = 2;
+
+  mark_point();
+  scan = prom_metric_db_scan_open(p, dbh, ranks);
+  ck_assert_msg(scan != NULL, "Failed to open scan: %s", strerror(errno));
+
+  mark_point();
+  res = prom_metric_db_scan_next(NULL, NULL, 0, NULL, NULL, NULL);
+  ck_assert_msg(res < 0, "Failed to handle null pool");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  /* Expect the rank's samples ordered by labels, and its histogram. */
+  mark_point();
+  res = prom_metric_db_scan_next(p, scan, 0, &samples, &histograms,
+    &summaries);
+  ck_assert_msg(res == 0, "Failed to scan: %s", strerror(errno));
+  ck_assert_msg(samples->nelts == 2, "Expected 2 samples, got %d",
+    samples->nelts);
+  ck_assert_msg(histograms->nelts == 1, "Expected 1 histogram, got %d",
+    histograms->nelts);
+  ck_assert_msg(summaries->nelts == 0, "Expected no summaries, got %d",
+    summaries->nelts);
+
+  sample_elts = samples->elts;
+  ck_assert_msg(sample_elts[0].metric_id == 9,
+    "Expected metric ID 9, got %lld", (long long) sample_elts[0].metric_id);
+  ck_assert_msg(strcmp(sample_elts[0].sample_labels, "{a=\"1\"}") == 0,
+    "Expected labels '{a=\"1\"}', got '%s'", sample_elts[0].sample_labels);
+  ck_assert_msg(sample_elts[0].sample_labelslen == 7,
+    "Expected labels length 7, got %lu",
+    (unsigned long) sample_elts[0].sample_labelslen);
+  ck_assert_msg(sample_elts[0].sample_value == 3.0, "Expected 3.0, got %g",
+    sample_elts[0].sample_value);
+  ck_assert_msg(sample_elts[0].created > 0.0, "Expected created time, got %g",
+    sample_elts[0].created);
+  ck_assert_msg(strcmp(sample_elts[1].sample_labels, "{a=\"2\"}") == 0,
+    "Expected labels '{a=\"2\"}', got '%s'", sample_elts[1].sample_labels);
+
+  histogram_elts = histograms->elts;
+  ck_assert_msg(histogram_elts[0].metric_id == 8,
+    "Expected metric ID 8, got %lld", (long long) histogram_elts[0].metric_id);
+  ck_assert_msg(histogram_elts[0].bucket_count == 2,
+    "Expected 2 buckets, got %u", histogram_elts[0].bucket_count);
+  ck_assert_msg(histogram_elts[0].bucket_counts[1] == 1.0,
+    "Expected bucket count 1, got %g", histogram_elts[0].bucket_counts[1]);
+  ck_assert_msg(histogram_elts[0].sample_sum == 5.0,
+    "Expected sum 5, got %g", histogram_elts[0].sample_sum);
+
+  /* Skipping rank 1 discards its samples. */
+  mark_point();
+  res = prom_metric_db_scan_next(p, scan, 2, &samples, &histograms,
+    &summaries);
+  ck_assert_msg(res == 0, "Failed to scan: %s", strerror(errno));
+  ck_assert_msg(samples->nelts == 0, "Expected no samples, got %d",
+    samples->nelts);
+  ck_assert_msg(summaries->nelts == 1, "Expected 1 summary, got %d",
+    summaries->nelts);
+
+  summary_elts = summaries->elts;
+  ck_assert_msg(summary_elts[0].metric_id == 10,
+    "Expected metric ID 10, got %lld", (long long) summary_elts[0].metric_id);
+  ck_assert_msg(summary_elts[0].bin_count == 2, "Expected 2 bins, got %u",
+    summary_elts[0].bin_count);
+  ck_assert_msg(summary_elts[0].bins[0].key == -1 &&
+    summary_elts[0].bins[1].key == 3,
+    "Expected bin keys -1, 3; got %d, %d", summary_elts[0].bins[0].key,
+    summary_elts[0].bins[1].key);
+  ck_assert_msg(summary_elts[0].sample_sum == 2.5, "Expected sum 2.5, got %g",
+    summary_elts[0].sample_sum);
+
+  /* Past the last rank, there is nothing more to read. */
+  mark_point();
+  res = prom_metric_db_scan_next(p, scan, 3, &samples, &histograms,
+    &summaries);
+  ck_assert_msg(res == 0, "Failed to scan: %s", strerror(errno));
+  ck_assert_msg(samples->nelts == 0, "Expected no samples, got %d",
+    samples->nelts);
+
+  mark_point();
+  res = prom_metric_db_scan_close(NULL);
+  ck_assert_msg(res < 0, "Failed to handle null scan");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  res = prom_metric_db_scan_close(scan);
+  ck_assert_msg(res == 0, "Failed to close scan: %s", strerror(errno));
+
+  res = prom_metric_db_close(p, dbh);
+  ck_assert_msg(res == 0, "Failed to close metrics db: %s", strerror(errno));
+  (void) tests_rmpath(p, test_dir);
+}
+END_TEST
+
 START_TEST (metric_db_sample_decr_test) {
   int res, flags = PROM_DB_OPEN_FL_SKIP_VACUUM;
   int64_t metric_id = 24;
@@ -395,6 +775,24 @@ START_TEST (metric_db_sample_incr_test) {
   ck_assert_msg(strcmp(elts[1], "") == 0,
     "Expected sample labels '', got '%s'", elts[1]);
 
+  /* Subsequent increments of the same sample must update, not insert. */
+  mark_point();
+  res = prom_metric_db_sample_incr(p, dbh, metric_id, incr_val, "");
+  ck_assert_msg(res == 0, "Failed to increment metric ID %ld: %s",
+    metric_id, strerror(errno));
+
+  mark_point();
+  results = prom_metric_db_sample_get(p, dbh, metric_id);
+  ck_assert_msg(results != NULL, "Failed to get samples for metric ID %ld: %s",
+    metric_id, strerror(errno));
+  ck_assert_msg(results->nelts == 2, "Expected results->nelts = 2, got %d",
+    results->nelts);
+
+  elts = results->elts;
+  sample_val = strtod(elts[0], NULL);
+  ck_assert_msg((int) sample_val == (int) (incr_val * 2),
+    "Expected sample value %lf, got %lf", incr_val * 2, sample_val);
+
   res = prom_metric_db_close(p, dbh);
   ck_assert_msg(res == 0, "Failed to close metrics db: %s", strerror(errno));
   (void) tests_rmpath(p, test_dir);
@@ -460,6 +858,216 @@ START_TEST (metric_db_sample_set_test) {
   ck_assert_msg(strcmp(elts[1], "") == 0,
     "Expected sample labels '', got '%s'", elts[1]);
 
+  /* Setting an existing sample replaces its value. */
+  mark_point();
+  res = prom_metric_db_sample_set(p, dbh, metric_id, set_val * 2, "");
+  ck_assert_msg(res == 0, "Failed to set metric ID %ld: %s",
+    metric_id, strerror(errno));
+
+  mark_point();
+  results = prom_metric_db_sample_get(p, dbh, metric_id);
+  ck_assert_msg(results != NULL, "Failed to get samples for metric ID %ld: %s",
+    metric_id, strerror(errno));
+  ck_assert_msg(results->nelts == 2, "Expected results->nelts = 2, got %d",
+    results->nelts);
+
+  elts = results->elts;
+  sample_val = strtod(elts[0], NULL);
+  ck_assert_msg((int) sample_val == (int) (set_val * 2),
+    "Expected sample value %lf, got %lf", set_val * 2, sample_val);
+
+  res = prom_metric_db_close(p, dbh);
+  ck_assert_msg(res == 0, "Failed to close metrics db: %s", strerror(errno));
+  (void) tests_rmpath(p, test_dir);
+}
+END_TEST
+
+START_TEST (metric_db_histogram_add_test) {
+  int res, flags = PROM_DB_OPEN_FL_SKIP_VACUUM;
+  struct prom_dbh *dbh;
+  const array_header *results;
+  const struct prom_metric_db_histogram *histograms;
+
+  (void) tests_rmpath(p, test_dir);
+  (void) tests_mkpath(p, test_dir);
+
+  mark_point();
+  res = prom_metric_db_histogram_add(NULL, NULL, 0, 0, 0, 0.0, 0.0, NULL,
+    NULL);
+  ck_assert_msg(res < 0, "Failed to handle null pool");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  res = prom_metric_db_histogram_add(p, NULL, 0, 0, 0, 0.0, 0.0, NULL, NULL);
+  ck_assert_msg(res < 0, "Failed to handle null dbh");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  dbh = prom_metric_db_init(p, test_dir, flags);
+  ck_assert_msg(dbh != NULL, "Failed to init metrics db: %s", strerror(errno));
+
+  mark_point();
+  res = prom_metric_db_histogram_add(p, dbh, 3, 0, 3, 1.0, 1.0, NULL, NULL);
+  ck_assert_msg(res < 0, "Failed to handle null labels");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  res = prom_metric_db_histogram_add(p, dbh, 3, 3, 3, 1.0, 1.0, "", NULL);
+  ck_assert_msg(res < 0, "Failed to handle out-of-range bucket");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  results = prom_metric_db_histogram_get(p, dbh, 3);
+  ck_assert_msg(results != NULL, "Failed to get histogram: %s",
+    strerror(errno));
+  ck_assert_msg(results->nelts == 0, "Expected 0 results, got %d",
+    results->nelts);
+
+  /* Each observation only touches its own bucket, and its exemplar. */
+  mark_point();
+  res = prom_metric_db_histogram_add(p, dbh, 3, 1, 3, 1.0, 2.5, "",
+    "{pid=\"1\"} 2.5 1.5");
+  ck_assert_msg(res == 0, "Failed to add observation: %s", strerror(errno));
+  res = prom_metric_db_histogram_add(p, dbh, 3, 1, 3, 1.0, 3.5, "",
+    "{pid=\"2\"} 3.5 2.5");
+  ck_assert_msg(res == 0, "Failed to add observation: %s", strerror(errno));
+  res = prom_metric_db_histogram_add(p, dbh, 3, 2, 3, 2.0, 20.0, "", NULL);
+  ck_assert_msg(res == 0, "Failed to add observation: %s", strerror(errno));
+  res = prom_metric_db_histogram_add(p, dbh, 3, 0, 3, 1.0, 0.5,
+    "{a=\"1\"}", NULL);
+  ck_assert_msg(res == 0, "Failed to add observation: %s", strerror(errno));
+
+  mark_point();
+  results = prom_metric_db_histogram_get(p, dbh, 3);
+  ck_assert_msg(results != NULL, "Failed to get histogram: %s",
+    strerror(errno));
+  ck_assert_msg(results->nelts == 2, "Expected 2 results, got %d",
+    results->nelts);
+
+  histograms = results->elts;
+  ck_assert_msg(histograms[0].sample_labelslen == 0,
+    "Expected empty labels, got '%s'", histograms[0].sample_labels);
+  ck_assert_msg(histograms[0].bucket_count == 3, "Expected 3 buckets, got %u",
+    histograms[0].bucket_count);
+  ck_assert_msg(histograms[0].bucket_counts[0] == 0.0 &&
+    histograms[0].bucket_counts[1] == 2.0 &&
+    histograms[0].bucket_counts[2] == 2.0,
+    "Expected bucket counts 0, 2, 2; got %g, %g, %g",
+    histograms[0].bucket_counts[0], histograms[0].bucket_counts[1],
+    histograms[0].bucket_counts[2]);
+  ck_assert_msg(histograms[0].sample_count == 4.0, "Expected count 4, got %g",
+    histograms[0].sample_count);
+  ck_assert_msg(histograms[0].sample_sum == 26.0, "Expected sum 26, got %g",
+    histograms[0].sample_sum);
+  ck_assert_msg(histograms[0].created > 0.0, "Expected created time, got %g",
+    histograms[0].created);
+  ck_assert_msg(histograms[0].bucket_exemplars != NULL,
+    "Expected bucket exemplars");
+  ck_assert_msg(histograms[0].bucket_exemplars[0] == NULL,
+    "Expected no exemplar for bucket 0, got '%s'",
+    histograms[0].bucket_exemplars[0]);
+  ck_assert_msg(histograms[0].bucket_exemplars[1] != NULL &&
+    strcmp(histograms[0].bucket_exemplars[1], "{pid=\"2\"} 3.5 2.5") == 0,
+    "Expected latest exemplar for bucket 1, got '%s'",
+    histograms[0].bucket_exemplars[1]);
+  ck_assert_msg(histograms[0].bucket_exemplars[2] == NULL,
+    "Expected no exemplar for bucket 2, got '%s'",
+    histograms[0].bucket_exemplars[2]);
+
+  ck_assert_msg(strcmp(histograms[1].sample_labels, "{a=\"1\"}") == 0,
+    "Expected labels '{a=\"1\"}', got '%s'", histograms[1].sample_labels);
+  ck_assert_msg(histograms[1].bucket_counts[0] == 1.0,
+    "Expected bucket count 1, got %g", histograms[1].bucket_counts[0]);
+  ck_assert_msg(histograms[1].bucket_exemplars == NULL,
+    "Expected no bucket exemplars");
+
+  res = prom_metric_db_close(p, dbh);
+  ck_assert_msg(res == 0, "Failed to close metrics db: %s", strerror(errno));
+  (void) tests_rmpath(p, test_dir);
+}
+END_TEST
+
+START_TEST (metric_db_summary_add_test) {
+  int res, flags = PROM_DB_OPEN_FL_SKIP_VACUUM;
+  struct prom_dbh *dbh;
+  const array_header *results;
+  const struct prom_metric_db_summary *summaries;
+
+  (void) tests_rmpath(p, test_dir);
+  (void) tests_mkpath(p, test_dir);
+
+  mark_point();
+  res = prom_metric_db_summary_add(NULL, NULL, 0, 0, 0.0, 0.0, NULL);
+  ck_assert_msg(res < 0, "Failed to handle null pool");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  res = prom_metric_db_summary_add(p, NULL, 0, 0, 0.0, 0.0, NULL);
+  ck_assert_msg(res < 0, "Failed to handle null dbh");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  dbh = prom_metric_db_init(p, test_dir, flags);
+  ck_assert_msg(dbh != NULL, "Failed to init metrics db: %s", strerror(errno));
+
+  mark_point();
+  res = prom_metric_db_summary_add(p, dbh, 3, 0, 1.0, 1.0, NULL);
+  ck_assert_msg(res < 0, "Failed to handle null labels");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  results = prom_metric_db_summary_get(p, dbh, 3);
+  ck_assert_msg(results != NULL, "Failed to get summary: %s", strerror(errno));
+  ck_assert_msg(results->nelts == 0, "Expected 0 results, got %d",
+    results->nelts);
+
+  /* Observations in the same bin are merged; bins are ordered by key. */
+  mark_point();
+  res = prom_metric_db_summary_add(p, dbh, 3, 10, 1.0, 2.5, "");
+  ck_assert_msg(res == 0, "Failed to add observation: %s", strerror(errno));
+  res = prom_metric_db_summary_add(p, dbh, 3, -5, 1.0, 0.5, "");
+  ck_assert_msg(res == 0, "Failed to add observation: %s", strerror(errno));
+  res = prom_metric_db_summary_add(p, dbh, 3, 10, 2.0, 5.0, "");
+  ck_assert_msg(res == 0, "Failed to add observation: %s", strerror(errno));
+  res = prom_metric_db_summary_add(p, dbh, 3, 7, 1.0, 2.0, "{a=\"1\"}");
+  ck_assert_msg(res == 0, "Failed to add observation: %s", strerror(errno));
+
+  mark_point();
+  results = prom_metric_db_summary_get(p, dbh, 3);
+  ck_assert_msg(results != NULL, "Failed to get summary: %s", strerror(errno));
+  ck_assert_msg(results->nelts == 2, "Expected 2 results, got %d",
+    results->nelts);
+
+  summaries = results->elts;
+  ck_assert_msg(summaries[0].sample_labelslen == 0,
+    "Expected empty labels, got '%s'", summaries[0].sample_labels);
+  ck_assert_msg(summaries[0].bin_count == 2, "Expected 2 bins, got %u",
+    summaries[0].bin_count);
+  ck_assert_msg(summaries[0].bins[0].key == -5 &&
+    summaries[0].bins[1].key == 10,
+    "Expected bin keys -5, 10; got %d, %d", summaries[0].bins[0].key,
+    summaries[0].bins[1].key);
+  ck_assert_msg(summaries[0].bins[0].count == 1.0 &&
+    summaries[0].bins[1].count == 3.0,
+    "Expected bin counts 1, 3; got %g, %g", summaries[0].bins[0].count,
+    summaries[0].bins[1].count);
+  ck_assert_msg(summaries[0].sample_count == 4.0, "Expected count 4, got %g",
+    summaries[0].sample_count);
+  ck_assert_msg(summaries[0].sample_sum == 8.0, "Expected sum 8, got %g",
+    summaries[0].sample_sum);
+
+  ck_assert_msg(strcmp(summaries[1].sample_labels, "{a=\"1\"}") == 0,
+    "Expected labels '{a=\"1\"}', got '%s'", summaries[1].sample_labels);
+  ck_assert_msg(summaries[1].bin_count == 1, "Expected 1 bin, got %u",
+    summaries[1].bin_count);
+
   res = prom_metric_db_close(p, dbh);
   ck_assert_msg(res == 0, "Failed to close metrics db: %s", strerror(errno));
   (void) tests_rmpath(p, test_dir);
@@ -478,15 +1086,21 @@ Suite *tests_get_metric_db_suite(void) {
   tcase_add_test(testcase, metric_db_close_test);
   tcase_add_test(testcase, metric_db_init_test);
   tcase_add_test(testcase, metric_db_open_test);
+  tcase_add_test(testcase, metric_db_reopen_test);
+  tcase_add_test(testcase, metric_db_maintain_test);
 
   tcase_add_test(testcase, metric_db_exists_test);
   tcase_add_test(testcase, metric_db_create_test);
 
   tcase_add_test(testcase, metric_db_sample_exists_test);
+  tcase_add_test(testcase, metric_db_sample_label_sets_test);
   tcase_add_test(testcase, metric_db_sample_get_test);
   tcase_add_test(testcase, metric_db_sample_decr_test);
   tcase_add_test(testcase, metric_db_sample_incr_test);
   tcase_add_test(testcase, metric_db_sample_set_test);
+  tcase_add_test(testcase, metric_db_histogram_add_test);
+  tcase_add_test(testcase, metric_db_summary_add_test);
+  tcase_add_test(testcase, metric_db_scan_test);
 
   suite_add_tcase(suite, testcase);
   return suite;
@@ -0,0 +1,593 @@
+/*
+ * ProFTPD - mod_prometheus API testsuite
+ * Copyright (c) 2021-2022 TJ Saunders <tj@castaglia.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+/* Metric shared memory datastore API tests. */
+
+#include "../tests.h"
+#include "prometheus/metric/shm.h"
+#include "prometheus/metric/db.h"
+
+#include <sys/mman.h>
+
+static pool *p = NULL;
+static const char *test_dir = "/tmp/prt-mod_prometheus-test-shm";
+
+static void set_up(void) {
+  if (p == NULL) {
+    p = permanent_pool = make_sub_pool(NULL);
+  }
+
+  (void) tests_rmpath(p, test_dir);
+  (void) tests_mkpath(p, test_dir);
+
+  if (getenv("TEST_VERBOSE") != NULL) {
+    pr_trace_set_levels("prometheus.metric.shm", 1, 20);
+  }
+}
+
+static void tear_down(void) {
+  if (getenv("TEST_VERBOSE") != NULL) {
+    pr_trace_set_levels("prometheus.metric.shm", 0, 0);
+  }
+
+  (void) tests_rmpath(p, test_dir);
+
+  if (p != NULL) {
+    destroy_pool(p);
+    p = permanent_pool = NULL;
+  }
+}
+
+START_TEST (metric_shm_init_test) {
+  int res;
+  struct prom_metric_shm *shm;
+
+  mark_point();
+  shm = prom_metric_shm_init(NULL, NULL, 0);
+  ck_assert_msg(shm == NULL, "Failed to handle null pool");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  shm = prom_metric_shm_init(p, NULL, 0);
+  ck_assert_msg(shm == NULL, "Failed to handle null path");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  shm = prom_metric_shm_init(p, test_dir, 0);
+  ck_assert_msg(shm == NULL, "Failed to handle zero max samples");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  shm = prom_metric_shm_init(p, "/tmp/prt-mod_prometheus-no-such-dir", 8);
+  ck_assert_msg(shm == NULL, "Failed to handle nonexistent directory");
+  ck_assert_msg(errno == ENOENT, "Expected ENOENT (%d), got %s (%d)", ENOENT,
+    strerror(errno), errno);
+
+  mark_point();
+  shm = prom_metric_shm_init(p, test_dir, 8);
+  ck_assert_msg(shm != NULL, "Failed to init shm: %s", strerror(errno));
+
+  res = prom_metric_shm_sample_count(shm);
+  ck_assert_msg(res == 0, "Expected 0 samples, got %d", res);
+
+  /* Initializing again should start with a new, empty datastore. */
+  res = prom_metric_shm_sample_incr(p, shm, 1, 1.0, "");
+  ck_assert_msg(res == 0, "Failed to increment sample: %s", strerror(errno));
+
+  res = prom_metric_shm_close(p, shm);
+  ck_assert_msg(res == 0, "Failed to close shm: %s", strerror(errno));
+
+  mark_point();
+  shm = prom_metric_shm_init(p, test_dir, 8);
+  ck_assert_msg(shm != NULL, "Failed to init shm: %s", strerror(errno));
+
+  res = prom_metric_shm_sample_count(shm);
+  ck_assert_msg(res == 0, "Expected 0 samples, got %d", res);
+
+  res = prom_metric_shm_close(p, shm);
+  ck_assert_msg(res == 0, "Failed to close shm: %s", strerror(errno));
+}
+END_TEST
+
+START_TEST (metric_shm_close_test) {
+  int res;
+
+  mark_point();
+  res = prom_metric_shm_close(NULL, NULL);
+  ck_assert_msg(res < 0, "Failed to handle null pool");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  res = prom_metric_shm_close(p, NULL);
+  ck_assert_msg(res < 0, "Failed to handle null shm");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+}
+END_TEST
+
+START_TEST (metric_shm_sample_get_test) {
+  int res;
+  int64_t metric_id = 7;
+  const array_header *results;
+  struct prom_metric_shm *shm;
+  const struct prom_metric_db_sample *elts;
+
+  mark_point();
+  results = prom_metric_shm_sample_get(NULL, NULL, 0);
+  ck_assert_msg(results == NULL, "Failed to handle null pool");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  results = prom_metric_shm_sample_get(p, NULL, 0);
+  ck_assert_msg(results == NULL, "Failed to handle null shm");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  shm = prom_metric_shm_init(p, test_dir, 16);
+  ck_assert_msg(shm != NULL, "Failed to init shm: %s", strerror(errno));
+
+  mark_point();
+  results = prom_metric_shm_sample_get(p, shm, metric_id);
+  ck_assert_msg(results != NULL, "Failed to get samples: %s",
+    strerror(errno));
+  ck_assert_msg(results->nelts == 0, "Expected 0 results, got %d",
+    results->nelts);
+
+  /* Add samples out of order, for another metric as well, and make sure
+   * that we only get ours, sorted by labels.
+   */
+  res = prom_metric_shm_sample_incr(p, shm, metric_id, 2.0, "{b=\"2\"}");
+  ck_assert_msg(res == 0, "Failed to increment sample: %s", strerror(errno));
+  res = prom_metric_shm_sample_incr(p, shm, metric_id + 1, 5.0, "{a=\"1\"}");
+  ck_assert_msg(res == 0, "Failed to increment sample: %s", strerror(errno));
+  res = prom_metric_shm_sample_incr(p, shm, metric_id, 1.0, "{a=\"1\"}");
+  ck_assert_msg(res == 0, "Failed to increment sample: %s", strerror(errno));
+
+  mark_point();
+  results = prom_metric_shm_sample_get(p, shm, metric_id);
+  ck_assert_msg(results != NULL, "Failed to get samples: %s",
+    strerror(errno));
+  ck_assert_msg(results->nelts == 2, "Expected 2 results, got %d",
+    results->nelts);
+
+  elts = results->elts;
+  ck_assert_msg(elts[0].metric_id == metric_id,
+    "Expected metric ID %lld, got %lld", (long long) metric_id,
+    (long long) elts[0].metric_id);
+  ck_assert_msg(elts[0].sample_value == 1.0, "Expected 1, got %g",
+    elts[0].sample_value);
+  ck_assert_msg(strcmp(elts[0].sample_labels, "{a=\"1\"}") == 0,
+    "Expected '{a=\"1\"}', got '%s'", elts[0].sample_labels);
+  ck_assert_msg(elts[0].sample_labelslen == 7,
+    "Expected labels length 7, got %lu",
+    (unsigned long) elts[0].sample_labelslen);
+  ck_assert_msg(elts[1].sample_value == 2.0, "Expected 2, got %g",
+    elts[1].sample_value);
+  ck_assert_msg(strcmp(elts[1].sample_labels, "{b=\"2\"}") == 0,
+    "Expected '{b=\"2\"}', got '%s'", elts[1].sample_labels);
+
+  res = prom_metric_shm_sample_count(shm);
+  ck_assert_msg(res == 3, "Expected 3 samples, got %d", res);
+
+  res = prom_metric_shm_close(p, shm);
+  ck_assert_msg(res == 0, "Failed to close shm: %s", strerror(errno));
+}
+END_TEST
+
+START_TEST (metric_shm_sample_decr_test) {
+  int res;
+  int64_t metric_id = 1;
+  const array_header *results;
+  struct prom_metric_shm *shm;
+  const struct prom_metric_db_sample *elts;
+
+  mark_point();
+  res = prom_metric_shm_sample_decr(NULL, NULL, 0, 0.0, NULL);
+  ck_assert_msg(res < 0, "Failed to handle null pool");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  res = prom_metric_shm_sample_decr(p, NULL, 0, 0.0, NULL);
+  ck_assert_msg(res < 0, "Failed to handle null shm");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  shm = prom_metric_shm_init(p, test_dir, 8);
+  ck_assert_msg(shm != NULL, "Failed to init shm: %s", strerror(errno));
+
+  mark_point();
+  res = prom_metric_shm_sample_decr(p, shm, metric_id, 0.0, NULL);
+  ck_assert_msg(res < 0, "Failed to handle null labels");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  res = prom_metric_shm_sample_decr(p, shm, metric_id, 0.1, "");
+  ck_assert_msg(res == 0, "Failed to decrement sample: %s", strerror(errno));
+
+  results = prom_metric_shm_sample_get(p, shm, metric_id);
+  ck_assert_msg(results != NULL, "Failed to get samples: %s",
+    strerror(errno));
+  ck_assert_msg(results->nelts == 1, "Expected 1 result, got %d",
+    results->nelts);
+
+  elts = results->elts;
+  ck_assert_msg(elts[0].sample_value == -0.1, "Expected -0.1, got %g",
+    elts[0].sample_value);
+
+  res = prom_metric_shm_close(p, shm);
+  ck_assert_msg(res == 0, "Failed to close shm: %s", strerror(errno));
+}
+END_TEST
+
+START_TEST (metric_shm_sample_incr_test) {
+  register unsigned int i;
+  int res;
+  int64_t metric_id = 1;
+  const array_header *results;
+  struct prom_metric_shm *shm;
+  const struct prom_metric_db_sample *elts;
+  char labels[PROM_METRIC_SHM_MAX_LABELS_LEN + 2];
+
+  mark_point();
+  res = prom_metric_shm_sample_incr(NULL, NULL, 0, 0.0, NULL);
+  ck_assert_msg(res < 0, "Failed to handle null pool");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  res = prom_metric_shm_sample_incr(p, NULL, 0, 0.0, NULL);
+  ck_assert_msg(res < 0, "Failed to handle null shm");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  shm = prom_metric_shm_init(p, test_dir, 2);
+  ck_assert_msg(shm != NULL, "Failed to init shm: %s", strerror(errno));
+
+  mark_point();
+  res = prom_metric_shm_sample_incr(p, shm, metric_id, 0.0, NULL);
+  ck_assert_msg(res < 0, "Failed to handle null labels");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  memset(labels, 'a', sizeof(labels)-1);
+  labels[sizeof(labels)-1] = '\0';
+  res = prom_metric_shm_sample_incr(p, shm, metric_id, 1.0, labels);
+  ck_assert_msg(res < 0, "Failed to handle too-long labels");
+  ck_assert_msg(errno == ENAMETOOLONG,
+    "Expected ENAMETOOLONG (%d), got %s (%d)", ENAMETOOLONG, strerror(errno),
+    errno);
+
+  mark_point();
+  for (i = 0; i < 10; i++) {
+    res = prom_metric_shm_sample_incr(p, shm, metric_id, 0.5, "");
+    ck_assert_msg(res == 0, "Failed to increment sample: %s",
+      strerror(errno));
+  }
+
+  results = prom_metric_shm_sample_get(p, shm, metric_id);
+  ck_assert_msg(results != NULL, "Failed to get samples: %s",
+    strerror(errno));
+  ck_assert_msg(results->nelts == 1, "Expected 1 result, got %d",
+    results->nelts);
+
+  elts = results->elts;
+  ck_assert_msg(elts[0].sample_value == 5.0, "Expected 5, got %g",
+    elts[0].sample_value);
+
+  /* Fill the remaining slot, then overflow. */
+  res = prom_metric_shm_sample_incr(p, shm, metric_id, 1.0, "{a=\"1\"}");
+  ck_assert_msg(res == 0, "Failed to increment sample: %s", strerror(errno));
+
+  mark_point();
+  res = prom_metric_shm_sample_incr(p, shm, metric_id, 1.0, "{a=\"2\"}");
+  ck_assert_msg(res < 0, "Failed to handle full datastore");
+  ck_assert_msg(errno == ENOSPC, "Expected ENOSPC (%d), got %s (%d)", ENOSPC,
+    strerror(errno), errno);
+
+  /* Existing samples can still be updated. */
+  res = prom_metric_shm_sample_incr(p, shm, metric_id, 1.0, "{a=\"1\"}");
+  ck_assert_msg(res == 0, "Failed to increment sample: %s", strerror(errno));
+
+  res = prom_metric_shm_close(p, shm);
+  ck_assert_msg(res == 0, "Failed to close shm: %s", strerror(errno));
+}
+END_TEST
+
+START_TEST (metric_shm_sample_incr_shared_test) {
+  register unsigned int i;
+  int res, status;
+  int64_t metric_id = 1;
+  unsigned int nprocs = 4, nincrs = 1000;
+  pid_t pids[4];
+  const array_header *results;
+  struct prom_metric_shm *shm;
+  const struct prom_metric_db_sample *elts;
+
+  shm = prom_metric_shm_init(p, test_dir, 8);
+  ck_assert_msg(shm != NULL, "Failed to init shm: %s", strerror(errno));
+
+  /* Multiple processes, inheriting the same mapping, updating the same
+   * samples concurrently.
+   */
+  for (i = 0; i < nprocs; i++) {
+    pids[i] = fork();
+    ck_assert_msg(pids[i] >= 0, "Failed to fork: %s", strerror(errno));
+
+    if (pids[i] == 0) {
+      register unsigned int j;
+
+      for (j = 0; j < nincrs; j++) {
+        if (prom_metric_shm_sample_incr(p, shm, metric_id, 1.0, "") < 0 ||
+            prom_metric_shm_sample_incr(p, shm, metric_id, 1.0,
+              "{a=\"1\"}") < 0) {
+          _exit(1);
+        }
+      }
+
+      _exit(0);
+    }
+  }
+
+  for (i = 0; i < nprocs; i++) {
+    res = waitpid(pids[i], &status, 0);
+    ck_assert_msg(res == pids[i], "Failed to wait for child: %s",
+      strerror(errno));
+    ck_assert_msg(WIFEXITED(status) && WEXITSTATUS(status) == 0,
+      "Child process failed");
+  }
+
+  results = prom_metric_shm_sample_get(p, shm, metric_id);
+  ck_assert_msg(results != NULL, "Failed to get samples: %s",
+    strerror(errno));
+  ck_assert_msg(results->nelts == 2, "Expected 2 results, got %d",
+    results->nelts);
+
+  elts = results->elts;
+  ck_assert_msg(elts[0].sample_value == 4000.0, "Expected 4000, got %g",
+    elts[0].sample_value);
+  ck_assert_msg(elts[1].sample_value == 4000.0, "Expected 4000, got %g",
+    elts[1].sample_value);
+
+  res = prom_metric_shm_sample_count(shm);
+  ck_assert_msg(res == 2, "Expected 2 samples, got %d", res);
+
+  res = prom_metric_shm_close(p, shm);
+  ck_assert_msg(res == 0, "Failed to close shm: %s", strerror(errno));
+}
+END_TEST
+
+START_TEST (metric_shm_sample_set_test) {
+  int res;
+  int64_t metric_id = 1;
+  const array_header *results;
+  struct prom_metric_shm *shm;
+  const struct prom_metric_db_sample *elts;
+
+  mark_point();
+  res = prom_metric_shm_sample_set(NULL, NULL, 0, 0.0, NULL);
+  ck_assert_msg(res < 0, "Failed to handle null pool");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  res = prom_metric_shm_sample_set(p, NULL, 0, 0.0, NULL);
+  ck_assert_msg(res < 0, "Failed to handle null shm");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  shm = prom_metric_shm_init(p, test_dir, 8);
+  ck_assert_msg(shm != NULL, "Failed to init shm: %s", strerror(errno));
+
+  mark_point();
+  res = prom_metric_shm_sample_set(p, shm, metric_id, 0.0, NULL);
+  ck_assert_msg(res < 0, "Failed to handle null labels");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  res = prom_metric_shm_sample_incr(p, shm, metric_id, 10.0, "");
+  ck_assert_msg(res == 0, "Failed to increment sample: %s", strerror(errno));
+
+  mark_point();
+  res = prom_metric_shm_sample_set(p, shm, metric_id, 0.25, "");
+  ck_assert_msg(res == 0, "Failed to set sample: %s", strerror(errno));
+
+  results = prom_metric_shm_sample_get(p, shm, metric_id);
+  ck_assert_msg(results != NULL, "Failed to get samples: %s",
+    strerror(errno));
+  ck_assert_msg(results->nelts == 1, "Expected 1 result, got %d",
+    results->nelts);
+
+  elts = results->elts;
+  ck_assert_msg(elts[0].sample_value == 0.25, "Expected 0.25, got %g",
+    elts[0].sample_value);
+
+  res = prom_metric_shm_close(p, shm);
+  ck_assert_msg(res == 0, "Failed to close shm: %s", strerror(errno));
+}
+END_TEST
+
+START_TEST (metric_shm_sample_get_all_test) {
+  int res;
+  const array_header *results;
+  struct prom_metric_shm *shm;
+  const struct prom_metric_db_sample *elts;
+
+  mark_point();
+  results = prom_metric_shm_sample_get_all(NULL, NULL);
+  ck_assert_msg(results == NULL, "Failed to handle null pool");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  results = prom_metric_shm_sample_get_all(p, NULL);
+  ck_assert_msg(results == NULL, "Failed to handle null shm");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  shm = prom_metric_shm_init(p, test_dir, 16);
+  ck_assert_msg(shm != NULL, "Failed to init shm: %s", strerror(errno));
+
+  res = prom_metric_shm_sample_incr(p, shm, 9, 1.0, "{b=\"2\"}");
+  ck_assert_msg(res == 0, "Failed to increment sample: %s", strerror(errno));
+  res = prom_metric_shm_sample_incr(p, shm, 3, 2.0, "");
+  ck_assert_msg(res == 0, "Failed to increment sample: %s", strerror(errno));
+  res = prom_metric_shm_sample_incr(p, shm, 9, 3.0, "{a=\"1\"}");
+  ck_assert_msg(res == 0, "Failed to increment sample: %s", strerror(errno));
+
+  /* Expect the samples sorted by metric ID, then labels. */
+  mark_point();
+  results = prom_metric_shm_sample_get_all(p, shm);
+  ck_assert_msg(results != NULL, "Failed to get samples: %s",
+    strerror(errno));
+  ck_assert_msg(results->nelts == 3, "Expected 3 results, got %d",
+    results->nelts);
+
+  elts = results->elts;
+  ck_assert_msg(elts[0].metric_id == 3, "Expected metric ID 3, got %lld",
+    (long long) elts[0].metric_id);
+  ck_assert_msg(elts[0].sample_value == 2.0, "Expected 2, got %g",
+    elts[0].sample_value);
+  ck_assert_msg(elts[1].metric_id == 9, "Expected metric ID 9, got %lld",
+    (long long) elts[1].metric_id);
+  ck_assert_msg(strcmp(elts[1].sample_labels, "{a=\"1\"}") == 0,
+    "Expected '{a=\"1\"}', got '%s'", elts[1].sample_labels);
+  ck_assert_msg(elts[2].metric_id == 9, "Expected metric ID 9, got %lld",
+    (long long) elts[2].metric_id);
+  ck_assert_msg(strcmp(elts[2].sample_labels, "{b=\"2\"}") == 0,
+    "Expected '{b=\"2\"}', got '%s'", elts[2].sample_labels);
+
+  res = prom_metric_shm_close(p, shm);
+  ck_assert_msg(res == 0, "Failed to close shm: %s", strerror(errno));
+}
+END_TEST
+
+START_TEST (metric_shm_sample_stale_slot_test) {
+  int fd, res, status;
+  int64_t metric_id = 1;
+  pid_t pid;
+  uint32_t *state;
+  void *addr;
+  size_t len;
+  const array_header *results;
+  struct prom_metric_shm *shm;
+  const struct prom_metric_db_sample *elts;
+
+  /* With a single slot, every sample probes it. */
+  shm = prom_metric_shm_init(p, test_dir, 1);
+  ck_assert_msg(shm != NULL, "Failed to init shm: %s", strerror(errno));
+
+  /* Obtain the PID of a process which has since exited. */
+  pid = fork();
+  ck_assert_msg(pid >= 0, "Failed to fork: %s", strerror(errno));
+  if (pid == 0) {
+    _exit(0);
+  }
+
+  res = waitpid(pid, &status, 0);
+  ck_assert_msg(res == pid, "Failed to wait for child: %s", strerror(errno));
+
+  /* Leave the slot busy, as if that process had died while claiming it.
+   * The slot state is the first field of the first slot, after the 16-byte
+   * header.
+   */
+  fd = open(pdircat(p, test_dir, "metrics.shm", NULL), O_RDWR);
+  ck_assert_msg(fd >= 0, "Failed to open shm file: %s", strerror(errno));
+
+  len = 16 + sizeof(uint32_t);
+  addr = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  (void) close(fd);
+  ck_assert_msg(addr != MAP_FAILED, "Failed to map shm file: %s",
+    strerror(errno));
+
+  state = (uint32_t *) (((char *) addr) + 16);
+  *state = 1 | ((uint32_t) pid << 2);
+
+  /* The abandoned claim is taken over, rather than dropping the update. */
+  mark_point();
+  res = prom_metric_shm_sample_incr(p, shm, metric_id, 2.0, "");
+  ck_assert_msg(res == 0, "Failed to increment sample: %s", strerror(errno));
+
+  res = prom_metric_shm_sample_incr(p, shm, metric_id, 3.0, "");
+  ck_assert_msg(res == 0, "Failed to increment sample: %s", strerror(errno));
+
+  results = prom_metric_shm_sample_get(p, shm, metric_id);
+  ck_assert_msg(results != NULL, "Failed to get samples: %s",
+    strerror(errno));
+  ck_assert_msg(results->nelts == 1, "Expected 1 result, got %d",
+    results->nelts);
+
+  elts = results->elts;
+  ck_assert_msg(elts[0].sample_value == 5.0, "Expected 5, got %g",
+    elts[0].sample_value);
+
+  res = prom_metric_shm_sample_count(shm);
+  ck_assert_msg(res == 1, "Expected 1 sample, got %d", res);
+
+  /* A slot being claimed by a live process is still left alone. */
+  *state = 1 | ((uint32_t) getpid() << 2);
+
+  mark_point();
+  res = prom_metric_shm_sample_incr(p, shm, metric_id, 1.0, "");
+  ck_assert_msg(res < 0, "Failed to handle busy slot");
+  ck_assert_msg(errno == EAGAIN, "Expected EAGAIN (%d), got %s (%d)", EAGAIN,
+    strerror(errno), errno);
+
+  (void) munmap(addr, len);
+
+  res = prom_metric_shm_close(p, shm);
+  ck_assert_msg(res == 0, "Failed to close shm: %s", strerror(errno));
+}
+END_TEST
+
+Suite *tests_get_metric_shm_suite(void) {
+  Suite *suite;
+  TCase *testcase;
+
+  suite = suite_create("metric.shm");
+  testcase = tcase_create("base");
+
+  tcase_add_checked_fixture(testcase, set_up, tear_down);
+
+  tcase_add_test(testcase, metric_shm_init_test);
+  tcase_add_test(testcase, metric_shm_close_test);
+
+  tcase_add_test(testcase, metric_shm_sample_get_test);
+  tcase_add_test(testcase, metric_shm_sample_get_all_test);
+  tcase_add_test(testcase, metric_shm_sample_decr_test);
+  tcase_add_test(testcase, metric_shm_sample_incr_test);
+  tcase_add_test(testcase, metric_shm_sample_incr_shared_test);
+  tcase_add_test(testcase, metric_shm_sample_set_test);
+  tcase_add_test(testcase, metric_shm_sample_stale_slot_test);
+
+  suite_add_tcase(suite, testcase);
+  return suite;
+}
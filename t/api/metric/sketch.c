@@ -0,0 +1,191 @@
+/*
+ * ProFTPD - mod_prometheus API testsuite
+ * Copyright (c) 2021-2022 TJ Saunders <tj@castaglia.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+
+/* Metric quantile sketch API tests. */
+
+#include "../tests.h"
+#include "prometheus/metric/sketch.h"
+
+#include <math.h>
+
+static pool *p = NULL;
+
+static void set_up(void) {
+  if (p == NULL) {
+    p = permanent_pool = make_sub_pool(NULL);
+  }
+}
+
+static void tear_down(void) {
+  if (p != NULL) {
+    destroy_pool(p);
+    p = permanent_pool = NULL;
+  }
+}
+
+START_TEST (sketch_key_test) {
+  int key, prev_key, min_key, max_key;
+  double val;
+
+  mark_point();
+  min_key = prom_sketch_key(0.0);
+  max_key = prom_sketch_key(PROM_SKETCH_MAX_VALUE);
+
+  /* Zero, negative, tiny, and NaN values all share the lowest bin. */
+  key = prom_sketch_key(-1.0);
+  ck_assert_msg(key == min_key, "Expected key %d for -1.0, got %d", min_key,
+    key);
+  key = prom_sketch_key(PROM_SKETCH_MIN_VALUE / 10.0);
+  ck_assert_msg(key == min_key, "Expected key %d for tiny value, got %d",
+    min_key, key);
+  key = prom_sketch_key(NAN);
+  ck_assert_msg(key == min_key, "Expected key %d for NaN, got %d", min_key,
+    key);
+
+  /* The smallest tracked value must not land in the lowest bin. */
+  key = prom_sketch_key(PROM_SKETCH_MIN_VALUE * 1.5);
+  ck_assert_msg(key > min_key, "Expected key > %d, got %d", min_key, key);
+
+  /* Huge values are clamped into the highest bin. */
+  key = prom_sketch_key(PROM_SKETCH_MAX_VALUE * 1000.0);
+  ck_assert_msg(key == max_key, "Expected key %d for huge value, got %d",
+    max_key, key);
+
+  mark_point();
+  prev_key = min_key;
+  for (val = 0.001; val < 1.0e9; val *= 1.7) {
+    key = prom_sketch_key(val);
+    ck_assert_msg(key >= prev_key, "Expected key >= %d for %g, got %d",
+      prev_key, val, key);
+    prev_key = key;
+  }
+
+  ck_assert_msg(
+    prom_sketch_max_bins() == (unsigned int) (max_key - min_key + 1),
+    "Expected %d max bins, got %u", max_key - min_key + 1,
+    prom_sketch_max_bins());
+}
+END_TEST
+
+START_TEST (sketch_value_test) {
+  double val, estimate;
+
+  mark_point();
+  estimate = prom_sketch_value(prom_sketch_key(0.0));
+  ck_assert_msg(estimate == 0.0, "Expected 0 for lowest bin, got %g",
+    estimate);
+
+  for (val = 0.0001; val < 1.0e12; val *= 3.1) {
+    estimate = prom_sketch_value(prom_sketch_key(val));
+    ck_assert_msg(fabs(estimate - val) <= val * PROM_SKETCH_RELATIVE_ACCURACY,
+      "Expected estimate of %g within %g, got %g", val,
+      PROM_SKETCH_RELATIVE_ACCURACY, estimate);
+  }
+}
+END_TEST
+
+START_TEST (sketch_quantile_test) {
+  register unsigned int i;
+  int res;
+  double val = 0.0;
+  struct prom_sketch_bin bins[1000];
+  unsigned int bin_count = 0;
+
+  mark_point();
+  res = prom_sketch_quantile(NULL, 0, 0.5, NULL);
+  ck_assert_msg(res < 0, "Failed to handle null bins");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  res = prom_sketch_quantile(bins, 0, 1.5, &val);
+  ck_assert_msg(res < 0, "Failed to handle out-of-range quantile");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  res = prom_sketch_quantile(bins, 0, 0.5, &val);
+  ck_assert_msg(res < 0, "Failed to handle empty sketch");
+  ck_assert_msg(errno == ENOENT, "Expected ENOENT (%d), got %s (%d)", ENOENT,
+    strerror(errno), errno);
+
+  /* Observe 1..1000, merging each into its bin (in key order). */
+  for (i = 1; i <= 1000; i++) {
+    int key;
+
+    key = prom_sketch_key((double) i);
+    if (bin_count > 0 &&
+        bins[bin_count-1].key == key) {
+      bins[bin_count-1].count += 1.0;
+      continue;
+    }
+
+    bins[bin_count].key = key;
+    bins[bin_count].count = 1.0;
+    bin_count++;
+  }
+
+  mark_point();
+  res = prom_sketch_quantile(bins, bin_count, 0.5, &val);
+  ck_assert_msg(res == 0, "Failed to get quantile: %s", strerror(errno));
+  ck_assert_msg(fabs(val - 500.5) <= 500.5 * 0.02,
+    "Expected median near 500.5, got %g", val);
+
+  mark_point();
+  res = prom_sketch_quantile(bins, bin_count, 0.99, &val);
+  ck_assert_msg(res == 0, "Failed to get quantile: %s", strerror(errno));
+  ck_assert_msg(fabs(val - 990.0) <= 990.0 * 0.02,
+    "Expected 0.99 quantile near 990, got %g", val);
+
+  mark_point();
+  res = prom_sketch_quantile(bins, bin_count, 0.0, &val);
+  ck_assert_msg(res == 0, "Failed to get quantile: %s", strerror(errno));
+  ck_assert_msg(fabs(val - 1.0) <= PROM_SKETCH_RELATIVE_ACCURACY,
+    "Expected minimum near 1, got %g", val);
+
+  mark_point();
+  res = prom_sketch_quantile(bins, bin_count, 1.0, &val);
+  ck_assert_msg(res == 0, "Failed to get quantile: %s", strerror(errno));
+  ck_assert_msg(fabs(val - 1000.0) <= 1000.0 * PROM_SKETCH_RELATIVE_ACCURACY,
+    "Expected maximum near 1000, got %g", val);
+}
+END_TEST
+
+Suite *tests_get_metric_sketch_suite(void) {
+  Suite *suite;
+  TCase *testcase;
+
+  suite = suite_create("metric.sketch");
+  testcase = tcase_create("base");
+
+  tcase_add_checked_fixture(testcase, set_up, tear_down);
+
+  tcase_add_test(testcase, sketch_key_test);
+  tcase_add_test(testcase, sketch_value_test);
+  tcase_add_test(testcase, sketch_quantile_test);
+
+  suite_add_tcase(suite, testcase);
+  return suite;
+}
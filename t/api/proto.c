@@ -0,0 +1,379 @@
+/*
+ * ProFTPD - mod_prometheus API testsuite
+ * Copyright (c) 2021-2022 TJ Saunders <tj@castaglia.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+/* Protobuf API tests. */
+
+#include "tests.h"
+#include "prometheus/proto.h"
+
+static pool *p = NULL;
+
+static void set_up(void) {
+  if (p == NULL) {
+    p = permanent_pool = make_sub_pool(NULL);
+  }
+
+  mark_point();
+}
+
+static void tear_down(void) {
+  if (p != NULL) {
+    destroy_pool(p);
+    p = permanent_pool = NULL;
+  }
+}
+
+static void assert_proto_buf(struct prom_proto *proto,
+    const unsigned char *expected, size_t expected_len) {
+  register unsigned int i;
+  const char *buf;
+  size_t buflen = 0;
+
+  buf = prom_proto_get_buf(proto, &buflen);
+  ck_assert_msg(buf != NULL, "Failed to get buffer: %s", strerror(errno));
+  ck_assert_msg(buflen == expected_len, "Expected %lu bytes, got %lu",
+    (unsigned long) expected_len, (unsigned long) buflen);
+
+  for (i = 0; i < buflen; i++) {
+    ck_assert_msg((unsigned char) buf[i] == expected[i],
+      "Expected 0x%02x at offset %u, got 0x%02x", expected[i], i,
+      (unsigned char) buf[i]);
+  }
+}
+
+START_TEST (proto_create_test) {
+  int res;
+  struct prom_proto *proto;
+
+  mark_point();
+  proto = prom_proto_create(NULL);
+  ck_assert_msg(proto == NULL, "Failed to handle null pool");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  res = prom_proto_destroy(NULL);
+  ck_assert_msg(res < 0, "Failed to handle null proto");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  proto = prom_proto_create(p);
+  ck_assert_msg(proto != NULL, "Failed to create proto: %s", strerror(errno));
+
+  res = prom_proto_destroy(proto);
+  ck_assert_msg(res == 0, "Failed to destroy proto: %s", strerror(errno));
+}
+END_TEST
+
+START_TEST (proto_get_buf_test) {
+  const char *buf;
+  size_t buflen = 1;
+  struct prom_proto *proto;
+
+  mark_point();
+  buf = prom_proto_get_buf(NULL, NULL);
+  ck_assert_msg(buf == NULL, "Failed to handle null proto");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  proto = prom_proto_create(p);
+
+  mark_point();
+  buf = prom_proto_get_buf(proto, NULL);
+  ck_assert_msg(buf == NULL, "Failed to handle null len");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  buf = prom_proto_get_buf(proto, &buflen);
+  ck_assert_msg(buf != NULL, "Failed to get buffer: %s", strerror(errno));
+  ck_assert_msg(buflen == 0, "Expected 0 bytes, got %lu",
+    (unsigned long) buflen);
+
+  prom_proto_destroy(proto);
+}
+END_TEST
+
+START_TEST (proto_add_varint_test) {
+  int res;
+  struct prom_proto *proto;
+  const unsigned char expected[] = { 0x08, 0xac, 0x02, 0x10, 0x00 };
+
+  mark_point();
+  res = prom_proto_add_varint(NULL, 1, 0);
+  ck_assert_msg(res < 0, "Failed to handle null proto");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  proto = prom_proto_create(p);
+
+  mark_point();
+  res = prom_proto_add_varint(proto, 0, 0);
+  ck_assert_msg(res < 0, "Failed to handle invalid field number");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  res = prom_proto_add_varint(proto, 1, 300);
+  ck_assert_msg(res == 0, "Failed to add varint: %s", strerror(errno));
+
+  res = prom_proto_add_varint(proto, 2, 0);
+  ck_assert_msg(res == 0, "Failed to add varint: %s", strerror(errno));
+
+  assert_proto_buf(proto, expected, sizeof(expected));
+
+  mark_point();
+  res = prom_proto_reset(proto);
+  ck_assert_msg(res == 0, "Failed to reset proto: %s", strerror(errno));
+  assert_proto_buf(proto, expected, 0);
+
+  prom_proto_destroy(proto);
+}
+END_TEST
+
+START_TEST (proto_add_sint_test) {
+  int res;
+  struct prom_proto *proto;
+  const unsigned char expected[] = {
+    0x08, 0x01, 0x08, 0x02, 0x08, 0x03,
+    0x08, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x01
+  };
+
+  proto = prom_proto_create(p);
+
+  mark_point();
+  res = prom_proto_add_sint(proto, 1, -1);
+  ck_assert_msg(res == 0, "Failed to add sint: %s", strerror(errno));
+
+  res = prom_proto_add_sint(proto, 1, 1);
+  ck_assert_msg(res == 0, "Failed to add sint: %s", strerror(errno));
+
+  res = prom_proto_add_sint(proto, 1, -2);
+  ck_assert_msg(res == 0, "Failed to add sint: %s", strerror(errno));
+
+  res = prom_proto_add_sint(proto, 1, INT64_MIN);
+  ck_assert_msg(res == 0, "Failed to add sint: %s", strerror(errno));
+
+  assert_proto_buf(proto, expected, sizeof(expected));
+  prom_proto_destroy(proto);
+}
+END_TEST
+
+START_TEST (proto_add_double_test) {
+  int res;
+  struct prom_proto *proto;
+  const unsigned char expected[] = {
+    0x11, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xf0, 0x3f
+  };
+
+  mark_point();
+  res = prom_proto_add_double(NULL, 2, 1.0);
+  ck_assert_msg(res < 0, "Failed to handle null proto");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  proto = prom_proto_create(p);
+
+  mark_point();
+  res = prom_proto_add_double(proto, 2, 1.0);
+  ck_assert_msg(res == 0, "Failed to add double: %s", strerror(errno));
+
+  assert_proto_buf(proto, expected, sizeof(expected));
+  prom_proto_destroy(proto);
+}
+END_TEST
+
+START_TEST (proto_add_str_test) {
+  int res;
+  struct prom_proto *proto;
+  const unsigned char expected[] = {
+    0x0a, 0x03, 'f', 'o', 'o', 0x12, 0x00
+  };
+
+  mark_point();
+  res = prom_proto_add_str(NULL, 1, NULL, 0);
+  ck_assert_msg(res < 0, "Failed to handle null proto");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  proto = prom_proto_create(p);
+
+  mark_point();
+  res = prom_proto_add_str(proto, 1, NULL, 3);
+  ck_assert_msg(res < 0, "Failed to handle null string");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  res = prom_proto_add_str(proto, 1, "foo", 3);
+  ck_assert_msg(res == 0, "Failed to add string: %s", strerror(errno));
+
+  res = prom_proto_add_str(proto, 2, "", 0);
+  ck_assert_msg(res == 0, "Failed to add string: %s", strerror(errno));
+
+  assert_proto_buf(proto, expected, sizeof(expected));
+  prom_proto_destroy(proto);
+}
+END_TEST
+
+START_TEST (proto_add_packed_sint_test) {
+  int res;
+  struct prom_proto *proto;
+  const int64_t vals[] = { 1, -1, 64 };
+  const unsigned char expected[] = {
+    0x6a, 0x04, 0x02, 0x01, 0x80, 0x01
+  };
+
+  mark_point();
+  res = prom_proto_add_packed_sint(NULL, 13, vals, 3);
+  ck_assert_msg(res < 0, "Failed to handle null proto");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  proto = prom_proto_create(p);
+
+  mark_point();
+  res = prom_proto_add_packed_sint(proto, 13, NULL, 3);
+  ck_assert_msg(res < 0, "Failed to handle null values");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  res = prom_proto_add_packed_sint(proto, 13, vals, 0);
+  ck_assert_msg(res == 0, "Failed to add no values: %s", strerror(errno));
+  assert_proto_buf(proto, expected, 0);
+
+  mark_point();
+  res = prom_proto_add_packed_sint(proto, 13, vals, 3);
+  ck_assert_msg(res == 0, "Failed to add values: %s", strerror(errno));
+
+  assert_proto_buf(proto, expected, sizeof(expected));
+  prom_proto_destroy(proto);
+}
+END_TEST
+
+START_TEST (proto_add_msg_test) {
+  int res;
+  struct prom_proto *proto, *msg;
+  const unsigned char expected[] = {
+    0x22, 0x02, 0x08, 0x05, 0x22, 0x00
+  };
+
+  proto = prom_proto_create(p);
+  msg = prom_proto_create(p);
+
+  mark_point();
+  res = prom_proto_add_msg(proto, 4, NULL);
+  ck_assert_msg(res < 0, "Failed to handle null message");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  prom_proto_add_varint(msg, 1, 5);
+  res = prom_proto_add_msg(proto, 4, msg);
+  ck_assert_msg(res == 0, "Failed to add message: %s", strerror(errno));
+
+  /* Empty messages are valid too. */
+  prom_proto_reset(msg);
+  res = prom_proto_add_msg(proto, 4, msg);
+  ck_assert_msg(res == 0, "Failed to add message: %s", strerror(errno));
+
+  assert_proto_buf(proto, expected, sizeof(expected));
+  prom_proto_destroy(msg);
+  prom_proto_destroy(proto);
+}
+END_TEST
+
+START_TEST (proto_add_delimited_test) {
+  register unsigned int i;
+  int res;
+  struct prom_proto *proto, *msg;
+  const char *buf;
+  size_t buflen = 0;
+  char str[300];
+
+  proto = prom_proto_create(p);
+  msg = prom_proto_create(p);
+
+  mark_point();
+  res = prom_proto_add_delimited(proto, NULL);
+  ck_assert_msg(res < 0, "Failed to handle null message");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  /* A message larger than the default buffer, with a two-byte length. */
+  memset(str, 'a', sizeof(str));
+  prom_proto_add_str(msg, 1, str, sizeof(str));
+
+  mark_point();
+  for (i = 0; i < 2; i++) {
+    res = prom_proto_add_delimited(proto, msg);
+    ck_assert_msg(res == 0, "Failed to add delimited message: %s",
+      strerror(errno));
+  }
+
+  buf = prom_proto_get_buf(proto, &buflen);
+  ck_assert_msg(buflen == 2 * (2 + 303), "Expected %u bytes, got %lu",
+    2 * (2 + 303), (unsigned long) buflen);
+
+  /* 303 = 0xaf 0x02 as a varint; then the tag, and the string length. */
+  for (i = 0; i < 2; i++) {
+    const unsigned char *ptr;
+
+    ptr = (const unsigned char *) buf + (i * 305);
+    ck_assert_msg(ptr[0] == 0xaf && ptr[1] == 0x02,
+      "Unexpected message length 0x%02x 0x%02x", ptr[0], ptr[1]);
+    ck_assert_msg(ptr[2] == 0x0a && ptr[3] == 0xac && ptr[4] == 0x02,
+      "Unexpected string field 0x%02x 0x%02x 0x%02x", ptr[2], ptr[3], ptr[4]);
+    ck_assert_msg(ptr[304] == 'a', "Unexpected last byte 0x%02x", ptr[304]);
+  }
+
+  prom_proto_destroy(msg);
+  prom_proto_destroy(proto);
+}
+END_TEST
+
+Suite *tests_get_proto_suite(void) {
+  Suite *suite;
+  TCase *testcase;
+
+  suite = suite_create("proto");
+  testcase = tcase_create("base");
+
+  tcase_add_checked_fixture(testcase, set_up, tear_down);
+
+  tcase_add_test(testcase, proto_create_test);
+  tcase_add_test(testcase, proto_get_buf_test);
+  tcase_add_test(testcase, proto_add_varint_test);
+  tcase_add_test(testcase, proto_add_sint_test);
+  tcase_add_test(testcase, proto_add_double_test);
+  tcase_add_test(testcase, proto_add_str_test);
+  tcase_add_test(testcase, proto_add_packed_sint_test);
+  tcase_add_test(testcase, proto_add_msg_test);
+  tcase_add_test(testcase, proto_add_delimited_test);
+
+  suite_add_tcase(suite, testcase);
+  return suite;
+}
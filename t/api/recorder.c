@@ -0,0 +1,377 @@
+/*
+ * ProFTPD - mod_prometheus API testsuite
+ * Copyright (c) 2021-2022 TJ Saunders <tj@castaglia.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+/* Recorder API tests. */
+
+#include "tests.h"
+#include "prometheus/recorder.h"
+#include "prometheus/metric.h"
+
+static pool *p = NULL;
+static const char *test_dir = "/tmp/prt-mod_prometheus-test-recorder";
+static const char *test_trace = "/tmp/prt-mod_prometheus-test-recorder/trace";
+
+static void set_up(void) {
+  if (p == NULL) {
+    p = permanent_pool = make_sub_pool(NULL);
+  }
+
+  (void) tests_rmpath(p, test_dir);
+  (void) tests_mkpath(p, test_dir);
+
+  if (getenv("TEST_VERBOSE") != NULL) {
+    pr_trace_set_levels("prometheus.recorder", 1, 20);
+  }
+
+  prom_db_init(p);
+}
+
+static void tear_down(void) {
+  if (getenv("TEST_VERBOSE") != NULL) {
+    pr_trace_set_levels("prometheus.recorder", 0, 0);
+  }
+
+  prom_db_free();
+  (void) tests_rmpath(p, test_dir);
+
+  if (p != NULL) {
+    destroy_pool(p);
+    p = permanent_pool = NULL;
+  }
+}
+
+START_TEST (recorder_open_test) {
+  int res;
+  struct prom_recorder *recorder;
+
+  mark_point();
+  recorder = prom_recorder_open(NULL, NULL);
+  ck_assert_msg(recorder == NULL, "Failed to handle null pool");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  recorder = prom_recorder_open(p, NULL);
+  ck_assert_msg(recorder == NULL, "Failed to handle null path");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  recorder = prom_recorder_open(p, "/tmp/prt-mod_prometheus-no-such-dir/trace");
+  ck_assert_msg(recorder == NULL, "Failed to handle missing directory");
+  ck_assert_msg(errno == ENOENT, "Expected ENOENT (%d), got %s (%d)", ENOENT,
+    strerror(errno), errno);
+
+  mark_point();
+  res = prom_recorder_close(NULL);
+  ck_assert_msg(res < 0, "Failed to handle null recorder");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  recorder = prom_recorder_open(p, test_trace);
+  ck_assert_msg(recorder != NULL, "Failed to open trace: %s",
+    strerror(errno));
+
+  res = prom_recorder_flush(recorder);
+  ck_assert_msg(res == 0, "Failed to flush trace: %s", strerror(errno));
+
+  res = prom_recorder_close(recorder);
+  ck_assert_msg(res == 0, "Failed to close trace: %s", strerror(errno));
+}
+END_TEST
+
+START_TEST (recorder_add_update_test) {
+  int res;
+  struct prom_dbh *dbh;
+  struct prom_metric *metric;
+  struct prom_recorder *recorder;
+  const char *values[2];
+
+  mark_point();
+  res = prom_recorder_add_update(NULL, 0, NULL, 0, 0.0, NULL, 0);
+  ck_assert_msg(res < 0, "Failed to handle null recorder");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  recorder = prom_recorder_open(p, test_trace);
+  ck_assert_msg(recorder != NULL, "Failed to open trace: %s",
+    strerror(errno));
+
+  mark_point();
+  res = prom_recorder_add_update(recorder, 0, NULL, 0, 0.0, NULL, 0);
+  ck_assert_msg(res < 0, "Failed to handle null metric");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  dbh = prom_metric_init(p, test_dir);
+  ck_assert_msg(dbh != NULL, "Failed to init metrics: %s", strerror(errno));
+
+  metric = prom_metric_create(p, "test", dbh);
+  (void) prom_metric_add_counter(metric, "total", "counter help");
+
+  mark_point();
+  res = prom_recorder_add_update(recorder, PROM_RECORDER_MAX_HANDLES, metric,
+    PROM_RECORDER_OP_INCR, 1.0, NULL, 0);
+  ck_assert_msg(res < 0, "Failed to handle out of range handle");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  res = prom_recorder_add_update(recorder, 0, metric, 0, 1.0, NULL, 0);
+  ck_assert_msg(res < 0, "Failed to handle unknown op");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  res = prom_recorder_add_update(recorder, 0, metric, PROM_RECORDER_OP_INCR,
+    1.0, NULL, 1);
+  ck_assert_msg(res < 0, "Failed to handle null values");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  values[0] = "foo";
+  values[1] = NULL;
+
+  mark_point();
+  res = prom_recorder_add_update(recorder, 0, metric, PROM_RECORDER_OP_INCR,
+    1.0, values, 2);
+  ck_assert_msg(res == 0, "Failed to add update: %s", strerror(errno));
+
+  res = prom_recorder_close(recorder);
+  ck_assert_msg(res == 0, "Failed to close trace: %s", strerror(errno));
+
+  prom_metric_destroy(p, metric);
+  (void) prom_metric_free(p, dbh);
+}
+END_TEST
+
+START_TEST (recorder_add_base_labels_test) {
+  int res;
+  struct prom_recorder *recorder;
+  pr_table_t *labels;
+
+  mark_point();
+  res = prom_recorder_add_base_labels(NULL, NULL);
+  ck_assert_msg(res < 0, "Failed to handle null recorder");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  recorder = prom_recorder_open(p, test_trace);
+  ck_assert_msg(recorder != NULL, "Failed to open trace: %s",
+    strerror(errno));
+
+  labels = pr_table_nalloc(p, 0, 1);
+  (void) pr_table_add(labels, "protocol", "ftp", 0);
+
+  mark_point();
+  res = prom_recorder_add_base_labels(recorder, labels);
+  ck_assert_msg(res == 0, "Failed to add base labels: %s", strerror(errno));
+
+  mark_point();
+  res = prom_recorder_add_base_labels(recorder, NULL);
+  ck_assert_msg(res == 0, "Failed to clear base labels: %s", strerror(errno));
+
+  res = prom_recorder_close(recorder);
+  ck_assert_msg(res == 0, "Failed to close trace: %s", strerror(errno));
+}
+END_TEST
+
+START_TEST (recorder_reader_test) {
+  int res;
+  struct prom_dbh *dbh;
+  struct prom_metric *metric;
+  struct prom_recorder *recorder;
+  struct prom_recorder_reader *reader;
+  struct prom_recorder_record record;
+  pr_table_t *labels;
+  const char *values[2], *def;
+  FILE *fh;
+
+  mark_point();
+  reader = prom_recorder_reader_open(NULL, NULL);
+  ck_assert_msg(reader == NULL, "Failed to handle null pool");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  reader = prom_recorder_reader_open(p, NULL);
+  ck_assert_msg(reader == NULL, "Failed to handle null path");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  reader = prom_recorder_reader_open(p, test_trace);
+  ck_assert_msg(reader == NULL, "Failed to handle missing trace");
+  ck_assert_msg(errno == ENOENT, "Expected ENOENT (%d), got %s (%d)", ENOENT,
+    strerror(errno), errno);
+
+  fh = fopen(test_trace, "w");
+  ck_assert_msg(fh != NULL, "Failed to create '%s': %s", test_trace,
+    strerror(errno));
+  fprintf(fh, "not a trace\n");
+  fclose(fh);
+
+  mark_point();
+  reader = prom_recorder_reader_open(p, test_trace);
+  ck_assert_msg(reader == NULL, "Failed to handle invalid trace");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+  (void) unlink(test_trace);
+
+  dbh = prom_metric_init(p, test_dir);
+  ck_assert_msg(dbh != NULL, "Failed to init metrics: %s", strerror(errno));
+
+  metric = prom_metric_create(p, "test", dbh);
+  (void) prom_metric_add_counter(metric, "total", "counter help");
+  (void) prom_metric_set_label_names(metric, 2, "reason", "method");
+  def = prom_metric_get_definition(p, metric);
+
+  recorder = prom_recorder_open(p, test_trace);
+  ck_assert_msg(recorder != NULL, "Failed to open trace: %s",
+    strerror(errno));
+
+  labels = pr_table_nalloc(p, 0, 1);
+  (void) pr_table_add(labels, "protocol", "ftp", 0);
+  (void) prom_recorder_add_base_labels(recorder, labels);
+
+  values[0] = "foo";
+  values[1] = NULL;
+  (void) prom_recorder_add_update(recorder, 7, metric, PROM_RECORDER_OP_INCR,
+    2.0, values, 2);
+  (void) prom_recorder_add_update(recorder, 7, metric,
+    PROM_RECORDER_OP_OBSERVE, 0.25, NULL, 0);
+
+  res = prom_recorder_close(recorder);
+  ck_assert_msg(res == 0, "Failed to close trace: %s", strerror(errno));
+
+  mark_point();
+  reader = prom_recorder_reader_open(p, test_trace);
+  ck_assert_msg(reader != NULL, "Failed to open trace: %s", strerror(errno));
+
+  mark_point();
+  res = prom_recorder_reader_next(reader, NULL);
+  ck_assert_msg(res < 0, "Failed to handle null record");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  res = prom_recorder_reader_next(reader, &record);
+  ck_assert_msg(res == 1, "Failed to read base labels: %s", strerror(errno));
+  ck_assert_msg(record.type == PROM_RECORDER_RECORD_BASE_LABELS,
+    "Expected base labels record, got %d", record.type);
+  ck_assert_msg(record.timestamp_usecs > 0, "Expected timestamp");
+  ck_assert_msg(record.nvalues == 2, "Expected 2 values, got %u",
+    record.nvalues);
+  ck_assert_msg(strcmp(record.values[0], "protocol") == 0,
+    "Expected 'protocol', got '%s'", record.values[0]);
+  ck_assert_msg(strcmp(record.values[1], "ftp") == 0,
+    "Expected 'ftp', got '%s'", record.values[1]);
+
+  /* The metric's definition precedes its first update. */
+  mark_point();
+  res = prom_recorder_reader_next(reader, &record);
+  ck_assert_msg(res == 1, "Failed to read metric: %s", strerror(errno));
+  ck_assert_msg(record.type == PROM_RECORDER_RECORD_METRIC,
+    "Expected metric record, got %d", record.type);
+  ck_assert_msg(record.handle == 7, "Expected handle 7, got %u",
+    record.handle);
+  ck_assert_msg(strcmp(record.definition, def) == 0,
+    "Expected '%s', got '%s'", def, record.definition);
+
+  mark_point();
+  res = prom_recorder_reader_next(reader, &record);
+  ck_assert_msg(res == 1, "Failed to read update: %s", strerror(errno));
+  ck_assert_msg(record.type == PROM_RECORDER_RECORD_UPDATE,
+    "Expected update record, got %d", record.type);
+  ck_assert_msg(record.handle == 7, "Expected handle 7, got %u",
+    record.handle);
+  ck_assert_msg(record.op == PROM_RECORDER_OP_INCR, "Expected incr, got %d",
+    record.op);
+  ck_assert_msg(record.value == 2.0, "Expected 2.0, got %g", record.value);
+  ck_assert_msg(record.nvalues == 2, "Expected 2 values, got %u",
+    record.nvalues);
+  ck_assert_msg(strcmp(record.values[0], "foo") == 0,
+    "Expected 'foo', got '%s'", record.values[0]);
+  ck_assert_msg(record.values[1] == NULL, "Expected null, got '%s'",
+    record.values[1]);
+
+  mark_point();
+  res = prom_recorder_reader_next(reader, &record);
+  ck_assert_msg(res == 1, "Failed to read update: %s", strerror(errno));
+  ck_assert_msg(record.op == PROM_RECORDER_OP_OBSERVE,
+    "Expected observe, got %d", record.op);
+  ck_assert_msg(record.value == 0.25, "Expected 0.25, got %g", record.value);
+  ck_assert_msg(record.nvalues == 0, "Expected 0 values, got %u",
+    record.nvalues);
+
+  mark_point();
+  res = prom_recorder_reader_next(reader, &record);
+  ck_assert_msg(res == 0, "Expected end of trace, got %d", res);
+
+  res = prom_recorder_reader_close(reader);
+  ck_assert_msg(res == 0, "Failed to close reader: %s", strerror(errno));
+
+  /* A truncated record is an error; the header and the base labels record
+   * take 33 bytes.
+   */
+  res = truncate(test_trace, 38);
+  ck_assert_msg(res == 0, "Failed to truncate trace: %s", strerror(errno));
+
+  reader = prom_recorder_reader_open(p, test_trace);
+  ck_assert_msg(reader != NULL, "Failed to open trace: %s", strerror(errno));
+
+  mark_point();
+  res = prom_recorder_reader_next(reader, &record);
+  ck_assert_msg(res == 1, "Failed to read base labels: %s", strerror(errno));
+
+  res = prom_recorder_reader_next(reader, &record);
+  ck_assert_msg(res < 0, "Failed to handle truncated trace");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  (void) prom_recorder_reader_close(reader);
+
+  prom_metric_destroy(p, metric);
+  (void) prom_metric_free(p, dbh);
+}
+END_TEST
+
+Suite *tests_get_recorder_suite(void) {
+  Suite *suite;
+  TCase *testcase;
+
+  suite = suite_create("recorder");
+  testcase = tcase_create("base");
+
+  tcase_add_checked_fixture(testcase, set_up, tear_down);
+
+  tcase_add_test(testcase, recorder_open_test);
+  tcase_add_test(testcase, recorder_add_update_test);
+  tcase_add_test(testcase, recorder_add_base_labels_test);
+  tcase_add_test(testcase, recorder_reader_test);
+
+  suite_add_tcase(suite, testcase);
+  return suite;
+}
@@ -259,6 +259,101 @@ START_TEST (registry_set_dbh_test) {
 }
 END_TEST
 
+START_TEST (registry_set_shm_test) {
+  int res;
+  struct prom_registry *registry;
+  struct prom_metric_shm *shm;
+
+  mark_point();
+  res = prom_registry_set_shm(NULL, NULL);
+  ck_assert_msg(res < 0, "Failed to handle null registry");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  registry = prom_registry_init(p, "test");
+  ck_assert_msg(registry != NULL, "Failed to create registry: %s",
+    strerror(errno));
+
+  /* A null shm is allowed, and means "use the database". */
+  mark_point();
+  res = prom_registry_set_shm(registry, NULL);
+  ck_assert_msg(res == 0, "Failed to handle null shm: %s", strerror(errno));
+
+  /* For purposes of testing, we don't need a real shm here. */
+  mark_point();
+  shm = palloc(p, 8);
+  res = prom_registry_set_shm(registry, shm);
+  ck_assert_msg(res == 0, "Failed to handle set shm: %s", strerror(errno));
+
+  prom_registry_free(registry);
+}
+END_TEST
+
+START_TEST (registry_set_buffer_test) {
+  int res;
+  struct prom_registry *registry;
+  struct prom_metric_buffer *buffer;
+
+  mark_point();
+  res = prom_registry_set_buffer(NULL, NULL);
+  ck_assert_msg(res < 0, "Failed to handle null registry");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  registry = prom_registry_init(p, "test");
+  ck_assert_msg(registry != NULL, "Failed to create registry: %s",
+    strerror(errno));
+
+  /* A null buffer is allowed, and means "write immediately". */
+  mark_point();
+  res = prom_registry_set_buffer(registry, NULL);
+  ck_assert_msg(res == 0, "Failed to handle null buffer: %s",
+    strerror(errno));
+
+  /* For purposes of testing, we don't need a real buffer here. */
+  mark_point();
+  buffer = palloc(p, 8);
+  res = prom_registry_set_buffer(registry, buffer);
+  ck_assert_msg(res == 0, "Failed to handle set buffer: %s", strerror(errno));
+
+  prom_registry_free(registry);
+}
+END_TEST
+
+START_TEST (registry_set_deferred_test) {
+  int res;
+  struct prom_registry *registry;
+  struct prom_metric_buffer *buffer;
+
+  mark_point();
+  res = prom_registry_set_deferred(NULL, NULL);
+  ck_assert_msg(res < 0, "Failed to handle null registry");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  registry = prom_registry_init(p, "test");
+  ck_assert_msg(registry != NULL, "Failed to create registry: %s",
+    strerror(errno));
+
+  /* A null buffer is allowed, and means "drop busy updates". */
+  mark_point();
+  res = prom_registry_set_deferred(registry, NULL);
+  ck_assert_msg(res == 0, "Failed to handle null buffer: %s",
+    strerror(errno));
+
+  /* For purposes of testing, we don't need a real buffer here. */
+  mark_point();
+  buffer = palloc(p, 8);
+  res = prom_registry_set_deferred(registry, buffer);
+  ck_assert_msg(res == 0, "Failed to handle set buffer: %s", strerror(errno));
+
+  prom_registry_free(registry);
+}
+END_TEST
+
 START_TEST (registry_get_text_test) {
   const char *text;
   struct prom_registry *registry;
@@ -290,6 +385,37 @@ START_TEST (registry_get_text_test) {
 }
 END_TEST
 
+START_TEST (registry_get_openmetrics_test) {
+  const char *text;
+  struct prom_registry *registry;
+
+  mark_point();
+  text = prom_registry_get_openmetrics(NULL, NULL);
+  ck_assert_msg(text == NULL, "Failed to handle null pool");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  text = prom_registry_get_openmetrics(p, NULL);
+  ck_assert_msg(text == NULL, "Failed to handle null registry");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  registry = prom_registry_init(p, "test");
+  ck_assert_msg(registry != NULL, "Failed to create registry: %s",
+    strerror(errno));
+
+  mark_point();
+  text = prom_registry_get_openmetrics(p, registry);
+  ck_assert_msg(text == NULL, "Failed to handle absent metrics");
+  ck_assert_msg(errno == ENOENT, "Expected ENOENT (%d), got %s (%d)", ENOENT,
+    strerror(errno), errno);
+
+  prom_registry_free(registry);
+}
+END_TEST
+
 START_TEST (registry_get_text_with_metrics_test) {
   int res;
   const char *text;
@@ -343,6 +469,82 @@ START_TEST (registry_get_text_with_metrics_test) {
 }
 END_TEST
 
+START_TEST (registry_get_proto_test) {
+  int res;
+  const char *proto;
+  size_t protolen = 0;
+  struct prom_registry *registry;
+  struct prom_metric *metric;
+  struct prom_dbh *dbh;
+  const unsigned char expected[] = {
+    0x2c,
+      0x0a, 0x11, 't', 'e', 's', 't', '_', 'm', 'e', 't', 'r', 'i', 'c', '_',
+        't', 'o', 't', 'a', 'l',
+      0x12, 0x08, 't', 'e', 's', 't', 'i', 'n', 'g', '.',
+      0x18, 0x00,
+      0x22, 0x0b,
+        0x1a, 0x09,
+          0x09, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xf0, 0x3f
+  };
+
+  (void) tests_rmpath(p, test_dir);
+  (void) tests_mkpath(p, test_dir);
+
+  mark_point();
+  proto = prom_registry_get_proto(NULL, NULL, NULL);
+  ck_assert_msg(proto == NULL, "Failed to handle null pool");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  registry = prom_registry_init(p, "test");
+  ck_assert_msg(registry != NULL, "Failed to create registry: %s",
+    strerror(errno));
+
+  mark_point();
+  proto = prom_registry_get_proto(p, registry, NULL);
+  ck_assert_msg(proto == NULL, "Failed to handle null len");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  proto = prom_registry_get_proto(p, registry, &protolen);
+  ck_assert_msg(proto == NULL, "Failed to handle absent metrics");
+  ck_assert_msg(errno == ENOENT, "Expected ENOENT (%d), got %s (%d)", ENOENT,
+    strerror(errno), errno);
+
+  mark_point();
+  dbh = prom_metric_init(p, test_dir);
+  ck_assert_msg(dbh != NULL, "Failed to init metrics: %s", strerror(errno));
+
+  metric = prom_metric_create(p, "metric", dbh);
+  ck_assert_msg(metric != NULL, "Failed to create metric: %s", strerror(errno));
+
+  res = prom_registry_add_metric(registry, metric);
+  ck_assert_msg(res == 0, "Failed to register metric: %s", strerror(errno));
+
+  res = prom_metric_add_counter(metric, "total", "testing");
+  ck_assert_msg(res == 0, "Failed to add counter to metric: %s",
+    strerror(errno));
+
+  res = prom_metric_incr(p, metric, 1, NULL);
+  ck_assert_msg(res == 0, "Failed to increment metric: %s", strerror(errno));
+
+  mark_point();
+  proto = prom_registry_get_proto(p, registry, &protolen);
+  ck_assert_msg(proto != NULL, "Failed to get registry protobuf: %s",
+    strerror(errno));
+  ck_assert_msg(protolen == sizeof(expected), "Expected %lu bytes, got %lu",
+    (unsigned long) sizeof(expected), (unsigned long) protolen);
+  ck_assert_msg(memcmp(proto, expected, protolen) == 0,
+    "Unexpected registry protobuf");
+
+  prom_registry_free(registry);
+  prom_db_close(p, dbh);
+  (void) tests_rmpath(p, test_dir);
+}
+END_TEST
+
 START_TEST (registry_get_text_with_metrics_readonly_test) {
   int res;
   const char *text;
@@ -409,6 +611,263 @@ START_TEST (registry_get_text_with_metrics_readonly_test) {
 }
 END_TEST
 
+START_TEST (registry_get_data_version_test) {
+  int res;
+  int64_t version = 0;
+  struct prom_registry *registry;
+  struct prom_dbh *dbh;
+
+  (void) tests_rmpath(p, test_dir);
+  (void) tests_mkpath(p, test_dir);
+
+  mark_point();
+  res = prom_registry_get_data_version(NULL, NULL, NULL);
+  ck_assert_msg(res < 0, "Failed to handle null pool");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  res = prom_registry_get_data_version(p, NULL, NULL);
+  ck_assert_msg(res < 0, "Failed to handle null registry");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  registry = prom_registry_init(p, "test");
+  ck_assert_msg(registry != NULL, "Failed to create registry: %s",
+    strerror(errno));
+
+  res = prom_registry_get_data_version(p, registry, NULL);
+  ck_assert_msg(res < 0, "Failed to handle null version");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  res = prom_registry_get_data_version(p, registry, &version);
+  ck_assert_msg(res < 0, "Failed to handle registry without dbh");
+  ck_assert_msg(errno == ENOSYS, "Expected ENOSYS (%d), got %s (%d)", ENOSYS,
+    strerror(errno), errno);
+
+  mark_point();
+  dbh = prom_metric_init(p, test_dir);
+  ck_assert_msg(dbh != NULL, "Failed to init metrics: %s", strerror(errno));
+
+  res = prom_registry_set_dbh(registry, dbh);
+  ck_assert_msg(res == 0, "Failed to set registry dbh: %s", strerror(errno));
+
+  mark_point();
+  res = prom_registry_get_data_version(p, registry, &version);
+  ck_assert_msg(res == 0, "Failed to get data version: %s", strerror(errno));
+
+  prom_registry_free(registry);
+  prom_db_close(p, dbh);
+  (void) tests_rmpath(p, test_dir);
+}
+END_TEST
+
+START_TEST (registry_iter_test) {
+  int res;
+  const char *text;
+  size_t textlen = 0;
+  struct prom_registry *registry;
+  struct prom_registry_iter *iter;
+  struct prom_metric *metric;
+  struct prom_dbh *dbh;
+
+  (void) tests_rmpath(p, test_dir);
+  (void) tests_mkpath(p, test_dir);
+
+  mark_point();
+  iter = prom_registry_iter_open(NULL, NULL);
+  ck_assert_msg(iter == NULL, "Failed to handle null pool");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  iter = prom_registry_iter_open(p, NULL);
+  ck_assert_msg(iter == NULL, "Failed to handle null registry");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  res = prom_registry_iter_close(NULL);
+  ck_assert_msg(res < 0, "Failed to handle null iterator");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  registry = prom_registry_init(p, "test");
+  ck_assert_msg(registry != NULL, "Failed to create registry: %s",
+    strerror(errno));
+
+  mark_point();
+  iter = prom_registry_iter_open(p, registry);
+  ck_assert_msg(iter == NULL, "Failed to handle empty registry");
+  ck_assert_msg(errno == ENOENT, "Expected ENOENT (%d), got %s (%d)", ENOENT,
+    strerror(errno), errno);
+
+  mark_point();
+  dbh = prom_metric_init(p, test_dir);
+  ck_assert_msg(dbh != NULL, "Failed to init metrics: %s", strerror(errno));
+
+  mark_point();
+  metric = prom_metric_create(p, "alpha", dbh);
+  ck_assert_msg(metric != NULL, "Failed to create metric: %s", strerror(errno));
+  res = prom_metric_add_counter(metric, "total", "testing");
+  ck_assert_msg(res == 0, "Failed to add counter to metric: %s",
+    strerror(errno));
+  res = prom_registry_add_metric(registry, metric);
+  ck_assert_msg(res == 0, "Failed to register metric: %s", strerror(errno));
+
+  mark_point();
+  metric = prom_metric_create(p, "beta", dbh);
+  ck_assert_msg(metric != NULL, "Failed to create metric: %s", strerror(errno));
+  res = prom_metric_add_gauge(metric, "count", "testing");
+  ck_assert_msg(res == 0, "Failed to add gauge to metric: %s",
+    strerror(errno));
+  res = prom_registry_add_metric(registry, metric);
+  ck_assert_msg(res == 0, "Failed to register metric: %s", strerror(errno));
+
+  res = prom_registry_sort_metrics(registry);
+  ck_assert_msg(res == 0, "Failed to sort metrics: %s", strerror(errno));
+
+  res = prom_registry_set_dbh(registry, dbh);
+  ck_assert_msg(res == 0, "Failed to set registry dbh: %s", strerror(errno));
+
+  mark_point();
+  iter = prom_registry_iter_open(p, registry);
+  ck_assert_msg(iter != NULL, "Failed to open iterator: %s", strerror(errno));
+
+  mark_point();
+  text = prom_registry_iter_next(p, iter, NULL);
+  ck_assert_msg(text == NULL, "Failed to handle null textlen");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  /* Expect one text per metric, in sorted order, then the final newline. */
+  mark_point();
+  text = prom_registry_iter_next(p, iter, &textlen);
+  ck_assert_msg(text != NULL, "Failed to get metric text: %s",
+    strerror(errno));
+  ck_assert_msg(strncmp(text, "# HELP test_alpha_total", 23) == 0,
+    "Expected alpha metric text, got '%s'", text);
+  ck_assert_msg(textlen == strlen(text), "Expected text length %lu, got %lu",
+    (unsigned long) strlen(text), (unsigned long) textlen);
+
+  mark_point();
+  text = prom_registry_iter_next(p, iter, &textlen);
+  ck_assert_msg(text != NULL, "Failed to get metric text: %s",
+    strerror(errno));
+  ck_assert_msg(strncmp(text, "# HELP test_beta_count", 22) == 0,
+    "Expected beta metric text, got '%s'", text);
+
+  mark_point();
+  text = prom_registry_iter_next(p, iter, &textlen);
+  ck_assert_msg(text != NULL, "Failed to get final text: %s",
+    strerror(errno));
+  ck_assert_msg(textlen == 1 && strcmp(text, "\n") == 0,
+    "Expected final newline, got '%s'", text);
+
+  mark_point();
+  text = prom_registry_iter_next(p, iter, &textlen);
+  ck_assert_msg(text == NULL, "Expected end of iteration, got '%s'", text);
+  ck_assert_msg(errno == ENOENT, "Expected ENOENT (%d), got %s (%d)", ENOENT,
+    strerror(errno), errno);
+
+  res = prom_registry_iter_close(iter);
+  ck_assert_msg(res == 0, "Failed to close iterator: %s", strerror(errno));
+
+  mark_point();
+  res = prom_registry_iter_set_format(NULL, PROM_REGISTRY_FORMAT_PROTOBUF);
+  ck_assert_msg(res < 0, "Failed to handle null iterator");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  iter = prom_registry_iter_open(p, registry);
+  ck_assert_msg(iter != NULL, "Failed to open iterator: %s", strerror(errno));
+
+  mark_point();
+  res = prom_registry_iter_set_format(iter, -1);
+  ck_assert_msg(res < 0, "Failed to handle invalid format");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  res = prom_registry_iter_set_format(iter, PROM_REGISTRY_FORMAT_PROTOBUF);
+  ck_assert_msg(res == 0, "Failed to set format: %s", strerror(errno));
+
+  /* Expect one delimited message per metric, and no final newline; the
+   * message starts with its length, then the family name field.
+   */
+  mark_point();
+  text = prom_registry_iter_next(p, iter, &textlen);
+  ck_assert_msg(text != NULL, "Failed to get metric protobuf: %s",
+    strerror(errno));
+  ck_assert_msg(textlen > 20 &&
+    memcmp(text + 1, "\x0a\x10test_alpha_total", 18) == 0,
+    "Expected alpha metric protobuf");
+
+  mark_point();
+  text = prom_registry_iter_next(p, iter, &textlen);
+  ck_assert_msg(text != NULL, "Failed to get metric protobuf: %s",
+    strerror(errno));
+  ck_assert_msg(textlen > 20 &&
+    memcmp(text + 1, "\x0a\x0ftest_beta_count", 17) == 0,
+    "Expected beta metric protobuf");
+
+  mark_point();
+  text = prom_registry_iter_next(p, iter, &textlen);
+  ck_assert_msg(text == NULL, "Expected end of iteration");
+  ck_assert_msg(errno == ENOENT, "Expected ENOENT (%d), got %s (%d)", ENOENT,
+    strerror(errno), errno);
+
+  res = prom_registry_iter_close(iter);
+  ck_assert_msg(res == 0, "Failed to close iterator: %s", strerror(errno));
+
+  iter = prom_registry_iter_open(p, registry);
+  ck_assert_msg(iter != NULL, "Failed to open iterator: %s", strerror(errno));
+
+  res = prom_registry_iter_set_format(iter, PROM_REGISTRY_FORMAT_OPENMETRICS);
+  ck_assert_msg(res == 0, "Failed to set format: %s", strerror(errno));
+
+  /* Expect one text per metric, using the OpenMetrics family names, then
+   * the "# EOF" marker.
+   */
+  mark_point();
+  text = prom_registry_iter_next(p, iter, &textlen);
+  ck_assert_msg(text != NULL, "Failed to get metric text: %s",
+    strerror(errno));
+  ck_assert_msg(strncmp(text, "# HELP test_alpha ", 18) == 0,
+    "Expected alpha metric text, got '%s'", text);
+
+  mark_point();
+  text = prom_registry_iter_next(p, iter, &textlen);
+  ck_assert_msg(text != NULL, "Failed to get metric text: %s",
+    strerror(errno));
+  ck_assert_msg(strncmp(text, "# HELP test_beta_count", 22) == 0,
+    "Expected beta metric text, got '%s'", text);
+
+  mark_point();
+  text = prom_registry_iter_next(p, iter, &textlen);
+  ck_assert_msg(text != NULL, "Failed to get final text: %s",
+    strerror(errno));
+  ck_assert_msg(textlen == 6 && strcmp(text, "# EOF\n") == 0,
+    "Expected EOF marker, got '%s'", text);
+
+  mark_point();
+  text = prom_registry_iter_next(p, iter, &textlen);
+  ck_assert_msg(text == NULL, "Expected end of iteration");
+  ck_assert_msg(errno == ENOENT, "Expected ENOENT (%d), got %s (%d)", ENOENT,
+    strerror(errno), errno);
+
+  res = prom_registry_iter_close(iter);
+  ck_assert_msg(res == 0, "Failed to close iterator: %s", strerror(errno));
+
+  prom_registry_free(registry);
+  prom_db_close(p, dbh);
+  (void) tests_rmpath(p, test_dir);
+}
+END_TEST
+
 Suite *tests_get_registry_suite(void) {
   Suite *suite;
   TCase *testcase;
@@ -425,10 +884,17 @@ Suite *tests_get_registry_suite(void) {
   tcase_add_test(testcase, registry_add_metric_test);
   tcase_add_test(testcase, registry_sort_metrics_test);
   tcase_add_test(testcase, registry_set_dbh_test);
+  tcase_add_test(testcase, registry_set_shm_test);
+  tcase_add_test(testcase, registry_set_buffer_test);
+  tcase_add_test(testcase, registry_set_deferred_test);
 
   tcase_add_test(testcase, registry_get_text_test);
+  tcase_add_test(testcase, registry_get_openmetrics_test);
   tcase_add_test(testcase, registry_get_text_with_metrics_test);
+  tcase_add_test(testcase, registry_get_proto_test);
   tcase_add_test(testcase, registry_get_text_with_metrics_readonly_test);
+  tcase_add_test(testcase, registry_iter_test);
+  tcase_add_test(testcase, registry_get_data_version_test);
 
   suite_add_tcase(suite, testcase);
   return suite;
@@ -0,0 +1,440 @@
+/*
+ * ProFTPD - mod_prometheus API testsuite
+ * Copyright (c) 2021-2022 TJ Saunders <tj@castaglia.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+/* Snapshot API tests. */
+
+#include "tests.h"
+#include "prometheus/snapshot.h"
+#include "prometheus/registry.h"
+#include "prometheus/metric.h"
+#include "prometheus/metric/db.h"
+
+static pool *p = NULL;
+static const char *test_dir = "/tmp/prt-mod_prometheus-test-snapshot";
+
+static void set_up(void) {
+  if (p == NULL) {
+    p = permanent_pool = make_sub_pool(NULL);
+  }
+
+  (void) tests_rmpath(p, test_dir);
+  (void) tests_mkpath(p, test_dir);
+
+  if (getenv("TEST_VERBOSE") != NULL) {
+    pr_trace_set_levels("prometheus.snapshot", 1, 20);
+  }
+}
+
+static void tear_down(void) {
+  if (getenv("TEST_VERBOSE") != NULL) {
+    pr_trace_set_levels("prometheus.snapshot", 0, 0);
+  }
+
+  (void) tests_rmpath(p, test_dir);
+
+  if (p != NULL) {
+    destroy_pool(p);
+    p = permanent_pool = NULL;
+  }
+}
+
+START_TEST (snapshot_init_test) {
+  int res;
+  struct prom_snapshot *snapshot;
+
+  mark_point();
+  snapshot = prom_snapshot_init(NULL, NULL, 0);
+  ck_assert_msg(snapshot == NULL, "Failed to handle null pool");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  snapshot = prom_snapshot_init(p, NULL, 0);
+  ck_assert_msg(snapshot == NULL, "Failed to handle null path");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  snapshot = prom_snapshot_init(p, test_dir, 0);
+  ck_assert_msg(snapshot == NULL, "Failed to handle zero max size");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  snapshot = prom_snapshot_init(p, "/tmp/prt-mod_prometheus-no-such-dir",
+    1024);
+  ck_assert_msg(snapshot == NULL, "Failed to handle nonexistent directory");
+  ck_assert_msg(errno == ENOENT, "Expected ENOENT (%d), got %s (%d)", ENOENT,
+    strerror(errno), errno);
+
+  mark_point();
+  snapshot = prom_snapshot_init(p, test_dir, 1024);
+  ck_assert_msg(snapshot != NULL, "Failed to init snapshot: %s",
+    strerror(errno));
+
+  res = prom_snapshot_close(p, snapshot);
+  ck_assert_msg(res == 0, "Failed to close snapshot: %s", strerror(errno));
+}
+END_TEST
+
+START_TEST (snapshot_close_test) {
+  int res;
+
+  mark_point();
+  res = prom_snapshot_close(NULL, NULL);
+  ck_assert_msg(res < 0, "Failed to handle null pool");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  res = prom_snapshot_close(p, NULL);
+  ck_assert_msg(res < 0, "Failed to handle null snapshot");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+}
+END_TEST
+
+START_TEST (snapshot_set_get_test) {
+  int res;
+  const char *text, *expected;
+  size_t textlen = 0;
+  uint64_t generation = 0;
+  struct prom_snapshot *snapshot;
+
+  mark_point();
+  res = prom_snapshot_set(NULL, NULL, NULL, 0);
+  ck_assert_msg(res < 0, "Failed to handle null pool");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  text = prom_snapshot_get(NULL, NULL, NULL, NULL);
+  ck_assert_msg(text == NULL, "Failed to handle null pool");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  res = prom_snapshot_get_generation(NULL, NULL);
+  ck_assert_msg(res < 0, "Failed to handle null snapshot");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  snapshot = prom_snapshot_init(p, test_dir, 16);
+  ck_assert_msg(snapshot != NULL, "Failed to init snapshot: %s",
+    strerror(errno));
+
+  mark_point();
+  res = prom_snapshot_get_generation(snapshot, &generation);
+  ck_assert_msg(res == 0, "Failed to get generation: %s", strerror(errno));
+  ck_assert_msg(generation == 0, "Expected generation 0, got %llu",
+    (unsigned long long) generation);
+
+  mark_point();
+  text = prom_snapshot_get(p, snapshot, &textlen, &generation);
+  ck_assert_msg(text == NULL, "Failed to handle absent snapshot");
+  ck_assert_msg(errno == ENOENT, "Expected ENOENT (%d), got %s (%d)", ENOENT,
+    strerror(errno), errno);
+
+  mark_point();
+  res = prom_snapshot_set(p, snapshot, "0123456789abcdefX", 17);
+  ck_assert_msg(res < 0, "Failed to handle too-large text");
+  ck_assert_msg(errno == E2BIG, "Expected E2BIG (%d), got %s (%d)", E2BIG,
+    strerror(errno), errno);
+
+  mark_point();
+  expected = "first";
+  res = prom_snapshot_set(p, snapshot, expected, strlen(expected));
+  ck_assert_msg(res == 0, "Failed to set snapshot: %s", strerror(errno));
+
+  text = prom_snapshot_get(p, snapshot, &textlen, &generation);
+  ck_assert_msg(text != NULL, "Failed to get snapshot: %s", strerror(errno));
+  ck_assert_msg(strcmp(text, expected) == 0, "Expected '%s', got '%s'",
+    expected, text);
+  ck_assert_msg(textlen == strlen(expected), "Expected length %lu, got %lu",
+    (unsigned long) strlen(expected), (unsigned long) textlen);
+  ck_assert_msg(generation == 1, "Expected generation 1, got %llu",
+    (unsigned long long) generation);
+
+  mark_point();
+  expected = "second, longer";
+  res = prom_snapshot_set(p, snapshot, expected, strlen(expected));
+  ck_assert_msg(res == 0, "Failed to set snapshot: %s", strerror(errno));
+
+  text = prom_snapshot_get(p, snapshot, &textlen, &generation);
+  ck_assert_msg(text != NULL, "Failed to get snapshot: %s", strerror(errno));
+  ck_assert_msg(strcmp(text, expected) == 0, "Expected '%s', got '%s'",
+    expected, text);
+  ck_assert_msg(generation == 2, "Expected generation 2, got %llu",
+    (unsigned long long) generation);
+
+  res = prom_snapshot_get_generation(snapshot, &generation);
+  ck_assert_msg(res == 0, "Failed to get generation: %s", strerror(errno));
+  ck_assert_msg(generation == 2, "Expected generation 2, got %llu",
+    (unsigned long long) generation);
+
+  /* This snapshot has no protobuf encoding. */
+  mark_point();
+  text = prom_snapshot_get_proto(p, snapshot, &textlen, &generation);
+  ck_assert_msg(text == NULL, "Failed to handle absent protobuf");
+  ck_assert_msg(errno == ENOENT, "Expected ENOENT (%d), got %s (%d)", ENOENT,
+    strerror(errno), errno);
+
+  mark_point();
+  res = prom_snapshot_set_with_proto(p, snapshot, "text", 4, NULL, 4);
+  ck_assert_msg(res < 0, "Failed to handle null protobuf");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  /* The text and protobuf share the maximum size. */
+  mark_point();
+  res = prom_snapshot_set_with_proto(p, snapshot, "0123456789", 10,
+    "\x08\x01\x08\x02\x08\x03\x08", 7);
+  ck_assert_msg(res < 0, "Failed to handle too-large snapshot");
+  ck_assert_msg(errno == E2BIG, "Expected E2BIG (%d), got %s (%d)", E2BIG,
+    strerror(errno), errno);
+
+  mark_point();
+  res = prom_snapshot_set_with_proto(p, snapshot, "third", 5,
+    "\x08\x00\x08", 3);
+  ck_assert_msg(res == 0, "Failed to set snapshot: %s", strerror(errno));
+
+  text = prom_snapshot_get_proto(p, snapshot, &textlen, &generation);
+  ck_assert_msg(text != NULL, "Failed to get snapshot protobuf: %s",
+    strerror(errno));
+  ck_assert_msg(textlen == 3 && memcmp(text, "\x08\x00\x08", 3) == 0,
+    "Unexpected snapshot protobuf");
+  ck_assert_msg(generation == 3, "Expected generation 3, got %llu",
+    (unsigned long long) generation);
+
+  text = prom_snapshot_get(p, snapshot, &textlen, &generation);
+  ck_assert_msg(text != NULL, "Failed to get snapshot: %s", strerror(errno));
+  ck_assert_msg(strcmp(text, "third") == 0, "Expected 'third', got '%s'",
+    text);
+
+  /* This snapshot has no OpenMetrics text. */
+  mark_point();
+  text = prom_snapshot_get_openmetrics(p, snapshot, &textlen, &generation);
+  ck_assert_msg(text == NULL, "Failed to handle absent OpenMetrics text");
+  ck_assert_msg(errno == ENOENT, "Expected ENOENT (%d), got %s (%d)", ENOENT,
+    strerror(errno), errno);
+
+  mark_point();
+  res = prom_snapshot_set_with_openmetrics(p, snapshot, "text", 4, NULL, 0,
+    NULL, 4);
+  ck_assert_msg(res < 0, "Failed to handle null OpenMetrics text");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  /* All three share the maximum size. */
+  mark_point();
+  res = prom_snapshot_set_with_openmetrics(p, snapshot, "012345", 6,
+    "\x08\x01\x08", 3, "# EOF\n# EOF\n", 12);
+  ck_assert_msg(res < 0, "Failed to handle too-large snapshot");
+  ck_assert_msg(errno == E2BIG, "Expected E2BIG (%d), got %s (%d)", E2BIG,
+    strerror(errno), errno);
+
+  mark_point();
+  res = prom_snapshot_set_with_openmetrics(p, snapshot, "om", 2,
+    "\x08\x00", 2, "# EOF\n", 6);
+  ck_assert_msg(res == 0, "Failed to set snapshot: %s", strerror(errno));
+
+  text = prom_snapshot_get_openmetrics(p, snapshot, &textlen, &generation);
+  ck_assert_msg(text != NULL, "Failed to get snapshot OpenMetrics text: %s",
+    strerror(errno));
+  ck_assert_msg(strcmp(text, "# EOF\n") == 0,
+    "Expected '# EOF\\n', got '%s'", text);
+  ck_assert_msg(generation == 4, "Expected generation 4, got %llu",
+    (unsigned long long) generation);
+
+  text = prom_snapshot_get_proto(p, snapshot, &textlen, NULL);
+  ck_assert_msg(text != NULL, "Failed to get snapshot protobuf: %s",
+    strerror(errno));
+  ck_assert_msg(textlen == 2 && memcmp(text, "\x08\x00", 2) == 0,
+    "Unexpected snapshot protobuf");
+
+  res = prom_snapshot_close(p, snapshot);
+  ck_assert_msg(res == 0, "Failed to close snapshot: %s", strerror(errno));
+}
+END_TEST
+
+START_TEST (snapshot_shared_test) {
+  int res, status;
+  const char *text;
+  size_t textlen = 0;
+  uint64_t generation = 0;
+  pid_t pid;
+  struct prom_snapshot *snapshot;
+
+  snapshot = prom_snapshot_init(p, test_dir, 1024);
+  ck_assert_msg(snapshot != NULL, "Failed to init snapshot: %s",
+    strerror(errno));
+
+  /* A child process, inheriting the mapping, publishes the snapshot. */
+  pid = fork();
+  ck_assert_msg(pid >= 0, "Failed to fork: %s", strerror(errno));
+
+  if (pid == 0) {
+    if (prom_snapshot_set(p, snapshot, "from child", 10) < 0) {
+      _exit(1);
+    }
+
+    _exit(0);
+  }
+
+  res = waitpid(pid, &status, 0);
+  ck_assert_msg(res == pid, "Failed to wait for child: %s", strerror(errno));
+  ck_assert_msg(WIFEXITED(status) && WEXITSTATUS(status) == 0,
+    "Child process failed");
+
+  text = prom_snapshot_get(p, snapshot, &textlen, &generation);
+  ck_assert_msg(text != NULL, "Failed to get snapshot: %s", strerror(errno));
+  ck_assert_msg(strcmp(text, "from child") == 0,
+    "Expected 'from child', got '%s'", text);
+  ck_assert_msg(generation == 1, "Expected generation 1, got %llu",
+    (unsigned long long) generation);
+
+  res = prom_snapshot_close(p, snapshot);
+  ck_assert_msg(res == 0, "Failed to close snapshot: %s", strerror(errno));
+}
+END_TEST
+
+START_TEST (snapshot_render_test) {
+  int res;
+  const char *text;
+  size_t textlen = 0;
+  struct prom_snapshot *snapshot;
+  struct prom_registry *registry;
+  struct prom_metric *metric;
+  struct prom_dbh *dbh;
+
+  mark_point();
+  res = prom_snapshot_render(NULL, NULL, NULL);
+  ck_assert_msg(res < 0, "Failed to handle null pool");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  snapshot = prom_snapshot_init(p, test_dir, 4096);
+  ck_assert_msg(snapshot != NULL, "Failed to init snapshot: %s",
+    strerror(errno));
+
+  mark_point();
+  res = prom_snapshot_render(p, snapshot, NULL);
+  ck_assert_msg(res < 0, "Failed to handle null registry");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  registry = prom_registry_init(p, "test");
+  ck_assert_msg(registry != NULL, "Failed to create registry: %s",
+    strerror(errno));
+
+  mark_point();
+  res = prom_snapshot_render(p, snapshot, registry);
+  ck_assert_msg(res < 0, "Failed to handle empty registry");
+  ck_assert_msg(errno == ENOENT, "Expected ENOENT (%d), got %s (%d)", ENOENT,
+    strerror(errno), errno);
+
+  dbh = prom_metric_init(p, test_dir);
+  ck_assert_msg(dbh != NULL, "Failed to init metrics: %s", strerror(errno));
+
+  metric = prom_metric_create(p, "foo", dbh);
+  ck_assert_msg(metric != NULL, "Failed to create metric: %s",
+    strerror(errno));
+  res = prom_metric_add_counter(metric, "total", "testing");
+  ck_assert_msg(res == 0, "Failed to add counter to metric: %s",
+    strerror(errno));
+  res = prom_registry_add_metric(registry, metric);
+  ck_assert_msg(res == 0, "Failed to register metric: %s", strerror(errno));
+
+  res = prom_metric_incr(p, metric, 3, NULL);
+  ck_assert_msg(res == 0, "Failed to increment metric: %s", strerror(errno));
+
+  mark_point();
+  res = prom_snapshot_render(p, snapshot, registry);
+  ck_assert_msg(res == 0, "Failed to render snapshot: %s", strerror(errno));
+
+  text = prom_snapshot_get(p, snapshot, &textlen, NULL);
+  ck_assert_msg(text != NULL, "Failed to get snapshot: %s", strerror(errno));
+  ck_assert_msg(strstr(text, "test_foo_total 3\n") != NULL,
+    "Expected counter sample in '%s'", text);
+  ck_assert_msg(strstr(text,
+    "\n# TYPE test_exporter_snapshot_timestamp_seconds gauge\n") != NULL,
+    "Expected timestamp gauge in '%s'", text);
+  ck_assert_msg(textlen >= 2 && strcmp(text + textlen - 2, "\n\n") == 0,
+    "Expected trailing empty line in '%s'", text);
+
+  /* The protobuf has the counter family, then the timestamp family. */
+  mark_point();
+  text = prom_snapshot_get_proto(p, snapshot, &textlen, NULL);
+  ck_assert_msg(text != NULL, "Failed to get snapshot protobuf: %s",
+    strerror(errno));
+  ck_assert_msg(textlen > 16 &&
+    memcmp(text + 1, "\x0a\x0etest_foo_total", 16) == 0,
+    "Expected counter family first");
+  ck_assert_msg(memcmp(text + text[0] + 1,
+    "\x65\x0a\x28test_exporter_snapshot_timestamp_seconds", 43) == 0,
+    "Expected timestamp family last");
+  ck_assert_msg(textlen == (size_t) text[0] + 2 + 0x65,
+    "Unexpected snapshot protobuf length %lu", (unsigned long) textlen);
+
+  /* The OpenMetrics text has the timestamp gauge before the EOF marker. */
+  mark_point();
+  text = prom_snapshot_get_openmetrics(p, snapshot, &textlen, NULL);
+  ck_assert_msg(text != NULL, "Failed to get snapshot OpenMetrics text: %s",
+    strerror(errno));
+  ck_assert_msg(strstr(text, "test_foo_total 3\n") != NULL,
+    "Expected counter sample in '%s'", text);
+  ck_assert_msg(strstr(text,
+    "\n# UNIT test_exporter_snapshot_timestamp_seconds seconds\n") != NULL,
+    "Expected timestamp gauge in '%s'", text);
+  ck_assert_msg(textlen >= 6 && strcmp(text + textlen - 6, "# EOF\n") == 0,
+    "Expected trailing EOF marker in '%s'", text);
+  ck_assert_msg(strstr(text, "# EOF\n") == text + textlen - 6,
+    "Expected a single EOF marker in '%s'", text);
+
+  prom_registry_free(registry);
+  prom_db_close(p, dbh);
+
+  res = prom_snapshot_close(p, snapshot);
+  ck_assert_msg(res == 0, "Failed to close snapshot: %s", strerror(errno));
+}
+END_TEST
+
+Suite *tests_get_snapshot_suite(void) {
+  Suite *suite;
+  TCase *testcase;
+
+  suite = suite_create("snapshot");
+  testcase = tcase_create("base");
+
+  tcase_add_checked_fixture(testcase, set_up, tear_down);
+
+  tcase_add_test(testcase, snapshot_init_test);
+  tcase_add_test(testcase, snapshot_close_test);
+  tcase_add_test(testcase, snapshot_set_get_test);
+  tcase_add_test(testcase, snapshot_shared_test);
+  tcase_add_test(testcase, snapshot_render_test);
+
+  suite_add_tcase(suite, testcase);
+  return suite;
+}
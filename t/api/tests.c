@@ -33,9 +33,15 @@ static struct testsuite_info suites[] = {
   { "db",		tests_get_db_suite },
   { "http",		tests_get_http_suite },
   { "text",		tests_get_text_suite },
+  { "proto",		tests_get_proto_suite },
   { "metric",		tests_get_metric_suite },
+  { "metric.buffer",	tests_get_metric_buffer_suite },
   { "metric.db",	tests_get_metric_db_suite },
+  { "metric.shm",	tests_get_metric_shm_suite },
+  { "metric.sketch",	tests_get_metric_sketch_suite },
+  { "recorder",		tests_get_recorder_suite },
   { "registry",		tests_get_registry_suite },
+  { "snapshot",		tests_get_snapshot_suite },
 
   { NULL, NULL }
 };
@@ -41,8 +41,14 @@ int tests_rmpath(pool *p, const char *path);
 Suite *tests_get_db_suite(void);
 Suite *tests_get_http_suite(void);
 Suite *tests_get_metric_suite(void);
+Suite *tests_get_metric_buffer_suite(void);
 Suite *tests_get_metric_db_suite(void);
+Suite *tests_get_metric_shm_suite(void);
+Suite *tests_get_metric_sketch_suite(void);
+Suite *tests_get_proto_suite(void);
+Suite *tests_get_recorder_suite(void);
 Suite *tests_get_registry_suite(void);
+Suite *tests_get_snapshot_suite(void);
 Suite *tests_get_text_suite(void);
 
 extern volatile unsigned int recvd_signal_flags;
@@ -27,6 +27,9 @@
 #include "tests.h"
 #include "prometheus/text.h"
 
+#include <float.h>
+#include <math.h>
+
 static pool *p = NULL;
 
 static void set_up(void) {
@@ -176,6 +179,285 @@ START_TEST (text_add_str_test) {
     "Expected '%s', got '%s'", input, str);
 
   prom_text_destroy(text);
+
+  /* Text larger than twice the current buffer size. */
+  mark_point();
+  text = prom_text_create(p);
+  sz = 8192;
+  input = palloc(p, sz + 1);
+  memset(input, 'x', sz);
+  input[sz] = '\0';
+
+  res = prom_text_add_str(text, "a", 1);
+  ck_assert_msg(res == 0, "Failed to handle text: %s", strerror(errno));
+  res = prom_text_add_str(text, input, sz);
+  ck_assert_msg(res == 0, "Failed to handle large text: %s", strerror(errno));
+
+  str = prom_text_get_str(p, text, &sz);
+  ck_assert_msg(str != NULL, "Failed get text: %s", strerror(errno));
+  ck_assert_msg(sz == 8193, "Expected size 8193, got %lu", (unsigned long) sz);
+  ck_assert_msg(str[0] == 'a' && strcmp(str + 1, input) == 0,
+    "Expected large text, got '%.16s...'", str);
+
+  prom_text_destroy(text);
+}
+END_TEST
+
+START_TEST (text_reserve_commit_test) {
+  int res;
+  char *ptr;
+  const char *str;
+  size_t sz;
+  struct prom_text *text;
+
+  mark_point();
+  ptr = prom_text_reserve(NULL, 0);
+  ck_assert_msg(ptr == NULL, "Failed to handle null text");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  res = prom_text_commit(NULL, 0);
+  ck_assert_msg(res < 0, "Failed to handle null text");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  text = prom_text_create(p);
+  ptr = prom_text_reserve(text, 0);
+  ck_assert_msg(ptr == NULL, "Failed to handle zero-length reservation");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  res = prom_text_commit(text, 1);
+  ck_assert_msg(res < 0, "Failed to handle commit without reservation");
+  ck_assert_msg(errno == EPERM, "Expected EPERM (%d), got %s (%d)", EPERM,
+    strerror(errno), errno);
+
+  mark_point();
+  res = prom_text_add_str(text, "foo ", 4);
+  ck_assert_msg(res == 0, "Failed to add text: %s", strerror(errno));
+
+  ptr = prom_text_reserve(text, 32);
+  ck_assert_msg(ptr != NULL, "Failed to reserve text: %s", strerror(errno));
+  sz = snprintf(ptr, 32, "%d", 42);
+
+  res = prom_text_commit(text, 33);
+  ck_assert_msg(res < 0, "Failed to handle commit larger than reservation");
+  ck_assert_msg(errno == EPERM, "Expected EPERM (%d), got %s (%d)", EPERM,
+    strerror(errno), errno);
+
+  res = prom_text_commit(text, sz);
+  ck_assert_msg(res == 0, "Failed to commit text: %s", strerror(errno));
+
+  res = prom_text_add_byte(text, '\n');
+  ck_assert_msg(res == 0, "Failed to add byte: %s", strerror(errno));
+
+  str = prom_text_get_buf(text, &sz);
+  ck_assert_msg(str != NULL, "Failed get text: %s", strerror(errno));
+  ck_assert_msg(sz == 7, "Expected size 7, got %lu", (unsigned long) sz);
+  ck_assert_msg(strcmp(str, "foo 42\n") == 0, "Expected 'foo 42\\n', got '%s'",
+    str);
+
+  /* A reservation larger than the remaining buffer grows it. */
+  mark_point();
+  ptr = prom_text_reserve(text, 4096);
+  ck_assert_msg(ptr != NULL, "Failed to reserve text: %s", strerror(errno));
+  memset(ptr, 'x', 4096);
+  res = prom_text_commit(text, 4096);
+  ck_assert_msg(res == 0, "Failed to commit text: %s", strerror(errno));
+
+  str = prom_text_get_buf(text, &sz);
+  ck_assert_msg(str != NULL, "Failed get text: %s", strerror(errno));
+  ck_assert_msg(sz == 4103, "Expected size 4103, got %lu", (unsigned long) sz);
+  ck_assert_msg(strncmp(str, "foo 42\n", 7) == 0 && str[4102] == 'x' &&
+    str[4103] == '\0', "Unexpected text '%.16s...'", str);
+
+  prom_text_destroy(text);
+}
+END_TEST
+
+START_TEST (text_get_buf_test) {
+  int res;
+  const char *str;
+  size_t sz;
+  struct prom_text *text;
+
+  mark_point();
+  str = prom_text_get_buf(NULL, NULL);
+  ck_assert_msg(str == NULL, "Failed to handle null text");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  text = prom_text_create(p);
+  str = prom_text_get_buf(text, NULL);
+  ck_assert_msg(str == NULL, "Failed to handle absent text");
+  ck_assert_msg(errno == ENOENT, "Expected ENOENT (%d), got %s (%d)", ENOENT,
+    strerror(errno), errno);
+
+  mark_point();
+  res = prom_text_add_str(text, "foobar", 6);
+  ck_assert_msg(res == 0, "Failed to add text: %s", strerror(errno));
+
+  str = prom_text_get_buf(text, &sz);
+  ck_assert_msg(str != NULL, "Failed get text: %s", strerror(errno));
+  ck_assert_msg(sz == 6, "Expected size 6, got %lu", (unsigned long) sz);
+  ck_assert_msg(strcmp(str, "foobar") == 0, "Expected 'foobar', got '%s'",
+    str);
+
+  prom_text_destroy(text);
+}
+END_TEST
+
+START_TEST (text_format_double_test) {
+  register unsigned int i;
+  int res;
+  char buf[PROM_TEXT_DOUBLE_MAX_LEN];
+  uint64_t bits = 88172645463325252ULL;
+  struct {
+    double val;
+    const char *text;
+  } expected[] = {
+    { 0.0,			"0" },
+    { -0.0,			"-0" },
+    { 1.0,			"1" },
+    { -42.0,			"-42" },
+    { 0.1,			"0.1" },
+    { 0.10000000000000001,	"0.1" },
+    { 1.0 / 3.0,		"0.3333333333333333" },
+    { 0.0012345678901234567,	"0.0012345678901234567" },
+    { -2.5,			"-2.5" },
+    { 0.025,			"0.025" },
+    { 0.0001,			"0.0001" },
+    { 0.00001,			"1e-05" },
+    { 107374182400.0,		"107374182400" },
+    { 9007199254740993.0,	"9007199254740992" },
+    { 1e16,			"10000000000000000" },
+    { 1e17,			"1e+17" },
+    { 1e21,			"1e+21" },
+    { 123456789012345678.0,	"1.2345678901234568e+17" },
+    { 5e-324,			"5e-324" },
+    { DBL_MAX,			"1.7976931348623157e+308" },
+    { DBL_MIN,			"2.2250738585072014e-308" },
+    { 0.0, NULL }
+  };
+
+  mark_point();
+  res = prom_text_format_double(NULL, 0, 0.0);
+  ck_assert_msg(res < 0, "Failed to handle null buffer");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  res = prom_text_format_double(buf, 1, 0.0);
+  ck_assert_msg(res < 0, "Failed to handle too-small buffer");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  res = prom_text_format_double(buf, sizeof(buf), NAN);
+  ck_assert_msg(res == 3, "Expected 3, got %d", res);
+  ck_assert_msg(strcmp(buf, "NaN") == 0, "Expected 'NaN', got '%s'", buf);
+
+  res = prom_text_format_double(buf, sizeof(buf), INFINITY);
+  ck_assert_msg(res == 4, "Expected 4, got %d", res);
+  ck_assert_msg(strcmp(buf, "+Inf") == 0, "Expected '+Inf', got '%s'", buf);
+
+  res = prom_text_format_double(buf, sizeof(buf), -INFINITY);
+  ck_assert_msg(res == 4, "Expected 4, got %d", res);
+  ck_assert_msg(strcmp(buf, "-Inf") == 0, "Expected '-Inf', got '%s'", buf);
+
+  for (i = 0; expected[i].text != NULL; i++) {
+    mark_point();
+    res = prom_text_format_double(buf, sizeof(buf), expected[i].val);
+    ck_assert_msg(res == (int) strlen(expected[i].text),
+      "Expected %lu for '%s', got %d", (unsigned long) strlen(expected[i].text),
+      expected[i].text, res);
+    ck_assert_msg(strcmp(buf, expected[i].text) == 0,
+      "Expected '%s', got '%s'", expected[i].text, buf);
+  }
+
+  /* Every finite double must read back as the same value, in no more
+   * characters than "%.17g" uses.  Check a large, reproducible sample of
+   * bit patterns, covering all exponents.
+   */
+  for (i = 0; i < 1000000; i++) {
+    double val;
+    char text[64];
+
+    bits ^= bits << 13;
+    bits ^= bits >> 7;
+    bits ^= bits << 17;
+    memcpy(&val, &bits, sizeof(val));
+
+    if (isnan(val) ||
+        isinf(val)) {
+      continue;
+    }
+
+    res = prom_text_format_double(buf, sizeof(buf), val);
+    ck_assert_msg(res > 0, "Failed to format %a: %s", val, strerror(errno));
+    ck_assert_msg(strtod(buf, NULL) == val,
+      "Value %a formatted as '%s' does not read back", val, buf);
+
+    snprintf(text, sizeof(text), "%.17g", val);
+    ck_assert_msg(res <= (int) strlen(text),
+      "Value %a formatted as '%s', longer than '%s'", val, buf, text);
+  }
+
+  /* And likewise for integral values, and values with few decimal places,
+   * as are typical of samples.
+   */
+  for (i = 0; i < 100000; i++) {
+    double val;
+
+    val = (double) i;
+    res = prom_text_format_double(buf, sizeof(buf), val);
+    ck_assert_msg(strtod(buf, NULL) == val,
+      "Value %a formatted as '%s' does not read back", val, buf);
+
+    val = (double) i / 1000.0;
+    res = prom_text_format_double(buf, sizeof(buf), val);
+    ck_assert_msg(strtod(buf, NULL) == val,
+      "Value %a formatted as '%s' does not read back", val, buf);
+    ck_assert_msg(res <= 7, "Value %a formatted as '%s', not shortest",
+      val, buf);
+  }
+}
+END_TEST
+
+START_TEST (text_add_double_test) {
+  int res;
+  const char *str;
+  size_t sz;
+  struct prom_text *text;
+
+  mark_point();
+  res = prom_text_add_double(NULL, 0.0);
+  ck_assert_msg(res < 0, "Failed to handle null text");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  text = prom_text_create(p);
+  res = prom_text_add_str(text, "foo ", 4);
+  ck_assert_msg(res == 0, "Failed to add text: %s", strerror(errno));
+  res = prom_text_add_double(text, 0.1);
+  ck_assert_msg(res == 0, "Failed to add double: %s", strerror(errno));
+  res = prom_text_add_byte(text, ' ');
+  ck_assert_msg(res == 0, "Failed to add byte: %s", strerror(errno));
+  res = prom_text_add_double(text, 7.0);
+  ck_assert_msg(res == 0, "Failed to add double: %s", strerror(errno));
+
+  str = prom_text_get_buf(text, &sz);
+  ck_assert_msg(str != NULL, "Failed get text: %s", strerror(errno));
+  ck_assert_msg(sz == 9, "Expected size 9, got %lu", (unsigned long) sz);
+  ck_assert_msg(strcmp(str, "foo 0.1 7") == 0, "Expected 'foo 0.1 7', got '%s'",
+    str);
+
+  prom_text_destroy(text);
 }
 END_TEST
 
@@ -240,6 +522,10 @@ Suite *tests_get_text_suite(void) {
   tcase_add_test(testcase, text_get_str_test);
   tcase_add_test(testcase, text_add_byte_test);
   tcase_add_test(testcase, text_add_str_test);
+  tcase_add_test(testcase, text_reserve_commit_test);
+  tcase_add_test(testcase, text_get_buf_test);
+  tcase_add_test(testcase, text_format_double_test);
+  tcase_add_test(testcase, text_add_double_test);
 
   tcase_add_test(testcase, text_from_labels_test);
 
@@ -0,0 +1,166 @@
+/*
+ * ProFTPD - mod_prometheus API benchmarks
+ * Copyright (c) 2021 TJ Saunders
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+#include "bench.h"
+
+struct bench_count {
+  const char *key;
+  uint64_t val;
+};
+
+struct bench_stats {
+  pool *pool;
+  unsigned long ops;
+  uint64_t elapsed_ns;
+
+  uint64_t *latencies;
+  unsigned long nlatencies, max_latencies;
+
+  array_header *counts;
+};
+
+uint64_t bench_now_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t) ts.tv_sec * 1000000000ULL) + (uint64_t) ts.tv_nsec;
+}
+
+struct bench_stats *bench_stats_create(pool *p, unsigned long max_latencies) {
+  struct bench_stats *stats;
+
+  stats = pcalloc(p, sizeof(struct bench_stats));
+  stats->pool = p;
+  if (max_latencies > 0) {
+    stats->latencies = palloc(p, max_latencies * sizeof(uint64_t));
+    stats->max_latencies = max_latencies;
+  }
+
+  return stats;
+}
+
+void bench_stats_add(struct bench_stats *stats, uint64_t latency_ns) {
+  stats->ops++;
+  stats->elapsed_ns += latency_ns;
+
+  if (stats->nlatencies < stats->max_latencies) {
+    stats->latencies[stats->nlatencies++] = latency_ns;
+  }
+}
+
+void bench_stats_add_batch(struct bench_stats *stats, unsigned long ops,
+    uint64_t elapsed_ns) {
+  stats->ops += ops;
+  stats->elapsed_ns += elapsed_ns;
+}
+
+void bench_stats_add_count(struct bench_stats *stats, const char *key,
+    uint64_t val) {
+  register unsigned int i;
+  struct bench_count *counts, *count;
+
+  if (stats->counts == NULL) {
+    stats->counts = make_array(stats->pool, 2, sizeof(struct bench_count));
+  }
+
+  counts = stats->counts->elts;
+  for (i = 0; i < stats->counts->nelts; i++) {
+    if (strcmp(counts[i].key, key) == 0) {
+      counts[i].val += val;
+      return;
+    }
+  }
+
+  count = push_array(stats->counts);
+  count->key = pstrdup(stats->pool, key);
+  count->val = val;
+}
+
+static int latency_cmp(const void *a, const void *b) {
+  uint64_t x, y;
+
+  x = *((const uint64_t *) a);
+  y = *((const uint64_t *) b);
+
+  if (x < y) {
+    return -1;
+  }
+
+  return x > y ? 1 : 0;
+}
+
+static void report_percentile(const char *key, struct bench_stats *stats,
+    double pct) {
+  unsigned long idx;
+
+  if (stats->nlatencies == 0) {
+    fprintf(stdout, ",\"%s\":null", key);
+    return;
+  }
+
+  idx = (unsigned long) (pct * (stats->nlatencies - 1));
+  fprintf(stdout, ",\"%s\":%llu", key,
+    (unsigned long long) stats->latencies[idx]);
+}
+
+void bench_report(const char *suite, const char *name,
+    struct bench_stats *stats) {
+  double ns_per_op = 0.0, ops_per_sec = 0.0;
+
+  if (stats->ops > 0) {
+    ns_per_op = (double) stats->elapsed_ns / stats->ops;
+  }
+
+  if (stats->elapsed_ns > 0) {
+    ops_per_sec = ((double) stats->ops * 1000000000.0) / stats->elapsed_ns;
+  }
+
+  if (stats->nlatencies > 0) {
+    qsort(stats->latencies, stats->nlatencies, sizeof(uint64_t),
+      latency_cmp);
+  }
+
+  fprintf(stdout, "{\"suite\":\"%s\",\"name\":\"%s\",\"ops\":%lu,"
+    "\"elapsed_ns\":%llu,\"ns_per_op\":%.1f,\"ops_per_sec\":%.0f", suite,
+    name, stats->ops, (unsigned long long) stats->elapsed_ns, ns_per_op,
+    ops_per_sec);
+  report_percentile("p50_ns", stats, 0.50);
+  report_percentile("p90_ns", stats, 0.90);
+  report_percentile("p99_ns", stats, 0.99);
+  report_percentile("max_ns", stats, 1.0);
+
+  if (stats->counts != NULL) {
+    register unsigned int i;
+    struct bench_count *counts;
+
+    counts = stats->counts->elts;
+    for (i = 0; i < stats->counts->nelts; i++) {
+      fprintf(stdout, ",\"%s\":%llu", counts[i].key,
+        (unsigned long long) counts[i].val);
+    }
+  }
+
+  fprintf(stdout, "}\n");
+  fflush(stdout);
+}
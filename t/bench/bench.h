@@ -0,0 +1,77 @@
+/*
+ * ProFTPD - mod_prometheus API benchmarks
+ * Copyright (c) 2021 TJ Saunders
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+/* Benchmark management */
+
+#ifndef MOD_PROMETHEUS_BENCH_H
+#define MOD_PROMETHEUS_BENCH_H
+
+#include "mod_prometheus.h"
+
+/* Provided by the API testsuite stubs. */
+int tests_mkpath(pool *p, const char *path);
+int tests_rmpath(pool *p, const char *path);
+
+/* Returns the current monotonic time, in nanoseconds. */
+uint64_t bench_now_ns(void);
+
+/* Collects the timings of a benchmark: the total operations and time, and,
+ * optionally, the latency of each operation, for percentiles.
+ */
+struct bench_stats;
+struct bench_stats *bench_stats_create(pool *p, unsigned long max_latencies);
+
+/* Records one operation, taking the given latency. */
+void bench_stats_add(struct bench_stats *stats, uint64_t latency_ns);
+
+/* Records a batch of operations, taking the given total time, e.g. when the
+ * operations are too quick to time individually.
+ */
+void bench_stats_add_batch(struct bench_stats *stats, unsigned long ops,
+  uint64_t elapsed_ns);
+
+/* Adds the given value to the named count, e.g. of errors, reported along
+ * with the timings.
+ */
+void bench_stats_add_count(struct bench_stats *stats, const char *key,
+  uint64_t val);
+
+/* Reports the collected timings, as a line of JSON on stdout:
+ *
+ *  {"suite":"...","name":"...","ops":N,"elapsed_ns":N,"ns_per_op":N,
+ *   "ops_per_sec":N,"p50_ns":N,"p90_ns":N,"p99_ns":N,"max_ns":N}
+ *
+ * The percentiles are null for batches.  Any counts follow, as "key":N.
+ */
+void bench_report(const char *suite, const char *name,
+  struct bench_stats *stats);
+
+int bench_run_contention(pool *p);
+int bench_run_db(pool *p);
+int bench_run_metric(pool *p);
+int bench_run_registry(pool *p);
+int bench_run_scrape(pool *p);
+int bench_run_text(pool *p);
+
+#endif /* MOD_PROMETHEUS_BENCH_H */
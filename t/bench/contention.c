@@ -0,0 +1,316 @@
+/*
+ * ProFTPD - mod_prometheus API benchmarks
+ * Copyright (c) 2021 TJ Saunders
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+
+/* Write contention benchmarks: forked writers, as session processes, updating
+ * the same metrics database which a reader, as the exporter, is scraping.
+ */
+
+#include "bench.h"
+#include "prometheus/db.h"
+#include "prometheus/metric.h"
+#include "prometheus/metric/db.h"
+#include "prometheus/registry.h"
+
+#include <sys/mman.h>
+
+/* Updates made by each writer, alternating counter increments and histogram
+ * observations.
+ */
+#define BENCH_CONTENTION_WRITE_COUNT		50
+#define BENCH_CONTENTION_MAX_WRITERS		512
+#define BENCH_CONTENTION_SCRAPE_INTERVAL_MS	100
+
+static const char *bench_dir = "/tmp/prt-mod_prometheus-bench-contention";
+
+/* Each writer's results, in memory shared with the reader. */
+struct contention_result {
+  uint64_t busy_errors;
+  uint64_t busy_sleeps;
+  uint64_t failed;
+  unsigned long nlatencies;
+  uint64_t latencies[BENCH_CONTENTION_WRITE_COUNT];
+};
+
+static void run_writer(pool *p, struct prom_registry *registry,
+    unsigned int writer_id, int start_fd, struct contention_result *result) {
+  register unsigned int i;
+  struct prom_dbh *dbh;
+  const struct prom_metric *counter, *histogram;
+  pr_table_t *labels;
+  uint64_t bits;
+  char buf[1];
+
+  /* As a session process does, open our own database handle, rather than
+   * using one inherited across the fork.
+   */
+  dbh = prom_metric_db_reopen(p, bench_dir);
+  if (dbh == NULL) {
+    _exit(1);
+  }
+
+  (void) prom_registry_set_dbh(registry, dbh);
+  counter = prom_registry_get_metric(registry, "writes");
+  histogram = prom_registry_get_metric(registry, "write_duration");
+
+  labels = pr_table_nalloc(p, 0, 1);
+  (void) pr_table_add(labels, "protocol", "ftp", 0);
+
+  bits = 88172645463325252ULL ^ writer_id;
+
+  /* Wait for all of the writers to be forked, and the reader ready. */
+  (void) read(start_fd, buf, sizeof(buf));
+  (void) close(start_fd);
+
+  for (i = 0; i < BENCH_CONTENTION_WRITE_COUNT; i++) {
+    int res;
+    uint64_t start_ns;
+
+    bits ^= bits << 13;
+    bits ^= bits >> 7;
+    bits ^= bits << 17;
+
+    start_ns = bench_now_ns();
+    if (i % 2 == 0) {
+      res = prom_metric_incr(p, counter, 1, labels);
+
+    } else {
+      res = prom_metric_observe(p, histogram,
+        (double) (bits % 100000) / 1000.0, labels);
+    }
+
+    result->latencies[result->nlatencies++] = bench_now_ns() - start_ns;
+    if (res < 0) {
+      result->failed++;
+    }
+  }
+
+  (void) prom_db_get_busy_stats(dbh, &(result->busy_errors),
+    &(result->busy_sleeps));
+  (void) prom_db_close(p, dbh);
+  _exit(0);
+}
+
+/* Creates the metrics written, in a new database, before any forking. */
+static struct prom_registry *create_registry(pool *p) {
+  struct prom_dbh *dbh;
+  struct prom_registry *registry;
+  struct prom_metric *metric;
+
+  dbh = prom_metric_init(p, bench_dir);
+  if (dbh == NULL) {
+    return NULL;
+  }
+
+  registry = prom_registry_init(p, "bench");
+
+  metric = prom_metric_create(p, "writes", dbh);
+  prom_metric_add_counter(metric, "total", "Benchmark writes");
+  (void) prom_registry_add_metric(registry, metric);
+
+  metric = prom_metric_create(p, "write_duration", dbh);
+  prom_metric_add_histogram(metric, "seconds", "Benchmark write durations", 5,
+    (double) 1, (double) 5, (double) 10, (double) 30, (double) 60);
+  (void) prom_registry_add_metric(registry, metric);
+
+  (void) prom_metric_db_close(p, dbh);
+  return registry;
+}
+
+static int bench_writers(pool *p, unsigned int writer_count) {
+  register unsigned int i;
+  int start_fds[2], res = 0, xerrno;
+  unsigned int nwriters = 0;
+  pool *tmp_pool;
+  struct prom_dbh *dbh;
+  struct prom_registry *registry;
+  struct contention_result *results;
+  struct bench_stats *write_stats, *scrape_stats;
+  size_t results_len;
+  char name[64];
+
+  (void) tests_rmpath(p, bench_dir);
+  (void) tests_mkpath(p, bench_dir);
+
+  tmp_pool = make_sub_pool(p);
+
+  registry = create_registry(tmp_pool);
+  if (registry == NULL) {
+    xerrno = errno;
+
+    destroy_pool(tmp_pool);
+    errno = xerrno;
+    return -1;
+  }
+
+  results_len = writer_count * sizeof(struct contention_result);
+  results = mmap(NULL, results_len, PROT_READ|PROT_WRITE,
+    MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+  if (results == MAP_FAILED) {
+    xerrno = errno;
+
+    (void) prom_registry_free(registry);
+    destroy_pool(tmp_pool);
+    errno = xerrno;
+    return -1;
+  }
+
+  memset(results, 0, results_len);
+
+  if (pipe(start_fds) < 0) {
+    xerrno = errno;
+
+    (void) munmap(results, results_len);
+    (void) prom_registry_free(registry);
+    destroy_pool(tmp_pool);
+    errno = xerrno;
+    return -1;
+  }
+
+  for (i = 0; i < writer_count; i++) {
+    pid_t pid;
+
+    pid = fork();
+    if (pid < 0) {
+      xerrno = errno;
+      fprintf(stderr, "Error forking writer #%u: %s\n", i, strerror(xerrno));
+      res = -1;
+      break;
+    }
+
+    if (pid == 0) {
+      (void) close(start_fds[1]);
+      run_writer(tmp_pool, registry, i, start_fds[0], &(results[i]));
+    }
+
+    nwriters++;
+  }
+
+  (void) close(start_fds[0]);
+
+  /* As the exporter does, scrape using a handle of our own. */
+  dbh = prom_metric_db_open(tmp_pool, bench_dir);
+  if (dbh != NULL) {
+    (void) prom_registry_set_dbh(registry, dbh);
+  }
+
+  write_stats = bench_stats_create(tmp_pool,
+    nwriters * BENCH_CONTENTION_WRITE_COUNT);
+
+  /* Start the writers, then scrape until they are all done. */
+  (void) close(start_fds[1]);
+
+  scrape_stats = bench_stats_create(tmp_pool, 1024);
+  while (nwriters > 0) {
+    pid_t pid;
+    int status;
+
+    if (dbh != NULL) {
+      pool *scrape_pool;
+      uint64_t start_ns;
+
+      scrape_pool = make_sub_pool(tmp_pool);
+
+      start_ns = bench_now_ns();
+      if (prom_registry_get_text(scrape_pool, registry) == NULL) {
+        bench_stats_add_count(scrape_stats, "failed", 1);
+      }
+      bench_stats_add(scrape_stats, bench_now_ns() - start_ns);
+
+      destroy_pool(scrape_pool);
+    }
+
+    (void) pr_timer_usleep(BENCH_CONTENTION_SCRAPE_INTERVAL_MS * 1000);
+
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+      nwriters--;
+
+      if (!WIFEXITED(status) ||
+          WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "Writer PID %lu failed\n", (unsigned long) pid);
+        res = -1;
+      }
+    }
+  }
+
+  for (i = 0; i < writer_count; i++) {
+    register unsigned int j;
+
+    for (j = 0; j < results[i].nlatencies; j++) {
+      bench_stats_add(write_stats, results[i].latencies[j]);
+    }
+
+    bench_stats_add_count(write_stats, "sqlite_busy", results[i].busy_errors);
+    bench_stats_add_count(write_stats, "busy_sleeps", results[i].busy_sleeps);
+    bench_stats_add_count(write_stats, "failed", results[i].failed);
+  }
+
+  snprintf(name, sizeof(name)-1, "write.writers_%u", writer_count);
+  bench_report("contention", name, write_stats);
+
+  if (dbh != NULL) {
+    uint64_t busy_errors = 0, busy_sleeps = 0;
+
+    (void) prom_db_get_busy_stats(dbh, &busy_errors, &busy_sleeps);
+    bench_stats_add_count(scrape_stats, "sqlite_busy", busy_errors);
+    bench_stats_add_count(scrape_stats, "busy_sleeps", busy_sleeps);
+
+    snprintf(name, sizeof(name)-1, "scrape.writers_%u", writer_count);
+    bench_report("contention", name, scrape_stats);
+
+    (void) prom_metric_db_close(tmp_pool, dbh);
+  }
+
+  xerrno = errno;
+
+  (void) munmap(results, results_len);
+  (void) prom_registry_free(registry);
+  destroy_pool(tmp_pool);
+  (void) tests_rmpath(p, bench_dir);
+
+  errno = xerrno;
+  return res;
+}
+
+int bench_run_contention(pool *p) {
+  int res = 0;
+  unsigned int writer_count, max_writers = BENCH_CONTENTION_MAX_WRITERS;
+  const char *text;
+
+  /* The largest runs can be capped, e.g. on smaller machines. */
+  text = getenv("PROMETHEUS_BENCH_MAX_WRITERS");
+  if (text != NULL) {
+    max_writers = (unsigned int) strtoul(text, NULL, 10);
+  }
+
+  prom_db_init(p);
+
+  for (writer_count = 1; res == 0 && writer_count <= max_writers;
+       writer_count *= 2) {
+    res = bench_writers(p, writer_count);
+  }
+
+  prom_db_free();
+  return res;
+}
@@ -0,0 +1,79 @@
+/*
+ * ProFTPD - mod_prometheus API benchmarks
+ * Copyright (c) 2021 TJ Saunders
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+#include "bench.h"
+
+struct benchsuite_info {
+  const char *name;
+  int (*run)(pool *p);
+};
+
+static struct benchsuite_info suites[] = {
+  { "contention",	bench_run_contention },
+  { "db",		bench_run_db },
+  { "metric",		bench_run_metric },
+  { "registry",		bench_run_registry },
+  { "scrape",		bench_run_scrape },
+  { "text",		bench_run_text },
+
+  { NULL, NULL }
+};
+
+int main(int argc, char *argv[]) {
+  register unsigned int i;
+  pool *p;
+  const char *requested;
+  int res = 0, found = FALSE;
+
+  p = permanent_pool = make_sub_pool(NULL);
+
+  /* Run just the requested suite, if any, e.g. for comparing builds. */
+  requested = getenv("PROMETHEUS_BENCH_SUITE");
+
+  for (i = 0; suites[i].name != NULL; i++) {
+    if (requested != NULL &&
+        strcmp(requested, suites[i].name) != 0) {
+      continue;
+    }
+
+    found = TRUE;
+    if ((suites[i].run)(p) < 0) {
+      fprintf(stderr, "Error running '%s' benchmarks: %s\n", suites[i].name,
+        strerror(errno));
+      res = -1;
+    }
+  }
+
+  if (found == FALSE) {
+    fprintf(stderr,
+      "No such benchmark suite ('%s') requested via PROMETHEUS_BENCH_SUITE\n",
+      requested);
+    return EXIT_FAILURE;
+  }
+
+  destroy_pool(p);
+  permanent_pool = NULL;
+
+  return res == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
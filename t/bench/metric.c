@@ -0,0 +1,235 @@
+/*
+ * ProFTPD - mod_prometheus API benchmarks
+ * Copyright (c) 2021 TJ Saunders
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+
+/* Metric API benchmarks. */
+
+#include "bench.h"
+#include "prometheus/db.h"
+#include "prometheus/metric.h"
+
+#define BENCH_METRIC_UPDATE_COUNT	20000
+
+static const char *bench_dir = "/tmp/prt-mod_prometheus-bench-metric";
+
+static pr_table_t **get_label_sets(pool *p, unsigned int cardinality,
+    const char ***values) {
+  register unsigned int i;
+  pr_table_t **label_sets;
+
+  label_sets = palloc(p, cardinality * sizeof(pr_table_t *));
+  *values = palloc(p, cardinality * sizeof(const char *));
+
+  for (i = 0; i < cardinality; i++) {
+    char text[32];
+
+    snprintf(text, sizeof(text)-1, "user%u", i);
+    (*values)[i] = pstrdup(p, text);
+
+    label_sets[i] = pr_table_nalloc(p, 0, 2);
+    (void) pr_table_add(label_sets[i], "protocol", "ftp", 0);
+    (void) pr_table_add(label_sets[i], "user", (*values)[i], 0);
+  }
+
+  return label_sets;
+}
+
+/* Counter increments, using label tables and using declared label values,
+ * cycling through the given number of distinct label sets.
+ */
+static int bench_incr(pool *p, struct prom_dbh *dbh,
+    unsigned int cardinality) {
+  register unsigned int i;
+  pool *tmp_pool;
+  struct prom_metric *metric;
+  pr_table_t **label_sets, *base_labels;
+  const char **values;
+  struct bench_stats *stats, *values_stats;
+  char name[64];
+
+  tmp_pool = make_sub_pool(p);
+
+  snprintf(name, sizeof(name)-1, "incr_%u", cardinality);
+  metric = prom_metric_create(tmp_pool, name, dbh);
+  if (metric == NULL) {
+    destroy_pool(tmp_pool);
+    return -1;
+  }
+
+  prom_metric_add_counter(metric, "total", "Benchmark counter");
+  prom_metric_set_label_names(metric, 1, "user");
+
+  base_labels = pr_table_nalloc(tmp_pool, 0, 1);
+  (void) pr_table_add(base_labels, "protocol", "ftp", 0);
+  (void) prom_metric_set_base_labels(tmp_pool, base_labels);
+
+  label_sets = get_label_sets(tmp_pool, cardinality, &values);
+  stats = bench_stats_create(tmp_pool, BENCH_METRIC_UPDATE_COUNT);
+  values_stats = bench_stats_create(tmp_pool, BENCH_METRIC_UPDATE_COUNT);
+
+  for (i = 0; i < BENCH_METRIC_UPDATE_COUNT; i++) {
+    uint64_t start_ns;
+
+    start_ns = bench_now_ns();
+    (void) prom_metric_incr(tmp_pool, metric, 1, label_sets[i % cardinality]);
+    bench_stats_add(stats, bench_now_ns() - start_ns);
+  }
+
+  for (i = 0; i < BENCH_METRIC_UPDATE_COUNT; i++) {
+    uint64_t start_ns;
+
+    start_ns = bench_now_ns();
+    (void) prom_metric_incr_values(tmp_pool, metric, 1,
+      &(values[i % cardinality]));
+    bench_stats_add(values_stats, bench_now_ns() - start_ns);
+  }
+
+  snprintf(name, sizeof(name)-1, "incr.cardinality_%u", cardinality);
+  bench_report("metric", name, stats);
+
+  snprintf(name, sizeof(name)-1, "incr_values.cardinality_%u", cardinality);
+  bench_report("metric", name, values_stats);
+
+  (void) prom_metric_set_base_labels(tmp_pool, NULL);
+  destroy_pool(tmp_pool);
+  return 0;
+}
+
+static int add_histogram(struct prom_metric *metric,
+    unsigned int bucket_count) {
+  const char *help = "Benchmark histogram";
+
+  switch (bucket_count) {
+    case 1:
+      return prom_metric_add_histogram(metric, "seconds", help, 1,
+        (double) 1);
+
+    case 5:
+      return prom_metric_add_histogram(metric, "seconds", help, 5,
+        (double) 1, (double) 5, (double) 10, (double) 30, (double) 60);
+
+    case 10:
+      return prom_metric_add_histogram(metric, "seconds", help, 10,
+        (double) 1, (double) 5, (double) 10, (double) 30, (double) 60,
+        (double) 300, (double) 600, (double) 1800, (double) 3600,
+        (double) 21600);
+
+    case 20:
+      return prom_metric_add_histogram(metric, "seconds", help, 20,
+        (double) 0.01, (double) 0.025, (double) 0.05, (double) 0.1,
+        (double) 0.25, (double) 0.5, (double) 1, (double) 2.5, (double) 5,
+        (double) 10, (double) 30, (double) 60, (double) 120, (double) 300,
+        (double) 600, (double) 1800, (double) 3600, (double) 7200,
+        (double) 21600, (double) 86400);
+
+    default:
+      break;
+  }
+
+  errno = EINVAL;
+  return -1;
+}
+
+/* Histogram observations, for the given number of buckets. */
+static int bench_observe(pool *p, struct prom_dbh *dbh,
+    unsigned int bucket_count) {
+  register unsigned int i;
+  pool *tmp_pool;
+  struct prom_metric *metric;
+  struct bench_stats *stats;
+  uint64_t bits = 88172645463325252ULL;
+  char name[64];
+
+  tmp_pool = make_sub_pool(p);
+
+  snprintf(name, sizeof(name)-1, "observe_%u", bucket_count);
+  metric = prom_metric_create(tmp_pool, name, dbh);
+  if (metric == NULL ||
+      add_histogram(metric, bucket_count) < 0) {
+    destroy_pool(tmp_pool);
+    return -1;
+  }
+
+  stats = bench_stats_create(tmp_pool, BENCH_METRIC_UPDATE_COUNT);
+
+  for (i = 0; i < BENCH_METRIC_UPDATE_COUNT; i++) {
+    double val;
+    uint64_t start_ns;
+
+    bits ^= bits << 13;
+    bits ^= bits >> 7;
+    bits ^= bits << 17;
+    val = (double) (bits % 100000) / 1000.0;
+
+    start_ns = bench_now_ns();
+    (void) prom_metric_observe(tmp_pool, metric, val, NULL);
+    bench_stats_add(stats, bench_now_ns() - start_ns);
+  }
+
+  snprintf(name, sizeof(name)-1, "observe.buckets_%u", bucket_count);
+  bench_report("metric", name, stats);
+
+  destroy_pool(tmp_pool);
+  return 0;
+}
+
+int bench_run_metric(pool *p) {
+  register unsigned int i;
+  int res = 0, xerrno = 0;
+  struct prom_dbh *dbh;
+  unsigned int cardinalities[] = { 1, 10, 100, 1000, 0 };
+  unsigned int bucket_counts[] = { 1, 5, 10, 20, 0 };
+
+  (void) tests_rmpath(p, bench_dir);
+  (void) tests_mkpath(p, bench_dir);
+  prom_db_init(p);
+
+  dbh = prom_metric_init(p, bench_dir);
+  if (dbh == NULL) {
+    xerrno = errno;
+
+    prom_db_free();
+    (void) tests_rmpath(p, bench_dir);
+
+    errno = xerrno;
+    return -1;
+  }
+
+  for (i = 0; res == 0 && cardinalities[i] != 0; i++) {
+    res = bench_incr(p, dbh, cardinalities[i]);
+  }
+
+  for (i = 0; res == 0 && bucket_counts[i] != 0; i++) {
+    res = bench_observe(p, dbh, bucket_counts[i]);
+  }
+
+  xerrno = errno;
+
+  (void) prom_metric_free(p, dbh);
+  prom_db_free();
+  (void) tests_rmpath(p, bench_dir);
+
+  errno = xerrno;
+  return res;
+}
@@ -0,0 +1,151 @@
+/*
+ * ProFTPD - mod_prometheus API benchmarks
+ * Copyright (c) 2021 TJ Saunders
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+
+/* Registry API benchmarks. */
+
+#include "bench.h"
+#include "prometheus/db.h"
+#include "prometheus/metric.h"
+#include "prometheus/registry.h"
+
+#define BENCH_REGISTRY_SCRAPE_COUNT	10
+
+static const char *bench_dir = "/tmp/prt-mod_prometheus-bench-registry";
+
+/* Populates a counter with the given number of series, in one transaction. */
+static int add_series(pool *p, struct prom_dbh *dbh,
+    struct prom_metric *metric, unsigned int series_count) {
+  register unsigned int i;
+  int res = 0;
+
+  if (prom_db_begin_txn(p, dbh, NULL) < 0) {
+    return -1;
+  }
+
+  for (i = 0; res == 0 && i < series_count; i++) {
+    pool *tmp_pool;
+    pr_table_t *labels;
+    char text[32];
+
+    tmp_pool = make_sub_pool(p);
+    labels = pr_table_nalloc(tmp_pool, 0, 1);
+
+    snprintf(text, sizeof(text)-1, "%u", i);
+    (void) pr_table_add(labels, "id", text, 0);
+
+    res = prom_metric_incr(tmp_pool, metric, i, labels);
+    destroy_pool(tmp_pool);
+  }
+
+  if (prom_db_commit_txn(p, dbh, NULL) < 0) {
+    return -1;
+  }
+
+  return res;
+}
+
+/* Scrape rendering, of the given number of series. */
+static int bench_get_text(pool *p, unsigned int series_count) {
+  register unsigned int i;
+  int res, xerrno;
+  pool *tmp_pool;
+  struct prom_dbh *dbh;
+  struct prom_registry *registry;
+  struct prom_metric *metric;
+  struct bench_stats *stats;
+  uint64_t start_ns;
+  char name[64];
+
+  (void) tests_rmpath(p, bench_dir);
+  (void) tests_mkpath(p, bench_dir);
+
+  tmp_pool = make_sub_pool(p);
+
+  dbh = prom_metric_init(tmp_pool, bench_dir);
+  if (dbh == NULL) {
+    xerrno = errno;
+
+    destroy_pool(tmp_pool);
+    errno = xerrno;
+    return -1;
+  }
+
+  registry = prom_registry_init(tmp_pool, "bench");
+  metric = prom_metric_create(tmp_pool, "series", dbh);
+  prom_metric_add_counter(metric, "total", "Benchmark series");
+  (void) prom_registry_add_metric(registry, metric);
+
+  stats = bench_stats_create(tmp_pool, 0);
+  start_ns = bench_now_ns();
+  res = add_series(tmp_pool, dbh, metric, series_count);
+  bench_stats_add_batch(stats, series_count, bench_now_ns() - start_ns);
+
+  if (res == 0) {
+    snprintf(name, sizeof(name)-1, "add_series.series_%u", series_count);
+    bench_report("registry", name, stats);
+
+    stats = bench_stats_create(tmp_pool, BENCH_REGISTRY_SCRAPE_COUNT);
+
+    for (i = 0; i < BENCH_REGISTRY_SCRAPE_COUNT; i++) {
+      pool *scrape_pool;
+
+      scrape_pool = make_sub_pool(tmp_pool);
+
+      start_ns = bench_now_ns();
+      (void) prom_registry_get_text(scrape_pool, registry);
+      bench_stats_add(stats, bench_now_ns() - start_ns);
+
+      destroy_pool(scrape_pool);
+    }
+
+    snprintf(name, sizeof(name)-1, "get_text.series_%u", series_count);
+    bench_report("registry", name, stats);
+  }
+
+  xerrno = errno;
+
+  (void) prom_registry_free(registry);
+  (void) prom_metric_free(tmp_pool, dbh);
+  destroy_pool(tmp_pool);
+  (void) tests_rmpath(p, bench_dir);
+
+  errno = xerrno;
+  return res;
+}
+
+int bench_run_registry(pool *p) {
+  register unsigned int i;
+  int res = 0;
+  unsigned int series_counts[] = { 1000, 10000, 100000, 0 };
+
+  prom_db_init(p);
+
+  for (i = 0; res == 0 && series_counts[i] != 0; i++) {
+    res = bench_get_text(p, series_counts[i]);
+  }
+
+  prom_db_free();
+  return res;
+}
@@ -0,0 +1,465 @@
+/*
+ * ProFTPD - mod_prometheus API benchmarks
+ * Copyright (c) 2021 TJ Saunders
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+
+/* Replays recorded traces (see PrometheusRecordDirectory) of metric updates
+ * against a metrics database, one process per trace, as the sessions which
+ * recorded them made them.
+ */
+
+#include "bench.h"
+#include "prometheus/db.h"
+#include "prometheus/metric.h"
+#include "prometheus/metric/db.h"
+#include "prometheus/recorder.h"
+#include "prometheus/registry.h"
+
+#define REPLAY_DEFAULT_TABLES_DIR	"/tmp/prt-mod_prometheus-replay"
+
+/* Upper bound on the update latencies kept, per trace, for percentiles. */
+#define REPLAY_MAX_LATENCIES		1000000
+
+static const char *tables_dir = REPLAY_DEFAULT_TABLES_DIR;
+
+/* Replay speed, relative to the recorded times; zero means as fast as
+ * possible.
+ */
+static double replay_speed = 0.0;
+
+/* Milliseconds between scrapes made while replaying; zero means none. */
+static unsigned long scrape_interval_ms = 0;
+
+/* The earliest recorded time, across all traces, to which the others are
+ * relative.
+ */
+static uint64_t replay_start_usecs = 0;
+
+static void usage(const char *progname) {
+  fprintf(stderr, "usage: %s [-d tables-dir] [-s speed] [-i scrape-ms] "
+    "trace ...\n", progname);
+  fprintf(stderr,
+    "  -d  metrics database directory (default %s)\n"
+    "  -s  replay speed, e.g. 1 for the recorded speed, 10 for ten times "
+    "faster;\n"
+    "      0 (the default) replays as fast as possible\n"
+    "  -i  milliseconds between scrapes while replaying (default none)\n",
+    REPLAY_DEFAULT_TABLES_DIR);
+}
+
+/* Returns the metric name, from the given definition. */
+static const char *definition_name(pool *p, const char *definition) {
+  const char *ptr;
+
+  if (strncmp(definition, "metric\t", 7) != 0) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  definition += 7;
+  ptr = strchr(definition, '\n');
+  if (ptr == NULL) {
+    return pstrdup(p, definition);
+  }
+
+  return pstrndup(p, definition, ptr - definition);
+}
+
+/* Creates the metrics defined in the given trace, if not already created
+ * for another trace, and notes its earliest recorded time.
+ */
+static int scan_trace(pool *p, struct prom_dbh *dbh,
+    struct prom_registry *registry, const char *path) {
+  int res;
+  struct prom_recorder_reader *reader;
+  struct prom_recorder_record record;
+
+  reader = prom_recorder_reader_open(p, path);
+  if (reader == NULL) {
+    return -1;
+  }
+
+  while ((res = prom_recorder_reader_next(reader, &record)) > 0) {
+    const char *name;
+    struct prom_metric *metric;
+
+    if (record.type != PROM_RECORDER_RECORD_METRIC) {
+      if (record.timestamp_usecs > 0 &&
+          (replay_start_usecs == 0 ||
+           record.timestamp_usecs < replay_start_usecs)) {
+        replay_start_usecs = record.timestamp_usecs;
+      }
+
+      continue;
+    }
+
+    name = definition_name(p, record.definition);
+    if (name == NULL ||
+        prom_registry_get_metric(registry, name) != NULL) {
+      continue;
+    }
+
+    metric = prom_metric_create_from_definition(p, record.definition, dbh);
+    if (metric == NULL) {
+      fprintf(stderr, "%s: error creating '%s' metric: %s\n", path, name,
+        strerror(errno));
+      res = -1;
+      break;
+    }
+
+    (void) prom_registry_add_metric(registry, metric);
+  }
+
+  (void) prom_recorder_reader_close(reader);
+  return res;
+}
+
+/* Waits until the given recorded time, at the replay speed. */
+static void replay_wait(uint64_t start_ns, uint64_t timestamp_usecs) {
+  uint64_t target_ns, now_ns;
+
+  if (replay_speed <= 0.0 ||
+      timestamp_usecs < replay_start_usecs) {
+    return;
+  }
+
+  target_ns = start_ns + (uint64_t) (((timestamp_usecs - replay_start_usecs) *
+    1000.0) / replay_speed);
+
+  now_ns = bench_now_ns();
+  if (now_ns < target_ns) {
+    (void) pr_timer_usleep((target_ns - now_ns) / 1000);
+  }
+}
+
+static int replay_update(pool *p, const struct prom_metric *metric,
+    struct prom_recorder_record *record) {
+  const char **values = NULL;
+
+  if (record->nvalues > 0) {
+    values = record->values;
+  }
+
+  switch (record->op) {
+    case PROM_RECORDER_OP_DECR:
+      return prom_metric_decr_values(p, metric, (uint32_t) record->value,
+        values);
+
+    case PROM_RECORDER_OP_INCR:
+      return prom_metric_incr_values(p, metric, (uint32_t) record->value,
+        values);
+
+    case PROM_RECORDER_OP_INCR_COUNTER:
+      return prom_metric_incr_type_values(p, metric, (uint32_t) record->value,
+        values, PROM_METRIC_TYPE_COUNTER);
+
+    case PROM_RECORDER_OP_INCR_GAUGE:
+      return prom_metric_incr_type_values(p, metric, (uint32_t) record->value,
+        values, PROM_METRIC_TYPE_GAUGE);
+
+    case PROM_RECORDER_OP_OBSERVE:
+      return prom_metric_observe_values(p, metric, record->value, values);
+
+    default:
+      break;
+  }
+
+  errno = EINVAL;
+  return -1;
+}
+
+static void replay_trace(pool *p, struct prom_registry *registry,
+    const char *path, uint64_t start_ns) {
+  int res;
+  pool *tmp_pool;
+  struct prom_dbh *dbh;
+  struct prom_recorder_reader *reader;
+  struct prom_recorder_record record;
+  const struct prom_metric *metrics[PROM_RECORDER_MAX_HANDLES];
+  struct bench_stats *stats;
+  uint64_t busy_errors = 0, busy_sleeps = 0;
+  const char *name;
+
+  /* As a session process does, open our own database handle, rather than
+   * using one inherited across the fork.
+   */
+  dbh = prom_metric_db_reopen(p, tables_dir);
+  if (dbh == NULL) {
+    fprintf(stderr, "%s: error opening database: %s\n", path,
+      strerror(errno));
+    _exit(1);
+  }
+
+  (void) prom_registry_set_dbh(registry, dbh);
+
+  reader = prom_recorder_reader_open(p, path);
+  if (reader == NULL) {
+    fprintf(stderr, "%s: error opening trace: %s\n", path, strerror(errno));
+    _exit(1);
+  }
+
+  memset(metrics, 0, sizeof(metrics));
+  stats = bench_stats_create(p, REPLAY_MAX_LATENCIES);
+  tmp_pool = make_sub_pool(p);
+
+  while ((res = prom_recorder_reader_next(reader, &record)) > 0) {
+    uint64_t update_ns;
+
+    switch (record.type) {
+      case PROM_RECORDER_RECORD_METRIC:
+        name = definition_name(tmp_pool, record.definition);
+        if (name != NULL &&
+            record.handle < PROM_RECORDER_MAX_HANDLES) {
+          metrics[record.handle] = prom_registry_get_metric(registry, name);
+        }
+        break;
+
+      case PROM_RECORDER_RECORD_BASE_LABELS: {
+        register unsigned int i;
+        pr_table_t *labels = NULL;
+
+        if (record.nvalues > 0) {
+          labels = pr_table_nalloc(tmp_pool, 0, record.nvalues / 2);
+          for (i = 0; i + 1 < record.nvalues; i += 2) {
+            (void) pr_table_add_dup(labels, record.values[i],
+              record.values[i+1], 0);
+          }
+        }
+
+        (void) prom_metric_set_base_labels(p, labels);
+        break;
+      }
+
+      case PROM_RECORDER_RECORD_UPDATE:
+        if (record.handle >= PROM_RECORDER_MAX_HANDLES ||
+            metrics[record.handle] == NULL) {
+          bench_stats_add_count(stats, "unknown_metric", 1);
+          break;
+        }
+
+        replay_wait(start_ns, record.timestamp_usecs);
+
+        update_ns = bench_now_ns();
+        if (replay_update(tmp_pool, metrics[record.handle], &record) < 0) {
+          bench_stats_add_count(stats, "failed", 1);
+        }
+        bench_stats_add(stats, bench_now_ns() - update_ns);
+        break;
+    }
+
+    /* Label sets, error messages et al are allocated from this pool. */
+    destroy_pool(tmp_pool);
+    tmp_pool = make_sub_pool(p);
+  }
+
+  if (res < 0) {
+    fprintf(stderr, "%s: error reading trace: %s\n", path, strerror(errno));
+  }
+
+  (void) prom_db_get_busy_stats(dbh, &busy_errors, &busy_sleeps);
+  bench_stats_add_count(stats, "sqlite_busy", busy_errors);
+  bench_stats_add_count(stats, "busy_sleeps", busy_sleeps);
+
+  name = strrchr(path, '/');
+  bench_report("replay", name != NULL ? name + 1 : path, stats);
+
+  destroy_pool(tmp_pool);
+  (void) prom_recorder_reader_close(reader);
+  (void) prom_db_close(p, dbh);
+  _exit(res < 0 ? 1 : 0);
+}
+
+static void scrape(pool *p, struct prom_registry *registry,
+    struct bench_stats *stats) {
+  pool *scrape_pool;
+  uint64_t start_ns;
+
+  scrape_pool = make_sub_pool(p);
+
+  start_ns = bench_now_ns();
+  if (prom_registry_get_text(scrape_pool, registry) == NULL) {
+    bench_stats_add_count(stats, "failed", 1);
+  }
+  bench_stats_add(stats, bench_now_ns() - start_ns);
+
+  destroy_pool(scrape_pool);
+}
+
+int main(int argc, char *argv[]) {
+  register int i;
+  int c, res = 0, ntraces;
+  unsigned int nreplayers = 0;
+  pool *p;
+  struct prom_dbh *dbh;
+  struct prom_registry *registry;
+  struct bench_stats *scrape_stats;
+  uint64_t start_ns;
+
+  while ((c = getopt(argc, argv, "d:i:s:")) != -1) {
+    switch (c) {
+      case 'd':
+        tables_dir = optarg;
+        break;
+
+      case 'i':
+        scrape_interval_ms = strtoul(optarg, NULL, 10);
+        break;
+
+      case 's':
+        replay_speed = strtod(optarg, NULL);
+        break;
+
+      default:
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+  }
+
+  ntraces = argc - optind;
+  if (ntraces <= 0) {
+    usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  p = permanent_pool = make_sub_pool(NULL);
+
+  if (strcmp(tables_dir, REPLAY_DEFAULT_TABLES_DIR) == 0) {
+    (void) tests_rmpath(p, tables_dir);
+  }
+  (void) tests_mkpath(p, tables_dir);
+
+  prom_db_init(p);
+
+  /* Create all of the traces' metrics before forking, as the daemon does
+   * before forking its sessions.
+   */
+  dbh = prom_metric_init(p, tables_dir);
+  if (dbh == NULL) {
+    fprintf(stderr, "Error opening '%s' database: %s\n", tables_dir,
+      strerror(errno));
+    return EXIT_FAILURE;
+  }
+
+  registry = prom_registry_init(p, "proftpd");
+
+  for (i = optind; i < argc; i++) {
+    if (scan_trace(p, dbh, registry, argv[i]) < 0) {
+      fprintf(stderr, "Error reading trace '%s': %s\n", argv[i],
+        strerror(errno));
+      return EXIT_FAILURE;
+    }
+  }
+
+  (void) prom_registry_sort_metrics(registry);
+  (void) prom_metric_db_close(p, dbh);
+
+  fflush(stdout);
+  start_ns = bench_now_ns();
+
+  for (i = optind; i < argc; i++) {
+    pid_t pid;
+
+    pid = fork();
+    if (pid < 0) {
+      fprintf(stderr, "Error forking replayer for '%s': %s\n", argv[i],
+        strerror(errno));
+      res = -1;
+      break;
+    }
+
+    if (pid == 0) {
+      replay_trace(p, registry, argv[i], start_ns);
+    }
+
+    nreplayers++;
+  }
+
+  /* As the exporter does, scrape using a handle of our own. */
+  dbh = prom_metric_db_open(p, tables_dir);
+  if (dbh == NULL) {
+    fprintf(stderr, "Error opening '%s' database: %s\n", tables_dir,
+      strerror(errno));
+    res = -1;
+
+  } else {
+    (void) prom_registry_set_dbh(registry, dbh);
+  }
+
+  scrape_stats = bench_stats_create(p, REPLAY_MAX_LATENCIES);
+
+  while (nreplayers > 0) {
+    pid_t pid;
+    int status;
+
+    if (scrape_interval_ms > 0) {
+      if (dbh != NULL) {
+        scrape(p, registry, scrape_stats);
+      }
+
+      (void) pr_timer_usleep(scrape_interval_ms * 1000);
+      pid = waitpid(-1, &status, WNOHANG);
+
+    } else {
+      pid = waitpid(-1, &status, 0);
+    }
+
+    if (pid < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      break;
+    }
+
+    while (pid > 0) {
+      nreplayers--;
+
+      if (!WIFEXITED(status) ||
+          WEXITSTATUS(status) != 0) {
+        res = -1;
+      }
+
+      pid = waitpid(-1, &status, WNOHANG);
+    }
+  }
+
+  /* The final state, as scraped once all of the updates are done. */
+  if (dbh != NULL) {
+    scrape(p, registry, scrape_stats);
+    bench_report("replay", "scrape", scrape_stats);
+
+    (void) prom_metric_db_close(p, dbh);
+  }
+
+  (void) prom_registry_free(registry);
+  prom_db_free();
+
+  if (strcmp(tables_dir, REPLAY_DEFAULT_TABLES_DIR) == 0) {
+    (void) tests_rmpath(p, tables_dir);
+  }
+
+  destroy_pool(p);
+  permanent_pool = NULL;
+
+  return res == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
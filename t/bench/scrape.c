@@ -0,0 +1,481 @@
+/*
+ * ProFTPD - mod_prometheus API benchmarks
+ * Copyright (c) 2021 TJ Saunders
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+
+/* Scrape throughput benchmarks: forked exporter workers, sharing the listening
+ * address as PrometheusExporterWorkers does, serving concurrent scrapers,
+ * while a session process keeps changing the metrics (so that scrapes are
+ * rendered, rather than served from the response cache).  Throughput should
+ * grow with the worker count, up to the number of cores.
+ */
+
+#include "bench.h"
+#include "prometheus/db.h"
+#include "prometheus/http.h"
+#include "prometheus/metric.h"
+#include "prometheus/metric/db.h"
+#include "prometheus/registry.h"
+
+#include <signal.h>
+#include <sys/mman.h>
+
+#define BENCH_SCRAPE_SERIES_COUNT	10000
+#define BENCH_SCRAPE_DURATION_MS	2000
+#define BENCH_SCRAPE_MAX_LATENCIES	8192
+#define BENCH_SCRAPE_MAX_WORKERS	16
+#define BENCH_SCRAPE_SCRAPERS		16
+#define BENCH_SCRAPE_PORT		19273
+
+static const char *bench_dir = "/tmp/prt-mod_prometheus-bench-scrape";
+
+/* Each scraper's results, in memory shared with the parent. */
+struct scrape_result {
+  uint64_t failed;
+  uint64_t bytes;
+  unsigned long nlatencies;
+  uint64_t latencies[BENCH_SCRAPE_MAX_LATENCIES];
+};
+
+/* Populates a counter with the given number of series, in one transaction. */
+static int add_series(pool *p, struct prom_dbh *dbh,
+    struct prom_metric *metric, unsigned int series_count) {
+  register unsigned int i;
+  int res = 0;
+
+  if (prom_db_begin_txn(p, dbh, NULL) < 0) {
+    return -1;
+  }
+
+  for (i = 0; res == 0 && i < series_count; i++) {
+    pool *tmp_pool;
+    pr_table_t *labels;
+    char text[32];
+
+    tmp_pool = make_sub_pool(p);
+    labels = pr_table_nalloc(tmp_pool, 0, 1);
+
+    snprintf(text, sizeof(text)-1, "%u", i);
+    (void) pr_table_add(labels, "id", text, 0);
+
+    res = prom_metric_incr(tmp_pool, metric, 1, labels);
+    destroy_pool(tmp_pool);
+  }
+
+  if (prom_db_commit_txn(p, dbh, NULL) < 0) {
+    return -1;
+  }
+
+  return res;
+}
+
+/* Creates the metrics scraped, in a new database, before any forking. */
+static struct prom_registry *create_registry(pool *p) {
+  int res;
+  struct prom_dbh *dbh;
+  struct prom_registry *registry;
+  struct prom_metric *metric;
+
+  dbh = prom_metric_init(p, bench_dir);
+  if (dbh == NULL) {
+    return NULL;
+  }
+
+  registry = prom_registry_init(p, "bench");
+
+  metric = prom_metric_create(p, "series", dbh);
+  prom_metric_add_counter(metric, "total", "Benchmark series");
+  (void) prom_registry_add_metric(registry, metric);
+
+  res = add_series(p, dbh, metric, BENCH_SCRAPE_SERIES_COUNT);
+
+  metric = prom_metric_create(p, "writes", dbh);
+  prom_metric_add_counter(metric, "total", "Benchmark writes");
+  (void) prom_registry_add_metric(registry, metric);
+
+  (void) prom_metric_db_close(p, dbh);
+
+  if (res < 0) {
+    (void) prom_registry_free(registry);
+    return NULL;
+  }
+
+  return registry;
+}
+
+/* As the exporter does, serve scrapes using a handle of our own, until
+ * killed.
+ */
+static void run_worker(pool *p, struct prom_registry *registry,
+    const pr_netaddr_t *addr, unsigned int max_conns, int ready_fd) {
+  struct prom_dbh *dbh;
+  struct prom_http *http;
+
+  dbh = prom_metric_db_open(p, bench_dir);
+  if (dbh == NULL) {
+    _exit(1);
+  }
+
+  (void) prom_registry_set_dbh(registry, dbh);
+
+  http = prom_http_start(p, addr, registry, NULL, NULL, max_conns,
+    PROM_HTTP_FL_SHARED_ADDR);
+  if (http == NULL) {
+    fprintf(stderr, "Error starting exporter worker: %s\n", strerror(errno));
+    _exit(1);
+  }
+
+  (void) write(ready_fd, "", 1);
+  (void) close(ready_fd);
+
+  (void) prom_http_run_loop(p, http);
+  _exit(0);
+}
+
+/* As a session does, keep updating a metric, until killed. */
+static void run_writer(pool *p, struct prom_registry *registry) {
+  struct prom_dbh *dbh;
+  const struct prom_metric *metric;
+
+  dbh = prom_metric_db_reopen(p, bench_dir);
+  if (dbh == NULL) {
+    _exit(1);
+  }
+
+  (void) prom_registry_set_dbh(registry, dbh);
+  metric = prom_registry_get_metric(registry, "writes");
+
+  while (TRUE) {
+    (void) prom_metric_incr(p, metric, 1, NULL);
+    (void) pr_timer_usleep(1000);
+  }
+}
+
+/* Performs one scrape, as a new connection; returns the response length. */
+static ssize_t scrape(const struct sockaddr_in *sin) {
+  int fd, ok = FALSE;
+  ssize_t total = 0;
+  const char *req;
+  char buf[65536];
+
+  fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0) {
+    return -1;
+  }
+
+  if (connect(fd, (const struct sockaddr *) sin, sizeof(*sin)) < 0) {
+    (void) close(fd);
+    return -1;
+  }
+
+  req = "GET /metrics HTTP/1.1\r\n"
+    "Host: 127.0.0.1\r\n"
+    "Connection: close\r\n"
+    "\r\n";
+  if (write(fd, req, strlen(req)) != (ssize_t) strlen(req)) {
+    (void) close(fd);
+    return -1;
+  }
+
+  while (TRUE) {
+    ssize_t len;
+
+    len = read(fd, buf, sizeof(buf));
+    if (len <= 0) {
+      break;
+    }
+
+    if (total == 0 &&
+        len >= 12 &&
+        strncmp(buf + 8, " 200", 4) == 0) {
+      ok = TRUE;
+    }
+
+    total += len;
+  }
+
+  (void) close(fd);
+  return ok == TRUE ? total : -1;
+}
+
+static void run_scraper(unsigned int port, int start_fd,
+    struct scrape_result *result) {
+  struct sockaddr_in sin;
+  uint64_t deadline_ns;
+  char buf[1];
+
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_port = htons(port);
+  sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  /* Wait for all of the scrapers to be forked. */
+  (void) read(start_fd, buf, sizeof(buf));
+  (void) close(start_fd);
+
+  deadline_ns = bench_now_ns() + (BENCH_SCRAPE_DURATION_MS * 1000000ULL);
+  while (bench_now_ns() < deadline_ns) {
+    ssize_t len;
+    uint64_t start_ns;
+
+    start_ns = bench_now_ns();
+    len = scrape(&sin);
+    if (len < 0) {
+      result->failed++;
+      continue;
+    }
+
+    result->bytes += len;
+    if (result->nlatencies < BENCH_SCRAPE_MAX_LATENCIES) {
+      result->latencies[result->nlatencies++] = bench_now_ns() - start_ns;
+    }
+  }
+
+  _exit(0);
+}
+
+static void stop_procs(pid_t *pids, unsigned int count) {
+  register unsigned int i;
+
+  for (i = 0; i < count; i++) {
+    int status;
+
+    (void) kill(pids[i], SIGTERM);
+    (void) waitpid(pids[i], &status, 0);
+  }
+}
+
+static int bench_workers(pool *p, unsigned int worker_count,
+    unsigned int scraper_count, unsigned int port) {
+  register unsigned int i;
+  int ready_fds[2], start_fds[2], res = 0, xerrno = 0;
+  unsigned int nworkers = 0, nscrapers = 0;
+  pool *tmp_pool;
+  pid_t writer_pid, *worker_pids;
+  pr_netaddr_t *addr;
+  struct prom_registry *registry;
+  struct scrape_result *results;
+  struct bench_stats *scrape_stats, *throughput_stats;
+  size_t results_len;
+  uint64_t start_ns, elapsed_ns;
+  char name[64];
+
+  (void) tests_rmpath(p, bench_dir);
+  (void) tests_mkpath(p, bench_dir);
+
+  tmp_pool = make_sub_pool(p);
+
+  registry = create_registry(tmp_pool);
+  if (registry == NULL) {
+    xerrno = errno;
+
+    destroy_pool(tmp_pool);
+    errno = xerrno;
+    return -1;
+  }
+
+  results_len = scraper_count * sizeof(struct scrape_result);
+  results = mmap(NULL, results_len, PROT_READ|PROT_WRITE,
+    MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+  if (results == MAP_FAILED) {
+    xerrno = errno;
+
+    (void) prom_registry_free(registry);
+    destroy_pool(tmp_pool);
+    errno = xerrno;
+    return -1;
+  }
+
+  memset(results, 0, results_len);
+
+  if (pipe(ready_fds) < 0) {
+    xerrno = errno;
+
+    (void) munmap(results, results_len);
+    (void) prom_registry_free(registry);
+    destroy_pool(tmp_pool);
+    errno = xerrno;
+    return -1;
+  }
+
+  addr = (pr_netaddr_t *) pr_netaddr_get_addr(tmp_pool, "127.0.0.1", NULL);
+  pr_netaddr_set_port2(addr, port);
+
+  /* Start the workers, and wait until they are all listening. */
+  worker_pids = pcalloc(tmp_pool, worker_count * sizeof(pid_t));
+  for (i = 0; i < worker_count; i++) {
+    pid_t pid;
+
+    pid = fork();
+    if (pid < 0) {
+      xerrno = errno;
+      fprintf(stderr, "Error forking worker #%u: %s\n", i, strerror(xerrno));
+      res = -1;
+      break;
+    }
+
+    if (pid == 0) {
+      (void) close(ready_fds[0]);
+      run_worker(tmp_pool, registry, addr, scraper_count, ready_fds[1]);
+    }
+
+    worker_pids[nworkers++] = pid;
+  }
+
+  (void) close(ready_fds[1]);
+
+  for (i = 0; i < nworkers; i++) {
+    char buf[1];
+
+    if (read(ready_fds[0], buf, sizeof(buf)) != 1) {
+      fprintf(stderr, "Error starting exporter workers\n");
+      xerrno = EPERM;
+      res = -1;
+      break;
+    }
+  }
+
+  (void) close(ready_fds[0]);
+
+  writer_pid = fork();
+  if (writer_pid == 0) {
+    run_writer(tmp_pool, registry);
+  }
+
+  if (res == 0 &&
+      pipe(start_fds) == 0) {
+    for (i = 0; i < scraper_count; i++) {
+      pid_t pid;
+
+      pid = fork();
+      if (pid < 0) {
+        xerrno = errno;
+        fprintf(stderr, "Error forking scraper #%u: %s\n", i,
+          strerror(xerrno));
+        res = -1;
+        break;
+      }
+
+      if (pid == 0) {
+        (void) close(start_fds[1]);
+        run_scraper(port, start_fds[0], &(results[i]));
+      }
+
+      nscrapers++;
+    }
+
+    (void) close(start_fds[0]);
+
+    /* Start the scrapers, then wait until they are all done. */
+    start_ns = bench_now_ns();
+    (void) close(start_fds[1]);
+
+    while (nscrapers > 0) {
+      int status;
+
+      if (waitpid(-1, &status, 0) < 0) {
+        break;
+      }
+
+      nscrapers--;
+    }
+
+    elapsed_ns = bench_now_ns() - start_ns;
+
+    scrape_stats = bench_stats_create(tmp_pool,
+      scraper_count * BENCH_SCRAPE_MAX_LATENCIES);
+    throughput_stats = bench_stats_create(tmp_pool, 0);
+
+    for (i = 0; i < scraper_count; i++) {
+      register unsigned int j;
+
+      for (j = 0; j < results[i].nlatencies; j++) {
+        bench_stats_add(scrape_stats, results[i].latencies[j]);
+      }
+
+      bench_stats_add_batch(throughput_stats, results[i].nlatencies, 0);
+      bench_stats_add_count(scrape_stats, "failed", results[i].failed);
+      bench_stats_add_count(throughput_stats, "bytes", results[i].bytes);
+    }
+
+    /* The scrape latencies, and the throughput of all of the workers. */
+    snprintf(name, sizeof(name)-1, "scrape.workers_%u", worker_count);
+    bench_report("scrape", name, scrape_stats);
+
+    bench_stats_add_batch(throughput_stats, 0, elapsed_ns);
+    snprintf(name, sizeof(name)-1, "throughput.workers_%u", worker_count);
+    bench_report("scrape", name, throughput_stats);
+  }
+
+  if (writer_pid > 0) {
+    stop_procs(&writer_pid, 1);
+  }
+
+  stop_procs(worker_pids, nworkers);
+
+  (void) munmap(results, results_len);
+  (void) prom_registry_free(registry);
+  destroy_pool(tmp_pool);
+  (void) tests_rmpath(p, bench_dir);
+
+  errno = xerrno;
+  return res;
+}
+
+int bench_run_scrape(pool *p) {
+  int res = 0;
+  unsigned int worker_count, max_workers = BENCH_SCRAPE_MAX_WORKERS;
+  unsigned int scraper_count = BENCH_SCRAPE_SCRAPERS;
+  unsigned int port = BENCH_SCRAPE_PORT;
+  const char *text;
+
+  /* The largest runs can be capped, e.g. on smaller machines; the scaling is
+   * best measured with at least as many cores as workers.
+   */
+  text = getenv("PROMETHEUS_BENCH_MAX_WORKERS");
+  if (text != NULL) {
+    max_workers = (unsigned int) strtoul(text, NULL, 10);
+  }
+
+  text = getenv("PROMETHEUS_BENCH_SCRAPERS");
+  if (text != NULL) {
+    scraper_count = (unsigned int) strtoul(text, NULL, 10);
+  }
+
+  text = getenv("PROMETHEUS_BENCH_PORT");
+  if (text != NULL) {
+    port = (unsigned int) strtoul(text, NULL, 10);
+  }
+
+  prom_db_init(p);
+  prom_http_init(p);
+
+  for (worker_count = 1; res == 0 && worker_count <= max_workers;
+       worker_count *= 2) {
+    res = bench_workers(p, worker_count, scraper_count, port);
+  }
+
+  prom_http_free();
+  prom_db_free();
+  return res;
+}
@@ -0,0 +1,172 @@
+/*
+ * ProFTPD - mod_prometheus API benchmarks
+ * Copyright (c) 2021 TJ Saunders
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+/* Text API benchmarks. */
+
+#include "bench.h"
+#include "prometheus/text.h"
+
+#define BENCH_TEXT_VALUE_COUNT		100000
+#define BENCH_TEXT_ROUNDS		10
+#define BENCH_TEXT_LABELS_COUNT		100000
+
+/* The sample values: integral counts, as most counters and gauges have;
+ * durations/sizes with a few decimal places, as histogram sums have; and
+ * arbitrary doubles.
+ */
+static double *get_values(pool *p, const char *kind) {
+  register unsigned int i;
+  double *vals;
+  uint64_t bits = 88172645463325252ULL;
+
+  vals = palloc(p, BENCH_TEXT_VALUE_COUNT * sizeof(double));
+
+  for (i = 0; i < BENCH_TEXT_VALUE_COUNT; i++) {
+    bits ^= bits << 13;
+    bits ^= bits >> 7;
+    bits ^= bits << 17;
+
+    if (strcmp(kind, "integral") == 0) {
+      vals[i] = (double) (bits % 100000000);
+
+    } else if (strcmp(kind, "decimal") == 0) {
+      vals[i] = (double) (bits % 100000000) / 1000.0;
+
+    } else {
+      vals[i] = (double) bits / (double) (bits % 1000 + 1);
+    }
+  }
+
+  return vals;
+}
+
+/* The formatting used before prom_text_add_double(). */
+static void add_snprintf_value(struct prom_text *text, double val) {
+  char sample_text[50];
+  int sample_textlen;
+
+  memset(sample_text, '\0', sizeof(sample_text));
+  sample_textlen = snprintf(sample_text, sizeof(sample_text)-1, "%0.17g",
+    val);
+  prom_text_add_str(text, sample_text, sample_textlen);
+}
+
+static void bench_values(pool *p, const char *kind, int use_snprintf) {
+  register unsigned int i, j;
+  pool *tmp_pool;
+  double *vals;
+  struct bench_stats *stats;
+  char name[64];
+
+  tmp_pool = make_sub_pool(p);
+  vals = get_values(tmp_pool, kind);
+  stats = bench_stats_create(tmp_pool, 0);
+
+  for (i = 0; i < BENCH_TEXT_ROUNDS; i++) {
+    struct prom_text *text;
+    uint64_t start_ns;
+
+    text = prom_text_create(tmp_pool);
+
+    start_ns = bench_now_ns();
+    for (j = 0; j < BENCH_TEXT_VALUE_COUNT; j++) {
+      if (use_snprintf == TRUE) {
+        add_snprintf_value(text, vals[j]);
+
+      } else {
+        prom_text_add_double(text, vals[j]);
+      }
+
+      prom_text_add_byte(text, '\n');
+    }
+    bench_stats_add_batch(stats, BENCH_TEXT_VALUE_COUNT,
+      bench_now_ns() - start_ns);
+
+    prom_text_destroy(text);
+  }
+
+  snprintf(name, sizeof(name)-1, "add_%s.%s",
+    use_snprintf == TRUE ? "snprintf" : "double", kind);
+  bench_report("text", name, stats);
+
+  destroy_pool(tmp_pool);
+}
+
+static void bench_from_labels(pool *p, unsigned int label_count) {
+  register unsigned int i;
+  pool *tmp_pool;
+  pr_table_t *labels;
+  struct bench_stats *stats;
+  char name[64];
+
+  tmp_pool = make_sub_pool(p);
+  stats = bench_stats_create(tmp_pool, BENCH_TEXT_LABELS_COUNT);
+
+  labels = pr_table_nalloc(tmp_pool, 0, label_count);
+  for (i = 0; i < label_count; i++) {
+    char key[32], val[32];
+
+    snprintf(key, sizeof(key)-1, "label%u", label_count - i);
+    snprintf(val, sizeof(val)-1, "value%u", i);
+    (void) pr_table_add_dup(labels, pstrdup(tmp_pool, key), val, 0);
+  }
+
+  for (i = 0; i < BENCH_TEXT_LABELS_COUNT; i++) {
+    pool *iter_pool;
+    struct prom_text *text;
+    uint64_t start_ns;
+
+    iter_pool = make_sub_pool(tmp_pool);
+
+    start_ns = bench_now_ns();
+    text = prom_text_create(iter_pool);
+    (void) prom_text_from_labels(iter_pool, text, labels);
+    prom_text_destroy(text);
+    bench_stats_add(stats, bench_now_ns() - start_ns);
+
+    destroy_pool(iter_pool);
+  }
+
+  snprintf(name, sizeof(name)-1, "from_labels.labels_%u", label_count);
+  bench_report("text", name, stats);
+
+  destroy_pool(tmp_pool);
+}
+
+int bench_run_text(pool *p) {
+  register unsigned int i;
+  const char *kinds[] = { "integral", "decimal", "arbitrary", NULL };
+  unsigned int label_counts[] = { 1, 4, 8, 0 };
+
+  for (i = 0; kinds[i] != NULL; i++) {
+    bench_values(p, kinds[i], TRUE);
+    bench_values(p, kinds[i], FALSE);
+  }
+
+  for (i = 0; label_counts[i] != 0; i++) {
+    bench_from_labels(p, label_counts[i]);
+  }
+
+  return 0;
+}